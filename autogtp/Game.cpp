@@ -23,6 +23,9 @@
 #include <QRegularExpression>
 #include "Game.h"
 
+// How often a wait for the engine checks for a cancel.
+constexpr int CANCEL_POLL_MSEC = 100;
+
 Game::Game(const QString& weights, const QString& opt, const QString& binary) :
     QProcess(),
     m_cmdLine(""),
@@ -32,7 +35,9 @@ Game::Game(const QString& weights, const QString& opt, const QString& binary) :
     m_blackToMove(true),
     m_blackResigned(false),
     m_passes(0),
-    m_moveNum(0)
+    m_moveNum(0),
+    m_gamesPlayed(0),
+    m_cancel(nullptr)
 {
 #ifdef WIN32
     m_binary.append(".exe");
@@ -176,11 +181,34 @@ bool Game::gameStart(const VersionTuple &min_version) {
     // check any return values.
     checkVersion(min_version);
     QTextStream(stdout) << "Engine has started." << endl;
+    m_gamesPlayed = 1;
     sendGtpCommand(m_timeSettings);
     QTextStream(stdout) << "Infinite thinking time set." << endl;
     return true;
 }
 
+bool Game::gameReset() {
+    // The seed and the cache of the previous game would make this one
+    // play like it.
+    if (!sendGtpCommand("clear_board")
+        || !sendGtpCommand("lz-clearcache")
+        || !sendGtpCommand("lz-seed")) {
+        return false;
+    }
+    m_winner.clear();
+    m_moveDone.clear();
+    m_result.clear();
+    m_resignation = false;
+    m_blackToMove = true;
+    m_blackResigned = false;
+    m_passes = 0;
+    m_moveNum = 0;
+    m_fileName = QUuid::createUuid().toRfc4122().toHex();
+    m_gamesPlayed++;
+    QTextStream(stdout) << "Engine is ready for a new game." << endl;
+    return true;
+}
+
 void Game::move() {
     m_moveNum++;
     QString moveCmd;
@@ -200,7 +228,14 @@ void Game::setMovesCount(int moves) {
 
 bool Game::waitReady() {
     while (!canReadLine() && state() == QProcess::Running) {
-        waitForReadyRead(-1);
+        if (m_cancel == nullptr) {
+            waitForReadyRead(-1);
+            continue;
+        }
+        if (m_cancel->load() != 0) {
+            return false;
+        }
+        waitForReadyRead(CANCEL_POLL_MSEC);
     }
     // somebody crashed
     if (state() != QProcess::Running) {
@@ -408,3 +443,13 @@ void Game::gameQuit() {
     write(qPrintable("quit\n"));
     waitForFinished(-1);
 }
+
+void Game::gameKill() {
+    kill();
+    waitForFinished(-1);
+}
+
+bool Game::setSideNetworks(int blackIndex, int whiteIndex) {
+    return sendGtpCommand("lz-setnet black " + QString::number(blackIndex))
+        && sendGtpCommand("lz-setnet white " + QString::number(whiteIndex));
+}
@@ -20,6 +20,7 @@
 #ifndef GAME_H
 #define GAME_H
 
+#include <QAtomicInt>
 #include <QProcess>
 #include <tuple>
 
@@ -34,6 +35,9 @@ public:
          const QString& binary = QString("./leelaz"));
     ~Game() = default;
     bool gameStart(const VersionTuple& min_version);
+    // Get the running engine ready for another game, false if it can't.
+    bool gameReset();
+    int getGamesPlayed() const { return m_gamesPlayed; }
     void move();
     bool waitForMove() { return waitReady(); }
     bool readMove();
@@ -50,6 +54,14 @@ public:
     QString getCmdLine() const { return m_cmdLine; }
     bool dumpDebug();
     void gameQuit();
+    // Stop the engine at once, e.g. in the middle of a move.
+    void gameKill();
+    // The waits for the engine give up once the flag, set by another
+    // thread, is nonzero. The engine has to be killed after that.
+    void setCancel(const QAtomicInt *cancel) { m_cancel = cancel; }
+    // The networks of the engine, loaded with several -w, that play
+    // the two colors.
+    bool setSideNetworks(int blackIndex, int whiteIndex);
     QString getMove() const { return m_moveDone; }
     QString getFile() const { return m_fileName; }
     bool setMove(const QString& m);
@@ -84,6 +96,8 @@ private:
     bool m_blackResigned;
     int m_passes;
     int m_moveNum;
+    int m_gamesPlayed;
+    const QAtomicInt *m_cancel;
     bool sendGtpCommand(QString cmd);
     void checkVersion(const VersionTuple &min_version);
     bool waitReady();
@@ -35,7 +35,12 @@ Job::Job(QString gpu, Management *parent) :
 }
 
 void Job::init(const Order &o) {
-    m_option = " " + o.parameters()["options"] + m_gpu + " -g -q -w ";
+    m_option = " " + o.parameters()["options"] + m_gpu;
+#ifndef WIN32
+    // The games of all workers start from the same positions.
+    m_option += " --shared-cache " + Management::sharedCacheName();
+#endif
+    m_option += " -g -q -w ";
     QStringList version_list = o.parameters()["leelazVer"].split(".");
     if (version_list.size() < 2) {
         QTextStream(stdout)
@@ -51,6 +56,40 @@ void Job::init(const Order &o) {
 
 }
 
+bool Job::runs(int index, const QString& network) const {
+    const Game probe("networks/" + network, m_option);
+    return m_engines[index]
+        && m_engines[index]->getCmdLine() == probe.getCmdLine();
+}
+
+Game *Job::getEngine(int index, const QString& network) {
+    auto &engine = m_engines[index];
+    if (runs(index, network)
+        && engine->getGamesPlayed() < MAX_ENGINE_GAMES
+        && engine->gameReset()) {
+        return engine.get();
+    }
+    if (engine) {
+        QTextStream(stdout) << "Restarting the engine." << endl;
+        engine->gameQuit();
+    }
+    engine = std::make_unique<Game>("networks/" + network, m_option);
+    if (!engine->gameStart(m_leelazMinVersion)) {
+        engine.reset();
+        return nullptr;
+    }
+    return engine.get();
+}
+
+void Job::quitEngines() {
+    for (auto &engine : m_engines) {
+        if (engine) {
+            engine->gameQuit();
+            engine.reset();
+        }
+    }
+}
+
 ProductionJob::ProductionJob(QString gpu, Management *parent) :
 Job(gpu, parent)
 {
@@ -68,10 +107,11 @@ Job(gpu, parent)
 
 Result ProductionJob::execute(){
     Result res(Result::Error);
-    Game game("networks/" + m_network, m_option);
-    if (!game.gameStart(m_leelazMinVersion)) {
+    Game *engine = getEngine(0, m_network);
+    if (engine == nullptr) {
         return res;
     }
+    Game &game = *engine;
     if (!m_sgf.isEmpty()) {
         if (m_restore) {
             game.loadSgf(m_sgf);
@@ -126,7 +166,6 @@ Result ProductionJob::execute(){
     default:
         break;
     }
-    game.gameQuit();
     return res;
 }
 
@@ -141,19 +180,25 @@ void ProductionJob::init(const Order &o) {
 
 Result ValidationJob::execute(){
     Result res(Result::Error);
-    Game first("networks/" + m_firstNet,  m_option);
-    if (!first.gameStart(m_leelazMinVersion)) {
+    // The networks swap colors between the games of a match.
+    if (!runs(0, m_firstNet) && runs(1, m_firstNet)) {
+        std::swap(m_engines[0], m_engines[1]);
+    }
+    Game *firstEngine = getEngine(0, m_firstNet);
+    if (firstEngine == nullptr) {
         return res;
     }
+    Game &first = *firstEngine;
     if (!m_sgfFirst.isEmpty()) {
         first.loadSgf(m_sgfFirst);
         first.setMovesCount(m_moves);
         QFile::remove(m_sgfFirst + ".sgf");
     }
-    Game second("networks/" + m_secondNet, m_option);
-    if (!second.gameStart(m_leelazMinVersion)) {
+    Game *secondEngine = getEngine(1, m_secondNet);
+    if (secondEngine == nullptr) {
         return res;
     }
+    Game &second = *secondEngine;
     if (!m_sgfSecond.isEmpty()) {
         second.loadSgf(m_sgfSecond);
         second.setMovesCount(m_moves);
@@ -208,8 +253,6 @@ Result ValidationJob::execute(){
     default:
         break;
     }
-    first.gameQuit();
-    second.gameQuit();
     return res;
 }
 
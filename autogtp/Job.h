@@ -22,9 +22,12 @@
 
 #include "Result.h"
 #include "Order.h"
+#include "Game.h"
 #include <QObject>
 #include <QAtomicInt>
 #include <QTextStream>
+#include <array>
+#include <memory>
 class Management;
 using VersionTuple = std::tuple<int, int, int>;
 
@@ -41,15 +44,27 @@ public:
         Validation
     };
     Job(QString gpu, Management *parent);
-    ~Job() = default;
+    ~Job() { quitEngines(); }
     virtual Result execute() = 0;
     virtual void init(const Order &o);
     void finish() { m_state.store(FINISHING); }
     void store() {
         m_state.store(STORING);
     }
+    void quitEngines();
 
 protected:
+    // The engines stay up between the games of a job, so that the games
+    // don't wait for the network to load. An engine is restarted for
+    // another network or other options, and after this many games.
+    static constexpr int MAX_ENGINE_GAMES = 100;
+    // The engine in that slot, ready for a new game of the network, or
+    // nullptr if it can't be started.
+    Game *getEngine(int index, const QString& network);
+    // Whether the engine in that slot plays the network.
+    bool runs(int index, const QString& network) const;
+    std::array<std::unique_ptr<Game>, 2> m_engines;
+
     QAtomicInt m_state;
     QString m_option;
     QString m_gpu;
@@ -17,39 +17,74 @@
     along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <cmath>
 #include <random>
+#include <QCoreApplication>
 #include <QDir>
+#include <QElapsedTimer>
 #include <QThread>
 #include <QList>
 #include <QCryptographicHash>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QLockFile>
+#include <QMutexLocker>
 #include <QUuid>
 #include <QRegularExpression>
+#include <QSaveFile>
+#include <QSet>
+#include <QSettings>
+#include <QTemporaryDir>
 #include "Management.h"
 #include "Game.h"
+#ifndef WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 constexpr int RETRY_DELAY_MIN_SEC = 30;
 constexpr int RETRY_DELAY_MAX_SEC = 60 * 60;  // 1 hour
 constexpr int MAX_RETRIES = 3;           // Stop retrying after 3 times
 
+// The -a games of every GPU and network size, kept between runs.
+const QString SCALING_FILE = "autogtp.ini";
+constexpr int MAX_GAMES_PER_GPU = 16;
+constexpr int MEASURED_GAMES_PER_WORKER = 4;
+constexpr double MIN_SCALING_GAIN = 1.05;  // Another step needs 5% more moves/s
+// How often the saved uploads are retried and the server is asked for
+// the networks coming up, while there is nothing to upload.
+constexpr int TRANSFER_POLL_MIN = 10;
+// The finished games wait in a journal in the spool directory until
+// they are uploaded, up to this many with one curl.
+const QString SPOOL_DIR = "spool";
+constexpr int UPLOAD_BATCH = 16;
+
 const QString Leelaz_min_version = "0.12";
 
+// The SGEMM tunings of leelaz, shared with the other hosts by
+// --tuning-cache.
+const QString TUNING_FILE = "leelaz_opencl_tuning";
+
 Management::Management(const int gpus,
                        const int games,
                        const QStringList& gpuslist,
                        const int ver,
                        const int maxGames,
                        const bool delNetworks,
+                       const bool autoGames,
                        const QString& keep,
                        const QString& debug,
                        const QString& serverUrl,
-                       const QString& publicAuthKey)
+                       const QString& publicAuthKey,
+                       const QString& tuningCache)
 
     : m_syncMutex(),
-    m_gamesThreads(gpus * games),
+    m_gamesThreads(),
+    m_workerGpus(),
+    m_scaling(gpus),
+    m_autoGames(autoGames),
+    m_storing(false),
     m_games(games),
     m_gpus(gpus),
     m_gpusList(gpuslist),
@@ -60,13 +95,17 @@ Management::Management(const int gpus,
     m_debugPath(debug),
     m_serverUrl(serverUrl),
     m_publicAuthKey(publicAuthKey),
+    m_tuningCache(tuningCache),
     m_version(ver),
     m_fallBack(Order::Error),
     m_lastMatch(Order::Error),
     m_gamesLeft(maxGames),
     m_threadsLeft(gpus * games),
     m_delNetworks(delNetworks),
-    m_lockFile(nullptr) {
+    m_lockFile(nullptr),
+    m_transfers(this),
+    m_uploadsDone(false),
+    m_journalLock(nullptr) {
 }
 
 void Management::runTuningProcess(const QString &tuneCmdLine) {
@@ -81,6 +120,137 @@ void Management::runTuningProcess(const QString &tuneCmdLine) {
     tuneProcess.waitForFinished(-1);
 }
 
+// The lines of leelaz are version;kernel;m;n;k;batch_size;tuners;device
+// and all but the tuners say which tuning it is.
+static QString tuningKey(const QString &line) {
+    QStringList fields = line.split(';');
+    if (fields.size() != 8) {
+        return QString();
+    }
+    fields.removeAt(6);
+    return fields.join(';');
+}
+
+static QStringList readTuning(const QString &fileName) {
+    QFile f(fileName);
+    if (!f.open(QFile::ReadOnly | QFile::Text)) {
+        return QStringList();
+    }
+    return QString(f.readAll()).split('\n', QString::SkipEmptyParts);
+}
+
+// The lines of extra with tunings that base doesn't have.
+static QStringList newTuning(const QStringList &base, const QStringList &extra) {
+    QSet<QString> keys;
+    for (const QString &line : base) {
+        keys.insert(tuningKey(line));
+    }
+    QStringList lines;
+    for (const QString &line : extra) {
+        const QString key = tuningKey(line);
+        if (!key.isEmpty() && !keys.contains(key)) {
+            keys.insert(key);
+            lines.append(line);
+        }
+    }
+    return lines;
+}
+
+static bool writeTuning(const QString &fileName, const QStringList &lines) {
+    // leelaz reads the old or the new file, never half of it.
+    QSaveFile f(fileName);
+    if (!f.open(QFile::WriteOnly | QFile::Text)) {
+        return false;
+    }
+    QTextStream out(&f);
+    for (const QString &line : lines) {
+        out << line << "\n";
+    }
+    out.flush();
+    return f.commit();
+}
+
+static bool isUrl(const QString &location) {
+    return location.startsWith("http://") || location.startsWith("https://");
+}
+
+void Management::fetchTuning() {
+    QStringList shared;
+    if (isUrl(m_tuningCache)) {
+        QString prog_cmdline("curl");
+#ifdef WIN32
+        prog_cmdline.append(".exe");
+#endif
+        prog_cmdline.append(" -s -f " + m_tuningCache);
+        QProcess curl;
+        curl.start(prog_cmdline);
+        curl.waitForFinished(-1);
+        if (curl.exitCode()) {
+            QTextStream(stdout) << "Could not fetch the shared tunings, curl "
+                                << "returned " << curl.exitCode() << endl;
+            return;
+        }
+        shared = QString(curl.readAllStandardOutput())
+                     .split('\n', QString::SkipEmptyParts);
+    } else {
+        shared = readTuning(m_tuningCache + '/' + TUNING_FILE);
+    }
+    m_sharedTuning = shared;
+
+    // The tunings of this host stay, whatever the others found.
+    const QStringList local = readTuning(TUNING_FILE);
+    const QStringList added = newTuning(local, shared);
+    if (added.isEmpty()) {
+        return;
+    }
+    if (writeTuning(TUNING_FILE, local + added)) {
+        QTextStream(stdout) << "Got " << added.size() << " tunings from "
+                            << m_tuningCache << endl;
+    }
+}
+
+void Management::publishTuning() {
+    const QStringList added = newTuning(m_sharedTuning,
+                                        readTuning(TUNING_FILE));
+    if (added.isEmpty()) {
+        return;
+    }
+    if (isUrl(m_tuningCache)) {
+        // Only the new lines go to the server, which merges them.
+        const QString fileName = TUNING_FILE + ".new";
+        if (!writeTuning(fileName, added)) {
+            return;
+        }
+        QString prog_cmdline("curl");
+#ifdef WIN32
+        prog_cmdline.append(".exe");
+#endif
+        prog_cmdline.append(" -s -f -F tuning=@" + fileName + " "
+                            + m_tuningCache);
+        QProcess curl;
+        curl.start(prog_cmdline);
+        curl.waitForFinished(-1);
+        QFile::remove(fileName);
+        if (curl.exitCode()) {
+            QTextStream(stdout) << "Could not publish the tunings, curl "
+                                << "returned " << curl.exitCode() << endl;
+            return;
+        }
+    } else {
+        // Other hosts may publish at the same time.
+        const QString fileName = m_tuningCache + '/' + TUNING_FILE;
+        QLockFile lock(fileName + ".lock");
+        lock.lock();
+        const QStringList shared = readTuning(fileName);
+        if (!writeTuning(fileName, shared + newTuning(shared, added))) {
+            QTextStream(stdout) << "Could not write " << fileName << endl;
+            return;
+        }
+    }
+    QTextStream(stdout) << "Published " << added.size() << " tunings to "
+                        << m_tuningCache << endl;
+}
+
 Order Management::getWork(const QFileInfo &file) {
     QTextStream(stdout) << "Got previously stored file" <<endl;
     Order o;
@@ -93,7 +263,9 @@ Order Management::getWork(const QFileInfo &file) {
 }
 
 void Management::giveAssignments() {
-    sendAllGames();
+    // This sends the games left by previous runs first.
+    openJournal();
+    m_transfers.start();
 
     //Make the OpenCl tuning before starting the threads
     QTextStream(stdout) << "Starting tuning process, please wait..." << endl;
@@ -101,6 +273,10 @@ void Management::giveAssignments() {
     Order tuneOrder = getWork(true);
     QString tuneCmdLine("./leelaz --tune-only -w networks/");
     tuneCmdLine.append(tuneOrder.parameters()["network"]);
+    // leelaz only tunes what it doesn't find in the file.
+    if (!m_tuningCache.isEmpty()) {
+        fetchTuning();
+    }
     if (m_gpusList.isEmpty()) {
         runTuningProcess(tuneCmdLine);
     } else {
@@ -108,47 +284,189 @@ void Management::giveAssignments() {
             runTuningProcess(tuneCmdLine + " --gpu=" + m_gpusList.at(i));
         }
     }
+    if (!m_tuningCache.isEmpty()) {
+        publishTuning();
+    }
     QTextStream(stdout) << "Tuning process finished" << endl;
 
     m_start = std::chrono::high_resolution_clock::now();
+    m_syncMutex.lock();
+    for (int gpu = 0; gpu < m_gpus; ++gpu) {
+        m_scaling[gpu] = {m_games, 0, 0, m_games, m_games, 0.0, 0, 0, 0, {}};
+    }
+    if (m_autoGames) {
+        m_scaledNet = tuneOrder.parameters()["network"];
+        m_netSize = networkSize(m_scaledNet);
+        loadScaling();
+    } else {
+        for (int gpu = 0; gpu < m_gpus; ++gpu) {
+            setGames(gpu, m_games);
+        }
+    }
+    m_syncMutex.unlock();
+}
+
+void Management::startWorker(int gpu) {
     QString myGpu;
+    if (!m_gpusList.isEmpty()) {
+        myGpu = m_gpusList.at(gpu);
+    }
+    QTextStream(stdout) << "Starting thread " << m_scaling[gpu].running + 1;
+    QTextStream(stdout) << " on GPU " << gpu << endl;
+    int thread_index = m_gamesThreads.size();
+    Worker *worker = new Worker(thread_index, myGpu, this);
+    connect(worker,
+            &Worker::resultReady,
+            this,
+            &Management::getResult,
+            Qt::DirectConnection);
+    m_gamesThreads.append(worker);
+    m_workerGpus.append(gpu);
+    m_scaling[gpu].running++;
+    QFileInfo finfo = getNextStored();
+    if (!finfo.fileName().isEmpty()) {
+        worker->order(getWork(finfo));
+    } else {
+        worker->order(getWork());
+    }
+    worker->start();
+}
+
+void Management::setGames(int gpu, int games) {
+    Scaling &s = m_scaling[gpu];
+    s.games = games;
+    s.settling = games;
+    // The extra workers stop when they finish their games.
+    while (s.running < s.games) {
+        startWorker(gpu);
+    }
+}
+
+void Management::loadScaling() {
+    QSettings settings(SCALING_FILE, QSettings::IniFormat);
     for (int gpu = 0; gpu < m_gpus; ++gpu) {
-        for (int game = 0; game < m_games; ++game) {
-            int thread_index = gpu * m_games + game;
-            if (m_gpusList.isEmpty()) {
-                myGpu = "";
-            } else {
-                myGpu = m_gpusList.at(gpu);
-            }
-            QTextStream(stdout) << "Starting thread " << game + 1 ;
-            QTextStream(stdout) << " on GPU " << gpu << endl;
-            m_gamesThreads[thread_index] = new Worker(thread_index, myGpu, this);
-            connect(m_gamesThreads[thread_index],
-                    &Worker::resultReady,
-                    this,
-                    &Management::getResult,
-                    Qt::DirectConnection);
-            QFileInfo finfo = getNextStored();
-            if (!finfo.fileName().isEmpty()) {
-                m_gamesThreads[thread_index]->order(getWork(finfo));
-            } else {
-                m_gamesThreads[thread_index]->order(getWork());
-            }
-            m_gamesThreads[thread_index]->start();
+        Scaling &s = m_scaling[gpu];
+        QString device = m_gpusList.isEmpty() ? "0" : m_gpusList.at(gpu);
+        QString key = "games/" + device + "/" + m_netSize;
+        int games = s.games;
+        s.step = 1;
+        if (settings.contains(key)) {
+            games = settings.value(key).toInt();
+            s.step = 0;
+            QTextStream(stdout) << "GPU " << gpu << ": " << games
+                << " game(s) for networks of size " << m_netSize << "." << endl;
         }
+        s.startGames = games;
+        s.bestGames = games;
+        s.bestRate = 0.0;
+        setGames(gpu, games);
     }
 }
 
+QString Management::networkSize(const QString &net) {
+    // The filters and the lines of the weights file tell apart the
+    // architectures.
+    QFile f("networks/" + net);
+    if (!f.open(QFile::ReadOnly | QFile::Text)) {
+        return "unknown";
+    }
+    QTextStream in(&f);
+    int lines = 0;
+    int filters = 0;
+    while (!in.atEnd()) {
+        QString line = in.readLine();
+        // The version, the input convolution and its biases, one for
+        // every filter.
+        if (lines == 2) {
+            filters = line.split(' ', QString::SkipEmptyParts).size();
+        }
+        lines++;
+    }
+    return QString("%1x%2").arg(filters).arg(lines);
+}
+
+bool Management::scaleGames(int index, const Order &ord, Result &res) {
+    int gpu = m_workerGpus[index];
+    Scaling &s = m_scaling[gpu];
+    if (s.running > s.games) {
+        s.running--;
+        QTextStream(stdout) << "Stopping a thread on GPU " << gpu << endl;
+        return false;
+    }
+    // Matches play at other speeds.
+    if (res.type() != Result::File || m_storing) {
+        return true;
+    }
+    QString net = ord.parameters()["network"];
+    if (net != m_scaledNet) {
+        m_scaledNet = net;
+        QString size = networkSize(net);
+        if (size != m_netSize) {
+            m_netSize = size;
+            loadScaling();
+            return true;
+        }
+    }
+    if (s.step == 0) {
+        return true;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (s.settling > 0) {
+        if (--s.settling == 0) {
+            s.start = now;
+            s.measured = 0;
+            s.moves = 0;
+        }
+        return true;
+    }
+    s.measured++;
+    s.moves += res.parameters()["moves"].toInt();
+    if (s.measured < MEASURED_GAMES_PER_WORKER * s.games) {
+        return true;
+    }
+    double rate = s.moves / std::chrono::duration<double>(now - s.start).count();
+    QTextStream(stdout) << "GPU " << gpu << ": " << s.games << " game(s) play "
+        << QString::number(rate, 'f', 1) << " moves/s." << endl;
+    int next = s.games + s.step;
+    if (rate > s.bestRate * MIN_SCALING_GAIN) {
+        s.bestRate = rate;
+        s.bestGames = s.games;
+    } else if (s.step > 0 && s.bestGames == s.startGames && s.startGames > 1) {
+        s.step = -1;
+        next = s.startGames - 1;
+    } else {
+        next = 0;
+    }
+    if (next < 1 || next > MAX_GAMES_PER_GPU) {
+        s.step = 0;
+        QString device = m_gpusList.isEmpty() ? "0" : m_gpusList.at(gpu);
+        QSettings settings(SCALING_FILE, QSettings::IniFormat);
+        settings.setValue("games/" + device + "/" + m_netSize, s.bestGames);
+        QTextStream(stdout) << "GPU " << gpu << ": settled on "
+            << s.bestGames << " game(s)." << endl;
+        next = s.bestGames;
+    }
+    setGames(gpu, next);
+    return true;
+}
+
 void Management::storeGames() {
-    for (int i = 0; i < m_gpus * m_games; ++i) {
-        m_gamesThreads[i]->doStore();
+    m_syncMutex.lock();
+    // No more workers start.
+    m_storing = true;
+    for (int i = 0; i < m_gamesThreads.size(); ++i) {
+        if (!m_gamesThreads[i]->isFinished()) {
+            m_gamesThreads[i]->doStore();
+        }
     }
+    m_syncMutex.unlock();
     wait();
+    finishTransfers();
 }
 
 void Management::wait() {
     QTextStream(stdout) << "Management: waiting for workers" << endl;
-    for (int i = 0; i < m_gpus * m_games; ++i) {
+    for (int i = 0; i < m_gamesThreads.size(); ++i) {
         m_gamesThreads[i]->wait();
         QTextStream(stdout) << "Management: Worker " << i+1 << " ended" << endl;
     }
@@ -156,6 +474,8 @@ void Management::wait() {
 
 void Management::getResult(Order ord, Result res, int index, int duration) {
     if (res.type() == Result::Error) {
+        // The games played so far still get uploaded.
+        finishTransfers();
         exit(1);
     }
     m_syncMutex.lock();
@@ -173,7 +493,6 @@ void Management::getResult(Order ord, Result res, int index, int duration) {
         printTimingInfo(duration);
         break;
     }
-    sendAllGames();
     if (m_gamesLeft == 0) {
         m_gamesThreads[index]->doFinish();
         if (m_threadsLeft > 1) {
@@ -181,6 +500,8 @@ void Management::getResult(Order ord, Result res, int index, int duration) {
         } else {
             sendQuit();
         }
+    } else if (m_autoGames && !scaleGames(index, ord, res)) {
+        m_gamesThreads[index]->doFinish();
     } else {
         if (m_gamesLeft > 0) --m_gamesLeft;
         QFileInfo finfo = getNextStored();
@@ -273,6 +594,36 @@ QString Management::getOptionsString(const QJsonObject &opt, const QString &rnd)
     return options;
 }
 
+QJsonDocument Management::getTask(bool tuning) {
+    QString prog_cmdline("curl");
+#ifdef WIN32
+    prog_cmdline.append(".exe");
+#endif
+    prog_cmdline.append(" -s -J");
+    prog_cmdline.append(" "+m_serverUrl+"get-task/");
+    if (tuning) {
+        prog_cmdline.append("0");
+    } else {
+        prog_cmdline.append(QString::number(AUTOGTP_VERSION));
+    }
+    QProcess curl;
+    curl.start(prog_cmdline);
+    curl.waitForFinished(-1);
+
+    if (curl.exitCode()) {
+        throw NetworkException("Curl returned non-zero exit code "
+                               + std::to_string(curl.exitCode()));
+    }
+    QJsonDocument doc;
+    QJsonParseError parseError;
+    doc = QJsonDocument::fromJson(curl.readAllStandardOutput(), &parseError);
+    if (parseError.error != QJsonParseError::NoError) {
+        std::string errorString = parseError.errorString().toUtf8().constData();
+        throw NetworkException("JSON parse error: " + errorString);
+    }
+    return doc;
+}
+
 Order Management::getWorkInternal(bool tuning) {
     Order o(Order::Error);
 
@@ -315,34 +666,7 @@ Order Management::getWorkInternal(bool tuning) {
 }
 
     */
-    QString prog_cmdline("curl");
-#ifdef WIN32
-    prog_cmdline.append(".exe");
-#endif
-    prog_cmdline.append(" -s -J");
-    prog_cmdline.append(" "+m_serverUrl+"get-task/");
-    if (tuning) {
-        prog_cmdline.append("0");
-    } else {
-        prog_cmdline.append(QString::number(AUTOGTP_VERSION));
-    }
-    QProcess curl;
-    curl.start(prog_cmdline);
-    curl.waitForFinished(-1);
-
-    if (curl.exitCode()) {
-        throw NetworkException("Curl returned non-zero exit code "
-                               + std::to_string(curl.exitCode()));
-        return o;
-    }
-    QJsonDocument doc;
-    QJsonParseError parseError;
-    doc = QJsonDocument::fromJson(curl.readAllStandardOutput(), &parseError);
-    if (parseError.error != QJsonParseError::NoError) {
-        std::string errorString = parseError.errorString().toUtf8().constData();
-        throw NetworkException("JSON parse error: " + errorString);
-    }
-
+    QJsonDocument doc = getTask(tuning);
     if (!tuning) {
         QTextStream(stdout) << doc.toJson() << endl;
     }
@@ -511,59 +835,91 @@ bool Management::networkExists(const QString &name) {
 }
 
 void Management::fetchNetwork(const QString &net) {
+    // The workers and the prefetch may want the same network.
+    QMutexLocker lock(&m_fetchMutex);
     QString name = "networks/" + net;
     if (networkExists(name)) {
         return;
     }
-    if (QFileInfo::exists(name + ".gz")) {
-        QFile f_gz(name + ".gz");
-        // Curl refuses to overwrite, so make sure to delete the gzipped
-        // network if it exists
-        f_gz.remove();
-    }
 
     QString prog_cmdline("curl");
+    QString gunzip_cmdline("gzip");
 #ifdef WIN32
     prog_cmdline.append(".exe");
+    gunzip_cmdline.append(".exe");
 #endif
-    // Be quiet, but output the real file name we saved.
-    // Use the filename from the server.
-    prog_cmdline.append(" -s -J -o " + name + ".gz ");
-    prog_cmdline.append(" -w %{filename_effective}");
-    prog_cmdline.append(" "+m_serverUrl + name + ".gz");
-
+    prog_cmdline.append(" -s -f " + m_serverUrl + name + ".gz");
+    gunzip_cmdline.append(" -d -c");
+
+    // The network goes from curl through gunzip into the file and the
+    // hash, and only gets its name once the hash is right.
+    QFile part(name + ".part");
+    if (!part.open(QFile::WriteOnly | QFile::Truncate)) {
+        throw NetworkException("Unable to write the network file."
+                               " Check permissions.");
+    }
+    QCryptographicHash hash(QCryptographicHash::Sha256);
     QProcess curl;
+    QProcess gunzip;
+    curl.setStandardOutputProcess(&gunzip);
     curl.start(prog_cmdline);
+    gunzip.start(gunzip_cmdline);
+    while (gunzip.waitForReadyRead(-1) || gunzip.bytesAvailable() > 0) {
+        QByteArray data = gunzip.readAllStandardOutput();
+        hash.addData(data);
+        part.write(data);
+    }
     curl.waitForFinished(-1);
+    gunzip.waitForFinished(-1);
+    QByteArray data = gunzip.readAllStandardOutput();
+    hash.addData(data);
+    part.write(data);
+    part.close();
 
     if (curl.exitCode()) {
+        part.remove();
         throw NetworkException("Curl returned non-zero exit code "
                                + std::to_string(curl.exitCode()));
     }
-
-    QByteArray output = curl.readAllStandardOutput();
-    QString outstr(output);
-    QStringList outlst = outstr.split("\n");
-    QString outfile = outlst[0];
-#ifdef WIN32
-    QProcess::execute("gzip.exe -d -q " + outfile);
-#else
-    QProcess::execute("gunzip -q " + outfile);
-#endif
-    // Remove extension (.gz)
-    outfile.chop(3);
-    QTextStream(stdout) << "Net filename: " << outfile << endl;
-
-    if (!networkExists(name)) {
-        //If gunzip failed remove the .gz file
-        QFile f_gz(name + ".gz");
-        f_gz.remove();
+    if (gunzip.exitCode() || QString(hash.result().toHex()) != net) {
+        part.remove();
         throw NetworkException("Failed to fetch the network");
     }
+    QFile::remove(name);
+    if (!part.rename(name)) {
+        part.remove();
+        throw NetworkException("Unable to rename the network file."
+                               " Check permissions.");
+    }
+    QTextStream(stdout) << "Net filename: " << name << endl;
 
+#ifndef WIN32
+    // Nothing in the shared cache can be hit by the new network. The
+    // running engines keep their mapping, new ones start an empty one.
+    shm_unlink(sharedCacheName().toLocal8Bit().constData());
+#endif
     return;
 }
 
+void Management::prefetchNetworks() {
+    try {
+        QJsonObject ob = getTask(false).object();
+        for (const QString &key : QStringList{"hash", "black_hash", "white_hash"}) {
+            if (ob.contains(key)) {
+                fetchNetwork(ob.value(key).toString());
+            }
+        }
+    } catch (NetworkException ex) {
+        QTextStream(stdout) << "Prefetching networks failed." << endl;
+        QTextStream(stdout) << ex.what() << endl;
+    }
+}
+
+QString Management::sharedCacheName() {
+    return "/leelaz-nncache-"
+        + QString::number(QCoreApplication::applicationPid());
+}
+
 QString Management::fetchGameData(const QString &name, const QString &extension) {
     QString prog_cmdline("curl");
 #ifdef WIN32
@@ -625,106 +981,6 @@ void Management::gzipFile(const QString &fileName) {
     QProcess::execute(gzipCmd);
 }
 
-void Management::saveCurlCmdLine(const QStringList &prog_cmdline, const QString &name) {
-    QString fileName = "curl_save" + QUuid::createUuid().toRfc4122().toHex() + ".bin";
-    QLockFile lf(fileName + ".lock");
-    lf.lock();
-    QFile f(fileName);
-    if (!f.open(QIODevice::WriteOnly | QIODevice::Text)) {
-        return;
-    }
-    QTextStream out(&f);
-    out << name << endl;
-    out << prog_cmdline.size() << endl;
-    QStringList::ConstIterator it = prog_cmdline.constBegin();
-    while (it != prog_cmdline.constEnd()) {
-        out << *it << " " << endl;
-        ++it;
-    }
-    f.close();
-}
-
-void Management::sendAllGames() {
-    QDir dir;
-    QStringList filters;
-    filters << "curl_save*.bin";
-    dir.setNameFilters(filters);
-    dir.setFilter(QDir::Files | QDir::NoSymLinks);
-    QFileInfoList list = dir.entryInfoList();
-    for (int i = 0; i < list.size(); ++i) {
-        QFileInfo fileInfo = list.at(i);
-        QLockFile lf(fileInfo.fileName()+".lock");
-        if (!lf.tryLock(10)) {
-            continue;
-        }
-        QFile file(fileInfo.fileName());
-        if (!file.open(QFile::ReadOnly)) {
-            continue;
-        }
-        QTextStream in(&file);
-        QString name;
-        QString tmp;
-        QStringList lines;
-        int count;
-        in >> name;
-        in >> count;
-        count = 2 * count - 1;
-        for (int i = 0; i < count; i++) {
-            in >> tmp;
-            lines << tmp;
-        }
-        file.close();
-        bool sent = false;
-
-        try {
-            sent = sendCurl(lines);
-            if (sent) {
-                QTextStream(stdout) << "File: " << file.fileName() << " sent" << endl;
-                file.remove();
-                cleanupFiles(name);
-                if (i+1 < list.size()) {
-                    QThread::sleep(10);
-                }
-            }
-        } catch (NetworkException ex) {
-            QTextStream(stdout)
-                << "Network connection to server failed." << endl;
-            QTextStream(stdout)
-                << ex.what() << endl;
-            QTextStream(stdout)
-                    << "Retrying when next game is finished."
-                    << endl;
-        }
-    }
-}
-
-bool Management::sendCurl(const QStringList &lines) {
-    QString prog_cmdline("curl");
-#ifdef WIN32
-    prog_cmdline.append(".exe");
-#endif
-    prog_cmdline.append(" -f");
-    prog_cmdline.append(" -F key=\"" + m_publicAuthKey + "\"");
-    QStringList::ConstIterator it = lines.constBegin();
-    while (it != lines.constEnd()) {
-        prog_cmdline.append(" " + *it);
-        ++it;
-    }
-    QProcess curl;
-    curl.start(prog_cmdline);
-    curl.waitForFinished(-1);
-    if (curl.exitCode()) {
-        QTextStream(stdout) << "Upload failed. Curl Exit code: "
-            << curl.exitCode() << endl;
-        QTextStream(stdout) << curl.readAllStandardOutput();
-        throw NetworkException("Curl returned non-zero exit code "
-                                   + std::to_string(curl.exitCode()));
-        return false;
-    }
-    QTextStream(stdout) << curl.readAllStandardOutput();
-    return (curl.exitCode() == 0);
-}
-
 /*
 -F winnerhash=223737476718d58a4a5b0f317a1eeeb4b38f0c06af5ab65cb9d76d68d9abadb6
 -F loserhash=92c658d7325fe38f0c8adbbb1444ed17afd891b9f208003c272547a7bcb87909
@@ -760,30 +1016,7 @@ void Management::uploadResult(const QMap<QString,QString> &r, const QMap<QString
     prog_cmdline.append("-F sgf=@"+ r["file"] + ".sgf.gz");
     prog_cmdline.append(m_serverUrl+"submit-match");
 
-    bool sent = false;
-    for (auto retries = 0; retries < MAX_RETRIES; retries++) {
-        try {
-            sent = sendCurl(prog_cmdline);
-            break;
-        } catch (NetworkException ex) {
-            QTextStream(stdout)
-                << "Network connection to server failed." << endl;
-            QTextStream(stdout)
-                << ex.what() << endl;
-            auto retry_delay =
-                std::min<int>(
-                    RETRY_DELAY_MIN_SEC * std::pow(1.5, retries),
-                    RETRY_DELAY_MAX_SEC);
-            QTextStream(stdout) << "Retrying in " << retry_delay << " s."
-                                << endl;
-            QThread::sleep(retry_delay);
-        }
-    }
-    if (!sent) {
-        saveCurlCmdLine(prog_cmdline, r["file"]);
-        return;
-    }
-    cleanupFiles(r["file"]);
+    queueUpload(prog_cmdline, r["file"]);
 }
 
 
@@ -814,31 +1047,289 @@ void Management::uploadData(const QMap<QString,QString> &r, const QMap<QString,Q
     prog_cmdline.append("-F trainingdata=@" + r["file"] + ".txt.0.gz");
     prog_cmdline.append(m_serverUrl+"submit");
 
-    bool sent = false;
-    for (auto retries = 0; retries < MAX_RETRIES; retries++) {
-        try {
-            sent = sendCurl(prog_cmdline);
-            break;
-        } catch (NetworkException ex) {
+    queueUpload(prog_cmdline, r["file"]);
+}
+
+void Management::openJournal() {
+    QDir().mkpath(SPOOL_DIR);
+    QString name = SPOOL_DIR + "/journal-" + QUuid::createUuid().toRfc4122().toHex();
+    m_journalLock = new QLockFile(name + ".lock");
+    m_journalLock->lock();
+    m_journal.setFileName(name + ".txt");
+    m_journal.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Text);
+
+    // The journals of the runs that ended before their uploads did.
+    QDir spool(SPOOL_DIR);
+    QFileInfoList journals = spool.entryInfoList({"journal-*.txt"}, QDir::Files);
+    for (const QFileInfo &fi : journals) {
+        QString other = fi.filePath();
+        other.chop(4);
+        if (other == name) {
+            continue;
+        }
+        QLockFile lock(other + ".lock");
+        if (!lock.tryLock(10)) {
+            continue;
+        }
+        QFile f(fi.filePath());
+        if (f.open(QFile::ReadOnly | QFile::Text)) {
+            QList<Upload> pending;
+            QTextStream in(&f);
+            while (!in.atEnd()) {
+                QStringList fields = in.readLine().split('\t');
+                if (fields.size() > 2 && fields[0] == "queue") {
+                    pending.append({fields.mid(2), fields[1]});
+                } else if (fields.size() == 2 && fields[0] == "sent") {
+                    for (int i = 0; i < pending.size(); ++i) {
+                        if (pending[i].name == fields[1]) {
+                            pending.removeAt(i);
+                            break;
+                        }
+                    }
+                }
+            }
+            f.close();
+            for (const Upload &u : pending) {
+                queueUpload(u.lines, u.name);
+            }
+        }
+        f.remove();
+    }
+
+    // The uploads saved one per file by older versions.
+    QDir dir;
+    QFileInfoList list = dir.entryInfoList({"curl_save*.bin"}, QDir::Files | QDir::NoSymLinks);
+    for (const QFileInfo &fi : list) {
+        QLockFile lf(fi.fileName() + ".lock");
+        if (!lf.tryLock(10)) {
+            continue;
+        }
+        QFile file(fi.fileName());
+        if (!file.open(QFile::ReadOnly)) {
+            continue;
+        }
+        QTextStream in(&file);
+        QString name;
+        QString tmp;
+        QStringList lines;
+        int count;
+        in >> name;
+        in >> count;
+        count = 2 * count - 1;
+        for (int i = 0; i < count; i++) {
+            in >> tmp;
+            lines << tmp;
+        }
+        file.close();
+        queueUpload(lines, name);
+        file.remove();
+    }
+}
+
+void Management::writeJournal(const QString &line) {
+    m_journal.write((line + "\n").toUtf8());
+    m_journal.flush();
+#ifndef WIN32
+    // The entry is on the disk before the upload is done.
+    fsync(m_journal.handle());
+#endif
+}
+
+void Management::queueUpload(const QStringList &lines, const QString &name) {
+    m_uploadMutex.lock();
+    writeJournal("queue\t" + name + "\t" + lines.join('\t'));
+    m_uploads.append({lines, name});
+    m_uploadCond.wakeAll();
+    m_uploadMutex.unlock();
+}
+
+QVector<int> Management::sendBatch(const QList<Upload> &batch,
+                                   int &retryAfter) {
+    // One curl sends all the games, over one connection, and writes the
+    // HTTP status of every one of them after its response. The response
+    // headers go to a file per game.
+    const QString marker = "autogtp-upload ";
+    QTemporaryDir headers;
+    QString prog_cmdline("curl");
+#ifdef WIN32
+    prog_cmdline.append(".exe");
+#endif
+    for (int i = 0; i < batch.size(); ++i) {
+        if (i > 0) {
+            prog_cmdline.append(" --next");
+        }
+        prog_cmdline.append(" -s -f");
+        prog_cmdline.append(" -w \"\\n" + marker + "%{http_code}\\n\"");
+        prog_cmdline.append(" -D \"" + headerFile(headers, i) + "\"");
+        prog_cmdline.append(" -F key=\"" + m_publicAuthKey + "\"");
+        prog_cmdline.append(" " + batch[i].lines.join(' '));
+    }
+    QProcess curl;
+    curl.start(prog_cmdline);
+    curl.waitForFinished(-1);
+
+    QVector<int> codes(batch.size(), 0);
+    int transfer = 0;
+    QStringList output = QString(curl.readAllStandardOutput()).split('\n');
+    for (const QString &line : output) {
+        if (!line.startsWith(marker)) {
+            if (!line.isEmpty()) {
+                QTextStream(stdout) << line << endl;
+            }
+            continue;
+        }
+        if (transfer < codes.size()) {
+            codes[transfer] = line.mid(marker.size()).toInt();
+        }
+        transfer++;
+    }
+    if (curl.exitCode()) {
+        QTextStream(stdout) << "Upload failed. Curl Exit code: "
+            << curl.exitCode() << endl;
+    }
+    // The longest wait the server asked for. Only the delay in seconds
+    // is understood, not the HTTP date.
+    retryAfter = 0;
+    for (int i = 0; i < batch.size(); ++i) {
+        QFile file(headerFile(headers, i));
+        if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+            continue;
+        }
+        while (!file.atEnd()) {
+            const QString line = QString(file.readLine()).trimmed();
+            if (!line.startsWith("retry-after:", Qt::CaseInsensitive)) {
+                continue;
+            }
+            bool ok;
+            const int seconds = line.mid(line.indexOf(':') + 1)
+                .trimmed().toInt(&ok);
+            if (ok && seconds > retryAfter) {
+                retryAfter = seconds;
+            }
+        }
+    }
+    return codes;
+}
+
+QString Management::headerFile(const QTemporaryDir &dir, int transfer) {
+    return dir.path() + QString("/headers-%1.txt").arg(transfer);
+}
+
+bool Management::uploadFilesExist(const Upload &upload) {
+    for (const QString &line : upload.lines) {
+        int file = line.indexOf("=@");
+        if (file >= 0 && !QFileInfo::exists(line.mid(file + 2))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Management::transferLoop() {
+    const qint64 poll_ms = TRANSFER_POLL_MIN * 60 * 1000;
+    QElapsedTimer sincePoll;
+    sincePoll.start();
+    int failures = 0;
+    m_uploadMutex.lock();
+    while (!m_uploadsDone || !m_uploads.isEmpty()) {
+        if (!m_uploadsDone && sincePoll.elapsed() >= poll_ms) {
+            m_uploadMutex.unlock();
+            prefetchNetworks();
+            sincePoll.restart();
+            m_uploadMutex.lock();
+            continue;
+        }
+        if (m_uploads.isEmpty()) {
+            m_uploadCond.wait(&m_uploadMutex,
+                              qMax<qint64>(0, poll_ms - sincePoll.elapsed()));
+            continue;
+        }
+        // The games that finished during an upload go together in the
+        // next one.
+        QList<Upload> batch = m_uploads.mid(0, UPLOAD_BATCH);
+        m_uploadMutex.unlock();
+        QTextStream(stdout) << "Uploading " << batch.size() << " game(s)." << endl;
+        int retryAfter;
+        QVector<int> codes = sendBatch(batch, retryAfter);
+        m_uploadMutex.lock();
+        int doneCount = 0;
+        bool throttled = retryAfter > 0;
+        for (int i = 0; i < batch.size(); ++i) {
+            bool sent = codes[i] >= 200 && codes[i] < 300;
+            // Request Timeout and Too Many Requests: the server takes it
+            // later, like after a 5xx.
+            bool busy = codes[i] == 408 || codes[i] == 429;
+            throttled = throttled || busy;
+            // The server won't take it with another try, or curl can't
+            // read the files.
+            bool rejected = (codes[i] >= 400 && codes[i] < 500 && !busy)
+                || !uploadFilesExist(batch[i]);
+            if (!sent && !rejected) {
+                continue;
+            }
+            doneCount++;
+            if (!sent) {
+                QTextStream(stdout) << "Dropping the upload of "
+                    << batch[i].name << "." << endl;
+            }
+            writeJournal("sent\t" + batch[i].name);
+            cleanupFiles(batch[i].name);
+            for (int j = 0; j < m_uploads.size(); ++j) {
+                if (m_uploads[j].name == batch[i].name) {
+                    m_uploads.removeAt(j);
+                    break;
+                }
+            }
+        }
+        if (m_uploads.isEmpty()) {
+            // Nothing in the journal is needed any more.
+            m_journal.resize(0);
+        }
+        if (doneCount > 0) {
+            failures = 0;
+            if (!throttled) {
+                continue;
+            }
+        }
+        if (throttled) {
+            QTextStream(stdout) << "The server is busy." << endl;
+        } else {
             QTextStream(stdout)
                 << "Network connection to server failed." << endl;
-            QTextStream(stdout)
-                << ex.what() << endl;
-            auto retry_delay =
-                std::min<int>(
-                    RETRY_DELAY_MIN_SEC * std::pow(1.5, retries),
-                    RETRY_DELAY_MAX_SEC);
-            QTextStream(stdout) << "Retrying in " << retry_delay << " s."
-                                << endl;
-            QThread::sleep(retry_delay);
         }
+        if (m_uploadsDone) {
+            // The next run sends them.
+            break;
+        }
+        auto retry_delay =
+            std::min<int>(
+                std::max<double>(
+                    RETRY_DELAY_MIN_SEC * std::pow(1.5, failures),
+                    retryAfter),
+                RETRY_DELAY_MAX_SEC);
+        failures++;
+        QTextStream(stdout) << "Retrying in " << retry_delay << " s."
+                            << endl;
+        m_uploadCond.wait(&m_uploadMutex, retry_delay * 1000);
     }
-    if (!sent) {
-        QTextStream(stdout) << "PROVA\n";
-        saveCurlCmdLine(prog_cmdline, r["file"]);
-        return;
+    m_uploadMutex.unlock();
+}
+
+void Management::finishTransfers() {
+    m_uploadMutex.lock();
+    m_uploadsDone = true;
+    m_uploadCond.wakeAll();
+    m_uploadMutex.unlock();
+    m_transfers.wait();
+    if (m_journal.isOpen() && m_journal.size() == 0) {
+        m_journal.remove();
+    }
+    m_journal.close();
+    if (m_journalLock != nullptr) {
+        m_journalLock->unlock();
+        delete m_journalLock;
+        m_journalLock = nullptr;
     }
-    cleanupFiles(r["file"]);
 }
 
 void Management::checkStoredGames() {
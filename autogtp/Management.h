@@ -21,11 +21,16 @@
 #include <QAtomicInt>
 #include <QMutex>
 #include <QString>
+#include <QTemporaryDir>
 #include <QTextStream>
 #include <QThread>
+#include <QFile>
 #include <QFileInfo>
+#include <QJsonDocument>
 #include <QLockFile>
+#include <QList>
 #include <QVector>
+#include <QWaitCondition>
 #include <chrono>
 #include <stdexcept>
 #include "Worker.h"
@@ -40,14 +45,18 @@ public:
                const int ver,
                const int maxGame,
                const bool delNetworks,
+               const bool autoGames,
                const QString& keep,
                const QString& debug,
                const QString& serverUrl,
-               const QString& publicAuthKey);
+               const QString& publicAuthKey,
+               const QString& tuningCache);
     ~Management() = default;
     void giveAssignments();
     void incMoves() { m_movesMade++; }
     void wait();
+    // Name of the shared NNCache segment of the engines of this autogtp.
+    static QString sharedCacheName();
 signals:
     void sendQuit();
 public slots:
@@ -62,8 +71,49 @@ private:
             : std::runtime_error("NetworkException: " + message)
         {}
     };
+
+    // The uploads and the downloads of the networks coming up run on
+    // this thread, so that the workers don't wait for the server.
+    class TransferThread : public QThread {
+    public:
+        TransferThread(Management *boss) : m_boss(boss) {}
+        void run() override { m_boss->transferLoop(); }
+    private:
+        Management *m_boss;
+    };
+
+    struct Upload {
+        QStringList lines;
+        QString name;
+    };
+    // The hill climbing of the number of games on a GPU, with -a. The
+    // games step up, or down if the first step up doesn't help, while
+    // every step plays more moves per second than the best so far.
+    struct Scaling {
+        // Workers that should run on the GPU, and those that do.
+        int games;
+        int running;
+        // +1 or -1 while climbing, 0 once the best number is found.
+        int step;
+        int startGames;
+        int bestGames;
+        double bestRate;
+        // Games to finish on the GPU before the measure starts, so that
+        // all its workers play with the new number.
+        int settling;
+        int measured;
+        int moves;
+        std::chrono::steady_clock::time_point start;
+    };
+
     QMutex m_syncMutex;
     QVector<Worker*> m_gamesThreads;
+    QVector<int> m_workerGpus;
+    QVector<Scaling> m_scaling;
+    bool m_autoGames;
+    bool m_storing;
+    QString m_scaledNet;
+    QString m_netSize;
     int m_games;
     int m_gpus;
     QStringList m_gpusList;
@@ -75,6 +125,10 @@ private:
     QString m_debugPath;
     QString m_serverUrl;
     QString m_publicAuthKey;
+    // Directory or URL of the tunings shared by the hosts, and what it
+    // had before this host tuned.
+    QString m_tuningCache;
+    QStringList m_sharedTuning;
     int m_version;
     std::chrono::high_resolution_clock::time_point m_start;
     int m_storeGames;
@@ -85,14 +139,25 @@ private:
     int m_threadsLeft;
     bool m_delNetworks;
     QLockFile *m_lockFile;
+    TransferThread m_transfers;
+    QMutex m_uploadMutex;
+    QWaitCondition m_uploadCond;
+    QList<Upload> m_uploads;
+    bool m_uploadsDone;
+    // A "queue" line for every finished game, and a "sent" line once the
+    // server has it, so that the next run resumes the uploads.
+    QFile m_journal;
+    QLockFile *m_journalLock;
+    // Held by the thread that is fetching a network.
+    QMutex m_fetchMutex;
 
+    QJsonDocument getTask(bool tuning);
     Order getWorkInternal(bool tuning);
     Order getWork(bool tuning = false);
     Order getWork(const QFileInfo &file);
     QString getOption(const QJsonObject &ob, const QString &key, const QString &opt, const QString &defValue);
     QString getBoolOption(const QJsonObject &ob, const QString &key, const QString &opt, bool defValue);
     QString getOptionsString(const QJsonObject &opt, const QString &rnd);
-    void sendAllGames();
     void checkStoredGames();
     QFileInfo getNextStored();
     bool networkExists(const QString &name);
@@ -100,13 +165,32 @@ private:
     QString fetchGameData(const QString &name, const QString &extension);
     void printTimingInfo(float duration);
     void runTuningProcess(const QString &tuneCmdLine);
+    // Adds the shared tunings this host doesn't have to its
+    // leelaz_opencl_tuning, and the other way after tuning.
+    void fetchTuning();
+    void publishTuning();
+    void startWorker(int gpu);
+    // Whether the worker of the finished game goes on to another one.
+    bool scaleGames(int index, const Order &ord, Result &res);
+    void setGames(int gpu, int games);
+    void loadScaling();
+    QString networkSize(const QString &net);
     void gzipFile(const QString &fileName);
-    bool sendCurl(const QStringList &lines);
-    void saveCurlCmdLine(const QStringList &prog_cmdline, const QString &name);
     void archiveFiles(const QString &fileName);
     void cleanupFiles(const QString &fileName);
     void uploadData(const QMap<QString,QString> &r, const QMap<QString,QString> &l);
     void uploadResult(const QMap<QString, QString> &r, const QMap<QString, QString> &l);
+    void queueUpload(const QStringList &lines, const QString &name);
+    void openJournal();
+    void writeJournal(const QString &line);
+    // The HTTP status of every upload, 0 for the ones that didn't get one,
+    // and the longest Retry-After of the responses in seconds, 0 if none.
+    QVector<int> sendBatch(const QList<Upload> &batch, int &retryAfter);
+    static QString headerFile(const QTemporaryDir &dir, int transfer);
+    bool uploadFilesExist(const Upload &upload);
+    void prefetchNetworks();
+    void transferLoop();
+    void finishTransfers();
 };
 
 #endif
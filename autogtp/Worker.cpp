@@ -89,6 +89,7 @@ void Worker::run() {
             emit resultReady(m_todo, res, m_index, gameDuration);
         }
     } while (m_state == RUNNING);
+    m_job->quitEngines();
     if (m_state == STORING) {
         m_todo.add("moves", res.parameters()["moves"]);
         if (res.type() == Result::StoreMatch) {
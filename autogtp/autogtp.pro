@@ -18,6 +18,8 @@ CONFIG   -= app_bundle
 
 TEMPLATE = app
 
+unix:!macx: LIBS += -lrt
+
 SOURCES += main.cpp \
     Game.cpp \
     Worker.cpp \
@@ -31,6 +31,8 @@
 #include <chrono>
 #ifdef WIN32
 #include <direct.h>
+#else
+#include <sys/mman.h>
 #endif
 #include <QCommandLineParser>
 #include <iostream>
@@ -78,6 +80,10 @@ int main(int argc, char *argv[]) {
         { "e", "erase" }, "Erase old networks when new ones are available.",
                           "");
 
+    QCommandLineOption autoGamesOption(
+        { "a", "autoGames" }, "Adjust the number of games on each GPU, starting from 'gamesNum', to play the most moves per second.",
+                          "");
+
     QCommandLineOption publicAuthKeyOption(
         "key" , "Set keys needed by the server for submitting games and matches",
                 "key", "");
@@ -86,6 +92,10 @@ int main(int argc, char *argv[]) {
         "url", "Set the URL of leela-zero/SAI server",
                 "server url", "http://localhost:8080/");
 
+    QCommandLineOption tuningCacheOption(
+        "tuning-cache", "Fetch the OpenCL tunings of identical devices from this directory or URL before tuning, and publish the new ones after.",
+                "directory or url", "");
+
     parser.addOption(gamesNumOption);
     parser.addOption(gpusOption);
     parser.addOption(keepSgfOption);
@@ -94,8 +104,10 @@ int main(int argc, char *argv[]) {
     parser.addOption(singleOption);
     parser.addOption(maxOption);
     parser.addOption(eraseOption);
+    parser.addOption(autoGamesOption);
     parser.addOption(publicAuthKeyOption);
     parser.addOption(serverUrlOption);
+    parser.addOption(tuningCacheOption);
 
 
     // Process the actual command line arguments given by the user
@@ -127,10 +139,16 @@ int main(int argc, char *argv[]) {
         maxNum = 0;
     }
 
+    // The number of games only changes when they don't run out.
+    bool autoGames = parser.isSet(autoGamesOption) && maxNum < 0;
+
     // Map streams
     QTextStream cerr(stderr, QIODevice::WriteOnly);
     cerr << "AutoGTP v" << AUTOGTP_VERSION << endl;
     cerr << "Using " << gamesNum << " thread(s) for GPU(s)." << endl;
+    if (autoGames) {
+        cerr << "The number of threads adjusts to the throughput." << endl;
+    }
     if (parser.isSet(keepSgfOption)) {
         if (!QDir().mkpath(parser.value(keepSgfOption))) {
             cerr << "Couldn't create output directory for self-play SGF files!"
@@ -152,9 +170,9 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
     Management *boss = new Management(gpusNum, gamesNum, gpusList, AUTOGTP_VERSION, maxNum,
-                                      parser.isSet(eraseOption), parser.value(keepSgfOption),
+                                      parser.isSet(eraseOption), autoGames, parser.value(keepSgfOption),
                                       parser.value(keepDebugOption), parser.value(serverUrlOption),
-                                      parser.value(publicAuthKeyOption));
+                                      parser.value(publicAuthKeyOption), parser.value(tuningCacheOption));
     QObject::connect(&app, &QCoreApplication::aboutToQuit, boss, &Management::storeGames);
     QTimer *timer = new QTimer();
     boss->giveAssignments();
@@ -169,5 +187,9 @@ int main(int argc, char *argv[]) {
             QObject::connect(cons, &Console::sendQuit, &app, &QCoreApplication::quit);
         }
     }
-    return app.exec();
+    const auto ret = app.exec();
+#ifndef WIN32
+    shm_unlink(Management::sharedCacheName().toLocal8Bit().constData());
+#endif
+    return ret;
 }
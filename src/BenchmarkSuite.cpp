@@ -0,0 +1,200 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "BenchmarkSuite.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "GTP.h"
+#include "GameState.h"
+#include "Metrics.h"
+#include "NNCache.h"
+#include "Random.h"
+#include "SGFStream.h"
+#include "Timing.h"
+#include "UCTNodePool.h"
+#include "UCTSearch.h"
+#include "Utils.h"
+
+using namespace Utils;
+
+namespace {
+    struct Result {
+        int threads;
+        double seconds;
+        double first_move_seconds;
+        std::uint64_t playouts;
+        std::uint64_t nodes;
+        std::uint64_t nn_evals;
+        std::uint64_t cache_lookups;
+        std::uint64_t cache_hits;
+        std::uint64_t batches;
+        std::uint64_t batched_positions;
+        std::size_t peak_tree_bytes;
+    };
+
+    // The counters of the process, to take the difference of a run.
+    struct Counts {
+        std::uint64_t playouts;
+        std::uint64_t nodes;
+        std::uint64_t nn_evals;
+        std::uint64_t cache_lookups;
+        std::uint64_t cache_hits;
+        std::uint64_t batches;
+        std::uint64_t batched_positions;
+
+        static Counts get() {
+            const auto batch = Metrics::get(Metrics::NN_BATCH_SIZE);
+            return {Metrics::get(Metrics::PLAYOUTS),
+                    Metrics::get(Metrics::NODES),
+                    Metrics::get(Metrics::NN_EVALS),
+                    Metrics::get(Metrics::NNCACHE_LOOKUPS),
+                    Metrics::get(Metrics::NNCACHE_HITS)
+                        + Metrics::get(Metrics::NNCACHE_SHARED_HITS),
+                    batch.count(), batch.sum};
+        }
+    };
+
+    std::vector<GameState> load_positions(const std::string& sgf_name) {
+        auto positions = std::vector<GameState>();
+        SGFStream sgf(sgf_name);
+        auto game = SGFGame{};
+        auto moves = std::vector<int>();
+        while (sgf.next_game(game)) {
+            positions.emplace_back(game.follow_mainline_state(moves));
+        }
+        if (positions.empty()) {
+            throw std::runtime_error("No positions in " + sgf_name);
+        }
+        return positions;
+    }
+
+    Result run_threads(const std::vector<GameState>& positions,
+                       const int threads) {
+        cfg_num_threads = threads;
+        NNCache::get_NNCache().clear();
+        const auto before = Counts::get();
+
+        auto result = Result{};
+        result.threads = threads;
+        const auto start = Time();
+        for (auto i = size_t{0}; i < positions.size(); i++) {
+            // The same random numbers for every run.
+            Random::get_Rng().seedrandom(cfg_rng_seed);
+            auto state = positions[i];
+            state.set_timecontrol(0, 1, 0, 0);  // Set infinite time.
+
+            const auto tree_bytes = UCTNodePool::get_bytes_in_use();
+            const auto move_start = Time();
+            auto search = std::make_unique<UCTSearch>(state);
+            search->think(state.get_to_move(), UCTSearch::NORESIGN);
+            if (i == 0) {
+                result.first_move_seconds =
+                    Time::timediff_seconds(move_start, Time());
+            }
+            // The tree only grows during a search.
+            result.peak_tree_bytes = std::max(
+                result.peak_tree_bytes,
+                UCTNodePool::get_bytes_in_use() - tree_bytes);
+        }
+        result.seconds = Time::timediff_seconds(start, Time());
+
+        const auto after = Counts::get();
+        result.playouts = after.playouts - before.playouts;
+        result.nodes = after.nodes - before.nodes;
+        result.nn_evals = after.nn_evals - before.nn_evals;
+        result.cache_lookups = after.cache_lookups - before.cache_lookups;
+        result.cache_hits = after.cache_hits - before.cache_hits;
+        result.batches = after.batches - before.batches;
+        result.batched_positions =
+            after.batched_positions - before.batched_positions;
+        return result;
+    }
+
+    std::string json_string(const std::string& text) {
+        auto result = std::string{"\""};
+        for (const auto c : text) {
+            if (c == '"' || c == '\\') {
+                result += '\\';
+            }
+            result += c;
+        }
+        return result + "\"";
+    }
+
+    double ratio(const double a, const double b) {
+        return b > 0.0 ? a / b : 0.0;
+    }
+}
+
+void BenchmarkSuite::run(const std::string& sgf_name) {
+    const auto positions = load_positions(sgf_name);
+    const auto max_threads = cfg_num_threads;
+    auto thread_counts = std::vector<int>();
+    for (auto threads = 1; threads < max_threads; threads *= 2) {
+        thread_counts.emplace_back(threads);
+    }
+    thread_counts.emplace_back(max_threads);
+
+    auto results = std::vector<Result>();
+    for (const auto threads : thread_counts) {
+        myprintf("Benchmark: %zu positions with %d thread(s).\n",
+                 positions.size(), threads);
+        results.emplace_back(run_threads(positions, threads));
+    }
+    cfg_num_threads = max_threads;
+
+    std::printf("{\n");
+    std::printf("  \"program\": %s,\n",
+                json_string(PROGRAM_NAME " " PROGRAM_VERSION).c_str());
+    std::printf("  \"weights\": %s,\n", json_string(cfg_weightsfile).c_str());
+    std::printf("  \"positions\": %zu,\n", positions.size());
+    std::printf("  \"visits\": %d,\n", cfg_max_visits);
+    std::printf("  \"seed\": %llu,\n",
+                static_cast<unsigned long long>(cfg_rng_seed));
+    std::printf("  \"batch_size\": %d,\n", cfg_batch_size);
+    std::printf("  \"runs\": [\n");
+    for (auto i = size_t{0}; i < results.size(); i++) {
+        const auto& r = results[i];
+        std::printf("    {\n");
+        std::printf("      \"threads\": %d,\n", r.threads);
+        std::printf("      \"seconds\": %.3f,\n", r.seconds);
+        std::printf("      \"first_move_seconds\": %.3f,\n",
+                    r.first_move_seconds);
+        std::printf("      \"playouts_per_second\": %.1f,\n",
+                    ratio(r.playouts, r.seconds));
+        std::printf("      \"nodes_per_second\": %.1f,\n",
+                    ratio(r.nodes, r.seconds));
+        std::printf("      \"nn_evals_per_second\": %.1f,\n",
+                    ratio(r.nn_evals, r.seconds));
+        std::printf("      \"cache_hit_rate\": %.4f,\n",
+                    ratio(r.cache_hits, r.cache_lookups));
+        std::printf("      \"average_batch_size\": %.2f,\n",
+                    ratio(r.batched_positions, r.batches));
+        std::printf("      \"peak_tree_bytes\": %zu\n", r.peak_tree_bytes);
+        std::printf("    }%s\n", i + 1 < results.size() ? "," : "");
+    }
+    std::printf("  ]\n");
+    std::printf("}\n");
+}
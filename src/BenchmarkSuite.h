@@ -0,0 +1,38 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BENCHMARKSUITE_H_INCLUDED
+#define BENCHMARKSUITE_H_INCLUDED
+
+#include "config.h"
+
+#include <string>
+
+// Searches a fixed set of positions end to end, for --benchmark-suite,
+// so that builds and hardware can be compared. Every game of the SGF
+// file is one position, after its main line, and src/tests/benchmark.sgf
+// has a set of them. The positions are searched with the fixed seed and
+// visits of --benchmark, with 1, 2, 4 ... threads up to --threads, from
+// an empty NNCache every time. The results go to stdout as JSON.
+class BenchmarkSuite {
+public:
+    // Throws std::runtime_error if the positions can't be read.
+    static void run(const std::string& sgf_name);
+};
+
+#endif
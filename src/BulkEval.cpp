@@ -0,0 +1,143 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "BulkEval.h"
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <stdexcept>
+#include <vector>
+
+#include "FastBoard.h"
+#include "GTP.h"
+#include "GameState.h"
+#include "Network.h"
+#include "SGFStream.h"
+#include "Timing.h"
+#include "Utils.h"
+
+using namespace Utils;
+
+static void append_records(std::string& out,
+                           const std::vector<GameState>& positions,
+                           const std::vector<std::uint32_t>& games,
+                           const std::vector<std::uint32_t>& moves) {
+    auto states = std::vector<const GameState*>{};
+    for (const auto& position : positions) {
+        states.emplace_back(&position);
+    }
+    const auto results = Network::get_scored_moves_direct(states, 0);
+
+    for (auto i = size_t{0}; i < positions.size(); i++) {
+        const auto& result = results[i];
+        auto record = EvalRecord{};
+        std::memset(&record, 0, sizeof(record));
+        record.game = games[i];
+        record.move = moves[i];
+        std::copy(begin(result.policy), end(result.policy), record.policy);
+        record.policy[BOARD_SQUARES] = result.policy_pass;
+        record.value = result.value;
+        record.alpha = result.alpha;
+        record.beta = result.beta;
+        record.to_move = positions[i].get_to_move();
+        out.append(reinterpret_cast<const char*>(&record), sizeof(record));
+    }
+}
+
+// The records of the games from first to last.
+static std::string evaluate_games(const std::vector<SGFGame>& games,
+                                  const size_t first, const size_t last) {
+    const auto batch_size = size_t(Network::get_max_batch_size());
+    auto out = std::string{};
+    auto positions = std::vector<GameState>{};
+    auto position_games = std::vector<std::uint32_t>{};
+    auto position_moves = std::vector<std::uint32_t>{};
+    auto moves = std::vector<int>{};
+    for (auto index = first; index < last; index++) {
+        auto state = GameState{};
+        try {
+            state = games[index].follow_mainline_state(moves);
+        } catch (const std::exception&) {
+            continue;
+        }
+
+        state.rewind();
+        auto move = std::uint32_t{0};
+        do {
+            positions.emplace_back(state);
+            position_games.emplace_back(std::uint32_t(index));
+            position_moves.emplace_back(move++);
+            if (positions.size() == batch_size) {
+                append_records(out, positions, position_games,
+                               position_moves);
+                positions.clear();
+                position_games.clear();
+                position_moves.clear();
+            }
+        } while (state.forward_move());
+    }
+    if (!positions.empty()) {
+        append_records(out, positions, position_games, position_moves);
+    }
+    return out;
+}
+
+size_t BulkEval::run(const std::string& sgf_name,
+                     const std::string& out_name) {
+    SGFStream sgf(sgf_name);
+    auto games = std::vector<SGFGame>{};
+    for (auto game = SGFGame{}; sgf.next_game(game); ) {
+        games.emplace_back(game);
+    }
+
+    auto out = std::ofstream{out_name, std::ios::binary};
+    if (!out) {
+        throw std::runtime_error("Error opening file");
+    }
+
+    // The tasks run ahead of the writer by a few per thread, so that the
+    // memory stays bounded while the output keeps the order of the file.
+    const auto max_tasks = size_t(2 * std::max(1, cfg_num_threads));
+    auto tasks = std::deque<std::future<std::string>>{};
+    auto positions = size_t{0};
+    auto next = size_t{0};
+    Time start;
+    while (next < games.size() || !tasks.empty()) {
+        while (next < games.size() && tasks.size() < max_tasks) {
+            const auto last = std::min(next + GAMES_PER_TASK, games.size());
+            tasks.emplace_back(thread_pool.add_task(
+                evaluate_games, std::cref(games), next, last));
+            next = last;
+        }
+        const auto records = tasks.front().get();
+        tasks.pop_front();
+        out.write(records.data(), records.size());
+        positions += records.size() / sizeof(EvalRecord);
+    }
+
+    Time elapsed;
+    const auto elapsed_s = Time::timediff_seconds(start, elapsed);
+    myprintf("%zu games, %zu positions in %5.2f seconds -> %d pos/s\n",
+             games.size(), positions, elapsed_s,
+             int(positions / std::max(elapsed_s, 0.01)));
+    return positions;
+}
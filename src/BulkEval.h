@@ -0,0 +1,62 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BULKEVAL_H_INCLUDED
+#define BULKEVAL_H_INCLUDED
+
+#include "config.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// The network outputs for one position, as bulk_eval writes them: back
+// to back as they are in memory, little endian and without padding
+// between the fields.
+struct EvalRecord {
+    // The game in the SGF file, from 0, and the moves played before.
+    std::uint32_t game;
+    std::uint32_t move;
+    // Intersections from A1, row by row, then pass.
+    float policy[BOARD_SQUARES + 1];
+    // As in Network::Netresult.
+    float value;
+    float alpha;
+    float beta;
+    // 0 = black to move.
+    std::uint8_t to_move;
+};
+
+static_assert(sizeof(EvalRecord)
+              == (8 + 4 * (BOARD_SQUARES + 4) + 1 + 3) / 4 * 4,
+              "EvalRecord has padding between its fields.");
+
+// Runs the network over every position of the main lines of an SGF
+// collection, without a search and without the NNCache. The games are
+// replayed and gathered on the thread pool and go through the network
+// in full batches. The records are in the order of the file.
+class BulkEval {
+public:
+    static constexpr size_t GAMES_PER_TASK = 32;
+
+    // Returns the number of positions written.
+    static size_t run(const std::string& sgf_name,
+                      const std::string& out_name);
+};
+
+#endif
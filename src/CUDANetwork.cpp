@@ -0,0 +1,548 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#ifdef USE_CUDA
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+
+#include <nvrtc.h>
+
+#include "CUDANetwork.h"
+#include "Metrics.h"
+#include "Utils.h"
+
+using Utils::myprintf;
+
+static constexpr auto NUM_INTERSECTIONS = BOARD_SQUARES;
+// Evaluations in flight per device. One is copied to or from the host
+// while the other runs.
+static constexpr auto SLOTS_PER_DEVICE = 2;
+static constexpr auto THREADS_PER_BLOCK = 256;
+static constexpr auto CUBLAS_WORKSPACE_SIZE = size_t{4} * 1024 * 1024;
+
+static std::string sourceCode_cuda = R"(
+#define NUM_INTERSECTIONS (BOARD_SIZE * BOARD_SIZE)
+
+// col[n][c][k][p] is plane c of position n at intersection p, moved by
+// filter tap k, and zero outside of the board.
+extern "C" __global__ void im2col3(const float* __restrict__ in,
+                                   float* __restrict__ col,
+                                   const int size) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= size) {
+        return;
+    }
+    const int p = i % NUM_INTERSECTIONS;
+    const int k = (i / NUM_INTERSECTIONS) % 9;
+    const int nc = i / (9 * NUM_INTERSECTIONS);
+    const int y = p / BOARD_SIZE + k / 3 - 1;
+    const int x = p % BOARD_SIZE + k % 3 - 1;
+    const bool inside = x >= 0 && x < BOARD_SIZE && y >= 0 && y < BOARD_SIZE;
+    col[i] = inside ? in[nc * NUM_INTERSECTIONS + y * BOARD_SIZE + x] : 0.0f;
+}
+
+extern "C" __global__ void batchnorm(float* __restrict__ data,
+                                     const float* __restrict__ means,
+                                     const float* __restrict__ stddivs,
+                                     const float* __restrict__ residual,
+                                     const int channels,
+                                     const int size) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= size) {
+        return;
+    }
+    const int c = (i / NUM_INTERSECTIONS) % channels;
+    float val = stddivs[c] * (data[i] - means[c]);
+    if (residual) {
+        val += residual[i];
+    }
+    data[i] = val > 0.0f ? val : 0.0f;
+}
+
+extern "C" __global__ void add_bias(float* __restrict__ data,
+                                    const float* __restrict__ biases,
+                                    const int channels,
+                                    const int size) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < size) {
+        data[i] += biases[(i / NUM_INTERSECTIONS) % channels];
+    }
+}
+)";
+
+static void check(const cudaError_t error, const char* const what) {
+    if (error != cudaSuccess) {
+        throw std::runtime_error(std::string(what) + ": "
+                                 + cudaGetErrorString(error));
+    }
+}
+
+static void check(const CUresult error, const char* const what) {
+    if (error != CUDA_SUCCESS) {
+        auto message = static_cast<const char*>(nullptr);
+        cuGetErrorString(error, &message);
+        throw std::runtime_error(std::string(what) + ": "
+                                 + (message ? message : "unknown error"));
+    }
+}
+
+static void check(const cublasStatus_t error, const char* const what) {
+    if (error != CUBLAS_STATUS_SUCCESS) {
+        throw std::runtime_error(std::string(what) + ": cuBLAS error "
+                                 + std::to_string(error));
+    }
+}
+
+static void check(const nvrtcResult error, const char* const what) {
+    if (error != NVRTC_SUCCESS) {
+        throw std::runtime_error(std::string(what) + ": "
+                                 + nvrtcGetErrorString(error));
+    }
+}
+
+static float* device_alloc(const size_t size) {
+    auto ptr = static_cast<void*>(nullptr);
+    check(cudaMalloc(&ptr, size * sizeof(float)), "cudaMalloc");
+    return static_cast<float*>(ptr);
+}
+
+static float* host_alloc(const size_t size) {
+    auto ptr = static_cast<void*>(nullptr);
+    check(cudaMallocHost(&ptr, size * sizeof(float)), "cudaMallocHost");
+    return static_cast<float*>(ptr);
+}
+
+// PTX for the newest architecture that both NVRTC and the device know.
+static std::string compile_kernels(const int major, const int minor) {
+    auto num_archs = 0;
+    check(nvrtcGetNumSupportedArchs(&num_archs), "nvrtcGetNumSupportedArchs");
+    auto archs = std::vector<int>(num_archs);
+    check(nvrtcGetSupportedArchs(archs.data()), "nvrtcGetSupportedArchs");
+    auto arch = archs.front();
+    for (const auto supported : archs) {
+        if (supported <= major * 10 + minor) {
+            arch = std::max(arch, supported);
+        }
+    }
+
+    auto program = nvrtcProgram{};
+    check(nvrtcCreateProgram(&program, sourceCode_cuda.c_str(),
+                             "CUDANetwork", 0, nullptr, nullptr),
+          "nvrtcCreateProgram");
+    const auto arch_option = "--gpu-architecture=compute_"
+                             + std::to_string(arch);
+    const auto board_option = "-DBOARD_SIZE=" + std::to_string(BOARD_SIZE);
+    const auto options = std::array<const char*, 3>{
+        arch_option.c_str(), board_option.c_str(), "--use_fast_math"};
+    const auto result = nvrtcCompileProgram(program, options.size(),
+                                            options.data());
+    if (result != NVRTC_SUCCESS) {
+        auto log_size = size_t{0};
+        nvrtcGetProgramLogSize(program, &log_size);
+        auto log = std::string(log_size, '\0');
+        nvrtcGetProgramLog(program, &log[0]);
+        myprintf("CUDA kernel build log:\n%s\n", log.c_str());
+        nvrtcDestroyProgram(&program);
+        check(result, "nvrtcCompileProgram");
+    }
+    auto ptx_size = size_t{0};
+    check(nvrtcGetPTXSize(program, &ptx_size), "nvrtcGetPTXSize");
+    auto ptx = std::string(ptx_size, '\0');
+    check(nvrtcGetPTX(program, &ptx[0]), "nvrtcGetPTX");
+    nvrtcDestroyProgram(&program);
+    return ptx;
+}
+
+struct CUDANetwork::Device {
+    struct Weights {
+        float* weights;
+        float* means;
+        float* stddivs;
+    };
+
+    explicit Device(const int device_id) : id(device_id) {}
+    ~Device() {
+        cudaSetDevice(id);
+        for (const auto ptr : allocations) {
+            cudaFree(ptr);
+        }
+        if (module) {
+            cuModuleUnload(module);
+        }
+    }
+
+    float* upload(const std::vector<float>& data) {
+        const auto ptr = device_alloc(data.size());
+        allocations.emplace_back(ptr);
+        check(cudaMemcpy(ptr, data.data(), data.size() * sizeof(float),
+                         cudaMemcpyHostToDevice), "cudaMemcpy");
+        return ptr;
+    }
+
+    int id;
+    CUmodule module{nullptr};
+    CUfunction im2col3{nullptr};
+    CUfunction batchnorm{nullptr};
+    CUfunction add_bias{nullptr};
+    // Same order as m_layers and m_heads. The means of the heads are
+    // their biases, they have no stddivs.
+    std::vector<Weights> layers;
+    std::vector<Weights> heads;
+    std::vector<float*> allocations;
+    // Slots taken and since when, under m_mutex.
+    int busy_slots{0};
+    std::chrono::steady_clock::time_point busy_since;
+};
+
+struct CUDANetwork::Slot {
+    explicit Slot(Device& dev) : device(dev) {}
+    ~Slot() {
+        cudaSetDevice(device.id);
+        clear_graphs();
+        if (cublas) {
+            cublasDestroy(cublas);
+        }
+        if (stream) {
+            cudaStreamDestroy(stream);
+        }
+        for (const auto ptr : device_buffers) {
+            cudaFree(ptr);
+        }
+        for (const auto ptr : host_buffers) {
+            cudaFreeHost(ptr);
+        }
+    }
+
+    void clear_graphs() {
+        for (const auto& graph : graphs) {
+            cudaGraphExecDestroy(graph.second);
+        }
+        graphs.clear();
+    }
+
+    Device& device;
+    cudaStream_t stream{nullptr};
+    cublasHandle_t cublas{nullptr};
+    // Pinned, so the copies are asynchronous and part of the graphs.
+    float* h_input{nullptr};
+    std::vector<float*> h_outputs;
+    float* d_input{nullptr};
+    float* d_col{nullptr};
+    std::array<float*, 3> d_planes{};
+    std::vector<float*> d_outputs;
+    std::vector<float*> device_buffers;
+    std::vector<float*> host_buffers;
+    // Indexed by batch size.
+    std::map<int, cudaGraphExec_t> graphs;
+};
+
+static void launch(const CUfunction kernel, const cudaStream_t stream,
+                   const int size, std::vector<void*> args) {
+    const auto blocks = (size + THREADS_PER_BLOCK - 1) / THREADS_PER_BLOCK;
+    check(cuLaunchKernel(kernel, blocks, 1, 1, THREADS_PER_BLOCK, 1, 1, 0,
+                         stream, args.data(), nullptr), "cuLaunchKernel");
+}
+
+// out[n] = weights * planes[n] for the batch_size positions, where the
+// weights are [outputs][inputs] and the planes [inputs][intersections].
+// cuBLAS is column major, so this is planes^T * weights^T for it.
+static void gemm(const cublasHandle_t cublas, const int outputs,
+                 const int inputs, const float* const planes,
+                 const float* const weights, float* const out,
+                 const int batch_size) {
+    const auto alpha = 1.0f;
+    const auto beta = 0.0f;
+    check(cublasSgemmStridedBatched(
+              cublas, CUBLAS_OP_N, CUBLAS_OP_N,
+              NUM_INTERSECTIONS, outputs, inputs,
+              &alpha,
+              planes, NUM_INTERSECTIONS, inputs * NUM_INTERSECTIONS,
+              weights, inputs, 0,
+              &beta,
+              out, NUM_INTERSECTIONS, outputs * NUM_INTERSECTIONS,
+              batch_size), "cublasSgemmStridedBatched");
+}
+
+CUDANetwork::CUDANetwork(const int input_planes, const int channels)
+    : m_input_planes(input_planes), m_channels(channels) {}
+
+// The slots use the devices, so they go first.
+CUDANetwork::~CUDANetwork() {
+    m_slots.clear();
+    m_devices.clear();
+}
+
+void CUDANetwork::push_convolve3(const int channels, const int outputs,
+                                 const std::vector<float>& weights,
+                                 const std::vector<float>& means,
+                                 const std::vector<float>& stddivs,
+                                 const bool residual) {
+    assert(weights.size() == size_t(outputs * channels * 9));
+    m_layers.emplace_back(Layer{channels, outputs, residual,
+                                weights, means, stddivs});
+}
+
+void CUDANetwork::push_head(const int outputs,
+                            const std::vector<float>& weights,
+                            const std::vector<float>& biases) {
+    assert(weights.size() == size_t(outputs * m_channels));
+    m_heads.emplace_back(Head{outputs, weights, biases});
+}
+
+void CUDANetwork::initialize(const std::vector<int>& gpus,
+                             const int max_batch_size) {
+    m_max_batch_size = max_batch_size;
+    auto device_ids = gpus;
+    if (device_ids.empty()) {
+        auto count = 0;
+        check(cudaGetDeviceCount(&count), "cudaGetDeviceCount");
+        for (auto i = 0; i < count; i++) {
+            device_ids.emplace_back(i);
+        }
+    }
+    if (device_ids.empty()) {
+        throw std::runtime_error("No CUDA devices found");
+    }
+    check(cuInit(0), "cuInit");
+
+    const auto max_inputs = std::max(m_input_planes, m_channels);
+    for (const auto id : device_ids) {
+        check(cudaSetDevice(id), "cudaSetDevice");
+        // Makes the primary context current for the driver API.
+        check(cudaFree(nullptr), "cudaFree");
+        auto props = cudaDeviceProp{};
+        check(cudaGetDeviceProperties(&props, id), "cudaGetDeviceProperties");
+        myprintf("CUDA device %d: %s, compute capability %d.%d, %d MB.\n",
+                 id, props.name, props.major, props.minor,
+                 int(props.totalGlobalMem >> 20));
+
+        m_devices.emplace_back(std::make_unique<Device>(id));
+        auto& dev = *m_devices.back();
+        const auto ptx = compile_kernels(props.major, props.minor);
+        check(cuModuleLoadData(&dev.module, ptx.c_str()), "cuModuleLoadData");
+        check(cuModuleGetFunction(&dev.im2col3, dev.module, "im2col3"),
+              "cuModuleGetFunction");
+        check(cuModuleGetFunction(&dev.batchnorm, dev.module, "batchnorm"),
+              "cuModuleGetFunction");
+        check(cuModuleGetFunction(&dev.add_bias, dev.module, "add_bias"),
+              "cuModuleGetFunction");
+        for (const auto& layer : m_layers) {
+            dev.layers.emplace_back(Device::Weights{dev.upload(layer.weights),
+                                                    dev.upload(layer.means),
+                                                    dev.upload(layer.stddivs)});
+        }
+        for (const auto& head : m_heads) {
+            dev.heads.emplace_back(Device::Weights{dev.upload(head.weights),
+                                                   dev.upload(head.biases),
+                                                   nullptr});
+        }
+
+        for (auto i = 0; i < SLOTS_PER_DEVICE; i++) {
+            m_slots.emplace_back(std::make_unique<Slot>(dev));
+            auto& slot = *m_slots.back();
+            check(cudaStreamCreateWithFlags(&slot.stream,
+                                            cudaStreamNonBlocking),
+                  "cudaStreamCreate");
+            check(cublasCreate(&slot.cublas), "cublasCreate");
+            check(cublasSetStream(slot.cublas, slot.stream),
+                  "cublasSetStream");
+            // cuBLAS must not allocate while a graph is captured.
+            const auto workspace = device_alloc(CUBLAS_WORKSPACE_SIZE
+                                                / sizeof(float));
+            slot.device_buffers.emplace_back(workspace);
+            check(cublasSetWorkspace(slot.cublas, workspace,
+                                     CUBLAS_WORKSPACE_SIZE),
+                  "cublasSetWorkspace");
+            check(cublasSetMathMode(slot.cublas,
+                                    m_tensor_math ? CUBLAS_TF32_TENSOR_OP_MATH
+                                                  : CUBLAS_DEFAULT_MATH),
+                  "cublasSetMathMode");
+
+            const auto batch_squares = max_batch_size * NUM_INTERSECTIONS;
+            auto device_buffer = [&slot](const size_t size) {
+                slot.device_buffers.emplace_back(device_alloc(size));
+                return slot.device_buffers.back();
+            };
+            auto host_buffer = [&slot](const size_t size) {
+                slot.host_buffers.emplace_back(host_alloc(size));
+                return slot.host_buffers.back();
+            };
+            slot.h_input = host_buffer(batch_squares * m_input_planes);
+            slot.d_input = device_buffer(batch_squares * m_input_planes);
+            slot.d_col = device_buffer(batch_squares * max_inputs * 9);
+            for (auto& planes : slot.d_planes) {
+                planes = device_buffer(batch_squares * m_channels);
+            }
+            for (const auto& head : m_heads) {
+                slot.h_outputs.emplace_back(
+                    host_buffer(batch_squares * head.outputs));
+                slot.d_outputs.emplace_back(
+                    device_buffer(batch_squares * head.outputs));
+            }
+            m_free_slots.emplace_back(&slot);
+        }
+    }
+}
+
+void CUDANetwork::set_tensor_math(const bool enabled) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_tensor_math = enabled;
+    // The math mode is part of the captured graphs.
+    for (const auto& slot : m_slots) {
+        check(cudaSetDevice(slot->device.id), "cudaSetDevice");
+        slot->clear_graphs();
+        check(cublasSetMathMode(slot->cublas,
+                                enabled ? CUBLAS_TF32_TENSOR_OP_MATH
+                                        : CUBLAS_DEFAULT_MATH),
+              "cublasSetMathMode");
+    }
+}
+
+CUDANetwork::Slot& CUDANetwork::acquire_slot() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_slot_free.wait(lock, [this] { return !m_free_slots.empty(); });
+    const auto slot = m_free_slots.back();
+    m_free_slots.pop_back();
+    if (slot->device.busy_slots++ == 0) {
+        slot->device.busy_since = std::chrono::steady_clock::now();
+    }
+    return *slot;
+}
+
+void CUDANetwork::release_slot(Slot& slot) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_free_slots.emplace_back(&slot);
+        auto& dev = slot.device;
+        if (--dev.busy_slots == 0) {
+            Metrics::add_device_busy(
+                dev.id, std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - dev.busy_since)
+                            .count());
+        }
+    }
+    m_slot_free.notify_one();
+}
+
+void CUDANetwork::run_network(Slot& slot, const int batch_size) {
+    check(cudaSetDevice(slot.device.id), "cudaSetDevice");
+    auto graph = slot.graphs.find(batch_size);
+    if (graph == end(slot.graphs)) {
+        auto& dev = slot.device;
+        const auto stream = slot.stream;
+        check(cudaStreamBeginCapture(stream,
+                                     cudaStreamCaptureModeThreadLocal),
+              "cudaStreamBeginCapture");
+        check(cudaMemcpyAsync(slot.d_input, slot.h_input,
+                              batch_size * m_input_planes
+                              * NUM_INTERSECTIONS * sizeof(float),
+                              cudaMemcpyHostToDevice, stream),
+              "cudaMemcpyAsync");
+
+        // The residual of a convolution is the input of the one before.
+        auto in = slot.d_input;
+        auto previous_in = static_cast<float*>(nullptr);
+        for (auto i = size_t{0}; i < m_layers.size(); i++) {
+            const auto& layer = m_layers[i];
+            auto out = slot.d_planes[0];
+            for (const auto planes : slot.d_planes) {
+                if (planes != in && planes != previous_in) {
+                    out = planes;
+                    break;
+                }
+            }
+            auto col_size = batch_size * layer.channels * 9
+                            * NUM_INTERSECTIONS;
+            launch(dev.im2col3, stream, col_size,
+                   {&in, &slot.d_col, &col_size});
+            gemm(slot.cublas, layer.outputs, layer.channels * 9, slot.d_col,
+                 dev.layers[i].weights, out, batch_size);
+
+            auto residual = layer.residual ? previous_in : nullptr;
+            auto channels = layer.outputs;
+            auto out_size = batch_size * layer.outputs * NUM_INTERSECTIONS;
+            launch(dev.batchnorm, stream, out_size,
+                   {&out, &dev.layers[i].means, &dev.layers[i].stddivs,
+                    &residual, &channels, &out_size});
+            previous_in = in;
+            in = out;
+        }
+
+        for (auto i = size_t{0}; i < m_heads.size(); i++) {
+            auto out = slot.d_outputs[i];
+            auto channels = m_heads[i].outputs;
+            auto out_size = batch_size * channels * NUM_INTERSECTIONS;
+            gemm(slot.cublas, channels, m_channels, in,
+                 dev.heads[i].weights, out, batch_size);
+            launch(dev.add_bias, stream, out_size,
+                   {&out, &dev.heads[i].means, &channels, &out_size});
+            check(cudaMemcpyAsync(slot.h_outputs[i], out,
+                                  out_size * sizeof(float),
+                                  cudaMemcpyDeviceToHost, stream),
+                  "cudaMemcpyAsync");
+        }
+
+        auto captured = cudaGraph_t{};
+        check(cudaStreamEndCapture(stream, &captured), "cudaStreamEndCapture");
+        auto exec = cudaGraphExec_t{};
+        const auto result = cudaGraphInstantiateWithFlags(&exec, captured, 0);
+        cudaGraphDestroy(captured);
+        check(result, "cudaGraphInstantiate");
+        graph = slot.graphs.emplace(batch_size, exec).first;
+    }
+    check(cudaGraphLaunch(graph->second, slot.stream), "cudaGraphLaunch");
+    check(cudaStreamSynchronize(slot.stream), "cudaStreamSynchronize");
+}
+
+void CUDANetwork::forward(const std::vector<float>& input,
+                          std::vector<float>& output_pol,
+                          std::vector<float>& output_val,
+                          std::vector<float>& output_vbe,
+                          const int batch_size) {
+    const auto outputs = std::array<std::vector<float>*, 3>{
+        &output_pol, &output_val, &output_vbe};
+    assert(m_heads.size() <= outputs.size());
+    const auto in_size = m_input_planes * NUM_INTERSECTIONS;
+
+    auto& slot = acquire_slot();
+    try {
+        for (auto start = 0; start < batch_size; start += m_max_batch_size) {
+            const auto size = std::min(m_max_batch_size, batch_size - start);
+            std::copy_n(begin(input) + start * in_size, size * in_size,
+                        slot.h_input);
+            run_network(slot, size);
+            for (auto i = size_t{0}; i < m_heads.size(); i++) {
+                const auto out_size = m_heads[i].outputs * NUM_INTERSECTIONS;
+                std::copy_n(slot.h_outputs[i], size * out_size,
+                            begin(*outputs[i]) + start * out_size);
+            }
+        }
+    } catch (...) {
+        release_slot(slot);
+        throw;
+    }
+    release_slot(slot);
+}
+
+#endif
@@ -0,0 +1,118 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CUDANETWORK_H_INCLUDED
+#define CUDANETWORK_H_INCLUDED
+
+#include "config.h"
+
+#ifdef USE_CUDA
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <cublas_v2.h>
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+// Runs the residual tower and the head convolutions on NVIDIA GPUs. It
+// fills the same outputs as Network::forward_cpu, so the fully connected
+// part of the heads stays on the host.
+//
+// The convolutions are cuBLAS matrix multiplications over im2col planes,
+// the small kernels in between are compiled with NVRTC when the devices
+// are set up, so building needs the CUDA toolkit but no nvcc. Every batch
+// size is captured once into a CUDA graph, later evaluations of that size
+// replay the whole network with one launch.
+class CUDANetwork {
+public:
+    CUDANetwork(const int input_planes, const int channels);
+    ~CUDANetwork();
+
+    // 3x3 filters as [outputs][channels][3][3]. The outputs are
+    // stddiv * (x - mean), plus the input of the previous convolution
+    // if residual is set, followed by the ReLU.
+    void push_convolve3(const int channels, const int outputs,
+                        const std::vector<float>& weights,
+                        const std::vector<float>& means,
+                        const std::vector<float>& stddivs,
+                        const bool residual);
+    // 1x1 head convolution of the tower output. forward() fills its
+    // outputs in the order the heads were pushed.
+    void push_head(const int outputs,
+                   const std::vector<float>& weights,
+                   const std::vector<float>& biases);
+
+    // Uploads the pushed weights to the devices in gpus, all of them if
+    // it is empty, and compiles the kernels. forward() may be called with
+    // up to max_batch_size positions, from any number of threads.
+    // Throws std::runtime_error if a device can't be used.
+    void initialize(const std::vector<int>& gpus, const int max_batch_size);
+
+    // TF32 tensor cores for the matrix multiplications on the devices
+    // that have them. On by default.
+    void set_tensor_math(const bool enabled);
+
+    void forward(const std::vector<float>& input,
+                 std::vector<float>& output_pol,
+                 std::vector<float>& output_val,
+                 std::vector<float>& output_vbe,
+                 const int batch_size);
+
+private:
+    struct Layer {
+        int channels;
+        int outputs;
+        bool residual;
+        std::vector<float> weights;
+        std::vector<float> means;
+        std::vector<float> stddivs;
+    };
+    struct Head {
+        int outputs;
+        std::vector<float> weights;
+        std::vector<float> biases;
+    };
+    // Device copies of the weights, in the order of m_layers and m_heads.
+    struct Device;
+    // Buffers and cached graphs of one evaluation in flight.
+    struct Slot;
+
+    void run_network(Slot& slot, const int batch_size);
+    Slot& acquire_slot();
+    void release_slot(Slot& slot);
+
+    int m_input_planes;
+    int m_channels;
+    int m_max_batch_size{0};
+    bool m_tensor_math{true};
+    std::vector<Layer> m_layers;
+    std::vector<Head> m_heads;
+    std::vector<std::unique_ptr<Device>> m_devices;
+    std::vector<std::unique_ptr<Slot>> m_slots;
+
+    std::mutex m_mutex;
+    std::condition_variable m_slot_free;
+    std::vector<Slot*> m_free_slots;
+};
+
+#endif
+
+#endif
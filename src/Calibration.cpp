@@ -0,0 +1,186 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "Calibration.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include "GTP.h"
+#include "GameState.h"
+#include "Metrics.h"
+#include "NNCache.h"
+#include "Network.h"
+#include "Random.h"
+#include "Timing.h"
+#include "UCTSearch.h"
+#include "Utils.h"
+
+using namespace Utils;
+
+const auto CALIBRATION_FILE = std::string("leelaz_calibration");
+
+// 1, 2, 4 ... below max, and max.
+static std::vector<int> powers_of_two(const int max) {
+    auto values = std::vector<int>();
+    for (auto value = 1; value < max; value *= 2) {
+        values.emplace_back(value);
+    }
+    values.emplace_back(max);
+    return values;
+}
+
+double Calibration::measure(const int threads, const int leaf_batch) {
+    cfg_num_threads = threads;
+    cfg_leaf_batch = leaf_batch;
+    NNCache::get_NNCache().clear();
+    Random::get_Rng().seedrandom(cfg_rng_seed);
+
+    auto state = GameState{};
+    state.init_game(BOARD_SIZE, cfg_komi);
+    state.set_timecontrol(0, 1, 0, 0);  // Set infinite time.
+    auto search = std::make_unique<UCTSearch>(state);
+    search->set_playout_limit(UCTSearch::UNLIMITED_PLAYOUTS);
+    search->set_visit_limit(VISITS);
+
+    // The search prints nothing.
+    const auto quiet = cfg_quiet;
+    cfg_quiet = true;
+    const auto nodes = Metrics::get(Metrics::NODES);
+    const auto start = Time();
+    search->think(state.get_to_move(), UCTSearch::NORESIGN);
+    const auto seconds = Time::timediff_seconds(start, Time());
+    cfg_quiet = quiet;
+    const auto nodes_per_second =
+        seconds > 0.0 ? (Metrics::get(Metrics::NODES) - nodes) / seconds
+                      : 0.0;
+    myprintf("Calibration: %d thread(s), leaf batches of %d: "
+             "%.0f nodes/s.\n", threads, leaf_batch, nodes_per_second);
+    return nodes_per_second;
+}
+
+Calibration::Setting Calibration::run(const bool threads,
+                                      const bool leaf_batch) {
+    const auto thread_counts = threads
+        ? powers_of_two(cfg_max_threads) : std::vector<int>{cfg_num_threads};
+    // The backends have room for batches this large.
+    const auto leaf_batches = leaf_batch
+        ? powers_of_two(Network::get_max_batch_size())
+        : std::vector<int>{cfg_leaf_batch};
+
+    // The first search only warms up.
+    measure(thread_counts.back(), leaf_batches.front());
+
+    auto best = Setting{cfg_num_threads, cfg_leaf_batch, 0.0};
+    for (const auto batch : leaf_batches) {
+        auto best_for_batch = 0.0;
+        for (const auto count : thread_counts) {
+            const auto nodes_per_second = measure(count, batch);
+            if (nodes_per_second > best.nodes_per_second) {
+                best = Setting{count, batch, nodes_per_second};
+            }
+            if (nodes_per_second < best_for_batch * MIN_SPEEDUP) {
+                break;
+            }
+            best_for_batch = std::max(best_for_batch, nodes_per_second);
+        }
+    }
+    NNCache::get_NNCache().clear();
+    return best;
+}
+
+bool Calibration::load(const std::string& key, Setting& setting) {
+    auto file = std::ifstream{CALIBRATION_FILE};
+    auto line = std::string{};
+    auto found = false;
+    while (std::getline(file, line)) {
+        if (line.compare(0, key.size(), key) != 0) {
+            continue;
+        }
+        auto ss = std::istringstream{line.substr(key.size())};
+        auto sep = char{};
+        auto value = Setting{};
+        if (ss >> value.threads >> sep >> value.leaf_batch >> sep
+                >> value.nodes_per_second
+            && value.threads >= 1 && value.threads <= cfg_max_threads
+            && value.leaf_batch >= 1
+            && value.leaf_batch <= Network::get_max_batch_size()) {
+            setting = value;
+            found = true;
+        }
+    }
+    return found;
+}
+
+void Calibration::store(const std::string& key, const Setting& setting) {
+    auto file_contents = std::vector<std::string>();
+    {
+        auto file = std::ifstream{CALIBRATION_FILE};
+        auto line = std::string{};
+        while (std::getline(file, line)) {
+            if (line.compare(0, key.size(), key) != 0) {
+                file_contents.emplace_back(line);
+            }
+        }
+    }
+    const auto tmp_file = CALIBRATION_FILE + ".tmp";
+    auto file = std::ofstream{tmp_file};
+    for (const auto& line : file_contents) {
+        file << line << std::endl;
+    }
+    file << key << setting.threads << ";" << setting.leaf_batch << ";"
+         << static_cast<long long>(setting.nodes_per_second) << std::endl;
+    file.close();
+
+    if (file.fail()
+        || std::rename(tmp_file.c_str(), CALIBRATION_FILE.c_str()) != 0) {
+        myprintf("Could not save the calibration result.\n");
+        myprintf("Do I have write permissions on %s?\n",
+                 CALIBRATION_FILE.c_str());
+    }
+}
+
+void Calibration::apply(const bool threads, const bool leaf_batch) {
+    // What was fixed on the command line is part of the key, the best
+    // leaf batch for 4 threads needn't be the best with 8.
+    auto key = std::ostringstream{};
+    key << VERSION << ";" << Network::get_device_names() << ";"
+        << Network::get_net_size() << ";" << cfg_batch_size << ";"
+        << (threads ? std::string("auto") : std::to_string(cfg_num_threads))
+        << ";"
+        << (leaf_batch ? std::string("auto") : std::to_string(cfg_leaf_batch))
+        << ";";
+
+    auto setting = Setting{};
+    if (load(key.str(), setting)) {
+        myprintf("Loaded existing calibration.\n");
+    } else {
+        setting = run(threads, leaf_batch);
+        store(key.str(), setting);
+    }
+    cfg_num_threads = setting.threads;
+    cfg_leaf_batch = setting.leaf_batch;
+    myprintf("Calibrated to %d thread(s) and leaf batches of %d, "
+             "%.0f nodes/s.\n", cfg_num_threads, cfg_leaf_batch,
+             setting.nodes_per_second);
+}
@@ -0,0 +1,57 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CALIBRATION_H_INCLUDED
+#define CALIBRATION_H_INCLUDED
+
+#include "config.h"
+
+#include <string>
+
+// Picks --threads and --leafbatch for --calibrate. Short searches of
+// the empty board run with 1, 2, 4 ... threads up to the maximum, and
+// leaf batches of 1, 2, 4 ... up to what the backend was set up for,
+// and the setting with the most nodes per second wins. It is stored in
+// the file leelaz_calibration, one line per device and network size,
+// and the next engine with the same ones uses it without searching.
+class Calibration {
+public:
+    // Sets cfg_num_threads if threads, and cfg_leaf_batch if leaf_batch.
+    // The thread pool must have cfg_max_threads threads.
+    static void apply(bool threads, bool leaf_batch);
+
+private:
+    static constexpr auto VERSION = 1;
+    static constexpr auto VISITS = 800;
+    // A run with less than this fraction of the speed of fewer threads
+    // stops the search for more threads at that leaf batch.
+    static constexpr auto MIN_SPEEDUP = 0.95;
+
+    struct Setting {
+        int threads;
+        int leaf_batch;
+        double nodes_per_second;
+    };
+
+    static double measure(int threads, int leaf_batch);
+    static Setting run(bool threads, bool leaf_batch);
+    static bool load(const std::string& key, Setting& setting);
+    static void store(const std::string& key, const Setting& setting);
+};
+
+#endif
@@ -0,0 +1,263 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "DistributedSearch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "FastBoard.h"
+#include "SGFTree.h"
+#include "Timing.h"
+#include "Utils.h"
+
+using namespace Utils;
+using namespace DistributedSearch;
+using boost::asio::ip::tcp;
+
+namespace {
+    // How long the coordinator waits for the final stats after stop.
+    constexpr auto FINISH_WAIT = std::chrono::milliseconds(1000);
+    constexpr auto POLL_WAIT = std::chrono::milliseconds(5);
+
+    std::string stats_line(const UCTSearch& search) {
+        auto out = std::ostringstream{};
+        out << "stats";
+        for (const auto& stats : search.get_root_stats(MAX_SYNC_MOVES)) {
+            out << " " << stats.move << " " << stats.visits << " " << stats.black_eval;
+        }
+        out << "\n";
+        return out.str();
+    }
+
+    // Moves are sent as vertices, the worker has the same board size.
+    std::vector<RootMoveStats> parse_stats(std::istream& in) {
+        auto result = std::vector<RootMoveStats>();
+        auto stats = RootMoveStats{};
+        while (in >> stats.move >> stats.visits >> stats.black_eval) {
+            if (stats.visits > 0) {
+                result.emplace_back(stats);
+            }
+        }
+        return result;
+    }
+
+    void write_line(tcp::socket& socket, const std::string& line) {
+        boost::asio::write(socket, boost::asio::buffer(line));
+    }
+
+    std::string read_line(tcp::socket& socket,
+                          boost::asio::streambuf& buffer) {
+        boost::asio::read_until(socket, buffer, '\n');
+        std::istream in(&buffer);
+        auto line = std::string{};
+        std::getline(in, line);
+        return line;
+    }
+
+    // Whether a whole line is waiting, without blocking.
+    bool line_pending(tcp::socket& socket, boost::asio::streambuf& buffer) {
+        const auto available = socket.available();
+        if (available > 0) {
+            auto data = buffer.prepare(available);
+            buffer.commit(socket.read_some(data));
+        }
+        const auto begin = boost::asio::buffers_begin(buffer.data());
+        const auto end = boost::asio::buffers_end(buffer.data());
+        return std::find(begin, end, '\n') != end;
+    }
+
+    void serve(tcp::socket& socket) {
+        boost::asio::streambuf buffer;
+        for (;;) {
+            auto request = std::istringstream(read_line(socket, buffer));
+            auto command = std::string{};
+            auto color = std::string{};
+            auto centis = 0;
+            auto bytes = size_t{0};
+            request >> command;
+            if (command != "search") {
+                // Can be a stop that came after the search ended.
+                continue;
+            }
+            if (!(request >> color >> centis >> bytes)) {
+                throw std::runtime_error("bad search request");
+            }
+            if (buffer.size() < bytes) {
+                boost::asio::read(socket, buffer,
+                    boost::asio::transfer_exactly(bytes - buffer.size()));
+            }
+            auto sgf = std::string(bytes, '\0');
+            std::istream(&buffer).read(&sgf[0], bytes);
+
+            auto tree = SGFTree{};
+            tree.load_from_string(sgf);
+            auto state = tree.follow_mainline_state();
+            // The coordinator decides when to stop.
+            state.set_timecontrol(0, 1, 0, 0);
+            const auto tomove = color == "w" ? FastBoard::WHITE
+                                             : FastBoard::BLACK;
+            myprintf("Searching for the coordinator, %.1f seconds.\n",
+                     centis / 100.0f);
+
+            UCTSearch search(state);
+            const Time start;
+            auto last_sync = 0;
+            search.set_progress_callback([&] {
+                const Time now;
+                const auto elapsed = Time::timediff_centis(start, now);
+                if (elapsed - last_sync >= SYNC_CENTIS) {
+                    last_sync = elapsed;
+                    write_line(socket, stats_line(search));
+                }
+                if (line_pending(socket, buffer)) {
+                    read_line(socket, buffer);
+                    return false;
+                }
+                return elapsed < centis;
+            });
+            search.think(tomove, UCTSearch::NORESIGN);
+
+            write_line(socket, stats_line(search));
+            write_line(socket, "done\n");
+        }
+    }
+}
+
+void DistributedSearch::run_worker(const int port) {
+    boost::asio::io_service io;
+    tcp::acceptor acceptor(
+        io, tcp::endpoint(tcp::v4(), static_cast<unsigned short>(port)));
+    for (;;) {
+        myprintf("Waiting for a coordinator on port %d.\n", port);
+        tcp::socket socket(io);
+        acceptor.accept(socket);
+        try {
+            serve(socket);
+        } catch (const boost::system::system_error& e) {
+            // The coordinator connects again for every move.
+            if (e.code() != boost::asio::error::eof) {
+                myprintf("Coordinator gone: %s\n", e.what());
+            }
+        } catch (const std::exception& e) {
+            myprintf("Coordinator gone: %s\n", e.what());
+        }
+    }
+}
+
+struct DistributedSearch::Coordinator::Worker {
+    std::string address;
+    std::thread thread;
+    std::atomic<bool> stop{false};
+    std::mutex mutex;
+    std::vector<RootMoveStats> stats;
+
+    // Owns the socket, so that it is only ever used by one thread.
+    void run(const std::string& request) {
+        try {
+            const auto colon = address.rfind(':');
+            if (colon == std::string::npos) {
+                throw std::runtime_error("expected host:port");
+            }
+            boost::asio::io_service io;
+            tcp::resolver resolver(io);
+            tcp::socket socket(io);
+            boost::asio::connect(socket, resolver.resolve(
+                {address.substr(0, colon), address.substr(colon + 1)}));
+            write_line(socket, request);
+
+            boost::asio::streambuf buffer;
+            auto stop_sent = false;
+            auto deadline = std::chrono::steady_clock::time_point{};
+            for (;;) {
+                if (stop && !stop_sent) {
+                    write_line(socket, "stop\n");
+                    stop_sent = true;
+                    deadline = std::chrono::steady_clock::now()
+                               + FINISH_WAIT;
+                }
+                if (stop_sent && std::chrono::steady_clock::now() > deadline) {
+                    return;
+                }
+                if (!line_pending(socket, buffer)) {
+                    std::this_thread::sleep_for(POLL_WAIT);
+                    continue;
+                }
+                auto line = std::istringstream(read_line(socket, buffer));
+                auto command = std::string{};
+                line >> command;
+                if (command == "done") {
+                    return;
+                } else if (command == "stats") {
+                    auto update = parse_stats(line);
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stats = std::move(update);
+                }
+            }
+        } catch (const std::exception& e) {
+            myprintf("Search worker %s: %s\n", address.c_str(), e.what());
+        }
+    }
+};
+
+DistributedSearch::Coordinator::Coordinator(
+    const std::vector<std::string>& workers, GameState& state,
+    const int color, const int time_for_move) {
+    const auto sgf = SGFTree::state_to_string(state, color);
+    const auto request = "search "
+        + std::string(color == FastBoard::WHITE ? "w" : "b") + " "
+        + std::to_string(time_for_move) + " "
+        + std::to_string(sgf.size()) + "\n" + sgf;
+    for (const auto& address : workers) {
+        m_workers.emplace_back(std::make_unique<Worker>());
+        auto& worker = *m_workers.back();
+        worker.address = address;
+        worker.thread = std::thread([&worker, request] {
+            worker.run(request);
+        });
+    }
+}
+
+DistributedSearch::Coordinator::~Coordinator() {
+    finish();
+}
+
+std::vector<std::vector<RootMoveStats>>
+DistributedSearch::Coordinator::finish() {
+    for (auto& worker : m_workers) {
+        worker->stop = true;
+    }
+    auto result = std::vector<std::vector<RootMoveStats>>();
+    for (auto& worker : m_workers) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        if (!worker->stats.empty()) {
+            result.emplace_back(std::move(worker->stats));
+            worker->stats.clear();
+        }
+    }
+    return result;
+}
@@ -0,0 +1,70 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DISTRIBUTEDSEARCH_H_INCLUDED
+#define DISTRIBUTEDSEARCH_H_INCLUDED
+
+#include "config.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "GameState.h"
+#include "UCTSearch.h"
+
+// Root parallel search over several hosts. The coordinator sends the
+// position and the time for the move to leelaz instances started with
+// --worker-port. Each of them searches on its own and streams back the
+// statistics of its most visited root moves, and the coordinator adds
+// them to its own root before it picks the move.
+//
+// There is one TCP connection per move, with a line based protocol:
+//   coordinator: search <color> <centiseconds> <bytes>, then an SGF
+//                of that many bytes with the game so far
+//   worker:      stats <move> <visits> <black eval> ..., repeatedly
+//   coordinator: stop, if it is done before the time is up
+//   worker:      done, after the final stats
+namespace DistributedSearch {
+    // Most moves per stats line, which bounds the bandwidth per update.
+    constexpr auto MAX_SYNC_MOVES = size_t{16};
+    // Time between two stats lines of a worker.
+    constexpr auto SYNC_CENTIS = 50;
+
+    // Serves one coordinator after the other, never returns.
+    void run_worker(int port);
+
+    class Coordinator {
+    public:
+        // Starts the search of state, color to move, on the workers,
+        // given as host:port.
+        Coordinator(const std::vector<std::string>& workers,
+                    GameState& state, int color, int time_for_move);
+        ~Coordinator();
+
+        // Stops the workers, waits a moment for their final stats and
+        // returns the latest stats of every worker that answered.
+        std::vector<std::vector<RootMoveStats>> finish();
+
+    private:
+        struct Worker;
+        std::vector<std::unique_ptr<Worker>> m_workers;
+    };
+}
+
+#endif
@@ -0,0 +1,119 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "EndgameSolver.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "FastBoard.h"
+#include "GameState.h"
+#include "Metrics.h"
+
+EndgameSolver::EndgameSolver()
+    : m_states(MAX_DEPTH + 1) {
+}
+
+bool EndgameSolver::solve(const GameState& state, float& score) {
+    // The states and the bounds of the last endgame of this thread are
+    // kept for their memory.
+    thread_local EndgameSolver solver;
+    solver.m_states[0].start_from(state);
+    solver.m_bounds.clear();
+    solver.m_nodes = 0;
+    const auto infinity = std::numeric_limits<float>::infinity();
+    const auto solved = solver.search(0, -infinity, infinity, score);
+    Metrics::add(solved ? Metrics::ENDGAME_SOLVED : Metrics::ENDGAME_UNSOLVED,
+                 1);
+    return solved;
+}
+
+bool EndgameSolver::search(const int depth, float alpha, float beta,
+                           float& score) {
+    auto& state = m_states[depth];
+    if (state.get_passes() >= 2) {
+        score = state.final_score();
+        return true;
+    }
+    if (depth == MAX_DEPTH || ++m_nodes > MAX_NODES) {
+        return false;
+    }
+    // The hash has the side to move, the ko and the passes.
+    const auto hash = state.board.get_hash();
+    const auto known = m_bounds.find(hash);
+    if (known != end(m_bounds)) {
+        const auto& bound = known->second;
+        if (bound.lower >= beta || bound.lower == bound.upper) {
+            score = bound.lower;
+            return true;
+        }
+        if (bound.upper <= alpha) {
+            score = bound.upper;
+            return true;
+        }
+        alpha = std::max(alpha, bound.lower);
+        beta = std::min(beta, bound.upper);
+    }
+    const auto window = std::make_pair(alpha, beta);
+
+    const auto color = state.get_to_move();
+    const auto black = (color == FastBoard::BLACK);
+    auto best = black ? -std::numeric_limits<float>::infinity()
+                      : std::numeric_limits<float>::infinity();
+    auto& next = m_states[depth + 1];
+    // The pass first, after a pass it ends the game at once, and the
+    // score of that is a bound for the other moves.
+    const auto moves = state.board.get_empty_count() + 1;
+    for (auto i = 0; i < moves; i++) {
+        const auto move = i == 0 ? FastBoard::PASS
+                                 : state.board.get_empty(i - 1);
+        if (!state.is_move_legal(color, move)
+            || (move != FastBoard::PASS && state.board.is_eye(color, move))) {
+            continue;
+        }
+        next.start_from(state);
+        next.play_move(move);
+        if (move != FastBoard::PASS && next.superko()) {
+            continue;
+        }
+        auto value = 0.0f;
+        if (!search(depth + 1, alpha, beta, value)) {
+            return false;
+        }
+        if (black) {
+            best = std::max(best, value);
+            alpha = std::max(alpha, value);
+        } else {
+            best = std::min(best, value);
+            beta = std::min(beta, value);
+        }
+        if (alpha >= beta) {
+            break;
+        }
+    }
+    score = best;
+    auto& bound = m_bounds.emplace(hash, Bound{}).first->second;
+    if (best > window.first) {
+        bound.lower = std::max(bound.lower, best);
+    }
+    if (best < window.second) {
+        bound.upper = std::min(bound.upper, best);
+    }
+    return true;
+}
@@ -0,0 +1,68 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ENDGAMESOLVER_H_INCLUDED
+#define ENDGAMESOLVER_H_INCLUDED
+
+#include "config.h"
+
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+#include "KoState.h"
+
+class GameState;
+
+// Finds the score of an endgame for --solve-empties, with an alpha-beta
+// search over the legal moves and the pass until two passes end the
+// game. Black maximizes the final_score() and white minimizes it. Moves
+// that repeat a position are left out, as the search does, and so are
+// moves into an eye of the side to move. The bounds found for a
+// position are kept by its hash, whatever line led to it, so a superko
+// that depends on the line can be missed. The search gives up beyond
+// MAX_DEPTH moves or MAX_NODES positions, which take about as long as
+// a network evaluation on the CPU.
+class EndgameSolver {
+public:
+    static constexpr auto MAX_DEPTH = 64;
+    static constexpr auto MAX_NODES = 2000;
+
+    // The final score of state with the best play of both sides, from
+    // the point of view of black. Returns false if it is not found
+    // within the limits.
+    static bool solve(const GameState& state, float& score);
+
+private:
+    EndgameSolver();
+    bool search(int depth, float alpha, float beta, float& score);
+
+    // One state per depth, each one starts from the one above it, so
+    // the superko checks see the whole line.
+    std::vector<KoState> m_states;
+    // What is known about the score of the positions searched so far.
+    struct Bound {
+        float lower{-std::numeric_limits<float>::infinity()};
+        float upper{std::numeric_limits<float>::infinity()};
+    };
+    std::unordered_map<std::uint64_t, Bound> m_bounds;
+    int m_nodes{0};
+};
+
+#endif
@@ -22,7 +22,6 @@
 #include <cassert>
 #include <array>
 #include <iostream>
-#include <queue>
 #include <sstream>
 #include <string>
 
@@ -31,28 +30,45 @@
 
 using namespace Utils;
 
-const int FastBoard::NBR_SHIFT;
-const int FastBoard::MAXSQ;
-const int FastBoard::BIG;
-const int FastBoard::PASS;
-const int FastBoard::RESIGN;
+const int FastBoardBase::NBR_SHIFT;
+const int FastBoardBase::MAX_SIZE;
+const int FastBoardBase::MAX_MAXSQ;
+const int FastBoardBase::BIG;
+const int FastBoardBase::PASS;
+const int FastBoardBase::RESIGN;
 
-const std::array<int, 2> FastBoard::s_eyemask = {
+template <int Size>
+const int BasicFastBoard<Size>::MAXSQ;
+
+const std::array<int, 2> FastBoardBase::s_eyemask = {
     4 * (1 << (NBR_SHIFT * BLACK)),
     4 * (1 << (NBR_SHIFT * WHITE))
 };
 
-const std::array<FastBoard::square_t, 4> FastBoard::s_cinvert = {
+const std::array<FastBoardBase::square_t, 4> FastBoardBase::s_cinvert = {
     WHITE, BLACK, EMPTY, INVAL
 };
 
-int FastBoard::get_boardsize(void) const {
+template <int Size>
+int BasicFastBoard<Size>::get_boardsize(void) const {
     return m_boardsize;
 }
 
-int FastBoard::get_vertex(int x, int y) const {
-    assert(x >= 0 && x < BOARD_SIZE);
-    assert(y >= 0 && y < BOARD_SIZE);
+template <int Size>
+int BasicFastBoard<Size>::get_empty_count() const {
+    return m_empty_cnt;
+}
+
+template <int Size>
+int BasicFastBoard<Size>::get_empty(const int i) const {
+    assert(i >= 0 && i < m_empty_cnt);
+    return m_empty[i];
+}
+
+template <int Size>
+int BasicFastBoard<Size>::get_vertex(int x, int y) const {
+    assert(x >= 0 && x < Size);
+    assert(y >= 0 && y < Size);
     assert(x >= 0 && x < m_boardsize);
     assert(y >= 0 && y < m_boardsize);
 
@@ -63,7 +79,8 @@ int FastBoard::get_vertex(int x, int y) const {
     return vertex;
 }
 
-std::pair<int, int> FastBoard::get_xy(int vertex) const {
+template <int Size>
+std::pair<int, int> BasicFastBoard<Size>::get_xy(int vertex) const {
     //int vertex = ((y + 1) * (get_boardsize() + 2)) + (x + 1);
     int x = (vertex % m_squaresize) - 1;
     int y = (vertex / m_squaresize) - 1;
@@ -75,30 +92,37 @@ std::pair<int, int> FastBoard::get_xy(int vertex) const {
     return std::make_pair(x, y);
 }
 
-FastBoard::square_t FastBoard::get_square(int vertex) const {
+template <int Size>
+FastBoardBase::square_t BasicFastBoard<Size>::get_square(int vertex) const {
     assert(vertex >= 0 && vertex < MAXSQ);
     assert(vertex >= 0 && vertex < m_maxsq);
 
     return m_square[vertex];
 }
 
-void FastBoard::set_square(int vertex, FastBoard::square_t content) {
+template <int Size>
+void BasicFastBoard<Size>::set_square(int vertex, square_t content) {
     assert(vertex >= 0 && vertex < MAXSQ);
     assert(vertex >= 0 && vertex < m_maxsq);
     assert(content >= BLACK && content <= INVAL);
 
+    update_bits(vertex, m_square[vertex], content);
     m_square[vertex] = content;
 }
 
-FastBoard::square_t FastBoard::get_square(int x, int y) const {
+template <int Size>
+FastBoardBase::square_t
+BasicFastBoard<Size>::get_square(int x, int y) const {
     return get_square(get_vertex(x, y));
 }
 
-void FastBoard::set_square(int x, int y, FastBoard::square_t content) {
+template <int Size>
+void BasicFastBoard<Size>::set_square(int x, int y, square_t content) {
     set_square(get_vertex(x, y), content);
 }
 
-void FastBoard::reset_board(int size) {
+template <int Size>
+void BasicFastBoard<Size>::reset_board(int size) {
     m_boardsize = size;
     m_squaresize = size + 2;
     m_maxsq = m_squaresize * m_squaresize;
@@ -113,6 +137,12 @@ void FastBoard::reset_board(int size) {
     m_dirs[2] = +m_squaresize;
     m_dirs[3] = -1;
 
+    for (auto& bits : m_bits) {
+        bits.reset();
+    }
+    for (auto& bits : m_stone_bits) {
+        bits.reset();
+    }
     for (int i = 0; i < m_maxsq; i++) {
         m_square[i]     = INVAL;
         m_neighbours[i] = 0;
@@ -124,6 +154,7 @@ void FastBoard::reset_board(int size) {
             int vertex = get_vertex(i, j);
 
             m_square[vertex]          = EMPTY;
+            m_bits[EMPTY].set(vertex);
             m_empty_idx[vertex]       = m_empty_cnt;
             m_empty[m_empty_cnt++]    = vertex;
 
@@ -150,7 +181,8 @@ void FastBoard::reset_board(int size) {
     m_next[MAXSQ]   = MAXSQ;
 }
 
-bool FastBoard::is_suicide(int i, int color) const {
+template <int Size>
+bool BasicFastBoard<Size>::is_suicide(int i, int color) const {
     // If there are liberties next to us, it is never suicide
     if (count_pliberties(i)) {
         return false;
@@ -179,18 +211,37 @@ bool FastBoard::is_suicide(int i, int color) const {
     return true;
 }
 
-int FastBoard::count_pliberties(const int i) const {
+template <int Size>
+typename BasicFastBoard<Size>::moves_t
+BasicFastBoard<Size>::get_playable(const int color) const {
+    auto moves = moves_t{};
+    for (auto i = 0; i < m_empty_cnt; i++) {
+        const auto vertex = m_empty[i];
+        // Only a point without empty neighbours can be suicide.
+        if (count_pliberties(vertex) || !is_suicide(vertex, color)) {
+            const auto x = vertex % m_squaresize - 1;
+            const auto y = vertex / m_squaresize - 1;
+            moves.set(y * Size + x);
+        }
+    }
+    return moves;
+}
+
+template <int Size>
+int BasicFastBoard<Size>::count_pliberties(const int i) const {
     return count_neighbours(EMPTY, i);
 }
 
 // count neighbours of color c at vertex v
 // the border of the board has fake neighours of both colors
-int FastBoard::count_neighbours(const int c, const int v) const {
+template <int Size>
+int BasicFastBoard<Size>::count_neighbours(const int c, const int v) const {
     assert(c == WHITE || c == BLACK || c == EMPTY);
     return (m_neighbours[v] >> (NBR_SHIFT * c)) & NBR_MASK;
 }
 
-void FastBoard::add_neighbour(const int vtx, const int color) {
+template <int Size>
+void BasicFastBoard<Size>::add_neighbour(const int vtx, const int color) {
     assert(color == WHITE || color == BLACK || color == EMPTY);
 
     std::array<int, 4> nbr_pars;
@@ -215,7 +266,8 @@ void FastBoard::add_neighbour(const int vtx, const int color) {
     }
 }
 
-void FastBoard::remove_neighbour(const int vtx, const int color) {
+template <int Size>
+void BasicFastBoard<Size>::remove_neighbour(const int vtx, const int color) {
     assert(color == WHITE || color == BLACK || color == EMPTY);
 
     std::array<int, 4> nbr_pars;
@@ -241,59 +293,82 @@ void FastBoard::remove_neighbour(const int vtx, const int color) {
     }
 }
 
-int FastBoard::calc_reach_color(int color) const {
-    auto reachable = 0;
-    auto bd = std::vector<bool>(m_maxsq, false);
-    auto open = std::queue<int>();
-    for (auto i = 0; i < m_boardsize; i++) {
-        for (auto j = 0; j < m_boardsize; j++) {
-            auto vertex = get_vertex(i, j);
-            if (m_square[vertex] == color) {
-                reachable++;
-                bd[vertex] = true;
-                open.push(vertex);
-            }
-        }
+template <int Size>
+const typename BasicFastBoard<Size>::bitboard_t&
+BasicFastBoard<Size>::get_bitboard(int content) const {
+    assert(content == BLACK || content == WHITE || content == EMPTY);
+    return m_bits[content];
+}
+
+template <int Size>
+void BasicFastBoard<Size>::update_bits(const int vertex,
+                                       const square_t old_content,
+                                       const square_t content) {
+    if (old_content != INVAL) {
+        m_bits[old_content].reset(vertex);
     }
-    while (!open.empty()) {
-        /* colored field, spread */
-        auto vertex = open.front();
-        open.pop();
-
-        for (auto k = 0; k < 4; k++) {
-            auto neighbor = vertex + m_dirs[k];
-            if (!bd[neighbor] && m_square[neighbor] == EMPTY) {
-                reachable++;
-                bd[neighbor] = true;
-                open.push(neighbor);
-            }
+    if (content != INVAL) {
+        m_bits[content].set(vertex);
+    }
+    if (old_content <= WHITE || content <= WHITE) {
+        // The point as in get_stones, see get_xy.
+        const auto point = (vertex / m_squaresize - 1) * Size
+            + vertex % m_squaresize - 1;
+        if (old_content <= WHITE) {
+            m_stone_bits[old_content].reset(point);
+        }
+        if (content <= WHITE) {
+            m_stone_bits[content].set(point);
         }
     }
-    return reachable;
 }
 
-int FastBoard::calc_is_color(int color) const {
-    auto color_match = 0;
-    for (auto i = 0; i < m_boardsize; i++) {
-        for (auto j = 0; j < m_boardsize; j++) {
-            auto vertex = get_vertex(i, j);
-            if (m_square[vertex] == color) {
-                color_match++;
-            }
+// The squares of from and those that can be reached from them by
+// steps through the squares of through. The border is never in
+// through, so the shifts don't wrap around the rows.
+template <int Size>
+typename BasicFastBoard<Size>::bitboard_t
+BasicFastBoard<Size>::spread(const bitboard_t& from,
+                             const bitboard_t& through) const {
+    auto reach = from;
+    for (;;) {
+        auto grown = reach | (reach << 1) | (reach >> 1)
+            | (reach << m_squaresize) | (reach >> m_squaresize);
+        grown = (grown & through) | from;
+        if (grown == reach) {
+            return reach;
         }
+        reach = grown;
     }
-    return color_match;
+}
+
+template <int Size>
+int BasicFastBoard<Size>::calc_reach_color(int color) const {
+    return spread(get_bitboard(color), get_bitboard(EMPTY)).count();
+}
+
+template <int Size>
+int BasicFastBoard<Size>::calc_is_color(int color) const {
+    return get_bitboard(color).count();
+}
+
+template <int Size>
+const typename BasicFastBoard<Size>::stones_t&
+BasicFastBoard<Size>::get_stones() const {
+    return m_stone_bits;
 }
 
 // Needed for scoring passed out games not in MC playouts
-float FastBoard::area_score(float komi) const {
+template <int Size>
+float BasicFastBoard<Size>::area_score(float komi) const {
     auto white = calc_reach_color(WHITE);
     auto black = calc_reach_color(BLACK);
     return black - white - komi;
 }
 // Japanese scoring of a postgame position with all capturable stones removed
-float FastBoard::nihon_score(float komi) const {
-    FastBoard passPassRemoveDead;
+template <int Size>
+float BasicFastBoard<Size>::nihon_score(float komi) const {
+    BasicFastBoard passPassRemoveDead;
     passPassRemoveDead.reset_board(m_boardsize);
 
     //Generate a board: the end game position with dead stones removed
@@ -313,8 +388,9 @@ float FastBoard::nihon_score(float komi) const {
 }
 
 // Sets the endgame position to the current position after a double pass, required for Japanese scoring
-void FastBoard::set_passPassPosition() {
-    FastBoard copyOfCurrentPosition;
+template <int Size>
+void BasicFastBoard<Size>::set_passPassPosition() {
+    BasicFastBoard copyOfCurrentPosition;
     copyOfCurrentPosition.reset_board(m_boardsize);
 
     //Generate a board: the end game position without dead stones removed
@@ -331,11 +407,13 @@ void FastBoard::set_passPassPosition() {
     m_pp_board_pos = &copyOfCurrentPosition;
 }
 
-FastBoard * FastBoard::get_passPassPosition() {
+template <int Size>
+BasicFastBoard<Size> * BasicFastBoard<Size>::get_passPassPosition() {
     return m_pp_board_pos;
 }
 
-void FastBoard::display_board(int lastmove) {
+template <int Size>
+void BasicFastBoard<Size>::display_board(int lastmove) {
     int boardsize = get_boardsize();
 
     myprintf("\n   ");
@@ -367,7 +445,8 @@ void FastBoard::display_board(int lastmove) {
     myprintf("\n");
 }
 
-void FastBoard::print_columns() {
+template <int Size>
+void BasicFastBoard<Size>::print_columns() {
     for (int i = 0; i < get_boardsize(); i++) {
         if (i < 25) {
             myprintf("%c ", (('a' + i < 'i') ? 'a' + i : 'a' + i + 1));
@@ -378,7 +457,8 @@ void FastBoard::print_columns() {
     myprintf("\n");
 }
 
-void FastBoard::merge_strings(const int ip, const int aip) {
+template <int Size>
+void BasicFastBoard<Size>::merge_strings(const int ip, const int aip) {
     assert(ip != MAXSQ && aip != MAXSQ);
 
     /* merge stones */
@@ -419,7 +499,8 @@ void FastBoard::merge_strings(const int ip, const int aip) {
     std::swap(m_next[aip], m_next[ip]);
 }
 
-bool FastBoard::is_eye(const int color, const int i) const {
+template <int Size>
+bool BasicFastBoard<Size>::is_eye(const int color, const int i) const {
     /* check for 4 neighbors of the same color */
     int ownsurrounded = (m_neighbours[i] & s_eyemask[color]);
 
@@ -456,7 +537,8 @@ bool FastBoard::is_eye(const int color, const int i) const {
     return true;
 }
 
-std::string FastBoard::move_to_text(int move) const {
+template <int Size>
+std::string BasicFastBoard<Size>::move_to_text(int move) const {
     std::ostringstream result;
 
     int column = move % m_squaresize;
@@ -467,19 +549,19 @@ std::string FastBoard::move_to_text(int move) const {
 
     // myprintf("Move: %d, m_squaresize: %d, row: %d.\n",
     // 	     move, m_squaresize,);
-    assert(move == FastBoard::PASS
-           || move == FastBoard::RESIGN
+    assert(move == PASS
+           || move == RESIGN
            || (row >= 0 && row < m_boardsize));
-    assert(move == FastBoard::PASS
-           || move == FastBoard::RESIGN
+    assert(move == PASS
+           || move == RESIGN
            || (column >= 0 && column < m_boardsize));
 
     if (move >= 0 && move <= m_maxsq) {
         result << static_cast<char>(column < 8 ? 'A' + column : 'A' + column + 1);
         result << (row + 1);
-    } else if (move == FastBoard::PASS) {
+    } else if (move == PASS) {
         result << "pass";
-    } else if (move == FastBoard::RESIGN) {
+    } else if (move == RESIGN) {
         result << "resign";
     } else {
         result << "error";
@@ -488,7 +570,8 @@ std::string FastBoard::move_to_text(int move) const {
     return result.str();
 }
 
-std::string FastBoard::move_to_text_sgf(int move) const {
+template <int Size>
+std::string BasicFastBoard<Size>::move_to_text_sgf(int move) const {
     std::ostringstream result;
 
     int column = move % m_squaresize;
@@ -497,11 +580,11 @@ std::string FastBoard::move_to_text_sgf(int move) const {
     column--;
     row--;
 
-    assert(move == FastBoard::PASS
-           || move == FastBoard::RESIGN
+    assert(move == PASS
+           || move == RESIGN
            || (row >= 0 && row < m_boardsize));
-    assert(move == FastBoard::PASS
-           || move == FastBoard::RESIGN
+    assert(move == PASS
+           || move == RESIGN
            || (column >= 0 && column < m_boardsize));
 
     // SGF inverts rows
@@ -518,9 +601,9 @@ std::string FastBoard::move_to_text_sgf(int move) const {
         } else {
             result << static_cast<char>('A' + row - 26);
         }
-    } else if (move == FastBoard::PASS) {
+    } else if (move == PASS) {
         result << "tt";
-    } else if (move == FastBoard::RESIGN) {
+    } else if (move == RESIGN) {
         result << "tt";
     } else {
         result << "error";
@@ -529,7 +612,7 @@ std::string FastBoard::move_to_text_sgf(int move) const {
     return result.str();
 }
 
-bool FastBoard::starpoint(int size, int point) {
+bool FastBoardBase::starpoint(int size, int point) {
     int stars[3];
     int points[2];
     int hits = 0;
@@ -556,39 +639,46 @@ bool FastBoard::starpoint(int size, int point) {
     return hits >= 2;
 }
 
-bool FastBoard::starpoint(int size, int x, int y) {
+bool FastBoardBase::starpoint(int size, int x, int y) {
     return starpoint(size, y * size + x);
 }
 
-int FastBoard::get_prisoners(int side)  const {
+template <int Size>
+int BasicFastBoard<Size>::get_prisoners(int side)  const {
     assert(side == WHITE || side == BLACK);
 
     return m_prisoners[side];
 }
 
-void FastBoard::set_prisoners(int side, int amount) {
+template <int Size>
+void BasicFastBoard<Size>::set_prisoners(int side, int amount) {
     assert(side == WHITE || side == BLACK);
 
     m_prisoners[side] = amount;
 }
 
-int FastBoard::get_to_move() const {
+template <int Size>
+int BasicFastBoard<Size>::get_to_move() const {
     return m_tomove;
 }
 
-bool FastBoard::black_to_move() const {
+template <int Size>
+bool BasicFastBoard<Size>::black_to_move() const {
     return m_tomove == BLACK;
 }
 
-bool FastBoard::white_to_move() const {
+template <int Size>
+bool BasicFastBoard<Size>::white_to_move() const {
     return m_tomove == WHITE;
 }
 
-void FastBoard::set_to_move(int tomove) {
+template <int Size>
+void BasicFastBoard<Size>::set_to_move(int tomove) {
     m_tomove = tomove;
 }
 
-std::string FastBoard::get_string(int vertex) const {
+template <int Size>
+std::string BasicFastBoard<Size>::get_string(int vertex) const {
     std::string result;
 
     int start = m_parent[vertex];
@@ -606,7 +696,8 @@ std::string FastBoard::get_string(int vertex) const {
     return result;
 }
 
-std::string FastBoard::get_stone_list() const {
+template <int Size>
+std::string BasicFastBoard<Size>::get_stone_list() const {
     std::string result;
 
     for (int i = 0; i < m_boardsize; i++) {
@@ -626,3 +717,12 @@ std::string FastBoard::get_stone_list() const {
 
     return result;
 }
+
+// The sizes there are boards of. The engine only plays on BOARD_SIZE,
+// the network and the search are built for it alone.
+template class BasicFastBoard<7>;
+template class BasicFastBoard<9>;
+template class BasicFastBoard<19>;
+#if BOARD_SIZE != 7 && BOARD_SIZE != 9 && BOARD_SIZE != 19
+template class BasicFastBoard<BOARD_SIZE>;
+#endif
@@ -22,13 +22,14 @@
 #include "config.h"
 
 #include <array>
+#include <bitset>
 #include <queue>
 #include <string>
 #include <utility>
 #include <vector>
 
-class FastBoard {
-    friend class FastState;
+// What the boards of all sizes share.
+class FastBoardBase {
 public:
     /*
         neighbor counts are up to 4, so 3 bits is ok,
@@ -38,9 +39,11 @@ public:
     static constexpr int NBR_MASK = (1 << NBR_SHIFT) - 1;
 
     /*
-        highest existing square
+        largest size the boards are built for, see the end of
+        FastBoard.cpp, and its highest square
     */
-    static constexpr int MAXSQ = ((BOARD_SIZE + 2) * (BOARD_SIZE + 2));
+    static constexpr int MAX_SIZE = BOARD_SIZE > 19 ? BOARD_SIZE : 19;
+    static constexpr int MAX_MAXSQ = (MAX_SIZE + 2) * (MAX_SIZE + 2);
 
     /*
         infinite score
@@ -69,7 +72,44 @@ public:
     using movescore_t = std::pair<int, float>;
     using scoredmoves_t = std::vector<movescore_t>;
 
+    static bool starpoint(int size, int point);
+    static bool starpoint(int size, int x, int y);
+
+protected:
+    /*
+        bit masks to detect eyes on neighbors
+    */
+    static const std::array<int,      2> s_eyemask;
+    static const std::array<square_t, 4> s_cinvert; /* color inversion */
+};
+
+// A board of up to Size x Size points, the size is set by reset_board.
+// The arrays are sized for Size at compile time. The engine plays on
+// FastBoard, of BOARD_SIZE.
+template <int Size>
+class BasicFastBoard : public FastBoardBase {
+    friend class FastState;
+public:
+    /*
+        highest existing square
+    */
+    static constexpr int MAXSQ = ((Size + 2) * (Size + 2));
+
+    /*
+        stones of each color, one bit per point at y * Size + x
+    */
+    using stones_t = std::array<std::bitset<Size * Size>, 2>;
+
+    /*
+        points to play on, one bit per point at y * Size + x, as
+        the policy of the network
+    */
+    using moves_t = std::bitset<Size * Size>;
+
     int get_boardsize(void) const;
+    // The empty points, i from 0 to get_empty_count() - 1.
+    int get_empty_count() const;
+    int get_empty(int i) const;
     square_t get_square(int x, int y) const;
     square_t get_square(int vertex) const ;
     int get_vertex(int i, int j) const;
@@ -78,6 +118,8 @@ public:
     std::pair<int, int> get_xy(int vertex) const;
 
     bool is_suicide(int i, int color) const;
+    // The empty points that aren't suicide for color.
+    moves_t get_playable(int color) const;
     int count_pliberties(const int i) const;
     bool is_eye(const int color, const int vtx) const;
 
@@ -85,8 +127,9 @@ public:
     float nihon_score(float komi) const;
 
     int calc_is_color(int color) const;
+    const stones_t& get_stones() const;
     void set_passPassPosition();
-    FastBoard * get_passPassPosition();
+    BasicFastBoard * get_passPassPosition();
 
     int get_prisoners(int side) const;
     void set_prisoners(int side, int amount);
@@ -103,17 +146,15 @@ public:
     void reset_board(int size);
     void display_board(int lastmove = -1);
 
-    static bool starpoint(int size, int point);
-    static bool starpoint(int size, int x, int y);
-
 protected:
     /*
-        bit masks to detect eyes on neighbors
+        one bit per square, the small boards fit in one or two words
     */
-    static const std::array<int,      2> s_eyemask;
-    static const std::array<square_t, 4> s_cinvert; /* color inversion */
+    using bitboard_t = std::bitset<MAXSQ>;
 
     std::array<square_t, MAXSQ>            m_square;      /* board contents */
+    std::array<bitboard_t, 3>              m_bits;        /* bits per content */
+    stones_t                               m_stone_bits;  /* stones per color */
     std::array<unsigned short, MAXSQ+1>    m_next;        /* next stone in string */
     std::array<unsigned short, MAXSQ+1>    m_parent;      /* parent node of string */
     std::array<unsigned short, MAXSQ+1>    m_libs;        /* liberties per string parent */
@@ -121,7 +162,7 @@ protected:
     std::array<unsigned short, MAXSQ>      m_neighbours;  /* counts of neighboring stones */
     std::array<int, 4>                     m_dirs;        /* movement directions 4 way */
     std::array<int, 2>                     m_prisoners;   /* prisoners per color */
-    FastBoard                             *m_pp_board_pos;/* board position after a double pass */
+    BasicFastBoard                        *m_pp_board_pos;/* board position after a double pass */
     std::array<unsigned short, MAXSQ>      m_empty;       /* empty squares */
     std::array<unsigned short, MAXSQ>      m_empty_idx;   /* indexes of square */
     int m_empty_cnt;                                      /* count of empties */
@@ -132,6 +173,11 @@ protected:
     int m_boardsize;
     int m_squaresize;
 
+    const bitboard_t& get_bitboard(int content) const;
+    // Moves vertex from the bits of old_content to those of content.
+    void update_bits(int vertex, square_t old_content, square_t content);
+    bitboard_t spread(const bitboard_t& from, const bitboard_t& through) const;
+
     int calc_reach_color(int color) const;
 
     int count_neighbours(const int color, const int i) const;
@@ -141,4 +187,6 @@ protected:
     void print_columns();
 };
 
+using FastBoard = BasicFastBoard<BOARD_SIZE>;
+
 #endif
@@ -71,6 +71,15 @@ bool FastState::is_move_legal(int color, int vertex) {
                 !board.is_suicide(vertex, color));
 }
 
+FastBoard::moves_t FastState::get_legal_moves(const int color) const {
+    auto moves = board.get_playable(color);
+    if (m_komove != 0) {
+        const auto xy = board.get_xy(m_komove);
+        moves.reset(xy.second * BOARD_SIZE + xy.first);
+    }
+    return moves;
+}
+
 void FastState::play_move(int vertex) {
     play_move(board.m_tomove, vertex);
 }
@@ -103,6 +112,19 @@ void FastState::play_move(int color, int vertex) {
     board.m_hash ^= Zobrist::zobrist_pass[get_passes()];
 }
 
+std::uint64_t FastState::get_canonical_hash(int& symmetry) const {
+    auto res = board.get_hash();
+    symmetry = 0;
+    for (auto s = 1; s < 8; s++) {
+        const auto hash = board.calc_symmetry_hash(m_komove, s);
+        if (hash < res) {
+            res = hash;
+            symmetry = s;
+        }
+    }
+    return res;
+}
+
 size_t FastState::get_movenum() const {
     return m_movenum;
 }
@@ -36,6 +36,9 @@ public:
     void play_move(int vertex);
 
     bool is_move_legal(int color, int vertex);
+    // The points where is_move_legal() is true, found at once. The pass
+    // is always legal.
+    FastBoard::moves_t get_legal_moves(int color) const;
 
     void set_komi(float komi);
     float get_komi() const;
@@ -49,6 +52,10 @@ public:
 
     float final_score() const;
 
+    // Smallest hash over the 8 symmetries of the position, and the
+    // symmetry that gives it.
+    std::uint64_t get_canonical_hash(int& symmetry) const;
+
     size_t get_movenum() const;
     int get_last_move() const;
     void display_state();
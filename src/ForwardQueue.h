@@ -0,0 +1,342 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FORWARDQUEUE_H_INCLUDED
+#define FORWARDQUEUE_H_INCLUDED
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Metrics.h"
+#include "Profile.h"
+#include "Timing.h"
+#include "Utils.h"
+
+// Collects network evaluations from many search threads so that a worker
+// can run them through the network as a single batch. The batches take
+// the tasks with the earliest Utils::EvalPriority deadline first.
+template <typename T>
+class ForwardQueue {
+public:
+    using clock = std::chrono::steady_clock;
+
+    // A deadline further away counts as this long after the task was
+    // queued, so no evaluation waits longer than that behind newer ones.
+    static constexpr auto MAX_DELAY = std::chrono::seconds(5);
+
+    class ForwardTask {
+    public:
+        const std::vector<T> * input;
+        std::vector<T> * output_pol;
+        std::vector<T> * output_val;
+        std::vector<T> * output_vbe;
+        std::promise<void> prom;
+        clock::time_point submitted;
+        // The queue is sorted by it.
+        clock::time_point due;
+        int game;
+#ifdef USE_PROFILING
+        Time queued;
+#endif
+        ForwardTask(const std::vector<T> * in,
+                    std::vector<T> * out_pol,
+                    std::vector<T> * out_val,
+                    std::vector<T> * out_vbe)
+            : input(in), output_pol(out_pol),
+              output_val(out_val), output_vbe(out_vbe),
+              submitted(clock::now()),
+              due(std::min(Utils::get_eval_priority().deadline,
+                           submitted + MAX_DELAY)),
+              game(Utils::get_eval_priority().game) {}
+    };
+
+    // Tasks taken off the queue by a worker. The inputs are stored back
+    // to back, and the outputs must be filled the same way.
+    class Batch {
+    public:
+        std::vector<ForwardTask*> tasks;
+        std::vector<T> input;
+        std::vector<T> output_pol;
+        std::vector<T> output_val;
+        std::vector<T> output_vbe;
+        int size() const {
+            return static_cast<int>(tasks.size());
+        }
+    };
+
+    // Runs batch_size positions stored back to back in the input,
+    // and fills the outputs the same way.
+    using forward_fn = std::function<void(const std::vector<T>& input,
+                                          std::vector<T>& output_pol,
+                                          std::vector<T>& output_val,
+                                          std::vector<T>& output_vbe,
+                                          int batch_size)>;
+
+    // Blocks the calling search thread until its position was evaluated.
+    // Throws std::runtime_error if the queue is shut down before that.
+    void forward(const std::vector<T>& input,
+                 std::vector<T>& output_pol,
+                 std::vector<T>& output_val,
+                 std::vector<T>& output_vbe);
+
+    // Worker loop. Waits at most max_wait for a batch to fill up, runs it,
+    // and returns only after shutdown() was called.
+    void run_worker(size_t max_batch, std::chrono::microseconds max_wait,
+                    forward_fn forward);
+
+    // Building blocks for workers that keep several batches in flight.
+    // pop_batch() takes up to max_batch tasks and gathers their inputs,
+    // waiting at most max_wait for the batch to fill up. If wait_for_work
+    // is set, it first blocks until there is at least one task, otherwise
+    // the batch may come back empty. Returns false after shutdown().
+    bool pop_batch(Batch& batch, size_t max_batch,
+                   std::chrono::microseconds max_wait, bool wait_for_work);
+    // Hands the outputs back to the search threads.
+    void complete(Batch& batch);
+    void fail(Batch& batch, std::exception_ptr error);
+
+    // The evaluations still queued and all later ones fail.
+    void shutdown();
+
+    // Print how full the batches were and how long the evaluations of
+    // every game waited in the queue since the last call, and reset
+    // the counters.
+    void dump_stats(int max_batch);
+
+private:
+    struct QueueWait {
+        std::uint64_t evals{0};
+        double total{0.0};
+        double max{0.0};
+    };
+
+    std::deque<ForwardTask*> m_queue;
+    // By game, under m_mutex.
+    std::vector<QueueWait> m_waits;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    bool m_running{true};
+
+    std::atomic<std::uint64_t> m_batches{0};
+    std::atomic<std::uint64_t> m_evals{0};
+};
+
+template <typename T>
+void ForwardQueue<T>::forward(const std::vector<T>& input,
+                              std::vector<T>& output_pol,
+                              std::vector<T>& output_val,
+                              std::vector<T>& output_vbe) {
+    ForwardTask task(&input, &output_pol, &output_val, &output_vbe);
+    auto f = task.prom.get_future();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_running) {
+            throw std::runtime_error("The NN evaluation queue is shut down.");
+        }
+        // Mostly at the end, as the deadlines are alike.
+        const auto pos = std::upper_bound(
+            begin(m_queue), end(m_queue), &task,
+            [](const ForwardTask* a, const ForwardTask* b) {
+                return a->due < b->due;
+            });
+        m_queue.insert(pos, &task);
+    }
+    m_cv.notify_one();
+    f.get();
+}
+
+template <typename T>
+constexpr std::chrono::seconds ForwardQueue<T>::MAX_DELAY;
+
+template <typename T>
+void ForwardQueue<T>::shutdown() {
+    const auto error = std::make_exception_ptr(
+        std::runtime_error("The NN evaluation queue is shut down."));
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_running = false;
+        // The workers take no more batches, nothing else would wake the
+        // search threads of these.
+        for (const auto task : m_queue) {
+            task->prom.set_exception(error);
+        }
+        m_queue.clear();
+    }
+    m_cv.notify_all();
+}
+
+template <typename T>
+void ForwardQueue<T>::dump_stats(const int max_batch) {
+    const auto batches = m_batches.exchange(0);
+    const auto evals = m_evals.exchange(0);
+    if (batches == 0) {
+        return;
+    }
+    const auto avg_fill = double(evals) / double(batches);
+    Utils::myprintf("%llu NN batches, average fill %.2f/%d (%.1f%%)\n",
+                    static_cast<unsigned long long>(batches), avg_fill,
+                    max_batch, 100.0 * avg_fill / max_batch);
+
+    auto waits = std::vector<QueueWait>();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        waits.swap(m_waits);
+    }
+    for (auto game = size_t{0}; game < waits.size(); game++) {
+        const auto& wait = waits[game];
+        if (wait.evals == 0) {
+            continue;
+        }
+        const auto label = waits.size() > 1
+            ? "Game " + std::to_string(game) + ": " : std::string();
+        Utils::myprintf("%sNN queue wait %.3f ms average, %.3f ms max\n",
+                        label.c_str(), 1000.0 * wait.total / wait.evals,
+                        1000.0 * wait.max);
+    }
+}
+
+template <typename T>
+bool ForwardQueue<T>::pop_batch(Batch& batch, const size_t max_batch,
+                                const std::chrono::microseconds max_wait,
+                                const bool wait_for_work) {
+    batch.tasks.clear();
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (wait_for_work) {
+            m_cv.wait(lock, [this] {
+                return !m_running || !m_queue.empty();
+            });
+        }
+        if (!m_running) {
+            return false;
+        }
+        // Give the other search threads a chance to fill the batch.
+        if (m_queue.size() < max_batch) {
+            m_cv.wait_for(lock, max_wait, [this, max_batch] {
+                return !m_running || m_queue.size() >= max_batch;
+            });
+        }
+        // Another worker may have emptied the queue in the meantime.
+        const auto count = std::min(max_batch, m_queue.size());
+        std::copy_n(begin(m_queue), count, std::back_inserter(batch.tasks));
+        m_queue.erase(begin(m_queue), begin(m_queue) + count);
+
+        const auto now = clock::now();
+        for (const auto task : batch.tasks) {
+            const auto game = static_cast<size_t>(std::max(0, task->game));
+            if (game >= m_waits.size()) {
+                m_waits.resize(game + 1);
+            }
+            auto& wait = m_waits[game];
+            const auto seconds =
+                std::chrono::duration<double>(now - task->submitted).count();
+            wait.evals++;
+            wait.total += seconds;
+            wait.max = std::max(wait.max, seconds);
+        }
+    }
+    if (batch.tasks.empty()) {
+        return true;
+    }
+
+    // All tasks for the same network have the same sizes.
+    const auto& first = *batch.tasks[0];
+    const auto in_size = first.input->size();
+    const auto count = batch.tasks.size();
+
+    batch.input.resize(count * in_size);
+    batch.output_pol.resize(count * first.output_pol->size());
+    batch.output_val.resize(count * first.output_val->size());
+    batch.output_vbe.resize(count * first.output_vbe->size());
+#ifdef USE_PROFILING
+    const auto popped = Time();
+#endif
+    for (auto i = size_t{0}; i < count; i++) {
+        std::copy(begin(*batch.tasks[i]->input), end(*batch.tasks[i]->input),
+                  begin(batch.input) + i * in_size);
+#ifdef USE_PROFILING
+        Profile::record(Profile::QUEUE, batch.tasks[i]->queued, popped);
+#endif
+    }
+    return true;
+}
+
+template <typename T>
+void ForwardQueue<T>::complete(Batch& batch) {
+    const auto count = batch.tasks.size();
+    m_batches++;
+    m_evals += count;
+    Metrics::observe(Metrics::NN_BATCH_SIZE, count);
+
+    const auto pol_size = batch.output_pol.size() / count;
+    const auto val_size = batch.output_val.size() / count;
+    const auto vbe_size = batch.output_vbe.size() / count;
+    for (auto i = size_t{0}; i < count; i++) {
+        auto& task = *batch.tasks[i];
+        std::copy_n(begin(batch.output_pol) + i * pol_size, pol_size,
+                    begin(*task.output_pol));
+        std::copy_n(begin(batch.output_val) + i * val_size, val_size,
+                    begin(*task.output_val));
+        std::copy_n(begin(batch.output_vbe) + i * vbe_size, vbe_size,
+                    begin(*task.output_vbe));
+        task.prom.set_value();
+    }
+    batch.tasks.clear();
+}
+
+template <typename T>
+void ForwardQueue<T>::fail(Batch& batch, std::exception_ptr error) {
+    for (auto task : batch.tasks) {
+        task->prom.set_exception(error);
+    }
+    batch.tasks.clear();
+}
+
+template <typename T>
+void ForwardQueue<T>::run_worker(const size_t max_batch,
+                                 const std::chrono::microseconds max_wait,
+                                 forward_fn forward) {
+    auto batch = Batch();
+    while (pop_batch(batch, max_batch, max_wait, true)) {
+        if (batch.tasks.empty()) {
+            continue;
+        }
+        try {
+            forward(batch.input, batch.output_pol, batch.output_val,
+                    batch.output_vbe, batch.size());
+        } catch (...) {
+            fail(batch, std::current_exception());
+            continue;
+        }
+        complete(batch);
+    }
+}
+
+#endif
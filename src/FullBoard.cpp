@@ -20,6 +20,7 @@
 
 #include <array>
 #include <cassert>
+#include <utility>
 
 #include "GTP.h"
 #include "FullBoard.h"
@@ -28,40 +29,44 @@
 
 using namespace Utils;
 
-int FullBoard::remove_string(int i) {
+template <int Size>
+int BasicFullBoard<Size>::remove_string(int i) {
     int pos = i;
     int removed = 0;
-    int color = m_square[i];
+    int color = this->m_square[i];
 
     do {
-        m_hash    ^= Zobrist::zobrist[m_square[pos]][pos];
-        m_ko_hash ^= Zobrist::zobrist[m_square[pos]][pos];
+        m_hash    ^= Zobrist::zobrist[this->m_square[pos]][pos];
+        m_ko_hash ^= Zobrist::zobrist[this->m_square[pos]][pos];
 
-        m_square[pos] = EMPTY;
-        m_parent[pos] = MAXSQ;
+        this->update_bits(pos, FastBoardBase::square_t(color),
+                          FastBoardBase::EMPTY);
+        this->m_square[pos] = FastBoardBase::EMPTY;
+        this->m_parent[pos] = this->MAXSQ;
 
-        remove_neighbour(pos, color);
+        this->remove_neighbour(pos, color);
 
-        m_empty_idx[pos]      = m_empty_cnt;
-        m_empty[m_empty_cnt]  = pos;
-        m_empty_cnt++;
+        this->m_empty_idx[pos]            = this->m_empty_cnt;
+        this->m_empty[this->m_empty_cnt]  = pos;
+        this->m_empty_cnt++;
 
-        m_hash    ^= Zobrist::zobrist[m_square[pos]][pos];
-        m_ko_hash ^= Zobrist::zobrist[m_square[pos]][pos];
+        m_hash    ^= Zobrist::zobrist[this->m_square[pos]][pos];
+        m_ko_hash ^= Zobrist::zobrist[this->m_square[pos]][pos];
 
         removed++;
-        pos = m_next[pos];
+        pos = this->m_next[pos];
     } while (pos != i);
 
     return removed;
 }
 
-std::uint64_t FullBoard::calc_ko_hash(void) {
+template <int Size>
+std::uint64_t BasicFullBoard<Size>::calc_ko_hash(void) {
     auto res = Zobrist::zobrist_empty;
 
-    for (int i = 0; i < m_maxsq; i++) {
-        if (m_square[i] != INVAL) {
-            res ^= Zobrist::zobrist[m_square[i]][i];
+    for (int i = 0; i < this->m_maxsq; i++) {
+        if (this->m_square[i] != FastBoardBase::INVAL) {
+            res ^= Zobrist::zobrist[this->m_square[i]][i];
         }
     }
 
@@ -70,20 +75,21 @@ std::uint64_t FullBoard::calc_ko_hash(void) {
     return res;
 }
 
-std::uint64_t FullBoard::calc_hash(int komove) {
+template <int Size>
+std::uint64_t BasicFullBoard<Size>::calc_hash(int komove) {
     auto res = Zobrist::zobrist_empty;
 
-    for (int i = 0; i < m_maxsq; i++) {
-        if (m_square[i] != INVAL) {
-            res ^= Zobrist::zobrist[m_square[i]][i];
+    for (int i = 0; i < this->m_maxsq; i++) {
+        if (this->m_square[i] != FastBoardBase::INVAL) {
+            res ^= Zobrist::zobrist[this->m_square[i]][i];
         }
     }
 
     /* prisoner hashing is rule set dependent */
-    res ^= Zobrist::zobrist_pris[0][m_prisoners[0]];
-    res ^= Zobrist::zobrist_pris[1][m_prisoners[1]];
+    res ^= Zobrist::zobrist_pris[0][this->m_prisoners[0]];
+    res ^= Zobrist::zobrist_pris[1][this->m_prisoners[1]];
 
-    if (m_tomove == BLACK) {
+    if (this->m_tomove == FastBoardBase::BLACK) {
         res ^= Zobrist::zobrist_blacktomove;
     }
 
@@ -94,92 +100,142 @@ std::uint64_t FullBoard::calc_hash(int komove) {
     return res;
 }
 
-std::uint64_t FullBoard::get_hash(void) const {
+template <int Size>
+std::uint64_t BasicFullBoard<Size>::get_hash(void) const {
     return m_hash;
 }
 
-std::uint64_t FullBoard::get_ko_hash(void) const {
+template <int Size>
+std::uint64_t BasicFullBoard<Size>::get_ko_hash(void) const {
     return m_ko_hash;
 }
 
-void FullBoard::set_to_move(int tomove) {
-    if (m_tomove != tomove) {
+template <int Size>
+int BasicFullBoard<Size>::get_symmetry_vertex(int vertex, int symmetry) const {
+    assert(symmetry >= 0 && symmetry < 8);
+    auto xy = this->get_xy(vertex);
+    auto x = xy.first;
+    auto y = xy.second;
+
+    if (symmetry >= 4) {
+        std::swap(x, y);
+        symmetry -= 4;
+    }
+    if (symmetry & 1) {
+        y = this->m_boardsize - y - 1;
+    }
+    if (symmetry & 2) {
+        x = this->m_boardsize - x - 1;
+    }
+
+    return this->get_vertex(x, y);
+}
+
+template <int Size>
+std::uint64_t BasicFullBoard<Size>::calc_symmetry_hash(int komove,
+                                                     int symmetry) const {
+    // Only the points move, so swap their terms in the hash
+    // for the ones of their images.
+    auto res = m_hash;
+
+    for (int y = 0; y < this->m_boardsize; y++) {
+        for (int x = 0; x < this->m_boardsize; x++) {
+            const auto vertex = this->get_vertex(x, y);
+            const auto sym_vertex = get_symmetry_vertex(vertex, symmetry);
+            res ^= Zobrist::zobrist[this->m_square[vertex]][vertex];
+            res ^= Zobrist::zobrist[this->m_square[vertex]][sym_vertex];
+        }
+    }
+
+    if (komove != 0) {
+        res ^= Zobrist::zobrist_ko[komove];
+        res ^= Zobrist::zobrist_ko[get_symmetry_vertex(komove, symmetry)];
+    }
+
+    return res;
+}
+
+template <int Size>
+void BasicFullBoard<Size>::set_to_move(int tomove) {
+    if (this->m_tomove != tomove) {
         m_hash ^= Zobrist::zobrist_blacktomove;
     }
-    FastBoard::set_to_move(tomove);
+    BasicFastBoard<Size>::set_to_move(tomove);
 }
 
-int FullBoard::update_board(const int color, const int i) {
-    assert(i != FastBoard::PASS);
-    assert(m_square[i] == EMPTY);
+template <int Size>
+int BasicFullBoard<Size>::update_board(const int color, const int i) {
+    assert(i != FastBoardBase::PASS);
+    assert(this->m_square[i] == FastBoardBase::EMPTY);
 
-    m_hash ^= Zobrist::zobrist[m_square[i]][i];
-    m_ko_hash ^= Zobrist::zobrist[m_square[i]][i];
+    m_hash ^= Zobrist::zobrist[this->m_square[i]][i];
+    m_ko_hash ^= Zobrist::zobrist[this->m_square[i]][i];
 
-    m_square[i] = square_t(color);
-    m_next[i] = i;
-    m_parent[i] = i;
-    m_libs[i] = count_pliberties(i);
-    m_stones[i] = 1;
+    this->update_bits(i, FastBoardBase::EMPTY, FastBoardBase::square_t(color));
+    this->m_square[i] = FastBoardBase::square_t(color);
+    this->m_next[i] = i;
+    this->m_parent[i] = i;
+    this->m_libs[i] = this->count_pliberties(i);
+    this->m_stones[i] = 1;
 
-    m_hash ^= Zobrist::zobrist[m_square[i]][i];
-    m_ko_hash ^= Zobrist::zobrist[m_square[i]][i];
+    m_hash ^= Zobrist::zobrist[this->m_square[i]][i];
+    m_ko_hash ^= Zobrist::zobrist[this->m_square[i]][i];
 
     /* update neighbor liberties (they all lose 1) */
-    add_neighbour(i, color);
+    this->add_neighbour(i, color);
 
     /* did we play into an opponent eye? */
-    auto eyeplay = (m_neighbours[i] & s_eyemask[!color]);
+    auto eyeplay = (this->m_neighbours[i] & this->s_eyemask[!color]);
 
     auto captured_stones = 0;
     int captured_sq;
 
     for (int k = 0; k < 4; k++) {
-        int ai = i + m_dirs[k];
+        int ai = i + this->m_dirs[k];
 
-        if (m_square[ai] == !color) {
-            if (m_libs[m_parent[ai]] <= 0) {
+        if (this->m_square[ai] == !color) {
+            if (this->m_libs[this->m_parent[ai]] <= 0) {
                 int this_captured = remove_string(ai);
                 captured_sq = ai;
                 captured_stones += this_captured;
             }
-        } else if (m_square[ai] == color) {
-            int ip = m_parent[i];
-            int aip = m_parent[ai];
+        } else if (this->m_square[ai] == color) {
+            int ip = this->m_parent[i];
+            int aip = this->m_parent[ai];
 
             if (ip != aip) {
-                if (m_stones[ip] >= m_stones[aip]) {
-                    merge_strings(ip, aip);
+                if (this->m_stones[ip] >= this->m_stones[aip]) {
+                    this->merge_strings(ip, aip);
                 } else {
-                    merge_strings(aip, ip);
+                    this->merge_strings(aip, ip);
                 }
             }
         }
     }
 
-    m_hash ^= Zobrist::zobrist_pris[color][m_prisoners[color]];
-    m_prisoners[color] += captured_stones;
-    if (cfg_rules == JAPANESE && get_passPassPosition() != NULL) {
+    m_hash ^= Zobrist::zobrist_pris[color][this->m_prisoners[color]];
+    this->m_prisoners[color] += captured_stones;
+    if (cfg_rules == JAPANESE && this->get_passPassPosition() != NULL) {
         //post-game moves get refund points when playing
-        m_prisoners[color]++;
+        this->m_prisoners[color]++;
     }
-    m_hash ^= Zobrist::zobrist_pris[color][m_prisoners[color]];
+    m_hash ^= Zobrist::zobrist_pris[color][this->m_prisoners[color]];
 
     /* move last vertex in list to our position */
-    auto lastvertex = m_empty[--m_empty_cnt];
-    m_empty_idx[lastvertex] = m_empty_idx[i];
-    m_empty[m_empty_idx[i]] = lastvertex;
+    auto lastvertex = this->m_empty[--this->m_empty_cnt];
+    this->m_empty_idx[lastvertex] = this->m_empty_idx[i];
+    this->m_empty[this->m_empty_idx[i]] = lastvertex;
 
     /* check whether we still live (i.e. detect suicide) */
-    if (m_libs[m_parent[i]] == 0) {
+    if (this->m_libs[this->m_parent[i]] == 0) {
         assert(captured_stones == 0);
         remove_string(i);
     }
 
     /* check for possible simple ko */
     if (captured_stones == 1 && eyeplay) {
-        assert(get_square(captured_sq) == FastBoard::EMPTY
-                && !is_suicide(captured_sq, !color));
+        assert(this->get_square(captured_sq) == FastBoardBase::EMPTY
+                && !this->is_suicide(captured_sq, !color));
         return captured_sq;
     }
 
@@ -187,15 +243,25 @@ int FullBoard::update_board(const int color, const int i) {
     return 0;
 }
 
-void FullBoard::display_board(int lastmove) {
-    FastBoard::display_board(lastmove);
+template <int Size>
+void BasicFullBoard<Size>::display_board(int lastmove) {
+    BasicFastBoard<Size>::display_board(lastmove);
 
     myprintf("Hash: %llX Ko-Hash: %llX\n\n", get_hash(), get_ko_hash());
 }
 
-void FullBoard::reset_board(int size) {
-    FastBoard::reset_board(size);
+template <int Size>
+void BasicFullBoard<Size>::reset_board(int size) {
+    BasicFastBoard<Size>::reset_board(size);
 
     calc_hash();
     calc_ko_hash();
 }
+
+// The sizes of BasicFastBoard, see the end of FastBoard.cpp.
+template class BasicFullBoard<7>;
+template class BasicFullBoard<9>;
+template class BasicFullBoard<19>;
+#if BOARD_SIZE != 7 && BOARD_SIZE != 9 && BOARD_SIZE != 19
+template class BasicFullBoard<BOARD_SIZE>;
+#endif
@@ -23,7 +23,10 @@
 #include <cstdint>
 #include "FastBoard.h"
 
-class FullBoard : public FastBoard {
+// A board with the hashes of its position, of any of the sizes of
+// BasicFastBoard. The engine plays on FullBoard, of BOARD_SIZE.
+template <int Size>
+class BasicFullBoard : public BasicFastBoard<Size> {
 public:
     int remove_string(int i);
     int update_board(const int color, const int i);
@@ -32,6 +35,10 @@ public:
     std::uint64_t calc_ko_hash(void);
     std::uint64_t get_hash(void) const;
     std::uint64_t get_ko_hash(void) const;
+    // Hash of the position transformed by one of the 8 board symmetries,
+    // numbered as in Network::get_nn_idx_symmetry.
+    std::uint64_t calc_symmetry_hash(int komove, int symmetry) const;
+    int get_symmetry_vertex(int vertex, int symmetry) const;
     void set_to_move(int tomove);
 
     void reset_board(int size);
@@ -41,4 +48,6 @@ public:
     std::uint64_t m_ko_hash;
 };
 
+using FullBoard = BasicFullBoard<BOARD_SIZE>;
+
 #endif
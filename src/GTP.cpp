@@ -21,23 +21,34 @@
 #include "GTP.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cctype>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <cstdlib>
+#include <deque>
 #include <exception>
 #include <fstream>
 #include <iostream>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <random>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "BulkEval.h"
 #include "FastBoard.h"
 #include "FullBoard.h"
 #include "GameState.h"
+#include "Metrics.h"
+#include "NNCache.h"
 #include "Network.h"
+#include "OpeningCache.h"
+#include "Profile.h"
+#include "Random.h"
 #include "SGFTree.h"
 #include "SMP.h"
 #include "Training.h"
@@ -51,10 +62,32 @@ using namespace Utils;
 // Configuration flags
 bool cfg_gtp_mode;
 bool cfg_allow_pondering;
+int cfg_ponder_replies;
 int cfg_num_threads;
 int cfg_max_threads;
+bool cfg_pin_threads;
+bool cfg_numa;
+bool cfg_huge_pages;
+std::vector<std::string> cfg_search_workers;
+int cfg_worker_port;
+int cfg_serve_games;
+int cfg_selfplay_games;
+int cfg_selfplay_parallel;
+std::string cfg_selfplay_output;
+int cfg_metrics_port;
 int cfg_max_playouts;
 int cfg_max_visits;
+int cfg_max_tree_mb;
+int cfg_max_memory_mb;
+bool cfg_transpositions;
+int cfg_cache_size_mb;
+bool cfg_cache_symmetries;
+CacheEviction::eviction_t cfg_cache_eviction;
+std::string cfg_shared_cache;
+int cfg_shared_cache_mb;
+std::string cfg_nn_daemon;
+std::string cfg_nn_client;
+std::string cfg_opening_cache;
 TimeManagement::enabled_t cfg_timemanage;
 int cfg_lagbuffer_cs;
 int cfg_resignpct;
@@ -70,25 +103,56 @@ int cfg_random_min_visits;
 float cfg_random_temp;
 std::uint64_t cfg_rng_seed;
 bool cfg_dumbpass;
-#ifdef USE_OPENCL
+#if defined(USE_OPENCL) || defined(USE_CUDA)
 std::vector<int> cfg_gpus;
+#endif
+#ifdef USE_OPENCL
 bool cfg_sgemm_exhaustive;
 bool cfg_tune_only;
+int cfg_pipeline_depth;
+int cfg_cpu_threads;
+Precision::precision_t cfg_precision;
 #endif
+int cfg_batch_size;
+int cfg_batch_wait;
+int cfg_leaf_batch;
+int cfg_speculate;
+int cfg_solve_empties;
+bool cfg_int8;
 float cfg_puct;
 float cfg_softmax_temp;
 float cfg_fpu_reduction;
 std::string cfg_weightsfile;
+std::vector<std::string> cfg_weightsfiles;
 std::string cfg_logfile;
 FILE* cfg_logfile_handle;
 bool cfg_quiet;
 std::string cfg_options_str;
 bool cfg_benchmark;
+std::string cfg_benchmark_suite;
+bool cfg_calibrate_threads;
+bool cfg_calibrate_leaf_batch;
 float cfg_blunder_thr;
+int cfg_gzip_level;
+bool cfg_binary_training;
+
+static std::uint64_t random_seed() {
+    // C++11 doesn't guarantee *anything* about how random this is,
+    // and in MinGW it isn't random at all. But we can mix it in, which
+    // helps when it *is* high quality (Linux, MSVC).
+    std::random_device rd;
+    std::ranlux48 gen(rd());
+    std::uint64_t seed1 = (gen() << 16) ^ gen();
+    // If the above fails, this is one of our best, portable, bets.
+    std::uint64_t seed2 = std::chrono::high_resolution_clock::
+        now().time_since_epoch().count();
+    return seed1 ^ seed2;
+}
 
 void GTP::setup_default_parameters() {
     cfg_gtp_mode = false;
     cfg_allow_pondering = true;
+    cfg_ponder_replies = 4;
     cfg_max_threads = std::max(1, std::min(SMP::get_num_cpus(), MAX_CPUS));
 #ifdef USE_OPENCL
     // If we will be GPU limited, using many threads won't help much.
@@ -96,19 +160,55 @@ void GTP::setup_default_parameters() {
 #else
     cfg_num_threads = cfg_max_threads;
 #endif
+    cfg_pin_threads = false;
+    cfg_numa = false;
+    cfg_huge_pages = false;
+    cfg_search_workers.clear();
+    cfg_worker_port = 0;
+    cfg_serve_games = 0;
+    cfg_selfplay_games = 0;
+    cfg_selfplay_parallel = 1;
+    cfg_selfplay_output = "selfplay";
+    cfg_metrics_port = 0;
     cfg_max_playouts = UCTSearch::UNLIMITED_PLAYOUTS;
     cfg_max_visits = UCTSearch::UNLIMITED_PLAYOUTS;
+    cfg_max_tree_mb = UCTSearch::DEFAULT_MAX_TREE_MB;
+    cfg_max_memory_mb = 0;
+    cfg_transpositions = false;
+    cfg_cache_size_mb = 0;
+    cfg_cache_symmetries = false;
+    cfg_cache_eviction = CacheEviction::CLOCK;
+    cfg_shared_cache = "";
+    cfg_shared_cache_mb = 256;
+    cfg_nn_daemon = "";
+    cfg_nn_client = "";
+    cfg_opening_cache = "";
     cfg_rules = CHINESE;
     cfg_prisoner_value = 0.0f;
     cfg_komi = 7.5f;
     cfg_lambda = 0.5f;
     cfg_timemanage = TimeManagement::AUTO;
     cfg_lagbuffer_cs = 100;
-#ifdef USE_OPENCL
+#if defined(USE_OPENCL) || defined(USE_CUDA)
     cfg_gpus = { };
+#endif
+#ifdef USE_OPENCL
     cfg_sgemm_exhaustive = false;
     cfg_tune_only = false;
+    cfg_pipeline_depth = 2;
+    cfg_cpu_threads = 0;
+#ifdef USE_HALF
+    cfg_precision = Precision::HALF;
+#else
+    cfg_precision = Precision::AUTO;
 #endif
+#endif
+    cfg_batch_size = 1;
+    cfg_batch_wait = 500;
+    cfg_leaf_batch = 1;
+    cfg_speculate = 0;
+    cfg_solve_empties = 0;
+    cfg_int8 = false;
     cfg_puct = 0.8f;
     cfg_softmax_temp = 1.0f;
     cfg_fpu_reduction = 0.25f;
@@ -125,18 +225,14 @@ void GTP::setup_default_parameters() {
     cfg_logfile_handle = nullptr;
     cfg_quiet = false;
     cfg_benchmark = false;
+    cfg_benchmark_suite.clear();
+    cfg_calibrate_threads = false;
+    cfg_calibrate_leaf_batch = false;
     cfg_blunder_thr = 0.0f;
+    cfg_gzip_level = 6;
+    cfg_binary_training = false;
 
-    // C++11 doesn't guarantee *anything* about how random this is,
-    // and in MinGW it isn't random at all. But we can mix it in, which
-    // helps when it *is* high quality (Linux, MSVC).
-    std::random_device rd;
-    std::ranlux48 gen(rd());
-    std::uint64_t seed1 = (gen() << 16) ^ gen();
-    // If the above fails, this is one of our best, portable, bets.
-    std::uint64_t seed2 = std::chrono::high_resolution_clock::
-        now().time_since_epoch().count();
-    cfg_rng_seed = seed1 ^ seed2;
+    cfg_rng_seed = random_seed();
 }
 
 const std::string GTP::s_commands[] = {
@@ -166,9 +262,126 @@ const std::string GTP::s_commands[] = {
     "kgs-time_settings",
     "kgs-game_over",
     "heatmap",
+    "lz-loadweights",
+    "lz-setnet",
+    "lz-cachestats",
+    "lz-clearcache",
+    "lz-seed",
+    "lz-lambda",
+    "lz-stats",
+    "lz-profile",
+    "lz-savetree",
+    "lz-loadtree",
+    "lz-saveopenings",
+    "lz-analyze",
+    "lz-komi-analyze",
+    ""
+};
+
+// Not time_left, the search threads copy the time control with the
+// game at every playout.
+const std::string GTP::s_queries[] = {
+    "protocol_version",
+    "name",
+    "version",
+    "known_command",
+    "list_commands",
+    "showboard",
+    "lz-cachestats",
+    "lz-stats",
     ""
 };
 
+bool GTP::is_query(const std::string& input) {
+    std::istringstream cmdstream(input);
+    std::string command;
+
+    cmdstream >> command;
+    // Skip the id
+    if (!command.empty()
+        && std::isdigit(static_cast<unsigned char>(command[0]))) {
+        cmdstream >> command;
+    }
+    std::transform(begin(command), end(command), begin(command),
+                   [](unsigned char c) { return std::tolower(c); });
+    for (int i = 0; s_queries[i].size() > 0; i++) {
+        if (command == s_queries[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+struct GTPReader::Lines {
+    std::deque<std::string> lines;
+    std::atomic<int> count{0};
+    std::atomic<bool> eof{false};
+    std::mutex mutex;
+    std::condition_variable condvar;
+};
+
+GTPReader::GTPReader() : m_lines(std::make_shared<Lines>()) {
+    m_thread = std::thread([lines = m_lines] {
+        auto input = std::string{};
+        while (std::getline(std::cin, input)) {
+            {
+                std::lock_guard<std::mutex> lock(lines->mutex);
+                lines->lines.emplace_back(std::move(input));
+                lines->count++;
+            }
+            lines->condvar.notify_one();
+        }
+        {
+            std::lock_guard<std::mutex> lock(lines->mutex);
+            lines->eof = true;
+        }
+        lines->condvar.notify_one();
+    });
+}
+
+GTPReader::~GTPReader() {
+    if (m_lines->eof) {
+        m_thread.join();
+    } else {
+        // The main loop only ends early on an error. A read of std::cin
+        // can't be interrupted, the thread has the lines to itself and
+        // ends with the process.
+        m_thread.detach();
+    }
+}
+
+bool GTPReader::next(std::string& line) {
+    std::unique_lock<std::mutex> lock(m_lines->mutex);
+    m_lines->condvar.wait(lock, [this] {
+        return m_lines->eof || !m_lines->lines.empty();
+    });
+    if (m_lines->lines.empty()) {
+        return false;
+    }
+    line = std::move(m_lines->lines.front());
+    m_lines->lines.pop_front();
+    m_lines->count--;
+    return true;
+}
+
+bool GTPReader::next_query(std::string& line) {
+    if (m_lines->count == 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(m_lines->mutex);
+    if (m_lines->lines.empty() || !GTP::is_query(m_lines->lines.front())) {
+        return false;
+    }
+    line = std::move(m_lines->lines.front());
+    m_lines->lines.pop_front();
+    m_lines->count--;
+    return true;
+}
+
+bool GTPReader::pending() const {
+    return m_lines->count > 0 || m_lines->eof;
+}
+
 std::string GTP::get_life_list(const GameState & game, bool live) {
     std::vector<std::string> stringlist;
     std::string result;
@@ -201,12 +414,19 @@ std::string GTP::get_life_list(const GameState & game, bool live) {
 
 bool GTP::execute(GameState & game, std::string xinput) {
     std::string input;
-    static auto search = std::make_unique<UCTSearch>(game);
+    // Every game of a GameServer runs on its own thread.
+    static thread_local auto search = std::make_unique<UCTSearch>(game);
 
     bool transform_lowercase = true;
 
     // Required on Unixy systems
-    if (xinput.find("loadsgf") != std::string::npos) {
+    if (xinput.find("loadsgf") != std::string::npos
+        || xinput.find("lz-loadweights") != std::string::npos
+        || xinput.find("lz-savetree") != std::string::npos
+        || xinput.find("lz-loadtree") != std::string::npos
+        || xinput.find("lz-saveopenings") != std::string::npos
+        || xinput.find("bulk_eval") != std::string::npos
+        || xinput.find("lz-profile") != std::string::npos) {
         transform_lowercase = false;
     }
 
@@ -266,6 +486,10 @@ bool GTP::execute(GameState & game, std::string xinput) {
         return true;
     } else if (command == "quit") {
         gtp_printf(id, "");
+        // The server quits on its own quit, not on those of the games.
+        if (cfg_serve_games > 0) {
+            return true;
+        }
         exit(EXIT_SUCCESS);
     } else if (command.find("known_command") == 0) {
         std::istringstream cmdstream(command);
@@ -692,6 +916,267 @@ bool GTP::execute(GameState & game, std::string xinput) {
             gtp_fail_printf(id, "cannot load file");
         }
         return true;
+    } else if (command.find("lz-loadweights") == 0) {
+        // lz-loadweights filename [index]
+        std::istringstream cmdstream(command);
+        std::string tmp, filename;
+        auto index = size_t{0};
+
+        cmdstream >> tmp;   // eat lz-loadweights
+        cmdstream >> filename;
+
+        if (cmdstream.fail()) {
+            gtp_fail_printf(id, "Missing filename.");
+            return true;
+        }
+        cmdstream >> index;
+        if (cmdstream.fail() && !cmdstream.eof()) {
+            gtp_fail_printf(id, "syntax error");
+        } else if (index > Network::get_network_count()) {
+            gtp_fail_printf(id, "invalid network index");
+        } else if (Network::load_weights(filename, index)) {
+            // The search tree holds evaluations of the old network.
+            search = std::make_unique<UCTSearch>(game);
+            if (index == 0) {
+                cfg_weightsfile = filename;
+            }
+            gtp_printf(id, "");
+        } else {
+            gtp_fail_printf(id, "cannot load weights file");
+        }
+        return true;
+    } else if (command.find("lz-setnet") == 0) {
+        // lz-setnet color index
+        std::istringstream cmdstream(command);
+        std::string tmp, color;
+        auto index = size_t{0};
+
+        cmdstream >> tmp;   // eat lz-setnet
+        cmdstream >> color >> index;
+
+        auto who = FastBoard::INVAL;
+        if (color == "w" || color == "white") {
+            who = FastBoard::WHITE;
+        } else if (color == "b" || color == "black") {
+            who = FastBoard::BLACK;
+        }
+        if (cmdstream.fail() || who == FastBoard::INVAL) {
+            gtp_fail_printf(id, "syntax error");
+        } else if (Network::set_side_network(who, index)) {
+            gtp_printf(id, "");
+        } else {
+            gtp_fail_printf(id, "invalid network index");
+        }
+        return true;
+    } else if (command.find("lz-cachestats") == 0) {
+        NNCache::get_NNCache().dump_stats();
+        gtp_printf(id, "");
+        return true;
+    } else if (command.find("lz-clearcache") == 0) {
+        NNCache::get_NNCache().clear();
+        gtp_printf(id, "");
+        return true;
+    } else if (command.find("lz-seed") == 0) {
+        // lz-seed [seed]
+        std::istringstream cmdstream(command);
+        std::string tmp;
+        auto seed = std::uint64_t{0};
+
+        cmdstream >> tmp;   // eat lz-seed
+        cmdstream >> seed;
+
+        if (cmdstream.fail() && !cmdstream.eof()) {
+            gtp_fail_printf(id, "syntax not understood");
+            return true;
+        }
+        // Without a seed, a new random one, as if the program restarted.
+        if (cmdstream.fail()) {
+            seed = random_seed();
+        }
+        Random::seed_all(seed);
+        gtp_printf(id, "");
+        return true;
+    } else if (command.find("lz-lambda") == 0) {
+        // lz-lambda value
+        std::istringstream cmdstream(command);
+        std::string tmp;
+        auto lambda = 0.0f;
+
+        cmdstream >> tmp;   // eat lz-lambda
+        cmdstream >> lambda;
+
+        if (cmdstream.fail() || lambda < 0.0f || lambda > 1.0f) {
+            gtp_fail_printf(id, "syntax not understood");
+        } else {
+            // The next search reweights the tree for it.
+            cfg_lambda = lambda;
+            gtp_printf(id, "");
+        }
+        return true;
+    } else if (command.find("lz-stats") == 0) {
+        // The rates are since the previous lz-stats.
+        gtp_printf(id, "%s", Metrics::summary().c_str());
+        return true;
+    } else if (command.find("lz-profile") == 0) {
+        // lz-profile [trace start | trace save filename]
+        std::istringstream cmdstream(command);
+        std::string tmp, subcommand, action, filename;
+
+        // tmp will eat lz-profile
+        cmdstream >> tmp >> subcommand >> action >> filename;
+
+        if (!Profile::enabled()) {
+            gtp_fail_printf(id, "build with USE_PROFILING to profile");
+        } else if (subcommand.empty()) {
+            gtp_printf(id, "%s", Profile::summary().c_str());
+        } else if (subcommand == "trace" && action == "start") {
+            Profile::start_trace();
+            gtp_printf(id, "");
+        } else if (subcommand == "trace" && action == "save"
+                   && !filename.empty()) {
+            if (Profile::save_trace(filename)) {
+                gtp_printf(id, "");
+            } else {
+                gtp_fail_printf(id, "cannot write %s", filename.c_str());
+            }
+        } else {
+            gtp_fail_printf(id, "syntax not understood");
+        }
+        return true;
+    } else if (command.find("lz-savetree") == 0) {
+        // lz-savetree filename [min_visits]
+        std::istringstream cmdstream(command);
+        std::string tmp, filename;
+        auto min_visits = 1;
+
+        cmdstream >> tmp;   // eat lz-savetree
+        cmdstream >> filename;
+
+        if (cmdstream.fail()) {
+            gtp_fail_printf(id, "Missing filename.");
+            return true;
+        }
+        cmdstream >> min_visits;
+        if (cmdstream.fail() && !cmdstream.eof()) {
+            gtp_fail_printf(id, "syntax error");
+        } else if (search->save_tree(filename, std::max(1, min_visits))) {
+            gtp_printf(id, "");
+        } else {
+            gtp_fail_printf(id, "cannot save tree");
+        }
+        return true;
+    } else if (command.find("lz-loadtree") == 0) {
+        // lz-loadtree filename
+        std::istringstream cmdstream(command);
+        std::string tmp, filename;
+
+        cmdstream >> tmp;   // eat lz-loadtree
+        cmdstream >> filename;
+
+        if (cmdstream.fail()) {
+            gtp_fail_printf(id, "Missing filename.");
+        } else if (search->load_tree(filename)) {
+            gtp_printf(id, "");
+        } else {
+            gtp_fail_printf(id, "cannot load tree");
+        }
+        return true;
+    } else if (command.find("lz-saveopenings") == 0) {
+        // lz-saveopenings filename plies [width]
+        std::istringstream cmdstream(command);
+        std::string tmp, filename;
+        auto plies = 0;
+        auto width = 3;
+
+        cmdstream >> tmp;   // eat lz-saveopenings
+        cmdstream >> filename >> plies;
+
+        if (cmdstream.fail() || plies < 0) {
+            gtp_fail_printf(id, "syntax not understood");
+            return true;
+        }
+        cmdstream >> width;
+        if ((cmdstream.fail() && !cmdstream.eof()) || width < 1) {
+            gtp_fail_printf(id, "syntax not understood");
+        } else if (OpeningCache::write(filename, game, plies, width)) {
+            gtp_printf(id, "");
+        } else {
+            gtp_fail_printf(id, "cannot save openings");
+        }
+        return true;
+    } else if (command.find("lz-komi-analyze") == 0) {
+        std::istringstream cmdstream(command);
+        std::string tmp;
+
+        cmdstream >> tmp;   // eat lz-komi-analyze
+        // lz-komi-analyze [color] from to [step]
+        auto who = game.get_to_move();
+        auto from = 0.0f, to = 0.0f, step = 1.0f;
+        if (cmdstream >> tmp) {
+            if (tmp == "w" || tmp == "white") {
+                who = FastBoard::WHITE;
+            } else if (tmp == "b" || tmp == "black") {
+                who = FastBoard::BLACK;
+            } else {
+                cmdstream.clear();
+                cmdstream.seekg(-int(tmp.size()), std::ios_base::cur);
+            }
+        }
+        cmdstream >> from >> to;
+        if (cmdstream.fail() || (!(cmdstream >> step) && !cmdstream.eof())
+            || step <= 0.0f || to < from || (to - from) / step > 1000.0f) {
+            gtp_fail_printf(id, "syntax not understood");
+            return true;
+        }
+
+        // One search at the komi of the game, as genmove without the
+        // move. The rows of the table all come from its tree.
+        auto komis = std::vector<float>();
+        for (auto i = 0; from + i * step <= to + 0.001f * step; i++) {
+            komis.emplace_back(from + i * step);
+        }
+        game.set_to_move(who);
+        search->think(who, UCTSearch::NORESIGN);
+        // Only known once the network is loaded, by the search.
+        if (!is_mult_komi_net) {
+            gtp_fail_printf(id, "the network has no alpha and beta");
+        } else {
+            gtp_printf(id, "%s", search->get_komi_analysis(komis).c_str());
+        }
+        return true;
+    } else if (command.find("lz-analyze") == 0) {
+        std::istringstream cmdstream(command);
+        std::string tmp;
+
+        cmdstream >> tmp;   // eat lz-analyze
+        // lz-analyze [color] [interval in centiseconds]
+        auto who = game.get_to_move();
+        auto interval = 100;
+        if (cmdstream >> tmp) {
+            if (tmp == "w" || tmp == "white") {
+                who = FastBoard::WHITE;
+            } else if (tmp == "b" || tmp == "black") {
+                who = FastBoard::BLACK;
+            } else {
+                cmdstream.clear();
+                cmdstream.seekg(-int(tmp.size()), std::ios_base::cur);
+            }
+            if (!(cmdstream >> interval) && !cmdstream.eof()) {
+                gtp_fail_printf(id, "syntax not understood");
+                return true;
+            }
+        }
+        if (interval <= 0) {
+            gtp_fail_printf(id, "syntax not understood");
+            return true;
+        }
+
+        // The info lines follow the response until the next command.
+        game.set_to_move(who);
+        gtp_printf_raw("=%s\n", id != -1 ? std::to_string(id).c_str() : "");
+        search->ponder(interval);
+        gtp_printf_raw("\n");
+        return true;
     } else if (command.find("kgs-chat") == 0) {
         // kgs-chat (game|private) Name Message
         std::istringstream cmdstream(command);
@@ -852,6 +1337,25 @@ bool GTP::execute(GameState & game, std::string xinput) {
             gtp_fail_printf(id, "syntax not understood");
         }
 
+        return true;
+    } else if (command.find("bulk_eval") == 0) {
+        std::istringstream cmdstream(command);
+        std::string tmp, sgfname, outname;
+
+        // tmp will eat bulk_eval
+        cmdstream >> tmp >> sgfname >> outname;
+
+        if (cmdstream.fail()) {
+            gtp_fail_printf(id, "syntax not understood");
+            return true;
+        }
+        try {
+            const auto positions = BulkEval::run(sgfname, outname);
+            gtp_printf(id, "%zu", positions);
+        } catch (const std::exception& e) {
+            gtp_fail_printf(id, "%s", e.what());
+        }
+
         return true;
     } else if (command.find("dump_supervised") == 0) {
         std::istringstream cmdstream(command);
@@ -23,18 +23,66 @@
 #include "config.h"
 
 #include <cstdio>
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "GameState.h"
 #include "UCTSearch.h"
 
+namespace CacheEviction {
+    enum eviction_t {
+        FIFO, CLOCK
+    };
+};
+
+#ifdef USE_OPENCL
+namespace Precision {
+    enum precision_t {
+        AUTO, SINGLE, HALF
+    };
+};
+#endif
+
 extern bool cfg_gtp_mode;
 extern bool cfg_allow_pondering;
+// Opponent replies the ponder searches, 0 for all of them.
+extern int cfg_ponder_replies;
 extern int cfg_num_threads;
 extern int cfg_max_threads;
+extern bool cfg_pin_threads;
+extern bool cfg_numa;
+// Put the tree nodes and the NNCache in huge pages where possible.
+extern bool cfg_huge_pages;
+// Hosts that search the same position, see DistributedSearch.
+extern std::vector<std::string> cfg_search_workers;
+// Serve searches on this port instead of GTP, if not zero.
+extern int cfg_worker_port;
+// Host this many games over one GTP stream, see GameServer, if not zero.
+extern int cfg_serve_games;
+// Play this many self-play games, see SelfPlay, if not zero. The games
+// run cfg_selfplay_parallel at a time and write to the files starting
+// with cfg_selfplay_output.
+extern int cfg_selfplay_games;
+extern int cfg_selfplay_parallel;
+extern std::string cfg_selfplay_output;
+// Serve the Prometheus metrics on this port, if not zero.
+extern int cfg_metrics_port;
 extern int cfg_max_playouts;
 extern int cfg_max_visits;
+extern int cfg_max_tree_mb;
+// Limit for the tree and the NNCache together, if not zero.
+extern int cfg_max_memory_mb;
+extern bool cfg_transpositions;
+extern int cfg_cache_size_mb;
+extern bool cfg_cache_symmetries;
+extern CacheEviction::eviction_t cfg_cache_eviction;
+extern std::string cfg_shared_cache;
+extern int cfg_shared_cache_mb;
+extern std::string cfg_nn_daemon;
+extern std::string cfg_nn_client;
+extern std::string cfg_opening_cache;
 extern TimeManagement::enabled_t cfg_timemanage;
 extern int cfg_lagbuffer_cs;
 extern int cfg_resignpct;
@@ -48,21 +96,43 @@ extern int cfg_random_min_visits;
 extern float cfg_random_temp;
 extern std::uint64_t cfg_rng_seed;
 extern bool cfg_dumbpass;
-#ifdef USE_OPENCL
+#if defined(USE_OPENCL) || defined(USE_CUDA)
 extern std::vector<int> cfg_gpus;
+#endif
+#ifdef USE_OPENCL
 extern bool cfg_sgemm_exhaustive;
 extern bool cfg_tune_only;
+extern int cfg_pipeline_depth;
+extern int cfg_cpu_threads;
+extern Precision::precision_t cfg_precision;
 #endif
+extern int cfg_batch_size;
+extern int cfg_batch_wait;
+extern int cfg_leaf_batch;
+extern int cfg_speculate;
+// Endgames with at most this many empty points are solved, see
+// EndgameSolver. 0 is off.
+extern int cfg_solve_empties;
+extern bool cfg_int8;
 extern float cfg_puct;
 extern float cfg_softmax_temp;
 extern float cfg_fpu_reduction;
 extern std::string cfg_logfile;
 extern std::string cfg_weightsfile;
+// All the --weights files, cfg_weightsfile is the first one.
+extern std::vector<std::string> cfg_weightsfiles;
 extern FILE* cfg_logfile_handle;
 extern bool cfg_quiet;
 extern std::string cfg_options_str;
 extern bool cfg_benchmark;
+// Positions for BenchmarkSuite, if not empty.
+extern std::string cfg_benchmark_suite;
+// What --calibrate picks, the ones not given on the command line.
+extern bool cfg_calibrate_threads;
+extern bool cfg_calibrate_leaf_batch;
 extern float cfg_blunder_thr;
+extern int cfg_gzip_level;
+extern bool cfg_binary_training;
 
 /*
     possible scoring methods
@@ -82,11 +152,39 @@ class GTP {
 public:
     static bool execute(GameState & game, std::string xinput);
     static void setup_default_parameters();
+    // Whether the command of input only looks at the game and at the
+    // statistics, so that it can be answered during a ponder without
+    // stopping it.
+    static bool is_query(const std::string& input);
 private:
     static constexpr int GTP_VERSION = 2;
 
     static std::string get_life_list(const GameState & game, bool live);
     static const std::string s_commands[];
+    static const std::string s_queries[];
+};
+
+// Reads the GTP input on a thread of its own. The main loop waits for
+// the next line, and a ponder only looks at a counter to know if there
+// is one, instead of asking stdin after every playout.
+class GTPReader {
+public:
+    GTPReader();
+    ~GTPReader();
+
+    // Waits for the next line. Returns false at the end of the input.
+    bool next(std::string& line);
+    // Takes the next line only if it is a GTP::is_query().
+    bool next_query(std::string& line);
+    // Whether there is a line, or the end of the input.
+    bool pending() const;
+
+private:
+    // Shared with the thread, which outlives the reader if it is gone
+    // before the end of the input.
+    struct Lines;
+    std::shared_ptr<Lines> m_lines;
+    std::thread m_thread;
 };
 
 
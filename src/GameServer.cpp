@@ -0,0 +1,142 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "GameServer.h"
+
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "GTP.h"
+#include "GameState.h"
+#include "Utils.h"
+
+using namespace Utils;
+
+// One game and the thread that runs its commands in order.
+class ServedGame {
+public:
+    explicit ServedGame(const int index) : m_index(index) {
+        m_game.init_game(BOARD_SIZE, cfg_komi);
+        m_thread = std::thread([this] { run(); });
+    }
+
+    ~ServedGame() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closed = true;
+        }
+        m_condvar.notify_one();
+        m_thread.join();
+    }
+
+    void push(const std::string& command) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_commands.push_back(command);
+            m_pending++;
+        }
+        m_condvar.notify_one();
+    }
+
+private:
+    void run() {
+        set_gtp_prefix(std::to_string(m_index) + ":");
+        // For the NN queue wait of every game.
+        auto priority = EvalPriority{};
+        priority.game = m_index;
+        set_eval_priority(priority);
+        // Pondering stops for the next command of this game only.
+        set_input_check([this](bool) { return m_pending > 0; });
+
+        while (true) {
+            auto command = std::string{};
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_condvar.wait(lock, [this] {
+                    return m_closed || !m_commands.empty();
+                });
+                if (m_commands.empty()) {
+                    return;
+                }
+                command = std::move(m_commands.front());
+                m_commands.pop_front();
+                m_pending--;
+            }
+            GTP::execute(m_game, command);
+        }
+    }
+
+    int m_index;
+    GameState m_game;
+    std::deque<std::string> m_commands;
+    std::atomic<int> m_pending{0};
+    bool m_closed{false};
+    std::mutex m_mutex;
+    std::condition_variable m_condvar;
+    std::thread m_thread;
+};
+
+void GameServer::run(int games) {
+    myprintf("Serving %d games.\n", games);
+    auto served = std::vector<std::unique_ptr<ServedGame>>{};
+    for (auto i = 0; i < games; i++) {
+        served.emplace_back(std::make_unique<ServedGame>(i));
+    }
+
+    auto input = std::string{};
+    while (std::getline(std::cin, input)) {
+        log_input(input);
+        const auto colon = input.find(':');
+        auto is_game = colon != std::string::npos && colon > 0;
+        for (auto i = size_t{0}; is_game && i < colon; i++) {
+            is_game = std::isdigit(static_cast<unsigned char>(input[i]));
+        }
+        if (!is_game) {
+            if (input.find("quit") != std::string::npos) {
+                gtp_printf(-1, "");
+                break;
+            }
+            if (!input.empty()) {
+                gtp_fail_printf(-1, "no game number");
+            }
+            continue;
+        }
+
+        const auto index = std::stoul(input.substr(0, colon));
+        if (index >= served.size()) {
+            gtp_fail_printf(-1, "no game %zu", index);
+            continue;
+        }
+        // Games wait for nothing but their own commands.
+        auto command = input.substr(colon + 1);
+        command.erase(0, command.find_first_not_of(' '));
+        served[index]->push(command);
+    }
+
+    // Waits for the commands in flight.
+    served.clear();
+}
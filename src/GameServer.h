@@ -0,0 +1,40 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GAMESERVER_H_INCLUDED
+#define GAMESERVER_H_INCLUDED
+
+#include "config.h"
+
+// Plays several games in one process, with --serve-games. They share
+// the network, its batches and the NNCache, so the GPU batches fill up
+// across the games.
+//
+// Every line of input starts with the number of its game, from 0, and a
+// colon, like "1: genmove b". Every line of the answer starts with the
+// same, the empty line at the end of it is "1:". Every game has its own
+// thread, GameState and UCTSearch, and ponders until its next command.
+// A line without a game number is for the server, which only knows
+// quit. The quit of a game is answered and does nothing else.
+class GameServer {
+public:
+    // Answers the commands from stdin until quit or the end of it.
+    static void run(int games);
+};
+
+#endif
@@ -71,7 +71,16 @@ void GameState::reset_game() {
     m_resigned = FastBoard::EMPTY;
 }
 
+void GameState::start_playout(const GameState& root) {
+    assert(root.m_playout_root == nullptr);
+    KoState::start_from(root);
+    m_resigned = root.m_resigned;
+    m_playout_root = &root;
+    m_playout_stones.resize(PLAYOUT_BOARDS);
+}
+
 bool GameState::forward_move(void) {
+    assert(m_playout_root == nullptr);
     if (game_history.size() > m_movenum + 1) {
         m_movenum++;
         *(static_cast<KoState*>(this)) = *game_history[m_movenum];
@@ -82,6 +91,7 @@ bool GameState::forward_move(void) {
 }
 
 bool GameState::undo_move(void) {
+    assert(m_playout_root == nullptr);
     if (m_movenum > 0) {
         m_movenum--;
 
@@ -96,6 +106,7 @@ bool GameState::undo_move(void) {
 }
 
 void GameState::rewind(void) {
+    assert(m_playout_root == nullptr);
     *(static_cast<KoState*>(this)) = *game_history[0];
     m_movenum = 0;
 }
@@ -111,6 +122,11 @@ void GameState::play_move(int color, int vertex) {
         KoState::play_move(color, vertex);
     }
 
+    if (m_playout_root) {
+        m_playout_stones[m_movenum % PLAYOUT_BOARDS] = board.get_stones();
+        return;
+    }
+
     // cut off any leftover moves from navigating
     game_history.resize(m_movenum);
     game_history.emplace_back(std::make_shared<KoState>(*this));
@@ -348,10 +364,18 @@ void GameState::place_free_handicap(int stones) {
     set_handicap(orgstones);
 }
 
-const FullBoard& GameState::get_past_board(int moves_ago) const {
+FastBoard::stones_t GameState::get_past_stones(int moves_ago) const {
     assert(moves_ago >= 0 && (unsigned)moves_ago <= m_movenum);
+    if (m_playout_root) {
+        const auto played = m_movenum - m_playout_root->m_movenum;
+        if ((unsigned)moves_ago < played) {
+            assert(moves_ago < PLAYOUT_BOARDS);
+            return m_playout_stones[(m_movenum - moves_ago) % PLAYOUT_BOARDS];
+        }
+        return m_playout_root->get_past_stones(moves_ago - played);
+    }
     assert(m_movenum + 1 <= game_history.size());
-    return game_history[m_movenum - moves_ago]->board;
+    return game_history[m_movenum - moves_ago]->board.get_stones();
 }
 
 // void GameState::copy_last_rnd_move_num () {
@@ -45,10 +45,19 @@ public:
     void place_free_handicap(int stones);
     void anchor_game_history(void);
 
+    // The network looks back at this many boards at most.
+    static constexpr auto PLAYOUT_BOARDS = 8;
+    // Puts this state at the position of root for a playout. The moves
+    // played after that keep only the stones of the last PLAYOUT_BOARDS
+    // boards and root is read for the older ones, so a playout neither copies the
+    // game history nor allocates. root must not change until the
+    // playout is over, and this state can't be undone past it.
+    void start_playout(const GameState& root);
+
     void rewind(void); /* undo infinite */
     bool undo_move(void);
     bool forward_move(void);
-    const FullBoard& get_past_board(int moves_ago) const;
+    FastBoard::stones_t get_past_stones(int moves_ago) const;
 
     void play_move(int color, int vertex);
     void play_move(int vertex);
@@ -78,6 +87,11 @@ private:
     std::vector<std::shared_ptr<const KoState>> game_history;
     TimeControl m_timecontrol;
     int m_resigned{FastBoard::EMPTY};
+
+    // Set by start_playout(), the stones of the boards after
+    // m_playout_root by move number modulo PLAYOUT_BOARDS.
+    const GameState* m_playout_root{nullptr};
+    std::vector<FastBoard::stones_t> m_playout_stones;
 };
 
 #endif
@@ -23,10 +23,10 @@
 #include <vector>
 #include <algorithm>
 
-template <unsigned long filter_size>
+template <unsigned long filter_size, typename T>
 void im2col(const int channels,
-            const std::vector<float>& input,
-            std::vector<float>& output) {
+            const T* const input,
+            std::vector<T>& output) {
     constexpr unsigned int height = BOARD_SIZE;
     constexpr unsigned int width = BOARD_SIZE;
 
@@ -34,8 +34,8 @@ void im2col(const int channels,
     constexpr unsigned int output_h = height + 2 * pad - filter_size  + 1;
     constexpr unsigned int output_w = width + 2 * pad - filter_size + 1;
 
-    const float* data_im = input.data();
-    float* data_col = output.data();
+    const T* data_im = input;
+    T* data_col = output.data();
 
     for (int channel = channels; channel--; data_im += BOARD_SQUARES) {
         for (unsigned int kernel_row = 0; kernel_row < filter_size; kernel_row++) {
@@ -65,13 +65,46 @@ void im2col(const int channels,
     }
 }
 
+// The same for a position stored with the channels innermost: every
+// point gets a row of filter_size * filter_size * channels values, the
+// taps in row major order and the channels innermost.
+template <unsigned long filter_size>
+void im2col_channels_last(const int channels,
+                          const float* const input,
+                          float* const output) {
+    constexpr int height = BOARD_SIZE;
+    constexpr int width = BOARD_SIZE;
+    constexpr int pad = (filter_size / 2);
+
+    auto data_col = output;
+    for (int output_row = 0; output_row < height; output_row++) {
+        for (int output_col = 0; output_col < width; output_col++) {
+            for (unsigned int kernel_row = 0; kernel_row < filter_size; kernel_row++) {
+                const int input_row = output_row - pad + kernel_row;
+                for (unsigned int kernel_col = 0; kernel_col < filter_size; kernel_col++) {
+                    const int input_col = output_col - pad + kernel_col;
+                    if (unsigned(input_row) < unsigned(height)
+                        && unsigned(input_col) < unsigned(width)) {
+                        const auto data_im =
+                            input + (input_row * width + input_col) * channels;
+                        data_col = std::copy(data_im, data_im + channels,
+                                             data_col);
+                    } else {
+                        data_col = std::fill_n(data_col, channels, 0.0f);
+                    }
+                }
+            }
+        }
+    }
+}
+
 template <>
 void im2col<1>(const int channels,
-               const std::vector<float>& input,
+               const float* const input,
                std::vector<float>& output) {
     auto outSize = size_t{channels * static_cast<size_t>(BOARD_SQUARES)};
     assert(output.size() == outSize);
-    std::copy(begin(input), begin(input) + outSize, begin(output));
+    std::copy(input, input + outSize, begin(output));
 }
 
 #endif
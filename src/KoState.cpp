@@ -34,24 +34,23 @@ void KoState::init_game(int size, float komi) {
 
     FastState::init_game(size, komi);
 
-    m_ko_hash_history.clear();
-    m_ko_hash_history.emplace_back(board.get_ko_hash());
+    clear_ko_hashes();
+    m_ko_parent = nullptr;
+    add_ko_hash(board.get_ko_hash());
+    m_superko = false;
 }
 
 bool KoState::superko(void) const {
-    auto first = crbegin(m_ko_hash_history);
-    auto last = crend(m_ko_hash_history);
-
-    auto res = std::find(++first, last, board.get_ko_hash());
-
-    return (res != last);
+    return m_superko;
 }
 
 void KoState::reset_game() {
     FastState::reset_game();
 
-    m_ko_hash_history.clear();
-    m_ko_hash_history.push_back(board.get_ko_hash());
+    clear_ko_hashes();
+    m_ko_parent = nullptr;
+    add_ko_hash(board.get_ko_hash());
+    m_superko = false;
     set_eval(0.0f, 1.0f, 0.5f, 0.5f, 0.0f);
 }
 
@@ -63,7 +62,75 @@ void KoState::play_move(int color, int vertex) {
     if (vertex != FastBoard::RESIGN) {
         FastState::play_move(color, vertex);
     }
-    m_ko_hash_history.push_back(board.get_ko_hash());
+    const auto hash = board.get_ko_hash();
+    m_superko = has_ko_hash(hash);
+    add_ko_hash(hash);
+}
+
+void KoState::start_from(const KoState& parent) {
+    *(static_cast<FastState*>(this)) = parent;
+    m_alpkt = parent.m_alpkt;
+    m_beta = parent.m_beta;
+    m_pi = parent.m_pi;
+    m_avg_eval = parent.m_avg_eval;
+    m_eval_bonus = parent.m_eval_bonus;
+
+    // The set keeps its capacity.
+    clear_ko_hashes();
+    m_ko_parent = &parent;
+    m_superko = parent.m_superko;
+}
+
+bool KoState::has_ko_hash(const std::uint64_t hash) const {
+    if (m_ko_hash_count) {
+        const auto mask = m_ko_hashes.size() - 1;
+        for (auto i = hash & mask;
+             m_ko_hashes[i].generation == m_ko_generation;
+             i = (i + 1) & mask) {
+            if (m_ko_hashes[i].hash == hash) {
+                return true;
+            }
+        }
+    }
+    return m_ko_parent && m_ko_parent->has_ko_hash(hash);
+}
+
+void KoState::add_ko_hash(const std::uint64_t hash) {
+    // At most half full, so the probes stay short.
+    if (2 * (m_ko_hash_count + 1) > m_ko_hashes.size()) {
+        auto old = std::vector<KoSlot>(
+            std::max<size_t>(64, 2 * m_ko_hashes.size()), KoSlot{0, 0});
+        old.swap(m_ko_hashes);
+        m_ko_hash_count = 0;
+        for (const auto& slot : old) {
+            if (slot.generation == m_ko_generation) {
+                add_ko_hash(slot.hash);
+            }
+        }
+    }
+    const auto mask = m_ko_hashes.size() - 1;
+    auto i = hash & mask;
+    while (m_ko_hashes[i].generation == m_ko_generation
+           && m_ko_hashes[i].hash != hash) {
+        i = (i + 1) & mask;
+    }
+    if (m_ko_hashes[i].generation != m_ko_generation) {
+        m_ko_hashes[i] = KoSlot{hash, m_ko_generation};
+        m_ko_hash_count++;
+    }
+}
+
+// Frees all the slots at once, the set is cleared for every playout.
+// Generation 0 is never current, it marks the slots that were never
+// used.
+void KoState::clear_ko_hashes() {
+    m_ko_hash_count = 0;
+    if (++m_ko_generation == 0) {
+        for (auto& slot : m_ko_hashes) {
+            slot.generation = 0;
+        }
+        m_ko_generation = 1;
+    }
 }
 
 std::tuple<float,float,float,float,float> KoState::get_eval() {
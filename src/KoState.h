@@ -22,6 +22,7 @@
 
 #include "config.h"
 
+#include <cstdint>
 #include <vector>
 #include <tuple>
 
@@ -33,6 +34,10 @@ public:
     void init_game(int size, float komi);
     bool superko(void) const;
     void reset_game();
+    // Puts this state at the position of parent. The ko hashes of the
+    // positions before it are looked up in parent, which must outlive
+    // the moves played on this state.
+    void start_from(const KoState& parent);
 
     void play_move(int color, int vertex);
     void play_move(int vertex);
@@ -40,7 +45,23 @@ public:
     void set_eval(float alpkt, float beta, float pi,
 		  float avg_eval, float eval_bonus);
 private:
-    std::vector<std::uint64_t> m_ko_hash_history;
+    bool has_ko_hash(std::uint64_t hash) const;
+    void add_ko_hash(std::uint64_t hash);
+    void clear_ko_hashes();
+
+    struct KoSlot {
+        std::uint64_t hash;
+        std::uint32_t generation;
+    };
+
+    // Ko hashes of the positions so far, as an open addressed set with
+    // linear probing. Only the slots of the current generation are
+    // used, so that clearing the set doesn't touch them.
+    std::vector<KoSlot> m_ko_hashes;
+    size_t m_ko_hash_count{0};
+    std::uint32_t m_ko_generation{1};
+    const KoState* m_ko_parent{nullptr};
+    bool m_superko{false};
     float m_alpkt = 0.0f;
     float m_beta = 1.0f;
     float m_pi = 0.5f;
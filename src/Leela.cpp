@@ -30,11 +30,19 @@
 #include <string>
 #include <vector>
 
+#include "BenchmarkSuite.h"
+#include "Calibration.h"
+#include "DistributedSearch.h"
 #include "GTP.h"
+#include "GameServer.h"
 #include "GameState.h"
+#include "Metrics.h"
 #include "Network.h"
 #include "NNCache.h"
+#include "OpeningCache.h"
 #include "Random.h"
+#include "SMP.h"
+#include "SelfPlay.h"
 #include "ThreadPool.h"
 #include "Utils.h"
 #include "Zobrist.h"
@@ -59,11 +67,83 @@ static void parse_commandline(int argc, char *argv[]) {
         ("gtp,g", "Enable GTP mode.")
         ("threads,t", po::value<int>()->default_value(cfg_num_threads),
                       "Number of threads to use.")
+        ("pin-threads", "Pin every search thread to its own core.")
+        ("numa", "Spread the pinned search threads over the NUMA nodes, "
+                 "keep the tree memory of every node on that node, and "
+                 "run the GPU threads on the node of the GPU.")
+        ("worker", po::value<std::vector<std::string>>(),
+                   "host:port of a leelaz started with --worker-port that "
+                   "searches every move along with this one. "
+                   "Can be given more than once.")
+        ("worker-port", po::value<int>(),
+                        "Search positions for a coordinator that connects "
+                        "to this port, instead of playing GTP.")
+        ("serve-games", po::value<int>(),
+                        "Play this many games at once over one GTP stream, "
+                        "with one network. Every line starts with the "
+                        "number of its game and a colon. "
+                        "--threads is per game.")
+        ("selfplay", po::value<int>(),
+                     "Play this many self-play games and exit, writing "
+                     "the training chunks and the SGF of the games.")
+        ("selfplay-parallel",
+         po::value<int>()->default_value(cfg_selfplay_parallel),
+         "Self-play games that are played at once. "
+         "--threads is per game.")
+        ("selfplay-output",
+         po::value<std::string>()->default_value(cfg_selfplay_output),
+         "Start of the names of the self-play files, the chunks are "
+         "NAME.N.gz and the games NAME.sgf.")
+        ("metrics-port", po::value<int>(),
+                         "Serve the engine metrics over HTTP on this port, "
+                         "in the Prometheus text format.")
         ("playouts,p", po::value<int>(),
                        "Weaken engine by limiting the number of playouts. "
                        "Requires --noponder.")
         ("visits,v", po::value<int>(),
                      "Weaken engine by limiting the number of visits.")
+        ("max-tree-size", po::value<int>()->default_value(cfg_max_tree_mb),
+                          "Memory for the search tree in MB.")
+        ("max-memory", po::value<int>(),
+                       "Memory for the search tree and the NNCache "
+                       "together in MB. Replaces --max-tree-size.")
+        ("huge-pages", "Put the search tree and the network evaluation "
+                       "cache in huge pages, where the system has them.")
+        ("transpositions", "Search the positions that are reached by "
+                           "different move orders only once.")
+        ("solve-empties", po::value<int>()->default_value(cfg_solve_empties),
+                          "Find the exact score of the positions with at "
+                          "most this many empty points, instead of "
+                          "evaluating them with the network. 0 = off.")
+        ("cache-size", po::value<int>()->default_value(cfg_cache_size_mb),
+                       "Memory for the network evaluation cache in MB.\n"
+                       "0 = size it from the playout limit.")
+        ("cache-eviction", po::value<std::string>(),
+                           "[clock|fifo] Which entries the network "
+                           "evaluation cache drops when it is full.\n"
+                           "clock = give entries that were hit a second "
+                           "chance")
+        ("cache-symmetries", "Share cached evaluations between positions "
+                             "that are rotations or reflections of each "
+                             "other.")
+        ("shared-cache", po::value<std::string>(),
+                         "Name of a shared memory segment, e.g. "
+                         "/leelaz-cache, in which the engines on this host "
+                         "share their network evaluations.")
+        ("shared-cache-size",
+         po::value<int>()->default_value(cfg_shared_cache_mb),
+         "Size in MB of the shared cache, if this engine creates it.")
+        ("nn-daemon", po::value<std::string>(),
+                      "Name of a shared memory segment, e.g. /leelaz-nn, "
+                      "on which to evaluate the positions of the --nn-client "
+                      "engines on this host, and nothing else. --threads "
+                      "batches of up to --batchsize run at once.")
+        ("nn-client", po::value<std::string>(),
+                      "Evaluate the positions on the --nn-daemon of this "
+                      "segment, which has the network, instead of --weights.")
+        ("opening-cache", po::value<std::string>(),
+                          "File of opening evaluations written by "
+                          "lz-saveopenings, used with the same network.")
         ("komi", po::value<float>()->default_value(cfg_komi),
                      "Komi")
         ("rules", po::value<std::string>()->default_value("chinese"),
@@ -75,15 +155,48 @@ static void parse_commandline(int argc, char *argv[]) {
         ("resignpct,r", po::value<int>()->default_value(cfg_resignpct),
                         "Resign when winrate is less than x%.\n"
                         "-1 uses 10% but scales for handicap.")
-        ("weights,w", po::value<std::string>(), "File with network weights.")
+        ("weights,w", po::value<std::vector<std::string>>(),
+                      "File with network weights. Give it twice to have "
+                      "the second network play white, see lz-setnet.")
         ("logfile,l", po::value<std::string>(), "File to log input/output to.")
         ("quiet,q", "Disable all diagnostic output.")
         ("timemanage", po::value<std::string>()->default_value("auto"),
                        "[auto|on|off|fast] Enable time management features.\n"
                        "auto = off when using -m, otherwise on")
         ("noponder", "Disable thinking on opponent's time.")
+        ("ponder-replies", po::value<int>()->default_value(cfg_ponder_replies),
+                           "Opponent replies to think about when pondering, "
+                           "0 for all of them.")
+        ("batchsize", po::value<int>()->default_value(cfg_batch_size),
+                      "Max number of positions per network batch. "
+                      "Values > 1 collect evaluations from all search "
+                      "threads, so use several threads per batch.")
+        ("batchwait", po::value<int>()->default_value(cfg_batch_wait),
+                      "Max time in microseconds to wait for a batch to fill.")
+        ("leafbatch", po::value<int>()->default_value(cfg_leaf_batch),
+                      "Number of leaves every search thread collects "
+                      "before they are evaluated as one batch.")
+        ("speculate", po::value<int>()->default_value(cfg_speculate),
+                      "Number of likeliest children of every expanded "
+                      "node that fill the empty slots of the --leafbatch "
+                      "batches, into the NNCache.")
+#ifndef USE_OPENCL
+        ("int8", "Use int8 quantized convolutions. Falls back to float "
+                 "if the outputs differ too much.")
+#endif
         ("benchmark", "Test network and exit. Default args:\n-v3200 --noponder "
                       "-m0 -t1 -s1.")
+        ("benchmark-suite", po::value<std::string>(),
+                            "Search the positions of this SGF file, like "
+                            "src/tests/benchmark.sgf, with 1, 2, 4 ... "
+                            "threads up to --threads, print the results "
+                            "as JSON and exit. Same defaults as --benchmark "
+                            "but for the threads.")
+        ("calibrate", "Pick the --threads and --leafbatch with the most "
+                      "nodes per second from short searches, unless they "
+                      "are given. The result is kept in "
+                      "leelaz_calibration for this device and network "
+                      "size.")
         ;
 #ifdef USE_OPENCL
     po::options_description gpu_desc("GPU options");
@@ -92,6 +205,23 @@ static void parse_commandline(int argc, char *argv[]) {
                 "ID of the OpenCL device(s) to use (disables autodetection).")
         ("full-tuner", "Try harder to find an optimal OpenCL tuning.")
         ("tune-only", "Tune OpenCL only and then exit.")
+        ("pipeline", po::value<int>()->default_value(cfg_pipeline_depth),
+                     "Number of batches in flight per GPU.")
+        ("cpu-threads", po::value<int>()->default_value(cfg_cpu_threads),
+                        "Number of threads that also evaluate positions on "
+                        "the CPU, next to the GPUs.")
+        ("precision", po::value<std::string>(),
+                      "[auto|single|half] Floating-point precision of the "
+                      "network on the GPU.\n"
+                      "auto = benchmark both and use half if it is faster "
+                      "and accurate enough.")
+        ;
+#endif
+#ifdef USE_CUDA
+    po::options_description gpu_desc("GPU options");
+    gpu_desc.add_options()
+        ("gpu",  po::value<std::vector<int> >(),
+                "ID of the CUDA device(s) to use (default: all).")
         ;
 #endif
     po::options_description selfplay_desc("Self-play options");
@@ -114,6 +244,11 @@ static void parse_commandline(int argc, char *argv[]) {
 	    po::value<float>()->default_value(cfg_blunder_thr),
 	    "If visits ratio with best is less than this, it's a blunder. "
 	    "Don't save training data for moves before last blunder.")
+        ("gziplevel", po::value<int>()->default_value(cfg_gzip_level),
+                      "Compression level of the training data, from 0 "
+                      "(fastest) to 9 (smallest).")
+        ("binarytraining", "Write the training data as fixed size binary "
+                           "records instead of text.")
         ;
 #ifdef USE_TUNER
     po::options_description tuner_desc("Tuning options");
@@ -132,7 +267,7 @@ static void parse_commandline(int argc, char *argv[]) {
         ("arguments", po::value<std::vector<std::string>>());
     po::options_description visible;
     visible.add(gen_desc)
-#ifdef USE_OPENCL
+#if defined(USE_OPENCL) || defined(USE_CUDA)
        .add(gpu_desc)
 #endif
        .add(selfplay_desc)
@@ -178,7 +313,7 @@ static void parse_commandline(int argc, char *argv[]) {
         cfg_quiet = true;
     }
 
-    if (vm.count("benchmark")) {
+    if (vm.count("benchmark") || vm.count("benchmark-suite")) {
         cfg_quiet = true;  // Set this early to avoid unnecessary output.
     }
 
@@ -205,8 +340,9 @@ static void parse_commandline(int argc, char *argv[]) {
     }
 
     if (vm.count("weights")) {
-        cfg_weightsfile = vm["weights"].as<std::string>();
-    } else {
+        cfg_weightsfiles = vm["weights"].as<std::vector<std::string>>();
+        cfg_weightsfile = cfg_weightsfiles.front();
+    } else if (!vm.count("nn-client")) {
         printf("A network weights file is required to use the program.\n");
         exit(EXIT_FAILURE);
     }
@@ -215,6 +351,50 @@ static void parse_commandline(int argc, char *argv[]) {
         cfg_gtp_mode = true;
     }
 
+    if (vm.count("pin-threads")) {
+        cfg_pin_threads = true;
+    }
+    if (vm.count("numa")) {
+        cfg_pin_threads = true;
+        cfg_numa = true;
+    }
+
+    if (vm.count("huge-pages")) {
+        cfg_huge_pages = true;
+    }
+
+    if (vm.count("worker")) {
+        cfg_search_workers = vm["worker"].as<std::vector<std::string>>();
+    }
+    if (vm.count("worker-port")) {
+        cfg_worker_port = vm["worker-port"].as<int>();
+    }
+    if (vm.count("serve-games")) {
+        cfg_serve_games = std::max(0, vm["serve-games"].as<int>());
+    }
+    if (vm.count("selfplay")) {
+        cfg_selfplay_games = std::max(0, vm["selfplay"].as<int>());
+        cfg_selfplay_parallel =
+            std::max(1, vm["selfplay-parallel"].as<int>());
+        cfg_selfplay_output = vm["selfplay-output"].as<std::string>();
+    }
+    if (vm.count("metrics-port")) {
+        cfg_metrics_port = vm["metrics-port"].as<int>();
+    }
+
+    cfg_batch_size = std::max(1, vm["batchsize"].as<int>());
+    cfg_batch_wait = std::max(0, vm["batchwait"].as<int>());
+    cfg_leaf_batch = std::max(1, vm["leafbatch"].as<int>());
+    cfg_speculate = std::max(0, vm["speculate"].as<int>());
+    cfg_solve_empties = std::max(0, vm["solve-empties"].as<int>());
+#ifndef USE_OPENCL
+    if (vm.count("int8")) {
+        cfg_int8 = true;
+    }
+#endif
+    // Threads waiting for their batch don't use a core.
+    cfg_max_threads *= cfg_batch_size;
+
     if (!vm["threads"].defaulted()) {
         auto num_threads = vm["threads"].as<int>();
         if (num_threads > cfg_max_threads) {
@@ -223,6 +403,10 @@ static void parse_commandline(int argc, char *argv[]) {
             cfg_num_threads = num_threads;
         }
     }
+    if (vm.count("calibrate")) {
+        cfg_calibrate_threads = vm["threads"].defaulted();
+        cfg_calibrate_leaf_batch = vm["leafbatch"].defaulted();
+    }
     myprintf("Using %d thread(s).\n", cfg_num_threads);
 
     if (vm.count("seed")) {
@@ -237,6 +421,7 @@ static void parse_commandline(int argc, char *argv[]) {
     if (vm.count("noponder")) {
         cfg_allow_pondering = false;
     }
+    cfg_ponder_replies = std::max(0, vm["ponder-replies"].as<int>());
 
     if (vm.count("noise")) {
         cfg_noise = true;
@@ -271,6 +456,42 @@ static void parse_commandline(int argc, char *argv[]) {
         }
     }
 
+    cfg_max_tree_mb = std::max(1, vm["max-tree-size"].as<int>());
+    if (vm.count("max-memory")) {
+        cfg_max_memory_mb = std::max(1, vm["max-memory"].as<int>());
+    }
+    cfg_cache_size_mb = std::max(0, vm["cache-size"].as<int>());
+    if (vm.count("cache-eviction")) {
+        auto eviction = vm["cache-eviction"].as<std::string>();
+        if (eviction == "clock") {
+            cfg_cache_eviction = CacheEviction::CLOCK;
+        } else if (eviction == "fifo") {
+            cfg_cache_eviction = CacheEviction::FIFO;
+        } else {
+            printf("Invalid cache eviction value.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (vm.count("transpositions")) {
+        cfg_transpositions = true;
+    }
+    if (vm.count("cache-symmetries")) {
+        cfg_cache_symmetries = true;
+    }
+    if (vm.count("shared-cache")) {
+        cfg_shared_cache = vm["shared-cache"].as<std::string>();
+    }
+    cfg_shared_cache_mb = std::max(1, vm["shared-cache-size"].as<int>());
+    if (vm.count("nn-daemon")) {
+        cfg_nn_daemon = vm["nn-daemon"].as<std::string>();
+    }
+    if (vm.count("nn-client")) {
+        cfg_nn_client = vm["nn-client"].as<std::string>();
+    }
+    if (vm.count("opening-cache")) {
+        cfg_opening_cache = vm["opening-cache"].as<std::string>();
+    }
+
     cfg_lambda = vm["lambda"].as<float>();
     cfg_komi = vm["komi"].as<float>();
 
@@ -301,6 +522,10 @@ static void parse_commandline(int argc, char *argv[]) {
     if (vm.count("blunderthr")) {
         cfg_blunder_thr = vm["blunderthr"].as<float>();
     }
+    cfg_gzip_level = std::min(9, std::max(0, vm["gziplevel"].as<int>()));
+    if (vm.count("binarytraining")) {
+        cfg_binary_training = true;
+    }
 
 
 
@@ -333,10 +558,12 @@ static void parse_commandline(int argc, char *argv[]) {
         }
     }
 
-#ifdef USE_OPENCL
+#if defined(USE_OPENCL) || defined(USE_CUDA)
     if (vm.count("gpu")) {
         cfg_gpus = vm["gpu"].as<std::vector<int> >();
     }
+#endif
+#ifdef USE_OPENCL
 
     if (vm.count("full-tuner")) {
         cfg_sgemm_exhaustive = true;
@@ -345,9 +572,29 @@ static void parse_commandline(int argc, char *argv[]) {
     if (vm.count("tune-only")) {
         cfg_tune_only = true;
     }
+
+    cfg_pipeline_depth = std::max(1, vm["pipeline"].as<int>());
+    cfg_cpu_threads = std::max(0, vm["cpu-threads"].as<int>());
+
+    if (vm.count("precision")) {
+        auto precision = vm["precision"].as<std::string>();
+        if (precision == "auto") {
+            cfg_precision = Precision::AUTO;
+        } else if (precision == "single") {
+            cfg_precision = Precision::SINGLE;
+        } else if (precision == "half") {
+            cfg_precision = Precision::HALF;
+        } else {
+            printf("Invalid precision value.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 #endif
 
-    if (vm.count("benchmark")) {
+    if (vm.count("benchmark-suite")) {
+        cfg_benchmark_suite = vm["benchmark-suite"].as<std::string>();
+    }
+    if (vm.count("benchmark") || vm.count("benchmark-suite")) {
         // These must be set later to override default arguments.
         cfg_allow_pondering = false;
         cfg_benchmark = true;
@@ -355,7 +602,7 @@ static void parse_commandline(int argc, char *argv[]) {
         cfg_random_cnt = 0;
         cfg_rng_seed = 1;
         cfg_timemanage = TimeManagement::OFF;  // Reliable number of playouts.
-        if (vm["threads"].defaulted()) {
+        if (vm["threads"].defaulted() && cfg_benchmark_suite.empty()) {
             cfg_num_threads = 1;
         }
         if (!vm.count("playouts") && !vm.count("visits")) {
@@ -375,7 +622,23 @@ static void parse_commandline(int argc, char *argv[]) {
 
 // Setup global objects after command line has been parsed
 void init_global_objects() {
-    thread_pool.initialize(cfg_num_threads);
+    // The main thread searches as well, it gets the first core.
+    if (cfg_pin_threads) {
+        SMP::pin_thread(0, cfg_numa);
+    }
+    // The searches of the served or self-play games run at the same
+    // time. The calibration may pick any number of threads.
+    const auto search_threads =
+        cfg_calibrate_threads ? cfg_max_threads : cfg_num_threads;
+    const auto games = cfg_selfplay_games > 0
+        ? std::min(cfg_selfplay_games, cfg_selfplay_parallel)
+        : cfg_serve_games;
+    const auto pool_threads = search_threads * std::max(1, games);
+    thread_pool.initialize(pool_threads, [](const size_t index) {
+        if (cfg_pin_threads) {
+            SMP::pin_thread(index + 1, cfg_numa);
+        }
+    });
 
     // Use deterministic random numbers for hashing
     auto rng = std::make_unique<Random>(5489);
@@ -386,12 +649,29 @@ void init_global_objects() {
     // improves reproducibility across platforms.
     Random::get_Rng().seedrandom(cfg_rng_seed);
 
-    // When visits are limited ensure cache size is still limited.
-    auto playouts = std::min(cfg_max_playouts, cfg_max_visits);
-    NNCache::get_NNCache().set_size_from_playouts(playouts);
+    if (cfg_cache_size_mb > 0) {
+        NNCache::get_NNCache().set_size_mb(cfg_cache_size_mb);
+    } else {
+        // When visits are limited ensure cache size is still limited.
+        auto playouts = std::min(cfg_max_playouts, cfg_max_visits);
+        NNCache::get_NNCache().set_size_from_playouts(playouts);
+    }
+    if (!cfg_shared_cache.empty()) {
+        NNCache::get_NNCache().attach_shared(cfg_shared_cache,
+                                             cfg_shared_cache_mb);
+    }
+    if (!cfg_opening_cache.empty()) {
+        OpeningCache::get_OpeningCache().open(cfg_opening_cache);
+    }
 
-    // Initialize network
-    Network::initialize();
+    // Initialize network. GTP answers the commands that don't need it
+    // while it loads.
+    auto background = cfg_gtp_mode;
+#ifdef USE_OPENCL
+    // Tuning exits once it's done.
+    background = background && !cfg_tune_only;
+#endif
+    Network::initialize(background);
 }
 
 void benchmark(GameState& game) {
@@ -432,19 +712,70 @@ int main(int argc, char *argv[]) {
     auto komi = cfg_komi;
     maingame->init_game(BOARD_SIZE, komi);
 
+    if (!cfg_benchmark_suite.empty()) {
+        try {
+            BenchmarkSuite::run(cfg_benchmark_suite);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        return 0;
+    }
+
     if (cfg_benchmark) {
         cfg_quiet = false;
         benchmark(*maingame);
         return 0;
     }
 
+    if (cfg_calibrate_threads || cfg_calibrate_leaf_batch) {
+        Calibration::apply(cfg_calibrate_threads, cfg_calibrate_leaf_batch);
+    }
+
+    if (cfg_metrics_port) {
+        Metrics::start_server(cfg_metrics_port);
+    }
+
+    if (!cfg_nn_daemon.empty()) {
+        return Network::run_daemon(cfg_nn_daemon) ? 0 : EXIT_FAILURE;
+    }
+
+    if (cfg_worker_port) {
+        DistributedSearch::run_worker(cfg_worker_port);
+        return 0;
+    }
+
+    if (cfg_serve_games > 0) {
+        GameServer::run(cfg_serve_games);
+        return 0;
+    }
+
+    if (cfg_selfplay_games > 0) {
+        SelfPlay::run(cfg_selfplay_games, cfg_selfplay_parallel,
+                      cfg_selfplay_output);
+        return 0;
+    }
+
+    // Only the GTP and console loop reads stdin, the modes above return
+    // before. A ponder stops for the next command, but answers the
+    // queries before it on the way.
+    GTPReader reader;
+    Utils::set_input_check([&](const bool answer_queries) {
+        auto query = std::string{};
+        while (answer_queries && reader.next_query(query)) {
+            Utils::log_input(query);
+            GTP::execute(*maingame, query);
+        }
+        return reader.pending();
+    });
+
     for (;;) {
         if (!cfg_gtp_mode) {
             maingame->display_state();
             std::cout << "Leela: ";
         }
 
-        if (std::getline(std::cin, input)) {
+        if (reader.next(input)) {
             Utils::log_input(input);
             GTP::execute(*maingame, input);
         } else {
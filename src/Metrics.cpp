@@ -0,0 +1,466 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "Metrics.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <boost/format.hpp>
+#include <chrono>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "Profile.h"
+#include "SMP.h"
+#include "UCTNodePool.h"
+#include "Utils.h"
+
+using namespace Utils;
+using boost::asio::ip::tcp;
+
+namespace {
+    using counter_t = std::atomic<std::uint64_t>;
+
+    constexpr auto CACHE_LINE = size_t{64};
+
+    // Only the owning thread writes to a slot, the readers may see
+    // the counters a little late. The padding keeps the counters off
+    // the cache lines of the neighbouring allocations.
+    struct Slot {
+        char front_padding[CACHE_LINE];
+        std::array<counter_t, Metrics::NUM_COUNTERS> counters;
+        std::array<std::array<counter_t, Metrics::BUCKETS>,
+                   Metrics::NUM_HISTOGRAMS> buckets;
+        std::array<counter_t, Metrics::NUM_HISTOGRAMS> sums;
+        // Nanoseconds.
+        std::array<counter_t, Metrics::MAX_DEVICES> busy;
+        char back_padding[CACHE_LINE];
+    };
+
+    // With a single writer a load and a store are enough, and much
+    // cheaper than a locked add.
+    void bump(counter_t& counter, const std::uint64_t count) {
+        counter.store(counter.load(std::memory_order_relaxed) + count,
+                      std::memory_order_relaxed);
+    }
+
+    template <typename Array>
+    void add_all(Array& to, const Array& from) {
+        for (auto i = size_t{0}; i < to.size(); i++) {
+            bump(to[i], from[i].load(std::memory_order_relaxed));
+        }
+    }
+
+    void add_slot(Slot& to, const Slot& from) {
+        add_all(to.counters, from.counters);
+        for (auto h = size_t{0}; h < to.buckets.size(); h++) {
+            add_all(to.buckets[h], from.buckets[h]);
+        }
+        add_all(to.sums, from.sums);
+        add_all(to.busy, from.busy);
+    }
+
+    struct Registry {
+        std::mutex mutex;
+        std::vector<Slot*> slots;
+        // Counts of the threads that ended.
+        Slot retired;
+        // For the rates of summary().
+        std::array<std::uint64_t, Metrics::NUM_COUNTERS> last_counters;
+        std::chrono::steady_clock::time_point last_time;
+    };
+
+    // Never destroyed, threads may still end while the program exits.
+    Registry& registry() {
+        static auto registry = [] {
+            const auto r = new Registry();
+            r->last_time = std::chrono::steady_clock::now();
+            return r;
+        }();
+        return *registry;
+    }
+
+    // Plain pointer, so that the hot paths only test it.
+    thread_local Slot* t_slot = nullptr;
+    // Takes what is counted while the thread exits, after its slot
+    // was retired.
+    thread_local Slot t_discarded;
+
+    struct SlotOwner {
+        Slot* slot;
+        ~SlotOwner() {
+            auto& r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            add_slot(r.retired, *slot);
+            r.slots.erase(std::find(begin(r.slots), end(r.slots), slot));
+            delete slot;
+            t_slot = &t_discarded;
+        }
+    };
+
+    Slot& local_slot() {
+        if (!t_slot) {
+            const auto slot = new Slot();
+            {
+                auto& r = registry();
+                std::lock_guard<std::mutex> lock(r.mutex);
+                r.slots.emplace_back(slot);
+            }
+            thread_local SlotOwner owner{slot};
+            t_slot = owner.slot;
+        }
+        return *t_slot;
+    }
+
+    void total(Slot& result) {
+        auto& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        add_slot(result, r.retired);
+        for (const auto slot : r.slots) {
+            add_slot(result, *slot);
+        }
+    }
+
+    std::uint64_t value(const counter_t& counter) {
+        return counter.load(std::memory_order_relaxed);
+    }
+
+    int bucket_of(const std::uint64_t value) {
+        auto bucket = 0;
+        while (bucket < Metrics::BUCKETS - 1
+               && value > (std::uint64_t{1} << bucket)) {
+            bucket++;
+        }
+        return bucket;
+    }
+
+    Metrics::HistogramData histogram_of(const Slot& slot,
+                                        const int histogram) {
+        auto result = Metrics::HistogramData{};
+        for (auto b = 0; b < Metrics::BUCKETS; b++) {
+            result.buckets[b] = value(slot.buckets[histogram][b]);
+        }
+        result.sum = value(slot.sums[histogram]);
+        return result;
+    }
+
+    void write_counter(std::ostream& out, const char* name,
+                       const char* help, const std::uint64_t count) {
+        out << "# HELP " << name << " " << help << "\n"
+            << "# TYPE " << name << " counter\n"
+            << name << " " << count << "\n";
+    }
+
+    void write_gauge(std::ostream& out, const char* name,
+                     const char* help, const std::uint64_t count) {
+        out << "# HELP " << name << " " << help << "\n"
+            << "# TYPE " << name << " gauge\n"
+            << name << " " << count << "\n";
+    }
+
+    void write_histogram_header(std::ostream& out, const char* name,
+                                const char* help) {
+        out << "# HELP " << name << " " << help << "\n"
+            << "# TYPE " << name << " histogram\n";
+    }
+
+    // labels is empty or ends with a comma.
+    void write_histogram_values(std::ostream& out, const char* name,
+                                const std::string& labels,
+                                const Metrics::HistogramData& histogram) {
+        auto count = std::uint64_t{0};
+        for (auto b = 0; b < Metrics::BUCKETS; b++) {
+            count += histogram.buckets[b];
+            if (b < Metrics::BUCKETS - 1) {
+                out << name << "_bucket{" << labels << "le=\""
+                    << (std::uint64_t{1} << b) << "\"} " << count << "\n";
+            }
+        }
+        const auto braces = labels.empty()
+            ? std::string()
+            : "{" + labels.substr(0, labels.size() - 1) + "}";
+        out << name << "_bucket{" << labels << "le=\"+Inf\"} " << count
+            << "\n"
+            << name << "_sum" << braces << " " << histogram.sum << "\n"
+            << name << "_count" << braces << " " << count << "\n";
+    }
+
+    void serve(tcp::socket& socket) {
+        // Whatever the request, the answer is the same.
+        boost::asio::streambuf request;
+        boost::asio::read_until(socket, request, "\r\n\r\n");
+        const auto body = Metrics::prometheus();
+        const auto header =
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: " + std::to_string(body.size()) + "\r\n"
+            "Connection: close\r\n\r\n";
+        boost::asio::write(socket, boost::asio::buffer(header));
+        boost::asio::write(socket, boost::asio::buffer(body));
+    }
+}
+
+void Metrics::add(const Counter counter, const std::uint64_t count) {
+    bump(local_slot().counters[counter], count);
+}
+
+void Metrics::observe(const Histogram histogram, const std::uint64_t value) {
+    auto& slot = local_slot();
+    bump(slot.buckets[histogram][bucket_of(value)], 1);
+    bump(slot.sums[histogram], value);
+}
+
+void Metrics::add_device_busy(const int device, const double seconds) {
+    if (device >= 0 && device < MAX_DEVICES && seconds > 0.0) {
+        bump(local_slot().busy[device],
+             static_cast<std::uint64_t>(seconds * 1e9));
+    }
+}
+
+std::uint64_t Metrics::get(const Counter counter) {
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    auto result = value(r.retired.counters[counter]);
+    for (const auto slot : r.slots) {
+        result += value(slot->counters[counter]);
+    }
+    return result;
+}
+
+std::uint64_t Metrics::HistogramData::count() const {
+    auto result = std::uint64_t{0};
+    for (const auto bucket : buckets) {
+        result += bucket;
+    }
+    return result;
+}
+
+std::uint64_t Metrics::HistogramData::percentile(
+    const double fraction) const {
+    const auto total = count();
+    auto seen = std::uint64_t{0};
+    for (auto b = 0; b < BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen > 0 && seen >= fraction * total) {
+            return std::uint64_t{1} << b;
+        }
+    }
+    return 0;
+}
+
+Metrics::HistogramData Metrics::get(const Histogram histogram) {
+    Slot sum{};
+    total(sum);
+    return histogram_of(sum, histogram);
+}
+
+std::string Metrics::summary() {
+    Slot sum{};
+    total(sum);
+    auto& r = registry();
+    auto rates = std::array<double, NUM_COUNTERS>{};
+    {
+        std::lock_guard<std::mutex> lock(r.mutex);
+        const auto now = std::chrono::steady_clock::now();
+        const auto seconds = std::max(
+            std::chrono::duration<double>(now - r.last_time).count(), 0.001);
+        for (auto i = size_t{0}; i < rates.size(); i++) {
+            const auto count = value(sum.counters[i]);
+            rates[i] = (count - r.last_counters[i]) / seconds;
+            r.last_counters[i] = count;
+        }
+        r.last_time = now;
+    }
+
+    const auto counter = [&sum](const Counter c) {
+        return value(sum.counters[c]);
+    };
+    auto out = std::ostringstream{};
+    out << boost::format("playouts %d (%.1f/s)\n")
+        % counter(PLAYOUTS) % rates[PLAYOUTS];
+    out << boost::format("nodes %d (%.1f/s), %d in use, %d MB\n")
+        % counter(NODES) % rates[NODES]
+        % UCTNodePool::get_nodes_in_use()
+        % (UCTNodePool::get_bytes_in_use() / (1024 * 1024));
+    out << boost::format("huge pages %d MB of %d MB of tree and nncache\n")
+        % (SMP::get_huge_page_bytes() / (1024 * 1024))
+        % (SMP::get_large_bytes() / (1024 * 1024));
+    out << boost::format("nn evals %d (%.1f/s), latency p50 %d us, "
+                         "p99 %d us\n")
+        % counter(NN_EVALS) % rates[NN_EVALS]
+        % histogram_of(sum, NN_LATENCY).percentile(0.5)
+        % histogram_of(sum, NN_LATENCY).percentile(0.99);
+    out << "nn batch sizes";
+    for (auto b = 0; b < BUCKETS; b++) {
+        const auto count = value(sum.buckets[NN_BATCH_SIZE][b]);
+        if (count > 0) {
+            out << " <=" << (std::uint64_t{1} << b) << ":" << count;
+        }
+    }
+    out << "\n";
+    const auto hits = counter(NNCACHE_HITS) + counter(NNCACHE_SHARED_HITS);
+    out << boost::format("nncache %d hits, %d misses, %d evictions\n")
+        % hits % (counter(NNCACHE_LOOKUPS) - hits) % counter(NNCACHE_EVICTIONS);
+    for (auto d = 0; d < MAX_DEVICES; d++) {
+        const auto busy = value(sum.busy[d]);
+        if (busy > 0) {
+            out << boost::format("gpu %d busy %.3f s\n") % d % (busy * 1e-9);
+        }
+    }
+    out << boost::format("locks %d acquisitions, %d contended, "
+                         "%d yields\n")
+        % counter(LOCK_ACQUISITIONS) % counter(LOCK_CONTENDED)
+        % counter(LOCK_YIELDS);
+    out << boost::format("ponder %d hits of %d moves\n")
+        % counter(PONDER_HITS) % counter(PONDERS);
+    out << boost::format("speculation %d hits of %d evals\n")
+        % counter(SPECULATIVE_HITS) % counter(SPECULATIVE_EVALS);
+    out << boost::format("opening cache %d hits\n")
+        % counter(OPENING_CACHE_HITS);
+    out << boost::format("endgames %d solved, %d unsolved")
+        % counter(ENDGAME_SOLVED) % counter(ENDGAME_UNSOLVED);
+    return out.str();
+}
+
+std::string Metrics::prometheus() {
+    Slot sum{};
+    total(sum);
+    const auto counter = [&sum](const Counter c) {
+        return value(sum.counters[c]);
+    };
+    auto out = std::ostringstream{};
+    write_counter(out, "leelaz_playouts_total", "Playouts of all searches.",
+                  counter(PLAYOUTS));
+    write_counter(out, "leelaz_nodes_total", "Tree nodes allocated.",
+                  counter(NODES));
+    write_gauge(out, "leelaz_tree_nodes", "Tree nodes alive.",
+                UCTNodePool::get_nodes_in_use());
+    write_gauge(out, "leelaz_tree_bytes", "Memory of the tree nodes alive.",
+                UCTNodePool::get_bytes_in_use());
+    write_gauge(out, "leelaz_large_bytes",
+                "Memory of the tree nodes and the NNCache entries.",
+                SMP::get_large_bytes());
+    write_gauge(out, "leelaz_huge_page_bytes",
+                "Memory of the tree nodes and the NNCache entries that is "
+                "in huge pages.",
+                SMP::get_huge_page_bytes());
+    write_counter(out, "leelaz_nn_evals_total", "Positions evaluated.",
+                  counter(NN_EVALS));
+    const auto latency_name = "leelaz_nn_latency_microseconds";
+    write_histogram_header(out, latency_name,
+        "Time from the request of an evaluation to its result.");
+    write_histogram_values(out, latency_name, "",
+                           histogram_of(sum, NN_LATENCY));
+    const auto batch_name = "leelaz_nn_batch_size";
+    write_histogram_header(out, batch_name,
+                           "Positions per run of the network.");
+    write_histogram_values(out, batch_name, "",
+                           histogram_of(sum, NN_BATCH_SIZE));
+    if (Profile::enabled()) {
+        const auto phase_name = "leelaz_phase_nanoseconds";
+        write_histogram_header(out, phase_name,
+                               "Time in each phase of the playouts.");
+        for (auto p = 0; p < Profile::NUM_PHASES; p++) {
+            const auto phase = static_cast<Profile::Phase>(p);
+            write_histogram_values(
+                out, phase_name,
+                std::string("phase=\"") + Profile::get_name(phase) + "\",",
+                histogram_of(sum, PHASE_SELECT + p));
+        }
+    }
+    write_counter(out, "leelaz_nncache_lookups_total", "NNCache lookups.",
+                  counter(NNCACHE_LOOKUPS));
+    write_counter(out, "leelaz_nncache_hits_total",
+                  "NNCache hits, in memory.", counter(NNCACHE_HITS));
+    write_counter(out, "leelaz_nncache_shared_hits_total",
+                  "NNCache hits in the shared segment.",
+                  counter(NNCACHE_SHARED_HITS));
+    write_counter(out, "leelaz_nncache_inserts_total", "NNCache inserts.",
+                  counter(NNCACHE_INSERTS));
+    write_counter(out, "leelaz_nncache_evictions_total",
+                  "NNCache evictions.", counter(NNCACHE_EVICTIONS));
+
+    const auto busy_name = "leelaz_gpu_busy_seconds_total";
+    out << "# HELP " << busy_name << " Time with evaluations on the GPU.\n"
+        << "# TYPE " << busy_name << " counter\n";
+    for (auto d = 0; d < MAX_DEVICES; d++) {
+        const auto busy = value(sum.busy[d]);
+        if (busy > 0) {
+            out << busy_name << "{gpu=\"" << d << "\"} "
+                << boost::format("%.6f") % (busy * 1e-9) << "\n";
+        }
+    }
+
+    write_counter(out, "leelaz_lock_acquisitions_total",
+                  "SMP::Lock acquisitions.", counter(LOCK_ACQUISITIONS));
+    write_counter(out, "leelaz_lock_contended_total",
+                  "SMP::Lock acquisitions that had to wait.",
+                  counter(LOCK_CONTENDED));
+    write_counter(out, "leelaz_lock_yields_total",
+                  "Times an SMP::Lock waiter yielded the CPU.",
+                  counter(LOCK_YIELDS));
+    write_counter(out, "leelaz_ponders_total",
+                  "Opponent moves played after a ponder.", counter(PONDERS));
+    write_counter(out, "leelaz_ponder_hits_total",
+                  "Opponent moves that the ponder had searched.",
+                  counter(PONDER_HITS));
+    write_counter(out, "leelaz_speculative_evals_total",
+                  "Positions evaluated in the empty slots of a batch.",
+                  counter(SPECULATIVE_EVALS));
+    write_counter(out, "leelaz_speculative_hits_total",
+                  "Speculative evaluations that a search used.",
+                  counter(SPECULATIVE_HITS));
+    write_counter(out, "leelaz_opening_cache_hits_total",
+                  "Evaluations found in the opening cache.",
+                  counter(OPENING_CACHE_HITS));
+    write_counter(out, "leelaz_endgames_solved_total",
+                  "Leaves whose exact score was found.",
+                  counter(ENDGAME_SOLVED));
+    write_counter(out, "leelaz_endgames_unsolved_total",
+                  "Leaves the endgame solver gave up on.",
+                  counter(ENDGAME_UNSOLVED));
+    return out.str();
+}
+
+void Metrics::start_server(const int port) {
+    std::thread([port] {
+        try {
+            boost::asio::io_service io;
+            tcp::acceptor acceptor(
+                io, tcp::endpoint(tcp::v4(),
+                                  static_cast<unsigned short>(port)));
+            myprintf("Serving metrics on port %d.\n", port);
+            for (;;) {
+                tcp::socket socket(io);
+                acceptor.accept(socket);
+                try {
+                    serve(socket);
+                } catch (const std::exception&) {
+                    // The scraper went away, wait for the next one.
+                }
+            }
+        } catch (const std::exception& e) {
+            myprintf("Can't serve metrics on port %d: %s\n", port, e.what());
+        }
+    }).detach();
+}
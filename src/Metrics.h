@@ -0,0 +1,116 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef METRICS_H_INCLUDED
+#define METRICS_H_INCLUDED
+
+#include "config.h"
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+// Counters of the whole process, for the lz-stats command and the
+// --metrics-port endpoint. Every thread counts in its own slot, so the
+// hot paths never write to a cache line another thread uses. The slots
+// are only added up when the metrics are read, and the slot of a thread
+// that ends is added to the totals.
+namespace Metrics {
+    enum Counter {
+        PLAYOUTS,
+        // Tree nodes allocated.
+        NODES,
+        NN_EVALS,
+        NNCACHE_LOOKUPS,
+        NNCACHE_HITS,
+        NNCACHE_SHARED_HITS,
+        NNCACHE_INSERTS,
+        NNCACHE_EVICTIONS,
+        LOCK_ACQUISITIONS,
+        // Acquisitions that found the SMP::Lock taken.
+        LOCK_CONTENDED,
+        // Times a waiter gave up spinning and yielded.
+        LOCK_YIELDS,
+        // Opponent moves after a ponder, and the ones it had searched.
+        PONDERS,
+        PONDER_HITS,
+        // Positions evaluated in the empty slots of a batch, see
+        // --speculate, and the ones a search asked for later.
+        SPECULATIVE_EVALS,
+        SPECULATIVE_HITS,
+        // Evaluations found in the --opening-cache.
+        OPENING_CACHE_HITS,
+        // Leaves that --solve-empties tried, by whether it found the
+        // score.
+        ENDGAME_SOLVED,
+        ENDGAME_UNSOLVED,
+        NUM_COUNTERS
+    };
+
+    enum Histogram {
+        // Microseconds from the request of an evaluation to its result.
+        NN_LATENCY,
+        // Positions per run of the network.
+        NN_BATCH_SIZE,
+        // Nanoseconds in the Profile::Phase of the same name.
+        PHASE_SELECT,
+        PHASE_LOCK_WAIT,
+        PHASE_GATHER,
+        PHASE_QUEUE,
+        PHASE_COMPUTE,
+        PHASE_HEADS,
+        PHASE_BACKUP,
+        NUM_HISTOGRAMS
+    };
+
+    // Bucket b counts the values up to 2^b, the last one all the others.
+    constexpr auto BUCKETS = 32;
+    // GPUs with their own busy time.
+    constexpr auto MAX_DEVICES = 16;
+
+    void add(Counter counter, std::uint64_t count = 1);
+    void observe(Histogram histogram, std::uint64_t value);
+    // Time with evaluations on a GPU, ignored for devices past
+    // MAX_DEVICES.
+    void add_device_busy(int device, double seconds);
+
+    // Sum over all the threads.
+    std::uint64_t get(Counter counter);
+
+    struct HistogramData {
+        std::array<std::uint64_t, BUCKETS> buckets;
+        std::uint64_t sum;
+
+        std::uint64_t count() const;
+        // The smallest bucket bound with at least fraction of the
+        // values, 0 without values.
+        std::uint64_t percentile(double fraction) const;
+    };
+    HistogramData get(Histogram histogram);
+
+    // Human readable, with the rates since the previous call.
+    std::string summary();
+    // Prometheus text exposition format.
+    std::string prometheus();
+
+    // Answers every HTTP request on port with prometheus(), from a
+    // background thread.
+    void start_server(int port);
+}
+
+#endif
@@ -17,13 +17,78 @@
 */
 
 #include "config.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
 #include <functional>
+#include <limits>
+#include <type_traits>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "NNCache.h"
+#include "GTP.h"
+#include "SMP.h"
 #include "Utils.h"
 #include "UCTSearch.h"
 
-NNCache::NNCache(int size) : m_size(size) {}
+// Identifies the segment layout, bump when it changes.
+static constexpr auto SHARED_MAGIC = std::uint64_t{0x4c5a4e4e43000001};
+
+NNCache::NNCache(int size)
+    : m_shard_size((size + NUM_SHARDS - 1) / NUM_SHARDS) {}
+
+NNCache::NodePool::~NodePool() {
+    for (const auto slab : m_slabs) {
+        SMP::free_large(slab);
+    }
+}
+
+void* NNCache::NodePool::allocate(const std::size_t size) {
+    if (m_free) {
+        auto node = m_free;
+        m_free = node->next;
+        return node;
+    }
+    const auto node_size = (std::max(size, sizeof(FreeNode))
+                            + alignof(std::max_align_t) - 1)
+        / alignof(std::max_align_t) * alignof(std::max_align_t);
+    if (m_end - m_next < static_cast<std::ptrdiff_t>(node_size)) {
+        m_next = static_cast<char*>(
+            SMP::allocate_large(SMP::HUGE_PAGE_SIZE, cfg_huge_pages));
+        m_end = m_next + SMP::HUGE_PAGE_SIZE;
+        m_slabs.emplace_back(m_next);
+    }
+    const auto node = m_next;
+    m_next += node_size;
+    return node;
+}
+
+void NNCache::NodePool::deallocate(void* const p) {
+    auto node = static_cast<FreeNode*>(p);
+    node->next = m_free;
+    m_free = node;
+}
+
+NNCache::Entry::Entry(const Network::Netresult& r)
+    : policy_pass(r.policy_pass), value(r.value),
+      alpha(r.alpha), beta(r.beta) {
+    std::copy(begin(r.policy), end(r.policy), begin(policy));
+}
+
+void NNCache::Entry::get(Network::Netresult& r) const {
+    std::copy(begin(policy), end(policy), begin(r.policy));
+    r.policy_pass = policy_pass;
+    r.value = value;
+    r.alpha = alpha;
+    r.beta = beta;
+}
 
 NNCache& NNCache::get_NNCache(void) {
     static NNCache cache;
@@ -31,53 +96,261 @@ NNCache& NNCache::get_NNCache(void) {
 }
 
 bool NNCache::lookup(std::uint64_t hash, Network::Netresult & result) {
-    std::lock_guard<std::mutex> lock(m_mutex);
-    ++m_lookups;
+    Metrics::add(Metrics::NNCACHE_LOOKUPS);
 
-    auto iter = m_cache.find(hash);
-    if (iter == m_cache.end()) {
-        return false;  // Not found.
-    }
+    {
+        auto& shard = get_shard(hash);
+        std::lock_guard<std::mutex> lock(shard.mutex);
 
-    const auto& entry = iter->second;
+        auto iter = shard.cache.find(hash);
+        if (iter != shard.cache.end()) {
+            // Found it.
+            Metrics::add(Metrics::NNCACHE_HITS);
+            iter->second.referenced = true;
+            if (iter->second.speculative) {
+                iter->second.speculative = false;
+                Metrics::add(Metrics::SPECULATIVE_HITS);
+            }
+            iter->second.entry.get(result);
+            return true;
+        }
+    }
 
-    // Found it.
-    ++m_hits;
-    result = entry->result;
+    // Maybe another engine on the host has seen it.
+    auto entry = Entry{};
+    if (!lookup_shared(hash, entry)) {
+        return false;  // Not found.
+    }
+    Metrics::add(Metrics::NNCACHE_SHARED_HITS);
+    entry.get(result);
+    insert_local(hash, entry);
     return true;
 }
 
+bool NNCache::contains(std::uint64_t hash) {
+    auto& shard = get_shard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.cache.find(hash) != shard.cache.end();
+}
+
 void NNCache::insert(std::uint64_t hash,
-                     const Network::Netresult& result) {
-    std::lock_guard<std::mutex> lock(m_mutex);
+                     const Network::Netresult& result,
+                     const bool speculative) {
+    const auto entry = Entry{result};
+    insert_local(hash, entry, speculative);
+    insert_shared(hash, entry);
+}
+
+void NNCache::insert_local(std::uint64_t hash, const Entry& entry,
+                           const bool speculative) {
+    auto& shard = get_shard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
 
-    if (m_cache.find(hash) != m_cache.end()) {
+    if (shard.cache.find(hash) != shard.cache.end()) {
         return;  // Already in the cache.
     }
 
-    m_cache.emplace(hash, std::make_unique<Entry>(result));
-    m_order.push_back(hash);
-    ++m_inserts;
+    shard.cache.emplace(hash, entry).first->second.speculative = speculative;
+    shard.order.push_back(hash);
+    Metrics::add(Metrics::NNCACHE_INSERTS);
+    ++m_entries;
 
     // If the cache is too large, remove the oldest entry.
-    if (m_order.size() > m_size) {
-        m_cache.erase(m_order.front());
-        m_order.pop_front();
+    trim(shard);
+}
+
+void NNCache::trim(Shard& shard) {
+    const auto clock = (cfg_cache_eviction == CacheEviction::CLOCK);
+    while (shard.order.size() > m_shard_size) {
+        auto iter = shard.cache.find(shard.order.front());
+        shard.order.pop_front();
+        if (clock && iter->second.referenced) {
+            iter->second.referenced = false;
+            shard.order.push_back(iter->first);
+            continue;
+        }
+        shard.cache.erase(iter);
+        Metrics::add(Metrics::NNCACHE_EVICTIONS);
+        --m_entries;
     }
 }
 
+bool NNCache::attach_shared(const std::string& name, size_t megabytes) {
+    static_assert(std::is_trivially_copyable<Entry>::value,
+                  "Shared entries are copied as words");
+#ifdef _WIN32
+    (void)name;
+    (void)megabytes;
+    Utils::myprintf("The shared NNCache is not supported on Windows.\n");
+    return false;
+#else
+    auto created = true;
+    auto fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        created = false;
+        fd = shm_open(name.c_str(), O_RDWR, 0600);
+    }
+    if (fd < 0) {
+        Utils::myprintf("Could not open the shared NNCache %s.\n",
+                        name.c_str());
+        return false;
+    }
+
+    auto bytes = size_t{0};
+    if (created) {
+        const auto slots = std::max(SHARED_WAYS,
+            megabytes * 1024 * 1024 / sizeof(SharedSlot));
+        bytes = sizeof(SharedHeader) + slots * sizeof(SharedSlot);
+        if (ftruncate(fd, bytes) != 0) {
+            Utils::myprintf("Could not size the shared NNCache %s.\n",
+                            name.c_str());
+            close(fd);
+            shm_unlink(name.c_str());
+            return false;
+        }
+    } else {
+        // The creator may still be sizing it, the size it picked wins.
+        for (auto tries = 0; tries < 100; tries++) {
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                bytes = st.st_size;
+                break;
+            }
+            usleep(10000);
+        }
+    }
+    if (bytes < sizeof(SharedHeader) + sizeof(SharedSlot)) {
+        Utils::myprintf("The shared NNCache %s is not ready.\n", name.c_str());
+        close(fd);
+        return false;
+    }
+
+    auto mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        Utils::myprintf("Could not map the shared NNCache %s.\n", name.c_str());
+        return false;
+    }
+
+    // New shared memory is zeroed, which is an empty table.
+    auto header = static_cast<SharedHeader*>(mem);
+    const auto slots = (bytes - sizeof(SharedHeader)) / sizeof(SharedSlot);
+    if (created) {
+        header->entry_words = ENTRY_WORDS;
+        header->slots = slots;
+        header->magic.store(SHARED_MAGIC, std::memory_order_release);
+    } else {
+        for (auto tries = 0; tries < 100; tries++) {
+            if (header->magic.load(std::memory_order_acquire) != 0) {
+                break;
+            }
+            usleep(10000);
+        }
+    }
+    if (header->magic.load(std::memory_order_acquire) != SHARED_MAGIC
+        || header->entry_words != ENTRY_WORDS
+        || header->slots != slots) {
+        Utils::myprintf("The shared NNCache %s is from another build.\n",
+                 name.c_str());
+        munmap(mem, bytes);
+        return false;
+    }
+
+    // Never unmapped, it lives as long as the cache does.
+    m_shared_slots = reinterpret_cast<SharedSlot*>(header + 1);
+    m_shared_count = slots;
+    Utils::myprintf("Shared NNCache: %zu entries in %s.\n", slots, name.c_str());
+    return true;
+#endif
+}
+
+bool NNCache::lookup_shared(std::uint64_t hash, Entry& entry) {
+    if (!m_shared_slots) {
+        return false;
+    }
+
+    auto words = std::array<std::uint32_t, ENTRY_WORDS>{};
+    const auto bucket = hash % m_shared_count;
+    for (auto way = size_t{0}; way < SHARED_WAYS; way++) {
+        auto& slot = m_shared_slots[(bucket + way) % m_shared_count];
+        const auto seq = slot.seq.load(std::memory_order_acquire);
+        if ((seq & 1) || slot.key.load(std::memory_order_relaxed) != hash) {
+            continue;
+        }
+        for (auto i = size_t{0}; i < ENTRY_WORDS; i++) {
+            words[i] = slot.data[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != seq) {
+            return false;  // Overwritten while we read it.
+        }
+        std::memcpy(static_cast<void*>(&entry), words.data(),
+                    sizeof(Entry));
+        return true;
+    }
+    return false;
+}
+
+void NNCache::insert_shared(std::uint64_t hash, const Entry& entry) {
+    if (!m_shared_slots) {
+        return;
+    }
+
+    // Take a free way if there is one, otherwise the hash picks the
+    // victim so that the processes spread their writes.
+    const auto bucket = hash % m_shared_count;
+    auto victim = &m_shared_slots[(bucket + (hash >> 62) % SHARED_WAYS)
+                                  % m_shared_count];
+    for (auto way = size_t{0}; way < SHARED_WAYS; way++) {
+        auto& slot = m_shared_slots[(bucket + way) % m_shared_count];
+        const auto key = slot.key.load(std::memory_order_relaxed);
+        if (key == hash) {
+            return;  // Already in the cache.
+        }
+        if (key == 0) {
+            victim = &slot;
+            break;
+        }
+    }
+
+    auto seq = victim->seq.load(std::memory_order_relaxed);
+    if ((seq & 1)
+        || !victim->seq.compare_exchange_strong(seq, seq + 1,
+                                                std::memory_order_relaxed)) {
+        return;  // Someone else is writing it.
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+
+    auto words = std::array<std::uint32_t, ENTRY_WORDS>{};
+    std::memcpy(words.data(), &entry, sizeof(Entry));
+    victim->key.store(hash, std::memory_order_relaxed);
+    for (auto i = size_t{0}; i < ENTRY_WORDS; i++) {
+        victim->data[i].store(words[i], std::memory_order_relaxed);
+    }
+    victim->seq.store(seq + 2, std::memory_order_release);
+}
+
 void NNCache::resize(int size) {
-    m_size = size;
-    while (m_order.size() > m_size) {
-        m_cache.erase(m_order.front());
-        m_order.pop_front();
+    m_shard_size = (size + NUM_SHARDS - 1) / NUM_SHARDS;
+    for (auto& shard : m_shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        trim(shard);
+    }
+}
+
+void NNCache::clear() {
+    for (auto& shard : m_shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        m_entries -= shard.cache.size();
+        shard.cache.clear();
+        shard.order.clear();
     }
 }
 
 void NNCache::set_size_from_playouts(int max_playouts) {
     // cache hits are generally from last several moves so setting cache
     // size based on playouts increases the hit rate while balancing memory
-    // usage for low playout instances. 150'000 cache entries is ~225 MB
+    // usage for low playout instances.
     constexpr auto num_cache_moves = 3;
     auto max_playouts_per_move =
         std::min(max_playouts,
@@ -87,9 +360,38 @@ void NNCache::set_size_from_playouts(int max_playouts) {
     NNCache::get_NNCache().resize(max_size);
 }
 
+void NNCache::set_size_mb(size_t megabytes) {
+    const auto entries = megabytes * 1024 * 1024 / ENTRY_SIZE;
+    resize(static_cast<int>(std::min<size_t>(
+        entries, std::numeric_limits<int>::max())));
+    Utils::myprintf("NNCache: %zu entries in %zu MB\n", entries, megabytes);
+}
+
 void NNCache::dump_stats() {
+    auto size = size_t{0};
+    for (auto& shard : m_shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        size += shard.cache.size();
+    }
+    const auto hits = Metrics::get(Metrics::NNCACHE_HITS);
+    const auto lookups = Metrics::get(Metrics::NNCACHE_LOOKUPS);
+    const auto shared_hits = Metrics::get(Metrics::NNCACHE_SHARED_HITS);
     Utils::myprintf(
-        "NNCache: %d/%d hits/lookups = %.1f%% hitrate, %d inserts, %u size\n",
-        m_hits, m_lookups, 100. * m_hits / (m_lookups + 1),
-        m_inserts, m_cache.size());
+        "NNCache: %llu/%llu hits/lookups = %.1f%% hitrate, %llu inserts, "
+        "%zu size\n",
+        static_cast<unsigned long long>(hits),
+        static_cast<unsigned long long>(lookups),
+        100. * hits / (lookups + 1),
+        static_cast<unsigned long long>(
+            Metrics::get(Metrics::NNCACHE_INSERTS)), size);
+    Utils::myprintf("NNCache: %s eviction, %llu misses, %llu evictions\n",
+        cfg_cache_eviction == CacheEviction::CLOCK ? "clock" : "fifo",
+        static_cast<unsigned long long>(lookups - hits - shared_hits),
+        static_cast<unsigned long long>(
+            Metrics::get(Metrics::NNCACHE_EVICTIONS)));
+    if (m_shared_slots) {
+        Utils::myprintf("Shared NNCache: %llu hits = %.1f%% of the lookups\n",
+                 static_cast<unsigned long long>(shared_hits),
+                 100. * shared_hits / (lookups + 1));
+    }
 }
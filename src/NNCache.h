@@ -21,10 +21,21 @@
 
 #include "config.h"
 
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
 #include <deque>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
+#include "half/half.hpp"
+#include "Metrics.h"
 #include "Network.h"
 
 class NNCache {
@@ -35,45 +46,224 @@ public:
     // Set a reasonable size gives max number of playouts
     void set_size_from_playouts(int max_playouts);
 
+    // Size the cache to use about this many megabytes.
+    void set_size_mb(size_t megabytes);
+
     // Resize NNCache
     void resize(int size);
 
+    // Remove all entries, e.g. after loading another network.
+    void clear();
+
+    // Put a second level behind the cache, in the shared memory segment
+    // of that name, which all the engines on the host can use.
+    bool attach_shared(const std::string& name, size_t megabytes);
+
     // Try and find an existing entry.
     bool lookup(std::uint64_t hash, Network::Netresult & result);
 
-    // Insert a new entry.
+    // Whether the entry is here, without counting a lookup. Doesn't
+    // look in the shared segment.
+    bool contains(std::uint64_t hash);
+
+    // Insert a new entry. The first lookup that finds a speculative
+    // entry counts a SPECULATIVE_HIT.
     void insert(std::uint64_t hash,
-                const Network::Netresult& result);
+                const Network::Netresult& result,
+                bool speculative = false);
 
     // Return the hit rate ratio.
-    std::pair<int, int> hit_rate() const {
-        return {m_hits, m_lookups};
+    std::pair<std::uint64_t, std::uint64_t> hit_rate() const {
+        return {Metrics::get(Metrics::NNCACHE_HITS)
+                    + Metrics::get(Metrics::NNCACHE_SHARED_HITS),
+                Metrics::get(Metrics::NNCACHE_LOOKUPS)};
     }
 
     void dump_stats();
 
-private:
-    NNCache(int size = 150000);  // ~ 225MB
+    // Entries the cache holds at most.
+    size_t get_capacity() const {
+        return m_shard_size * NUM_SHARDS;
+    }
 
-    std::mutex m_mutex;
+    // Memory taken by the entries, without the shared segment.
+    size_t get_estimated_size() const {
+        return m_entries * ENTRY_SIZE;
+    }
 
-    size_t m_size;
+private:
+    NNCache(int size = 150000);
 
-    // Statistics
-    int m_hits{0};
-    int m_lookups{0};
-    int m_inserts{0};
+    // The cache is split by the top bits of the hash, every shard has
+    // its own lock, so threads looking up different positions rarely
+    // wait for each other.
+    static constexpr auto SHARD_BITS = 6;
+    static constexpr auto NUM_SHARDS = size_t{1} << SHARD_BITS;
 
+    // The policy is stored in half precision, which is plenty for
+    // priors, and the entry lives inline in the map node.
     struct Entry {
-        Entry(const Network::Netresult& r)
-            : result(r) {}
-        Network::Netresult result;  // ~ 1.5KB
+        Entry() = default;
+        Entry(const Network::Netresult& r);
+        void get(Network::Netresult& r) const;
+
+        std::array<half_float::half, BOARD_SQUARES> policy;
+        half_float::half policy_pass;
+        float value;
+        float alpha;
+        float beta;
+    };
+
+    struct Node {
+        Node(const Entry& e) : entry(e) {}
+        Entry entry;
+        // Hit since the eviction clock last passed it.
+        bool referenced{false};
+        // Not looked up yet since a speculative insert.
+        bool speculative{false};
+    };
+
+    // Estimated memory per entry: the map node with its bucket pointer,
+    // and the FIFO slot.
+    static constexpr size_t ENTRY_SIZE =
+        sizeof(std::pair<const std::uint64_t, Node>)
+        + 2 * sizeof(void*) + sizeof(std::uint64_t);
+
+    // The map nodes of a shard come from slabs of SMP::allocate_large(),
+    // under the lock of the shard, so with --huge-pages the entries are
+    // in huge pages. Freed nodes stay with the shard for the next ones.
+    class NodePool {
+    public:
+        NodePool() = default;
+        ~NodePool();
+        NodePool(const NodePool&) = delete;
+        NodePool& operator=(const NodePool&) = delete;
+
+        // Every call must have the same size.
+        void* allocate(std::size_t size);
+        void deallocate(void* p);
+
+    private:
+        struct FreeNode {
+            FreeNode* next;
+        };
+        std::vector<void*> m_slabs;
+        FreeNode* m_free{nullptr};
+        // The part of the last slab that was never used, so its pages
+        // are only touched once entries need them.
+        char* m_next{nullptr};
+        char* m_end{nullptr};
+    };
+
+    // Takes the map nodes from a NodePool, and the bucket arrays, which
+    // hold no entries, from the heap.
+    template <typename T>
+    class NodeAllocator {
+    public:
+        using value_type = T;
+
+        explicit NodeAllocator(NodePool& pool) : m_pool(&pool) {}
+        template <typename U>
+        NodeAllocator(const NodeAllocator<U>& other)
+            : m_pool(other.m_pool) {}
+
+        T* allocate(const std::size_t n) {
+            if (is_node(n)) {
+                return static_cast<T*>(m_pool->allocate(sizeof(T)));
+            }
+            return std::allocator<T>().allocate(n);
+        }
+        void deallocate(T* const p, const std::size_t n) {
+            if (is_node(n)) {
+                m_pool->deallocate(p);
+            } else {
+                std::allocator<T>().deallocate(p, n);
+            }
+        }
+
+        template <typename U>
+        bool operator==(const NodeAllocator<U>& other) const {
+            return m_pool == other.m_pool;
+        }
+        template <typename U>
+        bool operator!=(const NodeAllocator<U>& other) const {
+            return m_pool != other.m_pool;
+        }
+
+    private:
+        template <typename U> friend class NodeAllocator;
+
+        // Only the map nodes are allocated one at a time and hold an
+        // Entry.
+        static bool is_node(const std::size_t n) {
+            return n == 1 && sizeof(T) >= sizeof(Entry);
+        }
+
+        NodePool* m_pool;
     };
 
-    // Map from hash to {features, result}
-    std::unordered_map<std::uint64_t, std::unique_ptr<const Entry>> m_cache;
-    // Order entries were added to the map.
-    std::deque<size_t> m_order;
+    using Map = std::unordered_map<
+        std::uint64_t, Node, std::hash<std::uint64_t>,
+        std::equal_to<std::uint64_t>,
+        NodeAllocator<std::pair<const std::uint64_t, Node>>>;
+
+    struct Shard {
+        Shard() : cache(0, Map::hasher(), Map::key_equal(),
+                        Map::allocator_type(pool)) {}
+        std::mutex mutex;
+        // Before the map, which gives its nodes back to it.
+        NodePool pool;
+        // Map from hash to result
+        Map cache;
+        // Order entries were added to the map, or got their second
+        // chance in.
+        std::deque<std::uint64_t> order;
+    };
+
+    Shard& get_shard(std::uint64_t hash) {
+        return m_shards[hash >> (64 - SHARD_BITS)];
+    }
+    // Evicts entries of the locked shard down to the size. With CLOCK
+    // an entry that was hit goes to the back once instead.
+    void trim(Shard& shard);
+    void insert_local(std::uint64_t hash, const Entry& entry,
+                      bool speculative = false);
+
+    // The shared segment is a table of seqlocked slots. The sequence is
+    // odd while a writer fills the slot, and a reader that sees it change
+    // counts a miss. Every access goes through atomics, so no process
+    // ever takes a lock.
+    static constexpr auto ENTRY_WORDS =
+        (sizeof(Entry) + sizeof(std::uint32_t) - 1) / sizeof(std::uint32_t);
+    // Number of slots a position can be stored in.
+    static constexpr auto SHARED_WAYS = size_t{4};
+
+    struct SharedHeader {
+        // Written last by the creator, once the rest is valid.
+        std::atomic<std::uint64_t> magic;
+        std::uint64_t entry_words;
+        std::uint64_t slots;
+    };
+
+    struct SharedSlot {
+        std::atomic<std::uint64_t> seq;
+        std::atomic<std::uint64_t> key;
+        std::array<std::atomic<std::uint32_t>, ENTRY_WORDS> data;
+    };
+
+    bool lookup_shared(std::uint64_t hash, Entry& entry);
+    void insert_shared(std::uint64_t hash, const Entry& entry);
+
+    SharedSlot* m_shared_slots{nullptr};
+    size_t m_shared_count{0};
+
+    std::array<Shard, NUM_SHARDS> m_shards;
+
+    // Entries per shard.
+    std::atomic<size_t> m_shard_size;
+
+    // The hits and lookups are counted in Metrics.
+    std::atomic<size_t> m_entries{0};
 };
 
 #endif
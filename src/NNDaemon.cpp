@@ -0,0 +1,417 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "NNDaemon.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <stdexcept>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "Network.h"
+#include "Utils.h"
+
+using namespace Utils;
+using clock_type = std::chrono::steady_clock;
+
+// Identifies the segment layout, bump when it changes.
+static constexpr auto SEGMENT_MAGIC = std::uint64_t{0x4c5a4e4e44000001};
+static constexpr auto INPUT_SIZE = Network::INPUT_CHANNELS * BOARD_SQUARES;
+
+// A slot goes FREE -> FILLING -> READY on the client, READY -> RUNNING
+// -> DONE on the daemon and back to FREE on the client. A client that
+// sleeps until its slot is DONE adds WAITER, so that the daemon only
+// wakes the ones that sleep.
+enum : std::uint32_t { FREE, FILLING, READY, RUNNING, DONE };
+static constexpr auto PHASE = std::uint32_t{0xff};
+static constexpr auto WAITER = std::uint32_t{0x100};
+
+// Every wait ends after this long, to see if the other side is still
+// there.
+static constexpr auto CHECK_WAIT = std::chrono::milliseconds(500);
+// Between two lines of statistics of the daemon.
+static constexpr auto STATS_INTERVAL = std::chrono::seconds(60);
+
+struct NNDaemon::Segment {
+    // Written last by the daemon, once the rest is valid.
+    std::atomic<std::uint64_t> magic;
+    NetInfo info;
+    std::int64_t pid;
+    // Where the clients start to look for a free slot.
+    std::atomic<std::uint32_t> next_slot;
+    // Bumped after every submission, the idle workers sleep on it.
+    std::atomic<std::uint32_t> submitted;
+    std::atomic<std::uint32_t> sleepers;
+
+    struct Slot {
+        std::atomic<std::uint32_t> state;
+        std::array<float, INPUT_SIZE> input;
+        std::array<float, MAX_OUTPUTS> output;
+    };
+    std::array<Slot, SLOTS> slots;
+};
+
+#ifndef _WIN32
+// Sleeps while word is value, at most timeout. The words are in shared
+// memory, so the futexes are not private to the process.
+static void wait_word(std::atomic<std::uint32_t>& word,
+                      const std::uint32_t value,
+                      const clock_type::duration timeout) {
+#ifdef __linux__
+    static_assert(sizeof(word) == sizeof(std::uint32_t),
+                  "Futexes are 32 bit words");
+    const auto micros =
+        std::chrono::duration_cast<std::chrono::microseconds>(timeout).count();
+    auto time = timespec{};
+    time.tv_sec = micros / 1000000;
+    time.tv_nsec = (micros % 1000000) * 1000;
+    syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAIT,
+            value, &time, nullptr, 0);
+#else
+    if (word.load(std::memory_order_acquire) == value) {
+        std::this_thread::sleep_for(
+            std::min<clock_type::duration>(timeout,
+                                           std::chrono::microseconds(50)));
+    }
+#endif
+}
+
+static void wake_word(std::atomic<std::uint32_t>& word, const int count) {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAKE,
+            count, nullptr, nullptr, 0);
+#else
+    (void)word;
+    (void)count;
+#endif
+}
+
+static bool is_alive(const std::int64_t pid) {
+    return kill(static_cast<pid_t>(pid), 0) == 0 || errno == EPERM;
+}
+
+// Takes the READY slots from scan on into batch, up to max_batch.
+static void take_ready(NNDaemon::Segment& segment,
+                       std::vector<NNDaemon::Segment::Slot*>& batch,
+                       const size_t max_batch, size_t& scan) {
+    for (auto i = 0; i < NNDaemon::SLOTS && batch.size() < max_batch; i++) {
+        const auto index = (scan + i) % NNDaemon::SLOTS;
+        auto& slot = segment.slots[index];
+        auto state = slot.state.load(std::memory_order_relaxed);
+        if ((state & PHASE) != READY) {
+            continue;
+        }
+        if (slot.state.compare_exchange_strong(
+                state, RUNNING | (state & WAITER),
+                std::memory_order_acquire)) {
+            batch.push_back(&slot);
+            scan = index + 1;
+        }
+    }
+}
+
+static void run_worker(NNDaemon::Segment& segment, const size_t max_batch,
+                       const std::chrono::microseconds max_wait,
+                       const NNDaemon::forward_fn& forward,
+                       std::atomic<std::uint64_t>& batches,
+                       std::atomic<std::uint64_t>& evals) {
+    const auto& info = segment.info;
+    auto batch = std::vector<NNDaemon::Segment::Slot*>();
+    auto input = std::vector<float>();
+    auto output_pol = std::vector<float>();
+    auto output_val = std::vector<float>();
+    auto output_vbe = std::vector<float>();
+    // The scan goes on where the last one stopped, so that all the
+    // slots are served in turn.
+    auto scan = size_t{0};
+    for (;;) {
+        batch.clear();
+        auto deadline = clock_type::time_point::max();
+        for (;;) {
+            // A submission after this wakes the wait below.
+            const auto seen = segment.submitted.load(std::memory_order_acquire);
+            take_ready(segment, batch, max_batch, scan);
+            const auto now = clock_type::now();
+            if (!batch.empty() && deadline == clock_type::time_point::max()) {
+                deadline = now + max_wait;
+            }
+            if (batch.size() >= max_batch
+                || (!batch.empty() && now >= deadline)) {
+                break;
+            }
+            segment.sleepers++;
+            wait_word(segment.submitted, seen,
+                      batch.empty() ? CHECK_WAIT : deadline - now);
+            segment.sleepers--;
+        }
+
+        const auto count = batch.size();
+        input.resize(count * INPUT_SIZE);
+        output_pol.resize(count * info.pol_size);
+        output_val.resize(count * info.val_size);
+        output_vbe.resize(count * info.vbe_size);
+        for (auto n = size_t{0}; n < count; n++) {
+            std::copy(begin(batch[n]->input), end(batch[n]->input),
+                      begin(input) + n * INPUT_SIZE);
+        }
+        forward(input, output_pol, output_val, output_vbe,
+                static_cast<int>(count));
+        for (auto n = size_t{0}; n < count; n++) {
+            auto& slot = *batch[n];
+            auto out = slot.output.data();
+            out = std::copy_n(begin(output_pol) + n * info.pol_size,
+                              info.pol_size, out);
+            out = std::copy_n(begin(output_val) + n * info.val_size,
+                              info.val_size, out);
+            std::copy_n(begin(output_vbe) + n * info.vbe_size,
+                        info.vbe_size, out);
+            const auto state =
+                slot.state.exchange(DONE, std::memory_order_acq_rel);
+            if (state & WAITER) {
+                wake_word(slot.state, 1);
+            }
+        }
+        batches++;
+        evals += count;
+    }
+}
+#endif
+
+bool NNDaemon::run(const std::string& name, const NetInfo& info,
+                   const int workers, const int max_batch,
+                   const std::chrono::microseconds max_wait,
+                   forward_fn forward) {
+#ifdef _WIN32
+    (void)name;
+    (void)info;
+    (void)workers;
+    (void)max_batch;
+    (void)max_wait;
+    (void)forward;
+    myprintf("The NN daemon is not supported on Windows.\n");
+    return false;
+#else
+    if (info.pol_size + info.val_size + info.vbe_size > MAX_OUTPUTS) {
+        myprintf("The network has too many outputs for the NN daemon.\n");
+        return false;
+    }
+    // The segment of a daemon before is left to its clients, which
+    // notice that it is gone.
+    shm_unlink(name.c_str());
+    const auto fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        myprintf("Could not create the NN daemon segment %s.\n",
+                 name.c_str());
+        return false;
+    }
+    if (ftruncate(fd, sizeof(Segment)) != 0) {
+        myprintf("Could not size the NN daemon segment %s.\n", name.c_str());
+        close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+    const auto mem = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        myprintf("Could not map the NN daemon segment %s.\n", name.c_str());
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    // New shared memory is zeroed, which is all slots FREE.
+    auto& segment = *static_cast<Segment*>(mem);
+    segment.info = info;
+    segment.pid = getpid();
+    segment.magic.store(SEGMENT_MAGIC, std::memory_order_release);
+
+    std::atomic<std::uint64_t> batches{0};
+    std::atomic<std::uint64_t> evals{0};
+    auto threads = std::vector<std::thread>();
+    for (auto i = 0; i < std::max(1, workers); i++) {
+        threads.emplace_back([&] {
+            run_worker(segment, std::max(1, max_batch), max_wait, forward,
+                       batches, evals);
+        });
+    }
+    myprintf("NN daemon serving %s, %d worker(s), batches of up to %d.\n",
+             name.c_str(), std::max(1, workers), std::max(1, max_batch));
+    for (;;) {
+        std::this_thread::sleep_for(STATS_INTERVAL);
+        const auto done = batches.exchange(0);
+        const auto positions = evals.exchange(0);
+        if (done > 0) {
+            myprintf("NN daemon: %llu positions in %llu batches, "
+                     "average fill %.2f/%d\n",
+                     static_cast<unsigned long long>(positions),
+                     static_cast<unsigned long long>(done),
+                     double(positions) / double(done), max_batch);
+        }
+    }
+#endif
+}
+
+NNDaemon::Client::Client(const std::string& name) : m_name(name) {
+#ifdef _WIN32
+    throw std::runtime_error("The NN daemon is not supported on Windows.");
+#else
+    const auto fd = shm_open(name.c_str(), O_RDWR, 0600);
+    if (fd < 0) {
+        throw std::runtime_error("No NN daemon serving " + name + ".");
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) != sizeof(Segment)) {
+        close(fd);
+        throw std::runtime_error("The NN daemon segment " + name
+                                 + " is from another build.");
+    }
+    const auto mem = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        throw std::runtime_error("Could not map the NN daemon segment "
+                                 + name + ".");
+    }
+    m_segment = static_cast<Segment*>(mem);
+    // The daemon may still be starting.
+    for (auto tries = 0; tries < 100; tries++) {
+        if (m_segment->magic.load(std::memory_order_acquire) != 0) {
+            break;
+        }
+        usleep(10000);
+    }
+    if (m_segment->magic.load(std::memory_order_acquire) != SEGMENT_MAGIC
+        || !is_alive(m_segment->pid)) {
+        munmap(mem, sizeof(Segment));
+        m_segment = nullptr;
+        throw std::runtime_error("No NN daemon serving " + name + ".");
+    }
+#endif
+}
+
+NNDaemon::Client::~Client() {
+#ifndef _WIN32
+    if (m_segment) {
+        munmap(m_segment, sizeof(Segment));
+    }
+#endif
+}
+
+const NNDaemon::NetInfo& NNDaemon::Client::get_info() const {
+    return m_segment->info;
+}
+
+void NNDaemon::Client::forward(const std::vector<float>& input,
+                               std::vector<float>& output_pol,
+                               std::vector<float>& output_val,
+                               std::vector<float>& output_vbe,
+                               const int batch_size) {
+#ifdef _WIN32
+    (void)input;
+    (void)output_pol;
+    (void)output_val;
+    (void)output_vbe;
+    (void)batch_size;
+#else
+    auto& segment = *m_segment;
+    const auto& info = segment.info;
+    const auto check_daemon = [&] {
+        if (!is_alive(segment.pid)) {
+            throw std::runtime_error("The NN daemon " + m_name
+                                     + " is gone.");
+        }
+    };
+
+    thread_local auto slots = std::vector<Segment::Slot*>();
+    slots.clear();
+    auto start = clock_type::now();
+    for (auto n = 0; n < batch_size; n++) {
+        for (;;) {
+            auto& slot = segment.slots[
+                segment.next_slot.fetch_add(1, std::memory_order_relaxed)
+                % SLOTS];
+            auto state = slot.state.load(std::memory_order_relaxed);
+            if (state == FREE && slot.state.compare_exchange_strong(
+                    state, FILLING, std::memory_order_acquire)) {
+                slots.push_back(&slot);
+                break;
+            }
+            // All the slots are taken.
+            if (clock_type::now() - start > CHECK_WAIT) {
+                check_daemon();
+                start = clock_type::now();
+            }
+            std::this_thread::yield();
+        }
+        auto& slot = *slots.back();
+        std::copy_n(begin(input) + n * INPUT_SIZE, INPUT_SIZE,
+                    begin(slot.input));
+        slot.state.store(READY, std::memory_order_release);
+    }
+    segment.submitted.fetch_add(1, std::memory_order_release);
+    if (segment.sleepers.load(std::memory_order_acquire) > 0) {
+        wake_word(segment.submitted, INT_MAX);
+    }
+
+    start = clock_type::now();
+    for (auto n = 0; n < batch_size; n++) {
+        auto& slot = *slots[n];
+        for (;;) {
+            auto state = slot.state.load(std::memory_order_acquire);
+            if ((state & PHASE) == DONE) {
+                break;
+            }
+            if (!(state & WAITER)
+                && !slot.state.compare_exchange_weak(state, state | WAITER)) {
+                continue;
+            }
+            wait_word(slot.state, state | WAITER, CHECK_WAIT);
+            if (clock_type::now() - start > CHECK_WAIT) {
+                check_daemon();
+                start = clock_type::now();
+            }
+        }
+        auto out = slot.output.data();
+        std::copy_n(out, info.pol_size,
+                    begin(output_pol) + n * info.pol_size);
+        out += info.pol_size;
+        std::copy_n(out, info.val_size,
+                    begin(output_val) + n * info.val_size);
+        out += info.val_size;
+        std::copy_n(out, info.vbe_size,
+                    begin(output_vbe) + n * info.vbe_size);
+        slot.state.store(FREE, std::memory_order_release);
+    }
+#endif
+}
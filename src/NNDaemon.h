@@ -0,0 +1,101 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef NNDAEMON_H_INCLUDED
+#define NNDAEMON_H_INCLUDED
+
+#include "config.h"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Evaluates the positions of many engine processes on one host with one
+// network. The daemon started with --nn-daemon owns the devices, the
+// weights and the batching, the engines started with --nn-client put
+// their positions into a ring of slots in a shared memory segment and
+// sleep until the outputs are there. Slots are claimed and handed over
+// with atomics only, the waits are futexes on Linux and short sleeps on
+// the other POSIX systems. Windows is not supported.
+namespace NNDaemon {
+    // Slots of the ring, each holds one position.
+    constexpr auto SLOTS = 1024;
+    // Most outputs of a position, policy then value then beta.
+    constexpr auto MAX_OUTPUTS = BOARD_SQUARES + 1 + 4;
+
+    // What the clients need to know about the network of the daemon.
+    struct NetInfo {
+        std::uint32_t value_head_type;
+        std::uint32_t residual_blocks;
+        std::uint32_t channels;
+        std::uint32_t input_planes;
+        std::uint32_t policy_outputs;
+        std::uint32_t val_outputs;
+        std::uint32_t vbe_outputs;
+        // The outputs of a position of forward().
+        std::uint32_t pol_size;
+        std::uint32_t val_size;
+        std::uint32_t vbe_size;
+        std::uint64_t cache_key;
+    };
+
+    // Runs batch_size positions stored back to back in the input, and
+    // fills the outputs the same way.
+    using forward_fn = std::function<void(const std::vector<float>& input,
+                                          std::vector<float>& output_pol,
+                                          std::vector<float>& output_val,
+                                          std::vector<float>& output_vbe,
+                                          int batch_size)>;
+
+    // The layout of the shared memory, see NNDaemon.cpp.
+    struct Segment;
+
+    // Serves the clients of the segment name on workers threads, each
+    // evaluating batches of up to max_batch positions and waiting at
+    // most max_wait for one to fill up. Only returns, false, if the
+    // segment can't be set up.
+    bool run(const std::string& name, const NetInfo& info, int workers,
+             int max_batch, std::chrono::microseconds max_wait,
+             forward_fn forward);
+
+    class Client {
+    public:
+        // Throws std::runtime_error if there is no daemon serving name.
+        explicit Client(const std::string& name);
+        ~Client();
+        Client(const Client&) = delete;
+        Client& operator=(const Client&) = delete;
+
+        const NetInfo& get_info() const;
+        // Has the daemon evaluate batch_size positions, as forward_fn.
+        // Throws std::runtime_error if the daemon is gone.
+        void forward(const std::vector<float>& input,
+                     std::vector<float>& output_pol,
+                     std::vector<float>& output_val,
+                     std::vector<float>& output_vbe,
+                     int batch_size);
+
+    private:
+        Segment* m_segment{nullptr};
+        std::string m_name;
+    };
+}
+
+#endif
@@ -23,11 +23,20 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <future>
 #include <iostream>
 #include <iterator>
 #include <memory>
+#include <numeric>
 #include <sstream>
 #include <string>
 #include <boost/utility.hpp>
@@ -44,10 +53,36 @@
 #include <cblas.h>
 #endif
 #include "zlib.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #ifdef USE_OPENCL
 #include "OpenCLScheduler.h"
 #include "UCTNode.h"
 #endif
+#ifdef USE_CUDA
+#include "CUDANetwork.h"
+#endif
+#if defined(USE_BLAS) && !defined(USE_OPENCL)
+#include <thread>
+#include "ForwardQueue.h"
+#endif
+#ifdef USE_OPENCL_SELFCHECK
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#endif
 
 #include "FastBoard.h"
 #include "FastState.h"
@@ -55,8 +90,13 @@
 #include "GameState.h"
 #include "GTP.h"
 #include "Im2Col.h"
+#include "Metrics.h"
 #include "NNCache.h"
+#include "NNDaemon.h"
+#include "OpeningCache.h"
+#include "Profile.h"
 #include "Random.h"
+#include "SMP.h"
 #include "ThreadPool.h"
 #include "Timing.h"
 #include "Utils.h"
@@ -64,51 +104,276 @@
 namespace x3 = boost::spirit::x3;
 using namespace Utils;
 
-static netarch arch;
-bool is_mult_komi_net = false;
+std::atomic<bool> is_mult_komi_net{false};
+
+// Symmetry helper
+static std::array<std::array<int, BOARD_SQUARES>, 8> symmetry_nn_idx_table;
 
-// Input + residual block tower
-static std::vector<std::vector<float>> conv_weights;
-static std::vector<std::vector<float>> conv_biases;
-static std::vector<std::vector<float>> batchnorm_means;
-static std::vector<std::vector<float>> batchnorm_stddivs;
+#if defined(USE_BLAS) && !defined(USE_OPENCL)
+// CPU-only builds batch evaluations across search threads the same way
+// the OpenCLScheduler does, so that forward_cpu sees large matrices.
+class CPUScheduler {
+public:
+    ~CPUScheduler() {
+        m_forward_queue.shutdown();
+        for (auto& worker : m_workers) {
+            worker.join();
+        }
+    }
 
-// Policy head
-static std::vector<float> conv_pol_w;    // channels*policy_outputs
-static std::vector<float> conv_pol_b;    // policy_outputs
-static std::vector<float> bn_pol_w1;     // policy_outputs
-static std::vector<float> bn_pol_w2;     // policy_outputs
+    void initialize(std::function<void(const std::vector<float>&,
+                                       std::vector<float>&,
+                                       std::vector<float>&,
+                                       std::vector<float>&,
+                                       int)> forward) {
+        // Search threads mostly wait for their batch, so one worker
+        // per full batch of search threads keeps the cores busy.
+        const auto num_workers = std::max(1, cfg_num_threads / cfg_batch_size);
+        for (auto i = 0; i < num_workers; i++) {
+            m_workers.emplace_back([this, forward] {
+                m_forward_queue.run_worker(
+                    cfg_batch_size,
+                    std::chrono::microseconds(cfg_batch_wait),
+                    forward);
+            });
+        }
+        myprintf("Batching up to %d evaluations on %d CPU worker(s).\n",
+                 cfg_batch_size, num_workers);
+    }
 
-static std::vector<float> ip_pol_w;      // board_sq*policy_outputs*(board_sq+1)
-static std::vector<float> ip_pol_b;      // board_sq+1
+    void forward(const std::vector<float>& input,
+                 std::vector<float>& output_pol,
+                 std::vector<float>& output_val,
+                 std::vector<float>& output_vbe) {
+        m_forward_queue.forward(input, output_pol, output_val, output_vbe);
+    }
 
-// Value head alpha (val=Value ALpha)
-static std::vector<float> conv_val_w;    // channels*val_outputs
-static std::vector<float> conv_val_b;    // val_outputs
-static std::vector<float> bn_val_w1;     // val_outputs
-static std::vector<float> bn_val_w2;     // val_outputs
+    void dump_batch_stats() {
+        m_forward_queue.dump_stats(cfg_batch_size);
+    }
 
-static std::vector<float> ip1_val_w;     // board_sq*val_outputs*val_chans
-static std::vector<float> ip1_val_b;     // val_chans
+private:
+    ForwardQueue<float> m_forward_queue;
+    std::vector<std::thread> m_workers;
+};
 
-static std::vector<float> ip2_val_w;     // val_chans (*2 in SINGLE head type)
-static std::vector<float> ip2_val_b;     // 1 (2 in SINGLE head type)
-static bool value_head_not_stm;
+#endif
 
-// Symmetry helper
-static std::array<std::array<int, BOARD_SQUARES>, 8> symmetry_nn_idx_table;
+#ifdef USE_OPENCL_SELFCHECK
+// Verifies a sample of the OpenCL evaluations against forward_cpu on a
+// low priority background thread, so the search threads never wait for
+// the CPU. Samples are dropped while the queue is full.
+class SelfCheck {
+public:
+    // Throws if the outputs don't match the CPU.
+    using check_fn = std::function<void(const std::vector<float>& input,
+                                        const std::vector<float>& output_pol,
+                                        const std::vector<float>& output_val,
+                                        const std::vector<float>& output_vbe,
+                                        int batch_size)>;
+
+    ~SelfCheck() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_running = false;
+        }
+        m_cv.notify_all();
+        if (m_worker.joinable()) {
+            m_worker.join();
+        }
+    }
 
-// Value head beta (vbe=Value BEta)
-static std::vector<float> conv_vbe_w;    // channels*vbe_outputs
-static std::vector<float> conv_vbe_b;    // vbe_outputs
-static std::vector<float> bn_vbe_w1;     // vbe_outputs
-static std::vector<float> bn_vbe_w2;     // vbe_outputs
+    void initialize(check_fn check) {
+        m_worker = std::thread([this, check] { worker(check); });
+    }
 
-static std::vector<float> ip1_vbe_w;     // board_sq*vbe_outputs*vbe_chans
-static std::vector<float> ip1_vbe_b;     // vbe_chans
+    void submit(const std::vector<float>& input,
+                const std::vector<float>& output_pol,
+                const std::vector<float>& output_val,
+                const std::vector<float>& output_vbe,
+                const int batch_size) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_queue.size() >= MAX_QUEUED) {
+                m_dropped++;
+                return;
+            }
+            m_queue.push_back({input, output_pol, output_val, output_vbe,
+                               batch_size});
+        }
+        m_cv.notify_one();
+    }
 
-static std::vector<float> ip2_vbe_w;     // vbe_chans
-static std::vector<float> ip2_vbe_b;     // 1
+    // Set once a sample did not match, the search threads then report
+    // the error on their next evaluation.
+    bool failed() const {
+        return m_failed;
+    }
+
+    void dump_stats() {
+        const auto checked = m_checked.exchange(0);
+        const auto dropped = m_dropped.exchange(0);
+        if (checked + dropped > 0) {
+            myprintf("Self-check: %d evaluation(s) verified, %d dropped.\n",
+                     checked, dropped);
+        }
+    }
+
+private:
+    static constexpr auto MAX_QUEUED = size_t{4};
+
+    struct Sample {
+        std::vector<float> input;
+        std::vector<float> output_pol;
+        std::vector<float> output_val;
+        std::vector<float> output_vbe;
+        int batch_size;
+    };
+
+    void worker(check_fn check) {
+#ifdef __linux__
+        // Linux applies the nice value to the calling thread only.
+        setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+#endif
+        while (true) {
+            auto sample = Sample();
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [this] {
+                    return !m_running || !m_queue.empty();
+                });
+                if (!m_running) {
+                    return;
+                }
+                sample = std::move(m_queue.front());
+                m_queue.pop_front();
+            }
+            try {
+                check(sample.input, sample.output_pol, sample.output_val,
+                      sample.output_vbe, sample.batch_size);
+            } catch (const std::runtime_error&) {
+                m_failed = true;
+            }
+            m_checked++;
+        }
+    }
+
+    std::deque<Sample> m_queue;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::thread m_worker;
+    bool m_running{true};
+    std::atomic<bool> m_failed{false};
+    std::atomic<int> m_checked{0};
+    std::atomic<int> m_dropped{0};
+};
+
+#endif
+
+// Everything that belongs to one loaded network: the weights, and the
+// backend that evaluates them. A new network is built next to the one in
+// use, and the old one is freed when its last evaluation has finished.
+struct NetworkWeights {
+    netarch arch;
+    bool value_head_not_stm{false};
+    // Set when the weights were loaded already transformed, so that
+    // they must not be processed again.
+    bool preprocessed{false};
+    bool use_int8{false};
+    // The Winograd transforms of the input convolution, and of the
+    // residual tower, for the channels of the network.
+    WinogradKernels input_kernels{};
+    WinogradKernels tower_kernels{};
+    // Mixed into the position hashes, so that the networks don't see
+    // the cached evaluations of each other. It is a hash of the weights
+    // file, so that engines sharing a cache agree on it.
+    std::uint64_t cache_key{0};
+
+    // Input + residual block tower
+    std::vector<std::vector<float>> conv_weights;
+    std::vector<std::vector<float>> conv_biases;
+    std::vector<std::vector<float>> batchnorm_means;
+    std::vector<std::vector<float>> batchnorm_stddivs;
+    // The filters of the 3x3 layers that run as im2col, see
+    // Network::select_convolutions(), empty for the Winograd ones.
+    std::vector<std::vector<float>> conv_weights_col;
+
+    // Int8 copy of the tower convolutions for --int8, quantized per output
+    // channel: weight = conv_weights_int8[i][n] * conv_scales_int8[i][output]
+    std::vector<std::vector<std::int8_t>> conv_weights_int8;
+    std::vector<std::vector<float>> conv_scales_int8;
+
+    // Policy head
+    std::vector<float> conv_pol_w;       // channels*policy_outputs
+    std::vector<float> conv_pol_b;       // policy_outputs
+    std::vector<float> bn_pol_w1;        // policy_outputs
+    std::vector<float> bn_pol_w2;        // policy_outputs
+
+    std::vector<float> ip_pol_w;         // board_sq*policy_outputs*(board_sq+1)
+    std::vector<float> ip_pol_b;         // board_sq+1
+
+    // Value head alpha (val=Value ALpha)
+    std::vector<float> conv_val_w;       // channels*val_outputs
+    std::vector<float> conv_val_b;       // val_outputs
+    std::vector<float> bn_val_w1;        // val_outputs
+    std::vector<float> bn_val_w2;        // val_outputs
+
+    std::vector<float> ip1_val_w;        // board_sq*val_outputs*val_chans
+    std::vector<float> ip1_val_b;        // val_chans
+
+    std::vector<float> ip2_val_w;        // val_chans (*2 in SINGLE head type)
+    std::vector<float> ip2_val_b;        // 1 (2 in SINGLE head type)
+
+    // Value head beta (vbe=Value BEta)
+    std::vector<float> conv_vbe_w;       // channels*vbe_outputs
+    std::vector<float> conv_vbe_b;       // vbe_outputs
+    std::vector<float> bn_vbe_w1;        // vbe_outputs
+    std::vector<float> bn_vbe_w2;        // vbe_outputs
+
+    std::vector<float> ip1_vbe_w;        // board_sq*vbe_outputs*vbe_chans
+    std::vector<float> ip1_vbe_b;        // vbe_chans
+
+    std::vector<float> ip2_vbe_w;        // vbe_chans
+    std::vector<float> ip2_vbe_b;        // 1
+
+    // Set with --nn-client, the daemon has the weights and runs all of
+    // the network, so none of the above is loaded.
+    std::unique_ptr<NNDaemon::Client> daemon;
+
+#ifdef USE_CUDA
+    // Set if the devices agree with forward_cpu. Before the scheduler,
+    // so that its workers stop first.
+    std::unique_ptr<CUDANetwork> cuda;
+#endif
+#ifdef USE_OPENCL
+    OpenCLScheduler opencl;
+#elif defined(USE_BLAS)
+    CPUScheduler cpu_scheduler;
+#endif
+#ifdef USE_OPENCL_SELFCHECK
+    // Last, so that its worker stops before the rest is destroyed.
+    SelfCheck selfcheck;
+#endif
+};
+
+// The network used by the search, only accessed with std::atomic_load
+// and std::atomic_store.
+static std::shared_ptr<NetworkWeights> current_network;
+// All the loaded networks and the one each color plays with. Only the
+// GTP thread touches these, between searches.
+static std::vector<std::shared_ptr<NetworkWeights>> networks;
+static std::array<size_t, 2> side_networks{{0, 0}};
+static size_t active_network{0};
+// The networks of initialize(), which may still be loading on another
+// thread. Everything above is only touched once they are ready.
+static std::shared_future<void> networks_loading;
+static std::atomic<bool> networks_ready{false};
+
+static void wait_for_networks() {
+    if (!networks_ready.load(std::memory_order_acquire)) {
+        networks_loading.wait();
+    }
+}
 
 void Network::benchmark(const GameState* const state, const int iterations) {
     const auto cpus = cfg_num_threads;
@@ -183,6 +448,40 @@ std::vector<float> Network::winograd_transform_f(const std::vector<float>& f,
     return U;
 }
 
+std::vector<float> Network::winograd_untransform_f(const std::vector<float>& U,
+                                                   const int outputs,
+                                                   const int channels) {
+    // f = H.dot(U).dot(H.transpose()) with H.dot(G) the identity: the
+    // first and last rows of G are the first and last rows of f, the
+    // middle row is the difference of the middle two rows of G.dot(f).
+    auto f = std::vector<float>(9 * outputs * channels);
+    const auto H = std::array<float, 12>{ 1.0,  0.0,  0.0,  0.0,
+                                          0.0,  1.0, -1.0,  0.0,
+                                          0.0,  0.0,  0.0,  1.0};
+
+    for (auto o = 0; o < outputs; o++) {
+        for (auto c = 0; c < channels; c++) {
+            for (auto k = 0; k < 3; k++) {
+                for (auto j = 0; j < 3; j++) {
+                    auto acc = 0.0f;
+                    for (auto xi = 0; xi < 4; xi++) {
+                        for (auto nu = 0; nu < 4; nu++) {
+                            acc += H[k*4 + xi] * H[j*4 + nu]
+                                * U[xi * (4 * outputs * channels)
+                                    + nu * (outputs * channels)
+                                    + c * outputs
+                                    + o];
+                        }
+                    }
+                    f[o*channels*9 + c*9 + k*3 + j] = acc;
+                }
+            }
+        }
+    }
+
+    return f;
+}
+
 std::vector<float> Network::zeropad_U(const std::vector<float>& U,
                                       const int outputs, const int channels,
                                       const int outputs_pad,
@@ -210,12 +509,38 @@ std::vector<float> Network::zeropad_U(const std::vector<float>& U,
     return Upad;
 }
 
+// Runs f(0) ... f(count - 1) on all the cores. Returns the first i for
+// which f returned false, or count.
+template <typename F>
+static size_t parallel_for(const size_t count, F f) {
+    const auto tasks = std::max(size_t{1}, std::min(
+        count, static_cast<size_t>(SMP::get_num_cpus())));
+    auto workers = std::vector<std::future<size_t>>{};
+    for (auto t = size_t{0}; t < tasks; t++) {
+        workers.emplace_back(std::async(std::launch::async, [&f, t, tasks,
+                                                             count] {
+            for (auto i = t; i < count; i += tasks) {
+                if (!f(i)) {
+                    return i;
+                }
+            }
+            return count;
+        }));
+    }
+    auto failed = count;
+    for (auto& worker : workers) {
+        failed = std::min(failed, worker.get());
+    }
+    return failed;
+}
+
 //v1 refers to the actual weight file format, to be changed when/if the weight file format changes
-int Network::load_v1_network(std::istream& wtfile) {
+int Network::load_v1_network(std::istream& wtfile, NetworkWeights& net) {
+    auto& arch = net.arch;
     // Count size of the network
     myprintf("Detecting residual layers...");
     // We are version 1 or 2
-    if (value_head_not_stm) {
+    if (net.value_head_not_stm) {
         myprintf("v%d...", 2);
     } else {
         myprintf("v%d...", 1);
@@ -229,18 +554,29 @@ int Network::load_v1_network(std::istream& wtfile) {
     std::array<std::vector<float>, 8> wts_2nd_val_head;
     std::array<std::vector<float>::size_type, 8> n_wts_2nd_val_head;
 
+    // Parsing the floats is most of the time it takes to load, so the
+    // lines are parsed in parallel and then taken in order.
+    auto lines = std::vector<std::string>{};
+    while (std::getline(wtfile, line)) {
+        lines.emplace_back(std::move(line));
+    }
+    auto parsed = std::vector<std::vector<float>>(lines.size());
+    const auto failed = parallel_for(lines.size(), [&](const size_t i) {
+        auto it_line = lines[i].cbegin();
+        const auto ok = phrase_parse(it_line, lines[i].cend(),
+                                     *x3::float_, x3::space, parsed[i]);
+        return ok && it_line == lines[i].cend();
+    });
+    if (failed < lines.size()) {
+        myprintf("\nFailed to parse weight file. Error on line %d.\n",
+                 static_cast<int>(failed) + 2); //+1 from version line, +1 from 0-indexing
+        return 1;
+    }
+    lines.clear();
+
     bool is_head_line = false;
     linecount = 0;
-    while (std::getline(wtfile, line)) {
-        std::vector<float> weights;
-        auto it_line = line.cbegin();
-        const auto ok = phrase_parse(it_line, line.cend(),
-                                     *x3::float_, x3::space, weights);
-        if (!ok || it_line != line.cend()) {
-            myprintf("\nFailed to parse weight file. Error on line %d.\n",
-                    linecount + 2); //+1 from version line, +1 from 0-indexing
-            return 1;
-        }
+    for (auto& weights : parsed) {
 	auto n_wts = weights.size();
 	size_t n_wts_1st_layer;
         if (!is_head_line) {
@@ -248,12 +584,12 @@ int Network::load_v1_network(std::istream& wtfile) {
 	      if (linecount == 0)
 		n_wts_1st_layer = n_wts;
 	      if (linecount==0 || n_wts==arch.channels*9*arch.channels)
-                conv_weights.emplace_back(weights);
+                net.conv_weights.emplace_back(std::move(weights));
 	      else {
 		is_head_line = true;
 		arch.policy_outputs = n_wts/arch.channels;
 		assert (n_wts == arch.channels*arch.policy_outputs);
-		conv_pol_w = std::move(weights);
+		net.conv_pol_w = std::move(weights);
 		arch.residual_blocks = (linecount-4)/8;
 		plain_conv_layers = 1 + (arch.residual_blocks * 2);
 		plain_conv_wts = plain_conv_layers * 4;
@@ -274,64 +610,64 @@ int Network::load_v1_network(std::istream& wtfile) {
 	      else
 		assert (n_wts == arch.channels);
 
-	      conv_biases.emplace_back(weights);
+	      net.conv_biases.emplace_back(std::move(weights));
             } else if (linecount % 4 == 2) {
 		assert (n_wts == arch.channels);
-                batchnorm_means.emplace_back(weights);
+                net.batchnorm_means.emplace_back(std::move(weights));
             } else if (linecount % 4 == 3) {
 	        assert (n_wts == arch.channels);
                 process_bn_var(weights);
-                batchnorm_stddivs.emplace_back(weights);
+                net.batchnorm_stddivs.emplace_back(std::move(weights));
             }
         } else if (linecount == plain_conv_wts + 1) {
 	    assert (n_wts == arch.policy_outputs);
-	    conv_pol_b = std::move(weights);
+	    net.conv_pol_b = std::move(weights);
         } else if (linecount == plain_conv_wts + 2) {
 	    assert (n_wts == arch.policy_outputs);
-	    bn_pol_w1 = std::move(weights);
+	    net.bn_pol_w1 = std::move(weights);
         } else if (linecount == plain_conv_wts + 3) {
 	    process_bn_var(weights);
 	    assert (n_wts == arch.policy_outputs);
-	    bn_pol_w2 = std::move(weights);
+	    net.bn_pol_w2 = std::move(weights);
 
         } else if (linecount == plain_conv_wts + 4) {
             assert (n_wts == arch.policy_outputs*BOARD_SQUARES*(BOARD_SQUARES+1));
 	    myprintf("%dx%d board.\n", BOARD_SIZE, BOARD_SIZE);
-	    ip_pol_w = std::move(weights);
+	    net.ip_pol_w = std::move(weights);
         } else if (linecount == plain_conv_wts + 5) {
 	    assert (n_wts == BOARD_SQUARES+1);
-            ip_pol_b = std::move(weights);
+            net.ip_pol_b = std::move(weights);
 
         } else if (linecount == plain_conv_wts + 6) {
 	    arch.val_outputs = n_wts/arch.channels;
 	    assert (n_wts == arch.channels*arch.val_outputs);
-	    conv_val_w = std::move(weights);
+	    net.conv_val_w = std::move(weights);
         } else if (linecount == plain_conv_wts + 7) {
 	    assert (n_wts == arch.val_outputs);
-            conv_val_b = std::move(weights);
+            net.conv_val_b = std::move(weights);
         } else if (linecount == plain_conv_wts + 8) {
 	    assert (n_wts == arch.val_outputs);
-            bn_val_w1 = std::move(weights);
+            net.bn_val_w1 = std::move(weights);
         } else if (linecount == plain_conv_wts + 9) {
 	    assert (n_wts == arch.val_outputs);
             process_bn_var(weights);
-            bn_val_w2 = std::move(weights);
+            net.bn_val_w2 = std::move(weights);
 
         } else if (linecount == plain_conv_wts + 10) {
 	    arch.val_chans = n_wts/arch.val_outputs/(BOARD_SQUARES);
 	    assert (n_wts == arch.val_chans*arch.val_outputs*BOARD_SQUARES);
-	    ip1_val_w = std::move(weights);
+	    net.ip1_val_w = std::move(weights);
         } else if (linecount == plain_conv_wts + 11) {
 	    assert (n_wts == arch.val_chans);
-            ip1_val_b = std::move(weights);
+            net.ip1_val_b = std::move(weights);
         } else if (linecount == plain_conv_wts + 12) {
 	    arch.value_head_rets = n_wts/arch.val_chans;
 	    assert (n_wts == arch.val_chans*arch.value_head_rets);
 	    assert (arch.value_head_rets == 1 || arch.value_head_rets == 2);
-	    ip2_val_w = std::move(weights);
+	    net.ip2_val_w = std::move(weights);
         } else if (linecount == plain_conv_wts + 13) {
 	    assert (n_wts == arch.value_head_rets);
-            ip2_val_b = std::move(weights);
+            net.ip2_val_b = std::move(weights);
 
         } else if (linecount >= plain_conv_wts + 14) {
 	    auto i = lastlines;
@@ -349,24 +685,24 @@ int Network::load_v1_network(std::istream& wtfile) {
 
 	arch.vbe_outputs = n_wts_2nd_val_head[0]/arch.channels;
 	assert (n_wts_2nd_val_head[0] == arch.channels*arch.vbe_outputs);
-	conv_vbe_w = std::move(wts_2nd_val_head[0]);
+	net.conv_vbe_w = std::move(wts_2nd_val_head[0]);
 
 	assert (n_wts_2nd_val_head[1] == arch.vbe_outputs);
-	conv_vbe_b = std::move(wts_2nd_val_head[1]);
+	net.conv_vbe_b = std::move(wts_2nd_val_head[1]);
 
 	assert (n_wts_2nd_val_head[2] == arch.vbe_outputs);
-	bn_vbe_w1 = std::move(wts_2nd_val_head[2]);
+	net.bn_vbe_w1 = std::move(wts_2nd_val_head[2]);
 
 	assert (n_wts_2nd_val_head[3] == arch.vbe_outputs);
 	process_bn_var(wts_2nd_val_head[3]);
-	bn_vbe_w2 = std::move(wts_2nd_val_head[3]);
+	net.bn_vbe_w2 = std::move(wts_2nd_val_head[3]);
 
 	arch.vbe_chans = n_wts_2nd_val_head[4]/arch.vbe_outputs/(BOARD_SQUARES);
 	assert (n_wts_2nd_val_head[4] == arch.vbe_chans*arch.vbe_outputs*BOARD_SQUARES);
-	ip1_vbe_w = std::move(wts_2nd_val_head[4]);
+	net.ip1_vbe_w = std::move(wts_2nd_val_head[4]);
 
 	assert (n_wts_2nd_val_head[5] == arch.vbe_chans);
-	ip1_vbe_b = std::move(wts_2nd_val_head[5]);
+	net.ip1_vbe_b = std::move(wts_2nd_val_head[5]);
 
 	int ret2 = n_wts_2nd_val_head[6]/arch.vbe_chans;
 	assert (n_wts_2nd_val_head[6] == arch.vbe_chans*ret2);
@@ -378,10 +714,10 @@ int Network::load_v1_network(std::istream& wtfile) {
 		    n_wts_2nd_val_head[6]/arch.vbe_chans);
 	  return 1;
 	}
-	ip2_vbe_w = std::move(wts_2nd_val_head[6]);
+	net.ip2_vbe_w = std::move(wts_2nd_val_head[6]);
 
 	assert (n_wts_2nd_val_head[7] == 1);
-	ip2_vbe_b = std::move(wts_2nd_val_head[7]);
+	net.ip2_vbe_b = std::move(wts_2nd_val_head[7]);
 
 	myprintf("Double value head. Type V.\n");
 	myprintf("Alpha head: %d outputs, %d channels.\n", arch.val_outputs, arch.val_chans);
@@ -392,19 +728,19 @@ int Network::load_v1_network(std::istream& wtfile) {
 
 	arch.vbe_chans = n_wts_2nd_val_head[0]/arch.val_outputs/(BOARD_SQUARES);
 	assert (n_wts_2nd_val_head[0] == arch.vbe_chans*arch.val_outputs*BOARD_SQUARES);
-	ip1_vbe_w = std::move(wts_2nd_val_head[0]);
+	net.ip1_vbe_w = std::move(wts_2nd_val_head[0]);
 
 	assert (n_wts_2nd_val_head[1] == arch.vbe_chans);
-	ip1_vbe_b = std::move(wts_2nd_val_head[1]);
+	net.ip1_vbe_b = std::move(wts_2nd_val_head[1]);
 
 	int ret2 = n_wts_2nd_val_head[2]/arch.vbe_chans;
 	assert (n_wts_2nd_val_head[2] == arch.vbe_chans*ret2);
 	if (ret2 != 1)
 	  return 1;
-	ip2_vbe_w = std::move(wts_2nd_val_head[2]);
+	net.ip2_vbe_w = std::move(wts_2nd_val_head[2]);
 
 	assert (n_wts_2nd_val_head[3] == 1);
-	ip2_vbe_b = std::move(wts_2nd_val_head[3]);
+	net.ip2_vbe_b = std::move(wts_2nd_val_head[3]);
 
 	myprintf("Double value head. Type Y.\n");
 	myprintf("Common convolution: %d outputs.\n", arch.val_outputs);
@@ -417,10 +753,10 @@ int Network::load_v1_network(std::istream& wtfile) {
 	assert (n_wts_2nd_val_head[0] == arch.val_chans*ret2);
 	if (ret2 != 1)
 	  return 1;
-	ip2_vbe_w = std::move(wts_2nd_val_head[0]);
+	net.ip2_vbe_w = std::move(wts_2nd_val_head[0]);
 
 	assert (n_wts_2nd_val_head[1] == 1);
-	ip2_vbe_b = std::move(wts_2nd_val_head[1]);
+	net.ip2_vbe_b = std::move(wts_2nd_val_head[1]);
 
 	myprintf("Double value head. Type T: %d outputs, %d channels.\n",
 		 arch.val_outputs, arch.val_chans);
@@ -445,7 +781,192 @@ int Network::load_v1_network(std::istream& wtfile) {
     return 0;
 }
 
-int Network::load_network_file(const std::string& filename) {
+// FNV-1a of the file, the same in every process that loads it.
+static std::uint64_t hash_file(const std::string& filename) {
+    auto hash = std::uint64_t{14695981039346656037ULL};
+    auto file = std::ifstream{filename, std::ios::binary};
+    auto buffer = std::vector<char>(64 * 1024);
+    while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
+        for (auto i = std::streamsize{0}; i < file.gcount(); i++) {
+            hash ^= static_cast<unsigned char>(buffer[i]);
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+// Magic bytes at the start of binary weights files, see utils/binweights.py
+static constexpr char binary_weights_magic[] = "SAIW";
+static constexpr std::uint32_t binary_weights_version = 1;
+static constexpr size_t binary_weights_align = 64;
+
+int Network::load_binary_network(const std::string& filename,
+                                 NetworkWeights& net) {
+    auto& arch = net.arch;
+    // Map the file when possible, the kernel then reads it in only once.
+    auto data = static_cast<const char*>(nullptr);
+    auto size = size_t{0};
+#ifdef _WIN32
+    auto file = std::ifstream{filename, std::ios::binary};
+    auto contents = std::vector<char>(std::istreambuf_iterator<char>(file),
+                                      std::istreambuf_iterator<char>());
+    data = contents.data();
+    size = contents.size();
+#else
+    const auto fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        myprintf("Could not open weights file: %s\n", filename.c_str());
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+    size = st.st_size;
+    const auto mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        myprintf("Could not map weights file: %s\n", filename.c_str());
+        return 1;
+    }
+    data = static_cast<const char*>(mapping);
+#endif
+
+    auto offset = size_t{0};
+    auto read_u32 = [&]() {
+        auto value = std::uint32_t{0};
+        if (offset + sizeof(value) <= size) {
+            std::memcpy(&value, data + offset, sizeof(value));
+        }
+        offset += sizeof(value);
+        return value;
+    };
+    auto align = [&]() {
+        offset = ceilMultiple(offset, binary_weights_align);
+    };
+    // Sections are a count followed by the floats, both aligned.
+    auto ok = true;
+    auto read_section = [&](std::vector<float>& weights,
+                            const size_t expected) {
+        auto count = std::uint64_t{0};
+        if (offset + sizeof(count) <= size) {
+            std::memcpy(&count, data + offset, sizeof(count));
+        }
+        offset += sizeof(count);
+        align();
+        if (count != expected || offset + count * sizeof(float) > size) {
+            ok = false;
+            count = 0;
+        }
+        weights.resize(count);
+        std::memcpy(weights.data(), data + offset, count * sizeof(float));
+        offset += count * sizeof(float);
+        align();
+    };
+
+    offset = sizeof(binary_weights_magic) - 1;
+    const auto version = read_u32();
+    const auto board_size = read_u32();
+    net.value_head_not_stm = read_u32() != 0;
+    arch.value_head_type = read_u32();
+    arch.residual_blocks = read_u32();
+    arch.channels = read_u32();
+    arch.input_planes = read_u32();
+    arch.policy_outputs = read_u32();
+    arch.val_outputs = read_u32();
+    arch.vbe_outputs = read_u32();
+    arch.val_chans = read_u32();
+    arch.vbe_chans = read_u32();
+    arch.value_head_rets = read_u32();
+    align();
+
+    if (version != binary_weights_version) {
+        myprintf("Weights file is the wrong version.\n");
+        ok = false;
+    } else if (board_size != BOARD_SIZE) {
+        myprintf("Weights file is for a %dx%d board.\n",
+                 board_size, board_size);
+        ok = false;
+    } else if (arch.input_planes != INPUT_CHANNELS) {
+        ok = false;
+    }
+
+    const auto conv_layers = ok ? 1 + arch.residual_blocks * 2 : 0;
+    net.conv_weights.resize(conv_layers);
+    net.conv_biases.resize(conv_layers);
+    net.batchnorm_means.resize(conv_layers);
+    net.batchnorm_stddivs.resize(conv_layers);
+    for (auto i = size_t{0}; i < conv_layers; i++) {
+        const auto channels = i == 0 ? arch.input_planes : arch.channels;
+        read_section(net.conv_weights[i],
+                     WINOGRAD_TILE * arch.channels * channels);
+        read_section(net.batchnorm_means[i], arch.channels);
+        read_section(net.batchnorm_stddivs[i], arch.channels);
+        net.conv_biases[i].assign(arch.channels, 0.0f);
+    }
+
+    const auto& type = arch.value_head_type;
+    const auto single_ip2 = type == SINGLE || type == DOUBLE_I;
+    read_section(net.conv_pol_w, arch.channels * arch.policy_outputs);
+    read_section(net.bn_pol_w1, arch.policy_outputs);
+    read_section(net.bn_pol_w2, arch.policy_outputs);
+    read_section(net.ip_pol_w,
+                 arch.policy_outputs * BOARD_SQUARES * (BOARD_SQUARES + 1));
+    read_section(net.ip_pol_b, BOARD_SQUARES + 1);
+    net.conv_pol_b.assign(arch.policy_outputs, 0.0f);
+
+    read_section(net.conv_val_w, arch.channels * arch.val_outputs);
+    read_section(net.bn_val_w1, arch.val_outputs);
+    read_section(net.bn_val_w2, arch.val_outputs);
+    read_section(net.ip1_val_w,
+                 BOARD_SQUARES * arch.val_outputs * arch.val_chans);
+    read_section(net.ip1_val_b, arch.val_chans);
+    read_section(net.ip2_val_w,
+                 arch.val_chans * (single_ip2 ? arch.value_head_rets : 1));
+    read_section(net.ip2_val_b, single_ip2 ? arch.value_head_rets : 1);
+    net.conv_val_b.assign(arch.val_outputs, 0.0f);
+
+    // The beta head sections are empty where the head type doesn't use them.
+    const auto beta_ip1_inputs = type == DOUBLE_V
+        ? arch.vbe_outputs : (type == DOUBLE_Y ? arch.val_outputs : 0);
+    const auto beta_ip2_inputs = type == DOUBLE_T
+        ? arch.val_chans : arch.vbe_chans;
+    read_section(net.conv_vbe_w, arch.channels * arch.vbe_outputs);
+    read_section(net.bn_vbe_w1, arch.vbe_outputs);
+    read_section(net.bn_vbe_w2, arch.vbe_outputs);
+    read_section(net.ip1_vbe_w,
+                 BOARD_SQUARES * beta_ip1_inputs * arch.vbe_chans);
+    read_section(net.ip1_vbe_b, arch.vbe_chans);
+    read_section(net.ip2_vbe_w, single_ip2 ? 0 : beta_ip2_inputs);
+    read_section(net.ip2_vbe_b, single_ip2 ? 0 : 1);
+    net.conv_vbe_b.assign(arch.vbe_outputs, 0.0f);
+
+#ifndef _WIN32
+    munmap(const_cast<char*>(data), size);
+#endif
+
+    if (!ok) {
+        myprintf("Failed to parse weight file.\n");
+        return 1;
+    }
+    net.preprocessed = true;
+    myprintf("Binary weights: %d blocks, %d channels, value head type %d.\n",
+             arch.residual_blocks, arch.channels, arch.value_head_type);
+    return 0;
+}
+
+int Network::load_network_file(const std::string& filename,
+                               NetworkWeights& net) {
+    // Binary weights are read as they are, without zlib.
+    {
+        auto magic = std::array<char, sizeof(binary_weights_magic) - 1>{};
+        auto file = std::ifstream{filename, std::ios::binary};
+        if (file.read(magic.data(), magic.size())
+            && std::equal(begin(magic), end(magic), binary_weights_magic)) {
+            return load_binary_network(filename, net);
+        }
+    }
+
     // gzopen supports both gz and non-gz files, will decompress
     // or just read directly as needed.
     auto gzhandle = gzopen(filename.c_str(), "rb");
@@ -485,17 +1006,17 @@ int Network::load_network_file(const std::string& filename) {
             // that they return the score for black instead of
             // the player to move. This is used by ELF Open Go.
             if (format_version == 2) {
-                value_head_not_stm = true;
+                net.value_head_not_stm = true;
             } else {
-                value_head_not_stm = false;
+                net.value_head_not_stm = false;
             }
-            return load_v1_network(buffer);
+            return load_v1_network(buffer, net);
         }
     }
     return 1;
 }
 
-void Network::initialize() {
+void Network::initialize(const bool background) {
     // Prepare symmetry table
     for (auto s = 0; s < 8; s++) {
         for (auto v = 0; v < BOARD_SQUARES; v++) {
@@ -503,309 +1024,987 @@ void Network::initialize() {
         }
     }
 
-    // Load network from file
-    if(load_network_file(cfg_weightsfile)) {
-        exit(EXIT_FAILURE);
+#ifdef USE_BLAS
+#ifndef __APPLE__
+#ifdef USE_OPENBLAS
+    openblas_set_num_threads(1);
+    myprintf("BLAS Core: %s\n", openblas_get_corename());
+#endif
+#ifdef USE_MKL
+    //mkl_set_threading_layer(MKL_THREADING_SEQUENTIAL);
+    mkl_set_num_threads(1);
+    MKLVersion Version;
+    mkl_get_version(&Version);
+    myprintf("BLAS core: MKL %s\n", Version.Processor);
+#endif
+#endif
+#endif
+
+    networks_loading = std::async(
+        background ? std::launch::async : std::launch::deferred, [] {
+            if (!cfg_nn_client.empty()) {
+                auto net = attach_daemon(cfg_nn_client);
+                if (!net) {
+                    std::fflush(nullptr);
+                    std::_Exit(EXIT_FAILURE);
+                }
+                networks.emplace_back(std::move(net));
+            }
+            // Load networks from file
+            for (const auto& filename : cfg_nn_client.empty()
+                     ? cfg_weightsfiles : std::vector<std::string>{}) {
+                auto net = load_network(
+                    filename, networks.empty() ? nullptr : networks[0].get());
+                if (!net) {
+                    // In the background exit() would wait for this thread.
+                    std::fflush(nullptr);
+                    std::_Exit(EXIT_FAILURE);
+                }
+                networks.emplace_back(std::move(net));
+            }
+            if (networks.size() > 1) {
+                side_networks[FastBoard::WHITE] = 1;
+            }
+            active_network = side_networks[FastBoard::BLACK];
+            is_mult_komi_net = (networks[active_network]->arch.value_head_type
+                                != SINGLE);
+            std::atomic_store(&current_network, networks[active_network]);
+            networks_ready = true;
+        }).share();
+    if (!background) {
+        wait_for_networks();
     }
+}
 
-    is_mult_komi_net = (arch.value_head_type != SINGLE);
+bool Network::load_weights(const std::string& filename, const size_t index) {
+    wait_for_networks();
+    // The daemon decides on the network of its clients.
+    if (!cfg_nn_client.empty() || index > networks.size()) {
+        return false;
+    }
+    // The current network keeps running until the new one is ready.
+    auto net = load_network(filename,
+                            networks.empty() ? nullptr : networks[0].get());
+    if (!net) {
+        return false;
+    }
+    if (index == networks.size()) {
+        networks.emplace_back(std::move(net));
+        return true;
+    }
+    networks[index] = std::move(net);
+    if (index == active_network) {
+        is_mult_komi_net = (networks[index]->arch.value_head_type != SINGLE);
+        std::atomic_store(&current_network, networks[index]);
+    }
+    // The cached evaluations of the old network can't be hit anymore.
+    NNCache::get_NNCache().clear();
+    return true;
+}
 
-    auto weight_index = size_t{0};
-    // Input convolution
-    // Winograd transform convolution weights
-    conv_weights[weight_index] =
-        winograd_transform_f(conv_weights[weight_index],
-                             arch.channels, arch.input_planes);
-    weight_index++;
-
-    // Residual block convolutions
-    for (auto i = size_t{0}; i < arch.residual_blocks * 2; i++) {
-        conv_weights[weight_index] =
-            winograd_transform_f(conv_weights[weight_index],
-                                 arch.channels, arch.channels);
-        weight_index++;
+size_t Network::get_network_count() {
+    wait_for_networks();
+    return networks.size();
+}
+
+std::string Network::get_device_names() {
+    wait_for_networks();
+    const auto net = std::atomic_load(&current_network);
+    if (net->daemon) {
+        return "NN daemon " + cfg_nn_client;
     }
+#ifdef USE_CUDA
+    if (net->cuda) {
+        return "CUDA";
+    }
+#endif
+#ifdef USE_OPENCL
+    return net->opencl.get_device_names();
+#else
+    return "CPU x" + std::to_string(SMP::get_num_cpus());
+#endif
+}
 
-    // Biases are not calculated and are typically zero but some networks might
-    // still have non-zero biases.
-    // Move biases to batchnorm means to make the output match without having
-    // to separately add the biases.
-    for (auto i = size_t{0}; i < conv_biases.size(); i++) {
-        for (auto j = size_t{0}; j < batchnorm_means[i].size(); j++) {
-            batchnorm_means[i][j] -= conv_biases[i][j];
-            conv_biases[i][j] = 0.0f;
-        }
+std::string Network::get_net_size() {
+    wait_for_networks();
+    const auto net = std::atomic_load(&current_network);
+    return std::to_string(net->arch.residual_blocks) + "x"
+        + std::to_string(net->arch.channels);
+}
+
+std::uint64_t Network::get_net_key() {
+    wait_for_networks();
+    const auto net = std::atomic_load(&current_network);
+    return net->cache_key;
+}
+
+bool Network::set_side_network(const int color, const size_t index) {
+    assert(color == FastBoard::BLACK || color == FastBoard::WHITE);
+    wait_for_networks();
+    if (index >= networks.size()) {
+        return false;
     }
+    side_networks[color] = index;
+    return true;
+}
 
-    for (auto i = size_t{0}; i < bn_val_w1.size(); i++) {
-        bn_val_w1[i] -= conv_val_b[i];
-        conv_val_b[i] = 0.0f;
+bool Network::select_side(const int color) {
+    assert(color == FastBoard::BLACK || color == FastBoard::WHITE);
+    wait_for_networks();
+    const auto index = side_networks[color];
+    if (index == active_network) {
+        return false;
     }
+    active_network = index;
+    is_mult_komi_net = (networks[index]->arch.value_head_type != SINGLE);
+    std::atomic_store(&current_network, networks[index]);
+    return true;
+}
 
-    for (auto i = size_t{0}; i < bn_vbe_w1.size(); i++) {
-        bn_vbe_w1[i] -= conv_vbe_b[i];
-        conv_vbe_b[i] = 0.0f;
+std::shared_ptr<NetworkWeights> Network::load_network(
+    const std::string& filename, NetworkWeights* const share) {
+    auto net_ptr = std::make_shared<NetworkWeights>();
+    auto& net = *net_ptr;
+    const auto& arch = net.arch;
+    // The file is hashed while it is parsed.
+    auto cache_key = std::async(std::launch::async, hash_file, filename);
+    if (load_network_file(filename, net)) {
+        return nullptr;
     }
+    net.cache_key = cache_key.get();
+
+#ifdef USE_BLAS
+    // Must be done before the Winograd transform below.
+    net.use_int8 = cfg_int8;
+    if (net.use_int8 && net.preprocessed) {
+        myprintf("Binary weights have no plain convolutions, "
+                 "not using int8.\n");
+        net.use_int8 = false;
+    }
+    if (net.use_int8) {
+        quantize_weights(net);
+    }
+    net.tower_kernels = get_winograd_kernels(arch.channels);
+    net.input_kernels = {
+        get_winograd_kernels(arch.input_planes).transform_in,
+        net.tower_kernels.transform_out
+    };
+#endif
+
+    if (!net.preprocessed) {
+        // Winograd transform convolution weights, all the layers at once.
+        // The input convolution is the first one, then the residual block
+        // convolutions.
+        parallel_for(net.conv_weights.size(), [&net, &arch](const size_t i) {
+            const auto channels = i == 0 ? arch.input_planes : arch.channels;
+            net.conv_weights[i] = winograd_transform_f(
+                net.conv_weights[i], arch.channels, channels);
+            return true;
+        });
+
+        // Biases are not calculated and are typically zero but some networks
+        // might still have non-zero biases.
+        // Move biases to batchnorm means to make the output match without
+        // having to separately add the biases.
+        for (auto i = size_t{0}; i < net.conv_biases.size(); i++) {
+            for (auto j = size_t{0}; j < net.batchnorm_means[i].size(); j++) {
+                net.batchnorm_means[i][j] -= net.conv_biases[i][j];
+                net.conv_biases[i][j] = 0.0f;
+            }
+        }
+
+        for (auto i = size_t{0}; i < net.bn_val_w1.size(); i++) {
+            net.bn_val_w1[i] -= net.conv_val_b[i];
+            net.conv_val_b[i] = 0.0f;
+        }
+
+        for (auto i = size_t{0}; i < net.bn_vbe_w1.size(); i++) {
+            net.bn_vbe_w1[i] -= net.conv_vbe_b[i];
+            net.conv_vbe_b[i] = 0.0f;
+        }
 
-    for (auto i = size_t{0}; i < bn_pol_w1.size(); i++) {
-        bn_pol_w1[i] -= conv_pol_b[i];
-        conv_pol_b[i] = 0.0f;
+        for (auto i = size_t{0}; i < net.bn_pol_w1.size(); i++) {
+            net.bn_pol_w1[i] -= net.conv_pol_b[i];
+            net.conv_pol_b[i] = 0.0f;
+        }
     }
 
 #ifdef USE_OPENCL
     myprintf("Initializing OpenCL.\n");
-    opencl.initialize(arch.channels);
 
-    for (const auto & opencl_net : opencl.get_networks()) {
-        const auto tuners = opencl_net->getOpenCL().get_sgemm_tuners();
+    // Called once for every OpenCL network the scheduler creates.
+    auto push_weights = [&](OpenCL_Network& opencl_net) {
+        const auto tuners = opencl_net.getOpenCL().get_sgemm_tuners();
 
         const auto mwg = tuners[0];
         const auto kwg = tuners[2];
         const auto vwm = tuners[3];
 
-        weight_index = 0;
+        // The devices are set up in parallel, so nothing is shared.
+        auto weight_index = size_t{0};
 
         const auto m_ceil = ceilMultiple(ceilMultiple(arch.channels, mwg), vwm);
         const auto k_ceil = ceilMultiple(ceilMultiple(arch.input_planes, kwg), vwm);
 
-        const auto Upad = zeropad_U(conv_weights[weight_index],
+        const auto Upad = zeropad_U(net.conv_weights[weight_index],
                                     arch.channels, arch.input_planes,
                                     m_ceil, k_ceil);
 
         // Winograd filter transformation changes filter size to 4x4
-        opencl_net->push_input_convolution(WINOGRAD_ALPHA, arch.input_planes,
+        opencl_net.push_input_convolution(WINOGRAD_ALPHA, arch.input_planes,
             arch.channels, Upad,
-            batchnorm_means[weight_index], batchnorm_stddivs[weight_index]);
+            net.batchnorm_means[weight_index],
+            net.batchnorm_stddivs[weight_index]);
         weight_index++;
 
         // residual blocks
         for (auto i = size_t{0}; i < arch.residual_blocks; i++) {
-            const auto Upad1 = zeropad_U(conv_weights[weight_index],
+            const auto Upad1 = zeropad_U(net.conv_weights[weight_index],
                                          arch.channels, arch.channels,
                                          m_ceil, m_ceil);
-            const auto Upad2 = zeropad_U(conv_weights[weight_index + 1],
+            const auto Upad2 = zeropad_U(net.conv_weights[weight_index + 1],
                                          arch.channels, arch.channels,
                                          m_ceil, m_ceil);
-            opencl_net->push_residual(WINOGRAD_ALPHA, arch.channels, arch.channels,
-                                      Upad1,
-                                      batchnorm_means[weight_index],
-                                      batchnorm_stddivs[weight_index],
-                                      Upad2,
-                                      batchnorm_means[weight_index + 1],
-                                      batchnorm_stddivs[weight_index + 1]);
+            opencl_net.push_residual(WINOGRAD_ALPHA, arch.channels, arch.channels,
+                                     Upad1,
+                                     net.batchnorm_means[weight_index],
+                                     net.batchnorm_stddivs[weight_index],
+                                     Upad2,
+                                     net.batchnorm_means[weight_index + 1],
+                                     net.batchnorm_stddivs[weight_index + 1],
+                                     winograd_untransform_f(
+                                         net.conv_weights[weight_index],
+                                         arch.channels, arch.channels),
+                                     winograd_untransform_f(
+                                         net.conv_weights[weight_index + 1],
+                                         arch.channels, arch.channels));
             weight_index += 2;
         }
 
         // Output head convolutions
-        opencl_net->push_convolve1(arch.channels, arch.policy_outputs, conv_pol_w);
-        opencl_net->push_convolve1(arch.channels, arch.val_outputs, conv_val_w);
-	if (arch.value_head_type == DOUBLE_V) {
-	  opencl_net->push_convolve1(arch.channels, arch.vbe_outputs, conv_vbe_w);
-	}
-    }
+        opencl_net.push_convolve1(arch.channels, arch.policy_outputs,
+                                  net.conv_pol_w, HEAD_POL_PLANES);
+        opencl_net.push_convolve1(arch.channels, arch.val_outputs,
+                                  net.conv_val_w, HEAD_VAL_PLANES);
+        if (arch.value_head_type == DOUBLE_V) {
+            opencl_net.push_convolve1(arch.channels, arch.vbe_outputs,
+                                      net.conv_vbe_w, HEAD_VBE_PLANES);
+        }
+
+        // The rest of the heads, as in forward_heads()
+        const auto pol_planes = arch.policy_outputs * BOARD_SQUARES;
+        const auto val_planes = arch.val_outputs * BOARD_SQUARES;
+        const auto vbe_planes = arch.vbe_outputs * BOARD_SQUARES;
+        opencl_net.push_innerproduct(pol_planes, net.ip_pol_b.size(), false,
+                                     HEAD_POL_PLANES, HEAD_POL_OUT,
+                                     net.ip_pol_w, net.ip_pol_b,
+                                     net.bn_pol_w1, net.bn_pol_w2);
+        opencl_net.push_softmax(net.ip_pol_b.size(), HEAD_POL_OUT);
+        opencl_net.push_innerproduct(val_planes, net.ip1_val_b.size(), true,
+                                     HEAD_VAL_PLANES, HEAD_VAL_CHANNELS,
+                                     net.ip1_val_w, net.ip1_val_b,
+                                     net.bn_val_w1, net.bn_val_w2);
+        opencl_net.push_innerproduct(net.ip1_val_b.size(),
+                                     net.ip2_val_b.size(), false,
+                                     HEAD_VAL_CHANNELS, HEAD_VAL_OUT,
+                                     net.ip2_val_w, net.ip2_val_b);
+        if (arch.value_head_type == DOUBLE_V) {
+            opencl_net.push_innerproduct(vbe_planes, net.ip1_vbe_b.size(), true,
+                                         HEAD_VBE_PLANES, HEAD_VBE_CHANNELS,
+                                         net.ip1_vbe_w, net.ip1_vbe_b,
+                                         net.bn_vbe_w1, net.bn_vbe_w2);
+        } else if (arch.value_head_type == DOUBLE_Y) {
+            opencl_net.push_innerproduct(val_planes, net.ip1_vbe_b.size(), true,
+                                         HEAD_VAL_PLANES, HEAD_VBE_CHANNELS,
+                                         net.ip1_vbe_w, net.ip1_vbe_b,
+                                         net.bn_val_w1, net.bn_val_w2);
+        }
+        if (arch.value_head_type == DOUBLE_V
+            || arch.value_head_type == DOUBLE_Y) {
+            opencl_net.push_innerproduct(net.ip1_vbe_b.size(),
+                                         net.ip2_vbe_b.size(), false,
+                                         HEAD_VBE_CHANNELS, HEAD_VBE_OUT,
+                                         net.ip2_vbe_w, net.ip2_vbe_b);
+        } else if (arch.value_head_type == DOUBLE_T) {
+            opencl_net.push_innerproduct(net.ip1_val_b.size(),
+                                         net.ip2_vbe_b.size(), false,
+                                         HEAD_VAL_CHANNELS, HEAD_VBE_OUT,
+                                         net.ip2_vbe_w, net.ip2_vbe_b);
+        }
+    };
+    // The same outputs as the device, for the self-check and for
+    // --cpu-threads.
+    auto forward_cpu_full = [&net](const std::vector<float>& input,
+                                   std::vector<float>& output_pol,
+                                   std::vector<float>& output_val,
+                                   std::vector<float>& output_vbe,
+                                   const int batch_size) {
+        auto cpu_pol = std::vector<float>(
+            batch_size * net.arch.policy_outputs * BOARD_SQUARES);
+        auto cpu_val = std::vector<float>(
+            batch_size * net.arch.val_outputs * BOARD_SQUARES);
+        auto cpu_vbe = std::vector<float>(
+            batch_size * net.arch.vbe_outputs * BOARD_SQUARES);
+        forward_cpu(net, input, cpu_pol, cpu_val, cpu_vbe, batch_size);
+        forward_heads(net, cpu_pol, cpu_val, cpu_vbe,
+                      output_pol, output_val, output_vbe, batch_size);
+    };
+    net.opencl.initialize(arch.channels, get_max_batch_size(),
+                          push_weights,
+                          forward_cpu_full, share ? &share->opencl : nullptr);
+#else
+    // Nothing to share on the CPU.
+    (void)share;
 #endif
-#ifdef USE_BLAS
-#ifndef __APPLE__
-#ifdef USE_OPENBLAS
-    openblas_set_num_threads(1);
-    myprintf("BLAS Core: %s\n", openblas_get_corename());
+#ifdef USE_OPENCL_SELFCHECK
+    net.selfcheck.initialize([forward_cpu_full](
+                                 const std::vector<float>& input,
+                                 const std::vector<float>& output_pol,
+                                 const std::vector<float>& output_val,
+                                 const std::vector<float>& output_vbe,
+                                 const int batch_size) {
+        auto cpu_policy_data = std::vector<float>(output_pol.size());
+        auto cpu_val_data = std::vector<float>(output_val.size());
+        auto cpu_vbe_data = std::vector<float>(output_vbe.size());
+        forward_cpu_full(input, cpu_policy_data, cpu_val_data, cpu_vbe_data,
+                         batch_size);
+        compare_net_outputs(output_pol, cpu_policy_data);
+        compare_net_outputs(output_val, cpu_val_data);
+        compare_net_outputs(output_vbe, cpu_vbe_data);
+    });
 #endif
-#ifdef USE_MKL
-    //mkl_set_threading_layer(MKL_THREADING_SEQUENTIAL);
-    mkl_set_num_threads(1);
-    MKLVersion Version;
-    mkl_get_version(&Version);
-    myprintf("BLAS core: MKL %s\n", Version.Processor);
+#ifdef USE_CUDA
+    try {
+        initialize_cuda(net);
+    } catch (const std::exception& e) {
+        myprintf("CUDA error: %s\nRunning the network on the CPU.\n",
+                 e.what());
+        net.cuda.reset();
+    }
+#endif
+#if defined(USE_BLAS) && !defined(USE_OPENCL)
+    select_convolutions(net);
+    if (net.use_int8) {
+        if (check_against_cpu(net, [&net](const std::vector<float>& input,
+                                          std::vector<float>& output_pol,
+                                          std::vector<float>& output_val,
+                                          std::vector<float>& output_vbe,
+                                          const int batch_size) {
+                forward_cpu_int8(net, input, output_pol, output_val,
+                                 output_vbe, batch_size);
+            })) {
+            myprintf("Using int8 convolutions.\n");
+        } else {
+            myprintf("Int8 outputs differ too much from float, "
+                     "not using int8.\n");
+            net.use_int8 = false;
+        }
+    }
+    if (cfg_batch_size > 1) {
+        net.cpu_scheduler.initialize(
+            [&net](const std::vector<float>& input,
+                   std::vector<float>& output_pol,
+                   std::vector<float>& output_val,
+                   std::vector<float>& output_vbe,
+                   const int batch_size) {
+                forward_planes(net, input, output_pol, output_val,
+                               output_vbe, batch_size);
+            });
+    }
 #endif
+    return net_ptr;
+}
+
+std::shared_ptr<NetworkWeights> Network::attach_daemon(
+    const std::string& name) {
+    auto net_ptr = std::make_shared<NetworkWeights>();
+    auto& net = *net_ptr;
+    try {
+        net.daemon = std::make_unique<NNDaemon::Client>(name);
+    } catch (const std::runtime_error& e) {
+        myprintf("%s\n", e.what());
+        return nullptr;
+    }
+    const auto& info = net.daemon->get_info();
+    net.arch.value_head_type = info.value_head_type;
+    net.arch.residual_blocks = info.residual_blocks;
+    net.arch.channels = info.channels;
+    net.arch.input_planes = info.input_planes;
+    net.arch.policy_outputs = info.policy_outputs;
+    net.arch.val_outputs = info.val_outputs;
+    net.arch.vbe_outputs = info.vbe_outputs;
+    net.cache_key = info.cache_key;
+    myprintf("Evaluating on the NN daemon %s, %zux%zu network.\n",
+             name.c_str(), net.arch.residual_blocks, net.arch.channels);
+    return net_ptr;
+}
+
+bool Network::run_daemon(const std::string& name) {
+    wait_for_networks();
+    auto net = std::atomic_load(&current_network);
+    auto info = NNDaemon::NetInfo{};
+    info.value_head_type = net->arch.value_head_type;
+    info.residual_blocks = net->arch.residual_blocks;
+    info.channels = net->arch.channels;
+    info.input_planes = net->arch.input_planes;
+    info.policy_outputs = net->arch.policy_outputs;
+    info.val_outputs = net->arch.val_outputs;
+    info.vbe_outputs = net->arch.vbe_outputs;
+    auto pol_size = size_t{0};
+    auto val_size = size_t{0};
+    auto vbe_size = size_t{0};
+    get_output_sizes(*net, pol_size, val_size, vbe_size);
+    info.pol_size = pol_size;
+    info.val_size = val_size;
+    info.vbe_size = vbe_size;
+    info.cache_key = net->cache_key;
+    // Every worker runs whole batches, which the backend takes as they
+    // are.
+    return NNDaemon::run(name, info, cfg_num_threads, cfg_batch_size,
+                         std::chrono::microseconds(cfg_batch_wait),
+                         [net](const std::vector<float>& input,
+                               std::vector<float>& output_pol,
+                               std::vector<float>& output_val,
+                               std::vector<float>& output_vbe,
+                               const int batch_size) {
+                             forward(*net, input, output_pol, output_val,
+                                     output_vbe, batch_size);
+                         });
+}
+
+void Network::dump_batch_stats() {
+    wait_for_networks();
+    const auto net = std::atomic_load(&current_network);
+    if (net->daemon) {
+        return;
+    }
+#ifdef USE_OPENCL
+    net->opencl.dump_batch_stats();
+#ifdef USE_OPENCL_SELFCHECK
+    net->selfcheck.dump_stats();
 #endif
+#elif defined(USE_BLAS)
+    net->cpu_scheduler.dump_batch_stats();
 #endif
 }
 
 #ifdef USE_BLAS
-void Network::winograd_transform_in(const std::vector<float>& in,
-                                    std::vector<float>& V,
-                                    const int C) {
+// The Winograd transforms keep the channels innermost, and work on
+// WINOGRAD_LANES consecutive channels at once. With GCC and Clang,
+// winograd_vec is a native vector type that becomes one AVX-512 register,
+// two AVX2 or four SSE/NEON registers. On x86-64 Linux the tile kernels are
+// compiled for all of these and the best one is picked at load time from
+// CPUID, so the binary needs no -march=native to use wide vectors.
+#if defined(__GNUC__)
+typedef float winograd_vec __attribute__((vector_size(16 * sizeof(float))));
+#else
+struct winograd_vec {
+    float v[16];
+    float& operator[](const int i) { return v[i]; }
+    float operator[](const int i) const { return v[i]; }
+};
+#define WINOGRAD_VEC_OP(op)                                          \
+static inline winograd_vec operator op(const winograd_vec& a,        \
+                                       const winograd_vec& b) {      \
+    auto r = winograd_vec{};                                         \
+    for (auto i = 0; i < 16; i++) {                                  \
+        r[i] = a[i] op b[i];                                         \
+    }                                                                \
+    return r;                                                        \
+}
+WINOGRAD_VEC_OP(+)
+WINOGRAD_VEC_OP(-)
+WINOGRAD_VEC_OP(*)
+#undef WINOGRAD_VEC_OP
+#endif
+static constexpr auto WINOGRAD_LANES =
+    static_cast<int>(sizeof(winograd_vec) / sizeof(float));
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__) \
+    && defined(__linux__)
+#define WINOGRAD_SIMD_CLONES \
+    __attribute__((target_clones("arch=skylake-avx512", "arch=haswell", \
+                                 "default")))
+#else
+#define WINOGRAD_SIMD_CLONES
+#endif
+
+// The vectors are passed by reference only, so that the kernels do not
+// depend on the calling convention for wide vectors of the default target.
+// Loads the first n lanes, the others are zero.
+static inline void vec_load(winograd_vec& v, const float* const p,
+                            const int n = WINOGRAD_LANES) {
+    v = winograd_vec{};
+    std::memcpy(&v, p, n * sizeof(float));
+}
+
+static inline void vec_store(float* const p, const winograd_vec& v,
+                             const int n = WINOGRAD_LANES) {
+    std::memcpy(p, &v, n * sizeof(float));
+}
+
+static inline void vec_relu(winograd_vec& v) {
+#if defined(__GNUC__)
+    v = v > winograd_vec{} ? v : winograd_vec{};
+#else
+    for (auto i = 0; i < WINOGRAD_LANES; i++) {
+        v[i] = v[i] > 0.0f ? v[i] : 0.0f;
+    }
+#endif
+}
+
+template <typename T>
+static void to_channels_last(const T* in, T* out,
+                             const size_t channels, const size_t batch_size) {
+    for (auto n = size_t{0}; n < batch_size; n++) {
+        for (auto c = size_t{0}; c < channels; c++) {
+            for (auto b = size_t{0}; b < BOARD_SQUARES; b++) {
+                out[(n * BOARD_SQUARES + b) * channels + c] =
+                    in[(n * channels + c) * BOARD_SQUARES + b];
+            }
+        }
+    }
+}
+
+template <typename T>
+static void to_channels_first(const T* in, T* out,
+                              const size_t channels, const size_t batch_size) {
+    for (auto n = size_t{0}; n < batch_size; n++) {
+        for (auto c = size_t{0}; c < channels; c++) {
+            for (auto b = size_t{0}; b < BOARD_SQUARES; b++) {
+                out[(n * channels + c) * BOARD_SQUARES + b] =
+                    in[(n * BOARD_SQUARES + b) * channels + c];
+            }
+        }
+    }
+}
+
+// in[i * 4 + j] is row i, column j of the tile, and component t of the
+// transformed tile goes to out[t * out_stride].
+static inline void winograd_tile_in(const float* const* const in,
+                                    float* const out, const size_t out_stride,
+                                    const int c, const int n) {
+    // Calculates transpose(B).x.B
+    // B = [[ 1.0,  0.0,  0.0,  0.0],
+    //      [ 0.0,  1.0, -1.0,  1.0],
+    //      [-1.0,  1.0,  1.0,  0.0],
+    //      [ 0.0,  0.0,  0.0, -1.0]]
+    std::array<std::array<winograd_vec, 4>, 4> T1;
+    for (auto j = 0; j < 4; j++) {
+        winograd_vec x0, x1, x2, x3;
+        vec_load(x0, in[0 * 4 + j] + c, n);
+        vec_load(x1, in[1 * 4 + j] + c, n);
+        vec_load(x2, in[2 * 4 + j] + c, n);
+        vec_load(x3, in[3 * 4 + j] + c, n);
+        T1[0][j] = x0 - x2;
+        T1[1][j] = x1 + x2;
+        T1[2][j] = x2 - x1;
+        T1[3][j] = x1 - x3;
+    }
+    for (auto i = 0; i < 4; i++) {
+        const auto o = out + i * 4 * out_stride + c;
+        vec_store(o + 0 * out_stride, T1[i][0] - T1[i][2], n);
+        vec_store(o + 1 * out_stride, T1[i][1] + T1[i][2], n);
+        vec_store(o + 2 * out_stride, T1[i][2] - T1[i][1], n);
+        vec_store(o + 3 * out_stride, T1[i][1] - T1[i][3], n);
+    }
+}
+
+// With FIXED_C the number of channels is known at compile time, C is
+// only used by the generic version, FIXED_C = 0. The same goes for
+// FIXED_K below.
+template <int FIXED_C>
+WINOGRAD_SIMD_CLONES
+static void winograd_tiles_in(const float* const* const in,
+                              float* const out, const size_t out_stride,
+                              int C) {
+    if (FIXED_C > 0) {
+        C = FIXED_C;
+    }
+    auto c = 0;
+    for (; c + WINOGRAD_LANES <= C; c += WINOGRAD_LANES) {
+        winograd_tile_in(in, out, out_stride, c, WINOGRAD_LANES);
+    }
+    if (c < C) {
+        winograd_tile_in(in, out, out_stride, c, C - c);
+    }
+}
+
+template <int FIXED_C>
+static void winograd_transform_in(const std::vector<float>& in,
+                                  std::vector<float>& V,
+                                  int C,
+                                  const int batch_size) {
+    if (FIXED_C > 0) {
+        C = FIXED_C;
+    }
     constexpr auto W = BOARD_SIZE;
     constexpr auto H = BOARD_SIZE;
     constexpr auto WTILES = (W + 1) / 2;
     constexpr auto P = WTILES * WTILES;
+    constexpr auto WPAD = WTILES * 2 + 2;
+    const auto NP = batch_size * P;
 
-    std::array<std::array<float, WTILES * 2 + 2>, WTILES * 2 + 2> in_pad;
-    for (auto xin = size_t{0}; xin < in_pad.size(); xin++) {
-        in_pad[0][xin]     = 0.0f;
-        in_pad[H + 1][xin] = 0.0f;
-        in_pad[H + 2][xin] = 0.0f;
-    }
-    for (auto yin = size_t{1}; yin < in_pad[0].size() - 2; yin++) {
-        in_pad[yin][0]     = 0.0f;
-        in_pad[yin][W + 1] = 0.0f;
-        in_pad[yin][W + 2] = 0.0f;
-    }
+    // One zero padded position, channels innermost
+    thread_local auto in_pad = std::vector<float>();
+    in_pad.assign(WPAD * WPAD * C, 0.0f);
+    auto tile = std::array<const float*, Network::WINOGRAD_TILE>{};
 
-    for (auto ch = 0; ch < C; ch++) {
+    for (auto n = 0; n < batch_size; n++) {
         for (auto yin = 0; yin < H; yin++) {
-            for (auto xin = 0; xin < W; xin++) {
-                in_pad[yin + 1][xin + 1] = in[ch*(W*H) + yin*W + xin];
-            }
+            const auto src = &in[(n * W * H + yin * W) * C];
+            std::copy(src, src + W * C,
+                      begin(in_pad) + ((yin + 1) * WPAD + 1) * C);
         }
         for (auto block_y = 0; block_y < WTILES; block_y++) {
             // Tiles overlap by 2
             const auto yin = 2 * block_y;
             for (auto block_x = 0; block_x < WTILES; block_x++) {
                 const auto xin = 2 * block_x;
-
-                // Calculates transpose(B).x.B
-                // B = [[ 1.0,  0.0,  0.0,  0.0],
-                //      [ 0.0,  1.0, -1.0,  1.0],
-                //      [-1.0,  1.0,  1.0,  0.0],
-                //      [ 0.0,  0.0,  0.0, -1.0]]
-
-                using WinogradTile =
-                    std::array<std::array<float, WINOGRAD_ALPHA>, WINOGRAD_ALPHA>;
-                WinogradTile T1, T2;
-
-                T1[0][0] = in_pad[yin + 0][xin + 0] - in_pad[yin + 2][xin + 0];
-                T1[0][1] = in_pad[yin + 0][xin + 1] - in_pad[yin + 2][xin + 1];
-                T1[0][2] = in_pad[yin + 0][xin + 2] - in_pad[yin + 2][xin + 2];
-                T1[0][3] = in_pad[yin + 0][xin + 3] - in_pad[yin + 2][xin + 3];
-                T1[1][0] = in_pad[yin + 1][xin + 0] + in_pad[yin + 2][xin + 0];
-                T1[1][1] = in_pad[yin + 1][xin + 1] + in_pad[yin + 2][xin + 1];
-                T1[1][2] = in_pad[yin + 1][xin + 2] + in_pad[yin + 2][xin + 2];
-                T1[1][3] = in_pad[yin + 1][xin + 3] + in_pad[yin + 2][xin + 3];
-                T1[2][0] = in_pad[yin + 2][xin + 0] - in_pad[yin + 1][xin + 0];
-                T1[2][1] = in_pad[yin + 2][xin + 1] - in_pad[yin + 1][xin + 1];
-                T1[2][2] = in_pad[yin + 2][xin + 2] - in_pad[yin + 1][xin + 2];
-                T1[2][3] = in_pad[yin + 2][xin + 3] - in_pad[yin + 1][xin + 3];
-                T1[3][0] = in_pad[yin + 1][xin + 0] - in_pad[yin + 3][xin + 0];
-                T1[3][1] = in_pad[yin + 1][xin + 1] - in_pad[yin + 3][xin + 1];
-                T1[3][2] = in_pad[yin + 1][xin + 2] - in_pad[yin + 3][xin + 2];
-                T1[3][3] = in_pad[yin + 1][xin + 3] - in_pad[yin + 3][xin + 3];
-
-                T2[0][0] = T1[0][0] - T1[0][2];
-                T2[0][1] = T1[0][1] + T1[0][2];
-                T2[0][2] = T1[0][2] - T1[0][1];
-                T2[0][3] = T1[0][1] - T1[0][3];
-                T2[1][0] = T1[1][0] - T1[1][2];
-                T2[1][1] = T1[1][1] + T1[1][2];
-                T2[1][2] = T1[1][2] - T1[1][1];
-                T2[1][3] = T1[1][1] - T1[1][3];
-                T2[2][0] = T1[2][0] - T1[2][2];
-                T2[2][1] = T1[2][1] + T1[2][2];
-                T2[2][2] = T1[2][2] - T1[2][1];
-                T2[2][3] = T1[2][1] - T1[2][3];
-                T2[3][0] = T1[3][0] - T1[3][2];
-                T2[3][1] = T1[3][1] + T1[3][2];
-                T2[3][2] = T1[3][2] - T1[3][1];
-                T2[3][3] = T1[3][1] - T1[3][3];
-
-                const auto offset = ch * P + block_y * WTILES + block_x;
-                for (auto i = 0; i < WINOGRAD_ALPHA; i++) {
-                    for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
-                        V[(i*WINOGRAD_ALPHA + j)*C*P + offset] = T2[i][j];
+                for (auto i = 0; i < Network::WINOGRAD_ALPHA; i++) {
+                    for (auto j = 0; j < Network::WINOGRAD_ALPHA; j++) {
+                        tile[i * Network::WINOGRAD_ALPHA + j] =
+                            &in_pad[((yin + i) * WPAD + xin + j) * C];
                     }
                 }
+                const auto b = n * P + block_y * WTILES + block_x;
+                winograd_tiles_in<FIXED_C>(tile.data(), &V[b * C], NP * C, C);
             }
         }
     }
 }
 
+void Network::winograd_transform_in(const std::vector<float>& in,
+                                    std::vector<float>& V,
+                                    const int C,
+                                    const int batch_size) {
+    ::winograd_transform_in<0>(in, V, C, batch_size);
+}
+
 void Network::winograd_sgemm(const std::vector<float>& U,
                              const std::vector<float>& V,
                              std::vector<float>& M,
-                             const int C, const int K) {
+                             const int C, const int K,
+                             const int batch_size) {
     constexpr auto P = (BOARD_SIZE + 1) * (BOARD_SIZE + 1) / WINOGRAD_ALPHA;
+    const auto NP = batch_size * P;
 
     for (auto b = 0; b < WINOGRAD_TILE; b++) {
         const auto offset_u = b * K * C;
-        const auto offset_v = b * C * P;
-        const auto offset_m = b * K * P;
+        const auto offset_v = b * C * NP;
+        const auto offset_m = b * K * NP;
 
-        cblas_sgemm(CblasRowMajor, CblasTrans, CblasNoTrans,
-                    K, P, C,
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+                    NP, K, C,
                     1.0f,
+                    &V[offset_v], C,
                     &U[offset_u], K,
-                    &V[offset_v], P,
                     0.0f,
-                    &M[offset_m], P);
+                    &M[offset_m], K);
     }
 }
 
-void Network::winograd_transform_out(const std::vector<float>& M,
-                                     std::vector<float>& Y,
-                                     const int K) {
+// Component t of the tile is in[t * in_stride], and out[i * 2 + j] is
+// row i, column j of the output tile.
+static inline void winograd_tile_out(const float* const in,
+                                     const size_t in_stride,
+                                     float* const* const out,
+                                     const float* const* const eltwise,
+                                     const float* const means,
+                                     const float* const stddivs,
+                                     const int k, const int n) {
+    // Calculates transpose(A).temp_m.A
+    //    A = [1.0,  0.0],
+    //        [1.0,  1.0],
+    //        [1.0, -1.0],
+    //        [0.0, -1.0]]
+    std::array<std::array<winograd_vec, 4>, 4> m;
+    for (auto t = 0; t < 16; t++) {
+        vec_load(m[t / 4][t % 4], in + t * in_stride + k, n);
+    }
+    // Rows of transpose(A).temp_m first, then the columns
+    const std::array<winograd_vec, 4> r0 = {
+        m[0][0] + m[1][0] + m[2][0], m[0][1] + m[1][1] + m[2][1],
+        m[0][2] + m[1][2] + m[2][2], m[0][3] + m[1][3] + m[2][3]
+    };
+    const std::array<winograd_vec, 4> r1 = {
+        m[1][0] - m[2][0] - m[3][0], m[1][1] - m[2][1] - m[3][1],
+        m[1][2] - m[2][2] - m[3][2], m[1][3] - m[2][3] - m[3][3]
+    };
+    const std::array<winograd_vec, 4> o = {
+        r0[0] + r0[1] + r0[2], r0[1] - r0[2] - r0[3],
+        r1[0] + r1[1] + r1[2], r1[1] - r1[2] - r1[3]
+    };
+
+    winograd_vec mean, scale_stddiv, res;
+    vec_load(mean, means + k, n);
+    vec_load(scale_stddiv, stddivs + k, n);
+    for (auto t = 0; t < 4; t++) {
+        auto val = scale_stddiv * (o[t] - mean);
+        if (eltwise) {
+            vec_load(res, eltwise[t] + k, n);
+            val = val + res;
+        }
+        vec_relu(val);
+        vec_store(out[t] + k, val, n);
+    }
+}
+
+template <int FIXED_K>
+WINOGRAD_SIMD_CLONES
+static void winograd_tiles_out(const float* const in, const size_t in_stride,
+                               float* const* const out,
+                               const float* const* const eltwise,
+                               const float* const means,
+                               const float* const stddivs,
+                               int K) {
+    if (FIXED_K > 0) {
+        K = FIXED_K;
+    }
+    auto k = 0;
+    for (; k + WINOGRAD_LANES <= K; k += WINOGRAD_LANES) {
+        winograd_tile_out(in, in_stride, out, eltwise, means, stddivs,
+                          k, WINOGRAD_LANES);
+    }
+    if (k < K) {
+        winograd_tile_out(in, in_stride, out, eltwise, means, stddivs,
+                          k, K - k);
+    }
+}
+
+template <int FIXED_K>
+static void winograd_transform_out(const std::vector<float>& M,
+                                   std::vector<float>& Y,
+                                   int K,
+                                   const float* const means,
+                                   const float* const stddivs,
+                                   const float* const eltwise,
+                                   const int batch_size) {
+    if (FIXED_K > 0) {
+        K = FIXED_K;
+    }
     constexpr auto W = BOARD_SIZE;
     constexpr auto H = BOARD_SIZE;
     constexpr auto WTILES = (W + 1) / 2;
     constexpr auto P = WTILES * WTILES;
+    const auto NP = batch_size * P;
 
-    for (auto k = 0; k < K; k++) {
-        const auto kHW = k * W * H;
-        for (auto block_x = 0; block_x < WTILES; block_x++) {
-            const auto x = 2 * block_x;
-            for (auto block_y = 0; block_y < WTILES; block_y++) {
-                const auto y = 2 * block_y;
-
-                const auto b = block_y * WTILES + block_x;
-                using WinogradTile =
-                    std::array<std::array<float, WINOGRAD_ALPHA>, WINOGRAD_ALPHA>;
-                WinogradTile temp_m;
-                for (auto xi = 0; xi < WINOGRAD_ALPHA; xi++) {
-                    for (auto nu = 0; nu < WINOGRAD_ALPHA; nu++) {
-                        temp_m[xi][nu] =
-                            M[xi*(WINOGRAD_ALPHA*K*P) + nu*(K*P)+ k*P + b];
-                    }
-                }
+    // Outputs that fall outside of the board read and write a scratch area.
+    thread_local auto scratch = std::vector<float>();
+    scratch.assign(K, 0.0f);
+    auto out = std::array<float*, 4>{};
+    auto res = std::array<const float*, 4>{};
 
-                // Calculates transpose(A).temp_m.A
-                //    A = [1.0,  0.0],
-                //        [1.0,  1.0],
-                //        [1.0, -1.0],
-                //        [0.0, -1.0]]
-
-                const std::array<std::array<float, 2>, 2> o = {
-                    temp_m[0][0] + temp_m[0][1] + temp_m[0][2] +
-                    temp_m[1][0] + temp_m[1][1] + temp_m[1][2] +
-                    temp_m[2][0] + temp_m[2][1] + temp_m[2][2],
-                    temp_m[0][1] - temp_m[0][2] - temp_m[0][3] +
-                    temp_m[1][1] - temp_m[1][2] - temp_m[1][3] +
-                    temp_m[2][1] - temp_m[2][2] - temp_m[2][3],
-                    temp_m[1][0] + temp_m[1][1] + temp_m[1][2] -
-                    temp_m[2][0] - temp_m[2][1] - temp_m[2][2] -
-                    temp_m[3][0] - temp_m[3][1] - temp_m[3][2],
-                    temp_m[1][1] - temp_m[1][2] - temp_m[1][3] -
-                    temp_m[2][1] + temp_m[2][2] + temp_m[2][3] -
-                    temp_m[3][1] + temp_m[3][2] + temp_m[3][3]
-                };
-
-                const auto y_ind = kHW + (y)*W + (x);
-                Y[y_ind] = o[0][0];
-                if (x + 1 < W) {
-                    Y[y_ind + 1] = o[0][1];
-                }
-                if (y + 1 < H) {
-                    Y[y_ind + W] = o[1][0];
-                    if (x + 1 < W) {
-                        Y[y_ind + W + 1] = o[1][1];
+    for (auto n = 0; n < batch_size; n++) {
+        for (auto block_y = 0; block_y < WTILES; block_y++) {
+            const auto y = 2 * block_y;
+            for (auto block_x = 0; block_x < WTILES; block_x++) {
+                const auto x = 2 * block_x;
+                for (auto i = 0; i < 2; i++) {
+                    for (auto j = 0; j < 2; j++) {
+                        const auto inside = y + i < H && x + j < W;
+                        const auto offset = (n * W * H + (y + i) * W + x + j) * K;
+                        out[i * 2 + j] = inside ? &Y[offset] : scratch.data();
+                        res[i * 2 + j] = inside && eltwise ? &eltwise[offset]
+                                                           : scratch.data();
                     }
                 }
+                const auto b = n * P + block_y * WTILES + block_x;
+                winograd_tiles_out<FIXED_K>(&M[b * K], NP * K, out.data(),
+                                            eltwise ? res.data() : nullptr,
+                                            means, stddivs, K);
             }
         }
     }
 }
 
-void Network::winograd_convolve3(const int outputs,
+void Network::winograd_transform_out(const std::vector<float>& M,
+                                     std::vector<float>& Y,
+                                     const int K,
+                                     const float* const means,
+                                     const float* const stddivs,
+                                     const float* const eltwise,
+                                     const int batch_size) {
+    ::winograd_transform_out<0>(M, Y, K, means, stddivs, eltwise, batch_size);
+}
+
+template <int C>
+static constexpr WinogradKernels winograd_kernels() {
+    return {::winograd_transform_in<C>, ::winograd_transform_out<C>};
+}
+
+WinogradKernels Network::get_winograd_kernels(const int C) {
+    switch (C) {
+    case INPUT_CHANNELS:
+        return winograd_kernels<INPUT_CHANNELS>();
+    case 32:
+        return winograd_kernels<32>();
+    case 64:
+        return winograd_kernels<64>();
+    case 128:
+        return winograd_kernels<128>();
+    case 192:
+        return winograd_kernels<192>();
+    case 256:
+        return winograd_kernels<256>();
+    default:
+        return {winograd_transform_in, winograd_transform_out};
+    }
+}
+
+void Network::winograd_convolve3(const WinogradKernels& kernels,
+                                 const int outputs,
                                  const std::vector<float>& input,
                                  const std::vector<float>& U,
                                  std::vector<float>& V,
                                  std::vector<float>& M,
-                                 std::vector<float>& output) {
+                                 std::vector<float>& output,
+                                 const float* const means,
+                                 const float* const stddivs,
+                                 const float* const eltwise,
+                                 const int batch_size) {
 
     constexpr unsigned int filter_len = WINOGRAD_ALPHA * WINOGRAD_ALPHA;
     const auto input_channels = U.size() / (outputs * filter_len);
 
-    winograd_transform_in(input, V, input_channels);
-    winograd_sgemm(U, V, M, input_channels, outputs);
-    winograd_transform_out(M, output, outputs);
+    kernels.transform_in(input, V, input_channels, batch_size);
+    winograd_sgemm(U, V, M, input_channels, outputs, batch_size);
+    kernels.transform_out(M, output, outputs, means, stddivs, eltwise,
+                          batch_size);
+}
+
+std::vector<float> Network::im2col_weights_f(const std::vector<float>& U,
+                                             const int outputs,
+                                             const int channels) {
+    const auto f = winograd_untransform_f(U, outputs, channels);
+    auto weights = std::vector<float>(9 * channels * outputs);
+    for (auto o = 0; o < outputs; o++) {
+        for (auto c = 0; c < channels; c++) {
+            for (auto t = 0; t < 9; t++) {
+                weights[(t * channels + c) * outputs + o] =
+                    f[o*channels*9 + c*9 + t];
+            }
+        }
+    }
+    return weights;
+}
+
+void Network::im2col_convolve3(const int outputs,
+                               const std::vector<float>& input,
+                               const std::vector<float>& weights,
+                               std::vector<float>& col,
+                               std::vector<float>& output,
+                               const float* const means,
+                               const float* const stddivs,
+                               const float* const eltwise,
+                               const int batch_size) {
+    constexpr auto filter_len = 3 * 3;
+    const auto channels = weights.size() / (filter_len * outputs);
+    const auto filter_dim = filter_len * channels;
+    const auto points = batch_size * BOARD_SQUARES;
+
+    col.resize(points * filter_dim);
+    for (auto n = 0; n < batch_size; n++) {
+        im2col_channels_last<3>(channels,
+                                &input[n * BOARD_SQUARES * channels],
+                                &col[n * BOARD_SQUARES * filter_dim]);
+    }
+    // output[points, outputs] = col[points, 3x3xchannels]
+    //                           x weights[3x3xchannels, outputs]
+    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+                points, outputs, filter_dim,
+                1.0f, &col[0], filter_dim,
+                &weights[0], outputs,
+                0.0f, &output[0], outputs);
+
+    // The batchnorm, the residual add and the ReLU of the Winograd
+    // output transform.
+    for (auto p = 0; p < points; p++) {
+        const auto out = &output[p * outputs];
+        const auto res = eltwise ? &eltwise[p * outputs] : nullptr;
+        for (auto o = 0; o < outputs; o++) {
+            auto val = stddivs[o] * (out[o] - means[o]);
+            if (res) {
+                val += res[o];
+            }
+            out[o] = val > 0.0f ? val : 0.0f;
+        }
+    }
+}
+
+void Network::select_convolutions(NetworkWeights& net) {
+    const auto& arch = net.arch;
+    net.conv_weights_col.assign(net.conv_weights.size(), {});
+    const auto batch_size = std::max(1, cfg_batch_size);
+    const auto outputs = static_cast<int>(arch.channels);
+    const auto planes_size = batch_size * outputs * BOARD_SQUARES;
+    constexpr auto tiles = (BOARD_SIZE + 1) * (BOARD_SIZE + 1) / 4;
+
+    // The input convolution, then the first of the residual tower, all
+    // of which have the same shape.
+    for (auto layer = size_t{0};
+         layer < std::min(size_t{2}, net.conv_weights.size()); layer++) {
+        const auto channels = static_cast<int>(
+            layer == 0 ? arch.input_planes : arch.channels);
+        const auto& kernels = layer == 0 ? net.input_kernels
+                                         : net.tower_kernels;
+        const auto& U = net.conv_weights[layer];
+        const auto means = net.batchnorm_means[layer].data();
+        const auto stddivs = net.batchnorm_stddivs[layer].data();
+        const auto weights = im2col_weights_f(U, outputs, channels);
+
+        auto rng = Random{1};
+        auto input = std::vector<float>(batch_size * channels * BOARD_SQUARES);
+        for (auto& x : input) {
+            x = rng.randuint64(1000) / 1000.0f;
+        }
+        auto V = std::vector<float>(WINOGRAD_TILE * channels * tiles
+                                    * batch_size);
+        auto M = std::vector<float>(WINOGRAD_TILE * outputs * tiles
+                                    * batch_size);
+        auto col = std::vector<float>();
+        auto winograd_out = std::vector<float>(planes_size);
+        auto im2col_out = std::vector<float>(planes_size);
+
+        // The best of a few runs, which leaves out the first one that
+        // sizes the buffers.
+        const auto time = [](const std::function<void()>& convolve) {
+            auto best = std::numeric_limits<double>::max();
+            for (auto run = 0; run < 5; run++) {
+                const auto start = std::chrono::steady_clock::now();
+                for (auto i = 0; i < 4; i++) {
+                    convolve();
+                }
+                const auto elapsed = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start).count();
+                best = std::min(best, elapsed / 4);
+            }
+            return best;
+        };
+        const auto winograd_ms = time([&] {
+            winograd_convolve3(kernels, outputs, input, U, V, M,
+                               winograd_out, means, stddivs, nullptr,
+                               batch_size);
+        });
+        const auto im2col_ms = time([&] {
+            im2col_convolve3(outputs, input, weights, col, im2col_out,
+                             means, stddivs, nullptr, batch_size);
+        });
+        const auto im2col = im2col_ms < winograd_ms
+            && compare_net_outputs(im2col_out, winograd_out, false);
+        myprintf("3x3 convolution %d -> %d channels: Winograd %.3f ms, "
+                 "im2col %.3f ms, using %s.\n", channels, outputs,
+                 winograd_ms, im2col_ms, im2col ? "im2col" : "Winograd");
+        if (!im2col) {
+            continue;
+        }
+        net.conv_weights_col[layer] = weights;
+        for (auto i = layer + 1; layer > 0 && i < net.conv_weights.size();
+             i++) {
+            net.conv_weights_col[i] = im2col_weights_f(
+                net.conv_weights[i], outputs, channels);
+        }
+    }
 }
 
 template<unsigned int filter_size>
@@ -813,7 +2012,8 @@ void convolve(const size_t outputs,
               const std::vector<float>& input,
               const std::vector<float>& weights,
               const std::vector<float>& biases,
-              std::vector<float>& output) {
+              std::vector<float>& output,
+              const size_t batch_size = 1) {
     // The size of the board is defined at compile time
     constexpr unsigned int width = BOARD_SIZE;
     constexpr unsigned int height = BOARD_SIZE;
@@ -821,44 +2021,128 @@ void convolve(const size_t outputs,
     constexpr auto filter_len = filter_size * filter_size;
     const auto input_channels = weights.size() / (biases.size() * filter_len);
     const auto filter_dim = filter_len * input_channels;
-    assert(outputs * board_squares == output.size());
+    assert(batch_size * outputs * board_squares == output.size());
 
     std::vector<float> col(filter_dim * width * height);
-    im2col<filter_size>(input_channels, input, col);
-
-    // Weight shape (output, input, filter_size, filter_size)
-    // 96 18 3 3
-    // C←αAB + βC
-    // outputs[96,19x19] = weights[96,18x3x3] x col[18x3x3,19x19]
-    // M Number of rows in matrices A and C.
-    // N Number of columns in matrices B and C.
-    // K Number of columns in matrix A; number of rows in matrix B.
-    // lda The size of the first dimention of matrix A; if you are
-    // passing a matrix A[m][n], the value should be m.
-    //    cblas_sgemm(CblasRowMajor, TransA, TransB, M, N, K, alpha, A, lda, B,
-    //                ldb, beta, C, N);
+    for (auto n = size_t{0}; n < batch_size; n++) {
+        const auto out = &output[n * outputs * board_squares];
+        im2col<filter_size>(input_channels,
+                            &input[n * input_channels * board_squares], col);
+
+        // Weight shape (output, input, filter_size, filter_size)
+        // 96 18 3 3
+        // C←αAB + βC
+        // outputs[96,19x19] = weights[96,18x3x3] x col[18x3x3,19x19]
+        // M Number of rows in matrices A and C.
+        // N Number of columns in matrices B and C.
+        // K Number of columns in matrix A; number of rows in matrix B.
+        // lda The size of the first dimention of matrix A; if you are
+        // passing a matrix A[m][n], the value should be m.
+        //    cblas_sgemm(CblasRowMajor, TransA, TransB, M, N, K, alpha, A, lda, B,
+        //                ldb, beta, C, N);
+
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+                    // M        N            K
+                    outputs, board_squares, filter_dim,
+                    1.0f, &weights[0], filter_dim,
+                    &col[0], board_squares,
+                    0.0f, out, board_squares);
+
+        for (unsigned int o = 0; o < outputs; o++) {
+            for (unsigned int b = 0; b < board_squares; b++) {
+                out[(o * board_squares) + b] += biases[o];
+            }
+        }
+    }
+}
 
-    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
-                // M        N            K
-                outputs, board_squares, filter_dim,
-                1.0f, &weights[0], filter_dim,
-                &col[0], board_squares,
-                0.0f, &output[0], board_squares);
+void Network::quantize_weights(NetworkWeights& net) {
+    net.conv_weights_int8.clear();
+    net.conv_scales_int8.clear();
+    for (auto i = size_t{0}; i < net.conv_weights.size(); i++) {
+        const auto& weights = net.conv_weights[i];
+        const auto outputs = net.conv_biases[i].size();
+        const auto filter_dim = weights.size() / outputs;
+
+        auto quantized = std::vector<std::int8_t>(weights.size());
+        auto scales = std::vector<float>(outputs);
+        for (auto o = size_t{0}; o < outputs; o++) {
+            const auto w = &weights[o * filter_dim];
+            auto max_abs = 0.0f;
+            for (auto k = size_t{0}; k < filter_dim; k++) {
+                max_abs = std::max(max_abs, std::fabs(w[k]));
+            }
+            const auto scale = max_abs > 0.0f ? max_abs / 127.0f : 1.0f;
+            for (auto k = size_t{0}; k < filter_dim; k++) {
+                quantized[o * filter_dim + k] =
+                    static_cast<std::int8_t>(std::round(w[k] / scale));
+            }
+            scales[o] = scale;
+        }
+        net.conv_weights_int8.emplace_back(std::move(quantized));
+        net.conv_scales_int8.emplace_back(std::move(scales));
+    }
+}
 
-    for (unsigned int o = 0; o < outputs; o++) {
-        for (unsigned int b = 0; b < board_squares; b++) {
-            output[(o * board_squares) + b] += biases[o];
+// 3x3 convolution on int8 weights and activations, accumulated in int32.
+// The inputs are either 0/1 planes or come out of a ReLU, so they are
+// stored unsigned, and every position is quantized with its own scale.
+void convolve3_int8(const size_t channels, const size_t outputs,
+                    const std::vector<float>& input,
+                    const std::vector<std::int8_t>& weights,
+                    const std::vector<float>& weight_scales,
+                    std::vector<float>& output,
+                    const int batch_size) {
+    constexpr auto filter_len = 3 * 3;
+    const auto filter_dim = filter_len * channels;
+    const auto in_size = channels * BOARD_SQUARES;
+
+    thread_local auto in_q = std::vector<std::uint8_t>();
+    thread_local auto col = std::vector<std::uint8_t>();
+    // Pixel major, so the dot products below run over contiguous memory.
+    thread_local auto col_t = std::vector<std::uint8_t>();
+    in_q.assign(in_size, 0);
+    col.assign(filter_dim * BOARD_SQUARES, 0);
+    col_t.assign(filter_dim * BOARD_SQUARES, 0);
+
+    for (auto n = 0; n < batch_size; n++) {
+        const auto in = &input[n * in_size];
+        const auto max_in = *std::max_element(in, in + in_size);
+        const auto in_scale = max_in > 0.0f ? max_in / 255.0f : 1.0f;
+        for (auto i = size_t{0}; i < in_size; i++) {
+            in_q[i] = static_cast<std::uint8_t>(std::round(in[i] / in_scale));
+        }
+        im2col<3>(channels, in_q.data(), col);
+        for (auto k = size_t{0}; k < filter_dim; k++) {
+            for (auto b = 0; b < BOARD_SQUARES; b++) {
+                col_t[b * filter_dim + k] = col[k * BOARD_SQUARES + b];
+            }
+        }
+
+        const auto out = &output[n * outputs * BOARD_SQUARES];
+        for (auto o = size_t{0}; o < outputs; o++) {
+            const auto w = &weights[o * filter_dim];
+            const auto scale = weight_scales[o] * in_scale;
+            for (auto b = 0; b < BOARD_SQUARES; b++) {
+                const auto c = &col_t[b * filter_dim];
+                auto acc = std::int32_t{0};
+                for (auto k = size_t{0}; k < filter_dim; k++) {
+                    acc += std::int32_t{w[k]} * std::int32_t{c[k]};
+                }
+                out[o * BOARD_SQUARES + b] = acc * scale;
+            }
         }
     }
 }
 
 template<bool ReLU>
-std::vector<float> innerproduct(const std::vector<float>& input,
-                                const std::vector<float>& weights,
-                                const std::vector<float>& biases) {
+void innerproduct(const std::vector<float>& input,
+                  const std::vector<float>& weights,
+                  const std::vector<float>& biases,
+                  std::vector<float>& output) {
     const auto inputs = input.size();
     const auto outputs = biases.size();
-    std::vector<float> output(outputs);
+    output.resize(outputs);
 
     cblas_sgemv(CblasRowMajor, CblasNoTrans,
                 // M     K
@@ -876,8 +2160,6 @@ std::vector<float> innerproduct(const std::vector<float>& input,
         }
         output[o] = val;
     }
-
-    return output;
 }
 
 template <size_t spatial_size>
@@ -889,20 +2171,24 @@ void batchnorm(const size_t channels,
 {
     const auto lambda_ReLU = [](const auto val) { return (val > 0.0f) ?
                                                           val : 0.0f; };
-    for (auto c = size_t{0}; c < channels; ++c) {
+    // data may hold several positions back to back
+    const auto batch_channels = data.size() / spatial_size;
+    for (auto nc = size_t{0}; nc < batch_channels; ++nc) {
+        const auto c = nc % channels;
         const auto mean = means[c];
         const auto scale_stddiv = stddivs[c];
+        const auto offset = nc * spatial_size;
 
         if (eltwise == nullptr) {
             // Classical BN
-            const auto arr = &data[c * spatial_size];
+            const auto arr = &data[offset];
             for (auto b = size_t{0}; b < spatial_size; b++) {
                 arr[b] = lambda_ReLU(scale_stddiv * (arr[b] - mean));
             }
         } else {
             // BN + residual add
-            const auto arr = &data[c * spatial_size];
-            const auto res = &eltwise[c * spatial_size];
+            const auto arr = &data[offset];
+            const auto res = &eltwise[offset];
             for (auto b = size_t{0}; b < spatial_size; b++) {
                 arr[b] = lambda_ReLU((scale_stddiv * (arr[b] - mean)) + res[b]);
             }
@@ -911,10 +2197,13 @@ void batchnorm(const size_t channels,
 }
 
 // output_val, output_vbe are the features before the fully connected step
-void Network::forward_cpu(const std::vector<float>& input,
+void Network::forward_cpu(const NetworkWeights& net,
+                          const std::vector<float>& input,
                           std::vector<float>& output_pol,
                           std::vector<float>& output_val,
-                          std::vector<float>& output_vbe) {
+                          std::vector<float>& output_vbe,
+                          const int batch_size) {
+    const auto& arch = net.arch;
     // Input convolution
     constexpr auto width = BOARD_SIZE;
     constexpr auto height = BOARD_SIZE;
@@ -924,44 +2213,257 @@ void Network::forward_cpu(const std::vector<float>& input,
     // might be bigger when the network has very few filters
     const auto input_channels = std::max(static_cast<size_t>(arch.channels),
                                          static_cast<size_t>(arch.input_planes));
-    auto conv_out = std::vector<float>(arch.channels * width * height);
+    const auto planes_size = batch_size * arch.channels * width * height;
+    // The thread keeps these between evaluations, every one is written
+    // before it is read.
+    thread_local auto conv_out = std::vector<float>();
+    thread_local auto conv_in = std::vector<float>();
+    thread_local auto res = std::vector<float>();
+    thread_local auto V = std::vector<float>();
+    thread_local auto M = std::vector<float>();
+    thread_local auto col = std::vector<float>();
+    conv_out.resize(planes_size);
+    V.resize(WINOGRAD_TILE * input_channels * tiles * batch_size);
+    M.resize(WINOGRAD_TILE * arch.channels * tiles * batch_size);
+
+    // Every layer runs the way select_convolutions() picked.
+    const auto convolve3 = [&net, batch_size](const size_t layer,
+                                              const WinogradKernels& kernels,
+                                              const int outputs,
+                                              const std::vector<float>& in,
+                                              std::vector<float>& out,
+                                              const float* const eltwise) {
+        const auto means = net.batchnorm_means[layer].data();
+        const auto stddivs = net.batchnorm_stddivs[layer].data();
+        if (layer < net.conv_weights_col.size()
+            && !net.conv_weights_col[layer].empty()) {
+            im2col_convolve3(outputs, in, net.conv_weights_col[layer], col,
+                             out, means, stddivs, eltwise, batch_size);
+        } else {
+            winograd_convolve3(kernels, outputs, in, net.conv_weights[layer],
+                               V, M, out, means, stddivs, eltwise,
+                               batch_size);
+        }
+    };
+
+    // The tower runs with the channels innermost
+    conv_in.resize(input.size());
+    to_channels_last(input.data(), conv_in.data(), arch.input_planes,
+                     batch_size);
+    convolve3(0, net.input_kernels, arch.channels, conv_in, conv_out,
+              nullptr);
+
+    // Residual tower
+    conv_in.resize(planes_size);
+    res.resize(planes_size);
+    for (auto i = size_t{1}; i < net.conv_weights.size(); i += 2) {
+        auto output_channels = net.conv_biases[i].size();
+        std::swap(conv_out, conv_in);
+        convolve3(i, net.tower_kernels, output_channels, conv_in, conv_out,
+                  nullptr);
+
+        output_channels = net.conv_biases[i + 1].size();
+        std::swap(conv_in, res);
+        std::swap(conv_out, conv_in);
+        convolve3(i + 1, net.tower_kernels, output_channels, conv_in,
+                  conv_out, res.data());
+    }
+    std::swap(conv_out, conv_in);
+    to_channels_first(conv_in.data(), conv_out.data(), arch.channels,
+                      batch_size);
+    convolve<1>(arch.policy_outputs, conv_out, net.conv_pol_w, net.conv_pol_b,
+                output_pol, batch_size);
+    convolve<1>(arch.val_outputs, conv_out, net.conv_val_w, net.conv_val_b,
+                output_val, batch_size);
+    if (arch.value_head_type == DOUBLE_V) {
+      convolve<1>(arch.vbe_outputs, conv_out, net.conv_vbe_w, net.conv_vbe_b,
+                  output_vbe, batch_size);
+    }
+}
 
-    auto V = std::vector<float>(WINOGRAD_TILE * input_channels * tiles);
-    auto M = std::vector<float>(WINOGRAD_TILE * arch.channels * tiles);
+void Network::forward_cpu_int8(const NetworkWeights& net,
+                               const std::vector<float>& input,
+                               std::vector<float>& output_pol,
+                               std::vector<float>& output_val,
+                               std::vector<float>& output_vbe,
+                               const int batch_size) {
+    const auto& arch = net.arch;
+    const auto planes_size = batch_size * arch.channels * BOARD_SQUARES;
+    thread_local auto conv_out = std::vector<float>();
+    thread_local auto conv_in = std::vector<float>();
+    thread_local auto res = std::vector<float>();
+    conv_out.resize(planes_size);
+    conv_in.resize(planes_size);
+    res.resize(planes_size);
 
-    winograd_convolve3(arch.channels, input, conv_weights[0], V, M, conv_out);
+    // Input convolution
+    convolve3_int8(arch.input_planes, arch.channels, input,
+                   net.conv_weights_int8[0], net.conv_scales_int8[0], conv_out,
+                   batch_size);
     batchnorm<BOARD_SQUARES>(arch.channels, conv_out,
-                             batchnorm_means[0].data(),
-                             batchnorm_stddivs[0].data());
+                             net.batchnorm_means[0].data(),
+                             net.batchnorm_stddivs[0].data());
 
     // Residual tower
-    auto conv_in = std::vector<float>(arch.channels * width * height);
-    auto res = std::vector<float>(arch.channels * width * height);
-    for (auto i = size_t{1}; i < conv_weights.size(); i += 2) {
-        auto output_channels = conv_biases[i].size();
+    for (auto i = size_t{1}; i < net.conv_weights_int8.size(); i += 2) {
+        auto output_channels = net.conv_biases[i].size();
         std::swap(conv_out, conv_in);
-        winograd_convolve3(output_channels, conv_in,
-                           conv_weights[i], V, M, conv_out);
+        convolve3_int8(arch.channels, output_channels, conv_in,
+                       net.conv_weights_int8[i], net.conv_scales_int8[i],
+                       conv_out, batch_size);
         batchnorm<BOARD_SQUARES>(output_channels, conv_out,
-                                 batchnorm_means[i].data(),
-                                 batchnorm_stddivs[i].data());
+                                 net.batchnorm_means[i].data(),
+                                 net.batchnorm_stddivs[i].data());
 
-        output_channels = conv_biases[i + 1].size();
+        output_channels = net.conv_biases[i + 1].size();
         std::swap(conv_in, res);
         std::swap(conv_out, conv_in);
-        winograd_convolve3(output_channels, conv_in,
-                           conv_weights[i + 1], V, M, conv_out);
+        convolve3_int8(arch.channels, output_channels, conv_in,
+                       net.conv_weights_int8[i + 1],
+                       net.conv_scales_int8[i + 1], conv_out, batch_size);
         batchnorm<BOARD_SQUARES>(output_channels, conv_out,
-                                 batchnorm_means[i + 1].data(),
-                                 batchnorm_stddivs[i + 1].data(),
+                                 net.batchnorm_means[i + 1].data(),
+                                 net.batchnorm_stddivs[i + 1].data(),
                                  res.data());
     }
-    convolve<1>(arch.policy_outputs, conv_out, conv_pol_w, conv_pol_b, output_pol);
-    convolve<1>(arch.val_outputs, conv_out, conv_val_w, conv_val_b, output_val);
+    convolve<1>(arch.policy_outputs, conv_out, net.conv_pol_w, net.conv_pol_b,
+                output_pol, batch_size);
+    convolve<1>(arch.val_outputs, conv_out, net.conv_val_w, net.conv_val_b,
+                output_val, batch_size);
     if (arch.value_head_type == DOUBLE_V) {
-      convolve<1>(arch.vbe_outputs, conv_out, conv_vbe_w, conv_vbe_b, output_vbe);
+      convolve<1>(arch.vbe_outputs, conv_out, net.conv_vbe_w, net.conv_vbe_b,
+                  output_vbe, batch_size);
+    }
+}
+
+#ifndef USE_OPENCL
+void Network::forward_planes(const NetworkWeights& net,
+                             const std::vector<float>& input,
+                             std::vector<float>& output_pol,
+                             std::vector<float>& output_val,
+                             std::vector<float>& output_vbe,
+                             const int batch_size) {
+    PROFILE_SCOPE(COMPUTE);
+#ifdef USE_CUDA
+    if (net.cuda) {
+        net.cuda->forward(input, output_pol, output_val, output_vbe,
+                          batch_size);
+        return;
+    }
+#endif
+    if (net.use_int8) {
+        forward_cpu_int8(net, input, output_pol, output_val, output_vbe,
+                         batch_size);
+    } else {
+        forward_cpu(net, input, output_pol, output_val, output_vbe,
+                    batch_size);
     }
 }
+#endif
+
+#ifdef USE_CUDA
+void Network::initialize_cuda(NetworkWeights& net) {
+    const auto& arch = net.arch;
+    net.cuda = std::make_unique<CUDANetwork>(arch.input_planes,
+                                             arch.channels);
+    // The devices run plain 3x3 convolutions on the filters before the
+    // Winograd transform. The second convolution of every residual block
+    // adds the input of the block.
+    auto channels = static_cast<int>(arch.input_planes);
+    for (auto i = size_t{0}; i < net.conv_weights.size(); i++) {
+        const auto outputs = static_cast<int>(net.conv_biases[i].size());
+        net.cuda->push_convolve3(
+            channels, outputs,
+            winograd_untransform_f(net.conv_weights[i], outputs, channels),
+            net.batchnorm_means[i], net.batchnorm_stddivs[i],
+            i > 0 && i % 2 == 0);
+        channels = outputs;
+    }
+    net.cuda->push_head(arch.policy_outputs, net.conv_pol_w, net.conv_pol_b);
+    net.cuda->push_head(arch.val_outputs, net.conv_val_w, net.conv_val_b);
+    if (arch.value_head_type == DOUBLE_V) {
+        net.cuda->push_head(arch.vbe_outputs, net.conv_vbe_w,
+                            net.conv_vbe_b);
+    }
+    net.cuda->initialize(cfg_gpus, get_max_batch_size());
+
+    auto cuda = net.cuda.get();
+    const auto forward = [cuda](const std::vector<float>& input,
+                                std::vector<float>& output_pol,
+                                std::vector<float>& output_val,
+                                std::vector<float>& output_vbe,
+                                const int batch_size) {
+        cuda->forward(input, output_pol, output_val, output_vbe, batch_size);
+    };
+    if (check_against_cpu(net, forward)) {
+        myprintf("Running the network on CUDA.\n");
+        return;
+    }
+    // TF32 keeps 10 bits of the mantissa, retry with full precision.
+    net.cuda->set_tensor_math(false);
+    if (check_against_cpu(net, forward)) {
+        myprintf("TF32 outputs differ too much, running the network "
+                 "on CUDA in single precision.\n");
+        return;
+    }
+    myprintf("CUDA outputs differ too much from the CPU, "
+             "running the network on the CPU.\n");
+    net.cuda.reset();
+}
+#endif
+
+bool Network::check_against_cpu(const NetworkWeights& net,
+                                const forward_fn& forward) {
+    const auto& arch = net.arch;
+    constexpr auto batch_size = NUM_SYMMETRIES;
+    const auto in_size = arch.input_planes * BOARD_SQUARES;
+    const auto pol_size = arch.policy_outputs * BOARD_SQUARES;
+    const auto val_size = arch.val_outputs * BOARD_SQUARES;
+    const auto vbe_size = arch.vbe_outputs * BOARD_SQUARES;
+
+    // Don't use thread Rng so the check doesn't change the game.
+    auto rng = Random{0};
+    auto input = std::vector<float>(batch_size * in_size);
+    for (auto& in : input) {
+        in = float(rng.randuint64(2));
+    }
+
+    // The raw features of the heads have many values close to zero, so
+    // compare what comes out of the heads instead.
+    auto final_outputs = [&](const forward_fn& forward) {
+        auto pol = std::vector<float>(batch_size * pol_size);
+        auto val = std::vector<float>(batch_size * val_size);
+        auto vbe = std::vector<float>(batch_size * vbe_size);
+        forward(input, pol, val, vbe, batch_size);
+
+        auto out_pol = size_t{0};
+        auto out_val = size_t{0};
+        auto out_vbe = size_t{0};
+        get_output_sizes(net, out_pol, out_val, out_vbe);
+        auto policy = std::vector<float>(batch_size * out_pol);
+        auto value = std::vector<float>(batch_size * out_val);
+        auto beta = std::vector<float>(batch_size * out_vbe);
+        forward_heads(net, pol, val, vbe, policy, value, beta, batch_size);
+
+        auto outputs = policy;
+        outputs.insert(end(outputs), begin(value), end(value));
+        outputs.insert(end(outputs), begin(beta), end(beta));
+        return outputs;
+    };
+
+    return compare_net_outputs(
+        final_outputs(forward),
+        final_outputs([&net](const std::vector<float>& input,
+                             std::vector<float>& output_pol,
+                             std::vector<float>& output_val,
+                             std::vector<float>& output_vbe,
+                             const int batch_size) {
+            forward_cpu(net, input, output_pol, output_val, output_vbe,
+                        batch_size);
+        }), false);
+}
+
+#endif
 
 template<typename T>
 T relative_difference(const T a, const T b) {
@@ -988,14 +2490,18 @@ T relative_difference(const T a, const T b) {
     return fabs(fa - fb) / std::min(fa, fb);
 }
 
-void compare_net_outputs(std::vector<float>& data,
-                         std::vector<float>& ref) {
+bool Network::compare_net_outputs(const std::vector<float>& data,
+                                  const std::vector<float>& ref,
+                                  const bool fatal) {
     // We accept an error up to 5%, but output values
     // smaller than 1/1000th are "rounded up" for the comparison.
     constexpr auto relative_error = 5e-2f;
     for (auto idx = size_t{0}; idx < data.size(); ++idx) {
         const auto err = relative_difference(data[idx], ref[idx]);
         if (err > relative_error) {
+            if (!fatal) {
+                return false;
+            }
             printf("Error in OpenCL calculation: expected %f got %f "
                    "(error=%f%%)\n", ref[idx], data[idx], err * 100.0);
             printf("Update your GPU drivers or reduce the amount of games "
@@ -1003,34 +2509,102 @@ void compare_net_outputs(std::vector<float>& data,
             throw std::runtime_error("OpenCL self-check mismatch.");
         }
     }
+    return true;
 }
-#endif
-
-std::vector<float> softmax(const std::vector<float>& input,
-                           const float temperature = 1.0f) {
-    auto output = std::vector<float>{};
-    output.reserve(input.size());
 
+void softmax(const std::vector<float>& input, float* const output,
+             const float temperature = 1.0f) {
     const auto alpha = *std::max_element(cbegin(input), cend(input));
     auto denom = 0.0f;
 
-    for (const auto in_val : input) {
-        auto val = std::exp((in_val - alpha) / temperature);
+    for (auto i = size_t{0}; i < input.size(); i++) {
+        const auto val = std::exp((input[i] - alpha) / temperature);
         denom += val;
-        output.push_back(val);
+        output[i] = val;
     }
 
-    for (auto& out : output) {
-        out /= denom;
+    for (auto i = size_t{0}; i < input.size(); i++) {
+        output[i] /= denom;
     }
-
-    return output;
 }
 
 float sigmoid(float alpha, float beta, float bonus) {
   return 1.0f/(1.0f+std::exp(-beta*(alpha+bonus)));
 }
 
+// The key of the position in the NNCache. With cache symmetries the
+// entries are stored for the canonical orientation of the position,
+// sym_key maps this one onto it.
+static std::uint64_t get_cache_key(const NetworkWeights& net,
+                                   const GameState* const state,
+                                   int& sym_key) {
+    sym_key = 0;
+    return (cfg_cache_symmetries
+            ? state->get_canonical_hash(sym_key)
+            : state->board.get_hash()) ^ net.cache_key;
+}
+
+// Moves a policy in the orientation sym_key maps onto back to the one
+// of the position, and the other way.
+static void from_canonical(const int sym_key, Network::Netresult& result) {
+    if (sym_key != 0) {
+        const auto canonical = result.policy;
+        for (auto idx = size_t{0}; idx < BOARD_SQUARES; idx++) {
+            const auto sym_idx = symmetry_nn_idx_table[sym_key][idx];
+            result.policy[idx] = canonical[sym_idx];
+        }
+    }
+}
+
+static Network::Netresult to_canonical(const int sym_key,
+                                       const Network::Netresult& result) {
+    auto canonical = result;
+    for (auto idx = size_t{0}; idx < BOARD_SQUARES; idx++) {
+        const auto sym_idx = symmetry_nn_idx_table[sym_key][idx];
+        canonical.policy[sym_idx] = result.policy[idx];
+    }
+    return canonical;
+}
+
+static bool lookup_cache(const std::uint64_t hash, const int sym_key,
+                         Network::Netresult& result) {
+    if (!NNCache::get_NNCache().lookup(hash, result)) {
+        return false;
+    }
+    from_canonical(sym_key, result);
+    return true;
+}
+
+static void insert_cache(const std::uint64_t hash, const int sym_key,
+                         const Network::Netresult& result,
+                         const bool speculative = false) {
+    if (sym_key != 0) {
+        NNCache::get_NNCache().insert(hash, to_canonical(sym_key, result),
+                                      speculative);
+    } else {
+        NNCache::get_NNCache().insert(hash, result, speculative);
+    }
+}
+
+// The --opening-cache comes before the NNCache, its positions are always
+// stored in the canonical orientation.
+static bool lookup_opening(const NetworkWeights& net,
+                           const GameState* const state,
+                           Network::Netresult& result) {
+    const auto& openings = OpeningCache::get_OpeningCache();
+    if (!openings.covers(net.cache_key, state->get_movenum())) {
+        return false;
+    }
+    auto sym_key = 0;
+    const auto hash = state->get_canonical_hash(sym_key);
+    if (!openings.lookup(hash, result)) {
+        return false;
+    }
+    from_canonical(sym_key, result);
+    Metrics::add(Metrics::OPENING_CACHE_HITS, 1);
+    return true;
+}
+
 Network::Netresult Network::get_scored_moves(
     const GameState* const state, const Ensemble ensemble,
     const int symmetry, const bool skip_cache) {
@@ -1039,151 +2613,378 @@ Network::Netresult Network::get_scored_moves(
         return result;
     }
 
+    // Keeps the network alive even if another one is loaded meanwhile.
+    wait_for_networks();
+    const auto net = std::atomic_load(&current_network);
+    auto sym_key = 0;
+    const auto hash = get_cache_key(*net, state, sym_key);
+
     if (!skip_cache) {
         // See if we already have this in the cache.
-        if (NNCache::get_NNCache().lookup(state->board.get_hash(), result)) {
+        if (lookup_opening(*net, state, result)
+            || lookup_cache(hash, sym_key, result)) {
             return result;
         }
     }
 
     if (ensemble == DIRECT) {
         assert(symmetry >= 0 && symmetry <= 7);
-        result = get_scored_moves_internal(state, symmetry);
+        result = get_scored_moves_internal(*net, state, symmetry);
     } else if (ensemble == AVERAGE) {
-        for (auto sym = 0; sym < 8; ++sym) {
-            auto tmpresult = get_scored_moves_internal(state, sym);
-            result.policy_pass += tmpresult.policy_pass / 8.0f;
+        // All the symmetries go through the network as a single batch.
+        auto symmetries = std::vector<int>(NUM_SYMMETRIES);
+        std::iota(begin(symmetries), end(symmetries), 0);
+        const auto tmpresults = get_scored_moves_batch(
+            *net, std::vector<const GameState*>(NUM_SYMMETRIES, state),
+            symmetries);
+
+        result.value = 0.0f;
+        for (const auto& tmpresult : tmpresults) {
+            result.policy_pass += tmpresult.policy_pass / NUM_SYMMETRIES;
+            result.value += tmpresult.value / NUM_SYMMETRIES;
+            result.alpha += tmpresult.alpha / NUM_SYMMETRIES;
+            result.beta += tmpresult.beta / NUM_SYMMETRIES;
 
             for (auto idx = size_t{0}; idx < BOARD_SQUARES; idx++) {
-                result.policy[idx] += tmpresult.policy[idx] / 8.0f;
+                result.policy[idx] += tmpresult.policy[idx] / NUM_SYMMETRIES;
             }
         }
     } else {
         assert(ensemble == RANDOM_SYMMETRY);
         assert(symmetry == -1);
-        const auto rand_sym = Random::get_Rng().randfix<8>();
-        result = get_scored_moves_internal(state, rand_sym);
+        const auto rand_sym = Random::get_Rng().randfix<NUM_SYMMETRIES>();
+        result = get_scored_moves_internal(*net, state, rand_sym);
     }
 
     // Insert result into cache.
-    NNCache::get_NNCache().insert(state->board.get_hash(), result);
+    insert_cache(hash, sym_key, result);
 
     return result;
 }
 
-Network::Netresult Network::get_scored_moves_internal(
-    const GameState* const state, const int symmetry) {
-    assert(symmetry >= 0 && symmetry <= 7);
-    constexpr auto width = BOARD_SIZE;
-    constexpr auto height = BOARD_SIZE;
+std::vector<Network::Netresult> Network::get_scored_moves(
+    const std::vector<const GameState*>& states,
+    const std::vector<const GameState*>& speculative) {
+    auto results = std::vector<Netresult>(states.size());
+
+    wait_for_networks();
+    const auto net = std::atomic_load(&current_network);
+    auto hashes = std::vector<std::uint64_t>(states.size());
+    auto sym_keys = std::vector<int>(states.size());
+    // The positions that are not in the cache, and where they go.
+    auto misses = std::vector<const GameState*>();
+    auto miss_index = std::vector<size_t>();
+    for (auto i = size_t{0}; i < states.size(); i++) {
+        if (states[i]->board.get_boardsize() != BOARD_SIZE) {
+            continue;
+        }
+        hashes[i] = get_cache_key(*net, states[i], sym_keys[i]);
+        if (!lookup_opening(*net, states[i], results[i])
+            && !lookup_cache(hashes[i], sym_keys[i], results[i])) {
+            misses.emplace_back(states[i]);
+            miss_index.emplace_back(i);
+        }
+    }
+    if (misses.empty()) {
+        return results;
+    }
+    const auto evals = misses.size();
+    for (const auto state : speculative) {
+        auto sym_key = 0;
+        const auto hash = get_cache_key(*net, state, sym_key);
+        if (state->board.get_boardsize() == BOARD_SIZE
+            && !NNCache::get_NNCache().contains(hash)) {
+            misses.emplace_back(state);
+            hashes.emplace_back(hash);
+            sym_keys.emplace_back(sym_key);
+            miss_index.emplace_back(hashes.size() - 1);
+        }
+    }
 
-    const auto input_data = gather_features(state, symmetry);
-    std::vector<float> policy_data(arch.policy_outputs * width * height);
-    std::vector<float> val_data(arch.val_outputs * width * height);
-    std::vector<float> vbe_data(arch.vbe_outputs * width * height);
+    auto symmetries = std::vector<int>();
+    for (auto i = size_t{0}; i < misses.size(); i++) {
+        symmetries.emplace_back(Random::get_Rng().randfix<NUM_SYMMETRIES>());
+    }
+    auto evaluated = get_scored_moves_batch(*net, misses, symmetries);
+    for (auto i = size_t{0}; i < evals; i++) {
+        const auto index = miss_index[i];
+        insert_cache(hashes[index], sym_keys[index], evaluated[i]);
+        results[index] = std::move(evaluated[i]);
+    }
+    for (auto i = evals; i < misses.size(); i++) {
+        const auto index = miss_index[i];
+        insert_cache(hashes[index], sym_keys[index], evaluated[i], true);
+    }
+    Metrics::add(Metrics::SPECULATIVE_EVALS, misses.size() - evals);
+    return results;
+}
 
-#ifdef USE_HALF
-    std::vector<net_t> policy_data_n(arch.policy_outputs * width * height);
-    std::vector<net_t> val_data_n(arch.val_outputs * width * height);
-    std::vector<net_t> vbe_data_n(arch.vbe_outputs * width * height);
-#endif
+Network::Netresult Network::get_opening_scored_moves(
+    const GameState* const state, Netresult& canonical,
+    std::uint64_t& net_key) {
+    wait_for_networks();
+    const auto net = std::atomic_load(&current_network);
+    net_key = net->cache_key;
+    const auto result = get_scored_moves(state, AVERAGE, -1, true);
+    auto sym_key = 0;
+    state->get_canonical_hash(sym_key);
+    canonical = to_canonical(sym_key, result);
+    return result;
+}
 
+int Network::get_max_batch_size() {
+    return std::max({NUM_SYMMETRIES, cfg_leaf_batch, cfg_batch_size});
+}
 
+std::vector<Network::Netresult> Network::get_scored_moves_direct(
+    const std::vector<const GameState*>& states, const int symmetry) {
+    assert(symmetry >= 0 && symmetry < NUM_SYMMETRIES);
+    wait_for_networks();
+    const auto net = std::atomic_load(&current_network);
+    return get_scored_moves_batch(
+        *net, states, std::vector<int>(states.size(), symmetry));
+}
+
+Network::Netresult Network::get_scored_moves_internal(
+    NetworkWeights& net, const GameState* const state, const int symmetry) {
+    thread_local auto states = std::vector<const GameState*>(1);
+    thread_local auto symmetries = std::vector<int>(1);
+    thread_local auto results = std::vector<Netresult>();
+    states[0] = state;
+    symmetries[0] = symmetry;
+    get_scored_moves_batch(net, states, symmetries, results);
+    return results[0];
+}
+
+void Network::forward(NetworkWeights& net,
+                      const std::vector<net_t>& input,
+                      std::vector<float>& output_pol,
+                      std::vector<float>& output_val,
+                      std::vector<float>& output_vbe,
+                      const int batch_size) {
+    const auto start = std::chrono::steady_clock::now();
+    // Single positions are batched by the scheduler.
+    if (cfg_batch_size == 1 || batch_size > 1) {
+        Metrics::observe(Metrics::NN_BATCH_SIZE, batch_size);
+    }
+    if (net.daemon) {
+        // The daemon batches the positions of all its clients.
+        net.daemon->forward(input, output_pol, output_val, output_vbe,
+                            batch_size);
+        Metrics::add(Metrics::NN_EVALS, batch_size);
+        return;
+    }
 #ifdef USE_OPENCL
-#ifdef USE_HALF
-    opencl.forward(input_data, policy_data_n, val_data_n, vbe_data_n);
-    std::copy(begin(policy_data_n), end(policy_data_n), begin(policy_data));
-    std::copy(begin(val_data_n), end(val_data_n), begin(val_data));
-    std::copy(begin(vbe_data_n), end(vbe_data_n), begin(vbe_data));
-#else
-    opencl.forward(input_data, policy_data, val_data, vbe_data);
-#endif
+    // The heads run on the device as well.
+    net.opencl.forward(input, output_pol, output_val, output_vbe, batch_size);
 
 #elif defined(USE_BLAS) && !defined(USE_OPENCL)
-    forward_cpu(input_data, policy_data, val_data, vbe_data);
+    // Every thread keeps its features, they only grow for larger batches
+    // or networks.
+    thread_local auto input_pol = std::vector<float>();
+    thread_local auto input_val = std::vector<float>();
+    thread_local auto input_vbe = std::vector<float>();
+    input_pol.resize(batch_size * net.arch.policy_outputs * BOARD_SQUARES);
+    input_val.resize(batch_size * net.arch.val_outputs * BOARD_SQUARES);
+    input_vbe.resize(batch_size * net.arch.vbe_outputs * BOARD_SQUARES);
+    if (cfg_batch_size > 1 && batch_size == 1) {
+        net.cpu_scheduler.forward(input, input_pol, input_val, input_vbe);
+    } else {
+        forward_planes(net, input, input_pol, input_val, input_vbe,
+                       batch_size);
+    }
+    forward_heads(net, input_pol, input_val, input_vbe,
+                  output_pol, output_val, output_vbe, batch_size);
 #endif
+    Metrics::add(Metrics::NN_EVALS, batch_size);
+    Metrics::observe(Metrics::NN_LATENCY,
+                     std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::steady_clock::now() - start).count());
 #ifdef USE_OPENCL_SELFCHECK
     // Both implementations are available, self-check the OpenCL driver by
-    // running both with a probability of 1/2000.
-    if (Random::get_Rng().randfix<SELFCHECK_PROBABILITY>() == 0) {
-        auto cpu_policy_data = std::vector<float>(policy_data.size());
-        auto cpu_val_data = std::vector<float>(val_data.size());
-        auto cpu_vbe_data = std::vector<float>(vbe_data.size());
-        forward_cpu(input_data, cpu_policy_data, cpu_val_data, cpu_vbe_data);
-        compare_net_outputs(policy_data, cpu_policy_data);
-        compare_net_outputs(val_data, cpu_val_data);
-        compare_net_outputs(vbe_data, cpu_vbe_data);
+    // running both with a probability of 1/2000. The CPU side runs in the
+    // background. Half precision is not expected to match closely enough.
+    if (net.selfcheck.failed()) {
+        throw std::runtime_error("OpenCL self-check mismatch.");
+    }
+    if (!net.opencl.uses_half()
+        && Random::get_Rng().randfix<SELFCHECK_PROBABILITY>() == 0) {
+        net.selfcheck.submit(input, output_pol, output_val, output_vbe,
+                             batch_size);
     }
 #endif
-    // Get the moves
-    batchnorm<BOARD_SQUARES>(arch.policy_outputs, policy_data,
-        bn_pol_w1.data(), bn_pol_w2.data());
-
-    const auto policy_out =
-        innerproduct<false>(
-            policy_data, ip_pol_w, ip_pol_b);
-
-    const auto outputs = softmax(policy_out, cfg_softmax_temp);
-
-    // Get alpha or value
-    batchnorm<BOARD_SQUARES>(arch.val_outputs, val_data,
-        bn_val_w1.data(), bn_val_w2.data());
-    const auto val_channels =
-        innerproduct<true>(val_data, ip1_val_w, ip1_val_b);
-    const auto val_output =
-        innerproduct<false>(val_channels, ip2_val_w, ip2_val_b);
-
-    Netresult result;
-
-    if (arch.value_head_type==DOUBLE_V) {
-	// If double head value, also get beta
-	batchnorm<BOARD_SQUARES>(arch.vbe_outputs, vbe_data,
-				 bn_vbe_w1.data(), bn_vbe_w2.data());
-	const auto vbe_channels =
-	    innerproduct<true>(vbe_data, ip1_vbe_w, ip1_vbe_b);
-	const auto vbe_output =
-	    innerproduct<false>(vbe_channels, ip2_vbe_w, ip2_vbe_b);
+}
 
-	result.value = 0.5f;
-	result.alpha = val_output[0];
-	result.beta = std::exp(vbe_output[0]) * 10.0f / BOARD_SQUARES;
+std::vector<Network::Netresult> Network::get_scored_moves_batch(
+    NetworkWeights& net, const std::vector<const GameState*>& states,
+    const std::vector<int>& symmetries) {
+    auto results = std::vector<Netresult>();
+    get_scored_moves_batch(net, states, symmetries, results);
+    return results;
+}
 
-    } else if (arch.value_head_type==DOUBLE_Y) {
-	const auto vbe_channels =
-	    innerproduct<true>(val_data, ip1_vbe_w, ip1_vbe_b);
-	const auto vbe_output =
-	    innerproduct<false>(vbe_channels, ip2_vbe_w, ip2_vbe_b);
+void Network::get_scored_moves_batch(
+    NetworkWeights& net, const std::vector<const GameState*>& states,
+    const std::vector<int>& symmetries, std::vector<Netresult>& results) {
+    assert(states.size() == symmetries.size());
+    const auto batch_size = symmetries.size();
+
+    // The buffers of the thread only grow, so once they have room for
+    // the largest batch an evaluation doesn't allocate.
+    thread_local auto input_data = std::vector<net_t>();
+    thread_local auto batch_policy = std::vector<float>();
+    thread_local auto batch_val = std::vector<float>();
+    thread_local auto batch_vbe = std::vector<float>();
+
+    // Each state is gathered straight into its slot of the batch.
+    constexpr auto input_size = INPUT_CHANNELS * BOARD_SQUARES;
+    input_data.resize(batch_size * input_size);
+    {
+        PROFILE_SCOPE(GATHER);
+        for (auto n = size_t{0}; n < batch_size; n++) {
+            gather_features(states[n], symmetries[n],
+                            input_data.data() + n * input_size);
+        }
+    }
 
-	result.value = 0.5f;
-	result.alpha = val_output[0];
-	result.beta = std::exp(vbe_output[0]) * 10.0f / BOARD_SQUARES;
+    auto pol_size = size_t{0};
+    auto val_size = size_t{0};
+    auto vbe_size = size_t{0};
+    get_output_sizes(net, pol_size, val_size, vbe_size);
+    batch_policy.resize(batch_size * pol_size);
+    batch_val.resize(batch_size * val_size);
+    batch_vbe.resize(batch_size * vbe_size);
+
+    forward(net, input_data, batch_policy, batch_val, batch_vbe,
+            static_cast<int>(batch_size));
+
+    PROFILE_SCOPE(HEADS);
+    results.resize(batch_size);
+    for (auto n = size_t{0}; n < batch_size; n++) {
+        results[n] = get_heads_output(net,
+                                      &batch_policy[n * pol_size],
+                                      &batch_val[n * val_size],
+                                      batch_vbe.data() + n * vbe_size,
+                                      symmetries[n]);
+    }
+}
 
-    } else if (arch.value_head_type==DOUBLE_T) {
-	const auto vbe_output =
-	    innerproduct<false>(val_channels, ip2_vbe_w, ip2_vbe_b);
+void Network::get_output_sizes(const NetworkWeights& net,
+                               size_t& output_pol, size_t& output_val,
+                               size_t& output_vbe) {
+    if (net.daemon) {
+        const auto& info = net.daemon->get_info();
+        output_pol = info.pol_size;
+        output_val = info.val_size;
+        output_vbe = info.vbe_size;
+        return;
+    }
+    output_pol = net.ip_pol_b.size();
+    output_val = net.ip2_val_b.size();
+    output_vbe = net.ip2_vbe_b.size();
+}
 
-	result.value = 0.5f;
-	result.alpha = val_output[0];
-	result.beta = std::exp(vbe_output[0]) * 10.0f / BOARD_SQUARES;
+#ifdef USE_BLAS
+void Network::forward_heads(const NetworkWeights& net,
+                            const std::vector<float>& input_pol,
+                            const std::vector<float>& input_val,
+                            const std::vector<float>& input_vbe,
+                            std::vector<float>& output_pol,
+                            std::vector<float>& output_val,
+                            std::vector<float>& output_vbe,
+                            const int batch_size) {
+    PROFILE_SCOPE(HEADS);
+    const auto& arch = net.arch;
+    const auto pol_size = arch.policy_outputs * BOARD_SQUARES;
+    const auto val_size = arch.val_outputs * BOARD_SQUARES;
+    const auto vbe_size = arch.vbe_outputs * BOARD_SQUARES;
+
+    // Scratch space of the thread, sized by the first evaluation.
+    thread_local auto policy_data = std::vector<float>();
+    thread_local auto policy_out = std::vector<float>();
+    thread_local auto val_data = std::vector<float>();
+    thread_local auto val_channels = std::vector<float>();
+    thread_local auto val_output = std::vector<float>();
+    thread_local auto vbe_data = std::vector<float>();
+    thread_local auto vbe_channels = std::vector<float>();
+    thread_local auto vbe_output = std::vector<float>();
+
+    for (auto n = 0; n < batch_size; n++) {
+        // Get the moves
+        policy_data.assign(begin(input_pol) + n * pol_size,
+                           begin(input_pol) + (n + 1) * pol_size);
+        batchnorm<BOARD_SQUARES>(arch.policy_outputs, policy_data,
+            net.bn_pol_w1.data(), net.bn_pol_w2.data());
+        innerproduct<false>(policy_data, net.ip_pol_w, net.ip_pol_b,
+                            policy_out);
+        softmax(policy_out, output_pol.data() + n * policy_out.size(),
+                cfg_softmax_temp);
+
+        // Get alpha or value
+        val_data.assign(begin(input_val) + n * val_size,
+                        begin(input_val) + (n + 1) * val_size);
+        batchnorm<BOARD_SQUARES>(arch.val_outputs, val_data,
+            net.bn_val_w1.data(), net.bn_val_w2.data());
+        innerproduct<true>(val_data, net.ip1_val_w, net.ip1_val_b,
+                           val_channels);
+        innerproduct<false>(val_channels, net.ip2_val_w, net.ip2_val_b,
+                            val_output);
+        std::copy(begin(val_output), end(val_output),
+                  begin(output_val) + n * val_output.size());
+
+        // If double head value, also get beta
+        vbe_output.clear();
+        if (arch.value_head_type == DOUBLE_V) {
+            vbe_data.assign(begin(input_vbe) + n * vbe_size,
+                            begin(input_vbe) + (n + 1) * vbe_size);
+            batchnorm<BOARD_SQUARES>(arch.vbe_outputs, vbe_data,
+                                     net.bn_vbe_w1.data(),
+                                     net.bn_vbe_w2.data());
+            innerproduct<true>(vbe_data, net.ip1_vbe_w, net.ip1_vbe_b,
+                               vbe_channels);
+            innerproduct<false>(vbe_channels, net.ip2_vbe_w, net.ip2_vbe_b,
+                                vbe_output);
+        } else if (arch.value_head_type == DOUBLE_Y) {
+            innerproduct<true>(val_data, net.ip1_vbe_w, net.ip1_vbe_b,
+                               vbe_channels);
+            innerproduct<false>(vbe_channels, net.ip2_vbe_w, net.ip2_vbe_b,
+                                vbe_output);
+        } else if (arch.value_head_type == DOUBLE_T) {
+            innerproduct<false>(val_channels, net.ip2_vbe_w, net.ip2_vbe_b,
+                                vbe_output);
+        }
+        std::copy(begin(vbe_output), end(vbe_output),
+                  begin(output_vbe) + n * vbe_output.size());
+    }
+}
+#endif
 
-    } else if (arch.value_head_type==DOUBLE_I) {
-	result.value = 0.5f;
-	result.alpha = val_output[0];
-	result.beta = std::exp(val_output[1]) * 10.0f / BOARD_SQUARES;
+Network::Netresult Network::get_heads_output(const NetworkWeights& net,
+                                             const float* const policy,
+                                             const float* const val_output,
+                                             const float* const vbe_output,
+                                             const int symmetry) {
+    Netresult result;
 
-    } else if (arch.value_head_type==SINGLE) {
-	result.value = (1.0f + std::tanh(val_output[0])) / 2.0f;
-	result.alpha = 0.0f;
-	result.beta = 1.0f;
+    if (net.arch.value_head_type == SINGLE) {
+        result.value = (1.0f + std::tanh(val_output[0])) / 2.0f;
+        result.alpha = 0.0f;
+        result.beta = 1.0f;
+    } else {
+        // DOUBLE_I has beta as the second output of the value head
+        const auto beta = net.arch.value_head_type == DOUBLE_I
+                          ? val_output[1] : vbe_output[0];
+        result.value = 0.5f;
+        result.alpha = val_output[0];
+        result.beta = std::exp(beta) * 10.0f / BOARD_SQUARES;
     }
 
-
     for (auto idx = size_t{0}; idx < BOARD_SQUARES; idx++) {
         const auto sym_idx = symmetry_nn_idx_table[symmetry][idx];
-        result.policy[sym_idx] = outputs[idx];
+        result.policy[sym_idx] = policy[idx];
     }
 
-    result.policy_pass = outputs[BOARD_SQUARES];
+    result.policy_pass = policy[BOARD_SQUARES];
 
     return result;
 }
@@ -1263,54 +3064,62 @@ void Network::show_heatmap(const FastState* const state,
     }
 }
 
-void Network::fill_input_plane_pair(const FullBoard& board,
-                                    std::vector<net_t>::iterator black,
-                                    std::vector<net_t>::iterator white,
+void Network::fill_input_plane_pair(const FastBoard::stones_t& stones,
+                                    net_t* black, net_t* white,
                                     const int symmetry) {
     for (auto idx = 0; idx < BOARD_SQUARES; idx++) {
         const auto sym_idx = symmetry_nn_idx_table[symmetry][idx];
-        const auto x = sym_idx % BOARD_SIZE;
-        const auto y = sym_idx / BOARD_SIZE;
-        const auto color = board.get_square(x, y);
-        if (color == FastBoard::BLACK) {
-            black[idx] = net_t(true);
-        } else if (color == FastBoard::WHITE) {
-            white[idx] = net_t(true);
-        }
+        black[idx] = net_t(stones[FastBoard::BLACK][sym_idx]);
+        white[idx] = net_t(stones[FastBoard::WHITE][sym_idx]);
     }
 }
 
 std::vector<net_t> Network::gather_features(const GameState* const state,
                                             const int symmetry) {
+    auto input_data = std::vector<net_t>(INPUT_CHANNELS * BOARD_SQUARES);
+    gather_features(state, symmetry, input_data.data());
+    return input_data;
+}
+
+void Network::gather_features(const GameState* const state,
+                              const int symmetry, net_t* input_data) {
     assert(symmetry >= 0 && symmetry <= 7);
-    auto input_data = std::vector<net_t>(arch.input_planes * BOARD_SQUARES);
+    static_assert(INPUT_MOVES <= GameState::PLAYOUT_BOARDS,
+                  "Playouts keep too few boards for the network.");
 
     const auto to_move = state->get_to_move();
     const auto blacks_move = to_move == FastBoard::BLACK;
 
     const auto black_it = blacks_move ?
-                          begin(input_data) :
-                          begin(input_data) + INPUT_MOVES * BOARD_SQUARES;
+                          input_data :
+                          input_data + INPUT_MOVES * BOARD_SQUARES;
     const auto white_it = blacks_move ?
-                          begin(input_data) + INPUT_MOVES * BOARD_SQUARES :
-                          begin(input_data);
+                          input_data + INPUT_MOVES * BOARD_SQUARES :
+                          input_data;
     const auto to_move_it = blacks_move ?
-        begin(input_data) + 2 * INPUT_MOVES * BOARD_SQUARES :
-        begin(input_data) + (2 * INPUT_MOVES + 1) * BOARD_SQUARES;
+        input_data + 2 * INPUT_MOVES * BOARD_SQUARES :
+        input_data + (2 * INPUT_MOVES + 1) * BOARD_SQUARES;
+    const auto other_it = blacks_move ?
+        input_data + (2 * INPUT_MOVES + 1) * BOARD_SQUARES :
+        input_data + 2 * INPUT_MOVES * BOARD_SQUARES;
 
     const auto moves = std::min<size_t>(state->get_movenum() + 1, INPUT_MOVES);
     // Go back in time, fill history boards
     for (auto h = size_t{0}; h < moves; h++) {
         // collect white, black occupation planes
-        fill_input_plane_pair(state->get_past_board(h),
+        fill_input_plane_pair(state->get_past_stones(h),
                               black_it + h * BOARD_SQUARES,
                               white_it + h * BOARD_SQUARES,
                               symmetry);
     }
+    // Before the start of the game
+    std::fill(black_it + moves * BOARD_SQUARES,
+              black_it + INPUT_MOVES * BOARD_SQUARES, net_t(false));
+    std::fill(white_it + moves * BOARD_SQUARES,
+              white_it + INPUT_MOVES * BOARD_SQUARES, net_t(false));
 
     std::fill(to_move_it, to_move_it + BOARD_SQUARES, net_t(true));
-
-    return input_data;
+    std::fill(other_it, other_it + BOARD_SQUARES, net_t(false));
 }
 
 int Network::get_nn_idx_symmetry(const int vertex, int symmetry) {
@@ -23,6 +23,9 @@
 #include "config.h"
 
 #include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <memory>
 #include <string>
 #include <utility>
@@ -42,7 +45,10 @@ static constexpr int DOUBLE_Y = 3;
 static constexpr int DOUBLE_T = 4;
 static constexpr int DOUBLE_I = 5;
 
-extern bool is_mult_komi_net;
+// Whether the network used by the search has alpha and beta. It is set
+// on the thread that loads the networks, which can run in the
+// background, and read by the search threads.
+extern std::atomic<bool> is_mult_komi_net;
 
 struct netarch {
   int value_head_type = SINGLE;
@@ -57,6 +63,23 @@ struct netarch {
   size_t value_head_rets = size_t{1};
 };
 
+// The weights of one loaded network, defined in Network.cpp
+struct NetworkWeights;
+
+// The Winograd transforms of the CPU backend for one number of channels,
+// see Network::get_winograd_kernels().
+struct WinogradKernels {
+    void (*transform_in)(const std::vector<float>& in,
+                         std::vector<float>& V,
+                         int C, int batch_size);
+    void (*transform_out)(const std::vector<float>& M,
+                          std::vector<float>& Y,
+                          int K,
+                          const float* means,
+                          const float* stddivs,
+                          const float* eltwise,
+                          int batch_size);
+};
 
 
 class Network {
@@ -68,7 +91,7 @@ public:
 
     struct Netresult {
         // 19x19 board positions
-        std::vector<float> policy;
+        std::array<float, BOARD_SQUARES> policy;
 
         // pass
         float policy_pass;
@@ -82,14 +105,37 @@ public:
         // sigmoid beta
         float beta;
 
-        Netresult() : policy(BOARD_SQUARES), policy_pass(0.0f), alpha(0.0f), beta(0.0f) {}
+        Netresult() : policy{}, policy_pass(0.0f), alpha(0.0f), beta(0.0f) {}
     };
 
     static Netresult get_scored_moves(const GameState* const state,
                                       const Ensemble ensemble,
                                       const int symmetry = -1,
                                       const bool skip_cache = false);
+    // RANDOM_SYMMETRY evaluations of several positions. The ones that
+    // are not in the cache go through the network as a single batch.
+    // The speculative positions that are not in the cache either join
+    // that batch, if there is one, and only go into the cache.
+    static std::vector<Netresult> get_scored_moves(
+        const std::vector<const GameState*>& states,
+        const std::vector<const GameState*>& speculative = {});
+    // DIRECT evaluations of several positions in one symmetry, as a
+    // single batch and without the cache.
+    static std::vector<Netresult> get_scored_moves_direct(
+        const std::vector<const GameState*>& states, const int symmetry);
+    // The AVERAGE evaluation of state without the caches, for the
+    // OpeningCache. canonical gets it in the orientation of the
+    // canonical hash of state, and net_key the key of the network.
+    static Netresult get_opening_scored_moves(const GameState* const state,
+                                              Netresult& canonical,
+                                              std::uint64_t& net_key);
+    // The largest batch that the backends take at once.
+    static int get_max_batch_size();
 
+    static constexpr auto NUM_SYMMETRIES = 8;
+    // Where the input of vertex comes from in symmetry, also for the
+    // training data in utils/ShuffleChunks.cpp.
+    static int get_nn_idx_symmetry(const int vertex, int symmetry);
     static constexpr auto INPUT_MOVES = 8;
     static constexpr auto INPUT_CHANNELS = 2 * INPUT_MOVES + 2;
   //static constexpr auto OUTPUTS_POLICY = 2;
@@ -100,7 +146,34 @@ public:
     static constexpr auto WINOGRAD_ALPHA = 4;
     static constexpr auto WINOGRAD_TILE = WINOGRAD_ALPHA * WINOGRAD_ALPHA;
 
-    static void initialize();
+    // With background the networks load on another thread, while the
+    // caller goes on. The functions that need them wait until they are
+    // ready.
+    static void initialize(const bool background = false);
+    // Replaces network number index with the one in filename, or adds
+    // it if index is the number of loaded networks. Evaluations already
+    // running finish on the old network. Returns false, and keeps the
+    // old network, if the file can't be loaded.
+    static bool load_weights(const std::string& filename,
+                             const size_t index = 0);
+    static size_t get_network_count();
+    // The devices that evaluate the network used by the search, and its
+    // residual blocks x channels, to key what was measured with them.
+    static std::string get_device_names();
+    static std::string get_net_size();
+    // The hash of the weights file of that network, which also keys its
+    // evaluations in the NNCache.
+    static std::uint64_t get_net_key();
+    // With several networks loaded each color plays with its own one,
+    // by default black with the first and white with the second.
+    static bool set_side_network(const int color, const size_t index);
+    // Makes the network of color the one used by the search. Returns
+    // true if that is another network than before.
+    static bool select_side(const int color);
+    // Serves the clients of --nn-client on the shared memory segment
+    // name with the network used by the search, see NNDaemon.h. Only
+    // returns, false, if the segment can't be set up.
+    static bool run_daemon(const std::string& name);
     static void benchmark(const GameState * const state,
                           const int iterations = 1600);
     static void show_heatmap(const FastState * const state,
@@ -109,45 +182,198 @@ public:
 
     static std::vector<net_t> gather_features(const GameState* const state,
                                               const int symmetry);
+    // Writes the INPUT_CHANNELS * BOARD_SQUARES inputs to input_data.
+    static void gather_features(const GameState* const state,
+                                const int symmetry, net_t* input_data);
+
+    // Print how full the evaluation batches were since the last call.
+    static void dump_batch_stats();
+
+    // Checks that two sets of network outputs agree within the self-check
+    // tolerance. On a mismatch this throws, or only returns false if fatal
+    // is not set.
+    static bool compare_net_outputs(const std::vector<float>& data,
+                                    const std::vector<float>& ref,
+                                    const bool fatal = true);
 private:
-    static int load_v1_network(std::istream& wtfile);
-    static int load_network_file(const std::string& filename);
+    // Times the Winograd transforms, see src/benchmarks.
+    friend class NetworkBenchmark;
+
+    // Reads the weights and sets up the backend. Returns nullptr if the
+    // file can't be loaded.
+    // Networks after the first share the devices of share.
+    static std::shared_ptr<NetworkWeights> load_network(
+        const std::string& filename, NetworkWeights* const share);
+    // A network that the NN daemon of the segment name evaluates.
+    // Returns nullptr if there is no such daemon.
+    static std::shared_ptr<NetworkWeights> attach_daemon(
+        const std::string& name);
+    static int load_v1_network(std::istream& wtfile, NetworkWeights& net);
+    // Binary weights written by utils/binweights.py. The batchnorm
+    // variances, the biases and the Winograd transform are already
+    // processed, so the weights are used as they are.
+    static int load_binary_network(const std::string& filename,
+                                   NetworkWeights& net);
+    static int load_network_file(const std::string& filename,
+                                 NetworkWeights& net);
     static void process_bn_var(std::vector<float>& weights,
                                const float epsilon = 1e-5f);
 
     static std::vector<float> winograd_transform_f(const std::vector<float>& f,
         const int outputs, const int channels);
+    // The 3x3 filters back from the output of winograd_transform_f().
+    static std::vector<float> winograd_untransform_f(
+        const std::vector<float>& U, const int outputs, const int channels);
     static std::vector<float> zeropad_U(const std::vector<float>& U,
         const int outputs, const int channels,
         const int outputs_pad, const int channels_pad);
+    // The Winograd functions work on batch_size positions stored back
+    // to back. The tiles of all the positions are stacked so that every
+    // sgemm call multiplies batch_size * WINOGRAD_P rows at once.
+    // Planes, tiles and transformed tiles all keep the channels innermost
+    // (batch, y, x, channel).
     static void winograd_transform_in(const std::vector<float>& in,
                                       std::vector<float>& V,
-                                      const int C);
+                                      const int C,
+                                      const int batch_size = 1);
+    // Also applies the batchnorm, the residual add if eltwise is set,
+    // and the ReLU.
     static void winograd_transform_out(const std::vector<float>& M,
                                        std::vector<float>& Y,
-                                       const int K);
-    static void winograd_convolve3(const int outputs,
+                                       const int K,
+                                       const float* const means,
+                                       const float* const stddivs,
+                                       const float* const eltwise = nullptr,
+                                       const int batch_size = 1);
+    // The transforms for C channels. The usual widths of the networks
+    // have versions with the channels fixed at compile time, so that the
+    // loops over them are unrolled, the others get the generic ones
+    // above. It is called once when the network is loaded.
+    static WinogradKernels get_winograd_kernels(const int C);
+    // transform_in of kernels must be for the input channels, and
+    // transform_out for the outputs.
+    static void winograd_convolve3(const WinogradKernels& kernels,
+                                   const int outputs,
                                    const std::vector<float>& input,
                                    const std::vector<float>& U,
                                    std::vector<float>& V,
                                    std::vector<float>& M,
-                                   std::vector<float>& output);
+                                   std::vector<float>& output,
+                                   const float* const means,
+                                   const float* const stddivs,
+                                   const float* const eltwise = nullptr,
+                                   const int batch_size = 1);
+    // The im2col filters of the same layer as U, [tap][channel][output].
+    static std::vector<float> im2col_weights_f(const std::vector<float>& U,
+                                               const int outputs,
+                                               const int channels);
+    // winograd_convolve3 as a single sgemm over the 3x3 neighbourhoods
+    // of all the points, with im2col weights. It does more multiplies, but
+    // has no transforms and doesn't pad the board to whole tiles.
+    static void im2col_convolve3(const int outputs,
+                                 const std::vector<float>& input,
+                                 const std::vector<float>& weights,
+                                 std::vector<float>& col,
+                                 std::vector<float>& output,
+                                 const float* const means,
+                                 const float* const stddivs,
+                                 const float* const eltwise = nullptr,
+                                 const int batch_size = 1);
+    // Times winograd_convolve3 and im2col_convolve3 on the input layer
+    // and on the residual tower, in batches of --batchsize, and has
+    // forward_cpu run every layer with the faster one.
+    static void select_convolutions(NetworkWeights& net);
     static void winograd_sgemm(const std::vector<float>& U,
                                const std::vector<float>& V,
-                               std::vector<float>& M, const int C, const int K);
-    static int get_nn_idx_symmetry(const int vertex, int symmetry);
-    static void fill_input_plane_pair(const FullBoard& board,
-                                      std::vector<net_t>::iterator black,
-                                      std::vector<net_t>::iterator white,
+                               std::vector<float>& M, const int C, const int K,
+                               const int batch_size = 1);
+    static void fill_input_plane_pair(const FastBoard::stones_t& stones,
+                                      net_t* black, net_t* white,
                                       const int symmetry);
-    static Netresult get_scored_moves_internal(const GameState* const state,
+    static Netresult get_scored_moves_internal(NetworkWeights& net,
+                                               const GameState* const state,
                                                const int symmetry);
+    // Evaluates every position in the symmetry next to it, as a single
+    // batch.
+    static std::vector<Netresult> get_scored_moves_batch(
+        NetworkWeights& net, const std::vector<const GameState*>& states,
+        const std::vector<int>& symmetries);
+    // The same into results, which keeps its capacity.
+    static void get_scored_moves_batch(
+        NetworkWeights& net, const std::vector<const GameState*>& states,
+        const std::vector<int>& symmetries, std::vector<Netresult>& results);
+    // Netresult of one position from the outputs of the heads.
+    static Netresult get_heads_output(const NetworkWeights& net,
+                                      const float* const policy,
+                                      const float* const val_output,
+                                      const float* const vbe_output,
+                                      const int symmetry);
+    // Values per position of the outputs of forward(): the move
+    // probabilities including pass, and the raw outputs of the value
+    // heads. output_vbe is 0 without a second value head output.
+    static void get_output_sizes(const NetworkWeights& net,
+                                 size_t& output_pol, size_t& output_val,
+                                 size_t& output_vbe);
+    static void forward(NetworkWeights& net,
+                        const std::vector<net_t>& input,
+                        std::vector<float>& output_pol,
+                        std::vector<float>& output_val,
+                        std::vector<float>& output_vbe,
+                        const int batch_size);
 #if defined(USE_BLAS)
-    static void forward_cpu(const std::vector<float>& input,
+    // Runs batch_size positions stored back to back in the input.
+    static void forward_cpu(const NetworkWeights& net,
+                            const std::vector<float>& input,
                             std::vector<float>& output_pol,
                             std::vector<float>& output_val,
-                            std::vector<float>& output_vbe);
+                            std::vector<float>& output_vbe,
+                            const int batch_size = 1);
 
+    // Same as forward_cpu, but the input and residual tower convolutions
+    // run on int8 weights and activations. The heads stay in float.
+    static void forward_cpu_int8(const NetworkWeights& net,
+                                 const std::vector<float>& input,
+                                 std::vector<float>& output_pol,
+                                 std::vector<float>& output_val,
+                                 std::vector<float>& output_vbe,
+                                 const int batch_size = 1);
+    // The fully connected part of the heads, from the head convolution
+    // planes of forward_cpu() to the outputs of forward().
+    static void forward_heads(const NetworkWeights& net,
+                              const std::vector<float>& input_pol,
+                              const std::vector<float>& input_val,
+                              const std::vector<float>& input_vbe,
+                              std::vector<float>& output_pol,
+                              std::vector<float>& output_val,
+                              std::vector<float>& output_vbe,
+                              const int batch_size = 1);
+    static void quantize_weights(NetworkWeights& net);
+#ifndef USE_OPENCL
+    // forward_cpu on the fastest path that was set up: CUDA, int8 or
+    // float.
+    static void forward_planes(const NetworkWeights& net,
+                               const std::vector<float>& input,
+                               std::vector<float>& output_pol,
+                               std::vector<float>& output_val,
+                               std::vector<float>& output_vbe,
+                               const int batch_size);
+#endif
+#ifdef USE_CUDA
+    // Pushes the tower and the head convolutions to the CUDA devices and
+    // checks them against forward_cpu. Leaves net.cuda empty if they
+    // don't agree, and throws std::runtime_error on device errors.
+    static void initialize_cuda(NetworkWeights& net);
+#endif
+    // Runs random positions through forward and forward_cpu and checks
+    // that they agree within the self-check tolerance. Used for the int8
+    // and the CUDA paths.
+    using forward_fn = std::function<void(const std::vector<float>& input,
+                                          std::vector<float>& output_pol,
+                                          std::vector<float>& output_val,
+                                          std::vector<float>& output_vbe,
+                                          int batch_size)>;
+    static bool check_against_cpu(const NetworkWeights& net,
+                                  const forward_fn& forward);
 #endif
 };
 
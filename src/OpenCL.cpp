@@ -31,11 +31,13 @@
 #include <stdexcept>
 
 #include <cstdio>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <sstream>
 #include <string>
 
+#include "half/half.hpp"
 #include "Network.h"
 #include "GTP.h"
 #include "Utils.h"
@@ -43,10 +45,11 @@
 
 using namespace Utils;
 
+// Compiled programs of earlier runs, next to the tuning file.
+static const auto PROGRAM_CACHE_FILE = std::string("leelaz_opencl_binaries");
+static constexpr auto PROGRAM_CACHE_ENTRIES = size_t{8};
+
 static std::string cl_args =
-#ifdef USE_HALF
-    "-DUSE_HALF "
-#endif
     "-cl-mad-enable -cl-fast-relaxed-math -cl-no-signed-zeros -cl-denorms-are-zero";
 
 static std::string sourceCode_config = R"(
@@ -71,10 +74,11 @@ static std::string sourceCode_convolve1 = R"(
                    __global const net_t * restrict weights,
                    __local float * channel_buff,
                    __local float * row_buff) {
-        // cl::NDRange global(channels, outputs, row);
+        // cl::NDRange global(channels, outputs, batch * row);
         const int c   = get_global_id(0);  // channel
         const int o   = get_global_id(1);  // output
-        const int row = get_global_id(2);  // row
+        const int row = get_global_id(2) % BOARD_SIZE;  // row
+        const int batch = get_global_id(2) / BOARD_SIZE;
         const int channels = get_global_size(0);
         const int outputs  = get_global_size(1);
         // cl::NDRange local(2, (1->32), 1);
@@ -84,23 +88,25 @@ static std::string sourceCode_convolve1 = R"(
         const int out_buff_size  = get_local_size(1);
         const int row_buff_size  = 7;
         const int chan_shift     = 3;
-        // input = channels * height * width
-        // output = outputs * height * width
+        // input = batch * channels * height * width
+        // output = batch * outputs * height * width
         // weights = output * channels * filter
-        // merge = channels * outputs * height * width
+        // merge = batch * channels * outputs * height * width
         const int width = BOARD_SIZE;
         const int height = BOARD_SIZE;
         const int strip_size = width;
+        const int in_offset = batch * channels * height * width;
+        const int merge_offset = batch * (channels >> chan_shift) * height * width;
         // Copy the input channels (strips) locally
         if (out_buff_size < BOARD_SIZE && ly == 0) {
             // strip-row
             for (int w = 0; w < width; w++) {
                 channel_buff[lx * width + w] =
-                    vload_net_t((c * height + row) * width + w, in);
+                    vload_net_t(in_offset + (c * height + row) * width + w, in);
             }
         } else if (out_buff_size >= BOARD_SIZE && ly < BOARD_SIZE) {
             // Every thread copies a column
-            channel_buff[lx * width + ly] = vload_net_t((c * height + row) * width + ly, in);
+            channel_buff[lx * width + ly] = vload_net_t(in_offset + (c * height + row) * width + ly, in);
         }
         // Copy the filter we are applying locally
         __private float filter_buff = vload_net_t((o * channels + c), weights);
@@ -126,7 +132,7 @@ static std::string sourceCode_convolve1 = R"(
                     val += row_buff[(ly * chan_buff_size + 5) * row_buff_size + lx];
                     val += row_buff[(ly * chan_buff_size + 6) * row_buff_size + lx];
                     val += row_buff[(ly * chan_buff_size + 7) * row_buff_size + lx];
-                    vstore_net_t(val, (((c >> chan_shift) * height + row) * width + out_cw + lx) * outputs + o, merge);
+                    vstore_net_t(val, (merge_offset + ((c >> chan_shift) * height + row) * width + out_cw + lx) * outputs + o, merge);
                 }
                 out_cw  += row_buff_size;
                 out_lane = 0;
@@ -138,20 +144,19 @@ __kernel void merge(
                         __global const net_t * restrict in,
                         __global net_t * restrict out,
                         __private const int channels) {
-        // cl::NDRange global(outputs, BOARD_SQUARES);
+        // cl::NDRange global(outputs, batch * BOARD_SQUARES);
         const int gx = get_global_id(0);
         const int gy = get_global_id(1);
         const int output = gx;
-        const int b = gy;
+        const int b = gy % BOARD_SQUARES;
+        const int batch = gy / BOARD_SQUARES;
         const int outputs = get_global_size(0);
-        const int width = BOARD_SIZE;
-        const int height = BOARD_SIZE;
         const int o = output;
         float sum = 0;
         for (int c = 0; c < channels; c++) {
-            sum += vload_net_t((c * BOARD_SQUARES + b) * outputs + o, in);
+            sum += vload_net_t(((batch * channels + c) * BOARD_SQUARES + b) * outputs + o, in);
         }
-        vstore_net_t(sum, o * BOARD_SQUARES + b, out);
+        vstore_net_t(sum, (batch * outputs + o) * BOARD_SQUARES + b, out);
     }
 )";
 
@@ -196,7 +201,7 @@ void __in_transform_eq(float x[4][4], __global net_t * restrict V, int offset, i
 
 __kernel void in_transform(__global net_t * restrict in, __global net_t * restrict V,
                            const int C, const int Cpad,
-                           const int Ppad) {
+                           const int Ppad, const int batch_size) {
     const int W = BOARD_SIZE;
     const int H = BOARD_SIZE;
     const int T = W*H;
@@ -206,16 +211,19 @@ __kernel void in_transform(__global net_t * restrict in, __global net_t * restri
 
     const int block = get_global_id(0);
     const int ch = get_global_id(1);
-    const int chT = ch*(T);
 
-    const int block_x = block % WTILES;
-    const int block_y = block / WTILES;
+    // Tiles of all the positions in the batch are laid out back to back
+    const int batch = block / P;
+    const int chT = (batch * C + ch) * T;
+
+    const int block_x = (block - P * batch) % WTILES;
+    const int block_y = (block - P * batch) / WTILES;
 
     // Tiles overlap by 2
     const int yin = 2 * block_y - 1;
     const int xin = 2 * block_x - 1;
 
-    if (block < P && ch < C) {
+    if (block < batch_size * P && ch < C) {
         // Cache input tile and handle zero padding
         float x[4][4];
         for (int i = 0; i < 4; i++) {
@@ -236,12 +244,9 @@ __kernel void in_transform(__global net_t * restrict in, __global net_t * restri
 }
 
 void __out_transform_eq(__global const net_t * restrict M, float o[4],
-                        int Kpad, int Ppad, int block_x, int block_y)
+                        int Kpad, int Ppad, int block)
 {
-    const int W = BOARD_SIZE;
-    const int H = BOARD_SIZE;
-    const int WTILES = (W + 1) / 2;
-    const int b = block_y * WTILES + block_x;
+    const int b = block;
     const int KPpad = Kpad * Ppad;
     const int k = get_global_id(0);
     float temp_m[16];
@@ -272,7 +277,8 @@ __kernel void out_transform_fused_bn(__global const net_t * restrict M,
                                      const int Kpad, const int Ppad,
                                      __global const net_t * restrict residual,
                                      __constant const net_t * restrict means,
-                                     __constant const net_t * restrict stddivs) {
+                                     __constant const net_t * restrict stddivs,
+                                     const int batch_size) {
     const int W = BOARD_SIZE;
     const int H = BOARD_SIZE;
     const int WTILES = (W + 1) / 2;
@@ -281,16 +287,17 @@ __kernel void out_transform_fused_bn(__global const net_t * restrict M,
     int k = get_global_id(0);
     int block = get_global_id(1);
 
-    const int block_x = block % WTILES;
-    const int block_y = block / WTILES;
+    const int batch = block / P;
+    const int block_x = (block - P * batch) % WTILES;
+    const int block_y = (block - P * batch) / WTILES;
 
     int x = 2*block_x;
     int y = 2*block_y;
     int a_ind = (y)*W + (x);
-    if (k < K && block < P) {
-        const int kHW = k * W * H;
+    if (k < K && block < batch_size * P) {
+        const int kHW = (batch * K + k) * W * H;
         float o[4];
-        __out_transform_eq(M, o, Kpad, Ppad, block_x, block_y);
+        __out_transform_eq(M, o, Kpad, Ppad, block);
 
         const float mean = vload_net_t(k, means);
         const float scale_stddiv = vload_net_t(k, stddivs);
@@ -332,6 +339,7 @@ __kernel void out_transform_fused_bn_in(
     const int k = get_global_id(0);
     const int kg = get_local_id(0);
     const int block = get_global_id(1);
+    const int batch = get_global_id(2);
 
     const int block_x = block % WTILES;
     const int block_y = block / WTILES;
@@ -348,10 +356,10 @@ __kernel void out_transform_fused_bn_in(
     if (k < K && block < P) {
         const int a[4] = {a_ind, a_ind+1, a_ind+W, a_ind+W+1};
         const bool pred[4] = { 1, x+1 < W, y+1 < H, x+1 < W & y+1 < H};
-        const int kHW = k * W * H;
+        const int kHW = (batch * K + k) * W * H;
 
         float o[4];
-        __out_transform_eq(M, o, Kpad, Ppad, block_x, block_y);
+        __out_transform_eq(M, o, Kpad, Ppad, batch * P + block);
 
         const float mean = vload_net_t(k, means);
         const float scale_stddiv = vload_net_t(k, stddivs);
@@ -389,33 +397,195 @@ __kernel void out_transform_fused_bn_in(
             }
         }
 
-        const int offset = k*Ppad + block;
+        const int offset = k*Ppad + batch * P + block;
         __in_transform_eq(xx, V, offset, CPpad);
     }
 }
 )";
 
-#ifdef USE_HALF
-const std::string sourceCode_sgemm =
+static std::string sourceCode_input = R"(
+__kernel void expand_bits(
+                        __global const uint * restrict bits,
+                        __global net_t * restrict out,
+                        __private const int size) {
+        // cl::NDRange global(size);
+        const int i = get_global_id(0);
+        if (i < size) {
+            const float val = (bits[i >> 5] >> (i & 31)) & 1;
+            vstore_net_t(val, i, out);
+        }
+    }
+)";
+
+static std::string sourceCode_residual = R"(
+float __conv3_bn(__local const float * restrict in,
+                 __global const net_t * restrict filters,
+                 __global const net_t * restrict means,
+                 __global const net_t * restrict stddivs,
+                 const int channels, const int i) {
+    const int k = i / BOARD_SQUARES;
+    const int sq = i - k * BOARD_SQUARES;
+    const int y = sq / BOARD_SIZE;
+    const int x = sq - y * BOARD_SIZE;
+    float sum = 0.0f;
+    for (int c = 0; c < channels; c++) {
+        for (int ky = 0; ky < 3; ky++) {
+            const int iy = y + ky - 1;
+            if (iy < 0 || iy >= BOARD_SIZE) {
+                continue;
+            }
+            for (int kx = 0; kx < 3; kx++) {
+                const int ix = x + kx - 1;
+                if (ix < 0 || ix >= BOARD_SIZE) {
+                    continue;
+                }
+                sum += vload_net_t((k * channels + c) * 9 + ky * 3 + kx,
+                                   filters)
+                    * in[c * BOARD_SQUARES + iy * BOARD_SIZE + ix];
+            }
+        }
+    }
+    return vload_net_t(k, stddivs) * (sum - vload_net_t(k, means));
+}
+
+__kernel void residual_fused(
+                        __global net_t * restrict inout,
+                        __global const net_t * restrict filters1,
+                        __global const net_t * restrict means1,
+                        __global const net_t * restrict stddivs1,
+                        __global const net_t * restrict filters2,
+                        __global const net_t * restrict means2,
+                        __global const net_t * restrict stddivs2,
+                        __private const int channels,
+                        __local float * restrict x,
+                        __local float * restrict y) {
+        // cl::NDRange global(wgs * batch), local(wgs);
+        const int lid = get_local_id(0);
+        const int lsize = get_local_size(0);
+        const int size = channels * BOARD_SQUARES;
+        const int offset = get_group_id(0) * size;
+
+        for (int i = lid; i < size; i += lsize) {
+            x[i] = vload_net_t(offset + i, inout);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int i = lid; i < size; i += lsize) {
+            const float val = __conv3_bn(x, filters1, means1, stddivs1,
+                                         channels, i);
+            y[i] = val > 0.0f ? val : 0.0f;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int i = lid; i < size; i += lsize) {
+            const float val = __conv3_bn(y, filters2, means2, stddivs2,
+                                         channels, i) + x[i];
+            vstore_net_t(val > 0.0f ? val : 0.0f, offset + i, inout);
+        }
+    }
+)";
+
+static std::string sourceCode_heads = R"(
+__kernel void innerproduct(
+                        __global const net_t * restrict in,
+                        __global net_t * restrict out,
+                        __global const net_t * restrict weights,
+                        __global const net_t * restrict biases,
+                        __global const net_t * restrict means,
+                        __global const net_t * restrict stddivs,
+                        __private const int inputs,
+                        __private const int relu) {
+        // cl::NDRange global(outputs, batch);
+        const int o = get_global_id(0);
+        const int batch = get_global_id(1);
+        const int outputs = get_global_size(0);
+        float sum = 0.0f;
+        for (int i = 0; i < inputs; i++) {
+            float val = vload_net_t(batch * inputs + i, in);
+            if (means) {
+                // Batchnorm and ReLU of the convolution planes
+                const int c = i / BOARD_SQUARES;
+                val = vload_net_t(c, stddivs) * (val - vload_net_t(c, means));
+                val = val > 0.0f ? val : 0.0f;
+            }
+            sum += val * vload_net_t(o * inputs + i, weights);
+        }
+        sum += vload_net_t(o, biases);
+        if (relu) {
+            sum = sum > 0.0f ? sum : 0.0f;
+        }
+        vstore_net_t(sum, batch * outputs + o, out);
+    }
+
+__kernel void softmax(
+                        __global net_t * restrict data,
+                        __private const int size,
+                        __private const float temperature) {
+        // cl::NDRange global(batch);
+        const int offset = get_global_id(0) * size;
+        float alpha = vload_net_t(offset, data);
+        for (int i = 1; i < size; i++) {
+            alpha = max(alpha, vload_net_t(offset + i, data));
+        }
+        float denom = 0.0f;
+        for (int i = 0; i < size; i++) {
+            denom += exp((vload_net_t(offset + i, data) - alpha) / temperature);
+        }
+        for (int i = 0; i < size; i++) {
+            const float val =
+                exp((vload_net_t(offset + i, data) - alpha) / temperature);
+            vstore_net_t(val / denom, offset + i, data);
+        }
+    }
+)";
+
+const std::string sourceCode_sgemm_half =
     #include "clblast_level3_half/common.opencl"
     #include "clblast_level3_half/xgemm_part1.opencl"
     #include "clblast_level3_half/xgemm_part2.opencl"
     #include "clblast_level3_half/xgemm_part3.opencl"
     #include "clblast_level3_half/xgemm_batched.opencl"
 ;
-#else
-const std::string sourceCode_sgemm =
+
+const std::string sourceCode_sgemm_single =
     #include "clblast_level3/common.opencl"
     #include "clblast_level3/xgemm_part1.opencl"
     #include "clblast_level3/xgemm_part2.opencl"
     #include "clblast_level3/xgemm_part3.opencl"
     #include "clblast_level3/xgemm_batched.opencl"
 ;
-#endif
+
+// The host always works in single precision, the device stores the
+// network either in half or single precision.
+template <typename T>
+static void store_net_t(const float* in, const size_t size,
+                        std::vector<char>& out) {
+    out.resize(size * sizeof(T));
+    auto dst = reinterpret_cast<T*>(out.data());
+    for (auto i = size_t{0}; i < size; i++) {
+        dst[i] = T(in[i]);
+    }
+}
+
+template <typename T>
+static void load_net_t(const void* in, const size_t size, float* out) {
+    auto src = static_cast<const T*>(in);
+    for (auto i = size_t{0}; i < size; i++) {
+        out[i] = float(src[i]);
+    }
+}
 
 thread_local ThreadData opencl_thread_data;
+std::atomic<std::uint64_t> OpenCL::s_next_id{0};
+std::atomic<std::uint64_t> OpenCL_Network::s_next_id{0};
 
 void OpenCL::ensure_thread_initialized() {
+    // Threads can move on to another network, e.g. after new weights
+    // were loaded. They start over with the kernels and buffers of it.
+    if (opencl_thread_data.m_opencl_id != m_id) {
+        opencl_thread_data = ThreadData();
+        opencl_thread_data.m_opencl_id = m_id;
+    }
     if (!opencl_thread_data.m_is_initialized) {
         // Make kernels
         opencl_thread_data.m_convolve1_kernel =
@@ -430,12 +600,141 @@ void OpenCL::ensure_thread_initialized() {
             cl::Kernel(m_program, "out_transform_fused_bn");
         opencl_thread_data.m_out_transform_bn_in_kernel =
             cl::Kernel(m_program, "out_transform_fused_bn_in");
-        opencl_thread_data.m_commandqueue =
-            cl::CommandQueue(m_context, m_device);
+        opencl_thread_data.m_innerproduct_kernel =
+            cl::Kernel(m_program, "innerproduct");
+        opencl_thread_data.m_softmax_kernel =
+            cl::Kernel(m_program, "softmax");
+        opencl_thread_data.m_expand_bits_kernel =
+            cl::Kernel(m_program, "expand_bits");
+        opencl_thread_data.m_residual_fused_kernel =
+            cl::Kernel(m_program, "residual_fused");
         opencl_thread_data.m_is_initialized = true;
     }
 }
 
+bool SlotSizes::covers(const SlotSizes& other) const {
+    return in >= other.in && bits >= other.bits && vm >= other.vm
+        && std::equal(begin(head), end(head), begin(other.head),
+                      [](const size_t a, const size_t b) { return a >= b; });
+}
+
+PipelineSlot& OpenCL::acquire_slot(const SlotSizes& sizes,
+                                   const std::uint64_t network_id) {
+    std::lock_guard<std::mutex> lock(m_pool_mutex);
+    // A free slot that is large enough, else a free one to grow.
+    auto slot = static_cast<PipelineSlot*>(nullptr);
+    for (const auto& free_slot : m_slots) {
+        if (free_slot->m_in_use) {
+            continue;
+        }
+        if (free_slot->m_sizes.covers(sizes)) {
+            slot = free_slot.get();
+            break;
+        }
+        if (!slot) {
+            slot = free_slot.get();
+        }
+    }
+    if (!slot) {
+        m_slots.emplace_back(std::make_unique<PipelineSlot>());
+        slot = m_slots.back().get();
+        // Every slot gets its own queue, otherwise the upload of the
+        // next batch would be ordered after the kernels of this one.
+        slot->m_commandqueue = cl::CommandQueue(m_context, m_device);
+    }
+
+    if (!slot->m_sizes.covers(sizes)) {
+        auto grown = slot->m_sizes;
+        grown.in = std::max(grown.in, sizes.in);
+        grown.bits = std::max(grown.bits, sizes.bits);
+        grown.vm = std::max(grown.vm, sizes.vm);
+        for (auto i = 0; i < NUM_HEAD_BUFFERS; i++) {
+            grown.head[i] = std::max(grown.head[i], sizes.head[i]);
+        }
+        allocate_slot(*slot, grown);
+    } else if (slot->m_network_id != network_id) {
+        // The padding of V must be zero, and another network may have
+        // used it for values with its own layout.
+        const auto v_zeros = std::vector<char>(slot->m_sizes.vm);
+        slot->m_commandqueue.enqueueWriteBuffer(slot->m_VBuffer, CL_TRUE, 0,
+                                                v_zeros.size(),
+                                                v_zeros.data());
+    }
+    slot->m_network_id = network_id;
+    slot->m_in_use = true;
+    return *slot;
+}
+
+void OpenCL::release_slot(PipelineSlot& slot) {
+    std::lock_guard<std::mutex> lock(m_pool_mutex);
+    slot.m_in_use = false;
+}
+
+void OpenCL::allocate_slot(PipelineSlot& slot, const SlotSizes& sizes) {
+    auto v_zeros = std::vector<char>(sizes.vm);
+
+    slot.m_inBuffer = cl::Buffer(m_context, CL_MEM_READ_WRITE, sizes.in);
+    slot.m_inBuffer2 = cl::Buffer(m_context, CL_MEM_READ_WRITE, sizes.in);
+    slot.m_inBitsBuffer = cl::Buffer(
+        m_context,
+        m_unified_memory
+            ? CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR | CL_MEM_HOST_WRITE_ONLY
+            : CL_MEM_READ_ONLY,
+        sizes.bits);
+    slot.m_VBuffer = cl::Buffer(
+        m_context,
+        CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
+        sizes.vm, v_zeros.data(), nullptr);
+    slot.m_MBuffer = cl::Buffer(
+        m_context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, sizes.vm);
+
+    for (auto i = 0; i < NUM_HEAD_BUFFERS; i++) {
+        const auto buffer = static_cast<head_buffer_t>(i);
+        if (sizes.head[i] == 0) {
+            continue;
+        }
+        const auto is_output = buffer == HEAD_POL_OUT
+                               || buffer == HEAD_VAL_OUT
+                               || buffer == HEAD_VBE_OUT;
+        slot.m_head_buffers[i] = cl::Buffer(
+            m_context,
+            is_output ? CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR
+                      : CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS,
+            sizes.head[i]);
+    }
+    slot.m_sizes = sizes;
+}
+
+cl::Buffer OpenCL::acquire_weights(const std::uint64_t key,
+                                   const std::vector<char>& weights) {
+    std::lock_guard<std::mutex> lock(m_pool_mutex);
+    auto iter = m_weights.find(key);
+    if (iter == end(m_weights)) {
+        const auto buffer = cl::Buffer(m_context,
+                                       CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY,
+                                       weights.size(),
+                                       const_cast<char*>(weights.data()));
+        iter = m_weights.emplace(key, SharedWeights{buffer, 0}).first;
+    }
+    iter->second.users++;
+    return iter->second.buffer;
+}
+
+void OpenCL::release_weights(const std::uint64_t key) {
+    std::lock_guard<std::mutex> lock(m_pool_mutex);
+    const auto iter = m_weights.find(key);
+    assert(iter != end(m_weights));
+    if (--iter->second.users == 0) {
+        m_weights.erase(iter);
+    }
+}
+
+OpenCL_Network::~OpenCL_Network() {
+    for (const auto key : m_weight_keys) {
+        m_opencl.release_weights(key);
+    }
+}
+
 void OpenCL_Network::add_weights(size_t layer,
                                  size_t size,
                                  const float * weights) {
@@ -443,105 +742,107 @@ void OpenCL_Network::add_weights(size_t layer,
         m_layers.push_back(Layer());
     }
 
-    auto converted_weights = std::vector<net_t>();
-    for (auto i = size_t{0}; i < size; i++) {
-        converted_weights.emplace_back(weights[i]);
+    auto converted_weights = std::vector<char>();
+    to_net_t(weights, size, converted_weights);
+
+    // FNV-1a of the contents, with the size.
+    auto key = std::uint64_t{14695981039346656037ULL};
+    for (const auto c : converted_weights) {
+        key ^= static_cast<unsigned char>(c);
+        key *= 1099511628211ULL;
     }
+    key ^= converted_weights.size();
+    key *= 1099511628211ULL;
 
-    auto weightSize = size * sizeof(decltype(converted_weights)::value_type);
     m_layers.back().weights.emplace_back(
-        m_opencl.m_context,
-        CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY,
-        weightSize,
-        const_cast<net_t*>(converted_weights.data()));
+        m_opencl.acquire_weights(key, converted_weights));
+    m_weight_keys.emplace_back(key);
 }
 
-void OpenCL_Network::forward(const std::vector<net_t>& input,
-                             std::vector<net_t>& output_pol,
-                             std::vector<net_t>& output_val,
-                             std::vector<net_t>& output_vbe) {
-    const bool double_value_head = output_vbe.size();
+size_t OpenCL_Network::head_buffer_size(const head_buffer_t buffer) const {
+    auto size = size_t{0};
+    for (const auto& layer : m_layers) {
+        if ((layer.is_convolve1 || layer.is_innerproduct)
+            && layer.output_buffer == buffer) {
+            const auto values = layer.is_convolve1
+                ? layer.outputs * BOARD_SQUARES : layer.outputs;
+            size = std::max<size_t>(size, values);
+        }
+    }
+    return size;
+}
 
-    constexpr auto width = BOARD_SIZE;
-    constexpr auto height = BOARD_SIZE;
-    constexpr auto tiles = WINOGRAD_P;
-    constexpr auto one_plane = width * height * sizeof(net_t);
+void OpenCL_Network::get_io_sizes(size_t& input, size_t& output_pol,
+                                  size_t& output_val,
+                                  size_t& output_vbe) const {
+    input = m_layers.front().channels * BOARD_SQUARES;
+    output_pol = head_buffer_size(HEAD_POL_OUT);
+    output_val = head_buffer_size(HEAD_VAL_OUT);
+    output_vbe = head_buffer_size(HEAD_VBE_OUT);
+}
+
+size_t OpenCL_Network::net_t_size() const {
+    return m_opencl.m_use_half ? sizeof(half_float::half) : sizeof(float);
+}
 
-    auto pol_lnum = m_layers.size() - 2;
-    if (double_value_head) {
-      pol_lnum--;
+void OpenCL_Network::to_net_t(const float* in, const size_t size,
+                              std::vector<char>& out) const {
+    if (m_opencl.m_use_half) {
+        store_net_t<half_float::half>(in, size, out);
+    } else {
+        store_net_t<float>(in, size, out);
     }
+}
 
-    const auto finalSize_pol = m_layers[pol_lnum].outputs * one_plane;
-    const auto finalSize_val = m_layers[pol_lnum+1].outputs * one_plane;
-    auto finalSize_vbe = finalSize_val;
-    if (double_value_head) {
-        finalSize_vbe = m_layers.back().outputs * one_plane;
+void OpenCL_Network::from_net_t(const void* in, const size_t size,
+                                float* out) const {
+    if (m_opencl.m_use_half) {
+        load_net_t<half_float::half>(in, size, out);
+    } else {
+        load_net_t<float>(in, size, out);
     }
+}
 
-    m_opencl.ensure_thread_initialized();
+void OpenCL_Network::forward(const std::vector<float>& input,
+                             std::vector<float>& output_pol,
+                             std::vector<float>& output_val,
+                             std::vector<float>& output_vbe,
+                             const int batch_size) {
+    forward_async(input, batch_size, 0);
+    forward_wait(output_pol, output_val, output_vbe, 0);
+}
 
-    if (!opencl_thread_data.m_buffers_allocated) {
-        auto max_channels = unsigned{0};
-        for (const auto& layer : m_layers) {
-            max_channels = std::max(max_channels,
-                                    std::max(layer.channels, layer.outputs));
-        }
+void OpenCL_Network::forward_async(const std::vector<float>& input,
+                                   const int batch_size,
+                                   const size_t slot) {
+    assert(batch_size >= 1 && batch_size <= m_max_batch_size);
+
+    // Only the outputs of the heads are read back.
+    const auto finalSize_pol =
+        batch_size * head_buffer_size(HEAD_POL_OUT) * net_t_size();
+    const auto finalSize_val =
+        batch_size * head_buffer_size(HEAD_VAL_OUT) * net_t_size();
+    const auto finalSize_vbe =
+        batch_size * head_buffer_size(HEAD_VBE_OUT) * net_t_size();
+
+    m_opencl.ensure_thread_initialized();
+    auto& slots = opencl_thread_data.m_slots;
+    if (slots.size() <= slot) {
+        slots.resize(slot + 1, nullptr);
+    }
+    assert(!slots[slot]);
+    auto& data = m_opencl.acquire_slot(get_slot_sizes(), m_id);
+    slots[slot] = &data;
 
-        const auto mwg = m_opencl.m_sgemm_tuners.mwg;
-        const auto nwg = m_opencl.m_sgemm_tuners.nwg;
-        const auto vwm = m_opencl.m_sgemm_tuners.vwm;
-        const auto vwn = m_opencl.m_sgemm_tuners.vwn;
-
-        const auto m_ceil = ceilMultiple(ceilMultiple(max_channels, mwg), vwm);
-        const auto n_ceil = ceilMultiple(ceilMultiple(tiles, nwg), vwn);
-
-        const auto alloc_inSize =
-            m_ceil * m_ceil *  max_channels * sizeof(net_t);
-        const auto alloc_vm_size =
-            WINOGRAD_TILE * m_ceil * n_ceil * sizeof(net_t);
-
-        auto v_zeros = std::vector<net_t>(alloc_vm_size);
-
-        opencl_thread_data.m_inBuffer = cl::Buffer(
-            m_opencl.m_context,
-            CL_MEM_READ_WRITE, alloc_inSize);
-        opencl_thread_data.m_inBuffer2 = cl::Buffer(
-            m_opencl.m_context,
-            CL_MEM_READ_WRITE, alloc_inSize);
-        opencl_thread_data.m_VBuffer = cl::Buffer(
-            m_opencl.m_context,
-            CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
-            alloc_vm_size, v_zeros.data(), nullptr);
-        opencl_thread_data.m_MBuffer = cl::Buffer(
-            m_opencl.m_context,
-            CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, alloc_vm_size);
-
-        opencl_thread_data.m_pinnedOutBuffer_pol = cl::Buffer(
-            m_opencl.m_context,
-            CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, finalSize_pol);
-        opencl_thread_data.m_pinnedOutBuffer_val = cl::Buffer(
-            m_opencl.m_context,
-            CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, finalSize_val);
-	if (double_value_head) {
-	    opencl_thread_data.m_pinnedOutBuffer_vbe = cl::Buffer(
-	      m_opencl.m_context,
-              CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, finalSize_vbe);
-	}
-
-        opencl_thread_data.m_buffers_allocated = true;
-    }
-
-    cl::Buffer & inBuffer = opencl_thread_data.m_inBuffer;
-    cl::Buffer & inBuffer2 = opencl_thread_data.m_inBuffer2;
-    cl::Buffer & VBuffer = opencl_thread_data.m_VBuffer;
-    cl::Buffer & MBuffer = opencl_thread_data.m_MBuffer;
-    cl::CommandQueue & queue = opencl_thread_data.m_commandqueue;
-
-    const auto inSize = sizeof(net_t) * input.size();
-    queue.enqueueWriteBuffer(inBuffer, CL_FALSE, 0, inSize, input.data());
+    cl::Buffer & inBuffer = data.m_inBuffer;
+    cl::Buffer & inBuffer2 = data.m_inBuffer2;
+    cl::Buffer & VBuffer = data.m_VBuffer;
+    cl::Buffer & MBuffer = data.m_MBuffer;
+    cl::CommandQueue & queue = data.m_commandqueue;
 
+    upload_input(data, input);
 
+    const auto fused = use_residual_fused(batch_size);
     auto skip_in_trans = false;
     for (auto iter = cbegin(m_layers); iter != cend(m_layers); iter++) {
         const auto& layer = *iter;
@@ -552,10 +853,11 @@ void OpenCL_Network::forward(const std::vector<net_t>& input,
             auto conv_weights = begin(layer.weights);
             auto bn_weights = begin(layer.weights) + 1;
             auto skip_next_in_trans = false;
-            if (niter->is_residual_block) {
+            if (niter->is_residual_block && !fused) {
                 skip_next_in_trans = true;
             }
-            convolve3(layer.channels,
+            convolve3(queue,
+                     layer.channels,
                      layer.outputs,
                      inBuffer,
                      inBuffer,
@@ -564,8 +866,12 @@ void OpenCL_Network::forward(const std::vector<net_t>& input,
                      conv_weights,
                      nullptr,
                      bn_weights,
-                     skip_in_trans, skip_next_in_trans, true);
+                     skip_in_trans, skip_next_in_trans, true,
+                     batch_size);
             skip_in_trans = skip_next_in_trans;
+        } else if (layer.is_residual_block && fused) {
+            assert(layer.channels == layer.outputs);
+            residual_fused(queue, layer, inBuffer, batch_size);
         } else if (layer.is_residual_block) {
             assert(layer.channels == layer.outputs);
             assert(niter != cend(m_layers));
@@ -573,7 +879,8 @@ void OpenCL_Network::forward(const std::vector<net_t>& input,
             auto bn1_weights   = begin(layer.weights) + 1;
             auto conv2_weights = begin(layer.weights) + 3;
             auto bn2_weights   = begin(layer.weights) + 4;
-            convolve3(layer.channels,
+            convolve3(queue,
+                      layer.channels,
                       layer.outputs,
                       inBuffer,
                       inBuffer2,
@@ -582,13 +889,15 @@ void OpenCL_Network::forward(const std::vector<net_t>& input,
                       conv1_weights,
                       nullptr,
                       bn1_weights,
-                      skip_in_trans, true, false);
+                      skip_in_trans, true, false,
+                      batch_size);
 
             auto skip_next_in_trans = false;
             if (niter->is_residual_block) {
                 skip_next_in_trans = true;
             }
-            convolve3(layer.channels,
+            convolve3(queue,
+                      layer.channels,
                       layer.outputs,
                       inBuffer2,
                       inBuffer,
@@ -597,106 +906,147 @@ void OpenCL_Network::forward(const std::vector<net_t>& input,
                       conv2_weights,
                       &inBuffer,
                       bn2_weights,
-                      true, skip_next_in_trans, true);
+                      true, skip_next_in_trans, true,
+                      batch_size);
             skip_in_trans = skip_next_in_trans;
-        } else {
-            assert(layer.is_convolve1);
-
-            cl::Buffer out_buffer;
-	    if (double_value_head) {
-
-	      if (niter == cend(m_layers)) {
-                out_buffer = opencl_thread_data.m_pinnedOutBuffer_vbe;
-	      } else if (niter == cend(m_layers) - 1) {
-                out_buffer = opencl_thread_data.m_pinnedOutBuffer_val;
-	      } else {
-                out_buffer = opencl_thread_data.m_pinnedOutBuffer_pol;
-	      }
-	    }
-	    else {
-
-	      if (niter == cend(m_layers)) {
-                out_buffer = opencl_thread_data.m_pinnedOutBuffer_val;
-	      } else {
-                out_buffer = opencl_thread_data.m_pinnedOutBuffer_pol;
-	      }
-	    }
-
-
-            convolve1(layer.channels,
+        } else if (layer.is_convolve1) {
+            convolve1(queue,
+                    layer.channels,
                     layer.outputs,
                     inBuffer,
-                    out_buffer,
+                    data.m_head_buffers[layer.output_buffer],
                     VBuffer,
-                    begin(layer.weights));
+                    begin(layer.weights),
+                    batch_size);
+        } else if (layer.is_innerproduct) {
+            innerproduct(queue, layer,
+                         data.m_head_buffers[layer.input_buffer],
+                         data.m_head_buffers[layer.output_buffer],
+                         batch_size);
+        } else {
+            assert(layer.is_softmax);
+            softmax(queue, layer, data.m_head_buffers[layer.output_buffer],
+                    batch_size);
         }
     }
 
-    if (double_value_head) {
+    // The queue is in order, so the event of the last map also
+    // covers everything enqueued before it.
+    data.m_finalSize_pol = finalSize_pol;
+    data.m_finalSize_val = finalSize_val;
+    data.m_finalSize_vbe = finalSize_vbe;
+    data.m_pinnedOutBufferHost_vbe = nullptr;
 
-      auto pinnedOutBufferHost_pol = queue.enqueueMapBuffer(
-        opencl_thread_data.m_pinnedOutBuffer_pol, CL_FALSE,
+    data.m_pinnedOutBufferHost_pol = queue.enqueueMapBuffer(
+        data.m_head_buffers[HEAD_POL_OUT], CL_FALSE,
         CL_MAP_READ, 0, finalSize_pol);
-      auto pinnedOutBufferHost_val = queue.enqueueMapBuffer(
-        opencl_thread_data.m_pinnedOutBuffer_val, CL_FALSE,
-        CL_MAP_READ, 0, finalSize_val);
-      auto pinnedOutBufferHost_vbe = queue.enqueueMapBuffer(
-        opencl_thread_data.m_pinnedOutBuffer_vbe, CL_FALSE,
-        CL_MAP_READ, 0, finalSize_vbe);
-
-      {
-        // Finish call is usually a busy wait. When using multiple threads
-        // use the lock to avoid busy waiting with all threads.
-        std::lock_guard<std::mutex> lock(m_queue_finish_mutex);
-        queue.finish();
-      }
+    if (finalSize_vbe > 0) {
+        data.m_pinnedOutBufferHost_val = queue.enqueueMapBuffer(
+            data.m_head_buffers[HEAD_VAL_OUT], CL_FALSE,
+            CL_MAP_READ, 0, finalSize_val);
+        data.m_pinnedOutBufferHost_vbe = queue.enqueueMapBuffer(
+            data.m_head_buffers[HEAD_VBE_OUT], CL_FALSE,
+            CL_MAP_READ, 0, finalSize_vbe, nullptr, &data.m_done);
+    } else {
+        data.m_pinnedOutBufferHost_val = queue.enqueueMapBuffer(
+            data.m_head_buffers[HEAD_VAL_OUT], CL_FALSE,
+            CL_MAP_READ, 0, finalSize_val, nullptr, &data.m_done);
+    }
+    queue.flush();
+}
+
+SlotSizes OpenCL_Network::get_slot_sizes() const {
+    constexpr auto width = BOARD_SIZE;
+    constexpr auto height = BOARD_SIZE;
+    constexpr auto tiles = WINOGRAD_P;
 
-      std::memcpy(output_pol.data(), pinnedOutBufferHost_pol, finalSize_pol);
-      std::memcpy(output_val.data(), pinnedOutBufferHost_val, finalSize_val);
-      std::memcpy(output_vbe.data(), pinnedOutBufferHost_vbe, finalSize_vbe);
+    auto max_channels = unsigned{0};
+    for (const auto& layer : m_layers) {
+        if (layer.is_innerproduct || layer.is_softmax) {
+            continue;
+        }
+        max_channels = std::max(max_channels,
+                                std::max(layer.channels, layer.outputs));
+    }
 
-      queue.enqueueUnmapMemObject(opencl_thread_data.m_pinnedOutBuffer_pol,
-				  pinnedOutBufferHost_pol);
-      queue.enqueueUnmapMemObject(opencl_thread_data.m_pinnedOutBuffer_val,
-				  pinnedOutBufferHost_val);
-      queue.enqueueUnmapMemObject(opencl_thread_data.m_pinnedOutBuffer_vbe,
-				  pinnedOutBufferHost_vbe);
+    const auto mwg = m_opencl.m_sgemm_tuners.mwg;
+    const auto nwg = m_opencl.m_sgemm_tuners.nwg;
+    const auto vwm = m_opencl.m_sgemm_tuners.vwm;
+    const auto vwn = m_opencl.m_sgemm_tuners.vwn;
+
+    const auto m_ceil = ceilMultiple(ceilMultiple(max_channels, mwg), vwm);
+    const auto n_ceil = ceilMultiple(ceilMultiple(tiles * m_max_batch_size,
+                                                  nwg), vwn);
+
+    auto sizes = SlotSizes{};
+    sizes.in = std::max<size_t>(
+        m_ceil * m_ceil * max_channels,
+        m_max_batch_size * max_channels * width * height) * net_t_size();
+    sizes.bits =
+        (sizes.in / net_t_size() + 31) / 32 * sizeof(std::uint32_t);
+    sizes.vm = WINOGRAD_TILE * m_ceil * n_ceil * net_t_size();
+    // The head buffers must hold the largest batch.
+    for (auto i = 0; i < NUM_HEAD_BUFFERS; i++) {
+        sizes.head[i] = m_max_batch_size
+            * head_buffer_size(static_cast<head_buffer_t>(i)) * net_t_size();
     }
-    else {
+    return sizes;
+}
 
-      auto pinnedOutBufferHost_pol = queue.enqueueMapBuffer(
-        opencl_thread_data.m_pinnedOutBuffer_pol, CL_FALSE,
-        CL_MAP_READ, 0, finalSize_pol);
-      auto pinnedOutBufferHost_val = queue.enqueueMapBuffer(
-        opencl_thread_data.m_pinnedOutBuffer_val, CL_FALSE,
-        CL_MAP_READ, 0, finalSize_val);
-      //      auto pinnedOutBufferHost_vbe = queue.enqueueMapBuffer(
-      //        opencl_thread_data.m_pinnedOutBuffer_vbe, CL_FALSE,
-      //        CL_MAP_READ, 0, finalSize_vbe);
-
-      {
-        // Finish call is usually a busy wait. When using multiple threads
+void OpenCL_Network::forward_wait(std::vector<float>& output_pol,
+                                  std::vector<float>& output_val,
+                                  std::vector<float>& output_vbe,
+                                  const size_t slot) {
+    auto& data = *opencl_thread_data.m_slots[slot];
+    assert(data.m_in_use);
+    cl::CommandQueue & queue = data.m_commandqueue;
+
+    {
+        // Waiting is usually a busy wait. When using multiple threads
         // use the lock to avoid busy waiting with all threads.
         std::lock_guard<std::mutex> lock(m_queue_finish_mutex);
-        queue.finish();
-      }
+        data.m_done.wait();
+    }
 
-      std::memcpy(output_pol.data(), pinnedOutBufferHost_pol, finalSize_pol);
-      std::memcpy(output_val.data(), pinnedOutBufferHost_val, finalSize_val);
-      //    std::memcpy(output_vbe.data(), pinnedOutBufferHost_vbe, finalSize_vbe);
+    from_net_t(data.m_pinnedOutBufferHost_pol,
+               data.m_finalSize_pol / net_t_size(), output_pol.data());
+    from_net_t(data.m_pinnedOutBufferHost_val,
+               data.m_finalSize_val / net_t_size(), output_val.data());
+    if (data.m_pinnedOutBufferHost_vbe) {
+        from_net_t(data.m_pinnedOutBufferHost_vbe,
+                   data.m_finalSize_vbe / net_t_size(), output_vbe.data());
+    }
 
-      queue.enqueueUnmapMemObject(opencl_thread_data.m_pinnedOutBuffer_pol,
-				  pinnedOutBufferHost_pol);
-      queue.enqueueUnmapMemObject(opencl_thread_data.m_pinnedOutBuffer_val,
-				  pinnedOutBufferHost_val);
-      //    queue.enqueueUnmapMemObject(opencl_thread_data.m_pinnedOutBuffer_vbe,
-      //            pinnedOutBufferHost_vbe);
+    queue.enqueueUnmapMemObject(data.m_head_buffers[HEAD_POL_OUT],
+                                data.m_pinnedOutBufferHost_pol);
+    queue.enqueueUnmapMemObject(data.m_head_buffers[HEAD_VAL_OUT],
+                                data.m_pinnedOutBufferHost_val);
+    if (data.m_pinnedOutBufferHost_vbe) {
+        queue.enqueueUnmapMemObject(data.m_head_buffers[HEAD_VBE_OUT],
+                                    data.m_pinnedOutBufferHost_vbe);
+    }
+    // The queue is in order, the next batch on the slot runs after the
+    // unmaps.
+    opencl_thread_data.m_slots[slot] = nullptr;
+    m_opencl.release_slot(data);
+}
 
+bool OpenCL_Network::forward_ready(const size_t slot) const {
+    const auto& data = *opencl_thread_data.m_slots[slot];
+    assert(data.m_in_use);
+    auto status = cl_int{CL_COMPLETE};
+    // On errors forward_wait() is the one to report them.
+    if (clGetEventInfo(data.m_done(), CL_EVENT_COMMAND_EXECUTION_STATUS,
+                       sizeof(status), &status, nullptr) != CL_SUCCESS) {
+        return true;
     }
+    // Negative values are errors of the commands.
+    return status <= CL_COMPLETE;
 }
 
 
-void OpenCL_Network::convolve3(int channels, int outputs,
+void OpenCL_Network::convolve3(cl::CommandQueue & queue,
+                              int channels, int outputs,
                               cl::Buffer& bufferIn,
                               cl::Buffer& bufferOut,
                               cl::Buffer& bufferV,
@@ -706,7 +1056,8 @@ void OpenCL_Network::convolve3(int channels, int outputs,
                               weight_slice_t bn_weights,
                               bool skip_in_transform,
                               bool fuse_in_transform,
-                              bool store_inout) {
+                              bool store_inout,
+                              int batch_size) {
 
     cl::Kernel & in_transform_kernel = opencl_thread_data.m_in_transform_kernel;
     cl::Kernel & sgemm_kernel = opencl_thread_data.m_sgemm_kernel;
@@ -738,11 +1089,11 @@ void OpenCL_Network::convolve3(int channels, int outputs,
     constexpr auto height = BOARD_SIZE;
 
     auto wgs = ceilMultiple(tiles, wavefront_size);
+    auto wgs_batch = ceilMultiple(batch_size * tiles, wavefront_size);
     auto m_ceil = int(ceilMultiple(ceilMultiple(outputs, mwg), vwm));
-    auto n_ceil = int(ceilMultiple(ceilMultiple(tiles, nwg), vwn));
+    auto n_ceil = int(ceilMultiple(ceilMultiple(batch_size * tiles, nwg), vwn));
     auto k_ceil = int(ceilMultiple(ceilMultiple(channels, kwg), vwm));
 
-    cl::CommandQueue & queue = opencl_thread_data.m_commandqueue;
 
     if (!skip_in_transform) {
         try {
@@ -751,9 +1102,10 @@ void OpenCL_Network::convolve3(int channels, int outputs,
             in_transform_kernel.setArg(2, channels);
             in_transform_kernel.setArg(3, k_ceil);
             in_transform_kernel.setArg(4, n_ceil);
+            in_transform_kernel.setArg(5, batch_size);
 
             queue.enqueueNDRangeKernel(in_transform_kernel, cl::NullRange,
-                                       cl::NDRange(wgs, channels));
+                                       cl::NDRange(wgs_batch, channels));
         } catch (const cl::Error &e) {
             std::cerr << "Error in convolve3: " << e.what() << ": "
                 << e.err() << std::endl;
@@ -812,8 +1164,8 @@ void OpenCL_Network::convolve3(int channels, int outputs,
 
             queue.enqueueNDRangeKernel(out_transform_bn_in_kernel,
                                        cl::NullRange,
-                                       cl::NDRange(outputs, wgs),
-                                       cl::NDRange(dim_size, wgs));
+                                       cl::NDRange(outputs, wgs, batch_size),
+                                       cl::NDRange(dim_size, wgs, 1));
         } else {
             out_transform_bn_kernel.setArg(0, bufferM);
             out_transform_bn_kernel.setArg(1, bufferOut);
@@ -827,9 +1179,10 @@ void OpenCL_Network::convolve3(int channels, int outputs,
             }
             out_transform_bn_kernel.setArg(6, bn_weights[0]);
             out_transform_bn_kernel.setArg(7, bn_weights[1]);
+            out_transform_bn_kernel.setArg(8, batch_size);
 
             queue.enqueueNDRangeKernel(out_transform_bn_kernel, cl::NullRange,
-                                       cl::NDRange(outputs, wgs));
+                                       cl::NDRange(outputs, wgs_batch));
         }
     } catch (const cl::Error &e) {
         std::cerr << "Error in convolve3: " << e.what() << ": "
@@ -838,11 +1191,13 @@ void OpenCL_Network::convolve3(int channels, int outputs,
     }
 }
 
-void OpenCL_Network::convolve1(int channels, int outputs,
+void OpenCL_Network::convolve1(cl::CommandQueue & queue,
+                              int channels, int outputs,
                               cl::Buffer& bufferInput,
                               cl::Buffer& bufferOutput,
                               cl::Buffer& bufferMerge,
-                              weight_slice_t weights) {
+                              weight_slice_t weights,
+                              int batch_size) {
     // The size of the board is defined at compile time
     constexpr int width = BOARD_SIZE;
     constexpr int boardsize = BOARD_SQUARES;
@@ -858,7 +1213,7 @@ void OpenCL_Network::convolve1(int channels, int outputs,
 
 #ifndef NDEBUG
     // Total output size after reducing
-    size_t outSize = boardsize * outputs * sizeof(net_t);
+    size_t outSize = batch_size * boardsize * outputs * net_t_size();
 
     // Produce channel * output planes and merge them at the end
     size_t mergeSize = (channels >> channelShift) * outSize;
@@ -871,7 +1226,6 @@ void OpenCL_Network::convolve1(int channels, int outputs,
     int rowBuffer = std::min<int>(channelGroup, 7);
     size_t rowSize = channelGroup * outputGroup * rowBuffer * sizeof(float);
 
-    cl::CommandQueue & queue = opencl_thread_data.m_commandqueue;
 
     try {
         m_convolve_kernel->setArg(0, bufferInput);
@@ -881,7 +1235,8 @@ void OpenCL_Network::convolve1(int channels, int outputs,
         m_convolve_kernel->setArg(4, cl::Local(rowSize));
 
         queue.enqueueNDRangeKernel(*m_convolve_kernel, cl::NullRange,
-                                   cl::NDRange(channels, outputs, rowTiles),
+                                   cl::NDRange(channels, outputs,
+                                               batch_size * rowTiles),
                                    cl::NDRange(channelGroup, outputGroup, rowGroup));
     } catch (const cl::Error &e) {
         std::cerr << "Error in convolve1: " << e.what() << ": "
@@ -898,7 +1253,8 @@ void OpenCL_Network::convolve1(int channels, int outputs,
         merge_kernel.setArg(2, channels >> channelShift);
 
         queue.enqueueNDRangeKernel(merge_kernel, cl::NullRange,
-                                   cl::NDRange(outputs, boardsize),
+                                   cl::NDRange(outputs,
+                                               batch_size * boardsize),
                                    cl::NDRange(std::min(8, outputs), BOARD_SIZE));
     } catch (const cl::Error &e) {
         std::cerr << "Error in merge: " << e.what() << ": "
@@ -907,6 +1263,165 @@ void OpenCL_Network::convolve1(int channels, int outputs,
     }
 }
 
+void OpenCL_Network::innerproduct(cl::CommandQueue & queue,
+                                  const Layer& layer,
+                                  cl::Buffer& bufferInput,
+                                  cl::Buffer& bufferOutput,
+                                  int batch_size) {
+    cl::Kernel & innerproduct_kernel = opencl_thread_data.m_innerproduct_kernel;
+    const auto has_batchnorm = layer.weights.size() > 2;
+
+    try {
+        innerproduct_kernel.setArg(0, bufferInput);
+        innerproduct_kernel.setArg(1, bufferOutput);
+        innerproduct_kernel.setArg(2, layer.weights[0]);
+        innerproduct_kernel.setArg(3, layer.weights[1]);
+        if (has_batchnorm) {
+            innerproduct_kernel.setArg(4, layer.weights[2]);
+            innerproduct_kernel.setArg(5, layer.weights[3]);
+        } else {
+            innerproduct_kernel.setArg(4, nullptr);
+            innerproduct_kernel.setArg(5, nullptr);
+        }
+        innerproduct_kernel.setArg(6, static_cast<int>(layer.channels));
+        innerproduct_kernel.setArg(7, static_cast<int>(layer.relu));
+
+        queue.enqueueNDRangeKernel(innerproduct_kernel, cl::NullRange,
+                                   cl::NDRange(layer.outputs, batch_size));
+    } catch (const cl::Error &e) {
+        std::cerr << "Error in innerproduct: " << e.what() << ": "
+                  << e.err() << std::endl;
+        throw;
+    }
+}
+
+// The stone and side to move planes are only 0 and 1, so they take one
+// bit each instead of a net_t. Returns false for any other value.
+static bool pack_bits(const std::vector<float>& input, std::uint32_t* bits) {
+    std::fill(bits, bits + (input.size() + 31) / 32, 0);
+    for (auto i = size_t{0}; i < input.size(); i++) {
+        if (input[i] == 1.0f) {
+            bits[i / 32] |= std::uint32_t{1} << (i % 32);
+        } else if (input[i] != 0.0f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void OpenCL_Network::upload_input(PipelineSlot& data,
+                                  const std::vector<float>& input) {
+    auto& queue = data.m_commandqueue;
+    const auto bits_size = (input.size() + 31) / 32 * sizeof(std::uint32_t);
+    auto packed = false;
+    if (m_opencl.m_unified_memory) {
+        // The bits go straight to the memory the device reads. The
+        // previous batch of this slot was waited for, so the map
+        // doesn't stall.
+        auto bits = static_cast<std::uint32_t*>(queue.enqueueMapBuffer(
+            data.m_inBitsBuffer, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION,
+            0, bits_size));
+        packed = pack_bits(input, bits);
+        queue.enqueueUnmapMemObject(data.m_inBitsBuffer, bits);
+    } else {
+        // A staging vector, which also lets the caller reuse its own
+        // buffer before the non-blocking write finished.
+        data.m_input_bits.resize(bits_size / sizeof(std::uint32_t));
+        packed = pack_bits(input, data.m_input_bits.data());
+        if (packed) {
+            queue.enqueueWriteBuffer(data.m_inBitsBuffer, CL_FALSE, 0,
+                                     bits_size, data.m_input_bits.data());
+        }
+    }
+    if (!packed) {
+        to_net_t(input.data(), input.size(), data.m_input);
+        queue.enqueueWriteBuffer(data.m_inBuffer, CL_FALSE, 0,
+                                 data.m_input.size(), data.m_input.data());
+        return;
+    }
+
+    cl::Kernel & expand_bits_kernel = opencl_thread_data.m_expand_bits_kernel;
+    const auto size = static_cast<int>(input.size());
+
+    try {
+        expand_bits_kernel.setArg(0, data.m_inBitsBuffer);
+        expand_bits_kernel.setArg(1, data.m_inBuffer);
+        expand_bits_kernel.setArg(2, size);
+
+        queue.enqueueNDRangeKernel(expand_bits_kernel, cl::NullRange,
+                                   cl::NDRange(size));
+    } catch (const cl::Error &e) {
+        std::cerr << "Error in expand_bits: " << e.what() << ": "
+                  << e.err() << std::endl;
+        throw;
+    }
+}
+
+bool OpenCL_Network::use_residual_fused(const int batch_size) const {
+    if (batch_size < static_cast<int>(m_opencl.m_compute_units)) {
+        return false;
+    }
+    for (const auto& layer : m_layers) {
+        if (layer.is_residual_block
+            && 2 * layer.channels * BOARD_SQUARES * sizeof(float)
+               > m_opencl.m_local_mem_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void OpenCL_Network::residual_fused(cl::CommandQueue & queue,
+                                    const Layer& layer,
+                                    cl::Buffer& bufferInOut,
+                                    int batch_size) {
+    cl::Kernel & residual_fused_kernel =
+        opencl_thread_data.m_residual_fused_kernel;
+    const auto wgs = m_opencl.m_residual_fused_wgs;
+    const auto planes_size = layer.channels * BOARD_SQUARES * sizeof(float);
+
+    try {
+        residual_fused_kernel.setArg(0, bufferInOut);
+        residual_fused_kernel.setArg(1, layer.weights[6]);
+        residual_fused_kernel.setArg(2, layer.weights[1]);
+        residual_fused_kernel.setArg(3, layer.weights[2]);
+        residual_fused_kernel.setArg(4, layer.weights[7]);
+        residual_fused_kernel.setArg(5, layer.weights[4]);
+        residual_fused_kernel.setArg(6, layer.weights[5]);
+        residual_fused_kernel.setArg(7, static_cast<int>(layer.channels));
+        residual_fused_kernel.setArg(8, cl::Local(planes_size));
+        residual_fused_kernel.setArg(9, cl::Local(planes_size));
+
+        queue.enqueueNDRangeKernel(residual_fused_kernel, cl::NullRange,
+                                   cl::NDRange(wgs * batch_size),
+                                   cl::NDRange(wgs));
+    } catch (const cl::Error &e) {
+        std::cerr << "Error in residual_fused: " << e.what() << ": "
+                  << e.err() << std::endl;
+        throw;
+    }
+}
+
+void OpenCL_Network::softmax(cl::CommandQueue & queue,
+                             const Layer& layer,
+                             cl::Buffer& buffer,
+                             int batch_size) {
+    cl::Kernel & softmax_kernel = opencl_thread_data.m_softmax_kernel;
+
+    try {
+        softmax_kernel.setArg(0, buffer);
+        softmax_kernel.setArg(1, static_cast<int>(layer.outputs));
+        softmax_kernel.setArg(2, cfg_softmax_temp);
+
+        queue.enqueueNDRangeKernel(softmax_kernel, cl::NullRange,
+                                   cl::NDRange(batch_size));
+    } catch (const cl::Error &e) {
+        std::cerr << "Error in softmax: " << e.what() << ": "
+                  << e.err() << std::endl;
+        throw;
+    }
+}
+
 template<class T>
 static std::string opencl_dev_type_to_string(T type) {
     if (type == CL_DEVICE_TYPE_CPU) {
@@ -1016,8 +1531,108 @@ std::vector<size_t> OpenCL::get_sgemm_tuners(void) {
     return tuners;
 }
 
-void OpenCL::initialize(const int channels, const std::vector<int> & gpus,
-                        bool silent) {
+using ProgramCache =
+    std::vector<std::pair<std::string, std::vector<unsigned char>>>;
+
+// Every entry is a line with the key, a line with the size and then
+// the program binary. The most recently stored entry comes first.
+static ProgramCache read_program_cache() {
+    auto entries = ProgramCache{};
+    auto file = std::ifstream{PROGRAM_CACHE_FILE, std::ios::binary};
+    auto key = std::string{};
+    auto size = size_t{0};
+    while (std::getline(file, key) && file >> size && file.get() == '\n') {
+        auto binary = std::vector<unsigned char>(size);
+        if (!file.read(reinterpret_cast<char*>(binary.data()), size)) {
+            break;
+        }
+        entries.emplace_back(key, std::move(binary));
+    }
+    return entries;
+}
+
+// FNV-1a, unlike std::hash it is the same for every build.
+static std::uint64_t hash_source(const std::string& source) {
+    auto hash = std::uint64_t{14695981039346656037ULL};
+    for (const auto c : source) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+std::string OpenCL::get_program_cache_key(const std::string& source,
+                                          const std::string& args) {
+    auto key = get_device_name() + ";"
+        + trim(m_device.getInfo<CL_DRIVER_VERSION>()) + ";" + args + ";"
+        + boost::str(boost::format("%016x") % hash_source(source));
+    std::replace(begin(key), end(key), '\n', ' ');
+    return key;
+}
+
+bool OpenCL::load_program_binary(const std::string& key,
+                                 const std::string& args) {
+    for (const auto& entry : read_program_cache()) {
+        if (entry.first != key) {
+            continue;
+        }
+        try {
+            auto program = cl::Program(m_context, {m_device}, {entry.second});
+            program.build(args.c_str());
+            m_program = program;
+            myprintf("Loaded the compiled kernels from %s.\n",
+                     PROGRAM_CACHE_FILE.c_str());
+            return true;
+        } catch (const cl::Error&) {
+            // Stale or damaged, build the program from the source.
+            return false;
+        }
+    }
+    return false;
+}
+
+void OpenCL::save_program_binary(const std::string& key) {
+    auto binaries = m_program.getInfo<CL_PROGRAM_BINARIES>();
+    if (binaries.size() != 1 || binaries[0].empty()) {
+        return;
+    }
+    auto entries = read_program_cache();
+    entries.erase(std::remove_if(begin(entries), end(entries),
+                                 [&key](const ProgramCache::value_type& e) {
+                                     return e.first == key;
+                                 }),
+                  end(entries));
+    entries.emplace(begin(entries), key, std::move(binaries[0]));
+    if (entries.size() > PROGRAM_CACHE_ENTRIES) {
+        entries.resize(PROGRAM_CACHE_ENTRIES);
+    }
+
+    // Engines that start meanwhile see the old file or the new one,
+    // never half of it.
+    const auto tmp_file = PROGRAM_CACHE_FILE + ".tmp";
+    {
+        auto file = std::ofstream{tmp_file, std::ios::binary};
+        for (const auto& entry : entries) {
+            file << entry.first << "\n" << entry.second.size() << "\n";
+            file.write(reinterpret_cast<const char*>(entry.second.data()),
+                       entry.second.size());
+        }
+        if (file.fail()) {
+            myprintf("Could not save the compiled kernels.\n");
+            myprintf("Do I have write permissions on %s?\n",
+                     PROGRAM_CACHE_FILE.c_str());
+            return;
+        }
+    }
+    std::rename(tmp_file.c_str(), PROGRAM_CACHE_FILE.c_str());
+}
+
+void OpenCL::initialize(const int channels,
+                        const std::vector<int> & batch_sizes,
+                        const std::vector<int> & gpus,
+                        bool use_half, bool silent) {
+    m_use_half = use_half;
+
     std::vector<cl::Platform> platforms;
     try {
         cl::Platform::get(&platforms);
@@ -1132,39 +1747,53 @@ void OpenCL::initialize(const int channels, const std::vector<int> & gpus,
     m_device = best_device;
 
     // Make program of the source code in the context
+    const auto source = sourceCode_config
+                        + sourceCode_convolve1
+                        + sourceCode_convolve3
+                        + sourceCode_input
+                        + sourceCode_residual
+                        + sourceCode_heads
+                        + (m_use_half ? sourceCode_sgemm_half
+                                      : sourceCode_sgemm_single);
     try {
-        m_program = cl::Program(m_context,
-                                  sourceCode_config
-                                + sourceCode_convolve1
-                                + sourceCode_convolve3
-                                + sourceCode_sgemm);
+        m_program = cl::Program(m_context, source);
     } catch (const cl::Error &e) {
         myprintf("Error getting kernels: %s: %d", e.what(), e.err());
         throw std::runtime_error("Error getting OpenCL kernels.");
     }
 
-    m_cl_args = cl_args;
+    m_cl_args = (m_use_half ? "-DUSE_HALF " : "") + cl_args;
+    myprintf("Using %s precision.\n", m_use_half ? "half" : "single");
 
+    // The tiles of all the positions of a batch go through one sgemm.
+    auto tuner_ns = std::vector<int>{};
+    for (const auto batch_size : batch_sizes) {
+        tuner_ns.emplace_back(WINOGRAD_P * batch_size);
+    }
     auto t = Tuner(*this, m_context, m_device);
     auto sgemm_tuners =
-        t.load_sgemm_tuners(channels, WINOGRAD_P, channels, WINOGRAD_TILE);
+        t.load_sgemm_tuners(channels, tuner_ns, channels, WINOGRAD_TILE);
 
-    // Exit immediately after tuning. Some NVIDIA drivers are buggy
+    // Stop immediately after tuning. Some NVIDIA drivers are buggy
     // and will fail to compile the rest of the kernels after a tuning
-    // run. See #729.
+    // run. See #729. The scheduler exits once every device is tuned.
     if (cfg_tune_only) {
-        exit(EXIT_SUCCESS);
+        return;
     }
 
-    // Build program for these specific devices
-    try {
-        std::string args = cl_args;
-        args += sgemm_tuners;
-        m_program.build(args.c_str());
-    } catch (const cl::Error&) {
-        myprintf("Error building kernels: %s\n",
-                 m_program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(m_device).c_str());
-        throw std::runtime_error("Error building OpenCL kernels.");
+    // Build program for these specific devices, unless an earlier run
+    // left it in the cache.
+    const auto args = m_cl_args + sgemm_tuners;
+    const auto cache_key = get_program_cache_key(source, args);
+    if (!load_program_binary(cache_key, args)) {
+        try {
+            m_program.build(args.c_str());
+        } catch (const cl::Error&) {
+            myprintf("Error building kernels: %s\n",
+                     m_program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(m_device).c_str());
+            throw std::runtime_error("Error building OpenCL kernels.");
+        }
+        save_program_binary(cache_key);
     }
 
     ensure_thread_initialized();
@@ -1175,8 +1804,17 @@ void OpenCL::initialize(const int channels, const std::vector<int> & gpus,
             best_device);
     myprintf("Wavefront/Warp size: %d\n", m_wavefront_size);
 
+    m_unified_memory =
+        best_device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() != 0;
+    myprintf("Unified host memory: %s\n", m_unified_memory ? "yes" : "no");
+
     m_max_workgroup_size = best_device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
     m_max_workgroup_dims = best_device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+    m_local_mem_size = best_device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+    m_compute_units = best_device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+    m_residual_fused_wgs = std::min<size_t>(256,
+        opencl_thread_data.m_residual_fused_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(
+            best_device));
 
     myprintf("Max workgroup size: %d\n", m_max_workgroup_size);
     myprintf("Max workgroup dimensions: ");
@@ -1188,6 +1826,61 @@ void OpenCL::initialize(const int channels, const std::vector<int> & gpus,
     m_init_ok = true;
 }
 
+int OpenCL::get_numa_node() {
+#ifdef __linux__
+    // From cl_khr_pci_bus_info, cl_nv_device_attribute_query and
+    // cl_amd_device_attribute_query, which older headers don't have.
+    constexpr cl_device_info PCI_BUS_INFO_KHR = 0x410F;
+    constexpr cl_device_info PCI_BUS_ID_NV = 0x4008;
+    constexpr cl_device_info PCI_SLOT_ID_NV = 0x4009;
+    constexpr cl_device_info TOPOLOGY_AMD = 0x4037;
+
+    auto domain = cl_uint{0};
+    auto bus = cl_uint{0};
+    auto device = cl_uint{0};
+    auto function = cl_uint{0};
+    const auto id = m_device();
+    cl_uint khr[4];
+    cl_uint nv_bus, nv_slot;
+    cl_char amd[24];
+    if (clGetDeviceInfo(id, PCI_BUS_INFO_KHR, sizeof(khr), khr,
+                        nullptr) == CL_SUCCESS) {
+        domain = khr[0];
+        bus = khr[1];
+        device = khr[2];
+        function = khr[3];
+    } else if (clGetDeviceInfo(id, PCI_BUS_ID_NV, sizeof(nv_bus), &nv_bus,
+                               nullptr) == CL_SUCCESS
+               && clGetDeviceInfo(id, PCI_SLOT_ID_NV, sizeof(nv_slot),
+                                  &nv_slot, nullptr) == CL_SUCCESS) {
+        bus = nv_bus;
+        // Device in the upper 5 bits, function in the lower 3.
+        device = nv_slot >> 3;
+        function = nv_slot & 7;
+    } else if (clGetDeviceInfo(id, TOPOLOGY_AMD, sizeof(amd), amd,
+                               nullptr) == CL_SUCCESS) {
+        // A cl_uint type, 17 unused bytes, then bus, device, function.
+        bus = static_cast<cl_uchar>(amd[21]);
+        device = static_cast<cl_uchar>(amd[22]);
+        function = static_cast<cl_uchar>(amd[23]);
+    } else {
+        return -1;
+    }
+
+    const auto path = boost::str(
+        boost::format("/sys/bus/pci/devices/%04x:%02x:%02x.%x/numa_node")
+        % domain % bus % device % function);
+    std::ifstream file(path);
+    auto node = -1;
+    if (!(file >> node)) {
+        return -1;
+    }
+    return node;
+#else
+    return -1;
+#endif
+}
+
 std::string OpenCL::get_device_name() {
     std::stringstream ss;
 
@@ -26,9 +26,13 @@
 #define CL_HPP_TARGET_OPENCL_VERSION    120
 #define CL_HPP_ENABLE_EXCEPTIONS
 #include <CL/cl2.hpp>
+#include <array>
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <mutex>
 
@@ -39,6 +43,16 @@ static constexpr auto WINOGRAD_TILE = 4 * 4;
 
 class OpenCL;
 
+// Buffers that connect the layers of the heads. The convolve1 layers
+// write the planes, the innerproduct and softmax layers reduce them to
+// the outputs, which are the only buffers read back by the host.
+enum head_buffer_t {
+    HEAD_POL_PLANES, HEAD_VAL_PLANES, HEAD_VBE_PLANES,
+    HEAD_VAL_CHANNELS, HEAD_VBE_CHANNELS,
+    HEAD_POL_OUT, HEAD_VAL_OUT, HEAD_VBE_OUT,
+    NUM_HEAD_BUFFERS
+};
+
 class Layer {
     friend class OpenCL_Network;
 private:
@@ -48,34 +62,87 @@ private:
     bool is_input_convolution{false};
     bool is_residual_block{false};
     bool is_convolve1{false};
+    bool is_innerproduct{false};
+    bool is_softmax{false};
+    bool relu{false};
+    head_buffer_t input_buffer{HEAD_POL_PLANES};
+    head_buffer_t output_buffer{HEAD_POL_PLANES};
     std::vector<cl::Buffer> weights;
 };
 
+// Sizes in bytes of the buffers of a PipelineSlot.
+struct SlotSizes {
+    size_t in{0};
+    size_t bits{0};
+    size_t vm{0};
+    std::array<size_t, NUM_HEAD_BUFFERS> head{};
+
+    bool covers(const SlotSizes& other) const;
+};
+
+// Command queue and buffers for one batch in flight. They come from the
+// pool of the device, see OpenCL::acquire_slot().
+class PipelineSlot {
+    friend class OpenCL;
+    friend class OpenCL_Network;
+private:
+    SlotSizes m_sizes;
+    // Taken by a batch between forward_async() and forward_wait().
+    bool m_in_use{false};
+    // The OpenCL_Network that ran the last batch on the slot.
+    std::uint64_t m_network_id{0};
+    cl::CommandQueue m_commandqueue;
+    cl::Buffer m_inBuffer;
+    cl::Buffer m_inBuffer2;
+    // The input planes packed to bits, see upload_input().
+    cl::Buffer m_inBitsBuffer;
+    cl::Buffer m_VBuffer;
+    cl::Buffer m_MBuffer;
+    // The output buffers are pinned.
+    std::array<cl::Buffer, NUM_HEAD_BUFFERS> m_head_buffers;
+
+    // State of the batch between forward_async() and forward_wait().
+    std::vector<char> m_input;
+    std::vector<std::uint32_t> m_input_bits;
+    cl::Event m_done;
+    void * m_pinnedOutBufferHost_pol{nullptr};
+    void * m_pinnedOutBufferHost_val{nullptr};
+    void * m_pinnedOutBufferHost_vbe{nullptr};
+    size_t m_finalSize_pol{0};
+    size_t m_finalSize_val{0};
+    size_t m_finalSize_vbe{0};
+};
+
 class ThreadData {
     friend class OpenCL;
     friend class OpenCL_Network;
 private:
     bool m_is_initialized{false};
-    cl::CommandQueue m_commandqueue;
+    // The OpenCL instance the kernels belong to.
+    std::uint64_t m_opencl_id{0};
     cl::Kernel m_convolve1_kernel;
     cl::Kernel m_merge_kernel;
     cl::Kernel m_in_transform_kernel;
     cl::Kernel m_sgemm_kernel;
     cl::Kernel m_out_transform_bn_kernel;
     cl::Kernel m_out_transform_bn_in_kernel;
-    cl::Buffer m_inBuffer;
-    cl::Buffer m_inBuffer2;
-    cl::Buffer m_VBuffer;
-    cl::Buffer m_MBuffer;
-    cl::Buffer m_pinnedOutBuffer_pol;
-    cl::Buffer m_pinnedOutBuffer_val;
-    cl::Buffer m_pinnedOutBuffer_vbe;
-    bool m_buffers_allocated{false};
+    cl::Kernel m_innerproduct_kernel;
+    cl::Kernel m_softmax_kernel;
+    cl::Kernel m_expand_bits_kernel;
+    cl::Kernel m_residual_fused_kernel;
+    // The slots of the pool the batches of this thread are in flight
+    // on, by the slot number of forward_async().
+    std::vector<PipelineSlot*> m_slots;
 };
 
 class OpenCL_Network {
 public:
     OpenCL_Network(OpenCL & opencl) : m_opencl(opencl) {}
+    // Gives the weights back to the OpenCL instance, which must still
+    // be there.
+    ~OpenCL_Network();
+    OpenCL_Network(const OpenCL_Network&) = delete;
+    OpenCL_Network& operator=(const OpenCL_Network&) = delete;
     OpenCL & getOpenCL() {
         return m_opencl;
     }
@@ -104,7 +171,9 @@ public:
                        const std::vector<float>& variances_1,
                        const std::vector<float>& weights_2,
                        const std::vector<float>& means_2,
-                       const std::vector<float>& variances_2) {
+                       const std::vector<float>& variances_2,
+                       const std::vector<float>& filters_1,
+                       const std::vector<float>& filters_2) {
         size_t layer = get_layer_count();
         push_weights(layer, weights_1);
         push_weights(layer, means_1);
@@ -112,6 +181,9 @@ public:
         push_weights(layer, weights_2);
         push_weights(layer, means_2);
         push_weights(layer, variances_2);
+        // The plain 3x3 filters, for residual_fused().
+        push_weights(layer, filters_1);
+        push_weights(layer, filters_2);
         m_layers[layer].is_residual_block = true;
         m_layers[layer].outputs = outputs;
         m_layers[layer].filter_size = filter_size;
@@ -120,22 +192,93 @@ public:
 
     void push_convolve1(unsigned int channels,
                        unsigned int outputs,
-                       const std::vector<float>& weights) {
+                       const std::vector<float>& weights,
+                       head_buffer_t output) {
         size_t layer = get_layer_count();
         push_weights(layer, weights);
         m_layers[layer].is_convolve1 = true;
         m_layers[layer].outputs = outputs;
         m_layers[layer].channels = channels;
+        m_layers[layer].output_buffer = output;
+    }
+
+    // Fully connected layer. If means and stddivs are given, the input
+    // planes first go through the batchnorm and a ReLU.
+    void push_innerproduct(unsigned int inputs,
+                           unsigned int outputs,
+                           bool relu,
+                           head_buffer_t input,
+                           head_buffer_t output,
+                           const std::vector<float>& weights,
+                           const std::vector<float>& biases,
+                           const std::vector<float>& means = {},
+                           const std::vector<float>& stddivs = {}) {
+        size_t layer = get_layer_count();
+        push_weights(layer, weights);
+        push_weights(layer, biases);
+        if (!means.empty()) {
+            push_weights(layer, means);
+            push_weights(layer, stddivs);
+        }
+        m_layers[layer].is_innerproduct = true;
+        m_layers[layer].relu = relu;
+        m_layers[layer].outputs = outputs;
+        m_layers[layer].channels = inputs;
+        m_layers[layer].input_buffer = input;
+        m_layers[layer].output_buffer = output;
+    }
+
+    // Softmax over the buffer, in place. Uses cfg_softmax_temp.
+    void push_softmax(unsigned int size, head_buffer_t buffer) {
+        m_layers.push_back(Layer());
+        m_layers.back().is_softmax = true;
+        m_layers.back().outputs = size;
+        m_layers.back().channels = size;
+        m_layers.back().input_buffer = buffer;
+        m_layers.back().output_buffer = buffer;
     }
 
     size_t get_layer_count() const {
         return m_layers.size();
     }
 
-    void forward(const std::vector<net_t>& input,
-            std::vector<net_t>& output_pol,
-            std::vector<net_t>& output_val,
-            std::vector<net_t>& output_vbe);
+    // Must be called before the first forward() as the per-thread
+    // buffers are sized for the largest batch.
+    void set_max_batch_size(int batch_size) {
+        m_max_batch_size = batch_size;
+    }
+
+    int get_max_batch_size() const {
+        return m_max_batch_size;
+    }
+
+    // Number of values per position in the input and each of the
+    // outputs, output_vbe is 0 without a second value head output.
+    void get_io_sizes(size_t& input, size_t& output_pol,
+                      size_t& output_val, size_t& output_vbe) const;
+
+    // The input holds batch_size positions back to back, and the
+    // outputs of the heads are filled the same way.
+    void forward(const std::vector<float>& input,
+            std::vector<float>& output_pol,
+            std::vector<float>& output_val,
+            std::vector<float>& output_vbe,
+            const int batch_size = 1);
+
+    // Asynchronous version of forward(). forward_async() only enqueues
+    // the work for the batch on the given slot, forward_wait() blocks
+    // until it is done and copies out the results. Each slot has its own
+    // queue and buffers, so the next batch can be uploaded while the
+    // device is still busy with the previous one.
+    void forward_async(const std::vector<float>& input,
+                       int batch_size, size_t slot);
+    void forward_wait(std::vector<float>& output_pol,
+                      std::vector<float>& output_val,
+                      std::vector<float>& output_vbe,
+                      size_t slot);
+    // Whether the batch on the slot is done, so forward_wait() won't
+    // block.
+    bool forward_ready(size_t slot) const;
 
 private:
     using weight_slice_t = std::vector<cl::Buffer>::const_iterator;
@@ -145,7 +288,14 @@ private:
     }
     void add_weights(size_t layer, size_t size, const float* weights);
 
-    void convolve3(int channels, int outputs,
+    // Size of one value on the device, and conversions between the host
+    // floats and the device representation.
+    size_t net_t_size() const;
+    void to_net_t(const float* in, size_t size, std::vector<char>& out) const;
+    void from_net_t(const void* in, size_t size, float* out) const;
+
+    void convolve3(cl::CommandQueue& queue,
+                    int channels, int outputs,
                     cl::Buffer& bufferIn,
                     cl::Buffer& bufferOut,
                     cl::Buffer& bufferV,
@@ -153,32 +303,81 @@ private:
                     cl::Buffer* bufferResidual,
                     weight_slice_t bn_weights,
                     bool skip_in_transform,
-                    bool fuse_in_transform, bool store_inout);
+                    bool fuse_in_transform, bool store_inout,
+                    int batch_size);
 
-    void convolve1(int channels, int outputs,
+    void convolve1(cl::CommandQueue& queue,
+                  int channels, int outputs,
                   cl::Buffer& bufferInput,
                   cl::Buffer& bufferOutput,
                   cl::Buffer& bufferMerge,
-                  weight_slice_t weights);
+                  weight_slice_t weights,
+                  int batch_size);
+
+    void innerproduct(cl::CommandQueue& queue,
+                      const Layer& layer,
+                      cl::Buffer& bufferInput,
+                      cl::Buffer& bufferOutput,
+                      int batch_size);
+
+    void softmax(cl::CommandQueue& queue,
+                 const Layer& layer,
+                 cl::Buffer& buffer,
+                 int batch_size);
+
+    // On small boards a residual block can run as a single kernel, one
+    // work group for each position with its planes in local memory. It
+    // is used when the planes fit and the batch has a position for
+    // every compute unit, smaller batches are faster through sgemm.
+    bool use_residual_fused(int batch_size) const;
+    void residual_fused(cl::CommandQueue& queue,
+                        const Layer& layer,
+                        cl::Buffer& bufferInOut,
+                        int batch_size);
+
+    // Writes the inputs of the batch to inBuffer, as bits when they are
+    // all 0 or 1.
+    void upload_input(PipelineSlot& data, const std::vector<float>& input);
+
+    // Values per position written to one of the head buffers.
+    size_t head_buffer_size(head_buffer_t buffer) const;
+    // What a slot needs for the largest batch of this network.
+    SlotSizes get_slot_sizes() const;
 
     OpenCL & m_opencl;
+    static std::atomic<std::uint64_t> s_next_id;
+    const std::uint64_t m_id{++s_next_id};
 
     // this mutex is not required for correctness, but this exists simply
-    // because queue.finish() is a busy wait and having a lot of threads
-    // waiting here is counterproductive CPU-wise.  At least std::mutex
-    // isn't busy wait so it should be better.
+    // because waiting on a queue event is usually a busy wait and having
+    // a lot of threads waiting here is counterproductive CPU-wise.  At
+    // least std::mutex isn't busy wait so it should be better.
     std::mutex m_queue_finish_mutex;
     std::vector<Layer> m_layers;
+    // Keys of the weights taken from OpenCL::acquire_weights().
+    std::vector<std::uint64_t> m_weight_keys;
+    int m_max_batch_size{1};
 };
 
 class OpenCL {
     friend class OpenCL_Network;
     friend class Tuner;
 public:
-    void initialize(const int channels, const std::vector<int> & gpus,
-                    bool silent = false);
+    // With use_half the network is stored in half precision on the
+    // device, the kernels still compute in single precision. The sgemm
+    // kernel is tuned for the network batch sizes in batch_sizes. With
+    // --tune-only it returns right after tuning, without building the
+    // kernels.
+    void initialize(const int channels, const std::vector<int> & batch_sizes,
+                    const std::vector<int> & gpus,
+                    bool use_half, bool silent = false);
+    bool uses_half() const {
+        return m_use_half;
+    }
     void ensure_thread_initialized(void);
     std::string get_device_name();
+    // The NUMA node of the PCIe root of the device, -1 if unknown.
+    int get_numa_node();
 
     std::vector<size_t> get_sgemm_tuners(void);
 
@@ -187,9 +386,46 @@ public:
 private:
     void tune_sgemm(void);
     void process_tuners(std::string tuners);
+    // The built program is cached in PROGRAM_CACHE_FILE, as compiling it
+    // takes seconds with some drivers. The key covers the device, the
+    // driver, the build arguments and the kernel source.
+    std::string get_program_cache_key(const std::string& source,
+                                      const std::string& args);
+    bool load_program_binary(const std::string& key,
+                             const std::string& args);
+    void save_program_binary(const std::string& key);
+
+    // The activation buffers and the weights are shared by all the
+    // networks and threads on the device. A slot is taken for every
+    // batch in flight, so there are as many as the pipelines keep busy
+    // at once, not one per thread and network. Weights with the same
+    // contents are uploaded once, e.g. when several networks in the
+    // process come from the same file.
+    PipelineSlot& acquire_slot(const SlotSizes& sizes,
+                               std::uint64_t network_id);
+    void release_slot(PipelineSlot& slot);
+    void allocate_slot(PipelineSlot& slot, const SlotSizes& sizes);
+    cl::Buffer acquire_weights(std::uint64_t key,
+                               const std::vector<char>& weights);
+    void release_weights(std::uint64_t key);
+
+    std::mutex m_pool_mutex;
+    std::vector<std::unique_ptr<PipelineSlot>> m_slots;
+    struct SharedWeights {
+        cl::Buffer buffer;
+        int users;
+    };
+    std::unordered_map<std::uint64_t, SharedWeights> m_weights;
 
     cl::Program m_program;
     std::string m_cl_args;
+    bool m_use_half{false};
+    // The device shares the memory of the host, e.g. an integrated GPU.
+    // The input is then written in place instead of copied.
+    bool m_unified_memory{false};
+    // Never reused, unlike the address of a freed instance.
+    static std::atomic<std::uint64_t> s_next_id;
+    const std::uint64_t m_id{++s_next_id};
 
     struct sgemm_tuners {
         size_t mwg, nwg, kwg;
@@ -200,10 +436,14 @@ private:
     size_t m_wavefront_size{0};
     size_t m_max_workgroup_size{0};
     std::vector<size_t> m_max_workgroup_dims;
+    size_t m_local_mem_size{0};
+    size_t m_compute_units{0};
+    size_t m_residual_fused_wgs{0};
     bool m_init_ok{false};
 };
 
 extern thread_local ThreadData opencl_thread_data;
-extern const std::string sourceCode_sgemm;
+extern const std::string sourceCode_sgemm_single;
+extern const std::string sourceCode_sgemm_half;
 
 #endif
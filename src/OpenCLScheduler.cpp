@@ -19,66 +19,500 @@
 #include "config.h"
 
 #ifdef USE_OPENCL
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <limits>
+
 #include "GTP.h"
+#include "Metrics.h"
+#include "Profile.h"
+#include "Network.h"
 #include "Random.h"
+#include "SMP.h"
+#include "Timing.h"
 #include "OpenCLScheduler.h"
+#include "Utils.h"
 
-thread_local auto current_thread_gpu_num = size_t{0};
-OpenCLScheduler opencl;
+using Utils::myprintf;
 
-void OpenCLScheduler::initialize(const int channels) {
-    // multi-gpu?
-    if (!cfg_gpus.empty()) {
-        auto silent{false};
-        for (auto gpu : cfg_gpus) {
-            auto opencl = std::make_unique<OpenCL>();
+OpenCLScheduler::~OpenCLScheduler() {
+    m_forward_queue.shutdown();
+    for (auto& worker : m_batch_workers) {
+        worker.join();
+    }
+    // The networks give their weights back to the devices, which go
+    // first otherwise.
+    m_networks.clear();
+}
+
+// Average time in seconds to run a full batch of random positions. The
+// outputs of the last run are left in output_*.
+static double time_forward(OpenCL_Network& net,
+                           std::vector<float>& output_pol,
+                           std::vector<float>& output_val,
+                           std::vector<float>& output_vbe) {
+    constexpr auto runs = 16;
+    const auto batch_size = net.get_max_batch_size();
+
+    auto in_size = size_t{0};
+    auto pol_size = size_t{0};
+    auto val_size = size_t{0};
+    auto vbe_size = size_t{0};
+    net.get_io_sizes(in_size, pol_size, val_size, vbe_size);
+
+    // Don't use thread Rng so both precisions see the same positions.
+    auto rng = Random{0};
+    auto input = std::vector<float>(batch_size * in_size);
+    for (auto& in : input) {
+        in = float(rng.randuint64(2));
+    }
+    output_pol.resize(batch_size * pol_size);
+    output_val.resize(batch_size * val_size);
+    output_vbe.resize(batch_size * vbe_size);
+
+    // The first run also allocates the buffers.
+    net.forward(input, output_pol, output_val, output_vbe, batch_size);
+    const auto start = std::chrono::steady_clock::now();
+    for (auto i = 0; i < runs; i++) {
+        net.forward(input, output_pol, output_val, output_vbe, batch_size);
+    }
+    const auto elapsed = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start);
+    return elapsed.count() / runs;
+}
+
+void OpenCLScheduler::initialize(const int channels,
+                                 const int max_batch_size,
+                                 push_weights_fn push_weights,
+                                 forward_fn cpu_forward,
+                                 const OpenCLScheduler* const share) {
+    const auto batch_size = std::max(max_batch_size, cfg_batch_size);
+    if (cfg_cpu_threads > 0) {
+        m_cpu_forward = cpu_forward;
+    }
+
+    if (share) {
+        // Same devices and precision, only the weights are new.
+        for (const auto& opencl : share->m_opencl) {
             auto net = std::make_unique<OpenCL_Network>(*opencl);
-            opencl->initialize(channels, {gpu}, silent);
-            m_opencl.push_back(std::move(opencl));
+            net->set_max_batch_size(batch_size);
+            push_weights(*net);
+            m_opencl.push_back(opencl);
             m_networks.push_back(std::move(net));
+        }
+    }
+
+    // Tuned for single evaluations and for full batches.
+    auto tuner_batch_sizes = std::vector<int>{1};
+    if (cfg_batch_size > 1) {
+        tuner_batch_sizes.emplace_back(cfg_batch_size);
+    }
+
+    auto make_network = [&](const std::vector<int>& gpus, bool use_half,
+                            bool silent) {
+        auto opencl = std::make_unique<OpenCL>();
+        auto net = std::make_unique<OpenCL_Network>(*opencl);
+        opencl->initialize(channels, tuner_batch_sizes, gpus, use_half,
+                           silent);
+        net->set_max_batch_size(batch_size);
+        push_weights(*net);
+        return std::make_pair(std::move(opencl), std::move(net));
+    };
+
+    auto setup_device = [&](const std::vector<int>& gpus, bool silent) {
+        auto best = make_network(gpus, cfg_precision == Precision::HALF,
+                                 silent);
 
-            // Clear thread data on every init call.  We don't know which GPU
-            // this thread will be eventually be assigned to
-            opencl_thread_data = ThreadData();
+        if (cfg_precision == Precision::AUTO) {
+            auto ref_pol = std::vector<float>();
+            auto ref_val = std::vector<float>();
+            auto ref_vbe = std::vector<float>();
+            const auto single_time =
+                time_forward(*best.second, ref_pol, ref_val, ref_vbe);
 
-            // starting next GPU, let's not dump full list of GPUs
-            silent = true;
+            try {
+                auto half = make_network(gpus, true, true);
+                auto pol = std::vector<float>();
+                auto val = std::vector<float>();
+                auto vbe = std::vector<float>();
+                const auto half_time =
+                    time_forward(*half.second, pol, val, vbe);
+                const auto accurate =
+                    Network::compare_net_outputs(pol, ref_pol, false)
+                    && Network::compare_net_outputs(val, ref_val, false)
+                    && Network::compare_net_outputs(vbe, ref_vbe, false);
+                myprintf("Batch of %d: %.3f ms in single precision, "
+                         "%.3f ms in half precision%s.\n",
+                         batch_size, single_time * 1000.0, half_time * 1000.0,
+                         accurate ? "" : " (not accurate enough)");
+                if (accurate && half_time < single_time) {
+                    // The network before the device it is on.
+                    best.second.reset();
+                    best = std::move(half);
+                }
+            } catch (const std::exception& e) {
+                myprintf("Half precision failed: %s\n", e.what());
+            }
+            myprintf("Selected %s precision.\n",
+                     best.first->uses_half() ? "half" : "single");
         }
+        return best;
+    };
 
+    auto device_lists = std::vector<std::vector<int>>{};
+    if (!share) {
+        // Without --gpu we let OpenCL autodetect a single device.
+        if (cfg_gpus.empty()) {
+            device_lists.emplace_back();
+        }
+        for (auto gpu : cfg_gpus) {
+            device_lists.push_back({gpu});
+        }
+    }
+
+    // The devices are set up, and tuned if needed, at the same time.
+    // Only the first one lists the devices it finds.
+    if (cfg_tune_only) {
+        auto tunings = std::vector<std::future<void>>{};
+        for (size_t i = 0; i < device_lists.size(); i++) {
+            tunings.emplace_back(std::async(std::launch::async, [&, i] {
+                if (cfg_precision != Precision::HALF) {
+                    OpenCL().initialize(channels, tuner_batch_sizes,
+                                        device_lists[i], false, i > 0);
+                }
+                if (cfg_precision != Precision::SINGLE) {
+                    OpenCL().initialize(channels, tuner_batch_sizes,
+                                        device_lists[i], true, true);
+                }
+            }));
+        }
+        for (auto& tuning : tunings) {
+            tuning.get();
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    using Device = std::pair<std::unique_ptr<OpenCL>,
+                             std::unique_ptr<OpenCL_Network>>;
+    auto devices = std::vector<std::future<Device>>{};
+    for (size_t i = 0; i < device_lists.size(); i++) {
+        devices.emplace_back(std::async(std::launch::async, setup_device,
+                                        std::cref(device_lists[i]), i > 0));
+    }
+    for (auto& device : devices) {
+        auto best = device.get();
+        m_opencl.push_back(std::move(best.first));
+        m_networks.push_back(std::move(best.second));
+    }
+
+    m_stats = std::vector<DeviceStats>(device_count());
+    m_stats_start = std::chrono::steady_clock::now();
+
+    // With --numa the threads that feed a GPU, and so its pinned host
+    // buffers, stay on the node of the GPU.
+    auto numa_nodes = std::vector<int>();
+    for (auto& opencl : m_opencl) {
+        numa_nodes.emplace_back(cfg_numa ? opencl->get_numa_node() : -1);
+        if (numa_nodes.back() >= 0) {
+            myprintf("%s is on NUMA node %d.\n",
+                     opencl->get_device_name().c_str(), numa_nodes.back());
+        }
+    }
+    auto bind_to_device = [numa_nodes](const size_t gnum) {
+        if (numa_nodes[gnum] >= 0) {
+            SMP::bind_thread_to_numa_node(numa_nodes[gnum]);
+        }
+    };
+
+    if (device_count() > 1) {
+        for (size_t gnum = 0; gnum < m_networks.size(); gnum++) {
+            // launch the worker threads.  One per batch in flight so that
+            // we can fully utilize GPU, since the worker thread consists of
+            // some CPU work for task preparation.
+            m_device_pools.emplace_back(std::make_unique<Utils::ThreadPool>());
+            m_device_pools.back()->initialize(
+                cfg_pipeline_depth,
+                [bind_to_device, gnum](size_t) { bind_to_device(gnum); });
+        }
+        if (m_cpu_forward) {
+            m_device_pools.emplace_back(std::make_unique<Utils::ThreadPool>());
+            m_device_pools.back()->initialize(cfg_cpu_threads);
+        }
+    }
+
+    if (cfg_batch_size > 1) {
+        // One batch worker per GPU, it keeps up to cfg_pipeline_depth
+        // batches in flight.
         for (size_t gnum = 0; gnum < m_networks.size(); gnum++) {
-            // launch the worker thread.  2 threads so that we can fully
-            // utilize GPU, since the worker thread consists of some CPU
-            // work for task preparation.
-            constexpr auto num_threads = 2;
-            for (auto i = 0; i < num_threads; i++) {
-                m_threadpool.add_thread([gnum] {
-                    current_thread_gpu_num = gnum;
-                });
+            m_batch_workers.emplace_back([this, gnum, bind_to_device] {
+                bind_to_device(gnum);
+                batch_worker(gnum);
+            });
+        }
+        // The CPU workers run one batch at a time each. Like the GPUs
+        // they take a new batch whenever they are done, so they get a
+        // share of the work in proportion to their speed.
+        const auto cpu = m_networks.size();
+        for (auto i = 0; m_cpu_forward && i < cfg_cpu_threads; i++) {
+            m_batch_workers.emplace_back([this, cpu] {
+                m_forward_queue.run_worker(
+                    cfg_batch_size, std::chrono::microseconds(cfg_batch_wait),
+                    [this, cpu](const std::vector<float>& input,
+                                std::vector<float>& output_pol,
+                                std::vector<float>& output_val,
+                                std::vector<float>& output_vbe,
+                                const int batch_size) {
+                        begin_forward(cpu, batch_size);
+                        run_timed(cpu, input, output_pol, output_val,
+                                  output_vbe, batch_size);
+                    });
+            });
+        }
+        myprintf("Batching up to %d evaluations, waiting at most %d us, "
+                 "%d batch(es) in flight.\n",
+                 cfg_batch_size, cfg_batch_wait, cfg_pipeline_depth);
+    }
+}
+
+size_t OpenCLScheduler::device_count() const {
+    return m_networks.size() + (m_cpu_forward ? 1 : 0);
+}
+
+void OpenCLScheduler::begin_forward(const size_t gnum, const int positions) {
+    std::lock_guard<std::mutex> lock(m_stats_mutex);
+    auto& stats = m_stats[gnum];
+    if (stats.pending == 0) {
+        stats.busy_since = std::chrono::steady_clock::now();
+    }
+    stats.pending += positions;
+}
+
+void OpenCLScheduler::end_forward(const size_t gnum, const int positions,
+                                  const double seconds) {
+    std::lock_guard<std::mutex> lock(m_stats_mutex);
+    auto& stats = m_stats[gnum];
+    stats.pending -= positions;
+    stats.evals += positions;
+    // Failed evaluations are not timed.
+    if (seconds > 0.0) {
+        const auto latency = seconds / positions;
+        if (stats.latency == 0.0) {
+            stats.latency = latency;
+        } else {
+            stats.latency += LATENCY_DECAY * (latency - stats.latency);
+        }
+    }
+    if (stats.pending == 0) {
+        const auto busy = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - stats.busy_since).count();
+        stats.busy += busy;
+        if (gnum < m_networks.size()) {
+            Metrics::add_device_busy(static_cast<int>(gnum), busy);
+        }
+    }
+}
+
+size_t OpenCLScheduler::pick_device(const int positions) {
+    std::lock_guard<std::mutex> lock(m_stats_mutex);
+    // The device that would finish these positions first, given the
+    // ones ahead of them. Devices without a measured latency go first.
+    auto best = size_t{0};
+    auto best_time = std::numeric_limits<double>::infinity();
+    for (size_t gnum = 0; gnum < m_stats.size(); gnum++) {
+        const auto& stats = m_stats[gnum];
+        const auto time = (stats.pending + positions) * stats.latency;
+        if (time < best_time) {
+            best = gnum;
+            best_time = time;
+        }
+    }
+    return best;
+}
+
+std::vector<OpenCLScheduler::DeviceUsage>
+OpenCLScheduler::get_device_usage() {
+    std::lock_guard<std::mutex> lock(m_stats_mutex);
+    const auto now = std::chrono::steady_clock::now();
+    const auto elapsed =
+        std::chrono::duration<double>(now - m_stats_start).count();
+    auto usage = std::vector<DeviceUsage>{};
+    for (const auto& stats : m_stats) {
+        auto busy = stats.busy;
+        if (stats.pending > 0) {
+            busy += std::chrono::duration<double>(
+                now - stats.busy_since).count();
+        }
+        usage.push_back({stats.evals, stats.latency,
+                         elapsed > 0.0 ? busy / elapsed : 0.0});
+    }
+    return usage;
+}
+
+void OpenCLScheduler::reset_device_usage() {
+    std::lock_guard<std::mutex> lock(m_stats_mutex);
+    const auto now = std::chrono::steady_clock::now();
+    m_stats_start = now;
+    for (auto& stats : m_stats) {
+        stats.evals = 0;
+        stats.busy = 0.0;
+        stats.busy_since = now;
+    }
+}
+
+bool OpenCLScheduler::uses_half() const {
+    for (const auto& opencl : m_opencl) {
+        if (opencl->uses_half()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string OpenCLScheduler::get_device_names() const {
+    auto names = std::string{};
+    for (const auto& opencl : m_opencl) {
+        names += (names.empty() ? "" : "+") + opencl->get_device_name();
+    }
+    if (m_cpu_forward) {
+        names += "+CPU";
+    }
+    return names;
+}
+
+void OpenCLScheduler::batch_worker(const size_t gnum) {
+    auto& net = *m_networks[gnum];
+    const auto depth = static_cast<size_t>(cfg_pipeline_depth);
+    const auto max_wait = std::chrono::microseconds(cfg_batch_wait);
+
+    // Batches in flight live in a ring, the slot number is also the
+    // index of the queue and buffers they use on the device.
+    auto batches = std::vector<ForwardQueue<float>::Batch>(depth);
+    auto starts = std::vector<Time>(depth);
+    auto oldest = size_t{0};
+    auto in_flight = size_t{0};
+    auto running = true;
+
+    while (running || in_flight > 0) {
+        // The search threads waiting on a finished batch are the ones
+        // that would fill the next one, so hand its results back first.
+        const auto oldest_done = in_flight > 0 && net.forward_ready(oldest);
+        if (running && in_flight < depth && !oldest_done) {
+            const auto slot = (oldest + in_flight) % depth;
+            auto& batch = batches[slot];
+            // Only block and wait for a full batch when the device is
+            // idle. Otherwise take what is there while it works on the
+            // batches already in flight.
+            const auto idle = in_flight == 0;
+            running = m_forward_queue.pop_batch(
+                batch, cfg_batch_size,
+                idle ? max_wait : std::chrono::microseconds(0), idle);
+            if (!batch.tasks.empty()) {
+                try {
+                    begin_forward(gnum, batch.size());
+                    starts[slot] = Time();
+                    net.forward_async(batch.input, batch.size(), slot);
+                    in_flight++;
+                } catch (...) {
+                    end_forward(gnum, batch.size(), 0.0);
+                    m_forward_queue.fail(batch, std::current_exception());
+                }
+                continue;
+            }
+            if (in_flight == 0) {
+                continue;
             }
         }
-    } else {
-        auto opencl = std::make_unique<OpenCL>();
-        auto net = std::make_unique<OpenCL_Network>(*opencl);
-        opencl->initialize(channels, {});
 
-        m_opencl.push_back(std::move(opencl));
-        m_networks.push_back(std::move(net));
+        auto& batch = batches[oldest];
+        try {
+            net.forward_wait(batch.output_pol, batch.output_val,
+                             batch.output_vbe, oldest);
+            m_forward_queue.complete(batch);
+        } catch (...) {
+            m_forward_queue.fail(batch, std::current_exception());
+        }
+        const auto end = Time();
+#ifdef USE_PROFILING
+        Profile::record(Profile::COMPUTE, starts[oldest], end);
+#endif
+        end_forward(gnum, batch.size(),
+                    Time::timediff_seconds(starts[oldest], end));
+        oldest = (oldest + 1) % depth;
+        in_flight--;
     }
 }
 
-void OpenCLScheduler::forward(const std::vector<net_t>& input,
-                              std::vector<net_t>& output_pol,
-                              std::vector<net_t>& output_val,
-                              std::vector<net_t>& output_vbe) {
-    if (m_networks.size() == 1) {
-        m_networks[0]->forward(input, output_pol, output_val, output_vbe);
+void OpenCLScheduler::forward(const std::vector<float>& input,
+                              std::vector<float>& output_pol,
+                              std::vector<float>& output_val,
+                              std::vector<float>& output_vbe,
+                              const int batch_size) {
+    // Batches built by the caller are run as they are.
+    if (cfg_batch_size > 1 && batch_size == 1) {
+        m_forward_queue.forward(input, output_pol, output_val, output_vbe);
+        return;
+    }
+
+    if (device_count() == 1) {
+        begin_forward(0, batch_size);
+        run_timed(0, input, output_pol, output_val, output_vbe, batch_size);
         return;
     }
 
-    auto f = m_threadpool.add_task([this, &input, &output_pol, &output_val, &output_vbe]{
-        m_networks[current_thread_gpu_num]->forward(input, output_pol, output_val, output_vbe);
+    // Every device has its own queue, the evaluation goes to the one
+    // expected to finish it first.
+    const auto gnum = pick_device(batch_size);
+    begin_forward(gnum, batch_size);
+    Utils::ThreadGroup tg(*m_device_pools[gnum]);
+    tg.add_task([this, gnum, &input, &output_pol, &output_val, &output_vbe,
+                 batch_size] {
+        run_timed(gnum, input, output_pol, output_val, output_vbe,
+                  batch_size);
     });
+    tg.wait_all();
+}
 
-    f.get();
+void OpenCLScheduler::run_timed(const size_t gnum,
+                                const std::vector<float>& input,
+                                std::vector<float>& output_pol,
+                                std::vector<float>& output_val,
+                                std::vector<float>& output_vbe,
+                                const int batch_size) {
+    const auto start = std::chrono::steady_clock::now();
+    PROFILE_SCOPE(COMPUTE);
+    try {
+        if (gnum < m_networks.size()) {
+            m_networks[gnum]->forward(input, output_pol, output_val,
+                                      output_vbe, batch_size);
+        } else {
+            m_cpu_forward(input, output_pol, output_val, output_vbe,
+                          batch_size);
+        }
+    } catch (...) {
+        end_forward(gnum, batch_size, 0.0);
+        throw;
+    }
+    end_forward(gnum, batch_size,
+                std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start).count());
+}
+
+void OpenCLScheduler::dump_batch_stats() {
+    m_forward_queue.dump_stats(cfg_batch_size);
+    const auto usage = get_device_usage();
+    for (size_t gnum = 0; gnum < usage.size(); gnum++) {
+        if (usage[gnum].evals == 0) {
+            continue;
+        }
+        const auto name = gnum < m_networks.size()
+            ? "GPU " + std::to_string(gnum) : std::string("CPU");
+        myprintf("%s: %llu evaluations, %.3f ms each, %.1f%% busy\n",
+                 name.c_str(),
+                 static_cast<unsigned long long>(usage[gnum].evals),
+                 usage[gnum].latency * 1000.0,
+                 100.0 * usage[gnum].utilization);
+    }
+    reset_device_usage();
 }
 #endif
@@ -21,39 +21,113 @@
 #define OPENCL_SCHEDULER_H_INCLUDED
 #include "config.h"
 
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
-#include <future>
 
+#include "ForwardQueue.h"
 #include "OpenCL.h"
 #include "ThreadPool.h"
 
 class OpenCLScheduler {
 public:
-    void initialize(const int channels);
+    ~OpenCLScheduler();
+    using push_weights_fn = std::function<void(OpenCL_Network&)>;
+    using forward_fn = ForwardQueue<float>::forward_fn;
+
+    // max_batch_size is the largest batch passed to forward(), it must be
+    // at least cfg_batch_size. push_weights is called for every network
+    // that gets created; with --precision auto that is one per precision
+    // and device, as both are tried out before picking one. The devices
+    // are set up in parallel, so push_weights must be thread safe.
+    // With share the devices, contexts and compiled kernels of that
+    // scheduler are used, so several networks fit next to each other.
+    // With cpu_forward and --cpu-threads the CPU is one more device,
+    // after the GPUs; it must fill the same outputs as forward().
+    void initialize(const int channels, const int max_batch_size,
+                    push_weights_fn push_weights,
+                    forward_fn cpu_forward = nullptr,
+                    const OpenCLScheduler* const share = nullptr);
+    // True if any of the devices stores the network in half precision.
+    bool uses_half() const;
+    // The names of the devices, with a + between them.
+    std::string get_device_names() const;
     std::vector<std::unique_ptr<OpenCL_Network>> & get_networks() {
         return m_networks;
     }
-    void forward(const std::vector<net_t>& input,
-                 std::vector<net_t>& output_pol,
-                 std::vector<net_t>& output_val,
-                 std::vector<net_t>& output_vbe);
+    void forward(const std::vector<float>& input,
+                 std::vector<float>& output_pol,
+                 std::vector<float>& output_val,
+                 std::vector<float>& output_vbe,
+                 const int batch_size = 1);
+
+    // Prints the batch fill and the usage of every device since the
+    // last call.
+    void dump_batch_stats();
+
+    struct DeviceUsage {
+        std::uint64_t evals;
+        // Moving average of the seconds per position.
+        double latency;
+        // Fraction of the time with evaluations on the device.
+        double utilization;
+    };
+    // Counters since dump_batch_stats() was last called.
+    std::vector<DeviceUsage> get_device_usage();
 private:
-    class ForwardTask {
-    public:
-        const std::vector<net_t> *input;
-        std::vector<net_t> * output;
-        std::promise<void> prom;
-        ForwardTask() : input(nullptr), output(nullptr) {}
-        ForwardTask(const std::vector<net_t> * in,
-                    std::vector<net_t> * out)
-            : input(in), output(out) {}
+    // How much a new latency measurement moves the average.
+    static constexpr auto LATENCY_DECAY = 0.05;
+
+    struct DeviceStats {
+        // Positions given to the device and not finished yet.
+        int pending{0};
+        double latency{0.0};
+        std::uint64_t evals{0};
+        // Seconds with evaluations on the device, not counting the
+        // current stretch that started at busy_since.
+        double busy{0.0};
+        std::chrono::steady_clock::time_point busy_since;
     };
 
+    // The GPUs, and the CPU if it evaluates as well.
+    size_t device_count() const;
+    // One evaluation on device gnum, after begin_forward().
+    void run_timed(size_t gnum,
+                   const std::vector<float>& input,
+                   std::vector<float>& output_pol,
+                   std::vector<float>& output_val,
+                   std::vector<float>& output_vbe,
+                   int batch_size);
+    void begin_forward(size_t gnum, int positions);
+    void end_forward(size_t gnum, int positions, double seconds);
+    size_t pick_device(int positions);
+    void reset_device_usage();
+
+    // Feeds the network of one GPU from m_forward_queue, keeping up to
+    // cfg_pipeline_depth batches in flight.
+    void batch_worker(size_t gnum);
+
     std::vector<std::unique_ptr<OpenCL_Network>> m_networks;
-    std::vector<std::unique_ptr<OpenCL>> m_opencl;
-    Utils::ThreadPool m_threadpool;
-};
+    std::vector<std::shared_ptr<OpenCL>> m_opencl;
+    forward_fn m_cpu_forward;
+
+    // Without batching every device with more than one in the
+    // scheduler gets its own queue and cfg_pipeline_depth threads,
+    // cfg_cpu_threads for the CPU.
+    std::vector<std::unique_ptr<Utils::ThreadPool>> m_device_pools;
 
-extern OpenCLScheduler opencl;
+    std::mutex m_stats_mutex;
+    std::vector<DeviceStats> m_stats;
+    std::chrono::steady_clock::time_point m_stats_start;
+
+    // Cross-thread batching, only used when cfg_batch_size > 1.
+    ForwardQueue<float> m_forward_queue;
+    std::vector<std::thread> m_batch_workers;
+};
 
 #endif
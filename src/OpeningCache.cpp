@@ -0,0 +1,212 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "OpeningCache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <unordered_set>
+#include <utility>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "FastBoard.h"
+#include "GameState.h"
+#include "Utils.h"
+
+using namespace Utils;
+
+constexpr char OpeningCache::MAGIC[];
+
+OpeningCache& OpeningCache::get_OpeningCache() {
+    static OpeningCache cache;
+    return cache;
+}
+
+OpeningCache::~OpeningCache() {
+#ifndef _WIN32
+    if (m_map) {
+        munmap(m_map, m_map_size);
+    }
+#endif
+}
+
+bool OpeningCache::open(const std::string& filename) {
+    auto data = static_cast<const char*>(nullptr);
+    auto size = size_t{0};
+#ifdef _WIN32
+    auto file = std::ifstream(filename, std::ios::binary);
+    m_buffer.assign(std::istreambuf_iterator<char>(file),
+                    std::istreambuf_iterator<char>());
+    data = m_buffer.data();
+    size = m_buffer.size();
+#else
+    const auto fd = ::open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        const auto mem = mmap(nullptr, st.st_size, PROT_READ,
+                              MAP_SHARED, fd, 0);
+        if (mem != MAP_FAILED) {
+            // The lookups are binary searches all over the file.
+            madvise(mem, st.st_size, MADV_RANDOM);
+            m_map = mem;
+            m_map_size = st.st_size;
+            data = static_cast<const char*>(mem);
+            size = m_map_size;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+#endif
+
+    auto header = Header{};
+    if (size >= sizeof(header)) {
+        std::memcpy(&header, data, sizeof(header));
+    }
+    if (size < sizeof(header)
+        || std::memcmp(header.magic, MAGIC, sizeof(header.magic)) != 0
+        || header.version != VERSION
+        || header.board_size != BOARD_SIZE
+        || size != sizeof(header) + header.count * sizeof(Record)) {
+        myprintf("Not an opening cache for this board: %s\n",
+                 filename.c_str());
+#ifdef _WIN32
+        m_buffer.clear();
+#else
+        if (m_map) {
+            munmap(m_map, m_map_size);
+            m_map = nullptr;
+        }
+#endif
+        return false;
+    }
+    m_records = reinterpret_cast<const Record*>(data + sizeof(header));
+    m_count = header.count;
+    m_max_movenum = header.max_movenum;
+    m_net_key = header.net_key;
+    myprintf("Opening cache with %zu positions up to move %zu.\n",
+             m_count, m_max_movenum);
+    return true;
+}
+
+bool OpeningCache::lookup(const std::uint64_t hash,
+                          Network::Netresult& result) const {
+    const auto end = m_records + m_count;
+    const auto record = std::lower_bound(
+        m_records, end, hash,
+        [](const Record& r, const std::uint64_t h) { return r.hash < h; });
+    if (record == end || record->hash != hash) {
+        return false;
+    }
+    std::copy(record->policy, record->policy + BOARD_SQUARES,
+              begin(result.policy));
+    result.policy_pass = record->policy_pass;
+    result.value = record->value;
+    result.alpha = record->alpha;
+    result.beta = record->beta;
+    return true;
+}
+
+bool OpeningCache::write(const std::string& filename,
+                         const GameState& state,
+                         const int plies, const int width) {
+    auto records = std::vector<Record>();
+    auto seen = std::unordered_set<std::uint64_t>();
+    auto net_key = std::uint64_t{0};
+    // One ply at a time, so a position reached by transposition is only
+    // expanded at its shortest distance from state.
+    auto level = std::vector<GameState>{state};
+    for (auto ply = 0; ply <= plies && !level.empty(); ply++) {
+        auto next = std::vector<GameState>();
+        for (auto& position : level) {
+            auto symmetry = 0;
+            const auto hash = position.get_canonical_hash(symmetry);
+            if (!seen.insert(hash).second) {
+                continue;
+            }
+            auto canonical = Network::Netresult{};
+            const auto result = Network::get_opening_scored_moves(
+                &position, canonical, net_key);
+
+            auto record = Record{};
+            record.hash = hash;
+            std::copy(begin(canonical.policy), end(canonical.policy),
+                      record.policy);
+            record.policy_pass = canonical.policy_pass;
+            record.value = canonical.value;
+            record.alpha = canonical.alpha;
+            record.beta = canonical.beta;
+            records.emplace_back(record);
+
+            if (ply == plies || position.get_passes() >= 2) {
+                continue;
+            }
+            auto moves = std::vector<Network::ScoreVertexPair>();
+            const auto legal =
+                position.get_legal_moves(position.get_to_move());
+            for (auto i = 0; i < BOARD_SQUARES; i++) {
+                if (legal[i]) {
+                    moves.emplace_back(result.policy[i],
+                                       position.board.get_vertex(
+                                           i % BOARD_SIZE, i / BOARD_SIZE));
+                }
+            }
+            const auto count = std::min(moves.size(), size_t(width));
+            std::partial_sort(begin(moves), begin(moves) + count, end(moves),
+                              std::greater<Network::ScoreVertexPair>());
+            for (auto i = size_t{0}; i < count; i++) {
+                next.emplace_back(position);
+                next.back().play_move(moves[i].second);
+            }
+        }
+        level = std::move(next);
+    }
+
+    std::sort(begin(records), end(records),
+              [](const Record& a, const Record& b) { return a.hash < b.hash; });
+    auto header = Header{};
+    std::memcpy(header.magic, MAGIC, sizeof(header.magic));
+    header.version = VERSION;
+    header.board_size = BOARD_SIZE;
+    header.max_movenum = static_cast<std::uint32_t>(
+        state.get_movenum() + plies);
+    header.net_key = net_key;
+    header.count = records.size();
+
+    auto file = std::ofstream(filename, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(records.data()),
+               records.size() * sizeof(Record));
+    file.close();
+    if (!file) {
+        myprintf("Could not write %s.\n", filename.c_str());
+        return false;
+    }
+    myprintf("Wrote %zu positions to %s.\n", records.size(),
+             filename.c_str());
+    return true;
+}
@@ -0,0 +1,102 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OPENINGCACHE_H_INCLUDED
+#define OPENINGCACHE_H_INCLUDED
+
+#include "config.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Network.h"
+
+class GameState;
+
+// A read-only file of network evaluations of the opening, for
+// --opening-cache. The evaluations are looked up before the NNCache, and
+// only for the network the file was written with. Positions are keyed
+// by their canonical hash, with the policy in that orientation.
+//
+// The file is a header and then the records sorted by hash, in the byte
+// order of the host. It is mapped into memory where we can, so engines
+// on the same host share its pages.
+class OpeningCache {
+public:
+    // return the global OpeningCache
+    static OpeningCache& get_OpeningCache();
+
+    // Maps the file, once before any evaluation. Returns false, and
+    // keeps no file, if it can't be read.
+    bool open(const std::string& filename);
+
+    // Whether there are evaluations of that network for moves up to
+    // movenum.
+    bool covers(std::uint64_t net_key, size_t movenum) const {
+        return m_count > 0 && net_key == m_net_key
+            && movenum <= m_max_movenum;
+    }
+
+    // Finds a position by its canonical hash, the policy is in the
+    // canonical orientation. Call only when covers().
+    bool lookup(std::uint64_t hash, Network::Netresult& result) const;
+
+    // Evaluates the positions up to plies moves from state, following
+    // the width likeliest moves of each, and writes them to filename.
+    static bool write(const std::string& filename, const GameState& state,
+                      int plies, int width);
+
+private:
+    OpeningCache() = default;
+    ~OpeningCache();
+
+    static constexpr char MAGIC[] = "SAIO";
+    static constexpr std::uint32_t VERSION = 1;
+
+    struct Header {
+        char magic[4];
+        std::uint32_t version;
+        std::uint32_t board_size;
+        std::uint32_t max_movenum;
+        std::uint64_t net_key;
+        std::uint64_t count;
+    };
+
+    struct Record {
+        std::uint64_t hash;
+        float policy[BOARD_SQUARES];
+        float policy_pass;
+        float value;
+        float alpha;
+        float beta;
+    };
+
+#ifdef _WIN32
+    std::vector<char> m_buffer;
+#else
+    void* m_map{nullptr};
+    size_t m_map_size{0};
+#endif
+    const Record* m_records{nullptr};
+    size_t m_count{0};
+    size_t m_max_movenum{0};
+    std::uint64_t m_net_key{0};
+};
+
+#endif
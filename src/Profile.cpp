@@ -0,0 +1,174 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "Profile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <boost/format.hpp>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include "Metrics.h"
+
+namespace {
+    const char* const PHASE_NAMES[] = {
+        "select", "lock_wait", "gather", "queue", "compute", "heads", "backup"
+    };
+    static_assert(sizeof(PHASE_NAMES) / sizeof(PHASE_NAMES[0])
+                  == Profile::NUM_PHASES, "Every phase has a name.");
+    static_assert(Metrics::PHASE_BACKUP - Metrics::PHASE_SELECT + 1
+                  == Profile::NUM_PHASES, "Every phase has a histogram.");
+
+    // About 6 MB per thread.
+    constexpr auto MAX_EVENTS = size_t{1} << 18;
+
+    struct Event {
+        Profile::Phase phase;
+        // Nanoseconds since the epoch of the trace.
+        std::int64_t start;
+        std::int64_t duration;
+    };
+
+    // The lock is only ever contended while the trace is saved.
+    struct ThreadEvents {
+        std::mutex mutex;
+        int thread;
+        std::vector<Event> events;
+    };
+
+    struct Trace {
+        std::mutex mutex;
+        std::vector<std::shared_ptr<ThreadEvents>> threads;
+        std::atomic<bool> recording{false};
+        Time epoch;
+    };
+
+    // Never destroyed, threads may still end while the program exits.
+    Trace& trace() {
+        static auto trace = new Trace();
+        return *trace;
+    }
+
+    thread_local std::shared_ptr<ThreadEvents> t_events;
+
+    ThreadEvents& local_events() {
+        if (!t_events) {
+            auto& t = trace();
+            std::lock_guard<std::mutex> lock(t.mutex);
+            t_events = std::make_shared<ThreadEvents>();
+            t_events->thread = static_cast<int>(t.threads.size());
+            t.threads.emplace_back(t_events);
+        }
+        return *t_events;
+    }
+}
+
+bool Profile::enabled() {
+#ifdef USE_PROFILING
+    return true;
+#else
+    return false;
+#endif
+}
+
+const char* Profile::get_name(const Phase phase) {
+    return PHASE_NAMES[phase];
+}
+
+void Profile::record(const Phase phase, const Time start, const Time end) {
+    const auto nanos = std::max(Time::timediff_nanos(start, end),
+                                std::int64_t{0});
+    Metrics::observe(
+        static_cast<Metrics::Histogram>(Metrics::PHASE_SELECT + phase),
+        static_cast<std::uint64_t>(nanos));
+
+    auto& t = trace();
+    if (!t.recording.load(std::memory_order_relaxed)) {
+        return;
+    }
+    auto& local = local_events();
+    std::lock_guard<std::mutex> lock(local.mutex);
+    if (local.events.size() < MAX_EVENTS) {
+        local.events.push_back(
+            {phase, Time::timediff_nanos(t.epoch, start), nanos});
+    }
+}
+
+std::string Profile::summary() {
+    auto out = std::ostringstream{};
+    out << boost::format("%-10s %10s %10s %9s %9s %9s")
+        % "phase" % "count" % "total ms" % "mean us" % "p50 us" % "p99 us";
+    for (auto p = 0; p < NUM_PHASES; p++) {
+        const auto histogram = Metrics::get(
+            static_cast<Metrics::Histogram>(Metrics::PHASE_SELECT + p));
+        const auto count = histogram.count();
+        // The percentiles are bucket bounds, powers of two.
+        out << boost::format("\n%-10s %10d %10.1f %9.2f %9.2f %9.2f")
+            % PHASE_NAMES[p] % count % (histogram.sum * 1e-6)
+            % (count > 0 ? histogram.sum * 1e-3 / count : 0.0)
+            % (histogram.percentile(0.5) * 1e-3)
+            % (histogram.percentile(0.99) * 1e-3);
+    }
+    return out.str();
+}
+
+void Profile::start_trace() {
+    auto& t = trace();
+    std::lock_guard<std::mutex> lock(t.mutex);
+    t.recording = false;
+    for (const auto& thread : t.threads) {
+        std::lock_guard<std::mutex> thread_lock(thread->mutex);
+        thread->events.clear();
+    }
+    t.recording = true;
+}
+
+bool Profile::save_trace(const std::string& filename) {
+    auto& t = trace();
+    std::lock_guard<std::mutex> lock(t.mutex);
+    t.recording = false;
+
+    auto file = std::ofstream{filename};
+    if (!file) {
+        return false;
+    }
+    // Chrome trace event format, the times are in microseconds.
+    file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    auto first = true;
+    for (const auto& thread : t.threads) {
+        std::lock_guard<std::mutex> thread_lock(thread->mutex);
+        for (const auto& event : thread->events) {
+            file << (first ? "\n" : ",\n")
+                 << boost::format("{\"name\":\"%s\",\"ph\":\"X\","
+                                  "\"ts\":%.3f,\"dur\":%.3f,"
+                                  "\"pid\":0,\"tid\":%d}")
+                    % PHASE_NAMES[event.phase] % (event.start * 1e-3)
+                    % (event.duration * 1e-3) % thread->thread;
+            first = false;
+        }
+        thread->events.clear();
+    }
+    file << "\n]}\n";
+    return file.good();
+}
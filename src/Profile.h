@@ -0,0 +1,94 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROFILE_H_INCLUDED
+#define PROFILE_H_INCLUDED
+
+#include "config.h"
+
+#include <string>
+
+#include "Timing.h"
+
+// Where the time of the playouts goes, with USE_PROFILING. The phases
+// are timed by PROFILE_SCOPE, which is empty in other builds, and every
+// thread adds the times to its histograms in Metrics. Phases may nest,
+// a lock wait during the selection counts for both.
+//
+// While a trace is recording every timed phase is also kept as an
+// event, and saved in the Chrome trace format that chrome://tracing and
+// Perfetto load.
+namespace Profile {
+    enum Phase {
+        // UCTNode::uct_select_child.
+        SELECT,
+        // Waits for a taken SMP::Lock.
+        LOCK_WAIT,
+        // Input planes of the network.
+        GATHER,
+        // From the ForwardQueue to the batch worker.
+        QUEUE,
+        // The network on the GPU or the CPU.
+        COMPUTE,
+        // Fully connected heads and their outputs.
+        HEADS,
+        // The evals going back up the tree.
+        BACKUP,
+        NUM_PHASES
+    };
+
+    // Whether the build times the phases at all.
+    bool enabled();
+    // Lowercase, like "select".
+    const char* get_name(Phase phase);
+
+    void record(Phase phase, Time start, Time end);
+
+    class ScopedTimer {
+    public:
+        explicit ScopedTimer(const Phase phase) : m_phase(phase) {}
+        ~ScopedTimer() {
+            record(m_phase, m_start, Time());
+        }
+
+        ScopedTimer(const ScopedTimer&) = delete;
+        ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+    private:
+        Phase m_phase;
+        Time m_start;
+    };
+
+    // Count, total and percentiles of every phase.
+    std::string summary();
+
+    // Drops the events recorded so far and records the next ones.
+    void start_trace();
+    // Stops recording and writes the events, false if the file
+    // can't be written.
+    bool save_trace(const std::string& filename);
+}
+
+#ifdef USE_PROFILING
+#define PROFILE_SCOPE(phase) \
+    Profile::ScopedTimer profile_scope_timer(Profile::phase)
+#else
+#define PROFILE_SCOPE(phase)
+#endif
+
+#endif
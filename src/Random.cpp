@@ -19,6 +19,7 @@
 #include "config.h"
 #include "Random.h"
 
+#include <atomic>
 #include <climits>
 #include <cstdint>
 #include <thread>
@@ -27,11 +28,28 @@
 #include "GTP.h"
 #include "Utils.h"
 
+// Bumped by seed_all, the threads reseed when they see it change.
+static std::atomic<std::uint64_t> s_seed_generation{0};
+
 Random& Random::get_Rng(void) {
     static thread_local Random s_rng{0};
+    static thread_local std::uint64_t s_generation{0};
+    const auto generation = s_seed_generation.load(std::memory_order_acquire);
+    if (s_generation != generation) {
+        s_generation = generation;
+        s_rng = Random{0};
+    }
     return s_rng;
 }
 
+void Random::seed_all(const std::uint64_t seed) {
+    cfg_rng_seed = seed;
+    s_seed_generation.fetch_add(1, std::memory_order_release);
+    // Like the start of the program, the calling thread is the main
+    // one and its seed doesn't mix in the thread id.
+    get_Rng().seedrandom(seed);
+}
+
 Random::Random(std::uint64_t seed) {
     if (seed == 0) {
         size_t thread_id =
@@ -52,6 +52,10 @@ public:
     // return the thread local RNG
     static Random& get_Rng(void);
 
+    // Reseed the RNGs of all the threads, as if the program started
+    // with this seed. Call it while no search runs.
+    static void seed_all(std::uint64_t seed);
+
     // UniformRandomBitGenerator interface
     using result_type = std::uint64_t;
     constexpr static result_type min() {
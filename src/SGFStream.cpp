@@ -0,0 +1,332 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "SGFStream.h"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "GTP.h"
+
+using string_view = SGFGame::string_view;
+
+static bool is_space(const char c) {
+    return std::isspace(static_cast<unsigned char>(c));
+}
+
+static bool is_letter(const char c) {
+    return std::isalpha(static_cast<unsigned char>(c));
+}
+
+template <typename T>
+static T to_number(const string_view value, const T fallback) {
+    auto strm = std::istringstream{value.to_string()};
+    auto result = fallback;
+    strm >> result;
+    return result;
+}
+
+// Same as SGFTree::string_to_vertex.
+static int to_vertex(const FastBoard& board, const string_view move) {
+    if (move.size() == 0) {
+        return FastBoard::PASS;
+    }
+    const auto bsize = board.get_boardsize();
+    if (bsize <= 19 && move == "tt") {
+        return FastBoard::PASS;
+    }
+    if (move.size() < 2) {
+        throw std::runtime_error("Illegal SGF move");
+    }
+
+    const auto coordinate = [](const char c) {
+        if (c >= 'A' && c <= 'Z') {
+            return 26 + c - 'A';
+        }
+        return c - 'a';
+    };
+    const auto x = coordinate(move[0]);
+    const auto y = bsize - coordinate(move[1]) - 1;
+    if (x < 0 || x >= bsize || y < 0 || y >= bsize) {
+        throw std::runtime_error("Illegal SGF move");
+    }
+    return board.get_vertex(x, y);
+}
+
+bool SGFGame::read_node(size_t& pos, Node& node) const {
+    node.clear();
+    // Entering a variation keeps us on the main line, because the first
+    // one is the main line. It ends where that variation does.
+    while (pos < m_text.size() && m_text[pos] != ';') {
+        if (m_text[pos] == ')') {
+            return false;
+        }
+        pos++;
+    }
+    if (pos == m_text.size()) {
+        return false;
+    }
+    pos++;
+
+    while (true) {
+        while (pos < m_text.size() && is_space(m_text[pos])) {
+            pos++;
+        }
+        // Some implementations use lowercase letters in the names.
+        const auto name_start = pos;
+        while (pos < m_text.size() && is_letter(m_text[pos])) {
+            pos++;
+        }
+        if (pos == name_start) {
+            return true;
+        }
+        const auto name = m_text.substr(name_start, pos - name_start);
+
+        while (true) {
+            while (pos < m_text.size() && is_space(m_text[pos])) {
+                pos++;
+            }
+            if (pos == m_text.size() || m_text[pos] != '[') {
+                break;
+            }
+            const auto value_start = ++pos;
+            while (pos < m_text.size() && m_text[pos] != ']') {
+                if (m_text[pos] == '\\') {
+                    pos++;
+                }
+                pos++;
+            }
+            pos = std::min(pos, m_text.size());
+            node.push_back({name,
+                            m_text.substr(value_start, pos - value_start)});
+            if (pos < m_text.size()) {
+                pos++;
+            }
+        }
+    }
+}
+
+string_view SGFGame::get_property(const std::string& name) const {
+    auto pos = size_t{0};
+    auto node = Node{};
+    if (read_node(pos, node)) {
+        for (const auto& property : node) {
+            if (property.name == name) {
+                return property.value;
+            }
+        }
+    }
+    return {};
+}
+
+FastBoard::square_t SGFGame::get_winner() const {
+    const auto result = get_property("RE");
+    if (result.empty() || result.find("Time") != string_view::npos) {
+        return FastBoard::EMPTY;
+    }
+    if (result.starts_with("W+")) {
+        return FastBoard::WHITE;
+    }
+    if (result.starts_with("B+")) {
+        return FastBoard::BLACK;
+    }
+    return FastBoard::INVAL;
+}
+
+GameState SGFGame::follow_mainline_state(std::vector<int>& moves) const {
+    moves.clear();
+    auto state = GameState{};
+    auto pos = size_t{0};
+    auto root = Node{};
+    if (!read_node(pos, root)) {
+        state.init_game(BOARD_SIZE, cfg_komi);
+        return state;
+    }
+
+    const auto property = [](const Node& node, const char* name) {
+        for (const auto& prop : node) {
+            if (prop.name == name) {
+                return &prop.value;
+            }
+        }
+        return static_cast<const string_view*>(nullptr);
+    };
+
+    const auto game = property(root, "GM");
+    if (game && *game != "1") {
+        throw std::runtime_error("SGF Game is not a Go game");
+    }
+    // The SGF spec defines the default size for Go.
+    const auto size = property(root, "SZ");
+    if ((size ? to_number(*size, 0) : 19) != BOARD_SIZE) {
+        throw std::runtime_error("Board size not supported.");
+    }
+    const auto komi = property(root, "KM");
+    state.init_game(BOARD_SIZE, komi ? to_number(*komi, cfg_komi) : cfg_komi);
+    const auto handicap = property(root, "HA");
+    if (handicap) {
+        state.set_handicap(int(to_number(*handicap, 0.0f)));
+    }
+
+    const auto setup = [&](const Node& node, const int color) {
+        const auto name = (color == FastBoard::BLACK ? "AB" : "AW");
+        for (const auto& prop : node) {
+            if (prop.name != name) {
+                continue;
+            }
+            const auto vertex = to_vertex(state.board, prop.value);
+            if (vertex == FastBoard::PASS) {
+                continue;
+            }
+            const auto square = state.board.get_square(vertex);
+            if (square == !color || square == FastBoard::INVAL) {
+                throw std::runtime_error("Illegal move");
+            }
+            // Playing on an occupied square is legal in SGF setup,
+            // but we can't really handle it, as in SGFTree.
+            if (square == color) {
+                continue;
+            }
+            state.play_move(color, vertex);
+        }
+    };
+    // Some Go apps put the handicap stones in the node after the root.
+    if (state.get_handicap() > 0 && !property(root, "AB")) {
+        auto next_pos = pos;
+        auto next = Node{};
+        if (read_node(next_pos, next)) {
+            setup(next, FastBoard::BLACK);
+        }
+    }
+    setup(root, FastBoard::BLACK);
+    setup(root, FastBoard::WHITE);
+    const auto to_move = property(root, "PL");
+    if (to_move && *to_move == "W") {
+        state.set_to_move(FastBoard::WHITE);
+    } else if (to_move && *to_move == "B") {
+        state.set_to_move(FastBoard::BLACK);
+    }
+    state.anchor_game_history();
+
+    auto node = Node{};
+    while (read_node(pos, node)) {
+        for (const auto& prop : node) {
+            if (prop.name != "B" && prop.name != "W") {
+                continue;
+            }
+            const auto color =
+                (prop.name == "B" ? FastBoard::BLACK : FastBoard::WHITE);
+            const auto vertex = to_vertex(state.board, prop.value);
+            if (vertex != FastBoard::PASS
+                && state.board.get_square(vertex) != FastBoard::EMPTY) {
+                return state;
+            }
+            state.play_move(color, vertex);
+            moves.push_back(vertex);
+            break;
+        }
+    }
+    return state;
+}
+
+SGFStream::SGFStream(const std::string& filename) {
+#ifdef _WIN32
+    auto file = std::ifstream{filename, std::ios::binary};
+    if (!file) {
+        throw std::runtime_error("Error opening file");
+    }
+    m_buffer.assign(std::istreambuf_iterator<char>(file),
+                    std::istreambuf_iterator<char>());
+    m_data = m_buffer;
+#else
+    const auto fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        throw std::runtime_error("Error opening file");
+    }
+    const auto size = size_t(st.st_size);
+    if (size > 0) {
+        const auto mem = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mem == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("Error mapping file");
+        }
+        m_map = mem;
+        m_data = string_view{static_cast<const char*>(mem), size};
+    }
+    close(fd);
+#endif
+}
+
+SGFStream::~SGFStream() {
+#ifndef _WIN32
+    if (m_map) {
+        munmap(m_map, m_data.size());
+    }
+#endif
+}
+
+bool SGFStream::next_game(SGFGame& game) {
+    while (m_pos < m_data.size() && m_data[m_pos] != '(') {
+        m_pos++;
+    }
+    if (m_pos == m_data.size()) {
+        return false;
+    }
+
+    const auto start = ++m_pos;
+    auto nesting = 1;
+    auto intag = false;
+    while (m_pos < m_data.size() && nesting > 0) {
+        const auto c = m_data[m_pos++];
+        if (intag) {
+            if (c == '\\') {
+                m_pos++;
+            } else if (c == ']') {
+                intag = false;
+            }
+        } else if (c == '[') {
+            intag = true;
+        } else if (c == '(') {
+            nesting++;
+        } else if (c == ')') {
+            nesting--;
+        }
+    }
+    m_pos = std::min(m_pos, m_data.size());
+    // A missing closing parenthesis (OGS) ends the game at the end
+    // of the file.
+    const auto end = (nesting == 0 ? m_pos - 1 : m_pos);
+    game = SGFGame{m_data.substr(start, end - start)};
+    return true;
+}
@@ -0,0 +1,90 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SGFSTREAM_H_INCLUDED
+#define SGFSTREAM_H_INCLUDED
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <boost/utility/string_ref.hpp>
+
+#include "FastBoard.h"
+#include "GameState.h"
+
+// One game of an SGF collection, as a view of its text. Only the main
+// line is read, straight from the text, without building an SGFTree.
+class SGFGame {
+public:
+    using string_view = boost::string_ref;
+
+    SGFGame() = default;
+    // The text between the outer parentheses of the game.
+    explicit SGFGame(string_view text) : m_text(text) {}
+
+    // First value of a property of the root node, empty if it is
+    // missing. Escapes are left in the value.
+    string_view get_property(const std::string& name) const;
+    // Same as SGFTree::get_winner.
+    FastBoard::square_t get_winner() const;
+    // The state after the setup of the root node and the main line
+    // moves, which are also stored in moves. The main line stops at a
+    // move on an occupied intersection. Throws std::runtime_error for
+    // games that can't be played here, like SGFTree.
+    GameState follow_mainline_state(std::vector<int>& moves) const;
+
+private:
+    struct Property {
+        string_view name;
+        string_view value;
+    };
+    using Node = std::vector<Property>;
+
+    // Reads the main line node at pos into node, false after the last.
+    bool read_node(size_t& pos, Node& node) const;
+
+    string_view m_text;
+};
+
+// The games of an SGF file, one at a time. The file is mapped into
+// memory where we can, and the games are views of it, so they are valid
+// as long as the stream.
+class SGFStream {
+public:
+    // Throws std::runtime_error if the file can't be read.
+    explicit SGFStream(const std::string& filename);
+    ~SGFStream();
+
+    SGFStream(const SGFStream&) = delete;
+    SGFStream& operator=(const SGFStream&) = delete;
+
+    // The next game of the file, false after the last.
+    bool next_game(SGFGame& game);
+
+private:
+#ifdef _WIN32
+    std::string m_buffer;
+#else
+    void* m_map{nullptr};
+#endif
+    SGFGame::string_view m_data;
+    size_t m_pos{0};
+};
+
+#endif
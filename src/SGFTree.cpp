@@ -45,12 +45,28 @@ void SGFTree::init_state(void) {
     // Initialize with defaults.
     // The SGF might be missing boardsize or komi
     // which means we'll never initialize properly.
-    m_state.init_game(BOARD_SIZE, cfg_komi);
+    m_state = std::make_unique<KoState>();
+    m_state->init_game(BOARD_SIZE, cfg_komi);
 }
 
-KoState * SGFTree::get_state(void) {
+KoState SGFTree::get_state(void) const {
     assert(m_initialized);
-    return &m_state;
+    // Replay from the closest checkpoint, the root has one.
+    auto path = std::vector<const SGFTree*>{};
+    auto node = this;
+    while (!node->m_state) {
+        path.push_back(node);
+        node = node->m_parent;
+    }
+    auto state = *node->m_state;
+    for (auto it = path.rbegin(); it != path.rend(); ++it) {
+        const auto color = state.get_to_move();
+        const auto move = (*it)->get_move(color);
+        if (move != EOT) {
+            apply_move(state, color, move);
+        }
+    }
+    return state;
 }
 
 SGFTree * SGFTree::get_child(size_t count) {
@@ -69,7 +85,8 @@ GameState SGFTree::follow_mainline_state(unsigned int movenum) {
     SGFTree * link = this;
     // This initializes a starting state from a KoState and
     // sets up the game history.
-    GameState result(get_state());
+    const auto root = get_state();
+    GameState result(&root);
 
     for (unsigned int i = 0; i <= movenum && link != nullptr; i++) {
         // root position has no associated move
@@ -141,7 +158,7 @@ void SGFTree::populate_states(void) {
         strm >> bsize;
         if (bsize == BOARD_SIZE) {
             // Assume default komi if not specified
-            m_state.init_game(bsize, cfg_komi);
+            m_state->init_game(bsize, cfg_komi);
             valid_size = true;
         } else {
             throw std::runtime_error("Board size not supported.");
@@ -155,15 +172,15 @@ void SGFTree::populate_states(void) {
         std::istringstream strm(foo);
         float komi;
         strm >> komi;
-        int handicap = m_state.get_handicap();
+        int handicap = m_state->get_handicap();
         // last ditch effort: if no GM or SZ, assume 19x19 Go here
         int bsize = 19;
         if (valid_size) {
-            bsize = m_state.board.get_boardsize();
+            bsize = m_state->board.get_boardsize();
         }
         if (bsize == BOARD_SIZE) {
-            m_state.init_game(bsize, komi);
-            m_state.set_handicap(handicap);
+            m_state->init_game(bsize, komi);
+            m_state->set_handicap(handicap);
         } else {
             throw std::runtime_error("Board size not supported.");
         }
@@ -177,7 +194,7 @@ void SGFTree::populate_states(void) {
         float handicap;
         strm >> handicap;
         has_handicap = (handicap > 0.0f);
-        m_state.set_handicap(int(handicap));
+        m_state->set_handicap(int(handicap));
     }
 
     // result
@@ -215,52 +232,107 @@ void SGFTree::populate_states(void) {
     // Loop through the stone list and apply
     for (auto pit = prop_pair_ab.first; pit != prop_pair_ab.second; ++pit) {
         auto move = pit->second;
-        int vtx = string_to_vertex(move);
-        apply_move(FastBoard::BLACK, vtx);
+        int vtx = string_to_vertex(move, m_state->board);
+        apply_move(*m_state, FastBoard::BLACK, vtx);
     }
 
     // XXX: count handicap stones
     const auto& prop_pair_aw = m_properties.equal_range("AW");
     for (auto pit = prop_pair_aw.first; pit != prop_pair_aw.second; ++pit) {
         auto move = pit->second;
-        int vtx = string_to_vertex(move);
-        apply_move(FastBoard::WHITE, vtx);
+        int vtx = string_to_vertex(move, m_state->board);
+        apply_move(*m_state, FastBoard::WHITE, vtx);
     }
 
     it = m_properties.find("PL");
     if (it != m_properties.end()) {
         std::string who = it->second;
         if (who == "W") {
-            m_state.set_to_move(FastBoard::WHITE);
+            m_state->set_to_move(FastBoard::WHITE);
         } else if (who == "B") {
-            m_state.set_to_move(FastBoard::BLACK);
+            m_state->set_to_move(FastBoard::BLACK);
         }
     }
 
+    decode_moves(m_state->board);
+
     // now for all children play out the moves
-    for (auto& child_state : m_children) {
-        // propagate state
-        child_state.copy_state(*this);
+    auto state = *m_state;
+    populate_children(state, 0);
+}
+
+void SGFTree::populate_children(KoState& state, int depth) {
+    for (auto i = size_t{0}; i < m_children.size(); i++) {
+        auto& child = m_children[i];
+        child.m_initialized = true;
+        child.m_parent = this;
+        child.decode_moves(state.board);
+
+        // The last variation goes on with our state, the others need
+        // a copy of it.
+        auto branch = std::unique_ptr<KoState>{};
+        auto child_state = &state;
+        if (i + 1 < m_children.size()) {
+            branch = std::make_unique<KoState>(state);
+            child_state = branch.get();
+        }
 
-        // XXX: maybe move this to the recursive call
         // get move for side to move
-        int move = child_state.get_move(m_state.get_to_move());
+        const auto color = child_state->get_to_move();
+        const auto move = child.get_move(color);
         if (move != EOT) {
-            child_state.apply_move(move);
+            apply_move(*child_state, color, move);
         }
+        // Setup stones can't be replayed from the moves.
+        const auto has_setup = child.apply_setup(*child_state);
+        if (has_setup || (depth + 1) % CHECKPOINT_INTERVAL == 0) {
+            child.m_state = std::make_unique<KoState>(*child_state);
+        }
+        child.m_properties.clear();
 
-        child_state.populate_states();
+        child.populate_children(*child_state, depth + 1);
     }
 }
 
-void SGFTree::copy_state(const SGFTree& tree) {
-    m_initialized = tree.m_initialized;
-    m_state = tree.m_state;
+bool SGFTree::apply_setup(KoState& state) const {
+    auto has_setup = false;
+    const auto setup = [&](const char* property, const int color) {
+        const auto range = m_properties.equal_range(property);
+        for (auto it = range.first; it != range.second; ++it) {
+            apply_move(state, color, string_to_vertex(it->second,
+                                                      state.board));
+            has_setup = true;
+        }
+    };
+    setup("AB", FastBoard::BLACK);
+    setup("AW", FastBoard::WHITE);
+
+    const auto it = m_properties.find("PL");
+    if (it != m_properties.end()) {
+        if (it->second == "W") {
+            state.set_to_move(FastBoard::WHITE);
+        } else if (it->second == "B") {
+            state.set_to_move(FastBoard::BLACK);
+        }
+        has_setup = true;
+    }
+    return has_setup;
 }
 
-void SGFTree::apply_move(int color, int move) {
+void SGFTree::decode_moves(const FastBoard& board) {
+    auto it = m_properties.find("B");
+    if (it != m_properties.end()) {
+        m_black_move = string_to_vertex(it->second, board);
+    }
+    it = m_properties.find("W");
+    if (it != m_properties.end()) {
+        m_white_move = string_to_vertex(it->second, board);
+    }
+}
+
+void SGFTree::apply_move(KoState& state, int color, int move) {
     if (move != FastBoard::PASS && move != FastBoard::RESIGN) {
-        int curr_sq = m_state.board.get_square(move);
+        int curr_sq = state.board.get_square(move);
         if (curr_sq == !color || curr_sq == FastBoard::INVAL) {
             throw std::runtime_error("Illegal move");
         }
@@ -271,12 +343,7 @@ void SGFTree::apply_move(int color, int move) {
         }
         assert(curr_sq == FastBoard::EMPTY);
     }
-    m_state.play_move(color, move);
-}
-
-void SGFTree::apply_move(int move) {
-    int color = m_state.get_to_move();
-    apply_move(color, move);
+    state.play_move(color, move);
 }
 
 void SGFTree::add_property(std::string property, std::string value) {
@@ -292,18 +359,19 @@ SGFTree * SGFTree::add_child() {
     return &(m_children.back());
 }
 
-int SGFTree::string_to_vertex(const std::string& movestring) const {
+int SGFTree::string_to_vertex(const std::string& movestring,
+                              const FastBoard& board) {
     if (movestring.size() == 0) {
         return FastBoard::PASS;
     }
 
-    if (m_state.board.get_boardsize() <= 19) {
+    if (board.get_boardsize() <= 19) {
         if (movestring == "tt") {
             return FastBoard::PASS;
         }
     }
 
-    int bsize = m_state.board.get_boardsize();
+    int bsize = board.get_boardsize();
     if (bsize == 0) {
         throw std::runtime_error("Node has 0 sized board");
     }
@@ -331,29 +399,17 @@ int SGFTree::string_to_vertex(const std::string& movestring) const {
         throw std::runtime_error("Illegal SGF move");
     }
 
-    int vtx = m_state.board.get_vertex(cc1, cc2);
+    int vtx = board.get_vertex(cc1, cc2);
 
     return vtx;
 }
 
-int SGFTree::get_move(int tomove) {
-    std::string colorstring;
-
+int SGFTree::get_move(int tomove) const {
     if (tomove == FastBoard::BLACK) {
-        colorstring = "B";
+        return m_black_move;
     } else {
-        colorstring = "W";
+        return m_white_move;
     }
-
-    PropertyMap::iterator it;
-    it = m_properties.find(colorstring);
-
-    if (it != m_properties.end()) {
-        std::string movestring = it->second;
-        return string_to_vertex(movestring);
-    }
-
-    return SGFTree::EOT;
 }
 
 FastBoard::square_t SGFTree::get_winner() const {
@@ -364,7 +420,7 @@ std::vector<int> SGFTree::get_mainline() {
     std::vector<int> moves;
 
     SGFTree * link = this;
-    int tomove = link->m_state.get_to_move();
+    int tomove = link->m_state->get_to_move();
     link = link->get_child(0);
 
     while (link != nullptr && link->is_initialized()) {
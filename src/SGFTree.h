@@ -21,6 +21,7 @@
 
 #include <cstddef>
 #include <map>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -32,11 +33,14 @@
 class SGFTree {
 public:
     static const int EOT = 0;               // End-Of-Tree marker
+    // Nodes keep a copy of their state every this many moves, the others
+    // replay the moves from the closest one above them.
+    static const int CHECKPOINT_INTERVAL = 16;
 
     SGFTree() = default;
     void init_state();
 
-    KoState * get_state();
+    KoState get_state() const;
     GameState follow_mainline_state(unsigned int movenum = 999);
     std::vector<int> get_mainline();
     void load_from_file(std::string filename, int index = 0);
@@ -45,7 +49,7 @@ public:
     void add_property(std::string property, std::string value);
     SGFTree * add_child();
     SGFTree * get_child(size_t count);
-    int get_move(int tomove);
+    int get_move(int tomove) const;
     bool is_initialized() const {
         return m_initialized;
     }
@@ -55,17 +59,28 @@ public:
 
 private:
     void populate_states(void);
-    void apply_move(int color, int move);
-    void apply_move(int move);
-    void copy_state(const SGFTree& state);
-    int string_to_vertex(const std::string& move) const;
+    // Plays the moves below this node on state, the state of this node.
+    void populate_children(KoState& state, int depth);
+    // Applies the AB, AW and PL properties of this node, true if any.
+    bool apply_setup(KoState& state) const;
+    void decode_moves(const FastBoard& board);
+    static void apply_move(KoState& state, int color, int move);
+    static int string_to_vertex(const std::string& move,
+                                const FastBoard& board);
 
     using PropertyMap = std::multimap<std::string, std::string>;
 
     bool m_initialized{false};
-    KoState m_state;
+    // Set at the root and the checkpoints.
+    std::unique_ptr<KoState> m_state;
+    int m_black_move{EOT};
+    int m_white_move{EOT};
     FastBoard::square_t m_winner{FastBoard::INVAL};
+    // Set when the states are populated, so a loaded tree stays in place.
+    SGFTree* m_parent{nullptr};
     std::vector<SGFTree> m_children;
+    // Only the root keeps its properties once the states are populated,
+    // the moves of the others are in m_black_move and m_white_move.
     PropertyMap m_properties;
 };
 
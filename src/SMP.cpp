@@ -18,8 +18,30 @@
 
 #include "SMP.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <vector>
+
+#include "Metrics.h"
+#include "Profile.h"
+#include "Utils.h"
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
 
 SMP::Mutex::Mutex() {
     m_lock = false;
@@ -30,9 +52,44 @@ SMP::Lock::Lock(Mutex & m) {
     lock();
 }
 
+static inline void cpu_relax() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_ia32_pause();
+#endif
+}
+
 void SMP::Lock::lock() {
     assert(!m_owns_lock);
-    while (m_mutex->m_lock.exchange(true, std::memory_order_acquire) == true);
+    // Test and test-and-set: wait on a plain load so the waiters do not
+    // keep stealing the cache line from the owner, and back off more
+    // the longer the lock stays taken.
+    constexpr auto MAX_BACKOFF = 1024;
+    auto backoff = 1;
+    auto contended = false;
+#ifdef USE_PROFILING
+    const auto wait_start = Time();
+#endif
+    while (m_mutex->m_lock.exchange(true, std::memory_order_acquire)) {
+        contended = true;
+        while (m_mutex->m_lock.load(std::memory_order_relaxed)) {
+            if (backoff < MAX_BACKOFF) {
+                for (auto i = 0; i < backoff; i++) {
+                    cpu_relax();
+                }
+                backoff *= 2;
+            } else {
+                Metrics::add(Metrics::LOCK_YIELDS);
+                std::this_thread::yield();
+            }
+        }
+    }
+    Metrics::add(Metrics::LOCK_ACQUISITIONS);
+    if (contended) {
+        Metrics::add(Metrics::LOCK_CONTENDED);
+#ifdef USE_PROFILING
+        Profile::record(Profile::LOCK_WAIT, wait_start, Time());
+#endif
+    }
     m_owns_lock = true;
 }
 
@@ -60,3 +117,328 @@ SMP::Lock::~Lock() {
 int SMP::get_num_cpus() {
     return std::thread::hardware_concurrency();
 }
+
+// The cores of every NUMA node, from sysfs. A single node with all the
+// cores where that is not available.
+static const std::vector<std::vector<int>>& numa_topology() {
+    static const auto topology = [] {
+        auto nodes = std::vector<std::vector<int>>();
+#ifdef __linux__
+        for (auto node = 0; ; node++) {
+            std::ifstream cpulist("/sys/devices/system/node/node"
+                                  + std::to_string(node) + "/cpulist");
+            if (!cpulist) {
+                break;
+            }
+            // Ranges like "0-7,16-23".
+            auto cpus = std::vector<int>();
+            auto first = 0;
+            while (cpulist >> first) {
+                auto last = first;
+                if (cpulist.peek() == '-') {
+                    cpulist.get();
+                    cpulist >> last;
+                }
+                for (auto cpu = first; cpu <= last; cpu++) {
+                    cpus.emplace_back(cpu);
+                }
+                if (cpulist.peek() == ',') {
+                    cpulist.get();
+                }
+            }
+            // Nodes with only memory stay empty, so that the indexes
+            // are the node numbers of the kernel.
+            nodes.emplace_back(std::move(cpus));
+        }
+#endif
+        if (std::all_of(begin(nodes), end(nodes),
+                        [](const auto& cpus) { return cpus.empty(); })) {
+            nodes.clear();
+            nodes.emplace_back();
+            for (auto cpu = 0; cpu < SMP::get_num_cpus(); cpu++) {
+                nodes.back().emplace_back(cpu);
+            }
+        }
+        return nodes;
+    }();
+    return topology;
+}
+
+int SMP::get_numa_node_count() {
+    return static_cast<int>(numa_topology().size());
+}
+
+int SMP::get_numa_node() {
+#ifdef __linux__
+    const auto cpu = sched_getcpu();
+    const auto& nodes = numa_topology();
+    for (auto node = size_t{0}; node < nodes.size(); node++) {
+        const auto& cpus = nodes[node];
+        if (std::find(begin(cpus), end(cpus), cpu) != end(cpus)) {
+            return static_cast<int>(node);
+        }
+    }
+#endif
+    return 0;
+}
+
+#ifdef __linux__
+static bool set_affinity(const std::vector<int>& cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const auto cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+#endif
+
+void SMP::pin_thread(const std::size_t index, const bool spread) {
+#ifdef __linux__
+    auto nodes = numa_topology();
+    nodes.erase(std::remove_if(begin(nodes), end(nodes),
+                               [](const auto& cpus) { return cpus.empty(); }),
+                end(nodes));
+    auto cpu = 0;
+    if (spread) {
+        const auto& cpus = nodes[index % nodes.size()];
+        cpu = cpus[(index / nodes.size()) % cpus.size()];
+    } else {
+        auto all = std::vector<int>();
+        for (const auto& cpus : nodes) {
+            all.insert(end(all), begin(cpus), end(cpus));
+        }
+        std::sort(begin(all), end(all));
+        cpu = all[index % all.size()];
+    }
+    set_affinity({cpu});
+#else
+    (void)index;
+    (void)spread;
+#endif
+}
+
+bool SMP::bind_thread_to_numa_node(const int node) {
+#ifdef __linux__
+    const auto& nodes = numa_topology();
+    if (node < 0 || node >= static_cast<int>(nodes.size())
+        || nodes[node].empty()) {
+        return false;
+    }
+    return set_affinity(nodes[node]);
+#else
+    (void)node;
+    return false;
+#endif
+}
+
+namespace {
+    enum class PageKind {
+        NORMAL,
+        // Reserved by the system, hugetlbfs or the large pages of
+        // Windows, so all of it is in huge pages.
+        RESERVED,
+        // madvise(MADV_HUGEPAGE), the kernel decides how much of it.
+        TRANSPARENT
+    };
+
+    struct Mapping {
+        std::size_t size;
+        PageKind kind;
+    };
+
+    struct LargeMappings {
+        std::mutex mutex;
+        // By start address.
+        std::map<std::uintptr_t, Mapping> mappings;
+        bool warned{false};
+    };
+
+    // Never destroyed, the NNCache gives its memory back at exit.
+    LargeMappings& large_mappings() {
+        static auto& mappings = *new LargeMappings;
+        return mappings;
+    }
+
+#ifdef _WIN32
+    // Large pages need the "Lock pages in memory" privilege, which the
+    // account must have and the process must enable.
+    bool enable_large_pages() {
+        static const auto enabled = [] {
+            auto token = HANDLE{};
+            if (!OpenProcessToken(GetCurrentProcess(),
+                                  TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY,
+                                  &token)) {
+                return false;
+            }
+            auto privileges = TOKEN_PRIVILEGES{};
+            privileges.PrivilegeCount = 1;
+            privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+            auto ok = LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME,
+                                           &privileges.Privileges[0].Luid)
+                && AdjustTokenPrivileges(token, FALSE, &privileges, 0,
+                                         nullptr, nullptr)
+                && GetLastError() == ERROR_SUCCESS;
+            CloseHandle(token);
+            return ok;
+        }();
+        return enabled;
+    }
+#endif
+
+    void* map_pages(const std::size_t size, const bool huge,
+                    PageKind& kind) {
+        kind = PageKind::NORMAL;
+#ifdef _WIN32
+        const auto minimum = GetLargePageMinimum();
+        if (huge && minimum > 0 && size % minimum == 0
+            && enable_large_pages()) {
+            const auto p = VirtualAlloc(
+                nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                PAGE_READWRITE);
+            if (p) {
+                kind = PageKind::RESERVED;
+                return p;
+            }
+        }
+        return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT,
+                            PAGE_READWRITE);
+#else
+#ifdef MAP_HUGETLB
+        if (huge) {
+            const auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                                -1, 0);
+            if (p != MAP_FAILED) {
+                kind = PageKind::RESERVED;
+                return p;
+            }
+        }
+#endif
+        // One huge page more, and the ends cut off to align it, or the
+        // kernel can't use huge pages for it.
+        const auto padded = size + SMP::HUGE_PAGE_SIZE;
+        const auto mem = mmap(nullptr, padded, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            return nullptr;
+        }
+        const auto raw = reinterpret_cast<std::uintptr_t>(mem);
+        const auto start = (raw + SMP::HUGE_PAGE_SIZE - 1)
+                           / SMP::HUGE_PAGE_SIZE * SMP::HUGE_PAGE_SIZE;
+        if (start > raw) {
+            munmap(mem, start - raw);
+        }
+        if (raw + padded > start + size) {
+            munmap(reinterpret_cast<void*>(start + size),
+                   raw + padded - (start + size));
+        }
+        const auto p = reinterpret_cast<void*>(start);
+#ifdef MADV_HUGEPAGE
+        if (huge && madvise(p, size, MADV_HUGEPAGE) == 0) {
+            kind = PageKind::TRANSPARENT;
+        }
+#endif
+        return p;
+#endif
+    }
+
+    void unmap_pages(void* const p, const std::size_t size) {
+#ifdef _WIN32
+        (void)size;
+        VirtualFree(p, 0, MEM_RELEASE);
+#else
+        munmap(p, size);
+#endif
+    }
+}
+
+void* SMP::allocate_large(const std::size_t bytes, const bool huge) {
+    const auto size = std::max<std::size_t>(
+        1, (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE) * HUGE_PAGE_SIZE;
+    auto kind = PageKind::NORMAL;
+    const auto p = map_pages(size, huge, kind);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    auto& large = large_mappings();
+    std::lock_guard<std::mutex> lock(large.mutex);
+    large.mappings.emplace(reinterpret_cast<std::uintptr_t>(p),
+                           Mapping{size, kind});
+    if (huge && kind == PageKind::NORMAL && !large.warned) {
+        large.warned = true;
+        Utils::myprintf("No huge pages, using normal pages.\n");
+    }
+    return p;
+}
+
+void SMP::free_large(void* const p) {
+    if (!p) {
+        return;
+    }
+    auto& large = large_mappings();
+    auto size = std::size_t{0};
+    {
+        std::lock_guard<std::mutex> lock(large.mutex);
+        const auto it =
+            large.mappings.find(reinterpret_cast<std::uintptr_t>(p));
+        assert(it != end(large.mappings));
+        size = it->second.size;
+        large.mappings.erase(it);
+    }
+    unmap_pages(p, size);
+}
+
+std::size_t SMP::get_large_bytes() {
+    auto& large = large_mappings();
+    std::lock_guard<std::mutex> lock(large.mutex);
+    auto bytes = std::size_t{0};
+    for (const auto& mapping : large.mappings) {
+        bytes += mapping.second.size;
+    }
+    return bytes;
+}
+
+std::size_t SMP::get_huge_page_bytes() {
+    auto& large = large_mappings();
+    std::lock_guard<std::mutex> lock(large.mutex);
+    auto bytes = std::size_t{0};
+    auto transparent = false;
+    for (const auto& mapping : large.mappings) {
+        if (mapping.second.kind == PageKind::RESERVED) {
+            bytes += mapping.second.size;
+        }
+        transparent |= (mapping.second.kind == PageKind::TRANSPARENT);
+    }
+#ifdef __linux__
+    if (!transparent) {
+        return bytes;
+    }
+    // The kernel merges neighbouring mappings, so every area of smaps
+    // with one of ours counts.
+    std::ifstream smaps("/proc/self/smaps");
+    auto line = std::string{};
+    auto ours = false;
+    while (std::getline(smaps, line)) {
+        auto fields = std::istringstream{line};
+        auto first = std::string{};
+        fields >> first;
+        const auto dash = first.find('-');
+        if (dash != std::string::npos && first.back() != ':') {
+            // "start-end perms offset ..." starts an area.
+            const auto start = std::stoull(first.substr(0, dash), nullptr, 16);
+            const auto end = std::stoull(first.substr(dash + 1), nullptr, 16);
+            const auto it = large.mappings.lower_bound(start);
+            ours = it != large.mappings.end() && it->first < end
+                   && it->second.kind == PageKind::TRANSPARENT;
+        } else if (ours && first == "AnonHugePages:") {
+            auto kilobytes = std::size_t{0};
+            fields >> kilobytes;
+            bytes += kilobytes * 1024;
+        }
+    }
+#else
+    (void)transparent;
+#endif
+    return bytes;
+}
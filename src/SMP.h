@@ -22,10 +22,35 @@
 #include "config.h"
 
 #include <atomic>
+#include <cstddef>
 
 namespace SMP {
     int get_num_cpus();
 
+    // NUMA nodes, 1 where the topology is unknown.
+    int get_numa_node_count();
+    // The node of the core the calling thread last ran on.
+    int get_numa_node();
+    // Pins the calling thread to a core. With spread, consecutive
+    // indexes go to the nodes in turn, otherwise index i gets core i.
+    void pin_thread(std::size_t index, bool spread);
+    // Lets the calling thread run on the cores of one node only.
+    bool bind_thread_to_numa_node(int node);
+
+    // The memory of allocate_large() is aligned to this, and comes in
+    // multiples of it.
+    constexpr auto HUGE_PAGE_SIZE = std::size_t{2} << 20;
+    // Zeroed memory for the search tree and the NNCache. With huge it
+    // is in huge pages where the system has them: the reserved ones
+    // first, then transparent ones, and normal pages for the rest.
+    // Throws std::bad_alloc.
+    void* allocate_large(std::size_t bytes, bool huge);
+    void free_large(void* p);
+    // The memory of allocate_large(), and the part of it that really
+    // is in huge pages.
+    std::size_t get_large_bytes();
+    std::size_t get_huge_page_bytes();
+
     class Mutex {
     public:
         Mutex();
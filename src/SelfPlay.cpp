@@ -0,0 +1,125 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "SelfPlay.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <boost/format.hpp>
+
+#include "FastBoard.h"
+#include "GTP.h"
+#include "GameState.h"
+#include "SGFTree.h"
+#include "Training.h"
+#include "UCTSearch.h"
+#include "Utils.h"
+
+using namespace Utils;
+
+namespace {
+    // The outputs of all the games, in the order they end.
+    class Results {
+    public:
+        explicit Results(const std::string& basename)
+            : m_chunker(basename, true), m_sgf_name(basename + ".sgf") {}
+
+        // Writes the training data recorded by the calling thread.
+        void add(GameState& game, const int winner,
+                 const std::string& result) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (winner != FastBoard::EMPTY) {
+                Training::dump_training(winner, m_chunker);
+            }
+            auto sgf = std::ofstream{m_sgf_name, std::ofstream::app};
+            sgf << SGFTree::state_to_string(game, 0);
+            std::printf("game %d: %s, %zu moves\n", ++m_games,
+                        result.c_str(), game.get_movenum());
+            std::fflush(stdout);
+        }
+
+    private:
+        std::mutex m_mutex;
+        OutputChunker m_chunker;
+        std::string m_sgf_name;
+        int m_games{0};
+    };
+
+    // The winner of a game that ended, EMPTY for a draw.
+    int get_winner(GameState& game, std::string& result) {
+        if (game.has_resigned()) {
+            const auto black = game.who_resigned() == FastBoard::WHITE;
+            result = black ? "B+Resign" : "W+Resign";
+            return black ? FastBoard::BLACK : FastBoard::WHITE;
+        }
+        const auto score = game.final_score();
+        if (score > 0.1f) {
+            result = str(boost::format("B+%.1f") % score);
+            return FastBoard::BLACK;
+        } else if (score < -0.1f) {
+            result = str(boost::format("W+%.1f") % -score);
+            return FastBoard::WHITE;
+        }
+        result = "0";
+        return FastBoard::EMPTY;
+    }
+
+    void play_game(GameState& game, Results& results) {
+        game.init_game(BOARD_SIZE, cfg_komi);
+        // The visits or playouts end the moves, as with autogtp.
+        game.set_timecontrol(0, 1, 0, 0);
+        Training::clear_training();
+        auto search = std::make_unique<UCTSearch>(game);
+        // As Game::checkGameEnd() in autogtp.
+        while (!game.has_resigned() && game.get_passes() < 2
+               && game.get_movenum() <= 2 * BOARD_SQUARES) {
+            const auto color = game.get_to_move();
+            game.play_move(search->think(color));
+        }
+        auto result = std::string{};
+        const auto winner = get_winner(game, result);
+        results.add(game, winner, result);
+    }
+}
+
+void SelfPlay::run(const int games, const int parallel,
+                   const std::string& basename) {
+    myprintf("Playing %d self-play games, %d at a time.\n", games, parallel);
+    Results results(basename);
+    std::atomic<int> next{0};
+    auto threads = std::vector<std::thread>{};
+    for (auto i = 0; i < std::min(games, parallel); i++) {
+        threads.emplace_back([&] {
+            auto game = GameState{};
+            while (next++ < games) {
+                play_game(game, results);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
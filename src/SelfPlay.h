@@ -0,0 +1,41 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SELFPLAY_H_INCLUDED
+#define SELFPLAY_H_INCLUDED
+
+#include "config.h"
+
+#include <string>
+
+// Plays self-play games in the engine with --selfplay, without a GTP
+// round trip per move. Every move is a genmove with the search settings
+// of the command line, --noise and --randomcnt included. Several games
+// run at once, each on its own thread, so they share the batches of the
+// network and the NNCache like the games of a GameServer.
+//
+// The training data of the games goes to the chunks basename.N.gz and
+// their SGF to basename.sgf, one game after the other. Every finished
+// game prints a line "game N: result, M moves" on stdout, for a
+// supervisor like autogtp. Games without a winner are not dumped.
+class SelfPlay {
+public:
+    static void run(int games, int parallel, const std::string& basename);
+};
+
+#endif
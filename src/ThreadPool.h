@@ -26,63 +26,285 @@
     distribution.
 */
 
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <exception>
 #include <vector>
 #include <thread>
-#include <queue>
 #include <mutex>
 #include <condition_variable>
 #include <memory>
+#include <new>
 #include <future>
 #include <functional>
+#include <type_traits>
+#include <utility>
 
 namespace Utils {
 
+// A move-only void() callable. Functors of up to INLINE_SIZE bytes are
+// stored in the task itself, so queueing them allocates nothing.
+class Task {
+public:
+    Task() = default;
+    template<class F,
+             class = typename std::enable_if<
+                 !std::is_same<typename std::decay<F>::type, Task>::value
+             >::type>
+    Task(F&& f) {
+        using Fn = typename std::decay<F>::type;
+        constexpr auto fits = sizeof(Fn) <= INLINE_SIZE
+            && alignof(Fn) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible<Fn>::value;
+        m_ops = Ops::template get<Fn, fits>();
+        Ops::template construct<Fn>(m_storage, std::forward<F>(f),
+                                    std::integral_constant<bool, fits>());
+    }
+    Task(Task&& other) noexcept {
+        *this = std::move(other);
+    }
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            reset();
+            if (other.m_ops) {
+                other.m_ops->move(other.m_storage, m_storage);
+                m_ops = other.m_ops;
+                other.m_ops = nullptr;
+            }
+        }
+        return *this;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+        reset();
+    }
+
+    void operator()() {
+        m_ops->call(m_storage);
+    }
+    explicit operator bool() const {
+        return m_ops != nullptr;
+    }
+
+private:
+    static constexpr auto INLINE_SIZE = std::size_t{88};
+
+    struct Ops {
+        void (*call)(void* f);
+        // Moves the functor to the empty storage and destroys the old one.
+        void (*move)(void* from, void* to);
+        void (*destroy)(void* f);
+
+        template<class Fn, bool Inline>
+        static const Ops* get() {
+            static const Ops ops = Inline ? Ops{
+                [](void* f) { (*static_cast<Fn*>(f))(); },
+                [](void* from, void* to) {
+                    new (to) Fn(std::move(*static_cast<Fn*>(from)));
+                    static_cast<Fn*>(from)->~Fn();
+                },
+                [](void* f) { static_cast<Fn*>(f)->~Fn(); }
+            } : Ops{
+                [](void* f) { (**static_cast<Fn**>(f))(); },
+                [](void* from, void* to) {
+                    *static_cast<Fn**>(to) = *static_cast<Fn**>(from);
+                },
+                [](void* f) { delete *static_cast<Fn**>(f); }
+            };
+            return &ops;
+        }
+        template<class Fn, class F>
+        static void construct(void* storage, F&& f, std::true_type) {
+            new (storage) Fn(std::forward<F>(f));
+        }
+        template<class Fn, class F>
+        static void construct(void* storage, F&& f, std::false_type) {
+            *static_cast<Fn**>(storage) = new Fn(std::forward<F>(f));
+        }
+    };
+
+    void reset() {
+        if (m_ops) {
+            m_ops->destroy(m_storage);
+            m_ops = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char m_storage[INLINE_SIZE];
+    const Ops* m_ops{nullptr};
+};
+
+// The tasks of one worker, in a ring that only allocates when it needs
+// to grow. The worker takes its newest task, thieves take the oldest.
+class TaskQueue {
+public:
+    void push(Task&& task) {
+        if (m_size == m_ring.size()) {
+            grow();
+        }
+        m_ring[(m_head + m_size) & (m_ring.size() - 1)] = std::move(task);
+        m_size++;
+    }
+    bool pop_back(Task& task) {
+        if (m_size == 0) {
+            return false;
+        }
+        m_size--;
+        task = std::move(m_ring[(m_head + m_size) & (m_ring.size() - 1)]);
+        return true;
+    }
+    bool pop_front(Task& task) {
+        if (m_size == 0) {
+            return false;
+        }
+        task = std::move(m_ring[m_head]);
+        m_head = (m_head + 1) & (m_ring.size() - 1);
+        m_size--;
+        return true;
+    }
+
+private:
+    void grow() {
+        auto ring = std::vector<Task>(std::max(std::size_t{16},
+                                               2 * m_ring.size()));
+        for (auto i = std::size_t{0}; i < m_size; i++) {
+            ring[i] = std::move(m_ring[(m_head + i) & (m_ring.size() - 1)]);
+        }
+        m_ring = std::move(ring);
+        m_head = 0;
+    }
+
+    std::vector<Task> m_ring;
+    std::size_t m_head{0};
+    std::size_t m_size{0};
+};
+
+// Every worker has its own queue. Tasks submitted by a worker go to its
+// own queue, the others are spread over all the queues, and a worker
+// that runs out of tasks steals from the others.
 class ThreadPool {
 public:
     ThreadPool() = default;
     ~ThreadPool();
 
-    // create worker threads.  This version has no initializers.
-    void initialize(std::size_t);
+    // Create the worker threads. Every worker calls initializer with its
+    // index before doing anything, e.g. to pin itself to a core.
+    void initialize(std::size_t threads,
+                    std::function<void(std::size_t)> initializer = nullptr);
+
+    // Queue a task without any future. Does not allocate for small
+    // functors.
+    template<class F>
+    void submit(F&& f);
 
-    // add an extra thread.  The thread calls initializer() before doing anything,
-    // so that the user can initialize per-thread data structures before doing work.
-    void add_thread(std::function<void()> initializer);
     template<class F, class... Args>
     auto add_task(F&& f, Args&&... args)
         -> std::future<typename std::result_of<F(Args...)>::type>;
+
 private:
+    struct Worker {
+        std::mutex mutex;
+        TaskQueue tasks;
+    };
+
+    void worker_loop(std::size_t index);
+    bool try_pop(std::size_t index, Task& task);
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
     std::vector<std::thread> m_threads;
-    std::queue<std::function<void()>> m_tasks;
+    std::atomic<std::size_t> m_next{0};
+    // Tasks in all the queues, and workers about to sleep.
+    std::atomic<std::size_t> m_queued{0};
+    std::atomic<std::size_t> m_idle{0};
 
     std::mutex m_mutex;
     std::condition_variable m_condvar;
     bool m_exit{false};
+
+    // The pool and the index of the worker running on this thread.
+    static ThreadPool*& current_pool() {
+        static thread_local ThreadPool* pool = nullptr;
+        return pool;
+    }
+    static std::size_t& current_index() {
+        static thread_local std::size_t index = 0;
+        return index;
+    }
 };
 
-inline void ThreadPool::add_thread(std::function<void()> initializer) {
-    m_threads.emplace_back([this, initializer] {
-        initializer();
-        for (;;) {
-            std::function<void()> task;
-            {
-                std::unique_lock<std::mutex> lock(m_mutex);
-                m_condvar.wait(lock, [this]{ return m_exit || !m_tasks.empty(); });
-                if (m_exit && m_tasks.empty()) {
-                    return;
-                }
-                task = std::move(m_tasks.front());
-                m_tasks.pop();
+inline void ThreadPool::initialize(
+    std::size_t threads, std::function<void(std::size_t)> initializer) {
+    // All the queues must exist before any worker looks for a task.
+    for (std::size_t i = 0; i < threads; i++) {
+        m_workers.emplace_back(std::make_unique<Worker>());
+    }
+    for (std::size_t i = 0; i < threads; i++) {
+        m_threads.emplace_back([this, i, initializer] {
+            if (initializer) {
+                initializer(i);
             }
+            worker_loop(i);
+        });
+    }
+}
+
+inline void ThreadPool::worker_loop(std::size_t index) {
+    current_pool() = this;
+    current_index() = index;
+    for (;;) {
+        Task task;
+        if (try_pop(index, task)) {
             task();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_idle++;
+        m_condvar.wait(lock, [this]{ return m_exit || m_queued > 0; });
+        m_idle--;
+        if (m_exit && m_queued == 0) {
+            return;
         }
-    });
+    }
+}
+
+inline bool ThreadPool::try_pop(std::size_t index, Task& task) {
+    if (m_queued == 0) {
+        return false;
+    }
+    const auto count = m_workers.size();
+    for (std::size_t i = 0; i < count; i++) {
+        auto& worker = *m_workers[(index + i) % count];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (i == 0 ? worker.tasks.pop_back(task)
+                   : worker.tasks.pop_front(task)) {
+            m_queued--;
+            return true;
+        }
+    }
+    return false;
 }
 
-inline void ThreadPool::initialize(size_t threads) {
-    for (size_t i = 0; i < threads; i++) {
-        add_thread([](){} /* null function */);
+template<class F>
+void ThreadPool::submit(F&& f) {
+    auto index = current_index();
+    if (current_pool() != this) {
+        index = m_next++ % m_workers.size();
+    }
+    {
+        auto& worker = *m_workers[index];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        // Counted first, so that the count never drops below the number
+        // of queued tasks.
+        m_queued++;
+        worker.tasks.push(Task(std::forward<F>(f)));
+    }
+    // Taking the lock makes sure that a worker that found no task
+    // is already waiting.
+    if (m_idle > 0) {
+        { std::lock_guard<std::mutex> lock(m_mutex); }
+        m_condvar.notify_one();
     }
 }
 
@@ -91,16 +313,12 @@ auto ThreadPool::add_task(F&& f, Args&&... args)
     -> std::future<typename std::result_of<F(Args...)>::type> {
     using return_type = typename std::result_of<F(Args...)>::type;
 
-    auto task = std::make_shared< std::packaged_task<return_type()> >(
+    auto task = std::packaged_task<return_type()>(
         std::bind(std::forward<F>(f), std::forward<Args>(args)...)
     );
 
-    std::future<return_type> res = task->get_future();
-    {
-        std::unique_lock<std::mutex> lock(m_mutex);
-        m_tasks.emplace([task](){(*task)();});
-    }
-    m_condvar.notify_one();
+    std::future<return_type> res = task.get_future();
+    submit(std::move(task));
     return res;
 }
 
@@ -115,23 +333,64 @@ inline ThreadPool::~ThreadPool() {
     }
 }
 
+// Tasks that are waited for together. Unlike futures this needs no
+// allocation per task. The destructor waits for the tasks as well.
 class ThreadGroup {
 public:
     ThreadGroup(ThreadPool & pool) : m_pool(pool) {}
+    ThreadGroup(const ThreadGroup&) = delete;
+    ThreadGroup& operator=(const ThreadGroup&) = delete;
+    ~ThreadGroup() {
+        wait();
+    }
+
     template<class F, class... Args>
     void add_task(F&& f, Args&&... args) {
-        m_taskresults.emplace_back(
-            m_pool.add_task(std::forward<F>(f), std::forward<Args>(args)...)
-        );
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending++;
+        }
+        m_pool.submit(
+            [this, fn = std::bind(std::forward<F>(f),
+                                  std::forward<Args>(args)...)]() mutable {
+                auto error = std::exception_ptr{};
+                try {
+                    fn();
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                // The group can be gone as soon as the lock is released.
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (error && !m_error) {
+                    m_error = error;
+                }
+                if (--m_pending == 0) {
+                    m_condvar.notify_all();
+                }
+            });
     }
+
+    // Waits for all the tasks, and throws the first exception of any.
     void wait_all() {
-        for (auto && result : m_taskresults) {
-            result.get();
+        wait();
+        if (m_error) {
+            auto error = m_error;
+            m_error = nullptr;
+            std::rethrow_exception(error);
         }
     }
+
 private:
+    void wait() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condvar.wait(lock, [this]{ return m_pending == 0; });
+    }
+
     ThreadPool & m_pool;
-    std::vector<std::future<void>> m_taskresults;
+    std::mutex m_mutex;
+    std::condition_variable m_condvar;
+    int m_pending{0};
+    std::exception_ptr m_error;
 };
 
 }
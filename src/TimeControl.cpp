@@ -190,6 +190,19 @@ int TimeControl::max_time_for_move(int color, int movenum) {
     return base_time + inc_time;
 }
 
+int TimeControl::max_extended_time_for_move(int color, int movenum) {
+    const auto time_for_move = max_time_for_move(color, movenum);
+    const auto infinite = m_byotime != 0 && m_byostones == 0
+                          && m_byoperiods == 0;
+    if (infinite || !can_accumulate_time(color)) {
+        return time_for_move;
+    }
+    // Twice the normal time, as long as that leaves most of the clock.
+    const auto spare =
+        std::max(m_remaining_time[color] - cfg_lagbuffer_cs, 0) / 4;
+    return std::max(time_for_move, std::min(2 * time_for_move, spare));
+}
+
 void TimeControl::adjust_time(int color, int time, int stones) {
     m_remaining_time[color] = time;
     // From pachi: some GTP things send 0 0 at the end of main time
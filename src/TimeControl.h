@@ -20,6 +20,7 @@
 #define TIMECONTROL_H_INCLUDED
 
 #include <array>
+#include <string>
 
 #include "config.h"
 #include "Timing.h"
@@ -37,6 +38,9 @@ public:
     void start(int color);
     void stop(int color);
     int max_time_for_move(int color, int movenum);
+    // The most time a move may take when the search can't decide
+    // between its best moves, at least max_time_for_move().
+    int max_extended_time_for_move(int color, int movenum);
     void adjust_time(int color, int time, int stones);
     void set_boardsize(int boardsize);
     void display_times();
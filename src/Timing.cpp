@@ -30,6 +30,11 @@ double Time::timediff_seconds(Time start, Time end) {
     return std::chrono::duration<double>(end.m_time - start.m_time).count();
 }
 
+std::int64_t Time::timediff_nanos(Time start, Time end) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>
+        (end.m_time - start.m_time).count();
+}
+
 Time::Time(void) {
     m_time = std::chrono::steady_clock::now();
 }
@@ -20,6 +20,7 @@
 #define TIMING_H_INCLUDED
 
 #include <chrono>
+#include <cstdint>
 
 class Time {
 public:
@@ -32,6 +33,9 @@ public:
     /* time difference in seconds */
     static double timediff_seconds(Time start, Time end);
 
+    /* time difference in nanoseconds */
+    static std::int64_t timediff_nanos(Time start, Time end);
+
 private:
     std::chrono::steady_clock::time_point m_time;
 };
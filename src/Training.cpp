@@ -20,14 +20,22 @@
 #include "Training.h"
 
 #include <algorithm>
+#include <atomic>
 #include <bitset>
 #include <cassert>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <iostream>
 #include <iterator>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
 #include <utility>
 
 #include "FastBoard.h"
@@ -35,15 +43,16 @@
 #include "GTP.h"
 #include "GameState.h"
 #include "Random.h"
-#include "SGFParser.h"
-#include "SGFTree.h"
+#include "SGFStream.h"
+#include "ThreadPool.h"
 #include "Timing.h"
 #include "UCTNode.h"
 #include "Utils.h"
+#include "TrainingRecord.h"
 #include "string.h"
 #include "zlib.h"
 
-std::vector<TimeStep> Training::m_data{};
+thread_local std::vector<TimeStep> Training::m_data{};
 
 std::ostream& operator <<(std::ostream& stream, const TimeStep& timestep) {
     stream << timestep.planes.size() << ' ';
@@ -51,8 +60,8 @@ std::ostream& operator <<(std::ostream& stream, const TimeStep& timestep) {
         stream << plane << ' ';
     }
     stream << timestep.probabilities.size() << ' ';
-    for (const auto prob : timestep.probabilities) {
-        stream << prob << ' ';
+    for (auto i = size_t{0}; i < timestep.probabilities.size(); ++i) {
+        stream << timestep.get_probability(i) << ' ';
     }
     stream << timestep.to_move << ' ';
     stream << timestep.net_winrate << ' ';
@@ -68,14 +77,18 @@ std::istream& operator>> (std::istream& stream, TimeStep& timestep) {
     for (auto i = 0; i < planes_size; ++i) {
         TimeStep::BoardPlane plane;
         stream >> plane;
-        timestep.planes.push_back(plane);
+        if (size_t(i) < timestep.planes.size()) {
+            timestep.planes[i] = plane;
+        }
     }
     int prob_size;
     stream >> prob_size;
     for (auto i = 0; i < prob_size; ++i) {
         float prob;
         stream >> prob;
-        timestep.probabilities.push_back(prob);
+        if (size_t(i) < timestep.probabilities.size()) {
+            timestep.set_probability(i, prob);
+        }
     }
     stream >> timestep.to_move;
     stream >> timestep.net_winrate;
@@ -85,6 +98,125 @@ std::istream& operator>> (std::istream& stream, TimeStep& timestep) {
     return stream;
 }
 
+static gzFile open_chunk(const std::string& filename, const int level) {
+    const auto mode = "wb" + std::to_string(level);
+    auto out = gzopen(filename.c_str(), mode.c_str());
+    if (!out) {
+        Utils::myprintf("Error opening %s\n", filename.c_str());
+    }
+    return out;
+}
+
+static void write_chunk(const gzFile out, const std::string& filename,
+                        const std::string& data) {
+    if (!data.empty() && !gzwrite(out, data.data(), data.size())) {
+        Utils::myprintf("Error in gzip output to %s\n", filename.c_str());
+    }
+}
+
+// Writes the chunks on a background thread, so that dumping the
+// training data doesn't hold up the next game. Games are compressed as
+// they arrive, the gzip file of a chunk stays open until it is closed.
+class ChunkWriter {
+public:
+    static ChunkWriter& get() {
+        static ChunkWriter writer;
+        return writer;
+    }
+
+    ~ChunkWriter() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_exit = true;
+        }
+        m_not_empty.notify_all();
+        m_thread.join();
+    }
+
+    // An empty data with close set finishes the chunk, which creates it
+    // if nothing was written to it yet. Blocks while the queue is full.
+    void write(const std::string& filename, std::string data,
+               const bool compress, const bool close) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_not_full.wait(lock, [this] {
+                return m_queue.size() < MAX_QUEUED;
+            });
+            m_queue.emplace_back(Job{filename, std::move(data),
+                                     compress, close, cfg_gzip_level});
+        }
+        m_not_empty.notify_one();
+    }
+
+private:
+    // Every game is a job, so this is a few chunks of games.
+    static constexpr size_t MAX_QUEUED = 4 * OutputChunker::CHUNK_SIZE;
+
+    struct Job {
+        std::string filename;
+        std::string data;
+        bool compress;
+        bool close;
+        int level;
+    };
+
+    ChunkWriter() : m_thread([this] { run(); }) {}
+
+    void run() {
+        while (true) {
+            auto job = Job{};
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_not_empty.wait(lock, [this] {
+                    return m_exit || !m_queue.empty();
+                });
+                if (m_queue.empty()) {
+                    break;
+                }
+                job = std::move(m_queue.front());
+                m_queue.pop_front();
+            }
+            m_not_full.notify_one();
+            if (job.compress) {
+                write_gzip(job);
+            } else if (!job.data.empty()) {
+                auto flags = std::ofstream::out | std::ofstream::app;
+                auto out = std::ofstream{job.filename, flags};
+                out << job.data;
+            }
+        }
+        for (const auto& file : m_open) {
+            gzclose(file.second);
+        }
+    }
+
+    void write_gzip(const Job& job) {
+        auto file = m_open.find(job.filename);
+        if (file == end(m_open)) {
+            auto out = open_chunk(job.filename, job.level);
+            if (!out) {
+                return;
+            }
+            file = m_open.emplace(job.filename, out).first;
+        }
+        write_chunk(file->second, job.filename, job.data);
+        if (job.close) {
+            gzclose(file->second);
+            m_open.erase(file);
+        }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_not_empty;
+    std::condition_variable m_not_full;
+    std::deque<Job> m_queue;
+    bool m_exit{false};
+    // Only used by the writer thread.
+    std::map<std::string, gzFile> m_open;
+    // Last, so that it starts after the rest is constructed.
+    std::thread m_thread;
+};
+
 std::string OutputChunker::gen_chunk_name(void) const {
     auto base = std::string{m_basename};
     base.append("." + std::to_string(m_chunk_count) + ".gz");
@@ -92,16 +224,36 @@ std::string OutputChunker::gen_chunk_name(void) const {
 }
 
 OutputChunker::OutputChunker(const std::string& basename,
-                             bool compress)
-    : m_basename(basename), m_compress(compress) {
+                             bool compress, bool background,
+                             size_t first_chunk)
+    : m_first_chunk(first_chunk), m_chunk_count(first_chunk),
+      m_basename(basename), m_compress(compress), m_background(background) {
 }
 
+// There is always a first chunk, even without any games, but no empty
+// chunk after a full one.
 OutputChunker::~OutputChunker() {
-    flush_chunks();
+    if (m_game_count > 0 || m_chunk_count == m_first_chunk) {
+        flush_chunks();
+    }
 }
 
 void OutputChunker::append(const std::string& str) {
-    m_buffer.append(str);
+    if (m_background) {
+        ChunkWriter::get().write(m_compress ? gen_chunk_name() : m_basename,
+                                 str, m_compress, false);
+    } else if (m_compress) {
+        if (!m_file) {
+            m_file = open_chunk(gen_chunk_name(), cfg_gzip_level);
+        }
+        if (m_file) {
+            write_chunk(m_file, gen_chunk_name(), str);
+        }
+    } else {
+        auto flags = std::ofstream::out | std::ofstream::app;
+        auto out = std::ofstream{m_basename, flags};
+        out << str;
+    }
     m_game_count++;
     if (m_game_count >= CHUNK_SIZE) {
         flush_chunks();
@@ -109,29 +261,20 @@ void OutputChunker::append(const std::string& str) {
 }
 
 void OutputChunker::flush_chunks() {
-    if (m_compress) {
-        auto chunk_name = gen_chunk_name();
-        auto out = gzopen(chunk_name.c_str(), "wb9");
-
-        auto in_buff_size = m_buffer.size();
-        auto in_buff = std::make_unique<char[]>(in_buff_size);
-        memcpy(in_buff.get(), m_buffer.data(), in_buff_size);
-
-        auto comp_size = gzwrite(out, in_buff.get(), in_buff_size);
-        if (in_buff_size && !comp_size) {
-            throw std::runtime_error("Error in gzip output");
+    if (m_compress && m_background) {
+        ChunkWriter::get().write(gen_chunk_name(), {}, true, true);
+        Utils::myprintf("Writing chunk %d\n",  m_chunk_count);
+    } else if (m_compress) {
+        if (!m_file) {
+            m_file = open_chunk(gen_chunk_name(), cfg_gzip_level);
+        }
+        if (m_file) {
+            gzclose(m_file);
+            m_file = nullptr;
         }
         Utils::myprintf("Writing chunk %d\n",  m_chunk_count);
-        gzclose(out);
-    } else {
-        auto chunk_name = m_basename;
-        auto flags = std::ofstream::out | std::ofstream::app;
-        auto out = std::ofstream{chunk_name, flags};
-        out << m_buffer;
-        out.close();
     }
 
-    m_buffer.clear();
     m_chunk_count++;
     m_game_count = 0;
 }
@@ -141,11 +284,11 @@ void Training::clear_training() {
 }
 
 TimeStep::NNPlanes Training::get_planes(const GameState* const state) {
-    const auto input_data = Network::gather_features(state, 0);
+    auto input_data =
+        std::array<net_t, Network::INPUT_CHANNELS * BOARD_SQUARES>{};
+    Network::gather_features(state, 0, input_data.data());
 
     auto planes = TimeStep::NNPlanes{};
-    planes.resize(Network::INPUT_CHANNELS);
-
     for (auto c = size_t{0}; c < Network::INPUT_CHANNELS; c++) {
         for (auto idx = 0; idx < BOARD_SQUARES; idx++) {
             planes[c][idx] = bool(input_data[c * BOARD_SQUARES + idx]);
@@ -172,8 +315,6 @@ void Training::record(GameState& state, UCTNode& root) {
     step.child_uct_winrate = best_node.get_eval(step.to_move);
     step.bestmove_visits = best_node.get_visits();
 
-    step.probabilities.resize((BOARD_SQUARES) + 1);
-
     // Get total visit amount. We count rather
     // than trust the root to avoid ttable issues.
     auto sum_visits = 0.0;
@@ -194,9 +335,9 @@ void Training::record(GameState& state, UCTNode& root) {
         auto move = child->get_move();
         if (move != FastBoard::PASS) {
             auto xy = state.board.get_xy(move);
-            step.probabilities[xy.second * BOARD_SIZE + xy.first] = prob;
+            step.set_probability(xy.second * BOARD_SIZE + xy.first, prob);
         } else {
-            step.probabilities[BOARD_SQUARES] = prob;
+            step.set_probability(BOARD_SQUARES, prob);
         }
     }
 
@@ -205,7 +346,11 @@ void Training::record(GameState& state, UCTNode& root) {
 
 void Training::dump_training(int winner_color, const std::string& filename) {
     auto chunker = OutputChunker{filename, true};
-    dump_training(winner_color, chunker);
+    dump_training(winner_color, m_data, chunker);
+}
+
+void Training::dump_training(int winner_color, OutputChunker& outchunker) {
+    dump_training(winner_color, m_data, outchunker);
 }
 
 void Training::save_training(const std::string& filename) {
@@ -230,27 +375,66 @@ void Training::load_training(std::ifstream& in) {
     int steps;
     in >> steps;
     for (auto i = 0; i < steps; ++i) {
-        TimeStep step;
+        auto step = TimeStep{};
         in >> step;
         m_data.push_back(step);
     }
 }
 
-void Training::dump_training(int winner_color, OutputChunker& outchunk) {
+TrainingRecord Training::get_record(const TimeStep& step,
+                                    const int winner_color) {
+    auto record = TrainingRecord{};
+    // Also clears the padding, which is written out.
+    std::memset(&record, 0, sizeof(record));
+    record.version = TrainingRecord::VERSION;
+    record.komi = step.komi;
+    record.net_winrate = step.net_winrate;
+    record.root_uct_winrate = step.root_uct_winrate;
+    record.child_uct_winrate = step.child_uct_winrate;
+    record.bestmove_visits = step.bestmove_visits;
+    std::copy(begin(step.probabilities), end(step.probabilities),
+              record.probabilities);
+    for (auto p = size_t{0}; p < TrainingRecord::PLANES; p++) {
+        for (auto i = size_t{0}; i < BOARD_SQUARES; i++) {
+            if (step.planes[p][i]) {
+                const auto bit = p * BOARD_SQUARES + i;
+                record.planes[bit / 8] |= 0x80 >> (bit % 8);
+            }
+        }
+    }
+    record.to_move = step.to_move == FastBoard::BLACK ? 0 : 1;
+    record.winner = step.to_move == winner_color ? 1 : 0;
+    record.is_blunder = step.is_blunder;
+    return record;
+}
+
+void Training::dump_training(int winner_color,
+                             const std::vector<TimeStep>& data,
+                             OutputChunker& outchunk) {
     auto training_str = std::string{};
 
-    if (m_data.size()==0) {
+    if (data.size()==0) {
 	return;
     }
 
-    auto it = m_data.end()-1;
-    for ( ; it!=m_data.begin() ; --it ) {
+    auto it = data.end()-1;
+    for ( ; it!=data.begin() ; --it ) {
 	if (it->is_blunder) {
 	    break;
 	}
     }
 
-    for ( ; it!=m_data.end() ; ++it ) {
+    if (cfg_binary_training) {
+        for ( ; it!=data.end() ; ++it ) {
+            const auto record = get_record(*it, winner_color);
+            training_str.append(reinterpret_cast<const char*>(&record),
+                                sizeof(record));
+        }
+        outchunk.append(training_str);
+        return;
+    }
+
+    for ( ; it!=data.end() ; ++it ) {
         auto out = std::stringstream{};
         // First output 16 times an input feature plane
         for (auto p = size_t{0}; p < 16; p++) {
@@ -275,10 +459,9 @@ void Training::dump_training(int winner_color, OutputChunker& outchunk) {
 	    << " " << it->komi
 	    << std::endl;
         // Then a BOARD_SQUARES + 1 long array of float probabilities
-        for (auto its = begin(it->probabilities);
-            its != end(it->probabilities); ++its) {
-            out << *its;
-            if (next(its) != end(it->probabilities)) {
+        for (auto i = size_t{0}; i < it->probabilities.size(); ++i) {
+            out << it->get_probability(i);
+            if (i + 1 < it->probabilities.size()) {
                 out << " ";
             }
         }
@@ -319,10 +502,11 @@ void Training::dump_debug(OutputChunker& outchunk) {
     outchunk.append(debug_str);
 }
 
-void Training::process_game(GameState& state, size_t& train_pos, int who_won,
+void Training::process_game(GameState& state, std::vector<TimeStep>& data,
+                            size_t& train_pos, int who_won,
                             const std::vector<int>& tree_moves,
                             OutputChunker& outchunker) {
-    clear_training();
+    data.clear();
     auto counter = size_t{0};
     state.rewind();
 
@@ -352,24 +536,28 @@ void Training::process_game(GameState& state, size_t& train_pos, int who_won,
         step.planes = get_planes(&state);
         step.komi = komi;
 
-        step.probabilities.resize(BOARD_SQUARES + 1);
-        step.probabilities[move_idx] = 1.0f;
+        step.set_probability(move_idx, 1.0f);
 
         train_pos++;
-        m_data.emplace_back(step);
+        data.emplace_back(step);
 
         counter++;
     } while (state.forward_move() && counter < tree_moves.size());
 
-    dump_training(who_won, outchunker);
+    dump_training(who_won, data, outchunker);
 }
 
 void Training::dump_supervised(const std::string& sgf_name,
                                const std::string& out_filename) {
-    auto outchunker = OutputChunker{out_filename, true};
-    auto games = SGFParser::chop_all(sgf_name);
+    // The games are views of the mapped file.
+    SGFStream sgf(sgf_name);
+    auto games = std::vector<SGFGame>{};
+    for (auto game = SGFGame{}; sgf.next_game(game); ) {
+        games.emplace_back(game);
+    }
     auto gametotal = games.size();
-    auto train_pos = size_t{0};
+    std::atomic<size_t> games_done{0};
+    std::atomic<size_t> train_pos{0};
 
     std::cout << "Total games in file: " << gametotal << std::endl;
     // Shuffle games around
@@ -378,44 +566,61 @@ void Training::dump_supervised(const std::string& sgf_name,
     std::cout << "done." << std::endl;
 
     Time start;
-    for (auto gamecount = size_t{0}; gamecount < gametotal; gamecount++) {
-        auto sgftree = std::make_unique<SGFTree>();
-        try {
-            sgftree->load_from_string(games[gamecount]);
-        } catch (...) {
-            continue;
-        };
-
-        if (gamecount > 0 && gamecount % 1000 == 0) {
-            Time elapsed;
-            auto elapsed_s = Time::timediff_seconds(start, elapsed);
-            Utils::myprintf(
-                "Game %5d, %5d positions in %5.2f seconds -> %d pos/s\n",
-                gamecount, train_pos, elapsed_s, int(train_pos / elapsed_s));
-        }
+    // Every range of games becomes the chunk with its number, whichever
+    // thread replays it, so the output doesn't depend on the threads.
+    constexpr auto chunk_size = OutputChunker::CHUNK_SIZE;
+    const auto process_range = [&](const size_t first, const size_t last) {
+        auto outchunker = OutputChunker{out_filename, true, false,
+                                        first / chunk_size};
+        auto data = std::vector<TimeStep>{};
+        auto tree_moves = std::vector<int>{};
+        auto range_pos = size_t{0};
+        for (auto gamecount = first; gamecount < last; gamecount++) {
+            const auto done = games_done++;
+            if (done > 0 && done % 1000 == 0) {
+                Time elapsed;
+                auto elapsed_s = Time::timediff_seconds(start, elapsed);
+                auto positions = train_pos.load();
+                Utils::myprintf(
+                    "Game %5d, %5d positions in %5.2f seconds -> %d pos/s\n",
+                    done, positions, elapsed_s, int(positions / elapsed_s));
+            }
 
-        auto tree_moves = sgftree->get_mainline();
-        // Empty game or couldn't be parsed?
-        if (tree_moves.size() == 0) {
-            continue;
-        }
+            const auto& game = games[gamecount];
+            auto who_won = game.get_winner();
+            // Accept all komis and handicaps, but reject no usable result
+            if (who_won != FastBoard::BLACK && who_won != FastBoard::WHITE) {
+                continue;
+            }
 
-        auto who_won = sgftree->get_winner();
-        // Accept all komis and handicaps, but reject no usable result
-        if (who_won != FastBoard::BLACK && who_won != FastBoard::WHITE) {
-            continue;
-        }
+            // Our board size is hardcoded in several places, other sizes
+            // throw like games that can't be replayed.
+            auto state = std::unique_ptr<GameState>{};
+            try {
+                state = std::make_unique<GameState>(
+                    game.follow_mainline_state(tree_moves));
+            } catch (...) {
+                continue;
+            };
+
+            // Empty game or couldn't be parsed?
+            if (tree_moves.size() == 0) {
+                continue;
+            }
 
-        auto state =
-            std::make_unique<GameState>(sgftree->follow_mainline_state());
-        // Our board size is hardcoded in several places
-        if (state->board.get_boardsize() != BOARD_SIZE) {
-            continue;
+            range_pos = 0;
+            process_game(*state, data, range_pos, who_won, tree_moves,
+                         outchunker);
+            train_pos += range_pos;
         }
+    };
 
-        process_game(*state, train_pos, who_won, tree_moves,
-                    outchunker);
+    Utils::ThreadGroup tg(thread_pool);
+    for (auto first = size_t{0}; first < gametotal; first += chunk_size) {
+        tg.add_task(process_range, first,
+                    std::min(first + chunk_size, gametotal));
     }
+    tg.wait_all();
 
     std::cout << "Dumped " << train_pos << " training positions." << std::endl;
 }
@@ -22,22 +22,37 @@
 
 #include "config.h"
 
+#include <array>
 #include <bitset>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "GameState.h"
 #include "Network.h"
+#include "TrainingRecord.h"
 #include "UCTNode.h"
 
+// Everything is stored inline, so that recording a game only grows
+// Training::m_data, which keeps its capacity from game to game.
 class TimeStep {
 public:
     using BoardPlane = std::bitset<BOARD_SQUARES>;
-    using NNPlanes = std::vector<BoardPlane>;
+    using NNPlanes = std::array<BoardPlane, Network::INPUT_CHANNELS>;
     NNPlanes planes;
-    std::vector<float> probabilities;
+    // Search probabilities of the intersections and pass, in units of
+    // 1/TrainingRecord::PROBABILITY_SCALE.
+    std::array<std::uint16_t, BOARD_SQUARES + 1> probabilities;
+    float get_probability(const size_t index) const {
+        return probabilities[index] / TrainingRecord::PROBABILITY_SCALE;
+    }
+    void set_probability(const size_t index, const float probability) {
+        probabilities[index] = static_cast<std::uint16_t>(
+            std::round(probability * TrainingRecord::PROBABILITY_SCALE));
+    }
     int to_move;
     float net_winrate;
     float root_uct_winrate;
@@ -50,9 +65,15 @@ public:
 std::ostream& operator<< (std::ostream& stream, const TimeStep& timestep);
 std::istream& operator>> (std::istream& stream, TimeStep& timestep);
 
+struct gzFile_s;
+
 class OutputChunker {
 public:
-    OutputChunker(const std::string& basename, bool compress = false);
+    // Compressed chunks are named basename.N.gz, counting from
+    // first_chunk. With background unset they are written on the calling
+    // thread, which lets several threads compress at once.
+    OutputChunker(const std::string& basename, bool compress = false,
+                  bool background = true, size_t first_chunk = 0);
     ~OutputChunker();
     void append(const std::string& str);
 
@@ -60,12 +81,18 @@ public:
     static constexpr size_t CHUNK_SIZE = 32;
 private:
     std::string gen_chunk_name() const;
+    // Closes the current chunk. The games are queued for a background
+    // writer as they are appended, so the files may still be incomplete
+    // for a moment after this returns; they are complete at exit.
     void flush_chunks();
     size_t m_game_count{0};
-    size_t m_chunk_count{0};
-    std::string m_buffer;
+    size_t m_first_chunk;
+    size_t m_chunk_count;
     std::string m_basename;
     bool m_compress{false};
+    bool m_background{true};
+    // The open chunk without background.
+    gzFile_s* m_file{nullptr};
 };
 
 class Training {
@@ -73,6 +100,8 @@ public:
     static void clear_training();
     static void dump_training(int winner_color,
                               const std::string& out_filename);
+    // The game recorded by this thread, as the next game of outchunker.
+    static void dump_training(int winner_color, OutputChunker& outchunker);
     static void dump_debug(const std::string& out_filename);
     static void record(GameState& state, UCTNode& node);
 
@@ -81,17 +110,25 @@ public:
     static void save_training(const std::string& filename);
     static void load_training(const std::string& filename);
 
+    // The --binarytraining record of step.
+    static TrainingRecord get_record(const TimeStep& step,
+                                     const int winner_color);
+
 private:
     static TimeStep::NNPlanes get_planes(const GameState* const state);
-    static void process_game(GameState& state, size_t& train_pos, int who_won,
+    // Replays a game into data and dumps it, data is scratch space.
+    static void process_game(GameState& state, std::vector<TimeStep>& data,
+                             size_t& train_pos, int who_won,
                              const std::vector<int>& tree_moves,
                              OutputChunker& outchunker);
     static void dump_training(int winner_color,
+                              const std::vector<TimeStep>& data,
                               OutputChunker& outchunker);
     static void dump_debug(OutputChunker& outchunker);
     static void save_training(std::ofstream& out);
     static void load_training(std::ifstream& in);
-    static std::vector<TimeStep> m_data;
+    // Per thread, for the games of a GameServer.
+    static thread_local std::vector<TimeStep> m_data;
 };
 
 #endif
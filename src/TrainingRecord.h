@@ -0,0 +1,64 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRAININGRECORD_H_INCLUDED
+#define TRAININGRECORD_H_INCLUDED
+
+#include "config.h"
+
+#include <cstdint>
+
+// One position of the binary training data, written with
+// --binarytraining instead of the 19 lines of text. The records are
+// stored back to back as they are in memory: little endian, without
+// padding between the fields and with zeros up to a multiple of 4 bytes
+// at the end. training/tf/chunkparser.py reads them as version 3.
+struct TrainingRecord {
+    static constexpr std::uint32_t VERSION = 3;
+    // Input planes stored, the side to move planes follow from to_move.
+    static constexpr auto PLANES = 16;
+    static constexpr auto PROBABILITY_SCALE = 65535.0f;
+
+    std::uint32_t version;
+    float komi;
+    float net_winrate;
+    float root_uct_winrate;
+    float child_uct_winrate;
+    std::uint32_t bestmove_visits;
+    // Search probabilities of the intersections and pass,
+    // in units of 1/PROBABILITY_SCALE.
+    std::uint16_t probabilities[BOARD_SQUARES + 1];
+    // Intersection i of plane p is bit p * BOARD_SQUARES + i, from the
+    // most significant bit of every byte.
+    std::uint8_t planes[PLANES * BOARD_SQUARES / 8];
+    // 0 = black to move.
+    std::uint8_t to_move;
+    // 1 if the side to move won the game, 0 if it lost.
+    std::uint8_t winner;
+    std::uint8_t is_blunder;
+};
+
+static_assert(TrainingRecord::PLANES * BOARD_SQUARES % 8 == 0,
+              "The planes fill whole bytes.");
+static_assert(sizeof(TrainingRecord)
+              == (24 + 2 * (BOARD_SQUARES + 1)
+                  + TrainingRecord::PLANES * BOARD_SQUARES / 8 + 3 + 3)
+                  / 4 * 4,
+              "TrainingRecord has padding between its fields.");
+
+#endif
@@ -0,0 +1,71 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "TranspositionTable.h"
+
+#include <cstring>
+#include <utility>
+
+std::uint64_t TranspositionTable::get_key(const FastState& state) {
+    // The board hash already has the side to move, the ko square
+    // and the passes.
+    auto key = state.board.get_hash();
+    auto komi = state.get_komi();
+    auto komi_bits = std::uint32_t{};
+    std::memcpy(&komi_bits, &komi, sizeof(komi_bits));
+    key ^= (std::uint64_t{komi_bits} + 1) * 0x9E3779B97F4A7C15ULL;
+    key ^= (std::uint64_t{state.get_movenum()} + 1) * 0xC2B2AE3D27D4EB4FULL;
+    return key;
+}
+
+UCTNode* TranspositionTable::insert(std::uint64_t key, UCTNode* node) {
+    auto& shard = get_shard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto it = shard.nodes.emplace(key, node);
+    if (it.second) {
+        m_size++;
+    }
+    return it.first->second;
+}
+
+UCTNode* TranspositionTable::lookup(std::uint64_t key) {
+    auto& shard = get_shard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto it = shard.nodes.find(key);
+    if (it == end(shard.nodes)) {
+        return nullptr;
+    }
+    return it->second;
+}
+
+void TranspositionTable::clear() {
+    for (auto& shard : m_shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.nodes.clear();
+    }
+    m_size = 0;
+}
+
+size_t TranspositionTable::get_estimated_size() const {
+    // Map node with its next pointer and cached hash, and a bucket.
+    constexpr auto ENTRY_SIZE =
+        sizeof(std::pair<const std::uint64_t, UCTNode*>)
+        + 3 * sizeof(void*);
+    return m_size * ENTRY_SIZE;
+}
@@ -0,0 +1,75 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRANSPOSITIONTABLE_H_INCLUDED
+#define TRANSPOSITIONTABLE_H_INCLUDED
+
+#include "config.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+#include "FastState.h"
+
+class UCTNode;
+
+// Maps every position in the search tree to the first node that was
+// created for it. The nodes reached later through another move order
+// don't grow a subtree of their own, the search goes on from the first
+// node instead, so the tree becomes a graph. The table only borrows the
+// nodes and must be cleared before the tree loses any of them.
+class TranspositionTable {
+public:
+    // The position, side to move, ko, passes, komi and move number.
+    // With the move number a node can never be its own descendant.
+    static std::uint64_t get_key(const FastState& state);
+
+    // Store this node for the key, unless there already is one.
+    // Return the node that is stored.
+    UCTNode* insert(std::uint64_t key, UCTNode* node);
+
+    // The stored node, or nullptr.
+    UCTNode* lookup(std::uint64_t key);
+
+    void clear();
+
+    // Bytes taken by the entries.
+    std::size_t get_estimated_size() const;
+
+private:
+    static constexpr auto SHARD_BITS = 6;
+    static constexpr auto NUM_SHARDS = size_t{1} << SHARD_BITS;
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::uint64_t, UCTNode*> nodes;
+    };
+
+    Shard& get_shard(std::uint64_t key) {
+        return m_shards[key >> (64 - SHARD_BITS)];
+    }
+
+    std::array<Shard, NUM_SHARDS> m_shards;
+    std::atomic<size_t> m_size{0};
+};
+
+#endif
@@ -0,0 +1,236 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "TreeFile.h"
+
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "UCTNode.h"
+#include "Utils.h"
+
+using namespace Utils;
+
+// The file, mapped into memory where we can.
+class TreeFile::Reader {
+public:
+    explicit Reader(const std::string& filename) {
+#ifdef _WIN32
+        auto file = std::ifstream(filename, std::ios::binary);
+        m_buffer.assign(std::istreambuf_iterator<char>(file),
+                        std::istreambuf_iterator<char>());
+        m_pos = m_buffer.data();
+        m_end = m_pos + m_buffer.size();
+#else
+        const auto fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            const auto mem = mmap(nullptr, st.st_size, PROT_READ,
+                                  MAP_PRIVATE, fd, 0);
+            if (mem != MAP_FAILED) {
+                // The file is read once from the start.
+                madvise(mem, st.st_size, MADV_SEQUENTIAL);
+                m_map = mem;
+                m_map_size = st.st_size;
+                m_pos = static_cast<const char*>(mem);
+                m_end = m_pos + m_map_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    ~Reader() {
+#ifndef _WIN32
+        if (m_map) {
+            munmap(m_map, m_map_size);
+        }
+#endif
+    }
+
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+
+    bool is_open() const {
+        return m_pos != nullptr;
+    }
+
+    template <typename T>
+    bool read(T& value) {
+        if (size_t(m_end - m_pos) < sizeof(T)) {
+            return false;
+        }
+        std::memcpy(&value, m_pos, sizeof(T));
+        m_pos += sizeof(T);
+        return true;
+    }
+
+private:
+#ifdef _WIN32
+    std::vector<char> m_buffer;
+#else
+    void* m_map{nullptr};
+    size_t m_map_size{0};
+#endif
+    const char* m_pos{nullptr};
+    const char* m_end{nullptr};
+};
+
+template <typename T>
+static void append(std::string& out, const T& value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+void TreeFile::write_node(std::string& out, const UCTNode& node,
+                          const int min_visits) {
+    auto record = NodeRecord{};
+    record.blackevals = node.m_blackevals;
+    record.visits = node.m_visits;
+    record.children = static_cast<std::uint32_t>(node.m_children.size());
+    record.min_psa_ratio_children = node.m_min_psa_ratio_children;
+    record.net_eval = node.m_net_eval;
+    record.net_alpkt = node.m_net_alpkt;
+    record.net_beta = node.m_net_beta;
+    record.eval_bonus = node.m_eval_bonus;
+    record.eval_bonus_father = node.m_eval_bonus_father;
+    append(out, record);
+
+    const auto expanded = [min_visits](const UCTNodePointer& child) {
+        return child.is_inflated() && child.get_visits() > 0
+               && child.get_visits() >= min_visits;
+    };
+    for (const auto& child : node.m_children) {
+        auto child_record = ChildRecord{};
+        child_record.move = static_cast<std::int16_t>(child.get_move());
+        child_record.expanded = expanded(child);
+        child_record.status = child_record.expanded
+            ? static_cast<std::uint8_t>(child->m_status.load())
+            : static_cast<std::uint8_t>(UCTNode::ACTIVE);
+        child_record.score = child.get_score();
+        append(out, child_record);
+    }
+    for (const auto& child : node.m_children) {
+        if (expanded(child)) {
+            write_node(out, *child, min_visits);
+        }
+    }
+}
+
+bool TreeFile::read_node(Reader& in, UCTNode& node) {
+    auto record = NodeRecord{};
+    if (!in.read(record) || record.children > BOARD_SQUARES + 1) {
+        return false;
+    }
+    node.m_blackevals = record.blackevals;
+    node.m_visits = record.visits;
+    node.m_min_psa_ratio_children = record.min_psa_ratio_children;
+    node.m_net_eval = record.net_eval;
+    node.m_net_alpkt = record.net_alpkt;
+    node.m_net_beta = record.net_beta;
+    node.m_eval_bonus = record.eval_bonus;
+    node.m_eval_bonus_father = record.eval_bonus_father;
+
+    // link_nodelist() can add the moves that were left out later, and
+    // it must find the room reserved.
+    const auto skipped = record.min_psa_ratio_children > 0.0f
+                         && record.min_psa_ratio_children <= 1.0f;
+    node.m_children.reserve(skipped ? BOARD_SQUARES + 1 : record.children);
+    auto expanded = std::vector<bool>();
+    for (auto i = std::uint32_t{0}; i < record.children; i++) {
+        auto child_record = ChildRecord{};
+        if (!in.read(child_record)
+            || child_record.status > UCTNode::ACTIVE) {
+            return false;
+        }
+        node.m_children.emplace_back(child_record.move, child_record.score);
+        expanded.push_back(child_record.expanded != 0);
+        if (expanded.back()) {
+            auto& child = node.m_children[i];
+            child.inflate();
+            child->m_status =
+                static_cast<UCTNode::Status>(child_record.status);
+        }
+    }
+    for (auto i = std::uint32_t{0}; i < record.children; i++) {
+        if (expanded[i] && !read_node(in, *node.m_children[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TreeFile::save(const std::string& filename, const UCTNode& root,
+                    const std::uint64_t key, const std::uint64_t net_key,
+                    const int min_visits) {
+    auto out = std::string{};
+    append(out, Header{MAGIC, key, net_key});
+    write_node(out, root, min_visits);
+
+    auto file = std::ofstream(filename, std::ios::binary);
+    file.write(out.data(), out.size());
+    file.close();
+    if (!file) {
+        myprintf("Could not write %s.\n", filename.c_str());
+        return false;
+    }
+    myprintf("Saved %d visits in %zu bytes.\n", root.get_visits(),
+             out.size());
+    return true;
+}
+
+std::unique_ptr<UCTNode> TreeFile::load(const std::string& filename,
+                                        const std::uint64_t key,
+                                        const std::uint64_t net_key) {
+    Reader in(filename);
+    auto header = Header{};
+    if (!in.is_open() || !in.read(header)) {
+        myprintf("Could not read %s.\n", filename.c_str());
+        return nullptr;
+    }
+    if (header.magic != MAGIC) {
+        myprintf("%s is not a search tree.\n", filename.c_str());
+        return nullptr;
+    }
+    if (header.key != key) {
+        myprintf("%s is the tree of another position.\n", filename.c_str());
+        return nullptr;
+    }
+    if (header.net_key != net_key) {
+        myprintf("%s was searched with another network.\n",
+                 filename.c_str());
+        return nullptr;
+    }
+    auto root = std::make_unique<UCTNode>(FastBoard::PASS, 0.0f);
+    if (!read_node(in, *root)) {
+        myprintf("%s is truncated or damaged.\n", filename.c_str());
+        return nullptr;
+    }
+    return root;
+}
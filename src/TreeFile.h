@@ -0,0 +1,87 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TREEFILE_H_INCLUDED
+#define TREEFILE_H_INCLUDED
+
+#include "config.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+class UCTNode;
+
+// Saves a search tree to disk and loads it back, for lz-savetree and
+// lz-loadtree. A node is stored with its visits, evals, SAI alpkt, beta
+// and bonuses, then its children as move and prior, then the subtrees
+// of the children that were expanded, depth first. The file is in the
+// byte order of the host. It records the network that grew the tree,
+// and it is only loaded back with that network.
+class TreeFile {
+public:
+    // Children with fewer than min_visits visits are stored without
+    // their subtrees. key is TranspositionTable::get_key of the root and
+    // net_key Network::get_net_key.
+    static bool save(const std::string& filename, const UCTNode& root,
+                     std::uint64_t key, std::uint64_t net_key,
+                     int min_visits);
+
+    // The tree in the file, or nullptr if it can't be read or is for
+    // another key or network.
+    static std::unique_ptr<UCTNode> load(const std::string& filename,
+                                         std::uint64_t key,
+                                         std::uint64_t net_key);
+
+private:
+    struct Header {
+        std::uint64_t magic;
+        std::uint64_t key;
+        std::uint64_t net_key;
+    };
+
+    struct NodeRecord {
+        std::int64_t blackevals;
+        std::int32_t visits;
+        std::uint32_t children;
+        float min_psa_ratio_children;
+        float net_eval;
+        float net_alpkt;
+        float net_beta;
+        float eval_bonus;
+        float eval_bonus_father;
+    };
+
+    struct ChildRecord {
+        std::int16_t move;
+        // Whether a NodeRecord follows for this child.
+        std::uint8_t expanded;
+        std::uint8_t status;
+        float score;
+    };
+
+    // Identifies the layout, bump when it changes.
+    static constexpr auto MAGIC = std::uint64_t{0x4c5a545245450002};
+
+    class Reader;
+    static void write_node(std::string& out, const UCTNode& node,
+                           int min_visits);
+    static bool read_node(Reader& in, UCTNode& node);
+};
+
+#endif
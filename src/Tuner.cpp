@@ -19,8 +19,11 @@
 #include "config.h"
 
 #ifdef USE_OPENCL
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <cstdio>
+#include <limits>
 #include <iostream>
 #include <sstream>
 #include <string>
@@ -29,6 +32,7 @@
 #include <cmath>
 #include <fstream>
 
+#include "half/half.hpp"
 #include "GTP.h"
 #include "OpenCL.h"
 #include "Tuner.h"
@@ -45,17 +49,24 @@
 #include <cblas.h>
 #endif
 
-const auto TUNER_FILE_LOCAL = std::string("leelaz_opencl_tuning");
-#ifdef USE_HALF
-const auto TUNER_KERNEL = std::string("XgemmBatchedHalf");
-constexpr auto MAX_ERROR = 1e-2f;
-#else
-const auto TUNER_KERNEL = std::string("XgemmBatched");
-constexpr auto MAX_ERROR = 1e-4f;
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
 #endif
 
+const auto TUNER_FILE_LOCAL = std::string("leelaz_opencl_tuning");
+const auto TUNER_KERNEL_SINGLE = std::string("XgemmBatched");
+const auto TUNER_KERNEL_HALF = std::string("XgemmBatchedHalf");
+constexpr auto MAX_ERROR_SINGLE = 1e-4f;
+constexpr auto MAX_ERROR_HALF = 1e-2f;
+// Runs that take this many times longer than the best one end the
+// configuration early.
+constexpr auto PRUNE_FACTOR = 3.0f;
+
 using namespace Utils;
 
+template <typename net_t>
 static void sgemmBatched_ref(const std::vector<net_t>& a,
                              const std::vector<net_t>& b,
                              std::vector<net_t>& c,
@@ -170,6 +181,7 @@ static size_t next_power_of_two(const size_t x) {
     return 2 << size_t(std::ceil(std::log2(x)) - 1);
 }
 
+template <typename net_t>
 static void sgemm_generate_data(std::vector<net_t> &x,
                                 const int m, const int n,
                                 const int batch_size,
@@ -193,6 +205,7 @@ static void sgemm_generate_data(std::vector<net_t> &x,
     }
 }
 
+template <typename net_t>
 static float compare_ref(std::vector<net_t> &x, std::vector<net_t> &ref,
                          const int m, const int n, const int batch_size,
                          const int m_ceil, const int n_ceil) {
@@ -210,8 +223,19 @@ static float compare_ref(std::vector<net_t> &x, std::vector<net_t> &ref,
     return sum / (m*n);
 }
 
-std::string Tuner::tune_sgemm(const int m, const int n, const int k,
-                              const int batch_size, const int runs) {
+std::string Tuner::tune_sgemm(const int m, const std::vector<int>& ns,
+                              const int k, const int batch_size,
+                              const int runs) {
+    if (m_opencl.m_use_half) {
+        return tune_sgemm<half_float::half>(m, ns, k, batch_size, runs);
+    }
+    return tune_sgemm<float>(m, ns, k, batch_size, runs);
+}
+
+template <typename net_t>
+std::string Tuner::tune_sgemm(const int m, const std::vector<int>& ns,
+                              const int k, const int batch_size,
+                              const int runs) {
     auto opts = std::vector<Configurations>();
     if (cfg_sgemm_exhaustive) {
         opts = {
@@ -251,7 +275,7 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
 
     // This needs to be at minimum the maximum (MNK/WG) values above.
     auto m_max = std::max(64, m);
-    auto n_max = std::max(64, n);
+    auto n_max = std::max(64, *std::max_element(begin(ns), end(ns)));
     auto k_max = std::max(32, k);
 
     auto at_size = batch_size
@@ -261,24 +285,39 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
     auto c_size = batch_size
         * next_power_of_two(m_max) * next_power_of_two(n_max);
 
-    auto total_flops = batch_size * 2.0 * m * n * k;
-
     auto at = std::vector<net_t>(at_size);
     auto b = std::vector<net_t>(b_size);
     auto c = std::vector<net_t>(c_size);
-    auto c_ref = std::vector<net_t>(c_size);
 
-    sgemm_generate_data(at, k, m, batch_size, k, m);
-    sgemm_generate_data(b, n, k, batch_size, n, k);
+    // Every n has its own input and reference result.
+    struct SizeData {
+        int n;
+        double total_flops;
+        std::vector<net_t> c_ref;
+        cl::Buffer bBuffer;
+        int n_ceil_prev{0};
+        int k_ceil_prev{0};
+        // Fastest single run of any configuration, in nanoseconds.
+        float best_run{0.0f};
+    };
+    auto sizes = std::vector<SizeData>(ns.size());
 
-    sgemmBatched_ref(at, b, c_ref, m, n, k, batch_size);
+    sgemm_generate_data(at, k, m, batch_size, k, m);
+    for (auto i = size_t{0}; i < ns.size(); i++) {
+        auto& size = sizes[i];
+        size.n = ns[i];
+        size.total_flops = batch_size * 2.0 * m * size.n * k;
+        size.c_ref.resize(c_size);
+        sgemm_generate_data(b, size.n, k, batch_size, size.n, k);
+        sgemmBatched_ref(at, b, size.c_ref, m, size.n, k, batch_size);
+        size.bBuffer = cl::Buffer(
+            m_context,
+            CL_MEM_READ_WRITE, sizeof(net_t) * b_size, nullptr, nullptr);
+    }
 
     auto aBuffer = cl::Buffer(
         m_context,
         CL_MEM_READ_WRITE, sizeof(net_t) * at_size, nullptr, nullptr);
-    auto bBuffer = cl::Buffer(
-        m_context,
-        CL_MEM_READ_WRITE, sizeof(net_t) * b_size, nullptr, nullptr);
     auto cBuffer = cl::Buffer(
         m_context,
         CL_MEM_READ_WRITE, sizeof(net_t) * c_size, nullptr, nullptr);
@@ -305,19 +344,23 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
             valid_params.emplace_back(i);
         }
     }
-    myprintf("Will try %zu valid configurations.\n", valid_params.size());
+    myprintf("Will try %zu valid configurations for %zu batch size(s).\n",
+             valid_params.size(), sizes.size());
 
     std::string best_params;
-    auto best_time = unsigned{0};
+    auto best_score = std::numeric_limits<double>::infinity();
 
     auto queue = cl::CommandQueue(m_context,
                                   m_device,
                                   CL_QUEUE_PROFILING_ENABLE);
     auto event = cl::Event();
-    auto program = cl::Program(m_context, sourceCode_sgemm);
+    auto program = cl::Program(m_context, m_opencl.m_use_half
+                                              ? sourceCode_sgemm_half
+                                              : sourceCode_sgemm_single);
+    const auto max_allowed_error = m_opencl.m_use_half ? MAX_ERROR_HALF
+                                                       : MAX_ERROR_SINGLE;
 
     auto m_ceil_prev = 0;
-    auto n_ceil_prev = 0;
     auto k_ceil_prev = 0;
     auto param_counter = size_t{0};
 
@@ -335,94 +378,152 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
             continue;
         }
 
-        // The kernel is (for now) named the same even in USE_HALF
+        // The kernel is (for now) named the same in half precision
         auto sgemm_kernel = cl::Kernel(program, "XgemmBatched");
 
         auto m_ceil = int(ceilMultiple(ceilMultiple(m, p["MWG"]), p["VWM"]));
-        auto n_ceil = int(ceilMultiple(ceilMultiple(n, p["NWG"]), p["VWN"]));
         auto k_ceil = int(ceilMultiple(ceilMultiple(k, p["KWG"]), p["VWM"]));
 
-        if (m_ceil != m_ceil_prev
-            || n_ceil != n_ceil_prev
-            || k_ceil != k_ceil_prev) {
+        if (m_ceil != m_ceil_prev || k_ceil != k_ceil_prev) {
             m_ceil_prev = m_ceil;
-            n_ceil_prev = n_ceil;
             k_ceil_prev = k_ceil;
 
             sgemm_generate_data(at, k, m, batch_size, k_ceil, m_ceil);
-            sgemm_generate_data(b, n, k, batch_size, n_ceil, k_ceil);
-
             queue.enqueueWriteBuffer(aBuffer, CL_FALSE, 0,
                                      at_size * sizeof(net_t), at.data());
-            queue.enqueueWriteBuffer(bBuffer, CL_FALSE, 0,
-                                     b_size * sizeof(net_t), b.data());
             queue.finish();
         }
 
-        sgemm_kernel.setArg(0, m_ceil);
-        sgemm_kernel.setArg(1, n_ceil);
-        sgemm_kernel.setArg(2, k_ceil);
-        sgemm_kernel.setArg(3, aBuffer);
-        sgemm_kernel.setArg(4, bBuffer);
-        sgemm_kernel.setArg(5, cBuffer);
-
-        cl::NDRange local_sgemm = {p["MDIMC"], p["NDIMC"], 1};
-
-
-        cl::NDRange size_sgemm = {(m_ceil * p["MDIMC"]) / p["MWG"],
-                                  (n_ceil * p["NDIMC"]) / p["NWG"],
-                                  size_t(batch_size)};
-
-        auto sum = 0.0f;
-        auto max_error = 0.0f;
-        for (auto r = 0; r < runs; r++) {
-            try {
-                queue.enqueueNDRangeKernel(sgemm_kernel, cl::NullRange,
-                                           size_sgemm, local_sgemm,
-                                           nullptr, &event);
-                queue.finish();
-                event.wait();
-
-                queue.enqueueReadBuffer(cBuffer, CL_FALSE, 0,
-                                        c_size * sizeof(net_t), c.data());
+        // Sum of the log of the time for every batch size, and the
+        // plain sums for the output.
+        auto score = 0.0;
+        auto total_time = 0.0;
+        auto total_flops = 0.0;
+        auto failed = false;
+        for (auto& size : sizes) {
+            auto n_ceil = int(ceilMultiple(ceilMultiple(size.n, p["NWG"]),
+                                           p["VWN"]));
+            if (n_ceil != size.n_ceil_prev || k_ceil != size.k_ceil_prev) {
+                size.n_ceil_prev = n_ceil;
+                size.k_ceil_prev = k_ceil;
+
+                sgemm_generate_data(b, size.n, k, batch_size, n_ceil, k_ceil);
+                queue.enqueueWriteBuffer(size.bBuffer, CL_FALSE, 0,
+                                         b_size * sizeof(net_t), b.data());
                 queue.finish();
+            }
 
-                auto this_error = compare_ref(c, c_ref, n, m, batch_size,
-                                              n_ceil, m_ceil);
-                max_error = std::max(max_error, this_error);
-
-                auto elapsed =
-                    event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
-                    event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-
-                sum += elapsed;
-            } catch (const cl::Error&) {
-                // Failed to enqueue kernel. Set error to max.
-                max_error = MAX_ERROR;
+            sgemm_kernel.setArg(0, m_ceil);
+            sgemm_kernel.setArg(1, n_ceil);
+            sgemm_kernel.setArg(2, k_ceil);
+            sgemm_kernel.setArg(3, aBuffer);
+            sgemm_kernel.setArg(4, size.bBuffer);
+            sgemm_kernel.setArg(5, cBuffer);
+
+            cl::NDRange local_sgemm = {p["MDIMC"], p["NDIMC"], 1};
+
+
+            cl::NDRange size_sgemm = {(m_ceil * p["MDIMC"]) / p["MWG"],
+                                      (n_ceil * p["NDIMC"]) / p["NWG"],
+                                      size_t(batch_size)};
+
+            auto sum = 0.0f;
+            auto max_error = 0.0f;
+            for (auto r = 0; r < runs; r++) {
+                try {
+                    queue.enqueueNDRangeKernel(sgemm_kernel, cl::NullRange,
+                                               size_sgemm, local_sgemm,
+                                               nullptr, &event);
+                    queue.finish();
+                    event.wait();
+
+                    queue.enqueueReadBuffer(cBuffer, CL_FALSE, 0,
+                                            c_size * sizeof(net_t), c.data());
+                    queue.finish();
+
+                    auto this_error = compare_ref(c, size.c_ref, size.n, m,
+                                                  batch_size, n_ceil, m_ceil);
+                    max_error = std::max(max_error, this_error);
+
+                    auto elapsed = float(
+                        event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+                        event.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+
+                    sum += elapsed;
+                    if (size.best_run == 0.0f || elapsed < size.best_run) {
+                        size.best_run = elapsed;
+                    }
+                    // A configuration far slower than the best one seen
+                    // can't win, don't spend the other runs on it.
+                    if (elapsed > PRUNE_FACTOR * size.best_run) {
+                        failed = true;
+                        break;
+                    }
+                } catch (const cl::Error&) {
+                    // Failed to enqueue kernel. Set error to max.
+                    max_error = max_allowed_error;
+                    break;
+                }
+            }
+            if (failed || max_error >= max_allowed_error) {
+                failed = true;
+                break;
+            }
+            score += std::log(sum / runs);
+            total_time += sum / runs;
+            total_flops += size.total_flops;
+            // The times are in nanoseconds, so no term is negative.
+            if (score >= best_score) {
+                failed = true;
                 break;
             }
         }
-        if (max_error < MAX_ERROR && (best_time == 0 || sum < best_time)) {
+        if (!failed && score < best_score) {
             auto param_str = parameters_to_string(p);
-            auto kernel_ms = 1e-6f * (sum / runs);
+            auto kernel_ms = 1e-6f * total_time;
             // Timing is in nanoseconds (10^-9), Giga = 10^9, so this works out
-            auto kernel_gflops = total_flops / (sum / runs);
+            auto kernel_gflops = total_flops / total_time;
             myprintf("(%u/%u) %s %.4f ms (%.1f GFLOPS)\n",
                param_counter, valid_params.size(), param_str.c_str(),
                kernel_ms, kernel_gflops);
-            best_time = sum;
+            best_score = score;
             best_params = defines;
         }
     }
-    if (best_time == 0) {
+    if (best_params.empty()) {
         printf("Failed to find a working configuration.\nCheck your OpenCL drivers.\n");
         throw std::runtime_error("Tuner failed to find working configuration.");
     }
     return best_params;
 }
 
-void Tuner::store_sgemm_tuners(const int m, const int n, const int k,
-                               const int batch_size, std::string tuners) {
+#ifndef _WIN32
+TunerFileLock::TunerFileLock() {
+    const auto lock_file = TUNER_FILE_LOCAL + ".lock";
+    m_fd = open(lock_file.c_str(), O_RDWR | O_CREAT, 0644);
+    if (m_fd >= 0) {
+        flock(m_fd, LOCK_EX);
+    }
+}
+
+TunerFileLock::~TunerFileLock() {
+    if (m_fd >= 0) {
+        flock(m_fd, LOCK_UN);
+        close(m_fd);
+    }
+}
+#else
+TunerFileLock::TunerFileLock() {}
+TunerFileLock::~TunerFileLock() {}
+#endif
+
+void Tuner::store_sgemm_tuners(const int m, const std::vector<int>& ns,
+                               const int k, const int batch_size,
+                               std::string tuners) {
+    // Other engines, or the other devices of this one, may be storing
+    // their tunings right now.
+    TunerFileLock lock;
+
     auto file_contents = std::vector<std::string>();
     {
         // Read the previous contents to string
@@ -434,29 +535,46 @@ void Tuner::store_sgemm_tuners(const int m, const int n, const int k,
             }
         }
     }
-    auto file = std::ofstream{TUNER_FILE_LOCAL};
+    // Readers don't take the lock, they see the old or the new file.
+    const auto tmp_file = TUNER_FILE_LOCAL + ".tmp";
+    auto file = std::ofstream{tmp_file};
 
     auto device_name = m_opencl.get_device_name();
-    auto tuning_params = std::stringstream{};
-    tuning_params << m << ";" << n << ";" << k << ";" << batch_size;
+    auto tuning_lines = std::vector<std::string>{};
+    auto tuning_line_prefixes = std::vector<std::string>{};
+    for (const auto n : ns) {
+        auto tuning_params = std::stringstream{};
+        tuning_params << m << ";" << n << ";" << k << ";" << batch_size;
 
-    auto tuning_line_prefix = std::to_string(TUNER_VERSION) + ";"
-        + TUNER_KERNEL + ";" + tuning_params.str() + ";";
-    auto tuning_line = tuning_line_prefix + tuners + ";" + device_name;
+        auto tuning_line_prefix = std::to_string(TUNER_VERSION) + ";"
+            + get_tuner_kernel() + ";" + tuning_params.str() + ";";
+        tuning_lines.emplace_back(tuning_line_prefix + tuners + ";"
+                                  + device_name);
+        tuning_line_prefixes.emplace_back(tuning_line_prefix);
+    }
 
     // Write back previous data as long as it's not the device and
     // tuning we just tuned
     for (const auto& line : file_contents) {
-        if (line.find(tuning_line_prefix) == std::string::npos
-            || line.find(device_name) == std::string::npos) {
+        const auto replaced = line.find(device_name) != std::string::npos
+            && std::any_of(begin(tuning_line_prefixes),
+                           end(tuning_line_prefixes),
+                           [&line](const std::string& prefix) {
+                               return line.find(prefix) != std::string::npos;
+                           });
+        if (!replaced) {
             file << line << std::endl;
         }
     }
 
     // Write new tuning
-    file << tuning_line << std::endl;
+    for (const auto& tuning_line : tuning_lines) {
+        file << tuning_line << std::endl;
+    }
+    file.close();
 
-    if (file.fail()) {
+    if (file.fail()
+        || std::rename(tmp_file.c_str(), TUNER_FILE_LOCAL.c_str()) != 0) {
         myprintf("Could not save the tuning result.\n");
         myprintf("Do I have write permissions on %s?\n",
             TUNER_FILE_LOCAL.c_str());
@@ -482,7 +600,7 @@ std::string Tuner::sgemm_tuners_from_line(std::string line,
         return "";
     }
 
-    if (s[1] != TUNER_KERNEL) {
+    if (s[1] != get_tuner_kernel()) {
         return "";
     }
 
@@ -509,21 +627,35 @@ std::string Tuner::sgemm_tuners_from_line(std::string line,
     return s[6];
 }
 
-std::string Tuner::load_sgemm_tuners(const int m, const int n, const int k,
-                                     const int batch_size) {
+std::string Tuner::get_tuner_kernel() const {
+    return m_opencl.m_use_half ? TUNER_KERNEL_HALF : TUNER_KERNEL_SINGLE;
+}
+
+std::string Tuner::load_sgemm_tuners(const int m, const std::vector<int>& ns,
+                                     const int k, const int batch_size) {
     auto file = std::ifstream{TUNER_FILE_LOCAL};
     if (!cfg_sgemm_exhaustive && file.good()) {
+        // Tuning of the largest n, if there is one for every n.
+        auto found = std::vector<std::string>(ns.size());
         auto line = std::string{};
         while (std::getline(file, line)) {
-            auto tuners = sgemm_tuners_from_line(line, m, n, k, batch_size);
-            if (tuners.size() != 0) {
-                myprintf("Loaded existing SGEMM tuning.\n");
-                return tuners;
+            for (auto i = size_t{0}; i < ns.size(); i++) {
+                auto tuners = sgemm_tuners_from_line(line, m, ns[i], k,
+                                                     batch_size);
+                if (tuners.size() != 0) {
+                    found[i] = tuners;
+                }
             }
         }
+        if (std::none_of(begin(found), end(found),
+                         [](const std::string& t) { return t.empty(); })) {
+            myprintf("Loaded existing SGEMM tuning.\n");
+            const auto largest = std::max_element(begin(ns), end(ns));
+            return found[largest - begin(ns)];
+        }
     }
-    auto tuners = tune_sgemm(m, n, k, batch_size);
-    store_sgemm_tuners(m, n, k, batch_size, tuners);
+    auto tuners = tune_sgemm(m, ns, k, batch_size);
+    store_sgemm_tuners(m, ns, k, batch_size, tuners);
     return tuners;
 }
 
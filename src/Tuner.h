@@ -29,22 +29,45 @@ using Parameters = std::map<std::string, size_t>;
 
 class OpenCL;
 
+// Exclusive lock on the tuning file while it is in scope, shared by all
+// the engines that run in the same directory. Does nothing on Windows.
+class TunerFileLock {
+public:
+    TunerFileLock();
+    ~TunerFileLock();
+    TunerFileLock(const TunerFileLock&) = delete;
+    TunerFileLock& operator=(const TunerFileLock&) = delete;
+private:
+    int m_fd{-1};
+};
+
 class Tuner {
     OpenCL & m_opencl;
     cl::Context m_context;
     cl::Device m_device;
 public:
-    std::string tune_sgemm(const int m, const int n, const int k,
-                           const int batch_size, const int runs = 4);
-    std::string load_sgemm_tuners(const int m, const int n, const int k,
-                                  const int batch_size);
+    // ns holds one n for every network batch size, the configuration
+    // with the lowest geometric mean time over all of them wins.
+    std::string tune_sgemm(const int m, const std::vector<int>& ns,
+                           const int k, const int batch_size,
+                           const int runs = 4);
+    // The tuning is stored for every n, and an earlier one is only used
+    // if it covers all of them.
+    std::string load_sgemm_tuners(const int m, const std::vector<int>& ns,
+                                  const int k, const int batch_size);
 
     static constexpr auto TUNER_VERSION = 0;
     Tuner(OpenCL & opencl, cl::Context context, cl::Device device) :
         m_opencl(opencl), m_context(context), m_device(device) {}
 private:
-    void store_sgemm_tuners(const int m, const int n, const int k,
-                            const int batch_size, std::string tuners);
+    template <typename net_t>
+    std::string tune_sgemm(const int m, const std::vector<int>& ns,
+                           const int k, const int batch_size,
+                           const int runs);
+    std::string get_tuner_kernel() const;
+    void store_sgemm_tuners(const int m, const std::vector<int>& ns,
+                            const int k, const int batch_size,
+                            std::string tuners);
     bool valid_config_sgemm(Parameters p, bool exhaustive);
     std::string parameters_to_defines(const Parameters& p);
     std::string parameters_to_string(const Parameters& p);
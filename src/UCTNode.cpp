@@ -23,6 +23,7 @@
 #include <cstdio>
 #include <cstdint>
 #include <algorithm>
+#include <array>
 #include <cmath>
 #include <functional>
 #include <iterator>
@@ -37,6 +38,7 @@
 #include "GTP.h"
 #include "GameState.h"
 #include "Network.h"
+#include "Profile.h"
 #include "Utils.h"
 
 using namespace Utils;
@@ -58,6 +60,18 @@ bool UCTNode::create_children(std::atomic<int>& nodecount,
                               float& alpkt,
 			      float& beta,
                               float min_psa_ratio) {
+    if (!start_expansion(state, min_psa_ratio)) {
+        return false;
+    }
+
+    const auto raw_netlist = Network::get_scored_moves(
+        &state, Network::Ensemble::RANDOM_SYMMETRY);
+
+    expand(nodecount, state, raw_netlist, value, alpkt, beta, min_psa_ratio);
+    return true;
+}
+
+bool UCTNode::start_expansion(const GameState& state, float min_psa_ratio) {
     // check whether somebody beat us to it (atomic)
     if (!expandable(min_psa_ratio)) {
         return false;
@@ -78,11 +92,13 @@ bool UCTNode::create_children(std::atomic<int>& nodecount,
     }
     // We'll be the one queueing this node for expansion, stop others
     m_is_expanding = true;
-    lock.unlock();
-
-    const auto raw_netlist = Network::get_scored_moves(
-        &state, Network::Ensemble::RANDOM_SYMMETRY);
+    return true;
+}
 
+void UCTNode::expand(std::atomic<int>& nodecount, GameState& state,
+                     const Network::Netresult& raw_netlist,
+                     float& value, float& alpkt, float& beta,
+                     float min_psa_ratio) {
     const auto to_move = state.board.get_to_move();
     const auto komi = state.get_bonus();
 
@@ -94,16 +110,13 @@ bool UCTNode::create_children(std::atomic<int>& nodecount,
 
     if (is_mult_komi_net) {
 	const auto pi = sigmoid(m_net_alpkt, m_net_beta, 0.0f);
-	const auto pi_lambda = (1-cfg_lambda)*pi + cfg_lambda*0.5f;
-	m_eval_bonus = std::log( (pi_lambda)/(1.0f-pi_lambda) ) / m_net_beta
-	    - m_net_alpkt;
-	
+	m_eval_bonus = eval_bonus(m_net_alpkt, m_net_beta);
 
 #ifndef NDEBUG
 	myprintf("alpha=%f, beta=%f, pass=%f\n"
-		 "alpkt=%f, pi=%f, pi_lambda=%f, x_bar=%f\n",
+		 "alpkt=%f, pi=%f, x_bar=%f\n",
 		 raw_netlist.alpha, raw_netlist.beta, raw_netlist.policy_pass,
-		 m_net_alpkt, pi, pi_lambda, m_eval_bonus);
+		 m_net_alpkt, pi, m_eval_bonus);
 #endif
 
 	m_net_eval = pi;
@@ -122,12 +135,13 @@ bool UCTNode::create_children(std::atomic<int>& nodecount,
 
     std::vector<Network::ScoreVertexPair> nodelist;
 
+    const auto legal = state.get_legal_moves(to_move);
+    nodelist.reserve(legal.count() + 1);
     auto legal_sum = 0.0f;
     for (auto i = 0; i < BOARD_SQUARES; i++) {
-        const auto x = i % BOARD_SIZE;
-        const auto y = i / BOARD_SIZE;
-        const auto vertex = state.board.get_vertex(x, y);
-        if (state.is_move_legal(to_move, vertex)) {
+        if (legal[i]) {
+            const auto vertex = state.board.get_vertex(i % BOARD_SIZE,
+                                                       i / BOARD_SIZE);
             nodelist.emplace_back(raw_netlist.policy[i], vertex);
             legal_sum += raw_netlist.policy[i];
         }
@@ -149,7 +163,27 @@ bool UCTNode::create_children(std::atomic<int>& nodecount,
     }
 
     link_nodelist(nodecount, nodelist, min_psa_ratio);
-    return true;
+}
+
+void UCTNode::set_solved(const float score) {
+    // As SearchResult::from_score. No child needs the bonus.
+    m_net_alpkt = score;
+    m_net_beta = 10.0f;
+    m_net_eval = score > 0.0f ? 1.0f : (score < 0.0f ? 0.0f : 0.5f);
+    m_eval_bonus = 0.0f;
+
+    LOCK(get_mutex(), lock);
+    m_min_psa_ratio_children = SOLVED_RATIO;
+    m_is_expanding = false;
+}
+
+void UCTNode::cancel_expansion() {
+    LOCK(get_mutex(), lock);
+    m_is_expanding = false;
+}
+
+bool UCTNode::solved() const {
+    return m_min_psa_ratio_children == SOLVED_RATIO;
 }
 
 void UCTNode::link_nodelist(std::atomic<int>& nodecount,
@@ -169,15 +203,9 @@ void UCTNode::link_nodelist(std::atomic<int>& nodecount,
     const auto max_psa = nodelist[0].first;
     const auto old_min_psa = max_psa * m_min_psa_ratio_children;
     const auto new_min_psa = max_psa * min_psa_ratio;
-    if (new_min_psa > 0.0f) {
-        m_children.reserve(
-            std::count_if(cbegin(nodelist), cend(nodelist),
-                [=](const auto& node) { return node.first >= new_min_psa; }
-            )
-        );
-    } else {
-        m_children.reserve(nodelist.size());
-    }
+    // Room for all the moves from the start, so that adding the pruned
+    // ones later never moves the children under uct_select_child.
+    m_children.reserve(nodelist.size());
 
     auto skipped_children = false;
     for (const auto& node : nodelist) {
@@ -193,7 +221,7 @@ void UCTNode::link_nodelist(std::atomic<int>& nodecount,
     m_is_expanding = false;
 }
 
-const std::vector<UCTNodePointer>& UCTNode::get_children() const {
+const UCTNodeList& UCTNode::get_children() const {
     return m_children;
 }
 
@@ -215,8 +243,28 @@ void UCTNode::update(float eval) {
     accumulate_eval(eval);
 }
 
+void UCTNode::shift_net_eval(const float delta, const int tomove) {
+    m_net_alpkt -= delta;
+    const auto pi = sigmoid(m_net_alpkt, m_net_beta, 0.0f);
+    m_eval_bonus = eval_bonus(m_net_alpkt, m_net_beta);
+    m_net_eval = (tomove == FastBoard::WHITE) ? 1.0f - pi : pi;
+}
+
+void UCTNode::set_blackevals(const double blackevals) {
+    m_blackevals.store(std::llround(blackevals * BLACKEVALS_ONE),
+                       std::memory_order_relaxed);
+}
+
+void UCTNode::add_remote_visits(int visits, float black_eval) {
+    m_visits += visits;
+    m_blackevals.fetch_add(
+        std::llround(double(visits) * black_eval * BLACKEVALS_ONE),
+        std::memory_order_relaxed);
+}
+
 bool UCTNode::has_children() const {
-    return m_min_psa_ratio_children <= 1.0f;
+    const auto ratio = m_min_psa_ratio_children.load();
+    return ratio >= 0.0f && ratio <= 1.0f;
 }
 
 bool UCTNode::expandable(const float min_psa_ratio) const {
@@ -227,6 +275,12 @@ float UCTNode::get_score() const {
     return m_score;
 }
 
+float UCTNode::eval_bonus(const float alpkt, const float beta) {
+    const auto pi = sigmoid(alpkt, beta, 0.0f);
+    const auto pi_lambda = (1-cfg_lambda)*pi + cfg_lambda*0.5f;
+    return std::log( (pi_lambda)/(1.0f-pi_lambda) ) / beta - alpkt;
+}
+
 float UCTNode::get_eval_bonus() const {
     return m_eval_bonus;
 }
@@ -285,23 +339,66 @@ float UCTNode::get_net_eval(int tomove) const {
 }
 
 double UCTNode::get_blackevals() const {
-    return m_blackevals;
+    return double(m_blackevals.load(std::memory_order_relaxed))
+        / BLACKEVALS_ONE;
 }
 
 void UCTNode::accumulate_eval(float eval) {
-    atomic_add(m_blackevals, double(eval));
+    m_blackevals.fetch_add(std::llround(double(eval) * BLACKEVALS_ONE),
+                           std::memory_order_relaxed);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__) \
+    && defined(__linux__)
+#define PUCT_SIMD_CLONES \
+    __attribute__((target_clones("arch=skylake-avx512", "arch=haswell", \
+                                 "default")))
+#else
+#define PUCT_SIMD_CLONES
+#endif
+
+// Room for all the moves and pass, in whole AVX-512 registers.
+static constexpr auto PUCT_MAX_CHILDREN =
+    size_t{(BOARD_SQUARES + 1 + 15) / 16 * 16};
+
+// Index of the first child with the highest winrate + c * psa / (1 + n),
+// where c already has sqrt(parentvisits) in it. The loops are plain so
+// that the compiler vectorizes them, and on x86-64 Linux they are built
+// for AVX-512 and AVX2 too and picked from CPUID at load time.
+PUCT_SIMD_CLONES
+static size_t puct_argmax(const float* const winrates,
+                          const float* const psas,
+                          const float* const visits,
+                          const size_t count, const float c) {
+    alignas(64) std::array<float, PUCT_MAX_CHILDREN> values;
+    for (auto i = size_t{0}; i < count; i++) {
+        values[i] = winrates[i] + c * psas[i] / (1.0f + visits[i]);
+    }
+    auto best_value = std::numeric_limits<float>::lowest();
+    for (auto i = size_t{0}; i < count; i++) {
+        best_value = std::max(best_value, values[i]);
+    }
+    for (auto i = size_t{0}; i < count; i++) {
+        if (values[i] == best_value) {
+            return i;
+        }
+    }
+    return 0;
 }
 
 UCTNode* UCTNode::uct_select_child(int color, bool is_root) {
-    LOCK(get_mutex(), lock);
+    PROFILE_SCOPE(SELECT);
+    // No lock: children are only ever appended, and they are published
+    // by the list size, see UCTNodeList.
 
     // Count parentvisits manually to avoid issues with transpositions.
     auto total_visited_policy = 0.0f;
     auto parentvisits = size_t{0};
     for (const auto& child : m_children) {
         if (child.valid()) {
-            parentvisits += child.get_visits();
-            if (child.get_visits() > 0) {
+            const auto visits = child.get_visits();
+            parentvisits += visits;
+            if (visits > 0) {
                 total_visited_policy += child.get_score();
             }
         }
@@ -321,30 +418,33 @@ UCTNode* UCTNode::uct_select_child(int color, bool is_root) {
 	fpu_eval = get_net_eval(color) - fpu_reduction;
     }
 
-    auto best = static_cast<UCTNodePointer*>(nullptr);
-    auto best_value = std::numeric_limits<double>::lowest();
-
-    for (auto& child : m_children) {
+    // Gather the child stats, then score them all in one go.
+    const auto count = m_children.size();
+    assert(count <= PUCT_MAX_CHILDREN);
+    alignas(64) std::array<float, PUCT_MAX_CHILDREN> winrates;
+    alignas(64) std::array<float, PUCT_MAX_CHILDREN> psas;
+    alignas(64) std::array<float, PUCT_MAX_CHILDREN> visits;
+    for (auto i = size_t{0}; i < count; i++) {
+        const auto& child = m_children[i];
         if (!child.active()) {
+            // Can never be picked.
+            winrates[i] = std::numeric_limits<float>::lowest();
+            psas[i] = 0.0f;
+            visits[i] = 0.0f;
             continue;
         }
-
-        auto winrate = fpu_eval;
-        if (child.get_visits() > 0) {
-            winrate = child.get_eval(color);
-        }
-        auto psa = child.get_score();
-        auto denom = 1.0 + child.get_visits();
-        auto puct = cfg_puct * psa * (numerator / denom);
-        auto value = winrate + puct;
-        assert(value > std::numeric_limits<double>::lowest());
-
-        if (value > best_value) {
-            best_value = value;
-            best = &child;
-	}
+        const auto child_visits = child.get_visits();
+        winrates[i] = child_visits > 0 ? child.get_eval(color) : fpu_eval;
+        psas[i] = child.get_score();
+        visits[i] = static_cast<float>(child_visits);
     }
 
+    const auto index = puct_argmax(winrates.data(), psas.data(),
+                                   visits.data(), count,
+                                   static_cast<float>(cfg_puct * numerator));
+    auto best = &m_children[index];
+    assert(best->active());
+
     assert(best != nullptr);
     best->inflate();
     return best->get();
@@ -375,7 +475,8 @@ private:
 
 void UCTNode::sort_children(int color) {
     LOCK(get_mutex(), lock);
-    std::stable_sort(rbegin(m_children), rend(m_children), NodeComp(color));
+    std::stable_sort(std::rbegin(m_children), std::rend(m_children),
+                     NodeComp(color));
 }
 
 class NodeCompByPolicy : public std::binary_function<UCTNodePointer&,
@@ -389,17 +490,55 @@ public:
 
 void UCTNode::sort_children_by_policy() {
     LOCK(get_mutex(), lock);
-    std::stable_sort(rbegin(m_children), rend(m_children), NodeCompByPolicy());
+    std::stable_sort(std::rbegin(m_children), std::rend(m_children),
+                     NodeCompByPolicy());
+}
+
+std::vector<const UCTNodePointer*> UCTNode::get_ranked_children(
+    const int color, const size_t count) const {
+    // The keys of NodeComp, and the index so that ties stay in order.
+    struct Ranked {
+        int visits;
+        float value;
+        size_t index;
+    };
+    const auto size = m_children.size();
+    auto ranked = std::vector<Ranked>();
+    ranked.reserve(size);
+    for (auto i = size_t{0}; i < size; i++) {
+        const auto& child = m_children[i];
+        const auto visits = child.get_visits();
+        ranked.push_back({visits,
+                          visits > 0 ? child.get_eval(color)
+                                     : child.get_score(),
+                          i});
+    }
+    const auto first = std::min(count, size);
+    std::partial_sort(begin(ranked), begin(ranked) + first, end(ranked),
+        [](const Ranked& a, const Ranked& b) {
+            if (a.visits != b.visits) {
+                return a.visits > b.visits;
+            }
+            if (a.value != b.value) {
+                return a.value > b.value;
+            }
+            return a.index < b.index;
+        });
+
+    auto children = std::vector<const UCTNodePointer*>();
+    children.reserve(first);
+    for (auto i = size_t{0}; i < first; i++) {
+        children.emplace_back(&m_children[ranked[i].index]);
+    }
+    return children;
 }
 
 UCTNode& UCTNode::get_best_root_child(int color) {
-    LOCK(get_mutex(), lock);
     assert(!m_children.empty());
 
-    auto ret = std::max_element(begin(m_children), end(m_children),
-                                NodeComp(color));
-    ret->inflate();
-    return *(ret->get());
+    const auto best = get_ranked_children(color, 1).front();
+    best->inflate();
+    return *(best->get());
 }
 
 size_t UCTNode::count_nodes() const {
@@ -413,6 +552,19 @@ size_t UCTNode::count_nodes() const {
     return nodecount;
 }
 
+void UCTNode::deflate_children(const int max_visits) {
+    for (auto& child : m_children) {
+        if (!child.is_inflated()) {
+            continue;
+        }
+        if (child.get_visits() <= max_visits) {
+            child.deflate();
+        } else {
+            child->deflate_children(max_visits);
+        }
+    }
+}
+
 void UCTNode::invalidate() {
     m_status = INVALID;
 }
@@ -32,6 +32,7 @@
 #include "Network.h"
 #include "SMP.h"
 #include "UCTNodePointer.h"
+#include "UCTNodePool.h"
 
 class UCTNode {
 public:
@@ -44,18 +45,51 @@ public:
     UCTNode() = delete;
     ~UCTNode() = default;
 
+    static void* operator new(std::size_t size) {
+        return UCTNodePool::allocate(size);
+    }
+    static void operator delete(void* p) {
+        UCTNodePool::deallocate(p);
+    }
+
     bool create_children(std::atomic<int>& nodecount,
                          GameState& state, float& value, float& alpkt,
 			 float& beta,
                          float min_psa_ratio = 0.0f);
-
-    const std::vector<UCTNodePointer>& get_children() const;
+    // create_children() in two steps, for callers that evaluate several
+    // positions together. start_expansion() returns true if this thread
+    // now owns the expansion, which it must then finish with expand()
+    // and the evaluation of the position.
+    bool start_expansion(const GameState& state, float min_psa_ratio = 0.0f);
+    void expand(std::atomic<int>& nodecount, GameState& state,
+                const Network::Netresult& raw_netlist,
+                float& value, float& alpkt, float& beta,
+                float min_psa_ratio = 0.0f);
+    // Finishes an expansion without children, as a leaf with this exact
+    // score from the point of view of black, see EndgameSolver. It is
+    // never expanded, its net alpkt is the score and its net beta that
+    // of SearchResult::from_score.
+    void set_solved(float score);
+    // Gives up an expansion that start_expansion() got.
+    void cancel_expansion();
+    bool solved() const;
+
+    const UCTNodeList& get_children() const;
     void sort_children(int color);
     void sort_children_by_policy();
+    // The count best children in the order of sort_children(), best
+    // first, without moving them or taking the lock. The visits and
+    // evals of each child are read once, so it can run while the
+    // search does.
+    std::vector<const UCTNodePointer*> get_ranked_children(
+        int color, size_t count) const;
     UCTNode& get_best_root_child(int color);
     UCTNode* uct_select_child(int color, bool is_root);
 
     size_t count_nodes() const;
+    // Deflates the subtrees below this node whose roots have at most
+    // max_visits visits.
+    void deflate_children(int max_visits);
     SMP::Mutex& get_mutex();
     bool first_visit() const;
     bool has_children() const;
@@ -71,6 +105,8 @@ public:
     void set_score(float score);
     float get_eval(int tomove) const;
     float get_net_eval(int tomove) const;
+    // The x bar of a node with this net alpkt and beta, for --lambda.
+    static float eval_bonus(float alpkt, float beta);
     float get_eval_bonus() const;
     float get_eval_bonus_father() const;
     void set_eval_bonus_father(float bonus);
@@ -80,6 +116,13 @@ public:
     void virtual_loss(void);
     void virtual_loss_undo(void);
     void update(float eval);
+    // Moves the net eval delta points of komi towards white and redoes
+    // the bonus for the current --lambda. For nets with alpha and beta.
+    void shift_net_eval(float delta, int tomove);
+    // Replaces the evals of all the visits.
+    void set_blackevals(double blackevals);
+    // Visits done by another search, see DistributedSearch.
+    void add_remote_visits(int visits, float black_eval);
 
     // Defined in UCTNodeRoot.cpp, only to be called on m_root in UCTSearch
     bool randomize_first_proportionally();
@@ -90,9 +133,15 @@ public:
     UCTNode* get_first_child() const;
     UCTNode* get_nopass_child(FastState& state) const;
     std::unique_ptr<UCTNode> find_child(const int move);
+    // The reverse of find_child(), node becomes the child with its move
+    // if it has more visits than the one there.
+    void adopt_child(std::unique_ptr<UCTNode> node);
     void inflate_all_children();
 
 private:
+    // Reads and writes the fields directly.
+    friend class TreeFile;
+
     enum Status : char {
         INVALID, // superko
         PRUNED,
@@ -102,28 +151,29 @@ private:
                        std::vector<Network::ScoreVertexPair>& nodelist,
                        float min_psa_ratio);
     void accumulate_eval(float eval);
+    // m_min_psa_ratio_children of a solved leaf.
+    static constexpr float SOLVED_RATIO = -1.0f;
+    // Fixed-point unit of m_blackevals. Leaves room for 2^31 visits.
+    static constexpr double BLACKEVALS_ONE = double(1 << 30);
     void kill_superkos(const KoState& state);
     void dirichlet_noise(float epsilon, float alpha);
 
     // Note : This class is very size-sensitive as we are going to create
     // tens of millions of instances of these.  Please put extra caution
     // if you want to add/remove/reorder any variables here.
+    // It is 64 bytes, one cache line, on 64-bit. The fields that
+    // uct_select_child reads for every sibling come first.
 
-    // Move
-    std::int16_t m_move;
     // UCT
-    std::atomic<std::int16_t> m_virtual_loss{0};
     std::atomic<int> m_visits{0};
+    std::atomic<std::int16_t> m_virtual_loss{0};
+    // Move
+    std::int16_t m_move;
+    // Sum of the evals in fixed point, see BLACKEVALS_ONE: an integer
+    // fetch_add never retries, unlike a compare-exchange on a double.
+    std::atomic<std::int64_t> m_blackevals{0};
     // UCT eval
     float m_score;
-    // Original net eval for this node (not children).
-    float m_net_eval{0.5f};
-    //    float m_net_value{0.5f};
-    float m_net_alpkt{0.0f}; // alpha + \tilde k
-    float m_net_beta{1.0f};
-    float m_eval_bonus{0.0f}; // x bar
-    float m_eval_bonus_father{0.0f}; // x bar of father node
-    std::atomic<double> m_blackevals{0.0};
     std::atomic<Status> m_status{ACTIVE};
     // Is someone adding scores to this node?
     bool m_is_expanding{false};
@@ -131,7 +181,14 @@ private:
 
     // Tree data
     std::atomic<float> m_min_psa_ratio_children{2.0f};
-    std::vector<UCTNodePointer> m_children;
+    // Original net eval for this node (not children).
+    float m_net_eval{0.5f};
+    //    float m_net_value{0.5f};
+    float m_net_alpkt{0.0f}; // alpha + \tilde k
+    float m_net_beta{1.0f};
+    float m_eval_bonus{0.0f}; // x bar
+    float m_eval_bonus_father{0.0f}; // x bar of father node
+    UCTNodeList m_children;
 };
 
 #endif
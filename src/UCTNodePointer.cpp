@@ -28,17 +28,14 @@
 //#include "Utils.h"
 
 UCTNodePointer::~UCTNodePointer() {
-    if (is_inflated()) {
-        delete read_ptr();
+    const auto v = m_data.load();
+    if (is_inflated(v)) {
+        delete read_ptr(v);
     }
 }
 
-UCTNodePointer::UCTNodePointer(UCTNodePointer&& n) {
-    if (is_inflated()) {
-        delete read_ptr();
-    }
-    m_data = n.m_data;
-    n.m_data = 1; // non-inflated garbage
+UCTNodePointer::UCTNodePointer(UCTNodePointer&& n)
+    : m_data(n.m_data.exchange(1)) { // leaves non-inflated garbage
 }
 
 UCTNodePointer::UCTNodePointer(std::int16_t vertex, float score) {
@@ -50,49 +47,70 @@ UCTNodePointer::UCTNodePointer(std::int16_t vertex, float score) {
             | (static_cast<std::uint64_t>(i_vertex) << 16) | 1ULL;
 }
 
+UCTNodePointer::UCTNodePointer(std::unique_ptr<UCTNode> node)
+    : m_data(reinterpret_cast<std::uint64_t>(node.release())) {
+}
+
 UCTNodePointer& UCTNodePointer::operator=(UCTNodePointer&& n) {
-    if (is_inflated()) {
-        delete read_ptr();
+    const auto old = m_data.exchange(n.m_data.exchange(1));
+    if (is_inflated(old)) {
+        delete read_ptr(old);
     }
-    m_data = n.m_data;
-    n.m_data = 1;
 
     return *this;
 }
 
 void UCTNodePointer::inflate() const {
-    if (is_inflated()) return;
-    m_data = reinterpret_cast<std::uint64_t>(
-        new UCTNode(read_vertex(), read_score()));
+    auto v = m_data.load();
+    if (is_inflated(v)) return;
+    auto node = new UCTNode(read_vertex(v), read_score(v));
+    if (!m_data.compare_exchange_strong(v,
+                                        reinterpret_cast<std::uint64_t>(node))) {
+        // Someone else inflated it first.
+        delete node;
+    }
+}
+
+void UCTNodePointer::deflate() {
+    const auto v = m_data.load();
+    if (!is_inflated(v)) return;
+    const auto node = read_ptr(v);
+    *this = UCTNodePointer(node->get_move(), node->get_score());
 }
 
 bool UCTNodePointer::valid() const {
-    if (is_inflated()) return read_ptr()->valid();
+    const auto v = m_data.load();
+    if (is_inflated(v)) return read_ptr(v)->valid();
     return true;
 }
 
 int UCTNodePointer::get_visits() const {
-    if (is_inflated()) return read_ptr()->get_visits();
+    const auto v = m_data.load();
+    if (is_inflated(v)) return read_ptr(v)->get_visits();
     return 0;
 }
 
 float UCTNodePointer::get_score() const {
-    if (is_inflated()) return read_ptr()->get_score();
-    return read_score();
+    const auto v = m_data.load();
+    if (is_inflated(v)) return read_ptr(v)->get_score();
+    return read_score(v);
 }
 
 bool UCTNodePointer::active() const {
-    if (is_inflated()) return read_ptr()->active();
+    const auto v = m_data.load();
+    if (is_inflated(v)) return read_ptr(v)->active();
     return true;
 }
 
 float UCTNodePointer::get_eval(int tomove) const {
     // this can only be called if it is an inflated pointer
-    assert(is_inflated());
-    return read_ptr()->get_eval(tomove);
+    const auto v = m_data.load();
+    assert(is_inflated(v));
+    return read_ptr(v)->get_eval(tomove);
 }
 
 int UCTNodePointer::get_move() const {
-    if (is_inflated()) return read_ptr()->get_move();
-    return read_vertex();
+    const auto v = m_data.load();
+    if (is_inflated(v)) return read_ptr(v)->get_move();
+    return read_vertex(v);
 }
@@ -21,8 +21,13 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <atomic>
+#include <cstdint>
+#include <iterator>
 #include <memory>
+#include <new>
+#include <utility>
 #include <cassert>
 #include <cstring>
 
@@ -39,8 +44,8 @@ class UCTNode;
 //  - std::unique_ptr<UCTNode> pointer;
 //  - std::pair<float, std::int16_t> args;
 
-// WARNING : inflate() is not thread-safe and hence has to be protected
-// by an external lock.
+// inflate() may race with itself, the loser frees its node, so the
+// children can be read and inflated without a lock.
 
 class UCTNodePointer {
 private:
@@ -48,24 +53,29 @@ private:
     // if bit 0 is 0, m_data is the actual pointer.
     // if bit 0 is 1, bit [31:16] is the vertex value, bit [63:32] is the score.
     // (C-style bit fields and unions are not portable)
-    mutable uint64_t m_data = 1;
+    // Every reader loads it once, it can be inflated under it.
+    mutable std::atomic<std::uint64_t> m_data{1};
 
-    UCTNode * read_ptr() const {
-        assert(is_inflated());
-        return reinterpret_cast<UCTNode*>(m_data);
+    static bool is_inflated(const std::uint64_t v) {
+        return (v & 1ULL) == 0;
     }
 
-    std::int16_t read_vertex() const {
-        assert(!is_inflated());
-        return static_cast<std::int16_t>(m_data >> 16);
+    static UCTNode * read_ptr(const std::uint64_t v) {
+        assert(is_inflated(v));
+        return reinterpret_cast<UCTNode*>(v);
     }
 
-    float read_score() const {
+    static std::int16_t read_vertex(const std::uint64_t v) {
+        assert(!is_inflated(v));
+        return static_cast<std::int16_t>(v >> 16);
+    }
+
+    static float read_score(const std::uint64_t v) {
         static_assert(sizeof(float) == 4,
             "This code assumes floats are 32-bit");
-        assert(!is_inflated());
+        assert(!is_inflated(v));
 
-        auto x = static_cast<std::uint32_t>(m_data >> 32);
+        auto x = static_cast<std::uint32_t>(v >> 32);
         float ret;
         std::memcpy(&ret, &x, sizeof(ret));
         return ret;
@@ -75,31 +85,34 @@ public:
     ~UCTNodePointer();
     UCTNodePointer(UCTNodePointer&& n);
     UCTNodePointer(std::int16_t vertex, float score);
+    // An inflated pointer to node.
+    explicit UCTNodePointer(std::unique_ptr<UCTNode> node);
     UCTNodePointer(const UCTNodePointer&) = delete;
 
     bool is_inflated() const {
-        return (m_data & 1ULL) == 0;
+        return is_inflated(m_data.load());
     }
 
     // methods from std::unique_ptr<UCTNode>
     typename std::add_lvalue_reference<UCTNode>::type operator*() const{
-        return *read_ptr();
+        return *read_ptr(m_data.load());
     }
     UCTNode* operator->() const {
-        return read_ptr();
+        return read_ptr(m_data.load());
     }
     UCTNode* get() const {
-        return read_ptr();
+        return read_ptr(m_data.load());
     }
     UCTNodePointer& operator=(UCTNodePointer&& n);
     UCTNode * release() {
-        auto ret = read_ptr();
-        m_data = 1;
-        return ret;
+        return read_ptr(m_data.exchange(1));
     }
 
     // construct UCTNode instance from the vertex/score pair
     void inflate() const;
+    // The reverse, frees the node and its subtree. No other thread may
+    // be in the subtree.
+    void deflate();
 
     // proxy of UCTNode methods which can be called without
     // constructing UCTNode
@@ -112,4 +125,86 @@ public:
     float get_eval(int tomove) const;
 };
 
+// The part of std::vector<UCTNodePointer> that the nodes use for their
+// children, in 16 instead of 24 bytes. A child is published by the store
+// of the size, so readers can walk the list while children are appended,
+// as long as the capacity was reserved before the first reader came.
+class UCTNodeList {
+public:
+    using iterator = UCTNodePointer*;
+    using const_iterator = const UCTNodePointer*;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+
+    UCTNodeList() = default;
+    UCTNodeList(const UCTNodeList&) = delete;
+    UCTNodeList& operator=(const UCTNodeList&) = delete;
+    ~UCTNodeList() {
+        erase(begin(), end());
+        ::operator delete(m_data.load());
+    }
+
+    iterator begin() { return data(); }
+    iterator end() { return begin() + size(); }
+    const_iterator begin() const { return data(); }
+    const_iterator end() const { return begin() + size(); }
+    reverse_iterator rbegin() { return reverse_iterator(end()); }
+    reverse_iterator rend() { return reverse_iterator(begin()); }
+
+    size_t size() const { return m_size.load(std::memory_order_acquire); }
+    bool empty() const { return size() == 0; }
+    UCTNodePointer& front() { return data()[0]; }
+    const UCTNodePointer& front() const { return data()[0]; }
+    UCTNodePointer& operator[](size_t i) { return data()[i]; }
+    const UCTNodePointer& operator[](size_t i) const { return data()[i]; }
+
+    void reserve(size_t capacity) {
+        if (capacity > m_capacity) {
+            reallocate(capacity);
+        }
+    }
+
+    template <typename... Args>
+    void emplace_back(Args&&... args) {
+        const auto n = m_size.load(std::memory_order_relaxed);
+        if (n == m_capacity) {
+            reallocate(m_capacity ? 2 * m_capacity : 1);
+        }
+        new (data() + n) UCTNodePointer(std::forward<Args>(args)...);
+        m_size.store(n + 1, std::memory_order_release);
+    }
+
+    iterator erase(iterator first, iterator last) {
+        auto new_end = std::move(last, end(), first);
+        for (auto it = new_end; it != end(); ++it) {
+            it->~UCTNodePointer();
+        }
+        m_size.store(static_cast<std::uint32_t>(new_end - begin()),
+                     std::memory_order_release);
+        return first;
+    }
+
+private:
+    UCTNodePointer* data() const {
+        return m_data.load(std::memory_order_relaxed);
+    }
+
+    void reallocate(size_t capacity) {
+        const auto old_data = data();
+        auto new_data = static_cast<UCTNodePointer*>(
+            ::operator new(capacity * sizeof(UCTNodePointer)));
+        const auto n = m_size.load(std::memory_order_relaxed);
+        for (auto i = size_t{0}; i < n; i++) {
+            new (new_data + i) UCTNodePointer(std::move(old_data[i]));
+            old_data[i].~UCTNodePointer();
+        }
+        m_data.store(new_data, std::memory_order_relaxed);
+        ::operator delete(old_data);
+        m_capacity = static_cast<std::uint32_t>(capacity);
+    }
+
+    std::atomic<UCTNodePointer*> m_data{nullptr};
+    std::atomic<std::uint32_t> m_size{0};
+    std::uint32_t m_capacity{0};
+};
+
 #endif
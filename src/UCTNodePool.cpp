@@ -0,0 +1,212 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "UCTNodePool.h"
+#include "GTP.h"
+#include "Metrics.h"
+#include "SMP.h"
+#include "UCTNode.h"
+#include "Utils.h"
+
+namespace {
+    // A free node holds the link to the next one.
+    struct FreeNode {
+        FreeNode* next;
+    };
+
+    constexpr auto NODE_SIZE = std::max(sizeof(UCTNode), sizeof(FreeNode));
+    // A huge page each with --huge-pages. Slabs start on a page, so
+    // 64-byte nodes each fill one cache line.
+    constexpr auto SLAB_SIZE = SMP::HUGE_PAGE_SIZE;
+    constexpr auto SLAB_NODES = SLAB_SIZE / NODE_SIZE;
+    // Free nodes move between the threads in lists of this length.
+    constexpr auto BATCH_NODES = size_t{512};
+
+    // With --numa every NUMA node has its own free batches, otherwise
+    // there is only node 0.
+    struct NumaNode {
+        std::vector<FreeNode*> batches;
+        std::size_t slabs{0};
+    };
+
+    struct FreeSlab {
+        void operator()(char* slab) const {
+            SMP::free_large(slab);
+        }
+    };
+
+    std::mutex s_mutex;
+    std::vector<std::unique_ptr<char, FreeSlab>> s_slabs;
+    // Start of every slab and its node, sorted by address.
+    std::vector<std::pair<std::uintptr_t, int>> s_slab_nodes;
+    std::vector<NumaNode> s_numa_nodes;
+    std::atomic<std::size_t> s_nodes_in_use{0};
+
+    // Nodes left here when a thread exits are lost, but the threads
+    // live as long as the program.
+    thread_local FreeNode* t_free{nullptr};
+    thread_local std::size_t t_free_count{0};
+
+    // The search threads are pinned with --numa, so their node is fixed.
+    int thread_node() {
+        static thread_local const int node =
+            cfg_numa ? SMP::get_numa_node() : 0;
+        return node;
+    }
+
+    NumaNode& numa_node(const int node) {
+        if (s_numa_nodes.empty()) {
+            s_numa_nodes.resize(cfg_numa ? SMP::get_numa_node_count() : 1);
+        }
+        return s_numa_nodes[node];
+    }
+
+    // Node of the slab that holds p.
+    int slab_node(const void* p) {
+        const auto address = reinterpret_cast<std::uintptr_t>(p);
+        auto it = std::upper_bound(
+            begin(s_slab_nodes), end(s_slab_nodes),
+            std::make_pair(address, std::numeric_limits<int>::max()));
+        assert(it != begin(s_slab_nodes));
+        return std::prev(it)->second;
+    }
+
+    void refill() {
+        const auto node = thread_node();
+        std::lock_guard<std::mutex> lock(s_mutex);
+        auto& batches = numa_node(node).batches;
+        if (!batches.empty()) {
+            t_free = batches.back();
+            t_free_count = BATCH_NODES;
+            batches.pop_back();
+            return;
+        }
+        // Rather use the free nodes of another node than keep many of
+        // them around, once they add up to a slab.
+        for (auto& other : s_numa_nodes) {
+            if (other.batches.size() * BATCH_NODES >= SLAB_NODES) {
+                t_free = other.batches.back();
+                t_free_count = BATCH_NODES;
+                other.batches.pop_back();
+                return;
+            }
+        }
+        s_slabs.emplace_back(static_cast<char*>(
+            SMP::allocate_large(SLAB_SIZE, cfg_huge_pages)));
+        auto slab = s_slabs.back().get();
+        // Writing the links is the first touch of the pages, which puts
+        // them on the node of this thread.
+        for (auto i = size_t{0}; i < SLAB_NODES; i++) {
+            auto free_node = reinterpret_cast<FreeNode*>(slab + i * NODE_SIZE);
+            free_node->next = t_free;
+            t_free = free_node;
+        }
+        t_free_count = SLAB_NODES;
+        const auto entry =
+            std::make_pair(reinterpret_cast<std::uintptr_t>(slab), node);
+        s_slab_nodes.insert(std::upper_bound(begin(s_slab_nodes),
+                                             end(s_slab_nodes), entry),
+                            entry);
+        numa_node(node).slabs++;
+    }
+
+    // Gives back a batch once the thread holds two, so that trees freed
+    // by another thread than the one that built them get reused. The
+    // batch goes to the node of its first node, the trees are freed
+    // whole so batches rarely mix slabs.
+    void spill() {
+        auto batch = t_free;
+        auto last = batch;
+        for (auto i = size_t{1}; i < BATCH_NODES; i++) {
+            last = last->next;
+        }
+        t_free = last->next;
+        t_free_count -= BATCH_NODES;
+        last->next = nullptr;
+
+        std::lock_guard<std::mutex> lock(s_mutex);
+        numa_node(cfg_numa ? slab_node(batch) : 0).batches.push_back(batch);
+    }
+}
+
+void* UCTNodePool::allocate(std::size_t size) {
+    assert(size <= NODE_SIZE);
+    (void)size;
+    if (!t_free) {
+        refill();
+    }
+    auto node = t_free;
+    t_free = node->next;
+    t_free_count--;
+    s_nodes_in_use++;
+    Metrics::add(Metrics::NODES);
+    return node;
+}
+
+void UCTNodePool::deallocate(void* p) {
+    if (!p) {
+        return;
+    }
+    auto node = static_cast<FreeNode*>(p);
+    node->next = t_free;
+    t_free = node;
+    t_free_count++;
+    s_nodes_in_use--;
+    if (t_free_count >= 2 * BATCH_NODES) {
+        spill();
+    }
+}
+
+void UCTNodePool::dump_stats() {
+    std::lock_guard<std::mutex> lock(s_mutex);
+    for (auto node = size_t{0}; cfg_numa && node < s_numa_nodes.size();
+         node++) {
+        const auto& stats = s_numa_nodes[node];
+        Utils::myprintf("NUMA node %zu: %zu MB of nodes, %zu MB free\n",
+                        node, stats.slabs * SLAB_SIZE / (1024 * 1024),
+                        stats.batches.size() * BATCH_NODES * NODE_SIZE
+                            / (1024 * 1024));
+    }
+    if (cfg_huge_pages) {
+        Utils::myprintf("%zu MB of %zu MB of tree and NNCache memory in "
+                        "huge pages\n",
+                        SMP::get_huge_page_bytes() / (1024 * 1024),
+                        SMP::get_large_bytes() / (1024 * 1024));
+    }
+}
+
+std::size_t UCTNodePool::get_nodes_in_use() {
+    return s_nodes_in_use;
+}
+
+std::size_t UCTNodePool::get_bytes_in_use() {
+    return s_nodes_in_use * NODE_SIZE;
+}
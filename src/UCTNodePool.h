@@ -0,0 +1,47 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef UCTNODEPOOL_H_INCLUDED
+#define UCTNODEPOOL_H_INCLUDED
+
+#include "config.h"
+
+#include <cstddef>
+
+// Hands out the memory of the UCTNodes from large slabs. Every thread
+// keeps its own free list, and only trades batches of free nodes with
+// the shared list, under a lock, so most allocations don't synchronize
+// at all. The slabs are kept for the next trees until the program exits.
+// With --numa the slabs are placed on the node of the thread that needs
+// them, and free nodes go back to the node they are on. With
+// --huge-pages every slab is one huge page.
+class UCTNodePool {
+public:
+    static void* allocate(std::size_t size);
+    static void deallocate(void* p);
+
+    // Nodes that are alive, and the bytes they take.
+    static std::size_t get_nodes_in_use();
+    static std::size_t get_bytes_in_use();
+
+    // Print the memory of every NUMA node with --numa, and how much of
+    // it is in huge pages with --huge-pages.
+    static void dump_stats();
+};
+
+#endif
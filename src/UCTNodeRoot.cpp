@@ -67,9 +67,9 @@ void UCTNode::kill_superkos(const KoState& state) {
 
     // Now do the actual deletion.
     m_children.erase(
-        std::remove_if(begin(m_children), end(m_children),
+        std::remove_if(std::begin(m_children), std::end(m_children),
                        [](const auto &child) { return !child->valid(); }),
-        end(m_children)
+        std::end(m_children)
     );
 }
 
@@ -151,7 +151,7 @@ bool UCTNode::randomize_first_proportionally() {
     assert(m_children.size() > index);
 
     // Now swap the child at index with the first child
-    std::iter_swap(begin(m_children), begin(m_children) + index);
+    std::iter_swap(std::begin(m_children), std::begin(m_children) + index);
 
     const bool is_dumb_move = (prb_vector[index] / prb_vector[0] < cfg_blunder_thr);
 
@@ -177,13 +177,16 @@ UCTNode* UCTNode::get_nopass_child(FastState& state) const {
     return nullptr;
 }
 
-// Used to find new root in UCTSearch.
+// Used to find new root in UCTSearch. The child is left in place as
+// one that was never visited, so that this node can be searched again.
 std::unique_ptr<UCTNode> UCTNode::find_child(const int move) {
     for (auto& child : m_children) {
         if (child.get_move() == move) {
              // no guarantee that this is a non-inflated node
             child.inflate();
-            return std::unique_ptr<UCTNode>(child.release());
+            auto node = std::unique_ptr<UCTNode>(child.release());
+            child = UCTNodePointer(node->get_move(), node->get_score());
+            return node;
         }
     }
 
@@ -191,6 +194,17 @@ std::unique_ptr<UCTNode> UCTNode::find_child(const int move) {
     return nullptr;
 }
 
+void UCTNode::adopt_child(std::unique_ptr<UCTNode> node) {
+    for (auto& child : m_children) {
+        if (child.get_move() == node->get_move()) {
+            if (node->get_visits() > child.get_visits()) {
+                child = UCTNodePointer(std::move(node));
+            }
+            return;
+        }
+    }
+}
+
 void UCTNode::inflate_all_children() {
     for (const auto& node : get_children()) {
         node.inflate();
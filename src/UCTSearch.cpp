@@ -20,22 +20,33 @@
 #include "config.h"
 #include "UCTSearch.h"
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cmath>
 #include <cstddef>
+#include <deque>
 #include <limits>
 #include <memory>
 #include <type_traits>
 #include <tuple>
+#include <boost/format.hpp>
 
+#include "DistributedSearch.h"
+#include "EndgameSolver.h"
 #include "FastBoard.h"
 #include "FastState.h"
 #include "FullBoard.h"
 #include "GTP.h"
 #include "GameState.h"
+#include "Metrics.h"
+#include "NNCache.h"
+#include "Profile.h"
 #include "TimeControl.h"
 #include "Timing.h"
 #include "Training.h"
+#include "TreeFile.h"
+#include "UCTNodePool.h"
 #include "Utils.h"
 #include "Network.h"
 
@@ -43,6 +54,39 @@ using namespace Utils;
 
 constexpr int UCTSearch::UNLIMITED_PLAYOUTS;
 
+// The states that the playouts of this thread are played on, kept from
+// one playout to the next so that they don't allocate. A deque, so that
+// more states don't move those in use.
+static GameState& playout_state(size_t index) {
+    static thread_local auto t_states = std::deque<GameState>{};
+    if (index >= t_states.size()) {
+        t_states.resize(index + 1);
+    }
+    return t_states[index];
+}
+
+// The children of the leaves of the last batches of a thread, for the
+// empty slots of its next ones. They are playout states of root.
+struct Speculation {
+    const GameState* root{nullptr};
+    std::uint64_t root_hash{0};
+    size_t root_movenum{0};
+    std::deque<GameState> states;
+};
+
+static Speculation& speculation(const GameState& root) {
+    static thread_local auto t_speculation = Speculation{};
+    auto& s = t_speculation;
+    if (s.root != &root || s.root_hash != root.board.get_hash()
+        || s.root_movenum != root.get_movenum()) {
+        s.states.clear();
+        s.root = &root;
+        s.root_hash = root.board.get_hash();
+        s.root_movenum = root.get_movenum();
+    }
+    return s;
+}
+
 UCTSearch::UCTSearch(GameState& g)
     : m_rootstate(g) {
     set_playout_limit(cfg_max_playouts);
@@ -56,10 +100,6 @@ bool UCTSearch::advance_to_new_rootstate() {
         return false;
     }
 
-    if (m_rootstate.get_komi() != m_last_rootstate->get_komi()) {
-        return false;
-    }
-
     auto depth =
         int(m_rootstate.get_movenum() - m_last_rootstate->get_movenum());
 
@@ -78,30 +118,15 @@ bool UCTSearch::advance_to_new_rootstate() {
         return false;
     }
 
-    // Make sure that the nodes we destroyed the previous move are
-    // in fact destroyed.
-    while (!m_delete_futures.empty()) {
-        m_delete_futures.front().wait_all();
-        m_delete_futures.pop_front();
-    }
-
     // Try to replay moves advancing m_root
     for (auto i = 0; i < depth; i++) {
-        ThreadGroup tg(thread_pool);
-
         test->forward_move();
         const auto move = test->get_last_move();
 
         auto oldroot = std::move(m_root);
         m_root = oldroot->find_child(move);
-
-        // Lazy tree destruction.  Instead of calling the destructor of the
-        // old root node on the main thread, send the old root to a separate
-        // thread and destroy it from the child thread.  This will save a
-        // bit of time when dealing with large trees.
-        auto p = oldroot.release();
-        tg.add_task([p]() { delete p; });
-        m_delete_futures.push_back(std::move(tg));
+        // The rest of the old tree is kept for an undo.
+        cache_tree(*m_last_rootstate, std::move(oldroot));
 
         if (!m_root) {
             // Tree hasn't been expanded this far
@@ -117,26 +142,228 @@ bool UCTSearch::advance_to_new_rootstate() {
         return false;
     }
 
+    const auto delta = m_rootstate.get_komi() - m_last_rootstate->get_komi();
+    if (delta != 0.0f || cfg_lambda != m_last_lambda) {
+        return reweight_tree(delta);
+    }
     return true;
 }
 
+bool UCTSearch::reweight_tree(const float delta) {
+    // The evals of a single value head don't depend on the komi. The
+    // visits of a transposed node were evaluated somewhere else.
+    if (!is_mult_komi_net || cfg_transpositions) {
+        return false;
+    }
+    auto states = std::vector<FastState>{m_rootstate};
+    auto bonuses = std::vector<float>{m_root->get_eval_bonus_father()};
+    auto sums = std::vector<double>(1, 0.0);
+    reweight_subtree(*m_root, states, delta, bonuses, sums, true);
+    m_root->set_blackevals(sums[0]);
+    return true;
+}
+
+void UCTSearch::reweight_subtree(UCTNode& node,
+                                 std::vector<FastState>& states,
+                                 const float delta,
+                                 std::vector<float>& bonuses,
+                                 std::vector<double>& sums,
+                                 const bool parallel) {
+    const auto depth = sums.size() - 1;
+    auto alpkt = 0.0f, beta = 0.0f;
+    if (states[depth].get_passes() >= 2) {
+        // As SearchResult::from_score.
+        alpkt = states[depth].final_score();
+        beta = 10.0f;
+    } else {
+        node.shift_net_eval(delta, states[depth].get_to_move());
+        alpkt = node.get_net_alpkt();
+        beta = node.get_net_beta();
+    }
+    if (states.size() < depth + 2) {
+        states.resize(depth + 2);
+    }
+
+    // The children done in parallel have stacks of their own.
+    struct Child {
+        UCTNode* node;
+        std::vector<FastState> states;
+        std::vector<float> bonuses;
+        std::vector<double> sums;
+    };
+    auto children = std::vector<Child>();
+    auto children_visits = 0;
+    for (const auto& child : node.get_children()) {
+        if (!child.is_inflated()) {
+            continue;
+        }
+        const auto next = child.get();
+        if (next->get_visits() == 0) {
+            continue;
+        }
+        next->set_eval_bonus_father(node.get_eval_bonus());
+        children_visits += next->get_visits();
+        if (parallel) {
+            children.push_back({next, std::vector<FastState>(depth + 2),
+                                bonuses,
+                                std::vector<double>(sums.size() + 1, 0.0)});
+            children.back().states[depth + 1] = states[depth];
+            children.back().states[depth + 1].play_move(next->get_move());
+            children.back().bonuses.emplace_back(node.get_eval_bonus());
+            continue;
+        }
+        // FastState has no undo, so every depth plays into its own
+        // slot of the stack.
+        states[depth + 1] = states[depth];
+        states[depth + 1].play_move(next->get_move());
+        bonuses.emplace_back(node.get_eval_bonus());
+        sums.emplace_back(0.0);
+        reweight_subtree(*next, states, delta, bonuses, sums, false);
+        next->set_blackevals(sums.back());
+        sums.pop_back();
+        bonuses.pop_back();
+    }
+    if (parallel) {
+        ThreadGroup tg(thread_pool);
+        for (auto& c : children) {
+            tg.add_task([this, delta, &c]() {
+                reweight_subtree(*c.node, c.states, delta, c.bonuses,
+                                 c.sums, false);
+                c.node->set_blackevals(c.sums.back());
+            });
+        }
+        tg.wait_all();
+        for (const auto& c : children) {
+            for (auto i = size_t{0}; i < sums.size(); i++) {
+                sums[i] += c.sums[i];
+            }
+        }
+    }
+
+    // The visits that stopped here, at the eval of the node itself.
+    const auto own = std::max(node.get_visits() - children_visits, 0);
+    if (own > 0) {
+        auto result = SearchResult::from_eval(0.5f, alpkt, beta);
+        for (auto i = size_t{0}; i < sums.size(); i++) {
+            sums[i] += double(own) * result.eval_with_bonus(bonuses[i]);
+        }
+    }
+}
+
+void UCTSearch::cache_tree(const GameState& state,
+                           std::unique_ptr<UCTNode> root) {
+    const auto key = TranspositionTable::get_key(state);
+    auto parent_key = std::uint64_t{0};
+    auto parent = state;
+    if (parent.undo_move()) {
+        parent_key = TranspositionTable::get_key(parent);
+    }
+    for (auto it = begin(m_tree_cache); it != end(m_tree_cache); ++it) {
+        if (it->key == key && it->lambda == m_last_lambda) {
+            delete_lazily(std::move(it->root));
+            m_tree_cache.erase(it);
+            break;
+        }
+    }
+    m_tree_cache.push_front({key, parent_key, m_last_lambda,
+                             std::move(root)});
+}
+
+std::unique_ptr<UCTNode> UCTSearch::take_cached_tree(
+    const std::uint64_t key) {
+    auto root = std::unique_ptr<UCTNode>();
+    for (auto it = begin(m_tree_cache); it != end(m_tree_cache); ++it) {
+        if (it->key == key && it->lambda == cfg_lambda) {
+            root = std::move(it->root);
+            m_tree_cache.erase(it);
+            break;
+        }
+    }
+    if (!root) {
+        return root;
+    }
+    // A child that became the root left an unvisited child behind, and
+    // it goes back in with the visits it had since.
+    auto it = begin(m_tree_cache);
+    while (it != end(m_tree_cache)) {
+        if (it->parent_key == key && it->lambda == cfg_lambda) {
+            root->adopt_child(take_cached_tree(it->key));
+            // That may have taken any of the trees.
+            it = begin(m_tree_cache);
+        } else {
+            ++it;
+        }
+    }
+    return root;
+}
+
+void UCTSearch::trim_tree_cache() {
+    while (!m_tree_cache.empty()) {
+        if (m_tree_cache.size() <= TREE_CACHE_SIZE) {
+            // The trees that are still being deleted count.
+            wait_for_deletes();
+            if (get_tree_fill() <= TREE_CACHE_FILL) {
+                break;
+            }
+        }
+        delete_lazily(std::move(m_tree_cache.back().root));
+        m_tree_cache.pop_back();
+    }
+}
+
+void UCTSearch::clear_tree_cache() {
+    for (auto& cached : m_tree_cache) {
+        delete_lazily(std::move(cached.root));
+    }
+    m_tree_cache.clear();
+}
+
+void UCTSearch::delete_lazily(std::unique_ptr<UCTNode> root) {
+    // Lazy tree destruction.  Instead of calling the destructor of the
+    // old root node on the main thread, send the old root to a separate
+    // thread and destroy it from the child thread.  This will save a
+    // bit of time when dealing with large trees.
+    auto p = root.release();
+    m_delete_futures.emplace_back(thread_pool);
+    m_delete_futures.back().add_task([p]() { delete p; });
+}
+
+void UCTSearch::wait_for_deletes() {
+    while (!m_delete_futures.empty()) {
+        m_delete_futures.front().wait_all();
+        m_delete_futures.pop_front();
+    }
+}
+
 void UCTSearch::update_root() {
     // Definition of m_playouts is playouts per search call.
     // So reset this count now.
     m_playouts = 0;
+    m_collisions = 0;
 
     #ifndef NDEBUG
     auto start_nodes = m_root->count_nodes();
     #endif
 
     if (!advance_to_new_rootstate() || !m_root) {
-        m_root = std::make_unique<UCTNode>(FastBoard::PASS, 0.0f);
+        // After an undo or on another line, the old tree is kept, and
+        // the one of this position may have been.
+        if (m_root && m_last_rootstate) {
+            cache_tree(*m_last_rootstate, std::move(m_root));
+        }
+        m_root = take_cached_tree(TranspositionTable::get_key(m_rootstate));
+        if (!m_root) {
+            m_root = std::make_unique<UCTNode>(FastBoard::PASS, 0.0f);
+        }
     }
     // Clear last_rootstate to prevent accidental use.
     m_last_rootstate.reset(nullptr);
+    // Part of the old tree is about to be deleted.
+    m_transpositions.clear();
 
     // Check how big our search tree (reused or new) is.
     m_nodes = m_root->count_nodes();
+    trim_tree_cache();
 
     #ifndef NDEBUG
     if (m_nodes > 0) {
@@ -146,8 +373,64 @@ void UCTSearch::update_root() {
     #endif
 }
 
+float UCTSearch::get_tree_fill() const {
+    // The nodes themselves, a child pointer for every node, and the
+    // transposition entries.
+    const auto bytes = UCTNodePool::get_bytes_in_use()
+                       + m_nodes * sizeof(UCTNodePointer)
+                       + m_transpositions.get_estimated_size();
+    auto limit = cfg_max_tree_mb * 1024.0f * 1024.0f;
+    if (cfg_max_memory_mb > 0) {
+        // The tree gets what the NNCache leaves.
+        limit = cfg_max_memory_mb * 1024.0f * 1024.0f
+                - NNCache::get_NNCache().get_estimated_size();
+    }
+    if (limit <= 0.0f) {
+        return std::numeric_limits<float>::infinity();
+    }
+    return bytes / limit;
+}
+
+void UCTSearch::start_workers(ThreadGroup& tg) {
+    for (int i = 1; i < cfg_num_threads; i++) {
+        tg.add_task(UCTWorker(m_rootstate, this, m_root.get()));
+    }
+}
+
+void UCTSearch::make_room(ThreadGroup& tg) {
+    // The other threads stop by themselves on the full tree.
+    tg.wait_all();
+    recycle_tree();
+    start_workers(tg);
+}
+
+void UCTSearch::recycle_tree() {
+    const auto nodes = m_nodes.load();
+    // The trees of the earlier roots go before any of this one.
+    clear_tree_cache();
+    wait_for_deletes();
+    // It points into the subtrees that go away.
+    m_transpositions.clear();
+    // The root children keep their statistics, they pick the move. Below
+    // them, the subtrees with the fewest visits go first. Their parents
+    // keep the visits, and they are searched again if they deserve it.
+    auto max_visits = 1;
+    while (get_tree_fill() > RECYCLE_FILL
+           && max_visits < m_root->get_visits()) {
+        for (const auto& child : m_root->get_children()) {
+            if (child.is_inflated()) {
+                child->deflate_children(max_visits);
+            }
+        }
+        m_nodes = m_root->count_nodes();
+        max_visits *= 2;
+    }
+    myprintf("Tree full, recycled %d of %d nodes, subtrees up to %d visits.\n",
+             nodes - m_nodes.load(), nodes, max_visits / 2);
+}
+
 float UCTSearch::get_min_psa_ratio() const {
-    const auto mem_full = m_nodes / static_cast<float>(MAX_TREE_SIZE);
+    const auto mem_full = get_tree_fill();
     // If we are halfway through our memory budget, start trimming
     // moves with very low policy priors.
     if (mem_full > 0.5f) {
@@ -181,11 +464,22 @@ SearchResult UCTSearch::play_simulation(GameState & currstate,
 
     node->virtual_loss();
 
-    if (node->expandable()) {
+    // A position that already has a node somewhere else in the tree is
+    // searched from that node. This node only keeps the statistics of
+    // the visits that came through its own parent, so the shared node
+    // gets each visit once and no ancestor counts it twice.
+    auto transposed = false;
+    if (const auto first = get_transposition(node, currstate)) {
+        transposed = true;
+        result = play_simulation(currstate, first);
+    }
+
+    if (!transposed && node->expandable()) {
         if (currstate.get_passes() >= 2) {
             auto score = currstate.final_score();
             result = SearchResult::from_score(score);
-        } else if (m_nodes < MAX_TREE_SIZE) {
+        } else if (!solve_leaf(node, currstate, result)
+                   && get_tree_fill() < 1.0f) {
 	    float value, alpkt, beta;
 	    const auto had_children = node->has_children();
             const auto success =
@@ -217,7 +511,11 @@ SearchResult UCTSearch::play_simulation(GameState & currstate,
         }
     }
 
-    if (node->has_children() && !result.valid()) {
+    if (!transposed && !result.valid() && node->solved()) {
+        result = SearchResult::from_score(node->get_net_alpkt());
+    }
+
+    if (!transposed && node->has_children() && !result.valid()) {
         auto next = node->uct_select_child(color, node == m_root.get());
         auto move = next->get_move();
 	next->set_eval_bonus_father(node->get_eval_bonus());
@@ -235,11 +533,12 @@ SearchResult UCTSearch::play_simulation(GameState & currstate,
     }
 
     if (result.valid()) {
+        PROFILE_SCOPE(BACKUP);
 	const auto eval = is_mult_komi_net ?
 	    result.eval_with_bonus(node->get_eval_bonus_father()) : result.eval();
 #ifndef NDEBUG
 	myprintf("is_mult_komi_net=%d, bonus=%f, eval_with_bonus=%f, eval=%f.\n"
-		 "About to update blackevals with %f\n", is_mult_komi_net, node->get_eval_bonus(), 
+		 "About to update blackevals with %f\n", is_mult_komi_net.load(), node->get_eval_bonus(), 
 		 result.eval_with_bonus(node->get_eval_bonus()), result.eval(), eval);
 #endif
         node->update(eval);
@@ -259,6 +558,208 @@ SearchResult UCTSearch::play_simulation(GameState & currstate,
     return result;
 }
 
+bool UCTSearch::solve_leaf(UCTNode* const node, const GameState& state,
+                           SearchResult& result) {
+    // The root needs its children to pick a move.
+    if (cfg_solve_empties == 0 || node == m_root.get()
+        || node->has_children()
+        || state.board.get_empty_count() > cfg_solve_empties
+        || !node->start_expansion(state)) {
+        return false;
+    }
+    auto score = 0.0f;
+    if (!EndgameSolver::solve(state, score)) {
+        node->cancel_expansion();
+        return false;
+    }
+    node->set_solved(score);
+    result = SearchResult::from_score(score);
+    return true;
+}
+
+UCTNode* UCTSearch::get_transposition(UCTNode* const node,
+                                      const GameState& state) {
+    if (!cfg_transpositions || node == m_root.get()
+        || state.get_passes() >= 2) {
+        return nullptr;
+    }
+    const auto first = m_transpositions.insert(
+        TranspositionTable::get_key(state), node);
+    if (first == node || node->has_children()) {
+        return nullptr;
+    }
+    // The evals a node backs up carry the bonus of its father, which
+    // the first node got from its own. Its statistics only stay
+    // consistent for fathers with the same bonus, the other ones grow
+    // a subtree of their own.
+    if (is_mult_komi_net
+        && first->get_eval_bonus_father() != node->get_eval_bonus_father()) {
+        return nullptr;
+    }
+    return first;
+}
+
+bool UCTSearch::descend(Descent& descent) {
+    auto& currstate = *descent.state;
+    auto node = descent.path.back();
+    for (;;) {
+        // Transpositions are followed as in play_simulation.
+        if (const auto first = get_transposition(node, currstate)) {
+            node = first;
+            node->virtual_loss();
+            descent.path.emplace_back(node);
+        }
+
+        if (node->solved()) {
+            descent.result = SearchResult::from_score(node->get_net_alpkt());
+            return true;
+        }
+        if (node->expandable()) {
+            if (currstate.get_passes() >= 2) {
+                const auto score = currstate.final_score();
+                descent.result = SearchResult::from_score(score);
+                return true;
+            }
+            if (solve_leaf(node, currstate, descent.result)) {
+                return true;
+            }
+            if (get_tree_fill() < 1.0f) {
+                const auto min_psa_ratio = get_min_psa_ratio();
+                const auto had_children = node->has_children();
+                if (node->start_expansion(currstate, min_psa_ratio)) {
+                    if (!had_children) {
+                        // A new leaf, evaluated with the others.
+                        descent.min_psa_ratio = min_psa_ratio;
+                        return true;
+                    }
+                    // Only brings back pruned moves, there is no
+                    // result to back up.
+                    const auto raw_netlist = Network::get_scored_moves(
+                        &currstate, Network::Ensemble::RANDOM_SYMMETRY);
+                    float value, alpkt, beta;
+                    node->expand(m_nodes, currstate, raw_netlist,
+                                 value, alpkt, beta, min_psa_ratio);
+                } else if (!node->has_children()) {
+                    // Another descent, maybe one of ours, got this
+                    // leaf first.
+                    m_collisions++;
+                    return false;
+                }
+            }
+        }
+
+        if (!node->has_children()) {
+            return false;
+        }
+        const auto color = currstate.get_to_move();
+        auto next = node->uct_select_child(color, node == m_root.get());
+        auto move = next->get_move();
+        next->set_eval_bonus_father(node->get_eval_bonus());
+
+        currstate.play_move(move);
+        if (move != FastBoard::PASS && currstate.superko()) {
+            next->invalidate();
+            return false;
+        }
+        node = next;
+        node->virtual_loss();
+        descent.path.emplace_back(node);
+    }
+}
+
+void UCTSearch::backup(const Descent& descent) {
+    PROFILE_SCOPE(BACKUP);
+    auto result = descent.result;
+    for (auto it = descent.path.rbegin(); it != descent.path.rend(); ++it) {
+        const auto node = *it;
+        if (result.valid()) {
+            const auto eval = is_mult_komi_net ?
+                result.eval_with_bonus(node->get_eval_bonus_father())
+                : result.eval();
+            node->update(eval);
+        }
+        node->virtual_loss_undo();
+    }
+}
+
+void UCTSearch::play_simulations(const GameState& rootstate,
+                                 UCTNode* const root) {
+    // The virtual losses of the descents that wait for their evaluation
+    // send the next descents elsewhere.
+    auto leaves = std::vector<Descent>();
+    leaves.reserve(cfg_leaf_batch);
+    for (auto i = 0; i < cfg_leaf_batch && is_running(); i++) {
+        auto descent = Descent{};
+        descent.state = &playout_state(i);
+        descent.state->start_playout(rootstate);
+        descent.path.emplace_back(root);
+        root->virtual_loss();
+        if (descend(descent) && !descent.result.valid()) {
+            leaves.emplace_back(std::move(descent));
+            continue;
+        }
+        backup(descent);
+        if (descent.result.valid()) {
+            increment_playouts();
+        }
+    }
+    if (leaves.empty()) {
+        return;
+    }
+
+    auto states = std::vector<const GameState*>();
+    for (const auto& leaf : leaves) {
+        states.emplace_back(leaf.state);
+    }
+    // The newest speculations fill the rest of the batch.
+    auto& spec = speculation(rootstate);
+    const auto spare = std::min(cfg_leaf_batch - leaves.size(),
+                                spec.states.size());
+    auto speculative = std::vector<const GameState*>();
+    for (auto i = spec.states.size() - spare; i < spec.states.size(); i++) {
+        speculative.emplace_back(&spec.states[i]);
+    }
+    const auto raw_netlists = Network::get_scored_moves(states, speculative);
+    spec.states.resize(spec.states.size() - spare);
+
+    for (auto i = size_t{0}; i < leaves.size(); i++) {
+        auto& leaf = leaves[i];
+        float value, alpkt, beta;
+        const auto node = leaf.path.back();
+        node->expand(m_nodes, *leaf.state, raw_netlists[i],
+                     value, alpkt, beta, leaf.min_psa_ratio);
+        leaf.result = SearchResult::from_eval(value, alpkt, beta);
+        backup(leaf);
+        increment_playouts();
+
+        // The children come in the order of their policy.
+        const auto& children = node->get_children();
+        const auto count = std::min(size_t(cfg_speculate), children.size());
+        for (auto c = size_t{0}; c < count; c++) {
+            spec.states.emplace_back(*leaf.state);
+            spec.states.back().play_move(children[c].get_move());
+        }
+    }
+    // Older speculations are further from where the search is now.
+    while (spec.states.size() > size_t(cfg_leaf_batch)) {
+        spec.states.pop_front();
+    }
+}
+
+void UCTSearch::run_simulations(const GameState& rootstate,
+                                UCTNode* const root) {
+    if (cfg_leaf_batch > 1) {
+        play_simulations(rootstate, root);
+        return;
+    }
+    auto& currstate = playout_state(0);
+    currstate.start_playout(rootstate);
+    auto result = play_simulation(currstate, root);
+    if (result.valid()) {
+        increment_playouts();
+    }
+}
+
 void UCTSearch::dump_stats(FastState & state, UCTNode & parent) {
     if (cfg_quiet || !parent.has_children()) {
         return;
@@ -266,19 +767,21 @@ void UCTSearch::dump_stats(FastState & state, UCTNode & parent) {
 
     const int color = state.get_to_move();
 
-    // sort children, put best move on top
-    parent.sort_children(color);
+    // best move on top
+    const auto children =
+        parent.get_ranked_children(color, parent.get_children().size());
 
-    if (parent.get_first_child()->first_visit()) {
+    if (children.front()->get_visits() == 0) {
         return;
     }
 
     int movecount = 0;
-    for (const auto& node : parent.get_children()) {
+    for (const auto child : children) {
         // Always display at least two moves. In the case there is
         // only one move searched the user could get an idea why.
-        if (++movecount > 2 && !node->get_visits()) break;
+        if (++movecount > 2 && !child->get_visits()) break;
 
+        const auto node = child->get();
         std::string move = state.move_to_text(node->get_move());
         FastState tmpstate = state;
         tmpstate.play_move(node->get_move());
@@ -507,10 +1010,20 @@ int UCTSearch::get_best_move(passflag_t passflag) {
     return bestmove;
 }
 
-std::string UCTSearch::get_pv(FastState & state, UCTNode& parent) {
-    if (!parent.has_children()) {
+std::string UCTSearch::get_pv(FastState & state, UCTNode& parent,
+                              int max_moves) {
+    if (max_moves <= 0) {
         return std::string();
     }
+    if (!parent.has_children()) {
+        const auto first = cfg_transpositions ?
+            m_transpositions.lookup(TranspositionTable::get_key(state))
+            : nullptr;
+        if (first == nullptr || first == &parent) {
+            return std::string();
+        }
+        return get_pv(state, *first, max_moves);
+    }
 
     auto& best_child = parent.get_best_root_child(state.get_to_move());
     if (best_child.first_visit()) {
@@ -521,7 +1034,7 @@ std::string UCTSearch::get_pv(FastState & state, UCTNode& parent) {
 
     state.play_move(best_move);
 
-    auto next = get_pv(state, best_child);
+    auto next = get_pv(state, best_child, max_moves - 1);
     if (!next.empty()) {
         res.append(" ").append(next);
     }
@@ -542,8 +1055,188 @@ void UCTSearch::dump_analysis(int playouts) {
              playouts, winrate, pvstring.c_str());
 }
 
+void UCTSearch::output_analysis(FastState & state, UCTNode & parent) {
+    struct MoveInfo {
+        UCTNode* node;
+        int visits;
+        float winrate;
+    };
+    const auto color = state.get_to_move();
+
+    // The children of the root don't change while we search, their
+    // stats are atomics.
+    auto moves = std::vector<MoveInfo>{};
+    for (const auto& child : parent.get_children()) {
+        // A child that was inflated just now shows up next time.
+        if (!child.is_inflated()) {
+            continue;
+        }
+        const auto node = child.get();
+        const auto visits = node->get_visits();
+        if (visits > 0 && node->active()) {
+            moves.push_back({node, visits, node->get_eval(color)});
+        }
+    }
+    std::stable_sort(begin(moves), end(moves),
+        [](const MoveInfo& a, const MoveInfo& b) {
+            return std::tie(a.visits, a.winrate)
+                   > std::tie(b.visits, b.winrate);
+        });
+
+    auto out = std::string{};
+    auto order = 0;
+    for (const auto& info : moves) {
+        const auto move = state.move_to_text(info.node->get_move());
+        auto pvstate = state;
+        pvstate.play_move(info.node->get_move());
+        auto pv = move;
+        const auto next = get_pv(pvstate, *info.node, MAX_PV_MOVES - 1);
+        if (!next.empty()) {
+            pv.append(" ").append(next);
+        }
+        // The net alpkt of a child is from the side that answers.
+        out.append(str(boost::format(
+            "info move %s visits %d winrate %d prior %d"
+            " alpkt %.2f beta %.3f order %d pv %s ")
+            % move % info.visits % int(info.winrate * 10000.0f)
+            % int(info.node->get_score() * 10000.0f)
+            % -info.node->get_net_alpkt() % info.node->get_net_beta()
+            % order++ % pv));
+    }
+    if (!out.empty()) {
+        out.pop_back();
+        gtp_printf_raw("%s\n", out.c_str());
+    }
+}
+
+std::vector<float> UCTSearch::komi_evals(
+    const UCTNode& node, FastState& state,
+    const std::vector<std::pair<float, float>>& shifts) {
+    auto alpkt = node.get_net_alpkt();
+    auto beta = node.get_net_beta();
+    if (state.get_passes() >= 2) {
+        // As SearchResult::from_score.
+        alpkt = state.final_score();
+        beta = 10.0f;
+    } else if (cfg_transpositions && !node.has_children()) {
+        // The visits went to the first node of the position.
+        const auto first = m_transpositions.lookup(
+            TranspositionTable::get_key(state));
+        if (first != nullptr && first != &node && first->has_children()) {
+            return komi_evals(*first, state, shifts);
+        }
+    }
+
+    auto sums = std::vector<double>(shifts.size(), 0.0);
+    auto children_visits = 0;
+    for (const auto& child : node.get_children()) {
+        if (!child.is_inflated()) {
+            continue;
+        }
+        const auto next = child.get();
+        const auto visits = next->get_visits();
+        if (visits == 0 || !next->valid()) {
+            continue;
+        }
+        auto nextstate = state;
+        nextstate.play_move(next->get_move());
+        const auto evals = komi_evals(*next, nextstate, shifts);
+        for (auto i = size_t{0}; i < shifts.size(); i++) {
+            sums[i] += double(visits) * evals[i];
+        }
+        children_visits += visits;
+    }
+    // The visits that stopped here, at the eval of the node itself.
+    const auto own = std::max(node.get_visits() - children_visits,
+                              children_visits == 0 ? 1 : 0);
+    auto evals = std::vector<float>(shifts.size());
+    for (auto i = size_t{0}; i < shifts.size(); i++) {
+        auto result = SearchResult::from_eval(0.5f, alpkt - shifts[i].first,
+                                              beta);
+        sums[i] += double(own) * result.eval_with_bonus(shifts[i].second);
+        evals[i] = static_cast<float>(sums[i] / (own + children_visits));
+    }
+    return evals;
+}
+
+std::string UCTSearch::get_komi_analysis(const std::vector<float>& komis) {
+    if (komis.empty() || !m_root->has_children()
+        || m_root->get_visits() == 0) {
+        return {};
+    }
+    FastState state = m_rootstate;
+    const auto color = state.get_to_move();
+    // The root moves are valued with the bonus of the root at that komi,
+    // the root itself with the bonus of its father, as it was searched.
+    auto root_shifts = std::vector<std::pair<float, float>>();
+    auto child_shifts = std::vector<std::pair<float, float>>();
+    for (const auto komi : komis) {
+        const auto delta = komi - state.get_komi();
+        root_shifts.emplace_back(delta, m_root->get_eval_bonus_father());
+        child_shifts.emplace_back(
+            delta, UCTNode::eval_bonus(m_root->get_net_alpkt() - delta,
+                                       m_root->get_net_beta()));
+    }
+    const auto to_move = [color](const float black_eval) {
+        return int((color == FastBoard::WHITE ? 1.0f - black_eval
+                                              : black_eval) * 10000.0f);
+    };
+
+    struct MoveEvals {
+        int move;
+        int visits;
+        std::vector<float> evals;
+    };
+    auto moves = std::vector<MoveEvals>{};
+    for (const auto& child : m_root->get_children()) {
+        if (!child.is_inflated()) {
+            continue;
+        }
+        const auto node = child.get();
+        const auto visits = node->get_visits();
+        if (visits > 0 && node->valid()) {
+            auto childstate = state;
+            childstate.play_move(node->get_move());
+            moves.push_back({node->get_move(), visits,
+                             komi_evals(*node, childstate, child_shifts)});
+        }
+    }
+    std::stable_sort(begin(moves), end(moves),
+        [](const MoveEvals& a, const MoveEvals& b) {
+            return a.visits > b.visits;
+        });
+
+    const auto root_evals = komi_evals(*m_root, state, root_shifts);
+    auto out = std::string{};
+    for (auto i = size_t{0}; i < komis.size(); i++) {
+        out.append(str(boost::format("komi %.1f winrate %d moves")
+                       % komis[i] % to_move(root_evals[i])));
+        for (const auto& info : moves) {
+            out.append(str(boost::format(" %s %d")
+                           % state.move_to_text(info.move)
+                           % to_move(info.evals[i])));
+        }
+        out.append("\n");
+    }
+    out.pop_back();
+    return out;
+}
+
 bool UCTSearch::is_running() const {
-    return m_run && m_nodes < MAX_TREE_SIZE;
+    return m_run && get_tree_fill() < 1.0f;
+}
+
+float UCTSearch::get_playout_rate() const {
+    if (m_rate_playouts >= 0) {
+        // Wait for at least 1 second and 100 playouts
+        // so we get a reliable playout_rate.
+        const auto centis = Time::timediff_centis(m_rate_start, Time());
+        const auto playouts = m_playouts - m_rate_playouts;
+        if (centis >= 100 && playouts >= 100) {
+            return 1.0f * playouts / centis;
+        }
+    }
+    return m_playout_rate;
 }
 
 int UCTSearch::est_playouts_left(int elapsed_centis, int time_for_move) const {
@@ -552,17 +1245,32 @@ int UCTSearch::est_playouts_left(int elapsed_centis, int time_for_move) const {
         std::max(0, std::min(m_maxplayouts - playouts,
                              m_maxvisits - m_root->get_visits()));
 
-    // Wait for at least 1 second and 100 playouts
-    // so we get a reliable playout_rate.
-    if (elapsed_centis < 100 || playouts < 100) {
+    const auto playout_rate = get_playout_rate();
+    if (playout_rate <= 0.0f) {
         return playouts_left;
     }
-    const auto playout_rate = 1.0f * playouts / elapsed_centis;
     const auto time_left = std::max(0, time_for_move - elapsed_centis);
     return std::min(playouts_left,
                     static_cast<int>(std::ceil(playout_rate * time_left)));
 }
 
+bool UCTSearch::root_visits_split() const {
+    auto first = 0;
+    auto second = 0;
+    for (const auto& node : m_root->get_children()) {
+        if (node.valid()) {
+            const auto visits = node.get_visits();
+            if (visits > first) {
+                second = first;
+                first = visits;
+            } else if (visits > second) {
+                second = visits;
+            }
+        }
+    }
+    return first > 0 && 4 * second >= 3 * first;
+}
+
 size_t UCTSearch::prune_noncontenders(int elapsed_centis, int time_for_move) {
     auto Nfirst = 0;
     // There are no cases where the root's children vector gets modified
@@ -631,17 +1339,15 @@ bool UCTSearch::stop_thinking(int elapsed_centis, int time_for_move) const {
 }
 
 void UCTWorker::operator()() {
+    Utils::EvalPriorityScope priority(m_priority);
     do {
-        auto currstate = std::make_unique<GameState>(m_rootstate);
-        auto result = m_search->play_simulation(*currstate, m_root);
-        if (result.valid()) {
-            m_search->increment_playouts();
-        }
+        m_search->run_simulations(m_rootstate, m_root);
     } while (m_search->is_running());
 }
 
 void UCTSearch::increment_playouts() {
     m_playouts++;
+    Metrics::add(Metrics::PLAYOUTS);
     //    myprintf("\n");
 }
 
@@ -668,9 +1374,28 @@ int UCTSearch::think(int color, passflag_t passflag) {
     // Start counting time for us
     m_rootstate.start_clock(color);
 
+    if (!m_ponder_moves.empty()) {
+        if (m_last_rootstate && m_rootstate.get_movenum()
+                                == m_last_rootstate->get_movenum() + 1) {
+            Metrics::add(Metrics::PONDERS);
+            const auto move = m_rootstate.get_last_move();
+            if (std::find(begin(m_ponder_moves), end(m_ponder_moves), move)
+                != end(m_ponder_moves)) {
+                Metrics::add(Metrics::PONDER_HITS);
+            }
+        }
+        m_ponder_moves.clear();
+    }
+
     // set up timing info
     Time start;
 
+    // Each color can play with its own network, and the tree holds the
+    // evaluations of the one that built it.
+    if (Network::select_side(color)) {
+        m_last_rootstate.reset(nullptr);
+        clear_tree_cache();
+    }
     update_root();
     // set side to move
     m_rootstate.board.set_to_move(color);
@@ -678,13 +1403,35 @@ int UCTSearch::think(int color, passflag_t passflag) {
     m_rootstate.get_timecontrol().set_boardsize(
         m_rootstate.board.get_boardsize());
     auto time_for_move = m_rootstate.get_timecontrol().max_time_for_move(color, m_rootstate.get_movenum());
+    auto extended_time = m_rootstate.get_timecontrol()
+        .max_extended_time_for_move(color, m_rootstate.get_movenum());
+    if (cfg_timemanage == TimeManagement::OFF) {
+        extended_time = time_for_move;
+    }
+    // The move isn't done when the search stops.
+    const auto finish_centis = static_cast<int>(m_finish_centis);
+    time_for_move = std::max(0, time_for_move - finish_centis);
+    extended_time = std::max(0, extended_time - finish_centis);
 
     myprintf("Thinking at most %.1f seconds...\n", time_for_move/100.0f);
 
+    // In a GameServer the evaluations of this move go before those of
+    // the games with more time, or that ponder.
+    auto priority = Utils::get_eval_priority();
+    priority.deadline = std::chrono::steady_clock::now()
+                        + std::chrono::milliseconds(10 * time_for_move);
+    Utils::EvalPriorityScope eval_priority(priority);
+
     // create a sorted list of legal moves (make sure we
     // play something legal and decent even in time trouble)
     m_root->prepare_root_node(color, m_nodes, m_rootstate);
 
+    auto coordinator = std::unique_ptr<DistributedSearch::Coordinator>();
+    if (!cfg_search_workers.empty()) {
+        coordinator = std::make_unique<DistributedSearch::Coordinator>(
+            cfg_search_workers, m_rootstate, color, time_for_move);
+    }
+
 #ifndef NDEBUG
     myprintf("We are at root. Move choices by policy are: ");
     print_move_choices_by_policy(m_rootstate, *m_root, 5, 0.01f);
@@ -695,22 +1442,27 @@ int UCTSearch::think(int color, passflag_t passflag) {
     int cpus = cfg_num_threads;
     myprintf("cpus=%i\n", cpus);
     ThreadGroup tg(thread_pool);
-    for (int i = 1; i < cpus; i++) {
-      tg.add_task(UCTWorker(m_rootstate, this, m_root.get()));
-    }
+    start_workers(tg);
+    // The playout rate is measured after the batches and the cache
+    // have filled up a bit.
+    const Time search_start;
+    m_rate_playouts = -1;
 
     bool keeprunning = true;
     int last_update = 0;
     do {
-        auto currstate = std::make_unique<GameState>(m_rootstate);
-
-        auto result = play_simulation(*currstate, m_root.get());
-        if (result.valid()) {
-	  increment_playouts();
+        run_simulations(m_rootstate, m_root.get());
+        if (get_tree_fill() >= 1.0f) {
+            make_room(tg);
         }
 
         Time elapsed;
         int elapsed_centis = Time::timediff_centis(start, elapsed);
+        if (m_rate_playouts < 0
+            && Time::timediff_centis(search_start, elapsed) >= 10) {
+            m_rate_start = elapsed;
+            m_rate_playouts = m_playouts;
+        }
 
         // output some stats every few seconds
         // check if we should still search
@@ -718,14 +1470,42 @@ int UCTSearch::think(int color, passflag_t passflag) {
             last_update = elapsed_centis;
             dump_analysis(static_cast<int>(m_playouts));
         }
+        // Think longer when the best moves are close.
+        if (elapsed_centis >= time_for_move && time_for_move < extended_time
+            && root_visits_split()) {
+            myprintf("Best moves are close, thinking up to %.1f seconds.\n",
+                     extended_time / 100.0f);
+            time_for_move = extended_time;
+        }
         keeprunning  = is_running();
         keeprunning &= !stop_thinking(elapsed_centis, time_for_move);
         keeprunning &= have_alternate_moves(elapsed_centis, time_for_move);
+        if (m_progress_callback) {
+            keeprunning &= m_progress_callback();
+        }
     } while (keeprunning);
 
     // stop the search
     m_run = false;
     tg.wait_all();
+    const Time search_end;
+    if (m_rate_playouts >= 0) {
+        const auto centis = Time::timediff_centis(m_rate_start, search_end);
+        const auto playouts = m_playouts - m_rate_playouts;
+        if (centis >= 10 && playouts > 0) {
+            const auto rate = 1.0f * playouts / centis;
+            m_playout_rate = m_playout_rate > 0.0f
+                ? 0.5f * (m_playout_rate + rate) : rate;
+        }
+    }
+    // The estimate is only used during the next search.
+    m_rate_playouts = -1;
+
+    if (coordinator) {
+        for (const auto& stats : coordinator->finish()) {
+            merge_root_stats(stats);
+        }
+    }
 
     // reactivate all pruned root children
     for (const auto& node : m_root->get_children()) {
@@ -771,38 +1551,93 @@ int UCTSearch::think(int color, passflag_t passflag) {
                  static_cast<int>(m_playouts),
                  (m_playouts * 100.0) / (elapsed_centis+1));
     }
+    if (cfg_leaf_batch > 1) {
+        myprintf("%d leaf collisions\n", static_cast<int>(m_collisions));
+    }
+    if (cfg_numa || cfg_huge_pages) {
+        UCTNodePool::dump_stats();
+    }
+    Network::dump_batch_stats();
 
     // Copy the root state. Use to check for tree re-use in future calls.
     m_last_rootstate = std::make_unique<GameState>(m_rootstate);
+    m_last_lambda = cfg_lambda;
+
+    const auto finish = Time::timediff_centis(search_end, Time());
+    m_finish_centis = 0.5f * (m_finish_centis + finish);
     return bestmove;
 }
 
-void UCTSearch::ponder() {
+void UCTSearch::ponder(int analysis_centis) {
     update_root();
 
     m_root->prepare_root_node(m_rootstate.board.get_to_move(),
                               m_nodes, m_rootstate);
 
+    m_ponder_moves.clear();
+    auto max_playouts = m_maxplayouts;
+    if (analysis_centis == 0 && cfg_ponder_replies > 0) {
+        // The replies the search from our move liked, and then the
+        // ones the policy likes.
+        auto replies = std::vector<const UCTNodePointer*>();
+        for (const auto& node : m_root->get_children()) {
+            if (node.valid()) {
+                replies.emplace_back(&node);
+            }
+        }
+        std::stable_sort(begin(replies), end(replies),
+            [](const UCTNodePointer* a, const UCTNodePointer* b) {
+                if (a->get_visits() != b->get_visits()) {
+                    return a->get_visits() > b->get_visits();
+                }
+                return a->get_score() > b->get_score();
+            });
+        for (auto i = size_t{0}; i < replies.size(); i++) {
+            const auto searched = i < size_t(cfg_ponder_replies);
+            (*replies[i])->set_active(searched);
+            if (searched) {
+                m_ponder_moves.emplace_back(replies[i]->get_move());
+            }
+        }
+        // Past that the ponder evicts the evaluations it warmed the
+        // cache with, or those of the last search.
+        max_playouts = std::min(max_playouts, static_cast<int>(
+            NNCache::get_NNCache().get_capacity() / 2));
+    }
+
     m_run = true;
     ThreadGroup tg(thread_pool);
-    for (int i = 1; i < cfg_num_threads; i++) {
-        tg.add_task(UCTWorker(m_rootstate, this, m_root.get()));
-    }
+    start_workers(tg);
+    Time start;
+    auto last_analysis = 0;
     auto keeprunning = true;
     do {
-        auto currstate = std::make_unique<GameState>(m_rootstate);
-        auto result = play_simulation(*currstate, m_root.get());
-        if (result.valid()) {
-            increment_playouts();
+        run_simulations(m_rootstate, m_root.get());
+        if (analysis_centis > 0) {
+            Time now;
+            const auto elapsed_centis = Time::timediff_centis(start, now);
+            if (elapsed_centis - last_analysis >= analysis_centis) {
+                last_analysis = elapsed_centis;
+                output_analysis(m_rootstate, *m_root);
+            }
+        }
+        if (get_tree_fill() >= 1.0f) {
+            make_room(tg);
         }
         keeprunning  = is_running();
         keeprunning &= !stop_thinking(0, 1);
-    } while (!Utils::input_pending() && keeprunning);
+        keeprunning &= m_playouts < max_playouts;
+        // lz-analyze stops for any command, as the GUIs expect.
+    } while (!Utils::input_pending(analysis_centis == 0) && keeprunning);
 
     // stop the search
     m_run = false;
     tg.wait_all();
 
+    for (const auto& node : m_root->get_children()) {
+        node->set_active(true);
+    }
+
     // display search info
     myprintf("\n");
     dump_stats(m_rootstate, *m_root);
@@ -811,6 +1646,7 @@ void UCTSearch::ponder() {
 
     // Copy the root state. Use to check for tree re-use in future calls.
     m_last_rootstate = std::make_unique<GameState>(m_rootstate);
+    m_last_lambda = cfg_lambda;
 }
 
 void UCTSearch::set_playout_limit(int playouts) {
@@ -828,6 +1664,75 @@ void UCTSearch::set_visit_limit(int visits) {
     m_maxvisits = std::min(visits, UNLIMITED_PLAYOUTS);
 }
 
+bool UCTSearch::save_tree(const std::string& filename,
+                          const int min_visits) const {
+    if (!m_root || !m_last_rootstate) {
+        myprintf("There is no search tree to save.\n");
+        return false;
+    }
+    return TreeFile::save(filename, *m_root,
+                          TranspositionTable::get_key(*m_last_rootstate),
+                          Network::get_net_key(), min_visits);
+}
+
+bool UCTSearch::load_tree(const std::string& filename) {
+    auto root = TreeFile::load(filename,
+                               TranspositionTable::get_key(m_rootstate),
+                               Network::get_net_key());
+    if (!root) {
+        return false;
+    }
+    m_transpositions.clear();
+    m_root = std::move(root);
+    m_last_rootstate = std::make_unique<GameState>(m_rootstate);
+    m_last_lambda = cfg_lambda;
+    m_nodes = m_root->count_nodes();
+    myprintf("Loaded %d visits, %d nodes.\n", m_root->get_visits(),
+             m_nodes.load());
+    return true;
+}
+
+void UCTSearch::set_progress_callback(std::function<bool()> callback) {
+    m_progress_callback = std::move(callback);
+}
+
+std::vector<RootMoveStats> UCTSearch::get_root_stats(size_t max_moves) const {
+    auto result = std::vector<RootMoveStats>();
+    if (!m_root) {
+        return result;
+    }
+    for (const auto& child : m_root->get_children()) {
+        const auto visits = child.get_visits();
+        if (visits > 0 && child.is_inflated()) {
+            result.push_back({child.get_move(), visits,
+                float(child->get_blackevals() / visits)});
+        }
+    }
+    std::sort(begin(result), end(result),
+        [](const RootMoveStats& a, const RootMoveStats& b) {
+            return a.visits > b.visits;
+        });
+    if (result.size() > max_moves) {
+        result.resize(max_moves);
+    }
+    return result;
+}
+
+void UCTSearch::merge_root_stats(const std::vector<RootMoveStats>& stats) {
+    for (const auto& remote : stats) {
+        for (const auto& child : m_root->get_children()) {
+            if (child.get_move() != remote.move) {
+                continue;
+            }
+            // Moves that were never visited here only exist as pointers.
+            child.inflate();
+            child->add_remote_visits(remote.visits, remote.black_eval);
+            m_root->add_remote_visits(remote.visits, remote.black_eval);
+            break;
+        }
+    }
+}
+
 float SearchResult::eval_with_bonus(float xbar) {
     if (std::abs(xbar) < 0.001f) {
 	return sigmoid(m_alpkt,m_beta,0.0f);
@@ -846,12 +1751,12 @@ float SearchResult::eval_with_bonus(float xbar) {
     if (xbar < -1000.0f) {
 	return 0.0f;
     }
-    
+
     auto a = std::abs(m_alpkt+xbar);
     auto b = std::abs(m_alpkt);
 
     auto aa = std::log(sigmoid(b,m_beta,0.0f))/m_beta/xbar;
     auto bb = std::log(sigmoid(a,m_beta,0.0f))/m_beta/xbar;
-    
+
     return 0.5f + 0.5f*(a-b)/xbar + aa - bb;
 }
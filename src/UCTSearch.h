@@ -20,18 +20,23 @@
 #ifndef UCTSEARCH_H_INCLUDED
 #define UCTSEARCH_H_INCLUDED
 
+#include <functional>
 #include <list>
 #include <atomic>
 #include <memory>
 #include <string>
 #include <tuple>
+#include <vector>
 #include <future>
 
 #include "ThreadPool.h"
 #include "FastBoard.h"
 #include "FastState.h"
 #include "GameState.h"
+#include "Timing.h"
+#include "TranspositionTable.h"
 #include "UCTNode.h"
+#include "Utils.h"
 
 
 class SearchResult {
@@ -61,6 +66,14 @@ private:
     float m_beta{1.0f};
 };
 
+// What a search found for one root move, in a form that can be sent to
+// and merged into another search.
+struct RootMoveStats {
+    int move;
+    int visits;
+    float black_eval;
+};
+
 namespace TimeManagement {
     enum enabled_t {
         AUTO = -1, OFF = 0, ON = 1, FAST = 2
@@ -80,12 +93,24 @@ public:
     static constexpr passflag_t NORESIGN = 1 << 1;
 
     /*
-        Maximum size of the tree in memory. Nodes are about
-        48 bytes, so limit to ~1.2G on 32-bits and about 5.5G
-        on 64-bits.
+        Default maximum size of the tree in memory, in MB.
+    */
+    static constexpr auto DEFAULT_MAX_TREE_MB =
+        (sizeof(void*) == 4 ? 1'200 : 5'500);
+
+    /*
+        Fraction of the tree memory that is left in use after a full tree
+        is recycled.
+    */
+    static constexpr auto RECYCLE_FILL = 0.8f;
+
+    /*
+        Number of trees of earlier roots that are kept, for when the game
+        goes back to them, and the fraction of the tree memory past which
+        the oldest ones are freed.
     */
-    static constexpr auto MAX_TREE_SIZE =
-        (sizeof(void*) == 4 ? 25'000'000 : 100'000'000);
+    static constexpr auto TREE_CACHE_SIZE = size_t{32};
+    static constexpr auto TREE_CACHE_FILL = 0.25f;
 
     /*
         Value representing unlimited visits or playouts. Due to
@@ -95,52 +120,188 @@ public:
     static constexpr auto UNLIMITED_PLAYOUTS =
         std::numeric_limits<int>::max() / 2;
 
+    /*
+        Longest principal variation that is printed.
+    */
+    static constexpr auto MAX_PV_MOVES = 2 * BOARD_SQUARES;
+
     UCTSearch(GameState& g);
     int think(int color, passflag_t passflag = NORMAL);
     void set_playout_limit(int playouts);
     void set_visit_limit(int visits);
-    void ponder();
+    // With analysis_centis set, writes lz-analyze info lines to stdout
+    // every that many centiseconds. Otherwise only the --ponder-replies
+    // likeliest opponent replies are searched, for as many playouts as
+    // the NNCache can keep besides the last search.
+    void ponder(int analysis_centis = 0);
     bool is_running() const;
     void increment_playouts();
     SearchResult play_simulation(GameState& currstate, UCTNode* const node);
+    // One playout from the root, or a batch of --leafbatch of them.
+    void run_simulations(const GameState& rootstate, UCTNode* const root);
+    // Called by think() after every playout of the main thread. The
+    // search stops when it returns false.
+    void set_progress_callback(std::function<bool()> callback);
+    // The max_moves most visited root moves.
+    std::vector<RootMoveStats> get_root_stats(size_t max_moves) const;
+    // The winrates of the last search at each of these komi values, for
+    // the side to move. Every net eval of the tree is moved to the komi
+    // with its alpkt and beta, and averaged with the visits as the
+    // search did. One line per komi, empty if there was no search.
+    std::string get_komi_analysis(const std::vector<float>& komis);
+    // Writes the tree of the last search, see TreeFile.
+    bool save_tree(const std::string& filename, int min_visits) const;
+    // Reads a tree that save_tree() wrote for the current position, the
+    // next search goes on from it.
+    bool load_tree(const std::string& filename);
 
 private:
+    // A descent that stopped at a leaf or at the end of the game.
+    struct Descent {
+        // One of the playout states of this thread.
+        GameState* state{nullptr};
+        // From the root down to the leaf, all with a virtual loss.
+        std::vector<UCTNode*> path;
+        SearchResult result;
+        // For the expansion of the leaf.
+        float min_psa_ratio{0.0f};
+    };
+    // Walks down like play_simulation, but only claims the expansion of
+    // the leaf. Returns false if there is nothing to back up.
+    bool descend(Descent& descent);
+    // With --solve-empties, looks for the exact score of a leaf that is
+    // not expanded yet. If it is found, the leaf is solved and result
+    // is its score.
+    bool solve_leaf(UCTNode* node, const GameState& state,
+                    SearchResult& result);
+    // With --transpositions, the node the search should go on from
+    // instead of this leaf, or nullptr.
+    UCTNode* get_transposition(UCTNode* node, const GameState& state);
+    // Updates the nodes of the path and takes back their virtual losses.
+    void backup(const Descent& descent);
+    // Collects up to --leafbatch leaves, evaluates them as one batch,
+    // and backs them all up.
+    void play_simulations(const GameState& rootstate, UCTNode* const root);
+
     float get_min_psa_ratio() const;
+    // Memory taken by the tree, as a fraction of the limit.
+    float get_tree_fill() const;
+    // The main thread calls this when the tree is full, it waits for the
+    // other threads, recycles and starts them again.
+    void make_room(Utils::ThreadGroup& tg);
+    // Deflates the least visited subtrees until the tree is down to
+    // RECYCLE_FILL. No other thread may be searching.
+    void recycle_tree();
+    void start_workers(Utils::ThreadGroup& tg);
     void dump_stats(FastState& state, UCTNode& parent);
     void print_move_choices_by_policy(KoState& state, UCTNode& parent, int at_least_as_many, float probab_threash);
     void tree_stats(const UCTNode& node);
-    std::string get_pv(FastState& state, UCTNode& parent);
+    std::string get_pv(FastState& state, UCTNode& parent,
+                       int max_moves = MAX_PV_MOVES);
     void dump_analysis(int playouts);
+    // One lz-analyze line for the root moves. The root children are read
+    // without a lock, the PVs only lock the nodes below them.
+    void output_analysis(FastState& state, UCTNode& parent);
+    // The black evals of the subtree of node at the komi differences of
+    // the shifts, each with its bonus for --lambda in place of the bonus
+    // of the father. state is the position of node.
+    std::vector<float> komi_evals(
+        const UCTNode& node, FastState& state,
+        const std::vector<std::pair<float, float>>& shifts);
     bool should_resign(passflag_t passflag, float bestscore);
     bool have_alternate_moves(int elapsed_centis, int time_for_move);
+    // Playouts per centisecond of this search once it is up to speed,
+    // or else of the previous moves. 0 if there is no estimate yet.
+    float get_playout_rate() const;
     int est_playouts_left(int elapsed_centis, int time_for_move) const;
+    // Whether the runner-up at the root has nearly as many visits as
+    // the best move.
+    bool root_visits_split() const;
     size_t prune_noncontenders(int elapsed_centis = 0, int time_for_move = 0);
     bool stop_thinking(int elapsed_centis = 0, int time_for_move = 0) const;
     int get_best_move(passflag_t passflag);
     void update_root();
+    // Adds the visits of a remote search to the root children.
+    void merge_root_stats(const std::vector<RootMoveStats>& stats);
     bool advance_to_new_rootstate();
+    // Moves the evals of the tree to a komi delta points higher and to
+    // the current --lambda, from the alpkt and beta of the nodes. False
+    // if the tree can't be kept.
+    bool reweight_tree(float delta);
+    // Does node and its subtree. states, bonuses and sums are stacks
+    // from the root down to node: the positions, the bonus of the father
+    // of every node, and the evals of the subtree added up for each of
+    // them. They are back as they were after the call. The subtrees of
+    // the children are done in parallel if asked.
+    void reweight_subtree(UCTNode& node, std::vector<FastState>& states,
+                          float delta, std::vector<float>& bonuses,
+                          std::vector<double>& sums, bool parallel);
+
+    // The tree of an earlier root, see TREE_CACHE_SIZE.
+    struct CachedTree {
+        std::uint64_t key;
+        // The key of the position before it, 0 at the first move.
+        std::uint64_t parent_key;
+        float lambda;
+        std::unique_ptr<UCTNode> root;
+    };
+    // Keeps root, the tree of state searched with m_last_lambda.
+    void cache_tree(const GameState& state, std::unique_ptr<UCTNode> root);
+    // Takes the tree of the position with key out of the cache, with
+    // the trees of the positions after it put back in as its subtrees.
+    std::unique_ptr<UCTNode> take_cached_tree(std::uint64_t key);
+    void trim_tree_cache();
+    void clear_tree_cache();
+    void delete_lazily(std::unique_ptr<UCTNode> root);
+    void wait_for_deletes();
 
     GameState & m_rootstate;
     std::unique_ptr<GameState> m_last_rootstate;
+    // The --lambda the tree was searched with.
+    float m_last_lambda{0.0f};
     std::unique_ptr<UCTNode> m_root;
+    // Only filled with --transpositions.
+    TranspositionTable m_transpositions;
     std::atomic<int> m_nodes{0};
     std::atomic<int> m_playouts{0};
+    // Descents of play_simulations that ran into a leaf that was already
+    // being expanded.
+    std::atomic<int> m_collisions{0};
     std::atomic<bool> m_run{false};
     int m_maxplayouts;
     int m_maxvisits;
+    // The time management model, kept over the moves of the game: the
+    // playouts per centisecond after the warmup of the search, and the
+    // centiseconds a move takes after the search. Both are 0 until the
+    // first move measures them.
+    float m_playout_rate{0.0f};
+    float m_finish_centis{0.0f};
+    // Start of the measured part of the current search, there are no
+    // measured playouts until m_rate_playouts isn't negative.
+    Time m_rate_start;
+    int m_rate_playouts{-1};
+    std::function<bool()> m_progress_callback;
 
     std::list<Utils::ThreadGroup> m_delete_futures;
+    // Most recently left first.
+    std::list<CachedTree> m_tree_cache;
+    // The opponent replies of the last ponder, to count its hits.
+    std::vector<int> m_ponder_moves;
 };
 
 class UCTWorker {
 public:
+    // The worker evaluates with the EvalPriority of the thread that
+    // creates it.
     UCTWorker(GameState & state, UCTSearch * search, UCTNode * root)
-      : m_rootstate(state), m_search(search), m_root(root) {}
+      : m_rootstate(state), m_search(search), m_root(root),
+        m_priority(Utils::get_eval_priority()) {}
     void operator()();
 private:
     GameState & m_rootstate;
     UCTSearch * m_search;
     UCTNode * m_root;
+    Utils::EvalPriority m_priority;
 };
 
 #endif
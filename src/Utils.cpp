@@ -19,6 +19,7 @@
 #include "config.h"
 #include "Utils.h"
 
+#include <algorithm>
 #include <mutex>
 #include <cstdarg>
 #include <cstdio>
@@ -33,7 +34,30 @@
 
 Utils::ThreadPool thread_pool;
 
-bool Utils::input_pending(void) {
+static thread_local std::function<bool(bool)> t_input_check;
+static thread_local std::string t_gtp_prefix;
+static thread_local Utils::EvalPriority t_eval_priority;
+
+void Utils::set_input_check(std::function<bool(bool)> check) {
+    t_input_check = std::move(check);
+}
+
+void Utils::set_gtp_prefix(const std::string& prefix) {
+    t_gtp_prefix = prefix;
+}
+
+const Utils::EvalPriority& Utils::get_eval_priority() {
+    return t_eval_priority;
+}
+
+void Utils::set_eval_priority(const EvalPriority& priority) {
+    t_eval_priority = priority;
+}
+
+bool Utils::input_pending(const bool answer_queries) {
+    if (t_input_check) {
+        return t_input_check(answer_queries);
+    }
 #ifdef HAVE_SELECT
     fd_set read_fds;
     FD_ZERO(&read_fds);
@@ -94,11 +118,42 @@ void Utils::myprintf(const char *fmt, ...) {
     }
 }
 
-static void gtp_fprintf(FILE* file, const std::string& prefix,
-                        const char *fmt, va_list ap) {
-    fprintf(file, "%s ", prefix.c_str());
-    vfprintf(file, fmt, ap);
-    fprintf(file, "\n\n");
+static std::string vformat(const char *fmt, va_list ap) {
+    va_list copy;
+    va_copy(copy, ap);
+    const auto size = std::max(0, vsnprintf(nullptr, 0, fmt, copy));
+    va_end(copy);
+    auto result = std::string(size, '\0');
+    vsnprintf(&result[0], size + 1, fmt, ap);
+    return result;
+}
+
+// Writes GTP output to stdout and the log, every line with the prefix of
+// this thread. The games of a GameServer write at the same time.
+static void gtp_write(const std::string& text) {
+    static std::mutex GTPmutex;
+    auto out = text;
+    if (!t_gtp_prefix.empty()) {
+        out.clear();
+        auto start = size_t{0};
+        while (start < text.size()) {
+            const auto end = std::min(text.find('\n', start), text.size());
+            out += t_gtp_prefix;
+            if (end > start) {
+                out += " " + text.substr(start, end - start);
+            }
+            out += "\n";
+            start = end + 1;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(GTPmutex);
+    fputs(out.c_str(), stdout);
+    fflush(stdout);
+    if (cfg_logfile_handle) {
+        std::lock_guard<std::mutex> lock(IOmutex);
+        fputs(out.c_str(), cfg_logfile_handle);
+    }
 }
 
 static void gtp_base_printf(int id, std::string prefix,
@@ -107,12 +162,7 @@ static void gtp_base_printf(int id, std::string prefix,
         prefix += std::to_string(id);
     }
 
-    gtp_fprintf(stdout, prefix, fmt, ap);
-
-    if (cfg_logfile_handle) {
-        std::lock_guard<std::mutex> lock(IOmutex);
-        gtp_fprintf(cfg_logfile_handle, prefix, fmt, ap);
-    }
+    gtp_write(prefix + " " + vformat(fmt, ap) + "\n\n");
 }
 
 void Utils::gtp_printf(int id, const char *fmt, ...) {
@@ -129,6 +179,13 @@ void Utils::gtp_fail_printf(int id, const char *fmt, ...) {
     va_end(ap);
 }
 
+void Utils::gtp_printf_raw(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    gtp_write(vformat(fmt, ap));
+    va_end(ap);
+}
+
 void Utils::log_input(const std::string& input) {
     if (cfg_logfile_handle) {
         std::lock_guard<std::mutex> lock(IOmutex);
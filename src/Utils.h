@@ -22,6 +22,8 @@
 #include "config.h"
 
 #include <atomic>
+#include <chrono>
+#include <functional>
 #include <limits>
 #include <string>
 
@@ -33,8 +35,45 @@ namespace Utils {
     void myprintf(const char *fmt, ...);
     void gtp_printf(int id, const char *fmt, ...);
     void gtp_fail_printf(int id, const char *fmt, ...);
+    // Without the GTP framing, for output that streams while a command
+    // runs, like lz-analyze.
+    void gtp_printf_raw(const char *fmt, ...);
     void log_input(const std::string& input);
-    bool input_pending();
+    // With answer_queries the check may first answer the commands that
+    // don't need the search to stop, see GTP::is_query().
+    bool input_pending(bool answer_queries = false);
+    // For the GTP loop and the games of a GameServer: input_pending() on
+    // this thread asks check instead of stdin, and the GTP output of this
+    // thread starts every line with prefix.
+    void set_input_check(std::function<bool(bool answer_queries)> check);
+    void set_gtp_prefix(const std::string& prefix);
+
+    // When the network evaluations of this thread are needed, and the
+    // game they are for. The batches of --batchsize fill up with the
+    // earliest deadlines first, a ponder has none.
+    struct EvalPriority {
+        std::chrono::steady_clock::time_point deadline{
+            std::chrono::steady_clock::time_point::max()};
+        int game{0};
+    };
+    const EvalPriority& get_eval_priority();
+    void set_eval_priority(const EvalPriority& priority);
+
+    // Sets the EvalPriority of this thread until the end of the scope.
+    class EvalPriorityScope {
+    public:
+        explicit EvalPriorityScope(const EvalPriority& priority)
+            : m_saved(get_eval_priority()) {
+            set_eval_priority(priority);
+        }
+        ~EvalPriorityScope() {
+            set_eval_priority(m_saved);
+        }
+        EvalPriorityScope(const EvalPriorityScope&) = delete;
+        EvalPriorityScope& operator=(const EvalPriorityScope&) = delete;
+    private:
+        EvalPriority m_saved;
+    };
 
     template<class T>
     void atomic_add(std::atomic<T> &f, T d) {
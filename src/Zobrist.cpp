@@ -20,10 +20,10 @@
 #include "Zobrist.h"
 #include "Random.h"
 
-std::array<std::array<std::uint64_t, FastBoard::MAXSQ>,     4> Zobrist::zobrist;
-std::array<std::uint64_t, FastBoard::MAXSQ>                    Zobrist::zobrist_ko;
-std::array<std::array<std::uint64_t, FastBoard::MAXSQ * 2>, 2> Zobrist::zobrist_pris;
-std::array<std::uint64_t, 5>                                   Zobrist::zobrist_pass;
+std::array<std::array<std::uint64_t, FastBoard::MAX_MAXSQ>,     4> Zobrist::zobrist;
+std::array<std::uint64_t, FastBoard::MAX_MAXSQ>                    Zobrist::zobrist_ko;
+std::array<std::array<std::uint64_t, FastBoard::MAX_MAXSQ * 2>, 2> Zobrist::zobrist_pris;
+std::array<std::uint64_t, 5>                                       Zobrist::zobrist_pass;
 
 void Zobrist::init_zobrist(Random& rng) {
     for (int i = 0; i < 4; i++) {
@@ -45,4 +45,22 @@ void Zobrist::init_zobrist(Random& rng) {
     for (int i = 0; i < 5; i++) {
         Zobrist::zobrist_pass[i]  = rng.randuint64();
     }
+
+    // The keys of the squares past the BOARD_SIZE board come last, so
+    // that its hashes don't change with the sizes there are boards of.
+    for (int i = 0; i < 4; i++) {
+        for (int j = FastBoard::MAXSQ; j < FastBoard::MAX_MAXSQ; j++) {
+            Zobrist::zobrist[i][j] = rng.randuint64();
+        }
+    }
+
+    for (int j = FastBoard::MAXSQ; j < FastBoard::MAX_MAXSQ; j++) {
+        Zobrist::zobrist_ko[j] = rng.randuint64();
+    }
+
+    for (int i = 0; i < 2; i++) {
+        for (int j = FastBoard::MAXSQ * 2; j < FastBoard::MAX_MAXSQ * 2; j++) {
+            Zobrist::zobrist_pris[i][j] = rng.randuint64();
+        }
+    }
 }
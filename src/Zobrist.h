@@ -31,10 +31,11 @@ public:
     static constexpr auto zobrist_empty = 0x1234567887654321;
     static constexpr auto zobrist_blacktomove = 0xABCDABCDABCDABCD;
 
-    static std::array<std::array<std::uint64_t, FastBoard::MAXSQ>,     4> zobrist;
-    static std::array<std::uint64_t, FastBoard::MAXSQ>                    zobrist_ko;
-    static std::array<std::array<std::uint64_t, FastBoard::MAXSQ * 2>, 2> zobrist_pris;
-    static std::array<std::uint64_t, 5>                                   zobrist_pass;
+    // Sized for the largest board, see FastBoardBase::MAX_SIZE.
+    static std::array<std::array<std::uint64_t, FastBoard::MAX_MAXSQ>,     4> zobrist;
+    static std::array<std::uint64_t, FastBoard::MAX_MAXSQ>                    zobrist_ko;
+    static std::array<std::array<std::uint64_t, FastBoard::MAX_MAXSQ * 2>, 2> zobrist_pris;
+    static std::array<std::uint64_t, 5>                                       zobrist_pass;
 
     static void init_zobrist(Random& rng);
 };
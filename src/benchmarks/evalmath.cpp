@@ -0,0 +1,270 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// The sigmoid, log-sigmoid and mean sigmoid of the SAI evals, with the
+// std:: functions the engine uses (range(0) == 0) against branchless
+// polynomial versions that can be vectorized (range(0) == 1). Each
+// benchmark reports the largest absolute error over its inputs,
+// against the same formula in double, in the max_error counter:
+//
+//     ./microbench --benchmark_filter=EvalMath
+//
+// The engine stays with std:: as long as these show no gain worth the
+// error.
+#include <benchmark/benchmark.h>
+
+#include "config.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "Network.h"
+#include "Random.h"
+#include "UCTSearch.h"
+
+namespace {
+    // After Cephes. The relative error is a few float ulps.
+    inline float poly_exp(float x) {
+        // Stay in the range of normal floats, denormals are very slow
+        // without -ffast-math.
+        x = x < -86.0f ? -86.0f : x;
+        x = x > 88.0f ? 88.0f : x;
+        // x = n * ln(2) + r with |r| <= ln(2) / 2. Rounds by truncation,
+        // adding a magic constant instead would not survive -ffast-math.
+        const auto t = x * 1.44269504f;
+        const auto ni = std::int32_t(t + (t < 0.0f ? -0.5f : 0.5f));
+        const auto n = float(ni);
+        const auto r = x - n * 0.693359375f + n * 2.12194440e-4f;
+        auto p = 1.9875691500e-4f;
+        p = p * r + 1.3981999507e-3f;
+        p = p * r + 8.3334519073e-3f;
+        p = p * r + 4.1665795894e-2f;
+        p = p * r + 1.6666665459e-1f;
+        p = p * r + 5.0000001201e-1f;
+        p = p * r * r + r + 1.0f;
+        // Times 2^n.
+        const auto bits = std::uint32_t(ni + 127) << 23;
+        auto scale = 0.0f;
+        std::memcpy(&scale, &bits, sizeof(scale));
+        return p * scale;
+    }
+
+    inline float poly_log(float x) {
+        x = x < 1.17549435e-38f ? 1.17549435e-38f : x;
+        auto bits = std::uint32_t{};
+        std::memcpy(&bits, &x, sizeof(bits));
+        // x = (1 + m) * 2^e with 1 + m in [sqrt(0.5), sqrt(2)).
+        auto e = float(std::int32_t(bits >> 23) - 126);
+        bits = (bits & 0x807fffffu) | 0x3f000000u;
+        auto m = 0.0f;
+        std::memcpy(&m, &bits, sizeof(m));
+        const auto small = m < 0.707106781f;
+        e = small ? e - 1.0f : e;
+        m = small ? m + m - 1.0f : m - 1.0f;
+        const auto z = m * m;
+        auto p = 7.0376836292e-2f;
+        p = p * m - 1.1514610310e-1f;
+        p = p * m + 1.1676998740e-1f;
+        p = p * m - 1.2420140846e-1f;
+        p = p * m + 1.4249322787e-1f;
+        p = p * m - 1.6668057665e-1f;
+        p = p * m + 2.0000714765e-1f;
+        p = p * m - 2.4999993993e-1f;
+        p = p * m + 3.3333331174e-1f;
+        const auto y = m * z * p - 2.12194440e-4f * e - 0.5f * z;
+        return m + y + 0.693359375f * e;
+    }
+
+    inline float poly_sigmoid(const float x) {
+        return 1.0f / (1.0f + poly_exp(-x));
+    }
+
+    // log(sigmoid(x)), also for x far below zero where the sigmoid is 0.
+    inline float poly_log_sigmoid(const float x) {
+        const auto neg = x < 0.0f ? x : -x;
+        return (x < 0.0f ? x : 0.0f) - poly_log(1.0f + poly_exp(neg));
+    }
+
+    // SearchResult::eval_with_bonus for n bonuses at once, as backup()
+    // would call it.
+    void poly_mean_sigmoid(const float alpkt, const float beta,
+                           const float* xbar, float* out, const size_t n) {
+        const auto b = std::abs(alpkt);
+        const auto eb = 1.0f + poly_exp(-beta * b);
+        const auto pi = poly_sigmoid(beta * alpkt);
+        for (auto i = size_t{0}; i < n; i++) {
+            const auto a = std::abs(alpkt + xbar[i]);
+            // Blends instead of selecting, gcc would branch around the
+            // division and that keeps the loop from vectorizing.
+            const auto w = float(std::abs(xbar[i]) < 0.001f);
+            const auto x = w + (1.0f - w) * xbar[i];
+            const auto ea = 1.0f + poly_exp(-beta * a);
+            const auto mean = 0.5f + (0.5f * beta * (a - b)
+                + poly_log(ea / eb)) / (beta * x);
+            out[i] = w * pi + (1.0f - w) * mean;
+        }
+    }
+
+    double exact_sigmoid(const double x) {
+        return 1.0 / (1.0 + std::exp(-x));
+    }
+
+    double exact_log_sigmoid(const double x) {
+        return std::min(x, 0.0) - std::log1p(std::exp(-std::abs(x)));
+    }
+
+    // The mean of sigmoid(beta * (alpkt + t)) for t from 0 to xbar.
+    double exact_mean_sigmoid(const double alpkt, const double beta,
+                              const double xbar) {
+        if (std::abs(xbar) < 0.001) {
+            return exact_sigmoid(beta * alpkt);
+        }
+        const auto softplus = [](const double x) {
+            return std::max(x, 0.0) + std::log1p(std::exp(-std::abs(x)));
+        };
+        return (softplus(beta * (alpkt + xbar)) - softplus(beta * alpkt))
+            / (beta * xbar);
+    }
+
+    // The alpkt, beta and bonuses of the nodes of a search, the bonuses
+    // of one node at a time in a row of ROW.
+    constexpr auto COUNT = size_t{4096};
+    constexpr auto ROW = size_t{16};
+
+    struct Inputs {
+        std::vector<float> alpkt;
+        std::vector<float> beta;
+        std::vector<float> xbar;
+    };
+
+    const Inputs& inputs() {
+        static const auto in = [] {
+            auto rng = Random{1};
+            auto uniform = [&rng](const float lo, const float hi) {
+                return lo + (hi - lo) * rng.randuint64(1 << 20) / (1 << 20);
+            };
+            auto result = Inputs{};
+            for (auto i = size_t{0}; i < COUNT; i++) {
+                result.alpkt.emplace_back(uniform(-30.0f, 30.0f));
+                result.beta.emplace_back(uniform(0.02f, 2.0f));
+                // Some of them at no bonus.
+                result.xbar.emplace_back(i % 8 == 0
+                                         ? 0.0f : uniform(-20.0f, 20.0f));
+            }
+            return result;
+        }();
+        return in;
+    }
+}
+
+static void BM_EvalMathSigmoid(benchmark::State& state) {
+    const auto& in = inputs();
+    const auto poly = state.range(0) != 0;
+    auto out = std::vector<float>(COUNT);
+    const auto run = [&] {
+        for (auto i = size_t{0}; i < COUNT; i++) {
+            out[i] = poly
+                ? poly_sigmoid(in.beta[i] * (in.alpkt[i] + in.xbar[i]))
+                : sigmoid(in.alpkt[i], in.beta[i], in.xbar[i]);
+        }
+    };
+    for (auto _ : state) {
+        run();
+        benchmark::DoNotOptimize(out.data());
+    }
+    auto max_error = 0.0;
+    for (auto i = size_t{0}; i < COUNT; i++) {
+        const auto exact = exact_sigmoid(
+            double(in.beta[i]) * (double(in.alpkt[i]) + in.xbar[i]));
+        max_error = std::max(max_error, std::abs(out[i] - exact));
+    }
+    state.counters["max_error"] = max_error;
+    state.SetItemsProcessed(state.iterations() * COUNT);
+}
+BENCHMARK(BM_EvalMathSigmoid)->Arg(0)->Arg(1);
+
+static void BM_EvalMathLogSigmoid(benchmark::State& state) {
+    const auto& in = inputs();
+    const auto poly = state.range(0) != 0;
+    auto out = std::vector<float>(COUNT);
+    const auto run = [&] {
+        for (auto i = size_t{0}; i < COUNT; i++) {
+            out[i] = poly
+                ? poly_log_sigmoid(in.beta[i] * in.alpkt[i])
+                : std::log(sigmoid(in.alpkt[i], in.beta[i], 0.0f));
+        }
+    };
+    for (auto _ : state) {
+        run();
+        benchmark::DoNotOptimize(out.data());
+    }
+    // Where the float sigmoid is 0 the std:: log is -inf, only count
+    // the error of the points both can give.
+    auto max_error = 0.0;
+    for (auto i = size_t{0}; i < COUNT; i++) {
+        const auto exact = exact_log_sigmoid(
+            double(in.beta[i]) * in.alpkt[i]);
+        if (std::isfinite(out[i]) && exact > -80.0) {
+            max_error = std::max(max_error, std::abs(out[i] - exact));
+        }
+    }
+    state.counters["max_error"] = max_error;
+    state.SetItemsProcessed(state.iterations() * COUNT);
+}
+BENCHMARK(BM_EvalMathLogSigmoid)->Arg(0)->Arg(1);
+
+// The integral formula of SearchResult::eval_with_bonus, one bonus at a
+// time, or ROW of them for each alpkt and beta with the polynomials.
+static void BM_EvalMathEvalWithBonus(benchmark::State& state) {
+    const auto& in = inputs();
+    const auto poly = state.range(0) != 0;
+    auto out = std::vector<float>(COUNT);
+    const auto run = [&] {
+        for (auto row = size_t{0}; row < COUNT; row += ROW) {
+            if (poly) {
+                poly_mean_sigmoid(in.alpkt[row], in.beta[row],
+                                  &in.xbar[row], &out[row], ROW);
+                continue;
+            }
+            auto result = SearchResult::from_eval(0.5f, in.alpkt[row],
+                                                  in.beta[row]);
+            for (auto i = row; i < row + ROW; i++) {
+                out[i] = result.eval_with_bonus(in.xbar[i]);
+            }
+        }
+    };
+    for (auto _ : state) {
+        run();
+        benchmark::DoNotOptimize(out.data());
+    }
+    auto max_error = 0.0;
+    for (auto row = size_t{0}; row < COUNT; row += ROW) {
+        for (auto i = row; i < row + ROW; i++) {
+            const auto exact = exact_mean_sigmoid(in.alpkt[row],
+                                                  in.beta[row], in.xbar[i]);
+            max_error = std::max(max_error, std::abs(out[i] - exact));
+        }
+    }
+    state.counters["max_error"] = max_error;
+    state.SetItemsProcessed(state.iterations() * COUNT);
+}
+BENCHMARK(BM_EvalMathEvalWithBonus)->Arg(0)->Arg(1);
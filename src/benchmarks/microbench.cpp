@@ -0,0 +1,405 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Microbenchmarks of the hot paths of the search, with Google Benchmark.
+// The board, tree and cache benchmarks run without a network. The
+// network ones need the weights, for this board size, after the
+// benchmark options:
+//
+//     ./microbench --benchmark_filter=Winograd
+//     ./microbench -w best-network
+#include <benchmark/benchmark.h>
+
+#include "config.h"
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "FastBoard.h"
+#include "FastState.h"
+#include "GTP.h"
+#include "GameState.h"
+#include "KoState.h"
+#include "NNCache.h"
+#include "Network.h"
+#include "Random.h"
+#include "UCTNode.h"
+#include "Zobrist.h"
+
+namespace {
+    bool network_loaded = false;
+
+    // The moves of a random game from the empty board, without suicides
+    // or filling own eyes. It ends with two passes.
+    std::vector<int> random_game(const std::uint64_t seed) {
+        auto rng = Random{seed};
+        auto state = FastState{};
+        state.init_game(BOARD_SIZE, cfg_komi);
+        auto moves = std::vector<int>();
+        while (state.get_passes() < 2 && moves.size() < 4 * BOARD_SQUARES) {
+            auto move = int{FastBoard::PASS};
+            for (auto tries = 0; tries < 4 * BOARD_SQUARES; tries++) {
+                const auto i = static_cast<int>(rng.randuint64(BOARD_SQUARES));
+                const auto vertex = state.board.get_vertex(i % BOARD_SIZE,
+                                                           i / BOARD_SIZE);
+                const auto color = state.get_to_move();
+                if (state.board.get_square(vertex) == FastBoard::EMPTY
+                    && !state.board.is_eye(color, vertex)
+                    && state.is_move_legal(color, vertex)) {
+                    move = vertex;
+                    break;
+                }
+            }
+            state.play_move(move);
+            moves.emplace_back(move);
+        }
+        return moves;
+    }
+
+    // Positions every few moves along a few random games.
+    std::vector<GameState> random_positions() {
+        auto positions = std::vector<GameState>();
+        for (auto seed = 1; seed <= 4; seed++) {
+            auto state = GameState{};
+            state.init_game(BOARD_SIZE, cfg_komi);
+            auto movenum = 0;
+            for (const auto move : random_game(seed)) {
+                state.play_move(move);
+                if (++movenum % 8 == 0) {
+                    positions.emplace_back(state);
+                }
+            }
+        }
+        return positions;
+    }
+
+    // Random priors over the legal moves, as the network would give.
+    Network::Netresult random_netresult(Random& rng) {
+        auto result = Network::Netresult{};
+        auto sum = 0.0f;
+        for (auto& p : result.policy) {
+            p = 1.0f + rng.randuint64(100);
+            sum += p;
+        }
+        result.policy_pass = 1.0f;
+        sum += result.policy_pass;
+        for (auto& p : result.policy) {
+            p /= sum;
+        }
+        result.policy_pass /= sum;
+        result.value = 0.5f;
+        result.beta = 1.0f;
+        return result;
+    }
+}
+
+static void BM_FastStatePlayMove(benchmark::State& state) {
+    const auto moves = random_game(1);
+    auto start = FastState{};
+    start.init_game(BOARD_SIZE, cfg_komi);
+    for (auto _ : state) {
+        auto game = start;
+        for (const auto move : moves) {
+            game.play_move(move);
+        }
+        benchmark::DoNotOptimize(game.board.get_hash());
+    }
+    state.SetItemsProcessed(state.iterations() * moves.size());
+}
+BENCHMARK(BM_FastStatePlayMove);
+
+// The superko check happens in KoState::play_move, superko() only
+// returns its result.
+static void BM_KoStatePlayMove(benchmark::State& state) {
+    const auto moves = random_game(1);
+    auto start = KoState{};
+    start.init_game(BOARD_SIZE, cfg_komi);
+    for (auto _ : state) {
+        auto game = start;
+        auto superkos = 0;
+        for (const auto move : moves) {
+            game.play_move(move);
+            superkos += game.superko();
+        }
+        benchmark::DoNotOptimize(superkos);
+    }
+    state.SetItemsProcessed(state.iterations() * moves.size());
+}
+BENCHMARK(BM_KoStatePlayMove);
+
+static void BM_AreaScore(benchmark::State& state) {
+    const auto positions = random_positions();
+    for (auto _ : state) {
+        for (const auto& position : positions) {
+            benchmark::DoNotOptimize(position.board.area_score(cfg_komi));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * positions.size());
+}
+BENCHMARK(BM_AreaScore);
+
+// The legal moves of the positions one point at a time, as the
+// expansions did, with 0, or at once with 1.
+static void BM_LegalMoves(benchmark::State& state) {
+    auto positions = random_positions();
+    const auto bulk = state.range(0) != 0;
+    for (auto _ : state) {
+        for (auto& position : positions) {
+            const auto color = position.get_to_move();
+            auto count = size_t{0};
+            if (bulk) {
+                count = position.get_legal_moves(color).count();
+            } else {
+                for (auto i = 0; i < BOARD_SQUARES; i++) {
+                    const auto vertex = position.board.get_vertex(
+                        i % BOARD_SIZE, i / BOARD_SIZE);
+                    count += position.is_move_legal(color, vertex);
+                }
+            }
+            benchmark::DoNotOptimize(count);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * positions.size());
+}
+BENCHMARK(BM_LegalMoves)->Arg(0)->Arg(1);
+
+static void BM_GatherFeatures(benchmark::State& state) {
+    if (!network_loaded) {
+        // The symmetry tables are set up with the network.
+        state.SkipWithError("needs -w weights");
+        return;
+    }
+    const auto positions = random_positions();
+    auto input = std::vector<net_t>(Network::INPUT_CHANNELS * BOARD_SQUARES);
+    auto symmetry = 0;
+    for (auto _ : state) {
+        for (const auto& position : positions) {
+            Network::gather_features(&position, symmetry, input.data());
+            symmetry = (symmetry + 1) % Network::NUM_SYMMETRIES;
+        }
+        benchmark::DoNotOptimize(input.data());
+    }
+    state.SetItemsProcessed(state.iterations() * positions.size());
+}
+BENCHMARK(BM_GatherFeatures);
+
+// The root of the empty board, after range(0) playouts that each went to
+// the child uct_select_child picked.
+static void BM_UCTSelectChild(benchmark::State& state) {
+    auto rng = Random{1};
+    auto game = GameState{};
+    game.init_game(BOARD_SIZE, cfg_komi);
+    std::atomic<int> nodecount{0};
+    UCTNode root(FastBoard::PASS, 0.0f);
+    auto value = 0.0f, alpkt = 0.0f, beta = 0.0f;
+    root.start_expansion(game);
+    root.expand(nodecount, game, random_netresult(rng), value, alpkt, beta);
+
+    const auto color = game.get_to_move();
+    for (auto i = 0; i < state.range(0); i++) {
+        const auto child = root.uct_select_child(color, true);
+        child->update(rng.randuint64(1000) / 1000.0f);
+        root.update(0.5f);
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(root.uct_select_child(color, true));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_UCTSelectChild)->Arg(0)->Arg(100)->Arg(10000);
+
+// Threads looking up positions, and inserting the ones that are missing,
+// in a cache that holds about half of them.
+static void BM_NNCache(benchmark::State& state) {
+    constexpr auto POSITIONS = 1 << 16;
+    auto& cache = NNCache::get_NNCache();
+    if (state.thread_index() == 0) {
+        cache.resize(POSITIONS / 2);
+    }
+    auto rng = Random{std::uint64_t(state.thread_index()) + 1};
+    const auto netresult = random_netresult(rng);
+    auto result = Network::Netresult{};
+    for (auto _ : state) {
+        // Zobrist hashes are uniform over all the bits.
+        const auto hash = rng.randuint64(POSITIONS) * 0x9E3779B97F4A7C15ULL;
+        if (!cache.lookup(hash, result)) {
+            cache.insert(hash, netresult);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_NNCache)->ThreadRange(1, 8)->UseRealTime();
+
+// Reaches the private Winograd transforms. With range(2) set they run
+// the versions get_winograd_kernels() picks for the channels, else the
+// generic ones.
+class NetworkBenchmark {
+public:
+    static WinogradKernels kernels(const benchmark::State& state) {
+        const auto channels = static_cast<int>(state.range(0));
+        if (state.range(2)) {
+            return Network::get_winograd_kernels(channels);
+        }
+        return {Network::winograd_transform_in,
+                Network::winograd_transform_out};
+    }
+
+    static void transform_in(benchmark::State& state) {
+        constexpr auto WTILES = (BOARD_SIZE + 1) / 2;
+        const auto channels = static_cast<int>(state.range(0));
+        const auto batch_size = static_cast<int>(state.range(1));
+        const auto transform = kernels(state).transform_in;
+        auto rng = Random{1};
+        auto in = std::vector<float>(batch_size * BOARD_SQUARES * channels);
+        for (auto& x : in) {
+            x = rng.randuint64(1000) / 1000.0f;
+        }
+        auto V = std::vector<float>(Network::WINOGRAD_TILE * batch_size
+                                    * WTILES * WTILES * channels);
+        for (auto _ : state) {
+            transform(in, V, channels, batch_size);
+            benchmark::DoNotOptimize(V.data());
+        }
+        state.SetItemsProcessed(state.iterations() * batch_size);
+    }
+
+    static void transform_out(benchmark::State& state) {
+        constexpr auto WTILES = (BOARD_SIZE + 1) / 2;
+        const auto channels = static_cast<int>(state.range(0));
+        const auto batch_size = static_cast<int>(state.range(1));
+        const auto transform = kernels(state).transform_out;
+        auto rng = Random{1};
+        auto M = std::vector<float>(Network::WINOGRAD_TILE * batch_size
+                                    * WTILES * WTILES * channels);
+        for (auto& x : M) {
+            x = rng.randuint64(1000) / 1000.0f - 0.5f;
+        }
+        const auto means = std::vector<float>(channels, 0.1f);
+        const auto stddivs = std::vector<float>(channels, 0.9f);
+        const auto eltwise =
+            std::vector<float>(batch_size * BOARD_SQUARES * channels, 0.1f);
+        auto Y = std::vector<float>(batch_size * BOARD_SQUARES * channels);
+        for (auto _ : state) {
+            transform(M, Y, channels, means.data(), stddivs.data(),
+                      eltwise.data(), batch_size);
+            benchmark::DoNotOptimize(Y.data());
+        }
+        state.SetItemsProcessed(state.iterations() * batch_size);
+    }
+
+    // A whole 3x3 convolution of range(0) channels with Winograd, or
+    // with im2col if range(2) is set.
+    static void convolve3(benchmark::State& state) {
+        constexpr auto WTILES = (BOARD_SIZE + 1) / 2;
+        const auto channels = static_cast<int>(state.range(0));
+        const auto batch_size = static_cast<int>(state.range(1));
+        const auto kernels = Network::get_winograd_kernels(channels);
+        auto rng = Random{1};
+        auto f = std::vector<float>(9 * channels * channels);
+        for (auto& x : f) {
+            x = rng.randuint64(1000) / 1000.0f - 0.5f;
+        }
+        const auto U = Network::winograd_transform_f(f, channels, channels);
+        const auto weights = Network::im2col_weights_f(U, channels, channels);
+        auto in = std::vector<float>(batch_size * BOARD_SQUARES * channels);
+        for (auto& x : in) {
+            x = rng.randuint64(1000) / 1000.0f;
+        }
+        const auto means = std::vector<float>(channels, 0.1f);
+        const auto stddivs = std::vector<float>(channels, 0.9f);
+        const auto tiles = batch_size * WTILES * WTILES * channels;
+        auto V = std::vector<float>(Network::WINOGRAD_TILE * tiles);
+        auto M = std::vector<float>(Network::WINOGRAD_TILE * tiles);
+        auto col = std::vector<float>();
+        auto out = std::vector<float>(batch_size * BOARD_SQUARES * channels);
+        for (auto _ : state) {
+            if (state.range(2)) {
+                Network::im2col_convolve3(channels, in, weights, col, out,
+                                          means.data(), stddivs.data(),
+                                          nullptr, batch_size);
+            } else {
+                Network::winograd_convolve3(kernels, channels, in, U, V, M,
+                                            out, means.data(),
+                                            stddivs.data(), nullptr,
+                                            batch_size);
+            }
+            benchmark::DoNotOptimize(out.data());
+        }
+        state.SetItemsProcessed(state.iterations() * batch_size);
+    }
+};
+BENCHMARK(NetworkBenchmark::transform_in)
+    ->Name("BM_WinogradTransformIn")
+    ->ArgsProduct({{32, 128, 256}, {1, 8}, {0, 1}});
+BENCHMARK(NetworkBenchmark::transform_out)
+    ->Name("BM_WinogradTransformOut")
+    ->ArgsProduct({{32, 128, 256}, {1, 8}, {0, 1}});
+BENCHMARK(NetworkBenchmark::convolve3)
+    ->Name("BM_Convolve3")
+    ->ArgsProduct({{32, 128, 256}, {1, 8}, {0, 1}});
+
+// The whole network on range(0) positions, with forward_cpu in the CPU
+// builds and the OpenCL or CUDA backend in the others.
+static void BM_Forward(benchmark::State& state) {
+    if (!network_loaded) {
+        state.SkipWithError("needs -w weights");
+        return;
+    }
+    const auto positions = random_positions();
+    auto batch = std::vector<const GameState*>();
+    for (auto i = 0; i < state.range(0); i++) {
+        batch.emplace_back(&positions[i % positions.size()]);
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Network::get_scored_moves_direct(batch, 0));
+    }
+    state.SetItemsProcessed(state.iterations() * batch.size());
+}
+BENCHMARK(BM_Forward)->Arg(1)->Arg(8)->UseRealTime();
+
+int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+
+    GTP::setup_default_parameters();
+    cfg_quiet = true;
+    for (auto i = 1; i < argc; i++) {
+        const auto arg = std::string{argv[i]};
+        if ((arg == "-w" || arg == "--weights") && i + 1 < argc) {
+            cfg_weightsfile = argv[++i];
+            cfg_weightsfiles = {cfg_weightsfile};
+        } else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto rng = std::make_unique<Random>(5489);
+    Zobrist::init_zobrist(*rng);
+    Random::get_Rng().seedrandom(cfg_rng_seed);
+    network_loaded = !cfg_weightsfiles.empty();
+    if (network_loaded) {
+        Network::initialize();
+    }
+
+    benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}
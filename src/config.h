@@ -73,9 +73,19 @@
  * faster if you have a recent GPU. Don't use it on CPUs even if they have
  * OpenCL drivers - the BLAS version is much faster for those.
  */
-#ifndef USE_CPU_ONLY
+#if !defined(USE_CPU_ONLY) && !defined(USE_CUDA)
 #define USE_OPENCL
 #endif
+/*
+ * USE_CUDA: Run the network on NVIDIA GPUs with cuBLAS instead of OpenCL.
+ * Needs the CUDA toolkit 11 or later, define it from the build
+ * (cmake -DUSE_CUDA=1 or make USE_CUDA=1) rather than here.
+ */
+/*
+ * USE_PROFILING: Time the phases of the playouts, for lz-profile, see
+ * Profile.h. The timers slow the search down a little.
+ */
+//#define USE_PROFILING
 /*
  * USE_TUNER: Expose some extra command line parameters that allow tuning the
  * search algorithm.
@@ -95,14 +105,14 @@
 #define MAX_CPUS 128
 #endif
 
-#ifdef USE_HALF
-#include "half/half.hpp"
-using net_t = half_float::half;
-#else
+/*
+ * The host always stores the network inputs as floats. Whether the OpenCL
+ * device works in half precision is chosen at runtime, see --precision.
+ * USE_HALF only changes the default from auto to half.
+ */
 using net_t = float;
-#endif
 
-#if defined(USE_BLAS) && defined(USE_OPENCL) && !defined(USE_HALF)
+#if defined(USE_BLAS) && defined(USE_OPENCL)
 // If both BLAS and OpenCL are fully usable, then check the OpenCL
 // results against BLAS with some probability.
 #define USE_OPENCL_SELFCHECK
@@ -0,0 +1,111 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+
+#include "config.h"
+
+#include <string>
+#include <vector>
+
+#include "EndgameSolver.h"
+#include "FastBoard.h"
+#include "GTP.h"
+#include "GameState.h"
+
+namespace {
+    // The rows from the top of the board down, X for black and O for
+    // white.
+    using Rows = std::vector<std::string>;
+
+    // Black has the four columns on the left and white the three on the
+    // right, with the last dame at D4.
+    const Rows LAST_DAME = {"XXXXOOO",
+                            ".XXXOO.",
+                            "XXXXOOO",
+                            "XXX.OOO",
+                            "XXXXOOO",
+                            ".XXXOO.",
+                            "XXXXOOO"};
+
+    // The same areas with nothing but single eyes left.
+    const Rows ONLY_EYES = {".X.XOO.",
+                            "XXXXOOO",
+                            ".X.XOO.",
+                            "XXXXOOO",
+                            ".X.XOO.",
+                            "XXXXOOO",
+                            ".X.XOO."};
+
+    GameState setup(const Rows& rows, const float komi, const int to_move) {
+        GTP::setup_default_parameters();
+        auto state = GameState();
+        state.init_game(BOARD_SIZE, komi);
+        for (auto y = 0; y < BOARD_SIZE; y++) {
+            const auto& row = rows[BOARD_SIZE - 1 - y];
+            for (auto x = 0; x < BOARD_SIZE; x++) {
+                if (row[x] == '.') {
+                    continue;
+                }
+                const auto color = (row[x] == 'X') ? FastBoard::BLACK
+                                                   : FastBoard::WHITE;
+                state.play_move(color, state.board.get_vertex(x, y));
+            }
+        }
+        state.set_to_move(to_move);
+        return state;
+    }
+}
+
+TEST(EndgameSolverTest, SideToMoveTakesTheLastDame) {
+    // 28 points to 21 for black, or 27 to 22 for white. Filling the
+    // eyes in every order would take more than MAX_NODES positions,
+    // the moves into them are left out.
+    auto score = 0.0f;
+    ASSERT_TRUE(EndgameSolver::solve(
+        setup(LAST_DAME, 6.0f, FastBoard::BLACK), score));
+    EXPECT_EQ(score, 1.0f);
+    ASSERT_TRUE(EndgameSolver::solve(
+        setup(LAST_DAME, 6.0f, FastBoard::WHITE), score));
+    EXPECT_EQ(score, -1.0f);
+}
+
+TEST(EndgameSolverTest, ScoresTheEyes) {
+    // The 12 eyes are the only empty points, so only the passes are
+    // searched and the eyes count as the area of their side.
+    const auto state = setup(ONLY_EYES, 7.5f, FastBoard::BLACK);
+    ASSERT_EQ(state.board.get_empty_count(), 12);
+    auto score = 0.0f;
+    ASSERT_TRUE(EndgameSolver::solve(state, score));
+    EXPECT_EQ(score, -0.5f);
+    ASSERT_TRUE(EndgameSolver::solve(
+        setup(ONLY_EYES, 6.5f, FastBoard::WHITE), score));
+    EXPECT_EQ(score, 0.5f);
+}
+
+TEST(EndgameSolverTest, ForgetsThePreviousEndgame) {
+    // The komi is not in the hash, the bounds of the first solve must
+    // not carry over to the second one.
+    auto score = 0.0f;
+    ASSERT_TRUE(EndgameSolver::solve(
+        setup(LAST_DAME, 6.0f, FastBoard::BLACK), score));
+    EXPECT_EQ(score, 1.0f);
+    ASSERT_TRUE(EndgameSolver::solve(
+        setup(LAST_DAME, 8.0f, FastBoard::BLACK), score));
+    EXPECT_EQ(score, -1.0f);
+}
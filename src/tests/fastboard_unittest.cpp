@@ -0,0 +1,143 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+
+#include "config.h"
+
+#include <random>
+#include <vector>
+
+#include "FastBoard.h"
+#include "FastState.h"
+#include "FullBoard.h"
+
+namespace {
+    // The stones of board from its squares.
+    FastBoard::stones_t scan_stones(const FastBoard& board) {
+        auto stones = FastBoard::stones_t{};
+        for (auto y = 0; y < BOARD_SIZE; y++) {
+            for (auto x = 0; x < BOARD_SIZE; x++) {
+                const auto color = board.get_square(x, y);
+                if (color == FastBoard::BLACK || color == FastBoard::WHITE) {
+                    stones[color].set(y * BOARD_SIZE + x);
+                }
+            }
+        }
+        return stones;
+    }
+
+    // Plays random games on a board of Size, and checks the playable
+    // points, the stones and the hashes after every move.
+    template <int Size>
+    void play_random_games() {
+        using Board = BasicFullBoard<Size>;
+        auto board = Board();
+        auto rng = std::mt19937{1234};
+        auto captures = 0;
+        for (auto game = 0; game < 10; game++) {
+            board.reset_board(Size);
+            for (auto move = 0; move < 2 * Size * Size; move++) {
+                const auto color = move % 2;
+                const auto playable = board.get_playable(color);
+                auto moves = std::vector<int>();
+                for (auto i = 0; i < board.get_empty_count(); i++) {
+                    const auto vertex = board.get_empty(i);
+                    if (!board.is_suicide(vertex, color)) {
+                        moves.push_back(vertex);
+                        const auto xy = board.get_xy(vertex);
+                        ASSERT_TRUE(playable[xy.second * Size + xy.first]);
+                    }
+                }
+                ASSERT_EQ(playable.count(), moves.size());
+                if (moves.empty()) {
+                    break;
+                }
+                const auto prisoners = board.get_prisoners(color);
+                board.update_board(color, moves[rng() % moves.size()]);
+                captures += board.get_prisoners(color) - prisoners;
+
+                auto stones = typename Board::stones_t{};
+                for (auto y = 0; y < Size; y++) {
+                    for (auto x = 0; x < Size; x++) {
+                        const auto square = board.get_square(x, y);
+                        if (square == FastBoard::BLACK
+                            || square == FastBoard::WHITE) {
+                            stones[square].set(y * Size + x);
+                        }
+                    }
+                }
+                ASSERT_EQ(board.get_stones(), stones);
+
+                auto fresh = board;
+                EXPECT_EQ(board.get_hash(), fresh.calc_hash());
+                EXPECT_EQ(board.get_ko_hash(), fresh.calc_ko_hash());
+                if (move == 0) {
+                    // The first stone has the whole board.
+                    EXPECT_EQ(board.area_score(0.0f), float(Size * Size));
+                }
+            }
+        }
+        // The random games took stones off the board.
+        EXPECT_GT(captures, 0);
+    }
+}
+
+TEST(FastBoardTest, StonesFollowCaptures) {
+    auto state = FastState();
+    state.init_game(BOARD_SIZE, 7.5f);
+    auto rng = std::mt19937{1234};
+    auto captures = 0;
+    for (auto game = 0; game < 20; game++) {
+        state.reset_game();
+        for (auto move = 0; move < 100; move++) {
+            const auto color = state.get_to_move();
+            auto moves = std::vector<int>();
+            for (auto i = 0; i < state.board.get_empty_count(); i++) {
+                const auto vertex = state.board.get_empty(i);
+                if (!state.board.is_suicide(vertex, color)) {
+                    moves.push_back(vertex);
+                }
+            }
+            if (moves.empty()) {
+                break;
+            }
+            const auto prisoners = state.board.get_prisoners(color);
+            state.play_move(moves[rng() % moves.size()]);
+            captures += state.board.get_prisoners(color) - prisoners;
+
+            const auto stones = scan_stones(state.board);
+            ASSERT_EQ(state.board.get_stones()[FastBoard::BLACK],
+                      stones[FastBoard::BLACK]);
+            ASSERT_EQ(state.board.get_stones()[FastBoard::WHITE],
+                      stones[FastBoard::WHITE]);
+            EXPECT_EQ(state.board.calc_is_color(FastBoard::BLACK),
+                      int(stones[FastBoard::BLACK].count()));
+            EXPECT_EQ(state.board.calc_is_color(FastBoard::WHITE),
+                      int(stones[FastBoard::WHITE].count()));
+        }
+    }
+    // The random games took stones off the board.
+    EXPECT_GT(captures, 0);
+}
+
+TEST(FastBoardTest, RandomGamesOnTheBoardSizes) {
+    play_random_games<7>();
+    play_random_games<9>();
+    play_random_games<19>();
+}
@@ -0,0 +1,84 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+
+#include "config.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "ForwardQueue.h"
+
+namespace {
+    // Evaluates one position on queue, true if it was given an output.
+    bool evaluate(ForwardQueue<float>& queue) {
+        auto input = std::vector<float>(4, 1.0f);
+        auto pol = std::vector<float>(2), val = std::vector<float>(1),
+             vbe = std::vector<float>(1);
+        try {
+            queue.forward(input, pol, val, vbe);
+        } catch (const std::runtime_error&) {
+            return false;
+        }
+        return true;
+    }
+}
+
+TEST(ForwardQueueTest, ShutdownFailsTheQueuedEvaluations) {
+    // No worker, the evaluations wait in the queue until the shutdown.
+    ForwardQueue<float> queue;
+    auto results = std::vector<int>(4, -1);
+    auto threads = std::vector<std::thread>();
+    for (auto& result : results) {
+        threads.emplace_back([&queue, &result] {
+            result = evaluate(queue);
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    queue.shutdown();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(results, std::vector<int>(4, 0));
+
+    // And the ones after it fail at once.
+    EXPECT_FALSE(evaluate(queue));
+}
+
+TEST(ForwardQueueTest, WorkerRunsTheBatches) {
+    ForwardQueue<float> queue;
+    auto worker = std::thread([&queue] {
+        queue.run_worker(
+            8, std::chrono::microseconds(100),
+            [](const std::vector<float>& input, std::vector<float>& pol,
+               std::vector<float>& val, std::vector<float>& vbe,
+               const int batch_size) {
+                EXPECT_EQ(input.size(), size_t(4 * batch_size));
+                std::fill(begin(pol), end(pol), 0.5f);
+                std::fill(begin(val), end(val), 0.25f);
+                std::fill(begin(vbe), end(vbe), 0.0f);
+            });
+    });
+    EXPECT_TRUE(evaluate(queue));
+    queue.shutdown();
+    worker.join();
+}
@@ -72,6 +72,7 @@ public:
         NNCache::get_NNCache().set_size_from_playouts(cfg_max_playouts);
 
         cfg_weightsfile = "../src/tests/0k.txt";
+        cfg_weightsfiles = {cfg_weightsfile};
         Network::initialize();
     }
     void TearDown() {}
@@ -88,7 +89,7 @@ public:
         cfg_gtp_mode = true;
 
         m_gamestate = std::make_unique<GameState>();
-        m_gamestate->init_game(19, 7.5f);
+        m_gamestate->init_game(BOARD_SIZE, 7.5f);
     }
 
     GameState& get_gamestate() {
@@ -115,26 +116,26 @@ TEST_F(LeelaTest, DefaultHash) {
     auto hash = maingame.board.get_hash();
     auto ko_hash = maingame.board.get_ko_hash();
 
-    EXPECT_EQ(hash, 0x9A930BE1616C538E);
-    EXPECT_EQ(ko_hash, 0xA14C933E7669946D);
+    EXPECT_EQ(hash, 0xD545E1C6B7E6C086);
+    EXPECT_EQ(ko_hash, 0xFDD3098DDC174493);
 }
 
 TEST_F(LeelaTest, Transposition) {
     auto maingame = get_gamestate();
 
     testing::internal::CaptureStdout();
-    GTP::execute(maingame, "play b Q16");
-    GTP::execute(maingame, "play w D16");
-    GTP::execute(maingame, "play b D4");
+    GTP::execute(maingame, "play b F6");
+    GTP::execute(maingame, "play w B6");
+    GTP::execute(maingame, "play b B2");
 
     auto hash = maingame.board.get_hash();
     auto ko_hash = maingame.board.get_ko_hash();
 
     GTP::execute(maingame, "clear_board");
 
-    GTP::execute(maingame, "play b D4");
-    GTP::execute(maingame, "play w D16");
-    GTP::execute(maingame, "play b Q16");
+    GTP::execute(maingame, "play b B2");
+    GTP::execute(maingame, "play w B6");
+    GTP::execute(maingame, "play b F6");
     std::string output = testing::internal::GetCapturedStdout();
 
     EXPECT_EQ(hash, maingame.board.get_hash());
@@ -197,8 +198,8 @@ TEST_F(LeelaTest, MoveOnOccupiedSq) {
 
     {
         testing::internal::CaptureStdout();
-        GTP::execute(maingame, "play w Q16");
-        GTP::execute(maingame, "play b Q16");
+        GTP::execute(maingame, "play w F6");
+        GTP::execute(maingame, "play b F6");
         output = testing::internal::GetCapturedStdout();
     }
 
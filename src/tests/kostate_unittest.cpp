@@ -0,0 +1,116 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+
+#include "config.h"
+
+#include <utility>
+#include <vector>
+
+#include "FastBoard.h"
+#include "KoState.h"
+
+namespace {
+    using Stones = std::vector<std::pair<int, int>>;
+
+    void place(KoState& state, const int color, const Stones& stones) {
+        for (const auto& xy : stones) {
+            state.play_move(color, state.board.get_vertex(xy.first,
+                                                          xy.second));
+        }
+    }
+
+    // Three kos. Black can take the ones at B1-C1 and F1-E1, white the
+    // one at B7-C7.
+    void setup_triple_ko(KoState& state) {
+        state.init_game(BOARD_SIZE, 7.5f);
+        place(state, FastBoard::BLACK, {{0, 0}, {0, 1}, {1, 1},
+                                        {0, 6}, {0, 5}, {1, 5}, {2, 6},
+                                        {6, 0}, {6, 1}, {5, 1}});
+        place(state, FastBoard::WHITE, {{1, 0}, {2, 1}, {3, 0}, {3, 1},
+                                        {4, 1}, {5, 0},
+                                        {2, 5}, {3, 5}, {3, 6}});
+        state.board.set_to_move(FastBoard::BLACK);
+    }
+
+    // Every move takes a ko, the sixth one brings back the position
+    // of the start.
+    const Stones TRIPLE_KO_CYCLE = {{2, 0}, {1, 6}, {4, 0},
+                                    {1, 0}, {2, 6}, {5, 0}};
+
+    int vertex(const KoState& state, const std::pair<int, int>& xy) {
+        return state.board.get_vertex(xy.first, xy.second);
+    }
+}
+
+TEST(KoStateTest, TripleKoCycleIsSuperko) {
+    auto state = KoState();
+    setup_triple_ko(state);
+    const auto start = state.board.get_ko_hash();
+    for (auto i = size_t{0}; i < TRIPLE_KO_CYCLE.size(); i++) {
+        const auto prisoners = state.board.get_prisoners(FastBoard::BLACK)
+            + state.board.get_prisoners(FastBoard::WHITE);
+        state.play_move(vertex(state, TRIPLE_KO_CYCLE[i]));
+        // Each one captures a stone.
+        EXPECT_EQ(state.board.get_prisoners(FastBoard::BLACK)
+                  + state.board.get_prisoners(FastBoard::WHITE),
+                  prisoners + 1);
+        // The recaptures of the fourth to sixth move are legal until
+        // the whole position repeats.
+        const auto last = (i + 1 == TRIPLE_KO_CYCLE.size());
+        EXPECT_EQ(state.superko(), last) << "move " << i + 1;
+    }
+    EXPECT_EQ(state.board.get_ko_hash(), start);
+}
+
+TEST(KoStateTest, StartFromSeesTheParent) {
+    auto root = KoState();
+    setup_triple_ko(root);
+    for (auto i = 0; i < 3; i++) {
+        root.play_move(vertex(root, TRIPLE_KO_CYCLE[i]));
+    }
+
+    auto playout = KoState();
+    playout.start_from(root);
+    EXPECT_FALSE(playout.superko());
+    for (auto i = size_t{3}; i < TRIPLE_KO_CYCLE.size(); i++) {
+        playout.play_move(vertex(playout, TRIPLE_KO_CYCLE[i]));
+        const auto last = (i + 1 == TRIPLE_KO_CYCLE.size());
+        EXPECT_EQ(playout.superko(), last) << "move " << i + 1;
+    }
+}
+
+TEST(KoStateTest, StartFromForgetsEarlierPlayouts) {
+    auto root = KoState();
+    setup_triple_ko(root);
+    root.board.set_to_move(FastBoard::WHITE);
+
+    // The playout state is reused for every playout, like in the
+    // search. The second playout ends in the position of the first
+    // one, which must not count.
+    auto playout = KoState();
+    for (const auto& moves : {Stones{{3, 3}, {1, 3}, {5, 3}},
+                              Stones{{5, 3}, {1, 3}, {3, 3}}}) {
+        playout.start_from(root);
+        for (const auto& xy : moves) {
+            playout.play_move(vertex(playout, xy));
+            EXPECT_FALSE(playout.superko());
+        }
+    }
+}
@@ -0,0 +1,184 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+
+#include "config.h"
+
+#include <cstdint>
+
+#include "GTP.h"
+#include "NNCache.h"
+#include "Network.h"
+
+namespace {
+    constexpr auto SHARD_SHIFT = 58;
+
+    // Hashes with the same top bits go to the same shard.
+    std::uint64_t shard_hash(const std::uint64_t shard,
+                             const std::uint64_t index) {
+        return (shard << SHARD_SHIFT) | (index + 1);
+    }
+
+    Network::Netresult make_result(const float value) {
+        auto result = Network::Netresult{};
+        for (auto i = 0; i < BOARD_SQUARES; i++) {
+            result.policy[i] = 1.0f / (i + 2);
+        }
+        result.policy_pass = 0.125f;
+        result.value = value;
+        result.alpha = 3.25f;
+        result.beta = 0.0625f;
+        return result;
+    }
+
+    class NNCacheTest : public ::testing::Test {
+    protected:
+        NNCacheTest() : m_cache(NNCache::get_NNCache()) {
+            m_eviction = cfg_cache_eviction;
+            m_capacity = m_cache.get_capacity();
+            m_cache.clear();
+        }
+        ~NNCacheTest() {
+            cfg_cache_eviction = m_eviction;
+            m_cache.clear();
+            m_cache.resize(static_cast<int>(m_capacity));
+        }
+
+        bool has(const std::uint64_t hash) {
+            return m_cache.contains(hash);
+        }
+
+        NNCache& m_cache;
+
+    private:
+        CacheEviction::eviction_t m_eviction;
+        size_t m_capacity;
+    };
+}
+
+TEST_F(NNCacheTest, HitAndMiss) {
+    m_cache.resize(1000);
+    m_cache.insert(shard_hash(3, 0), make_result(0.75f));
+
+    auto result = Network::Netresult{};
+    const auto before = m_cache.hit_rate();
+    EXPECT_TRUE(m_cache.lookup(shard_hash(3, 0), result));
+    EXPECT_EQ(result.value, 0.75f);
+    EXPECT_FALSE(m_cache.lookup(shard_hash(3, 1), result));
+    EXPECT_FALSE(m_cache.lookup(shard_hash(4, 0), result));
+    const auto after = m_cache.hit_rate();
+    EXPECT_EQ(after.first - before.first, 1u);
+    EXPECT_EQ(after.second - before.second, 3u);
+
+    m_cache.clear();
+    EXPECT_FALSE(m_cache.lookup(shard_hash(3, 0), result));
+}
+
+TEST_F(NNCacheTest, ShardsEvictOnTheirOwn) {
+    cfg_cache_eviction = CacheEviction::FIFO;
+    // Two entries per shard.
+    m_cache.resize(128);
+    EXPECT_EQ(m_cache.get_capacity(), 128u);
+
+    m_cache.insert(shard_hash(1, 0), make_result(0.1f));
+    m_cache.insert(shard_hash(2, 0), make_result(0.2f));
+    m_cache.insert(shard_hash(1, 1), make_result(0.3f));
+    m_cache.insert(shard_hash(1, 2), make_result(0.4f));
+
+    // The oldest entry of the full shard went, the other shard
+    // wasn't touched.
+    EXPECT_FALSE(has(shard_hash(1, 0)));
+    EXPECT_TRUE(has(shard_hash(1, 1)));
+    EXPECT_TRUE(has(shard_hash(1, 2)));
+    EXPECT_TRUE(has(shard_hash(2, 0)));
+}
+
+TEST_F(NNCacheTest, ResizeTrims) {
+    cfg_cache_eviction = CacheEviction::FIFO;
+    m_cache.resize(64 * 4);
+    for (auto i = 0; i < 4; i++) {
+        m_cache.insert(shard_hash(5, i), make_result(0.5f));
+    }
+    m_cache.resize(64);
+    EXPECT_FALSE(has(shard_hash(5, 2)));
+    EXPECT_TRUE(has(shard_hash(5, 3)));
+}
+
+TEST_F(NNCacheTest, CompactEntries) {
+    m_cache.resize(1000);
+    const auto stored = make_result(0.6789f);
+    m_cache.insert(shard_hash(7, 0), stored);
+
+    auto result = Network::Netresult{};
+    ASSERT_TRUE(m_cache.lookup(shard_hash(7, 0), result));
+    // The policy is kept in half precision, the rest as it was.
+    for (auto i = 0; i < BOARD_SQUARES; i++) {
+        EXPECT_NEAR(result.policy[i], stored.policy[i],
+                    stored.policy[i] / 1024.0f);
+    }
+    EXPECT_EQ(result.policy_pass, stored.policy_pass);
+    EXPECT_EQ(result.value, stored.value);
+    EXPECT_EQ(result.alpha, stored.alpha);
+    EXPECT_EQ(result.beta, stored.beta);
+}
+
+TEST_F(NNCacheTest, SizeInMegabytes) {
+    constexpr auto MB = size_t{1024} * 1024;
+    m_cache.set_size_mb(1);
+    const auto capacity = m_cache.get_capacity();
+    // An entry is a few hundred bytes at most.
+    EXPECT_GT(capacity, MB / 1024);
+
+    for (auto i = size_t{0}; i < 2 * capacity; i++) {
+        m_cache.insert(i * 0x9E3779B97F4A7C15ULL + 1, make_result(0.5f));
+    }
+    // The shards round the size up.
+    EXPECT_LE(m_cache.get_estimated_size(), MB + MB / 100);
+    EXPECT_GT(m_cache.get_estimated_size(), MB * 9 / 10);
+}
+
+TEST_F(NNCacheTest, ClockKeepsHitEntries) {
+    auto result = Network::Netresult{};
+    for (const auto eviction : {CacheEviction::FIFO, CacheEviction::CLOCK}) {
+        cfg_cache_eviction = eviction;
+        m_cache.clear();
+        m_cache.resize(128);
+        m_cache.insert(shard_hash(9, 0), make_result(0.1f));
+        m_cache.insert(shard_hash(9, 1), make_result(0.2f));
+        ASSERT_TRUE(m_cache.lookup(shard_hash(9, 0), result));
+        m_cache.insert(shard_hash(9, 2), make_result(0.3f));
+
+        // With CLOCK the entry that was hit gets a second chance and
+        // the other one goes instead.
+        const auto clock = (eviction == CacheEviction::CLOCK);
+        EXPECT_EQ(has(shard_hash(9, 0)), clock);
+        EXPECT_EQ(has(shard_hash(9, 1)), !clock);
+        EXPECT_TRUE(has(shard_hash(9, 2)));
+
+        // It went to the back of the queue with its mark cleared, so it
+        // is evicted in turn once it isn't hit again.
+        if (clock) {
+            m_cache.insert(shard_hash(9, 3), make_result(0.4f));
+            EXPECT_FALSE(has(shard_hash(9, 2)));
+            EXPECT_TRUE(has(shard_hash(9, 0)));
+            m_cache.insert(shard_hash(9, 4), make_result(0.5f));
+            EXPECT_FALSE(has(shard_hash(9, 0)));
+        }
+    }
+}
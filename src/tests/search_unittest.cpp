@@ -0,0 +1,195 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+
+#include "config.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "FastBoard.h"
+#include "GTP.h"
+#include "GameState.h"
+#include "TranspositionTable.h"
+#include "TreeFile.h"
+#include "UCTNode.h"
+#include "UCTSearch.h"
+
+namespace {
+    // Black holds the columns A to C and D1, D2, white E to G and D6,
+    // D7. D3, D4 and D5 are left, so the same positions come up in many
+    // move orders.
+    void setup_endgame(GameState& game) {
+        game.init_game(BOARD_SIZE, 7.5f);
+        for (auto y = 0; y < BOARD_SIZE; y++) {
+            for (auto x = 0; x < BOARD_SIZE; x++) {
+                auto color = FastBoard::EMPTY;
+                if (x < 3 || (x == 3 && y < 2)) {
+                    color = FastBoard::BLACK;
+                } else if (x > 3 || (x == 3 && y > 4)) {
+                    color = FastBoard::WHITE;
+                }
+                if (color != FastBoard::EMPTY) {
+                    game.play_move(color, game.board.get_vertex(x, y));
+                }
+            }
+        }
+        game.board.set_to_move(FastBoard::BLACK);
+    }
+
+    class SearchTest : public ::testing::Test {
+    protected:
+        SearchTest() {
+            GTP::setup_default_parameters();
+            cfg_gtp_mode = true;
+            cfg_num_threads = 1;
+            cfg_quiet = true;
+            m_filename = ::testing::TempDir() + "search_unittest.tree";
+        }
+        ~SearchTest() {
+            std::remove(m_filename.c_str());
+        }
+
+        // The tree of the last search of search, as TreeFile saves it.
+        std::unique_ptr<UCTNode> get_tree(UCTSearch& search,
+                                          const GameState& game) {
+            if (!search.save_tree(m_filename, 1)) {
+                return nullptr;
+            }
+            return TreeFile::load(m_filename,
+                                  TranspositionTable::get_key(game),
+                                  Network::get_net_key());
+        }
+
+        std::string m_filename;
+    };
+
+    // The nodes with visits by position.
+    void collect_positions(
+        const UCTNode& node, const FastState& state,
+        std::map<std::uint64_t, std::vector<const UCTNode*>>& positions) {
+        positions[TranspositionTable::get_key(state)].push_back(&node);
+        for (const auto& child : node.get_children()) {
+            if (!child.is_inflated() || child.get_visits() == 0) {
+                continue;
+            }
+            auto next = state;
+            next.play_move(child.get_move());
+            collect_positions(*child, next, positions);
+        }
+    }
+
+    int child_visits(const UCTNode& node, const int move) {
+        for (const auto& child : node.get_children()) {
+            if (child.get_move() == move) {
+                return child.get_visits();
+            }
+        }
+        return 0;
+    }
+}
+
+TEST_F(SearchTest, TranspositionsAreEvaluatedOnce) {
+    cfg_transpositions = true;
+    auto game = GameState();
+    setup_endgame(game);
+    auto search = std::make_unique<UCTSearch>(game);
+    search->set_playout_limit(400);
+    search->think(FastBoard::BLACK, UCTSearch::NORESIGN);
+
+    const auto root = get_tree(*search, game);
+    ASSERT_NE(root, nullptr);
+    auto positions = std::map<std::uint64_t, std::vector<const UCTNode*>>();
+    collect_positions(*root, game, positions);
+
+    auto shared = 0;
+    for (const auto& position : positions) {
+        const auto& nodes = position.second;
+        if (nodes.size() < 2) {
+            continue;
+        }
+        // Only the first node of the position grows a subtree. The
+        // others pass their visits on to it, so it has them all.
+        auto expanded = std::vector<const UCTNode*>();
+        auto linked_visits = 0;
+        for (const auto node : nodes) {
+            if (node->has_children()) {
+                expanded.push_back(node);
+            } else {
+                linked_visits += node->get_visits();
+            }
+        }
+        if (expanded.empty()) {
+            continue;
+        }
+        EXPECT_EQ(expanded.size(), 1u);
+        EXPECT_GT(expanded[0]->get_visits(), linked_visits);
+        shared++;
+    }
+    EXPECT_GT(shared, 0);
+
+    // The root was expanded before the search, every playout went
+    // through one of its children once.
+    auto root_children_visits = 0;
+    for (const auto& child : root->get_children()) {
+        root_children_visits += child.get_visits();
+    }
+    EXPECT_EQ(root->get_visits(), root_children_visits);
+}
+
+TEST_F(SearchTest, UndoRedoReusesTheCachedTrees) {
+    auto game = GameState();
+    game.init_game(BOARD_SIZE, 7.5f);
+    auto search = std::make_unique<UCTSearch>(game);
+    search->set_playout_limit(200);
+    const auto move = search->think(FastBoard::BLACK, UCTSearch::NORESIGN);
+    const auto first = get_tree(*search, game);
+    ASSERT_NE(first, nullptr);
+
+    // The subtree of the move goes on growing as the root.
+    game.play_move(move);
+    search->think(FastBoard::WHITE, UCTSearch::NORESIGN);
+    const auto second = get_tree(*search, game);
+    ASSERT_NE(second, nullptr);
+    EXPECT_GT(second->get_visits(), child_visits(*first, move));
+
+    // After the undo, the old root comes back from the cache, with the
+    // subtree of the move as it was at the second search. A search of
+    // one playout adds one visit.
+    ASSERT_TRUE(game.undo_move());
+    search->set_playout_limit(1);
+    search->think(FastBoard::BLACK, UCTSearch::NORESIGN);
+    const auto third = get_tree(*search, game);
+    ASSERT_NE(third, nullptr);
+    EXPECT_EQ(third->get_visits(), first->get_visits() + 1);
+    const auto visits = child_visits(*third, move);
+    EXPECT_GE(visits, second->get_visits());
+    EXPECT_LE(visits, second->get_visits() + 1);
+
+    // And the redo goes down the same tree again.
+    game.play_move(move);
+    search->think(FastBoard::WHITE, UCTSearch::NORESIGN);
+    const auto fourth = get_tree(*search, game);
+    ASSERT_NE(fourth, nullptr);
+    EXPECT_EQ(fourth->get_visits(), visits + 1);
+}
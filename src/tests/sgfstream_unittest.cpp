@@ -0,0 +1,165 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+
+#include "config.h"
+
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "FastBoard.h"
+#include "GTP.h"
+#include "GameState.h"
+#include "SGFParser.h"
+#include "SGFStream.h"
+#include "SGFTree.h"
+
+namespace {
+    class SGFStreamTest : public ::testing::Test {
+    protected:
+        SGFStreamTest() {
+            GTP::setup_default_parameters();
+            m_filename = ::testing::TempDir() + "sgfstream_unittest.sgf";
+        }
+        ~SGFStreamTest() {
+            std::remove(m_filename.c_str());
+        }
+
+        void write_file(const std::string& text) const {
+            auto file = std::ofstream(m_filename, std::ios::binary);
+            file << text;
+        }
+
+        std::string m_filename;
+    };
+
+    // The game in text, read by SGFTree like loadsgf does.
+    SGFTree load_tree(const std::string& text) {
+        auto stream = std::istringstream{text};
+        auto tree = SGFTree();
+        tree.load_from_string(SGFParser::chop_stream(stream)[0]);
+        return tree;
+    }
+
+    // A game of random legal moves, which ends with two passes when
+    // pass_out is set.
+    GameState random_game(std::mt19937& rng, const float komi,
+                          const bool pass_out, std::vector<int>& moves) {
+        auto state = GameState();
+        state.init_game(BOARD_SIZE, komi);
+        moves.clear();
+        for (auto i = 0; i < 40; i++) {
+            const auto color = state.get_to_move();
+            auto legal = std::vector<int>();
+            for (auto j = 0; j < state.board.get_empty_count(); j++) {
+                const auto vertex = state.board.get_empty(j);
+                if (state.is_move_legal(color, vertex)) {
+                    legal.push_back(vertex);
+                }
+            }
+            // An occasional pass in the middle of the game.
+            const auto move = (legal.empty() || rng() % 16 == 0)
+                ? int(FastBoard::PASS) : legal[rng() % legal.size()];
+            state.play_move(move);
+            moves.push_back(move);
+        }
+        if (pass_out) {
+            for (auto i = 0; i < 2; i++) {
+                state.play_move(FastBoard::PASS);
+                moves.push_back(FastBoard::PASS);
+            }
+        }
+        return state;
+    }
+}
+
+TEST_F(SGFStreamTest, RoundTripsGames) {
+    auto rng = std::mt19937{2018};
+    auto games = std::vector<GameState>();
+    auto game_moves = std::vector<std::vector<int>>();
+    auto collection = std::string();
+    for (auto i = 0; i < 8; i++) {
+        auto moves = std::vector<int>();
+        games.emplace_back(random_game(rng, 0.5f * i - 1.5f, i % 2, moves));
+        game_moves.emplace_back(moves);
+        // Collections have all sorts of text between the games.
+        collection += SGFTree::state_to_string(games.back(),
+                                               FastBoard::BLACK);
+        collection += (i % 2 ? "\n\n" : " ");
+    }
+    write_file(collection);
+
+    SGFStream sgf(m_filename);
+    auto game = SGFGame();
+    auto count = size_t{0};
+    for (; sgf.next_game(game); count++) {
+        ASSERT_LT(count, games.size());
+        auto& original = games[count];
+        auto moves = std::vector<int>();
+        const auto state = game.follow_mainline_state(moves);
+        EXPECT_EQ(moves, game_moves[count]) << "game " << count;
+        EXPECT_EQ(state.get_komi(), original.get_komi());
+        EXPECT_EQ(state.board.get_hash(), original.board.get_hash());
+        EXPECT_EQ(state.get_movenum(), original.get_movenum());
+
+        // The same as the full parser.
+        auto tree = load_tree(
+            SGFTree::state_to_string(original, FastBoard::BLACK));
+        EXPECT_EQ(moves, tree.get_mainline());
+        EXPECT_EQ(game.get_winner(), tree.get_winner());
+        EXPECT_NE(game.get_winner(), FastBoard::EMPTY);
+    }
+    EXPECT_EQ(count, games.size());
+}
+
+TEST_F(SGFStreamTest, FollowsTheFirstVariation) {
+    const auto text = std::string{
+        "(;GM[1]FF[4]SZ[7]KM[5.5]RE[W+3.5]C[a \\] in a comment]AB[aa]"
+        "(;B[dd]C[(;B[gg\\])];W[cc](;B[ee])(;B[ff]))(;B[bb]))"};
+    write_file("Some text before (;GM[1]SZ[7];B[dd]) " + text + "\n");
+
+    SGFStream sgf(m_filename);
+    auto game = SGFGame();
+    ASSERT_TRUE(sgf.next_game(game));
+    ASSERT_TRUE(sgf.next_game(game));
+    EXPECT_EQ(game.get_property("KM"), "5.5");
+    EXPECT_EQ(game.get_property("C"), "a \\] in a comment");
+    EXPECT_EQ(game.get_winner(), FastBoard::WHITE);
+
+    auto moves = std::vector<int>();
+    const auto state = game.follow_mainline_state(moves);
+    // AB[aa] is A7, then the main line is D4, C5 and E3.
+    auto expected = GameState();
+    expected.init_game(BOARD_SIZE, 5.5f);
+    expected.play_move(FastBoard::BLACK, expected.board.get_vertex(0, 6));
+    const auto dd = expected.board.get_vertex(3, 3);
+    const auto cc = expected.board.get_vertex(2, 4);
+    const auto ee = expected.board.get_vertex(4, 2);
+    EXPECT_EQ(moves, (std::vector<int>{dd, cc, ee}));
+    expected.play_move(FastBoard::BLACK, dd);
+    expected.play_move(FastBoard::WHITE, cc);
+    expected.play_move(FastBoard::BLACK, ee);
+    EXPECT_EQ(state.board.get_hash(), expected.board.get_hash());
+    EXPECT_EQ(state.get_komi(), 5.5f);
+    EXPECT_FALSE(sgf.next_game(game));
+}
@@ -0,0 +1,119 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+
+#include "config.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <random>
+
+#include "FastBoard.h"
+#include "Training.h"
+#include "TrainingRecord.h"
+
+namespace {
+    TimeStep make_step(std::mt19937& rng) {
+        auto step = TimeStep{};
+        for (auto& plane : step.planes) {
+            for (auto i = size_t{0}; i < plane.size(); i++) {
+                plane[i] = (rng() % 3 == 0);
+            }
+        }
+        auto sum = 0.0f;
+        auto weights = std::array<float, BOARD_SQUARES + 1>{};
+        for (auto& weight : weights) {
+            weight = (rng() % 4 == 0) ? float(rng() % 1000) : 0.0f;
+            sum += weight;
+        }
+        for (auto i = size_t{0}; i < weights.size(); i++) {
+            step.set_probability(i, sum > 0.0f ? weights[i] / sum : 0.0f);
+        }
+        step.to_move = (rng() % 2) ? FastBoard::BLACK : FastBoard::WHITE;
+        step.net_winrate = (rng() % 1000) / 1000.0f;
+        step.root_uct_winrate = (rng() % 1000) / 1000.0f;
+        step.child_uct_winrate = (rng() % 1000) / 1000.0f;
+        step.bestmove_visits = rng() % 2000;
+        step.komi = 0.5f * (int(rng() % 41) - 20);
+        step.is_blunder = (rng() % 5 == 0);
+        return step;
+    }
+
+    // Plane p at intersection i, as training/tf/chunkparser.py unpacks
+    // it.
+    bool get_bit(const TrainingRecord& record, const size_t p,
+                 const size_t i) {
+        const auto bit = p * BOARD_SQUARES + i;
+        return (record.planes[bit / 8] >> (7 - bit % 8)) & 1;
+    }
+}
+
+TEST(TrainingTest, BinaryRecordRoundTrip) {
+    auto rng = std::mt19937{42};
+    for (auto n = 0; n < 50; n++) {
+        const auto step = make_step(rng);
+        // FastBoard::BLACK or WHITE.
+        const auto winner = int(rng() % 2);
+        const auto record = Training::get_record(step, winner);
+
+        EXPECT_EQ(record.version, std::uint32_t{TrainingRecord::VERSION});
+        EXPECT_EQ(record.komi, step.komi);
+        EXPECT_EQ(record.net_winrate, step.net_winrate);
+        EXPECT_EQ(record.root_uct_winrate, step.root_uct_winrate);
+        EXPECT_EQ(record.child_uct_winrate, step.child_uct_winrate);
+        EXPECT_EQ(int(record.bestmove_visits), step.bestmove_visits);
+        for (auto p = size_t{0}; p < TrainingRecord::PLANES; p++) {
+            for (auto i = size_t{0}; i < BOARD_SQUARES; i++) {
+                ASSERT_EQ(get_bit(record, p, i), bool(step.planes[p][i]))
+                    << "plane " << p << " intersection " << i;
+            }
+        }
+        auto sum = 0.0f;
+        for (auto i = size_t{0}; i < BOARD_SQUARES + 1; i++) {
+            const auto probability =
+                record.probabilities[i] / TrainingRecord::PROBABILITY_SCALE;
+            EXPECT_EQ(probability, step.get_probability(i));
+            sum += probability;
+        }
+        EXPECT_NEAR(sum, 1.0f, (BOARD_SQUARES + 1) * 0.5f / 65535.0f);
+        EXPECT_EQ(record.to_move, step.to_move == FastBoard::BLACK ? 0 : 1);
+        EXPECT_EQ(record.winner, step.to_move == winner ? 1 : 0);
+        EXPECT_EQ(bool(record.is_blunder), step.is_blunder);
+    }
+}
+
+TEST(TrainingTest, BinaryRecordLayout) {
+    auto rng = std::mt19937{7};
+    const auto record = Training::get_record(make_step(rng),
+                                             FastBoard::BLACK);
+    unsigned char bytes[sizeof(TrainingRecord)];
+    std::memcpy(bytes, &record, sizeof(record));
+
+    // utils/ParseChunks tells the binary records from the text by
+    // their first byte.
+    EXPECT_EQ(bytes[0], std::uint32_t{TrainingRecord::VERSION});
+    EXPECT_EQ(sizeof(TrainingRecord) % 4, 0u);
+    // The padding at the end is written out, it must be zeros.
+    for (auto i = offsetof(TrainingRecord, is_blunder) + 1;
+         i < sizeof(TrainingRecord); i++) {
+        EXPECT_EQ(bytes[i], 0) << "byte " << i;
+    }
+}
@@ -0,0 +1,161 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 SAI Team
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+
+#include "config.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+
+#include "FastBoard.h"
+#include "GTP.h"
+#include "GameState.h"
+#include "Network.h"
+#include "TreeFile.h"
+#include "UCTNode.h"
+
+namespace {
+    constexpr auto KEY = std::uint64_t{0x0123456789abcdef};
+    constexpr auto NET_KEY = std::uint64_t{0xfedcba9876543210};
+
+    class TreeFileTest : public ::testing::Test {
+    protected:
+        TreeFileTest() : m_root(FastBoard::PASS, 0.0f) {
+            GTP::setup_default_parameters();
+            cfg_quiet = true;
+            m_filename = ::testing::TempDir() + "treefile_unittest.tree";
+
+            // The children of the root with their priors, the first one
+            // with a subtree of its own and the second with one visit.
+            auto game = GameState();
+            game.init_game(BOARD_SIZE, 7.5f);
+            std::atomic<int> nodecount{0};
+            auto value = 0.0f, alpkt = 0.0f, beta = 0.0f;
+            m_root.create_children(nodecount, game, value, alpkt, beta);
+            const auto& children = m_root.get_children();
+            children[0].inflate();
+            children[1].inflate();
+            auto next = game;
+            next.play_move(children[0].get_move());
+            children[0]->create_children(nodecount, next, value, alpkt, beta);
+            const auto& grandchildren = children[0]->get_children();
+            grandchildren[0].inflate();
+            grandchildren[0]->update(0.75f);
+            for (auto i = 0; i < 3; i++) {
+                children[0]->update(0.25f * i);
+                m_root.update(0.25f * i);
+            }
+            children[1]->update(0.5f);
+            m_root.update(0.5f);
+        }
+        ~TreeFileTest() {
+            std::remove(m_filename.c_str());
+        }
+
+        std::string read_file() const {
+            auto file = std::ifstream(m_filename, std::ios::binary);
+            return std::string(std::istreambuf_iterator<char>(file),
+                               std::istreambuf_iterator<char>());
+        }
+
+        void write_file(const std::string& data) const {
+            auto file = std::ofstream(m_filename, std::ios::binary);
+            file.write(data.data(), data.size());
+        }
+
+        UCTNode m_root;
+        std::string m_filename;
+    };
+
+    void expect_same_tree(const UCTNode& loaded, const UCTNode& node) {
+        EXPECT_EQ(loaded.get_visits(), node.get_visits());
+        EXPECT_EQ(loaded.get_blackevals(), node.get_blackevals());
+        EXPECT_EQ(loaded.get_net_eval(), node.get_net_eval());
+        EXPECT_EQ(loaded.get_net_alpkt(), node.get_net_alpkt());
+        EXPECT_EQ(loaded.get_net_beta(), node.get_net_beta());
+        EXPECT_EQ(loaded.get_eval_bonus(), node.get_eval_bonus());
+        EXPECT_EQ(loaded.get_eval_bonus_father(),
+                  node.get_eval_bonus_father());
+
+        const auto& children = node.get_children();
+        const auto& loaded_children = loaded.get_children();
+        ASSERT_EQ(loaded_children.size(), children.size());
+        for (auto i = size_t{0}; i < children.size(); i++) {
+            const auto& child = children[i];
+            const auto& loaded_child = loaded_children[i];
+            EXPECT_EQ(loaded_child.get_move(), child.get_move());
+            EXPECT_EQ(loaded_child.get_score(), child.get_score());
+            const auto expanded = child.is_inflated()
+                                  && child.get_visits() > 0;
+            ASSERT_EQ(loaded_child.is_inflated(), expanded);
+            if (expanded) {
+                expect_same_tree(*loaded_child, *child);
+            }
+        }
+    }
+}
+
+TEST_F(TreeFileTest, RoundTrip) {
+    ASSERT_TRUE(TreeFile::save(m_filename, m_root, KEY, NET_KEY, 0));
+    const auto root = TreeFile::load(m_filename, KEY, NET_KEY);
+    ASSERT_NE(root, nullptr);
+    expect_same_tree(*root, m_root);
+    EXPECT_EQ(root->count_nodes(), m_root.count_nodes());
+}
+
+TEST_F(TreeFileTest, MinVisits) {
+    ASSERT_TRUE(TreeFile::save(m_filename, m_root, KEY, NET_KEY, 2));
+    const auto root = TreeFile::load(m_filename, KEY, NET_KEY);
+    ASSERT_NE(root, nullptr);
+    // The child with one visit is kept only as its move and prior.
+    const auto& children = root->get_children();
+    EXPECT_TRUE(children[0].is_inflated());
+    EXPECT_FALSE(children[1].is_inflated());
+    EXPECT_EQ(children[1].get_score(), m_root.get_children()[1].get_score());
+    EXPECT_FALSE(children[0]->get_children()[0].is_inflated());
+}
+
+TEST_F(TreeFileTest, RejectsOtherPositionAndNetwork) {
+    ASSERT_TRUE(TreeFile::save(m_filename, m_root, KEY, NET_KEY, 0));
+    EXPECT_EQ(TreeFile::load(m_filename, KEY + 1, NET_KEY), nullptr);
+    EXPECT_EQ(TreeFile::load(m_filename, KEY, NET_KEY + 1), nullptr);
+    EXPECT_NE(TreeFile::load(m_filename, KEY, NET_KEY), nullptr);
+}
+
+TEST_F(TreeFileTest, RejectsOtherVersionAndDamage) {
+    ASSERT_TRUE(TreeFile::save(m_filename, m_root, KEY, NET_KEY, 0));
+    const auto data = read_file();
+
+    // The magic, which has the version in its low bits.
+    auto other_version = data;
+    other_version[0] ^= 1;
+    write_file(other_version);
+    EXPECT_EQ(TreeFile::load(m_filename, KEY, NET_KEY), nullptr);
+
+    write_file(data.substr(0, data.size() - 1));
+    EXPECT_EQ(TreeFile::load(m_filename, KEY, NET_KEY), nullptr);
+
+    std::remove(m_filename.c_str());
+    EXPECT_EQ(TreeFile::load(m_filename, KEY, NET_KEY), nullptr);
+}
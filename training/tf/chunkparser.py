@@ -22,6 +22,7 @@ import glob
 import gzip
 import itertools
 import math
+import mmap
 import multiprocessing as mp
 import numpy as np
 import queue
@@ -85,6 +86,9 @@ class ChunkParser:
             VERY slow to decode. Typically around 2500 bytes long.
             Used only for backward compatability.
 
+            v3: Binary records written by leelaz --binarytraining, see
+            src/TrainingRecord.h. Fixed length, converted to v2 when read.
+
             v2: Packed binary representation of v1. Fixed length,
             no record seperator. The most compact format.
             Data in the shuffle buffer is held in this
@@ -154,6 +158,18 @@ class ChunkParser:
         s2 = BOARD_SQUARES*2
         self.v2_struct = struct.Struct('4s'+str(s1)+'s'+str(s2)+'sBiB')
 
+        # V3 Format, see src/TrainingRecord.h
+        # int32 version, float32 komi, float32 * 3 winrates,
+        # uint32 bestmove_visits
+        # BOARD_SQUARES+1 uint16 probabilities in units of 1/65535
+        # BOARD_SQUARES*16 packed bit planes
+        # uint8 side_to_move, uint8 is_winner, uint8 is_blunder
+        # zero padding to a multiple of 4 bytes
+        v3_size = 24 + (BOARD_SQUARES+1)*2 + s2 + 3
+        self.v3_struct = struct.Struct('<IffffI' + str(BOARD_SQUARES+1) + 'H'
+                                       + str(s2) + 'sBBB'
+                                       + str(-v3_size % 4) + 'x')
+
         # Struct used to return data from child workers.
         # float32 winner
         # float32*(BOARD_SQUARE+1) probs
@@ -232,6 +248,21 @@ class ChunkParser:
 
         return True, self.v2_struct.pack(version, probs, planes, stm, komi, winner)
 
+    def convert_v3_to_v2(self, content):
+        """
+            Convert a v3 binary record to the v2 format
+        """
+        fields = self.v3_struct.unpack(content)
+        komi = fields[1]
+        probs = np.array(fields[6:6+BOARD_SQUARES+1], dtype=np.float32)
+        probs = (probs / 65535).tobytes()
+        planes, stm, winner = fields[6+BOARD_SQUARES+1:6+BOARD_SQUARES+4]
+        komi = int(2*komi)
+        if (stm == 0):
+            komi = -komi
+        version = struct.pack('i', 1)
+        return self.v2_struct.pack(version, probs, planes, stm, komi, winner)
+
     def v2_apply_symmetry(self, symmetry, content):
         """<
             Apply a random symmetry to a v2 record.
@@ -311,6 +342,15 @@ class ChunkParser:
                     if random.randint(0, self.sample-1) != 0:
                         continue  # Skip this record.
                 yield chunkdata[i:i+self.v2_struct.size]
+        elif chunkdata[0:4] == b'\3\0\0\0':
+            #print("V3 chunkdata")
+            for i in range(0, len(chunkdata), self.v3_struct.size):
+                if self.sample > 1:
+                    # Downsample, using only 1/Nth of the items.
+                    if random.randint(0, self.sample-1) != 0:
+                        continue  # Skip this record.
+                yield self.convert_v3_to_v2(
+                    chunkdata[i:i+self.v3_struct.size])
         else:
             #print("V1 chunkdata")
             file_chunkdata = chunkdata.splitlines()
@@ -404,6 +444,32 @@ class ChunkParser:
             yield b
 
 
+def batch_file_gen(filename):
+    """
+        Yield the batches of raw tensors written by shufflechunks, see
+        utils/ShuffleChunks.cpp, as ChunkParser.parse() does. The file
+        is mapped, not read.
+    """
+    with open(filename, 'rb') as f:
+        data = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    magic = data[0:4]
+    version, board_size, batch_size = struct.unpack('3I', data[4:16])
+    if magic != b'SAIB' or version != 1 or board_size != BOARD_SIZE:
+        raise ValueError("{} is not a batch file for this board size"
+                         .format(filename))
+    sizes = [batch_size * 18 * BOARD_SQUARES,
+             batch_size * (BOARD_SQUARES + 1) * 4,
+             batch_size * 4,
+             batch_size * 4]
+    offset = 16
+    while offset + sum(sizes) <= len(data):
+        batch = []
+        for size in sizes:
+            batch.append(data[offset:offset + size])
+            offset += size
+        yield tuple(batch)
+
+
 # Tests to check that records can round-trip successfully
 class ChunkParserTest(unittest.TestCase):
     def generate_fake_pos(self):
@@ -0,0 +1,219 @@
+/*
+  Reads training chunks for parsechunks and nodecount: gzipped or not,
+  text or --binarytraining records, from a list of files that are
+  parsed on several threads, or from the standard input.
+
+  Build with zlib and threads, e.g.
+  g++ -std=c++14 -O2 -pthread ParseChunks.cpp -o parsechunks -lz
+*/
+
+#ifndef CHUNKREADER_H_INCLUDED
+#define CHUNKREADER_H_INCLUDED
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Whitespace separated tokens and raw bytes from a gzFile, which reads
+// uncompressed files as they are.
+class ChunkReader {
+public:
+    explicit ChunkReader(gzFile file)
+	: m_file(file), m_buffer(BUFFER_SIZE) {}
+    ~ChunkReader() {
+	if (m_file) {
+	    gzclose(m_file);
+	}
+    }
+    ChunkReader(const ChunkReader&) = delete;
+    ChunkReader& operator=(const ChunkReader&) = delete;
+
+    bool is_open() const { return m_file != nullptr; }
+
+    // The next byte, or EOF.
+    int peek() {
+	if (!fill(1)) {
+	    return EOF;
+	}
+	return static_cast<unsigned char>(m_buffer[m_pos]);
+    }
+
+    bool read(void* data, size_t size) {
+	if (!fill(size)) {
+	    return false;
+	}
+	std::memcpy(data, m_buffer.data() + m_pos, size);
+	m_pos += size;
+	return true;
+    }
+
+    // The next token, valid until the next call.
+    bool token(const char*& begin, size_t& size) {
+	while (true) {
+	    if (!fill(1)) {
+		return false;
+	    }
+	    if (!is_space(m_buffer[m_pos])) {
+		break;
+	    }
+	    ++m_pos;
+	}
+	auto end = m_pos;
+	while (true) {
+	    if (end == m_end) {
+		// The token goes on past the buffer.
+		const auto done = end - m_pos;
+		if (!fill(done + 1)) {
+		    end = m_end;
+		    break;
+		}
+		end = m_pos + done;
+	    }
+	    if (is_space(m_buffer[end])) {
+		break;
+	    }
+	    ++end;
+	}
+	begin = m_buffer.data() + m_pos;
+	size = end - m_pos;
+	m_pos = end;
+	return true;
+    }
+
+    bool skip_tokens(int count) {
+	const char* begin;
+	size_t size;
+	for (auto i = 0; i < count; i++) {
+	    if (!token(begin, size)) {
+		return false;
+	    }
+	}
+	return true;
+    }
+
+    bool next_int(int& value) {
+	char number[MAX_NUMBER + 1];
+	if (!next_number(number)) {
+	    return false;
+	}
+	value = std::atoi(number);
+	return true;
+    }
+
+    bool next_float(float& value) {
+	char number[MAX_NUMBER + 1];
+	if (!next_number(number)) {
+	    return false;
+	}
+	value = std::strtof(number, nullptr);
+	return true;
+    }
+
+private:
+    static constexpr size_t BUFFER_SIZE = 1 << 20;
+    static constexpr size_t MAX_NUMBER = 63;
+
+    static bool is_space(const char c) {
+	return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+    }
+
+    bool next_number(char* number) {
+	const char* begin;
+	size_t size;
+	if (!token(begin, size)) {
+	    return false;
+	}
+	size = std::min(size, MAX_NUMBER);
+	std::memcpy(number, begin, size);
+	number[size] = '\0';
+	return true;
+    }
+
+    // Makes the buffer have at least size bytes from m_pos, unless the
+    // file ends first.
+    bool fill(const size_t size) {
+	if (m_end - m_pos >= size) {
+	    return true;
+	}
+	std::memmove(m_buffer.data(), m_buffer.data() + m_pos, m_end - m_pos);
+	m_end -= m_pos;
+	m_pos = 0;
+	if (m_buffer.size() < size) {
+	    m_buffer.resize(size);
+	}
+	while (m_end < size && !m_eof) {
+	    const auto bytes = gzread(m_file, m_buffer.data() + m_end,
+				      unsigned(m_buffer.size() - m_end));
+	    if (bytes <= 0) {
+		m_eof = true;
+	    } else {
+		m_end += bytes;
+	    }
+	}
+	return m_end >= size;
+    }
+
+    gzFile m_file;
+    std::vector<char> m_buffer;
+    size_t m_pos{0};
+    size_t m_end{0};
+    bool m_eof{false};
+};
+
+// The -j threads option and the chunk files from argv[first] on.
+inline void parse_chunk_args(int argc, char* argv[], int first,
+			     std::vector<std::string>& files,
+			     unsigned int& threads) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+    for (auto i = first; i < argc; ++i) {
+	if (std::strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+	    threads = std::max(1, std::atoi(argv[++i]));
+	} else {
+	    files.emplace_back(argv[i]);
+	}
+    }
+}
+
+// Calls parse(reader, result) on every file, or on the standard input
+// if there are none, with one Result for every thread, and returns
+// them to be merged.
+template <typename Result, typename Parse>
+std::vector<Result> parse_chunks(const std::vector<std::string>& files,
+				 unsigned int threads, Parse parse) {
+    if (files.empty()) {
+	auto results = std::vector<Result>(1);
+	ChunkReader reader(gzdopen(fileno(stdin), "rb"));
+	parse(reader, results[0]);
+	return results;
+    }
+    threads = std::min<unsigned int>(threads, files.size());
+    auto results = std::vector<Result>(threads);
+    std::atomic<size_t> next{0};
+    auto workers = std::vector<std::thread>();
+    for (auto t = 0u; t < threads; ++t) {
+	workers.emplace_back([&, t]() {
+	    for (auto i = next++; i < files.size(); i = next++) {
+		ChunkReader reader(gzopen(files[i].c_str(), "rb"));
+		if (!reader.is_open()) {
+		    std::fprintf(stderr, "Could not open %s\n",
+				 files[i].c_str());
+		    continue;
+		}
+		parse(reader, results[t]);
+	    }
+	});
+    }
+    for (auto& worker : workers) {
+	worker.join();
+    }
+    return results;
+}
+
+#endif
@@ -3,15 +3,24 @@
   all the games in a chunk.
 
   Usage:
-  gunzip * -c | nodecount
+  nodecount [visits] [-j threads] chunk files...
+  gunzip * -c | nodecount [visits]
+
+  The files are parsed on threads threads, all of them by default.
+  Reads the text training data as well as the --binarytraining records.
 */
 
 #include <iostream>
 #include <string>
+#include <cctype>
 #include <cmath>
+#include <cstring>
 #include <algorithm>
 #include <vector>
 
+#include "ChunkReader.h"
+#include "../src/TrainingRecord.h"
+
 #define VISITS 250
 #define GOBAN_SIZE 7
 #define LOW_THR 0.0005f
@@ -41,6 +50,28 @@ unsigned long int gcd_denum(std::vector<float> q) {
 }
 
 
+// the binary records round the probabilities to multiples of
+// 1/PROBABILITY_SCALE, so look for the smallest denominator they are all
+// fractions of, up to that rounding
+unsigned long int rounded_denum(const std::vector<float> &q,
+				unsigned long int max_denum) {
+    for (unsigned long int den=1 ; den<max_denum ; den++) {
+	const auto tol = 0.5f * den / TrainingRecord::PROBABILITY_SCALE
+	    + 0.0001f;
+	bool all = true;
+	for (auto &p : q) {
+	    if (std::abs(p*den - std::round(p*den)) > tol) {
+		all = false;
+		break;
+	    }
+	}
+	if (all)
+	    return den;
+    }
+    return max_denum;
+}
+
+
 unsigned long int gcd_denum_bad(const std::vector<float> &x) {
     std::vector<float> q,dq;
 
@@ -118,107 +149,175 @@ void add_freq(unsigned long int denum, std::vector<freq_it> &freq) {
 }
 
 
-int main(int argc, char* argv[]){
-  std::string buf;
-  std::string hexnil((GOBAN_SIZE*GOBAN_SIZE+3)/4,'0');
-  std::vector<freq_it> freq;
-  unsigned long int cfg_visits = VISITS;
-  
-  if(argc >= 2) {
-      cfg_visits = std::stoi(argv[1]);
-  }
-  
-  unsigned long int denum=0;
-  
-  // cumulative number of nodes created
-  int nodessum = 0;
-  
-  // the single move with maximum number of nodes is (typically)
-  // chosen: these nodes are shared in the analysis of the next move,
-  // and hence not computed again
-  int maxnodes = 0;
-  
-  while (std::cin >> buf) {
+struct node_counter {
+    unsigned long int cfg_visits = VISITS;
+    std::vector<freq_it> freq;
+
+    // cumulative number of nodes created
+    int nodessum = 0;
+
+    // the single move with maximum number of nodes is (typically)
+    // chosen: these nodes are shared in the analysis of the next move,
+    // and hence not computed again
+    int maxnodes = 0;
+
+    // empty is 0 for the starting position
+    void add_position(int chknil, const std::vector<float> &polprb,
+		      bool rounded) {
+	// if starting position, the former maxnodes should have never
+	// been subtracted, because after the last position there is no
+	// more tree re-use
+	if (!chknil)
+	    nodessum += maxnodes;
+
+	// maximum probability of a move
+	float maxprb=0;
+
+	for (auto prob : polprb) {
+	    // the one with the maximum probability will be typically chosen
+	    if (prob > maxprb)
+		maxprb = prob;
+	}
+
+	//    std::cout << polprb.size() << " probabilities read." << std::endl;
+	unsigned long int denum = rounded
+	    ? rounded_denum(polprb, std::max(cfg_visits, 250ul))
+	    : gcd_denum(polprb);
+	add_freq(denum, freq);
+	if (denum != cfg_visits-1) {
+	    auto i = default_visits.size();
+	    for ( ; i>0 ; --i) {
+		const auto visits = default_visits[i-1];
+		if ((visits-1) % denum == 0) {
+		    denum = visits-1;
+		    break;
+		}
+	    }
+	    if (i==0) {
+		std::cerr << "Possibly wrong denominator " << denum << std::endl;
+	    }
+	}
 
-    // check whether the goban is empty
-    int chknil = buf.compare(hexnil); // 0 if goban empty (1/16)
-    for (int i=0; i<15; i++) {
+	nodessum += denum+1;
 
-      // skip the 16 lines describing the position
-      std::cin >> buf;
+	// this number of nodes will be shared with the next position
+	maxnodes = round(maxprb*denum);
 
-    // check whether this is the starting position, otherwise 1 
-      if (!chknil && buf.compare(hexnil))
-	chknil = 1;
+	// so subtract it from the total
+	nodessum -= maxnodes;
     }
 
-    // if starting position, the former maxnodes should have never
-    // been subtracted, because after the last position there is no
-    // more tree re-use
-    if (!chknil)
-      nodessum += maxnodes;
-
-    // skip line 17, with the player and komi
-    std::getline(std::cin, buf);
-    std::getline(std::cin, buf);
-    //    std::cout << "-" << buf << "-" << std::endl;
-    //    std::cin >> buf ;
-    //    std::cout << "." << buf << "." << std::endl;
-    
-    // maximum probability of a move
-    float maxprb=0;
-    
-    std::vector<float> polprb;
-    for (int i=0; i<GOBAN_SIZE*GOBAN_SIZE+1; i++) {
-
-      float prob;
-	
-      // line 18 has the 50 probabilities, all of which are fractions
-      // like k/99
-      std::cin >> prob;
-      polprb.emplace_back(prob);
-
-      // the one with the maximum probability will be typically chosen
-      if (prob > maxprb)
-	maxprb = prob;
+    // the last game of a file
+    void add_game() {
+	nodessum += maxnodes;
+	maxnodes = 0;
     }
 
-    //    std::cout << polprb.size() << " probabilities read." << std::endl;
-    denum = gcd_denum(polprb);
-    add_freq(denum, freq);
-    if (denum != cfg_visits-1) {
-	auto i = default_visits.size();
-	for ( ; i>0 ; --i) {
-	    const auto visits = default_visits[i-1];
-	    if ((visits-1) % denum == 0) {
-		denum = visits-1;
-		break;
-	    }
+    void merge(const node_counter &other) {
+	nodessum += other.nodessum;
+	for (auto &j : other.freq) {
+	    for (size_t c=0 ; c<j.c ; ++c)
+		add_freq(j.ind, freq);
+	}
+    }
+};
+
+
+// Binary records start with their version, the text starts with hex
+// digits.
+void parse_binary(ChunkReader &in, node_counter &counter) {
+    TrainingRecord record;
+    std::vector<float> polprb(GOBAN_SIZE*GOBAN_SIZE+1);
+    while (in.read(&record, sizeof(record))) {
+	int chknil = 0;
+	for (auto byte : record.planes) {
+	    if (byte)
+		chknil = 1;
 	}
-	if (i==0) {
-	    std::cerr << "Possibly wrong denominator " << denum << std::endl;
+	for (size_t i=0; i<polprb.size(); i++) {
+	    polprb[i] = record.probabilities[i]
+		/ TrainingRecord::PROBABILITY_SCALE;
 	}
+	counter.add_position(chknil, polprb, true);
     }
+}
+
+void parse_text(ChunkReader &in, node_counter &counter) {
+    const std::string hexnil((GOBAN_SIZE*GOBAN_SIZE+3)/4,'0');
+    const char* buf;
+    size_t size;
+    std::vector<float> polprb(GOBAN_SIZE*GOBAN_SIZE+1);
+
+    const auto is_nil = [&hexnil](const char* buf, size_t size) {
+	return size == hexnil.size()
+	    && std::memcmp(buf, hexnil.data(), size) == 0;
+    };
+
+    while (in.token(buf, size)) {
+
+	// check whether the goban is empty
+	int chknil = !is_nil(buf, size); // 0 if goban empty (1/16)
+	for (int i=0; i<15; i++) {
 
-    nodessum += denum+1;
+	    // skip the 16 lines describing the position
+	    in.token(buf, size);
 
-    // this number of nodes will be shared with the next position
-    maxnodes = round(maxprb*denum);
+	    // check whether this is the starting position, otherwise 1 
+	    if (!chknil && !is_nil(buf, size))
+		chknil = 1;
+	}
+
+	// skip line 17, with the player and komi
+	in.skip_tokens(2);
+
+	for (auto &prob : polprb) {
+	    // line 18 has the 50 probabilities, all of which are fractions
+	    // like k/99
+	    in.next_float(prob);
+	}
+
+	counter.add_position(chknil, polprb, false);
+
+	// skip line 19, with the winner
+	in.skip_tokens(1);
+    }
+}
+
+int main(int argc, char* argv[]){
+  unsigned long int cfg_visits = VISITS;
+  auto first = 1;
+  
+  if(argc >= 2 && std::isdigit(static_cast<unsigned char>(argv[1][0]))) {
+      cfg_visits = std::stoi(argv[1]);
+      first = 2;
+  }
 
-    // so subtract it from the total
-    nodessum -= maxnodes;
+  std::vector<std::string> files;
+  unsigned int threads;
+  parse_chunk_args(argc, argv, first, files, threads);
 
-    // skip line 19, with the winner
-    std::cin >> buf;
-    polprb.clear();
+  const auto counters = parse_chunks<node_counter>(
+      files, threads,
+      [cfg_visits](ChunkReader &in, node_counter &counter) {
+	  counter.cfg_visits = cfg_visits;
+	  if (in.peek() == TrainingRecord::VERSION) {
+	      parse_binary(in, counter);
+	  } else {
+	      parse_text(in, counter);
+	  }
+	  counter.add_game();
+      });
+  node_counter total;
+  for (const auto &c : counters) {
+      total.merge(c);
   }
 
-  for (auto &j : freq) {
+  for (auto &j : total.freq) {
       std::cerr << "Denominator " << j.ind
 		<< " frequency " << j.c << std::endl;
   }
   
-  std::cout << nodessum << std::endl;
+  std::cout << total.nodessum << std::endl;
   
   return 0;
 }
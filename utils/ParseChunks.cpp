@@ -3,21 +3,29 @@
   all the games in a chunk.
 
   Usage:
-  gunzip * -c | nodecount
+  parsechunks [-j threads] chunk files...
+  gunzip * -c | parsechunks
+
+  The files are parsed on threads threads, all of them by default.
+  Reads the text training data as well as the --binarytraining records.
 */
 
 #include <iostream>
 #include <string>
 #include <cmath>
 #include <cassert>
+#include <cstring>
 #include <vector>
 #include <algorithm>
 
+#include "ChunkReader.h"
+#include "../src/TrainingRecord.h"
+
 //#define VISITS 160
 #define GOBAN_SIZE 7
 
 struct one_komi_stats {
-    float komi;
+    float komi=0.0f;
     unsigned int bwg;
     unsigned int bwm;
     unsigned int wwg;
@@ -30,7 +38,8 @@ bool compare(const one_komi_stats& a, const one_komi_stats& b) {
 }
 
 
-unsigned int komi_index(float komi, std::vector<one_komi_stats> &stats) {
+unsigned int komi_index(float komi, std::vector<one_komi_stats> &stats,
+			bool report) {
     unsigned int j;
     
     for (j=0 ; j<stats.size() ; ++j) {
@@ -46,89 +55,144 @@ unsigned int komi_index(float komi, std::vector<one_komi_stats> &stats) {
 	p.wwm = 0;
 	p.mvs = 0;
 	stats.push_back(p);
-	std::cout << "Found new komi (" << j
-		  << "): " << komi << std::endl;
+	if (report) {
+	    std::cout << "Found new komi (" << j
+		      << "): " << komi << std::endl;
+	}
     }
     return j;
 }
 
 
-int main(){
-    std::string buf;
-    std::string hexnil((GOBAN_SIZE*GOBAN_SIZE+3)/4,'0');
-    int games=0, line=0, moves=0, lastwinner=0, winner=0;
-    float komi;
+struct game_counter {
+    int games=0, moves=0, lastwinner=0;
     unsigned int j = 0;
     std::vector<one_komi_stats> stats;
-    
-    while (std::cin >> buf) {
-	++line;
-      
+
+    // empty is 0 for the starting position
+    void add_position(int empty, int stm, float komi, int winner) {
+	j = komi_index(komi, stats, false);
+	++stats[j].mvs;
+	++moves;
+
+	// if starting position, the former maxnodes should have never
+	// been subtracted, because after the last position there is no
+	// more tree re-use
+	if (!empty && stm == 0) {
+	    assert (winner == 1 || winner == -1);
+	    ++games;
+	    add_game();
+	    lastwinner = winner;
+	}
+    }
+
+    // the game that ended with the last position, at the end of a file
+    void add_game() {
+	if (lastwinner == 1) {
+	    ++stats[j].bwg;
+	    stats[j].bwm += moves;
+	}
+	else if (lastwinner == -1) {
+	    ++stats[j].wwg;
+	    stats[j].wwm += moves;
+	}
+	moves = 0;
+	lastwinner = 0;
+    }
+
+    void merge(const game_counter &other) {
+	games += other.games;
+	for (const auto &s : other.stats) {
+	    const auto k = komi_index(s.komi, stats, true);
+	    stats[k].bwg += s.bwg;
+	    stats[k].bwm += s.bwm;
+	    stats[k].wwg += s.wwg;
+	    stats[k].wwm += s.wwm;
+	    stats[k].mvs += s.mvs;
+	}
+    }
+};
+
+// Binary records start with their version, the text starts with hex
+// digits.
+void parse_binary(ChunkReader &in, game_counter &counter) {
+    TrainingRecord record;
+    while (in.read(&record, sizeof(record))) {
+	assert (record.version == TrainingRecord::VERSION);
+	int empty = 0;
+	for (auto byte : record.planes) {
+	    if (byte)
+		empty = 1;
+	}
+	counter.add_position(empty, record.to_move, record.komi,
+			     record.winner ? 1 : -1);
+    }
+}
+
+void parse_text(ChunkReader &in, game_counter &counter) {
+    const std::string hexnil((GOBAN_SIZE*GOBAN_SIZE+3)/4,'0');
+    const char* buf;
+    size_t size;
+    int winner=0;
+    float komi=0.0f;
+
+    const auto is_nil = [&hexnil](const char* buf, size_t size) {
+	return size == hexnil.size()
+	    && std::memcmp(buf, hexnil.data(), size) == 0;
+    };
+
+    while (in.token(buf, size)) {
 	// check whether the goban is empty
-	int chknil = buf.compare(hexnil); // 0 if goban empty (1/16)
+	int chknil = !is_nil(buf, size); // 0 if goban empty (1/16)
 	for (int i=0; i<15; i++) {
 	    
 	    // skip the 16 lines describing the position
-	    std::cin >> buf;
-	    ++line;
+	    in.token(buf, size);
 	    
 	    // check whether this is the starting position, otherwise 1 
-	    if (!chknil && buf.compare(hexnil))
+	    if (!chknil && !is_nil(buf, size))
 		chknil = 1;
 	}
 	
 	// skip line 17, with the player and komi
-	int stm;
-	std::cin >> stm;
-	std::cin >> komi;
-	++line;
+	int stm=0;
+	in.next_int(stm);
+	in.next_float(komi);
 
-	j = komi_index(komi, stats);
-	++stats[j].mvs;
-	
-	for (int i=0; i<GOBAN_SIZE*GOBAN_SIZE+1; i++) {
-	    float polprb;
-	    
-	    // line 18 has the 50 probabilities, all of which are fractions
-	    // like k/99
-	    std::cin >> polprb;
-	    
-	    //	    assert (0 == ((int)round(1000*polprb*(VISITS-1)) % 1000));
-	}
-	++line;
+	// line 18 has the 50 probabilities, all of which are fractions
+	// like k/99
+	in.skip_tokens(GOBAN_SIZE*GOBAN_SIZE+1);
 	
 	// skip line 19, with the winner
-	std::cin >> winner;
-	++line;
-	++moves;
-	
-	// if starting position, the former maxnodes should have never
-	// been subtracted, because after the last position there is no
-	// more tree re-use
-	if (!chknil && stm == 0) {
-	    assert (winner == 1 || winner == -1);
-	    ++games;
-	    if (lastwinner == 1) {
-		++stats[j].bwg;
-		stats[j].bwm += moves;
-	    }
-	    else if (lastwinner == -1) {
-		++stats[j].wwg;
-		stats[j].wwm += moves;
-	    }
-	    moves = 0;
-	    lastwinner = winner;
-	}
-	
+	in.next_int(winner);
+
+	counter.add_position(chknil, stm, komi, winner);
     }
-    if (lastwinner == 1) {
-	++stats[j].bwg;
-	stats[j].bwm += moves;
+}
+
+void parse_chunk(ChunkReader &in, game_counter &counter) {
+    if (in.peek() == TrainingRecord::VERSION) {
+	parse_binary(in, counter);
+    } else {
+	parse_text(in, counter);
     }
-    else if (lastwinner == -1) {
-	++stats[j].wwg;
-	stats[j].wwm += moves;
+    counter.add_game();
+}
+
+int main(int argc, char* argv[]){
+    std::vector<std::string> files;
+    unsigned int threads;
+    parse_chunk_args(argc, argv, 1, files, threads);
+
+    const auto counters =
+	parse_chunks<game_counter>(files, threads, parse_chunk);
+    game_counter counter;
+    for (const auto &c : counters) {
+	counter.merge(c);
     }
+
+    auto &stats = counter.stats;
+    const auto games = counter.games;
     
     sort(stats.begin(), stats.end(), compare);
     
@@ -0,0 +1,383 @@
+/*
+  This program shuffles the positions of training chunks and writes them
+  as batches of the tensors that training/tf/chunkparser.py feeds to
+  TensorFlow, so the training only has to map them.
+
+  Usage:
+  shufflechunks [-j threads] [-b batch size] [-s shuffle size]
+		[-r sample rate] [-o output] [-x seed] chunk files...
+
+  The chunks are read on threads threads, all of them by default, and
+  may be text or --binarytraining records, gzipped or not. Only one
+  position in sample rate is kept, each one in a random symmetry. A
+  reservoir of shuffle size positions shuffles them, as
+  training/tf/shufflebuffer.py does. The output goes to the standard
+  output unless a file is given, and may be a pipe.
+
+  The output is a header, the magic "SAIB", the version, the board size
+  and the batch size as uint32, followed by the batches. A batch has the
+  uint8 planes[batch size][18 * BOARD_SQUARES], the float32
+  probabilities[batch size][BOARD_SQUARES + 1], the float32 komi[batch
+  size] and the float32 winner[batch size] of chunkparser.py, back to
+  back in the byte order of the host. A last batch that isn't full is
+  left out.
+*/
+
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ChunkReader.h"
+#include "../src/Network.h"
+#include "../src/TrainingRecord.h"
+
+#define BATCH_SIZE 256
+#define SHUFFLE_SIZE 100000
+
+// A position in the shuffle buffer, with the planes packed as in
+// TrainingRecord.
+struct packed_position {
+    std::uint8_t planes[TrainingRecord::PLANES * BOARD_SQUARES / 8];
+    std::uint16_t probabilities[BOARD_SQUARES + 1];
+    // From the side to move, as chunkparser.py has it.
+    float komi;
+    std::uint8_t to_move;
+    // 1 if the side to move won.
+    std::uint8_t winner;
+};
+
+static std::array<std::array<int, BOARD_SQUARES>, Network::NUM_SYMMETRIES>
+    symmetry_table;
+
+static bool get_bit(const std::uint8_t *bits, int i) {
+    return bits[i / 8] & (0x80 >> (i % 8));
+}
+
+static void set_bit(std::uint8_t *bits, int i, bool value) {
+    if (value)
+	bits[i / 8] |= (0x80 >> (i % 8));
+}
+
+static void apply_symmetry(packed_position &pos, int symmetry) {
+    const auto &table = symmetry_table[symmetry];
+    auto sym = packed_position(pos);
+    std::memset(sym.planes, 0, sizeof(sym.planes));
+    for (auto p = 0; p < TrainingRecord::PLANES; ++p) {
+	for (auto v = 0; v < BOARD_SQUARES; ++v) {
+	    set_bit(sym.planes, p * BOARD_SQUARES + v,
+		    get_bit(pos.planes, p * BOARD_SQUARES + table[v]));
+	}
+    }
+    for (auto v = 0; v < BOARD_SQUARES; ++v) {
+	sym.probabilities[v] = pos.probabilities[table[v]];
+    }
+    pos = sym;
+}
+
+// komi as chunkparser.py gets it, in halves of a point, and negative
+// for black to move
+static float side_komi(float komi, int to_move) {
+    const auto halves = std::trunc(2.0f * komi);
+    return (to_move == 0 ? -halves : halves) / 2.0f;
+}
+
+static bool parse_binary(ChunkReader &in, packed_position &pos) {
+    TrainingRecord record;
+    if (!in.read(&record, sizeof(record)))
+	return false;
+    std::memcpy(pos.planes, record.planes, sizeof(pos.planes));
+    std::memcpy(pos.probabilities, record.probabilities,
+		sizeof(pos.probabilities));
+    pos.komi = side_komi(record.komi, record.to_move);
+    pos.to_move = record.to_move;
+    pos.winner = record.winner;
+    return true;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+	return c - '0';
+    if (c >= 'a' && c <= 'f')
+	return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+	return c - 'A' + 10;
+    return -1;
+}
+
+// The 19 lines of a position, see Training::dump_training. Returns false
+// at the end of the file, and sets valid if the position is good.
+static bool parse_text(ChunkReader &in, packed_position &pos, bool &valid) {
+    const char *buf;
+    size_t size;
+    const auto hexchars = (BOARD_SQUARES - 1) / 4;
+    valid = true;
+    std::memset(pos.planes, 0, sizeof(pos.planes));
+    for (auto p = 0; p < TrainingRecord::PLANES; ++p) {
+	if (!in.token(buf, size))
+	    return false;
+	if (size != size_t(hexchars + 1)) {
+	    valid = false;
+	    continue;
+	}
+	for (auto c = 0; c < hexchars; ++c) {
+	    const auto nibble = hex_value(buf[c]);
+	    if (nibble < 0) {
+		valid = false;
+		break;
+	    }
+	    for (auto b = 0; b < 4; ++b) {
+		set_bit(pos.planes, p * BOARD_SQUARES + 4 * c + b,
+			nibble & (8 >> b));
+	    }
+	}
+	// the remaining bit goes by itself
+	if (buf[hexchars] != '0' && buf[hexchars] != '1')
+	    valid = false;
+	set_bit(pos.planes, p * BOARD_SQUARES + BOARD_SQUARES - 1,
+		buf[hexchars] == '1');
+    }
+
+    int stm = 0;
+    float komi = 0.0f;
+    in.next_int(stm);
+    in.next_float(komi);
+    if (stm != 0 && stm != 1)
+	valid = false;
+    pos.to_move = stm;
+    pos.komi = side_komi(komi, stm);
+
+    for (auto &prob : pos.probabilities) {
+	float value = 0.0f;
+	in.next_float(value);
+	// leela-zero v0.3 wrote some NaN
+	if (!(value >= 0.0f && value <= 1.0f))
+	    valid = false;
+	prob = std::uint16_t(std::round(value
+					* TrainingRecord::PROBABILITY_SCALE));
+    }
+
+    int winner = 0;
+    if (!in.next_int(winner))
+	return false;
+    if (winner != 1 && winner != -1)
+	valid = false;
+    pos.winner = winner == 1;
+    return true;
+}
+
+// The chunks parsed so far, for the thread that shuffles them.
+struct chunk_queue {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::vector<packed_position>> chunks;
+    size_t capacity;
+    unsigned int running;
+
+    void push(std::vector<packed_position> chunk) {
+	std::unique_lock<std::mutex> lock(mutex);
+	changed.wait(lock, [this] { return chunks.size() < capacity; });
+	chunks.emplace_back(std::move(chunk));
+	changed.notify_all();
+    }
+
+    void done() {
+	std::lock_guard<std::mutex> lock(mutex);
+	--running;
+	changed.notify_all();
+    }
+
+    // Returns false when all the chunks are done.
+    bool pop(std::vector<packed_position> &chunk) {
+	std::unique_lock<std::mutex> lock(mutex);
+	changed.wait(lock, [this] { return !chunks.empty() || !running; });
+	if (chunks.empty())
+	    return false;
+	chunk = std::move(chunks.front());
+	chunks.pop_front();
+	changed.notify_all();
+	return true;
+    }
+};
+
+struct batch_writer {
+    FILE *out;
+    size_t batch_size;
+    std::vector<std::uint8_t> planes;
+    std::vector<float> probabilities;
+    std::vector<float> komi;
+    std::vector<float> winner;
+    size_t count = 0;
+    size_t batches = 0;
+
+    batch_writer(FILE *file, size_t size)
+	: out(file), batch_size(size),
+	  planes(size * 18 * BOARD_SQUARES),
+	  probabilities(size * (BOARD_SQUARES + 1)),
+	  komi(size), winner(size) {
+	// the version of the batch format, the board size and batch size
+	const std::uint32_t header[] = {1, BOARD_SIZE,
+					std::uint32_t(batch_size)};
+	std::fwrite("SAIB", 1, 4, out);
+	std::fwrite(header, sizeof(header[0]), 3, out);
+    }
+
+    void add(const packed_position &pos) {
+	auto plane = planes.data() + count * 18 * BOARD_SQUARES;
+	for (auto i = 0; i < TrainingRecord::PLANES * BOARD_SQUARES; ++i) {
+	    plane[i] = get_bit(pos.planes, i);
+	}
+	// the side to move planes, black first
+	plane += TrainingRecord::PLANES * BOARD_SQUARES;
+	std::memset(plane, pos.to_move == 0, BOARD_SQUARES);
+	std::memset(plane + BOARD_SQUARES, pos.to_move == 1, BOARD_SQUARES);
+
+	auto probs = probabilities.data() + count * (BOARD_SQUARES + 1);
+	for (auto i = 0; i < BOARD_SQUARES + 1; ++i) {
+	    probs[i] = pos.probabilities[i]
+		/ TrainingRecord::PROBABILITY_SCALE;
+	}
+	komi[count] = pos.komi;
+	winner[count] = pos.winner ? 1.0f : -1.0f;
+
+	if (++count == batch_size) {
+	    std::fwrite(planes.data(), 1, planes.size(), out);
+	    std::fwrite(probabilities.data(), sizeof(float),
+			probabilities.size(), out);
+	    std::fwrite(komi.data(), sizeof(float), komi.size(), out);
+	    std::fwrite(winner.data(), sizeof(float), winner.size(), out);
+	    count = 0;
+	    ++batches;
+	}
+    }
+};
+
+int main(int argc, char* argv[]) {
+    auto threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t batch_size = BATCH_SIZE;
+    size_t shuffle_size = SHUFFLE_SIZE;
+    unsigned int sample = 1;
+    std::string output = "-";
+    auto seed = std::random_device{}();
+    std::vector<std::string> files;
+
+    for (auto i = 1; i < argc; ++i) {
+	const auto arg = std::string(argv[i]);
+	if (arg.size() == 2 && arg[0] == '-' && i + 1 < argc) {
+	    const auto value = argv[++i];
+	    switch (arg[1]) {
+	    case 'j': threads = std::max(1, std::atoi(value)); break;
+	    case 'b': batch_size = std::max(1, std::atoi(value)); break;
+	    case 's': shuffle_size = std::max(1, std::atoi(value)); break;
+	    case 'r': sample = std::max(1, std::atoi(value)); break;
+	    case 'o': output = value; break;
+	    case 'x': seed = std::strtoul(value, nullptr, 10); break;
+	    default:
+		std::fprintf(stderr, "Unknown option %s\n", argv[i - 1]);
+		return 1;
+	    }
+	} else {
+	    files.emplace_back(arg);
+	}
+    }
+    if (files.empty()) {
+	std::fprintf(stderr, "No chunk files given.\n");
+	return 1;
+    }
+
+    for (auto s = 0; s < Network::NUM_SYMMETRIES; ++s) {
+	for (auto v = 0; v < BOARD_SQUARES; ++v) {
+	    symmetry_table[s][v] = Network::get_nn_idx_symmetry(v, s);
+	}
+    }
+
+    FILE *out = output == "-" ? stdout : std::fopen(output.c_str(), "wb");
+    if (!out) {
+	std::fprintf(stderr, "Could not open %s\n", output.c_str());
+	return 1;
+    }
+
+    chunk_queue queue;
+    queue.capacity = 2 * threads;
+    queue.running = threads;
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> workers;
+    for (auto t = 0u; t < threads; ++t) {
+	workers.emplace_back([&, t]() {
+	    std::mt19937 rng(seed + t + 1);
+	    for (auto i = next++; i < files.size(); i = next++) {
+		ChunkReader in(gzopen(files[i].c_str(), "rb"));
+		if (!in.is_open()) {
+		    std::fprintf(stderr, "Could not open %s\n",
+				 files[i].c_str());
+		    continue;
+		}
+		const auto binary = in.peek() == TrainingRecord::VERSION;
+		std::vector<packed_position> chunk;
+		packed_position pos;
+		auto valid = true;
+		while (binary ? parse_binary(in, pos)
+			      : parse_text(in, pos, valid)) {
+		    if (!valid || rng() % sample != 0)
+			continue;
+		    apply_symmetry(pos, rng() % Network::NUM_SYMMETRIES);
+		    chunk.emplace_back(pos);
+		}
+		queue.push(std::move(chunk));
+	    }
+	    queue.done();
+	});
+    }
+
+    // putting the new position in a random place, and writing the one
+    // there, is a full random shuffle (Fisher-Yates)
+    std::mt19937 rng(seed);
+    std::vector<packed_position> buffer;
+    buffer.reserve(shuffle_size);
+    batch_writer writer(out, batch_size);
+    std::vector<packed_position> chunk;
+    size_t positions = 0;
+    while (queue.pop(chunk)) {
+	for (auto &pos : chunk) {
+	    ++positions;
+	    if (!buffer.empty()) {
+		std::swap(pos, buffer[rng() % buffer.size()]);
+	    }
+	    if (buffer.size() < shuffle_size) {
+		buffer.emplace_back(pos);
+	    } else {
+		writer.add(pos);
+	    }
+	}
+    }
+    for (auto &worker : workers) {
+	worker.join();
+    }
+    // the buffer is in random order already
+    while (!buffer.empty()) {
+	writer.add(buffer.back());
+	buffer.pop_back();
+    }
+
+    std::fflush(out);
+    const auto failed = std::ferror(out);
+    if (out != stdout)
+	std::fclose(out);
+    if (failed) {
+	std::fprintf(stderr, "Could not write %s\n", output.c_str());
+	return 1;
+    }
+    std::fprintf(stderr, "%zu positions, %zu batches of %zu.\n",
+		 positions, writer.batches, batch_size);
+    return 0;
+}
@@ -0,0 +1,150 @@
+#!/bin/python3
+
+# Converts a text weights file (plain or gzipped) to the binary format
+# read by Network::load_binary_network. The batchnorm variances are
+# replaced by 1/sqrt(var + 1e-5), the convolution biases are folded into
+# the batchnorm means and the tower filters are Winograd transformed, so
+# the engine can use the weights as they are.
+#
+# usage: binweights.py weights.txt[.gz] weights.bin
+
+import array
+import gzip
+import struct
+import sys
+
+BOARD_SIZE = 7
+
+MAGIC = b"SAIW"
+VERSION = 1
+ALIGN = 64
+
+SINGLE, DOUBLE_V, DOUBLE_Y, DOUBLE_T, DOUBLE_I = 1, 2, 3, 4, 5
+
+def read_lines(filename):
+    with open(filename, "rb") as f:
+        gzipped = f.read(2) == b"\x1f\x8b"
+    opener = gzip.open if gzipped else open
+    with opener(filename, "rt") as f:
+        version = int(f.readline())
+        if version not in (1, 2):
+            sys.exit("Weights file is the wrong version.")
+        return version, [[float(w) for w in line.split()] for line in f]
+
+def process_bn_var(weights):
+    return [1.0 / (w + 1e-5) ** 0.5 for w in weights]
+
+def fold_biases(means, biases):
+    return [m - b for m, b in zip(means, biases)]
+
+# Same layout as Network::winograd_transform_f: U[xi][nu][c][o]
+def winograd_transform_f(f, outputs, channels):
+    U = array.array("f", bytes(4 * 16 * outputs * channels))
+    stride = outputs * channels
+    for o in range(outputs):
+        for c in range(channels):
+            g = f[(o * channels + c) * 9:(o * channels + c + 1) * 9]
+            r0, r1, r2 = g[0:3], g[3:6], g[6:9]
+            rows = (r0,
+                    [0.5 * (x + y + z) for x, y, z in zip(r0, r1, r2)],
+                    [0.5 * (x - y + z) for x, y, z in zip(r0, r1, r2)],
+                    r2)
+            for xi, t in enumerate(rows):
+                cols = (t[0],
+                        0.5 * (t[0] + t[1] + t[2]),
+                        0.5 * (t[0] - t[1] + t[2]),
+                        t[2])
+                for nu, u in enumerate(cols):
+                    U[(xi * 4 + nu) * stride + c * outputs + o] = u
+    return U
+
+def convert(lines):
+    lines = iter(lines)
+    # Input convolution
+    first = next(lines)
+    biases = next(lines)
+    channels = len(biases)
+    input_planes = len(first) // 9 // channels
+    tower = [(first, biases, next(lines), next(lines))]
+    # Residual tower, until the policy head convolution
+    while True:
+        w = next(lines)
+        if len(w) != channels * 9 * channels:
+            conv_pol_w = w
+            break
+        tower.append((w, next(lines), next(lines), next(lines)))
+    residual_blocks = (len(tower) - 1) // 2
+
+    conv_pol_b, bn_pol_w1, bn_pol_w2 = next(lines), next(lines), next(lines)
+    ip_pol_w, ip_pol_b = next(lines), next(lines)
+    conv_val_w, conv_val_b = next(lines), next(lines)
+    bn_val_w1, bn_val_w2 = next(lines), next(lines)
+    ip1_val_w, ip1_val_b = next(lines), next(lines)
+    ip2_val_w, ip2_val_b = next(lines), next(lines)
+    extra = list(lines)
+
+    policy_outputs = len(conv_pol_b)
+    val_outputs = len(conv_val_b)
+    val_chans = len(ip1_val_b)
+    vbe = [[]] * 7
+    vbe_outputs = 0
+    vbe_chans = 0
+    value_head_rets = 2
+    if len(extra) == 8:
+        head_type = DOUBLE_V
+        vbe_outputs = len(extra[1])
+        vbe_chans = len(extra[5])
+        vbe = [extra[0], fold_biases(extra[2], extra[1]),
+               process_bn_var(extra[3])] + extra[4:8]
+    elif len(extra) == 4:
+        head_type = DOUBLE_Y
+        vbe_chans = len(extra[1])
+        vbe = [[], [], []] + extra[0:4]
+    elif len(extra) == 2:
+        head_type = DOUBLE_T
+        vbe = [[]] * 5 + extra[0:2]
+    elif len(extra) == 0:
+        value_head_rets = len(ip2_val_b)
+        head_type = DOUBLE_I if value_head_rets == 2 else SINGLE
+    else:
+        sys.exit("Failed to parse weight file.")
+
+    arch = [head_type, residual_blocks, channels, input_planes,
+            policy_outputs, val_outputs, vbe_outputs, val_chans, vbe_chans,
+            value_head_rets]
+
+    sections = []
+    for i, (w, b, mean, var) in enumerate(tower):
+        sections.append(winograd_transform_f(
+            w, channels, input_planes if i == 0 else channels))
+        sections.append(fold_biases(mean, b))
+        sections.append(process_bn_var(var))
+    sections += [conv_pol_w, fold_biases(bn_pol_w1, conv_pol_b),
+                 process_bn_var(bn_pol_w2), ip_pol_w, ip_pol_b]
+    sections += [conv_val_w, fold_biases(bn_val_w1, conv_val_b),
+                 process_bn_var(bn_val_w2), ip1_val_w, ip1_val_b,
+                 ip2_val_w, ip2_val_b]
+    sections += vbe
+    return arch, sections
+
+def pad(out):
+    out.write(bytes(-out.tell() % ALIGN))
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("usage: binweights.py weights.txt[.gz] weights.bin")
+    version, lines = read_lines(sys.argv[1])
+    arch, sections = convert(lines)
+    with open(sys.argv[2], "wb") as out:
+        out.write(MAGIC)
+        out.write(struct.pack("<3I", VERSION, BOARD_SIZE, int(version == 2)))
+        out.write(struct.pack("<%dI" % len(arch), *arch))
+        pad(out)
+        # Every section is a count followed by the floats, both aligned.
+        for section in sections:
+            out.write(struct.pack("<Q", len(section)))
+            pad(out)
+            out.write(struct.pack("<%df" % len(section), *section))
+            pad(out)
+
+main()
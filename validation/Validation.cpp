@@ -17,6 +17,7 @@
 */
 
 #include "Validation.h"
+#include <memory>
 #include <QFile>
 #include <QDir>
 #include <QUuid>
@@ -26,86 +27,162 @@ using VersionTuple = std::tuple<int, int, int>;
 const VersionTuple min_leelaz_version{0, 10, 0};
 
 
+bool ValidationWorker::startEngine(std::unique_ptr<Game>& engine,
+                                   const QString& weights,
+                                   const QString& opts,
+                                   const QString& bin) {
+    const Game probe(weights, opts, bin);
+    if (engine && engine->getCmdLine() == probe.getCmdLine()
+        && engine->gameReset()) {
+        return true;
+    }
+    stopEngine(engine);
+    if (m_state.load() != RUNNING) {
+        return false;
+    }
+    engine = std::make_unique<Game>(weights, opts, bin);
+    if (!engine->gameStart(min_leelaz_version)) {
+        engine.reset();
+        return false;
+    }
+    // Not before, a cancelled start exits.
+    engine->setCancel(&m_state);
+    return true;
+}
+
+void ValidationWorker::stopEngine(std::unique_ptr<Game>& engine) {
+    if (!engine) {
+        return;
+    }
+    if (m_state.load() == RUNNING) {
+        engine->gameQuit();
+    } else {
+        // It may be in the middle of a move.
+        engine->gameKill();
+    }
+    engine.reset();
+}
+
 void ValidationWorker::run() {
+    // With the same binary and options both networks are loaded into
+    // a single engine, it plays black with the first and white with the
+    // second one.
+    const auto shared = (m_firstBin == m_secondBin
+                         && m_firstOpts == m_secondOpts);
+    // A kept engine loads the networks in this order, and switches
+    // them between the colors.
+    const auto sharedWeights = m_firstNet + " -w " + m_secondNet;
+    const auto sharedFirst = m_firstNet;
+    std::unique_ptr<Game> first;
+    std::unique_ptr<Game> second;
     do {
-        Game first(m_firstNet,  m_firstOpts, m_firstBin);
-        if (!first.gameStart(min_leelaz_version)) {
-            emit resultReady(Sprt::NoResult, Game::BLACK);
-            return;
+        auto started = false;
+        if (shared && m_reuse) {
+            const auto black = (m_firstNet == sharedFirst) ? 0 : 1;
+            started = startEngine(first, sharedWeights, m_firstOpts, m_firstBin)
+                && first->setSideNetworks(black, 1 - black);
+        } else if (shared) {
+            started = startEngine(first, m_firstNet + " -w " + m_secondNet,
+                                  m_firstOpts, m_firstBin);
+        } else {
+            started = startEngine(first, m_firstNet, m_firstOpts, m_firstBin)
+                && startEngine(second, m_secondNet, m_secondOpts, m_secondBin);
         }
-        Game second(m_secondNet, m_secondOpts, m_secondBin);
-        if (!second.gameStart(min_leelaz_version)) {
-            emit resultReady(Sprt::NoResult, Game::BLACK);
-            return;
+        if (!started) {
+            if (m_state.load() == RUNNING) {
+                emit resultReady(Sprt::NoResult, Game::BLACK);
+            }
+            break;
+        }
+        if (shared) {
+            QTextStream(stdout) << "starting:" << endl <<
+                first->getCmdLine() << endl;
+        } else {
+            QTextStream(stdout) << "starting:" << endl <<
+                first->getCmdLine() << endl <<
+                "vs" << endl <<
+                second->getCmdLine() << endl;
         }
-        QTextStream(stdout) << "starting:" << endl <<
-            first.getCmdLine() << endl <<
-            "vs" << endl <<
-            second.getCmdLine() << endl;
 
         QString wmove = "play white ";
         QString bmove = "play black ";
+        bool failed = false;
         do {
-            first.move();
-            if (!first.waitForMove()) {
-                emit resultReady(Sprt::NoResult, Game::BLACK);
-                return;
+            first->move();
+            if (!first->waitForMove()) {
+                failed = true;
+                break;
             }
-            first.readMove();
-            if (first.checkGameEnd()) {
+            first->readMove();
+            if (first->checkGameEnd()) {
                 break;
             }
-            second.setMove(bmove + first.getMove());
-            second.move();
-            if (!second.waitForMove()) {
-                emit resultReady(Sprt::NoResult, Game::BLACK);
-                return;
+            if (shared) {
+                // The same engine plays the other color next.
+                continue;
             }
-            second.readMove();
-            first.setMove(wmove + second.getMove());
-            second.nextMove();
-        } while (first.nextMove() && m_state.load() == RUNNING);
+            second->setMove(bmove + first->getMove());
+            second->move();
+            if (!second->waitForMove()) {
+                failed = true;
+                break;
+            }
+            second->readMove();
+            first->setMove(wmove + second->getMove());
+            second->nextMove();
+        } while (first->nextMove() && m_state.load() == RUNNING);
 
-        if (m_state.load() == RUNNING) {
-            QTextStream(stdout) << "Game has ended." << endl;
-            int result = 0;
-            if (first.getScore()) {
-                result = first.getWinner();
-                if (!m_keepPath.isEmpty()) {
-                    first.writeSgf();
-                    QString prefix = m_keepPath + '/';
-                    if (m_expected == Game::BLACK) {
-                        prefix.append("black_");
-                    } else {
-                        prefix.append("white_");
-                    }
-                    QFile(first.getFile() + ".sgf").rename(prefix + first.getFile() + ".sgf");
+        if (m_state.load() != RUNNING) {
+            // The decision is made, the game doesn't count.
+            break;
+        }
+        if (failed) {
+            emit resultReady(Sprt::NoResult, Game::BLACK);
+            break;
+        }
+        QTextStream(stdout) << "Game has ended." << endl;
+        int result = 0;
+        if (first->getScore()) {
+            result = first->getWinner();
+            if (!m_keepPath.isEmpty()) {
+                first->writeSgf();
+                QString prefix = m_keepPath + '/';
+                if (m_expected == Game::BLACK) {
+                    prefix.append("black_");
+                } else {
+                    prefix.append("white_");
                 }
+                QFile(first->getFile() + ".sgf").rename(prefix + first->getFile() + ".sgf");
             }
+        }
+        if (!m_reuse) {
             QTextStream(stdout) << "Stopping engine." << endl;
-            first.gameQuit();
-            second.gameQuit();
+            stopEngine(first);
+            stopEngine(second);
+        }
 
-            // Game is finished, send the result
-            if (result == m_expected) {
-                emit resultReady(Sprt::Win, m_expected);
-            } else {
-                emit resultReady(Sprt::Loss, m_expected);
-            }
-            // Change color and play again
-            m_firstNet.swap(m_secondNet);
-            m_firstBin.swap(m_secondBin);
-            m_firstOpts.swap(m_secondOpts);
-            if (m_expected == Game::BLACK) {
-                m_expected = Game::WHITE;
-            } else {
-                m_expected = Game::BLACK;
-            }
+        // Game is finished, send the result
+        if (result == m_expected) {
+            emit resultReady(Sprt::Win, m_expected);
         } else {
-            first.gameQuit();
-            second.gameQuit();
+            emit resultReady(Sprt::Loss, m_expected);
+        }
+        // Change color and play again
+        m_firstNet.swap(m_secondNet);
+        m_firstBin.swap(m_secondBin);
+        m_firstOpts.swap(m_secondOpts);
+        // The engines change colors with their networks.
+        if (!shared) {
+            first.swap(second);
+        }
+        if (m_expected == Game::BLACK) {
+            m_expected = Game::WHITE;
+        } else {
+            m_expected = Game::BLACK;
         }
     } while (m_state.load() != FINISHING);
+    stopEngine(first);
+    stopEngine(second);
 }
 
 void ValidationWorker::init(const QString& gpuIndex,
@@ -116,7 +193,8 @@ void ValidationWorker::init(const QString& gpuIndex,
                             const QString& firstOpts,
                             const QString& secondOpts,
                             const QString& keep,
-                            int expected) {
+                            int expected,
+                            bool reuse) {
     m_firstOpts = firstOpts;
     m_secondOpts = secondOpts;
     if (!gpuIndex.isEmpty()) {
@@ -129,6 +207,7 @@ void ValidationWorker::init(const QString& gpuIndex,
     m_secondBin = secondBin;
     m_expected = expected;
     m_keepPath = keep;
+    m_reuse = reuse;
     m_state.store(RUNNING);
 }
 
@@ -144,7 +223,8 @@ Validation::Validation(const int gpus,
                        const QString& firstOpts,
                        const QString& secondOpts,
                        const float& h0,
-                       const float& h1) :
+                       const float& h1,
+                       const bool reuse) :
 
     m_mainMutex(mutex),
     m_syncMutex(),
@@ -158,7 +238,9 @@ Validation::Validation(const int gpus,
     m_secondBin(secondBin),
     m_firstOpts(firstOpts),
     m_secondOpts(secondOpts),
-    m_keepPath(keep) {
+    m_keepPath(keep),
+    m_reuse(reuse),
+    m_decided(false) {
     m_statistic.initialize(h0, h1, 0.05, 0.05);
     m_statistic.addGameResult(Sprt::Draw);
 }
@@ -198,7 +280,7 @@ void Validation::startGames() {
                 myGpu = m_gpusList.at(gpu);
             }
 
-            m_gamesThreads[thread_index].init(myGpu, n1, n2, b1, b2, o1, o2, m_keepPath, expected);
+            m_gamesThreads[thread_index].init(myGpu, n1, n2, b1, b2, o1, o2, m_keepPath, expected, m_reuse);
             m_gamesThreads[thread_index].start();
         }
     }
@@ -257,6 +339,11 @@ void Validation::getResult(Sprt::GameResult result, int net_one_color) {
         return;
     }
     m_syncMutex.lock();
+    if (m_decided) {
+        // Finished while the workers were stopping.
+        m_syncMutex.unlock();
+        return;
+    }
     m_statistic.addGameResult(result);
     m_results.addGameResult(result, net_one_color);
 
@@ -265,6 +352,9 @@ void Validation::getResult(Sprt::GameResult result, int net_one_color) {
     QTextStream(stdout) << std::get<0>(wdl) << " wins, "
                         << std::get<2>(wdl) << " losses" << endl;
     if (status.result != Sprt::Continue) {
+        // The games still running can't change the decision, they
+        // stop at once.
+        m_decided = true;
         quitThreads();
         QTextStream(stdout)
             << "The first net is "
@@ -24,6 +24,7 @@
 #include <QVector>
 #include <QAtomicInt>
 #include <QMutex>
+#include <memory>
 #include "SPRT.h"
 #include "../autogtp/Game.h"
 #include "Results.h"
@@ -46,8 +47,10 @@ public:
               const QString& firstOpts,
               const QString& secondOpts,
               const QString& keep,
-              int expected);
+              int expected,
+              bool reuse);
     void run() override;
+    // Also cancels the game in progress.
     void doFinish() { m_state.store(FINISHING); }
 
 signals:
@@ -61,7 +64,16 @@ private:
     QString m_secondBin;
     QString m_firstOpts;
     QString m_secondOpts;
+    // Keep the engines between games, they only get a clear_board.
+    bool m_reuse;
     QAtomicInt m_state;
+    // Reuses the engine if it runs these weights and options, the old
+    // engine stops otherwise. False if it can't start.
+    bool startEngine(std::unique_ptr<Game>& engine,
+                     const QString& weights,
+                     const QString& opts,
+                     const QString& bin);
+    void stopEngine(std::unique_ptr<Game>& engine);
 };
 
 class Validation : public QObject {
@@ -79,7 +91,8 @@ public:
                const QString& firstOpts,
                const QString& secondOpts,
                const float& h0,
-               const float& h1);
+               const float& h1,
+               const bool reuse);
     ~Validation() = default;
     void startGames();
     void wait();
@@ -105,6 +118,8 @@ private:
     QString m_firstOpts;
     QString m_secondOpts;
     QString m_keepPath;
+    bool m_reuse;
+    bool m_decided;
     void quitThreads();
     void saveSprt();
     void printSprtStatus(const Sprt::Status& status);
@@ -70,6 +70,9 @@ int main(int argc, char *argv[]) {
         {"k", "keepSgf" },
             "Save SGF files after each self-play game.",
             "output directory");
+    QCommandLineOption reuseOption(
+        {"r", "reuse"},
+            "Keep the engines running between games.");
 
     parser.addOption(gamesNumOption);
     parser.addOption(gpusOption);
@@ -78,6 +81,7 @@ int main(int argc, char *argv[]) {
     parser.addOption(optionsOption);
     parser.addOption(sprtOption);
     parser.addOption(keepSgfOption);
+    parser.addOption(reuseOption);
 
     // Process the actual command line arguments given by the user
     parser.process(app);
@@ -125,7 +129,7 @@ int main(int argc, char *argv[]) {
                         parser.value(keepSgfOption), &mutex,
                         binList.at(0), binList.at(1),
                         optsList.at(0), optsList.at(1),
-                        h0, h1);
+                        h0, h1, parser.isSet(reuseOption));
     QObject::connect(&app, &QCoreApplication::aboutToQuit, validate, &Validation::storeSprt);
     validate->loadSprt();
     validate->startGames();